@@ -49,6 +49,18 @@ __BEGIN_DECLS
 #define LAUNCHD_ASYNC_MSG_KEY "_AsyncMessage"
 #define LAUNCH_KEY_BATCHCONTROL "BatchControl"
 #define LAUNCH_KEY_BATCHQUERY "BatchQuery"
+#define LAUNCH_KEY_BULKJOBCONTROL "BulkJobControl"
+
+#define LAUNCH_BULKJOBCONTROL_ACTION "Action"
+#define LAUNCH_BULKJOBCONTROL_LABELS "Labels"
+#define LAUNCH_BULKJOBCONTROL_PATTERN "Pattern"
+#define LAUNCH_BULKJOBCONTROL_ORDER "Order"
+#define LAUNCH_BULKJOBCONTROL_LIMIT "Limit"
+#define LAUNCH_BULKJOBCONTROL_GRACEPERIOD "GracePeriod"
+#define LAUNCH_BULKJOBCONTROL_SIGNAL "Signal"
+
+#define LAUNCH_BULKJOBCONTROL_ORDER_LABEL "Label"
+#define LAUNCH_BULKJOBCONTROL_ORDER_REVERSE "ReverseLabel"
 
 #define LAUNCH_JOBKEY_TRANSACTIONCOUNT "TransactionCount"
 #define LAUNCH_JOBKEY_QUARANTINEDATA "QuarantineData"
@@ -102,6 +114,35 @@ __BEGIN_DECLS
 #define LAUNCH_JOBKEY_MACH_HOSTSPECIALPORT "HostSpecialPort"
 #define LAUNCH_JOBKEY_MACH_ENTERKERNELDEBUGGERONCLOSE "EnterKernelDebuggerOnClose"
 #define LAUNCH_JOBKEY_LOWPRIORITYBACKGROUNDIO "LowPriorityBackgroundIO"
+#define LAUNCH_JOBKEY_HISTORY "History"
+
+#define LAUNCH_JOBHISTORY_TIMESTAMP "Timestamp"
+#define LAUNCH_JOBHISTORY_EVENT "Event"
+#define LAUNCH_JOBHISTORY_PID "PID"
+#define LAUNCH_JOBHISTORY_STATUS "Status"
+#define LAUNCH_JOBHISTORY_REASON "Reason"
+
+#define LAUNCH_JOBKEY_DESCENDANTS "Descendants"
+
+#define LAUNCH_JOBDESCENDANT_PID "PID"
+#define LAUNCH_JOBDESCENDANT_PPID "PPID"
+#define LAUNCH_JOBDESCENDANT_NAME "Name"
+#define LAUNCH_JOBDESCENDANT_DIDEXEC "DidExec"
+
+#define LAUNCH_JOBKEY_STOPSIGNAL "StopSignal"
+
+#define LAUNCH_JOBKEY_OUTPUTCAPTURE "OutputCapture"
+
+#define LAUNCH_JOBOUTPUTCAPTURE_MAXFILESIZE "MaxFileSize"
+#define LAUNCH_JOBOUTPUTCAPTURE_MAXFILEAGE "MaxFileAge"
+#define LAUNCH_JOBOUTPUTCAPTURE_MAXFILES "MaxFiles"
+#define LAUNCH_JOBOUTPUTCAPTURE_MAXBYTESPERSECOND "MaxBytesPerSecond"
+#define LAUNCH_JOBOUTPUTCAPTURE_DROPPEDBYTES "DroppedBytes"
+
+/* Microseconds from the current instance's spawn until it had checked in all
+ * of its MachServices and Sockets.
+ */
+#define LAUNCH_JOBKEY_READYLATENCY "ReadyLatency"
 
 #define LAUNCH_ENV_INSTANCEID "LaunchInstanceID"
 
@@ -151,6 +192,17 @@ pid_t
 _spawn_via_launchd(const char *label, const char * const *argv,
 	const struct spawn_via_launchd_attr *spawn_attrs, int struct_version);
 
+/* A cheaper spawn_via_launchd() for launches that need nothing beyond
+ * arguments, an environment and spawn flags. On success, *handle names the
+ * definition that was used. Passing that handle back reuses its label,
+ * environment and flags, and argv may then be NULL to reuse its arguments as
+ * well. Pass a zero handle for a first launch.
+ */
+pid_t
+spawn_via_launchd_compact(const char *label, const char * const *argv,
+	const char * const *env, uint64_t flags, uint64_t *handle,
+	mach_port_t *observer_port);
+
 int
 launch_wait(mach_port_t port);
 
@@ -164,6 +216,15 @@ mpm_uncork_fork(mach_port_t ajob);
 launch_data_t
 launch_socket_service_check_in(void);
 
+/* Fetches the descriptors of a single entry in the caller's Sockets dictionary
+ * without packing or copying the rest of the check-in reply. On success, fds
+ * is set to a malloc(3)ed array of cnt descriptors that the caller must free.
+ * Returns ENOENT if the job has no such entry and ESRCH if the caller is not
+ * managed by launchd.
+ */
+int
+launch_socket_service_activate(const char *name, int **fds, size_t *cnt);
+
 __END_DECLS
 
 #pragma GCC visibility pop
@@ -25,6 +25,8 @@
 #include "bootstrap_priv.h"
 #include "vproc.h"
 #include "vproc_priv.h"
+#include "vproc_internal.h"
+#include "launch_internal.h"
 
 #include <mach/mach.h>
 #include <mach/vm_map.h>
@@ -280,6 +282,41 @@ bootstrap_info(mach_port_t bp,
 	return vproc_mig_info(bp, service_names, service_namesCnt, service_jobs, service_jobsCnt, service_active, service_activeCnt, flags);
 }
 
+kern_return_t
+bootstrap_info_page(mach_port_t bp, const name_t prefix, const name_t after, const name_t after_job, uint32_t limit,
+			   name_array_t *service_names, mach_msg_type_number_t *service_namesCnt,
+			   name_array_t *service_jobs, mach_msg_type_number_t *service_jobsCnt,
+			   bootstrap_status_array_t *service_active, mach_msg_type_number_t *service_activeCnt,
+			   boolean_t *more, uint64_t flags)
+{
+	return vproc_mig_info_page(bp, (char *)prefix, (char *)after, (char *)after_job, limit, service_names, service_namesCnt, service_jobs, service_jobsCnt, service_active, service_activeCnt, more, flags);
+}
+
+kern_return_t
+bootstrap_lookup_tree(mach_port_t bp, launch_data_t *tree,
+	mach_port_array_t *peruser_ports, mach_msg_type_number_t *peruser_portsCnt)
+{
+	mach_msg_type_number_t outdata_cnt = 0;
+	vm_offset_t outdata = 0;
+	size_t data_offset = 0;
+	launch_data_t out_obj;
+	kern_return_t kr;
+
+	if ((kr = vproc_mig_lookup_tree(bp, &outdata, &outdata_cnt, peruser_ports, peruser_portsCnt, 0))) {
+		return kr;
+	}
+
+	if ((out_obj = launch_data_unpack((void *)outdata, outdata_cnt, NULL, 0, &data_offset, NULL))) {
+		*tree = launch_data_copy(out_obj);
+	} else {
+		kr = BOOTSTRAP_NO_MEMORY;
+	}
+
+	mig_deallocate(outdata, outdata_cnt);
+
+	return kr;
+}
+
 const char *
 bootstrap_strerror(kern_return_t r)
 {
@@ -782,6 +782,40 @@ launch_data_pack(launch_data_t d, void *where, size_t len, int *fd_where, size_t
 	return node_data_len;
 }
 
+/* Returns the number of bytes launch_data_pack() needs for d, and adds the
+ * number of descriptor slots it will use to *fd_cnt if fd_cnt is not NULL.
+ */
+size_t
+launch_data_packed_size(launch_data_t d, size_t *fd_cnt)
+{
+	size_t i, sz = sizeof(struct _launch_data);
+
+	switch (d->type) {
+	case LAUNCH_DATA_FD:
+		if (fd_cnt && d->fd != -1) {
+			(*fd_cnt)++;
+		}
+		break;
+	case LAUNCH_DATA_STRING:
+		sz += ROUND_TO_64BIT_WORD_SIZE(d->string_len + 1);
+		break;
+	case LAUNCH_DATA_OPAQUE:
+		sz += ROUND_TO_64BIT_WORD_SIZE(d->opaque_size);
+		break;
+	case LAUNCH_DATA_DICTIONARY:
+	case LAUNCH_DATA_ARRAY:
+		sz += d->_array_cnt * sizeof(uint64_t);
+		for (i = 0; i < d->_array_cnt; i++) {
+			sz += launch_data_packed_size(d->_array[i], fd_cnt);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return sz;
+}
+
 launch_data_t
 launch_data_unpack(void *data, size_t data_size, int *fds, size_t fd_cnt, size_t *data_offset, size_t *fdoffset)
 {
@@ -976,6 +1010,55 @@ launchd_msg_send(launch_t lh, launch_data_t d)
 	return 0;
 }
 
+/* Sends a message that was already run through launch_data_pack(). The caller
+ * keeps ownership of the data and descriptors.
+ */
+int
+launchd_msg_send_packed(launch_t lh, const void *data, size_t len, const int *fds, size_t fd_cnt)
+{
+	struct launch_msg_header lmh;
+	uint64_t msglen = len + sizeof(struct launch_msg_header);
+
+	if (launchd_getfd(lh) == -1) {
+		errno = EPERM;
+		return -1;
+	}
+
+	assert(lh->sendlen == 0);
+
+	free(lh->sendbuf);
+	lh->sendbuf = malloc(msglen);
+	if (!lh->sendbuf) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// Most packed messages carry no descriptors, and malloc(0) may return NULL.
+	free(lh->sendfds);
+	lh->sendfds = NULL;
+	if (fd_cnt && !(lh->sendfds = malloc(fd_cnt * sizeof(int)))) {
+		free(lh->sendbuf);
+		lh->sendbuf = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	lmh.len = host2wire(msglen);
+	lmh.magic = host2wire(LAUNCH_MSG_HEADER_MAGIC);
+
+	memcpy(lh->sendbuf, &lmh, sizeof(lmh));
+	memcpy(lh->sendbuf + sizeof(lmh), data, len);
+	if (fd_cnt) {
+		memcpy(lh->sendfds, fds, fd_cnt * sizeof(int));
+	}
+
+	lh->sendlen = msglen;
+	lh->sendfdcnt = fd_cnt;
+
+	// The header is already in the buffer, so just drain it like a partial send.
+	return launchd_msg_send(lh, NULL);
+}
+
 int
 launch_get_fd(void)
 {
@@ -371,26 +371,81 @@ vproc_standby_end(vproc_t vp __unused, vproc_standby_t vpt __unused)
 }
 
 #pragma mark Miscellaneous SPI
+/* Converts the dictionary-per-service reply of the original take_subset
+ * routine into the records that take_subset2 sends.
+ */
+static kern_return_t
+_vproc_subset_records_from_legacy(vm_offset_t outdata, mach_msg_type_number_t outdata_cnt,
+	struct vproc_subset_record **records, mach_msg_type_number_t *recordCnt)
+{
+	struct vproc_subset_record *r = NULL;
+	size_t data_offset = 0, i, cnt;
+	launch_data_t out_obj, tmp;
+
+	if (!(out_obj = launch_data_unpack((void *)outdata, outdata_cnt, NULL, 0, &data_offset, NULL))) {
+		return 1;
+	}
+
+	cnt = launch_data_array_get_count(out_obj);
+	if (cnt) {
+		mig_allocate((vm_address_t *)&r, cnt * sizeof(r[0]));
+		if (!r) {
+			return BOOTSTRAP_NO_MEMORY;
+		}
+	}
+
+	for (i = 0; i < cnt; i++) {
+		launch_data_t obj_at_idx = launch_data_array_get_index(out_obj, i);
+
+		if ((tmp = launch_data_dict_lookup(obj_at_idx, TAKE_SUBSET_PID))) {
+			r[i].pid = (pid_t)launch_data_get_integer(tmp);
+		}
+		if ((tmp = launch_data_dict_lookup(obj_at_idx, TAKE_SUBSET_PERPID)) && launch_data_get_bool(tmp)) {
+			r[i].flags |= VPROC_SUBSET_PERPID;
+		}
+		if ((tmp = launch_data_dict_lookup(obj_at_idx, TAKE_SUBSET_NAME))) {
+			(void)strlcpy(r[i].name, launch_data_get_string(tmp), sizeof(r[i].name));
+		}
+	}
+
+	*records = r;
+	*recordCnt = (mach_msg_type_number_t)cnt;
+
+	return 0;
+}
+
 kern_return_t
 _vproc_grab_subset(mach_port_t bp, mach_port_t *reqport, mach_port_t *rcvright,
-	launch_data_t *outval, mach_port_array_t *ports, 
-	mach_msg_type_number_t *portCnt)
+	struct vproc_subset_record **records, mach_msg_type_number_t *recordCnt,
+	mach_port_array_t *ports, mach_msg_type_number_t *portCnt)
 {
-	mach_msg_type_number_t outdata_cnt;
+	mach_msg_type_number_t outdata_cnt = 0;
 	vm_offset_t outdata = 0;
-	size_t data_offset = 0;
-	launch_data_t out_obj;
 	kern_return_t kr;
 
+	*records = NULL;
+	*recordCnt = 0;
+
+	kr = vproc_mig_take_subset2(bp, reqport, rcvright, &outdata, &outdata_cnt, ports, portCnt);
+	if (kr == 0) {
+		if (outdata_cnt % sizeof(struct vproc_subset_record) != 0) {
+			mig_deallocate(outdata, outdata_cnt);
+			return 1;
+		}
+
+		*records = (struct vproc_subset_record *)outdata;
+		*recordCnt = outdata_cnt / sizeof(struct vproc_subset_record);
+		return 0;
+	} else if (kr != MIG_BAD_ID) {
+		return kr;
+	}
+
+	// An older launchd only knows how to hand over a packed array.
 	if ((kr = vproc_mig_take_subset(bp, reqport, rcvright, &outdata, &outdata_cnt, ports, portCnt))) {
 		goto out;
 	}
 
-	if ((out_obj = launch_data_unpack((void *)outdata, outdata_cnt, NULL, 0, &data_offset, NULL))) {
-		*outval = launch_data_copy(out_obj);
-	} else {
-		kr = 1;
-	}
+	kr = _vproc_subset_records_from_legacy(outdata, outdata_cnt, records, recordCnt);
 
 out:
 	if (outdata) {
@@ -400,6 +455,60 @@ out:
 	return kr;
 }
 
+kern_return_t
+_vproc_list_jobs(mach_port_t bp, const char *prefix, uint64_t flags,
+	struct vproc_list_record **records, mach_msg_type_number_t *recordCnt)
+{
+	mach_msg_type_number_t outdata_cnt = 0;
+	vm_offset_t outdata = 0;
+	name_t prefix_buf = "";
+	kern_return_t kr;
+
+	*records = NULL;
+	*recordCnt = 0;
+
+	if (prefix) {
+		(void)strlcpy(prefix_buf, prefix, sizeof(prefix_buf));
+	}
+
+	if ((kr = vproc_mig_list_jobs(bp, prefix_buf, flags, &outdata, &outdata_cnt))) {
+		return kr;
+	}
+
+	if (outdata_cnt % sizeof(struct vproc_list_record) != 0) {
+		mig_deallocate(outdata, outdata_cnt);
+		return 1;
+	}
+
+	*records = (struct vproc_list_record *)outdata;
+	*recordCnt = outdata_cnt / sizeof(struct vproc_list_record);
+
+	return 0;
+}
+
+kern_return_t
+_vproc_set_jetsam_batch(mach_port_t bp, struct vproc_jetsam_update *updates,
+	mach_msg_type_number_t cnt, int32_t *results)
+{
+	mach_msg_type_number_t outdata_cnt = 0;
+	vm_offset_t outdata = 0;
+	kern_return_t kr;
+
+	if ((kr = vproc_mig_set_jetsam_batch(bp, (vm_offset_t)updates, cnt * sizeof(updates[0]), &outdata, &outdata_cnt))) {
+		return kr;
+	}
+
+	if (outdata_cnt != cnt * sizeof(results[0])) {
+		kr = 1;
+	} else {
+		memcpy(results, (void *)outdata, outdata_cnt);
+	}
+
+	mig_deallocate(outdata, outdata_cnt);
+
+	return kr;
+}
+
 vproc_err_t
 _vprocmgr_move_subset_to_user(uid_t target_user, const char *session_type, uint64_t flags)
 {
@@ -696,6 +805,132 @@ out:
 	return -1;
 }
 
+static struct vproc_spawn_desc *
+_vproc_spawn_desc_new(const char *label, const char *const *argv, const char *const *env, uint64_t flags, size_t *len)
+{
+	struct vproc_spawn_desc *d;
+	const char *const *tmpp;
+	size_t sz = sizeof(*d), l;
+	uint32_t argc = 0, envc = 0;
+	char *ptr;
+
+	if (label && strlen(label) >= sizeof(d->label)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (tmpp = argv; tmpp && *tmpp; tmpp++, argc++) {
+		sz += strlen(*tmpp) + 1;
+	}
+	for (tmpp = env; tmpp && *tmpp; tmpp++, envc++) {
+		const char *eq = strchr(*tmpp, '=');
+		if (!eq || (size_t)(eq - *tmpp) > VPROC_SPAWN_ENV_KEY_MAX) {
+			errno = EINVAL;
+			return NULL;
+		}
+		sz += strlen(*tmpp) + 1;
+	}
+	if (sz > VPROC_SPAWN_DESC_MAX) {
+		errno = E2BIG;
+		return NULL;
+	}
+
+	if (!(d = calloc(1, sz))) {
+		return NULL;
+	}
+
+	d->version = VPROC_SPAWN_DESC_VERSION;
+	d->flags = (uint32_t)flags;
+	d->argc = argc;
+	d->envc = envc;
+	if (label) {
+		strlcpy(d->label, label, sizeof(d->label));
+	}
+
+	ptr = d->strings;
+	for (tmpp = argv; tmpp && *tmpp; tmpp++) {
+		l = strlen(*tmpp) + 1;
+		memcpy(ptr, *tmpp, l);
+		ptr += l;
+	}
+	for (tmpp = env; tmpp && *tmpp; tmpp++) {
+		l = strlen(*tmpp) + 1;
+		memcpy(ptr, *tmpp, l);
+		ptr += l;
+	}
+
+	*len = sz;
+	return d;
+}
+
+pid_t
+spawn_via_launchd_compact(const char *label, const char *const *argv, const char *const *env, uint64_t flags, uint64_t *handle, mach_port_t *observer_port)
+{
+	struct vproc_spawn_desc *d = NULL;
+	mach_port_t obsvr_port = MACH_PORT_NULL;
+	uint64_t h = *handle;
+	kern_return_t kr;
+	size_t len = 0;
+	pid_t p = -1;
+
+	// With a handle, only send arguments, and only if there are new ones.
+	if ((!h || argv) && !(d = _vproc_spawn_desc_new(h ? NULL : label, argv, h ? NULL : env, flags, &len))) {
+		return -1;
+	}
+
+	kr = vproc_mig_spawn3(bootstrap_port, (vm_offset_t)d, (mach_msg_type_number_t)len, _audit_session_self(), &h, &p, &obsvr_port);
+	if (kr == VPROC_ERR_TRY_PER_USER) {
+		mach_port_t puc;
+
+		if (vproc_mig_lookup_per_user_context(bootstrap_port, 0, &puc) == 0) {
+			kr = vproc_mig_spawn3(puc, (vm_offset_t)d, (mach_msg_type_number_t)len, _audit_session_self(), &h, &p, &obsvr_port);
+			mach_port_deallocate(mach_task_self(), puc);
+		}
+	}
+
+	free(d);
+
+	if (kr == BOOTSTRAP_UNKNOWN_SERVICE && *handle && label && argv) {
+		// launchd has forgotten the handle. Send the whole definition again.
+		*handle = 0;
+		return spawn_via_launchd_compact(label, argv, env, flags, handle, observer_port);
+	} else if (kr == MIG_BAD_ID && !*handle) {
+		// An older launchd. Do it the long way.
+		struct spawn_via_launchd_attr attrs = {
+			.spawn_flags = flags,
+			.spawn_env = env,
+			.spawn_observer_port = observer_port,
+		};
+
+		return _spawn_via_launchd(label, argv, &attrs, 3);
+	}
+
+	switch (kr) {
+	case BOOTSTRAP_SUCCESS:
+		*handle = h;
+		if (observer_port) {
+			*observer_port = obsvr_port;
+		} else {
+			mach_port_mod_refs(mach_task_self(), obsvr_port, MACH_PORT_RIGHT_RECEIVE, -1);
+		}
+		return p;
+	case BOOTSTRAP_NOT_PRIVILEGED:
+		errno = EPERM; break;
+	case BOOTSTRAP_NO_MEMORY:
+		errno = ENOMEM; break;
+	case BOOTSTRAP_NAME_IN_USE:
+		errno = EEXIST; break;
+	case BOOTSTRAP_UNKNOWN_SERVICE:
+		errno = ESRCH; break;
+	case 1:
+		errno = EIO; break;
+	default:
+		errno = EINVAL; break;
+	}
+
+	return -1;
+}
+
 kern_return_t
 mpm_wait(mach_port_t ajob __attribute__((unused)), int *wstatus)
 {
@@ -748,24 +983,13 @@ _vprocmgr_log_forward(mach_port_t mp, void *data, size_t len)
 	return _vprocmgr_log_forward;
 }
 
-vproc_err_t
-_vprocmgr_log_drain(vproc_t vp __attribute__((unused)), pthread_mutex_t *mutex, _vprocmgr_log_drain_callback_t func)
+static void
+_vprocmgr_log_deliver(vm_offset_t outdata, mach_msg_type_number_t outdata_cnt, pthread_mutex_t *mutex, _vprocmgr_log_drain_callback_t func)
 {
-	mach_msg_type_number_t outdata_cnt, tmp_cnt;
-	vm_offset_t outdata = 0;
+	mach_msg_type_number_t tmp_cnt = outdata_cnt;
 	struct timeval tv;
 	struct logmsg_s *lm;
 
-	if (!func) {
-		return _vprocmgr_log_drain;
-	}
-
-	if (vproc_mig_log_drain(bootstrap_port, &outdata, &outdata_cnt) != 0) {
-		return _vprocmgr_log_drain;
-	}
-
-	tmp_cnt = outdata_cnt;
-
 	if (mutex) {
 		pthread_mutex_lock(mutex);
 	}
@@ -788,6 +1012,23 @@ _vprocmgr_log_drain(vproc_t vp __attribute__((unused)), pthread_mutex_t *mutex,
 	if (mutex) {
 		pthread_mutex_unlock(mutex);
 	}
+}
+
+vproc_err_t
+_vprocmgr_log_drain(vproc_t vp __attribute__((unused)), pthread_mutex_t *mutex, _vprocmgr_log_drain_callback_t func)
+{
+	mach_msg_type_number_t outdata_cnt;
+	vm_offset_t outdata = 0;
+
+	if (!func) {
+		return _vprocmgr_log_drain;
+	}
+
+	if (vproc_mig_log_drain(bootstrap_port, &outdata, &outdata_cnt) != 0) {
+		return _vprocmgr_log_drain;
+	}
+
+	_vprocmgr_log_deliver(outdata, outdata_cnt, mutex, func);
 
 	if (outdata) {
 		mig_deallocate(outdata, outdata_cnt);
@@ -796,6 +1037,73 @@ _vprocmgr_log_drain(vproc_t vp __attribute__((unused)), pthread_mutex_t *mutex,
 	return NULL;
 }
 
+vproc_err_t
+_vprocmgr_log_subscribe(int max_pri, pid_t pid, const char *label_prefix, const char *session, mach_port_t *token, uint64_t *handle)
+{
+	name_t prefix2, session2;
+	mach_port_t tok;
+
+	if (mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &tok) != 0) {
+		return _vprocmgr_log_subscribe;
+	}
+	if (mach_port_insert_right(mach_task_self(), tok, tok, MACH_MSG_TYPE_MAKE_SEND) != 0) {
+		(void)mach_port_mod_refs(mach_task_self(), tok, MACH_PORT_RIGHT_RECEIVE, -1);
+		return _vprocmgr_log_subscribe;
+	}
+
+	(void)strlcpy(prefix2, label_prefix ? label_prefix : "", sizeof(prefix2));
+	(void)strlcpy(session2, session ? session : "", sizeof(session2));
+
+	kern_return_t kr = vproc_mig_log_subscribe(bootstrap_port, tok, max_pri, pid, prefix2, session2, handle);
+	(void)mach_port_deallocate(mach_task_self(), tok);
+	if (kr != 0) {
+		(void)mach_port_mod_refs(mach_task_self(), tok, MACH_PORT_RIGHT_RECEIVE, -1);
+		return _vprocmgr_log_subscribe;
+	}
+
+	*token = tok;
+
+	return NULL;
+}
+
+vproc_err_t
+_vprocmgr_log_read(uint64_t handle, pthread_mutex_t *mutex, _vprocmgr_log_drain_callback_t func, uint64_t *dropped)
+{
+	mach_msg_type_number_t outdata_cnt = 0;
+	vm_offset_t outdata = 0;
+	uint64_t dropped2 = 0;
+
+	if (!func) {
+		return _vprocmgr_log_read;
+	}
+
+	if (vproc_mig_log_read(bootstrap_port, handle, &outdata, &outdata_cnt, &dropped2) != 0) {
+		return _vprocmgr_log_read;
+	}
+
+	if (dropped) {
+		*dropped = dropped2;
+	}
+
+	_vprocmgr_log_deliver(outdata, outdata_cnt, mutex, func);
+
+	if (outdata) {
+		mig_deallocate(outdata, outdata_cnt);
+	}
+
+	return NULL;
+}
+
+vproc_err_t
+_vprocmgr_log_unsubscribe(mach_port_t token, uint64_t handle)
+{
+	kern_return_t kr = vproc_mig_log_unsubscribe(bootstrap_port, handle);
+
+	(void)mach_port_mod_refs(mach_task_self(), token, MACH_PORT_RIGHT_RECEIVE, -1);
+
+	return kr == 0 ? NULL : _vprocmgr_log_unsubscribe;
+}
+
 vproc_err_t
 vproc_swap_integer(vproc_t vp, vproc_gsk_t key, int64_t *inval, int64_t *outval)
 {
@@ -927,6 +1235,26 @@ _vproc_kickstart_by_label(const char *label, pid_t *out_pid,
 	return (vproc_err_t)_vproc_kickstart_by_label;
 }
 
+vproc_err_t
+_vproc_kickstart_by_label_wait(const char *label, uint32_t timeout, pid_t *out_pid, vproc_flags_t flags)
+{
+	kern_return_t kr = vproc_mig_kickstart2(bootstrap_port, (char *)label, timeout, out_pid, flags);
+	if (kr == MIG_BAD_ID) {
+		// Older launchd. Fall back to a kickstart that doesn't wait.
+		kr = vproc_mig_kickstart(bootstrap_port, (char *)label, out_pid, flags);
+	}
+
+	if (kr == KERN_SUCCESS) {
+		return NULL;
+	}
+
+	if (kr == ETIMEDOUT || kr == ESRCH) {
+		errno = kr;
+	}
+
+	return (vproc_err_t)_vproc_kickstart_by_label_wait;
+}
+
 vproc_err_t
 _vproc_set_global_on_demand(bool state)
 {
@@ -1032,20 +1360,25 @@ launch_socket_service_check_in(void)
 				mach_msg_size_t fdpsCnt = 0;
 				kern_return_t kr = vproc_mig_legacy_ipc_request(bootstrap_port, (vm_address_t)buff, sz, NULL, 0, &sreply, &sreplyCnt, &fdps, &fdpsCnt, _audit_session_self());
 				if (kr == BOOTSTRAP_SUCCESS) {
-					int fds[128];
-
 					size_t i = 0;
 					size_t nfds = fdpsCnt / sizeof(fdps[0]);
+					int *fds = nfds ? calloc(nfds, sizeof(fds[0])) : NULL;
+
 					for (i = 0; i < nfds; i++) {
-						fds[i] = fileport_makefd(fdps[i]);
+						if (fds) {
+							fds[i] = fileport_makefd(fdps[i]);
+						}
 						(void)mach_port_deallocate(mach_task_self(), fdps[i]);
 					}
 
-					size_t dataoff = 0;
-					size_t fdoff = 0;
-					reply = launch_data_unpack((void *)sreply, sreplyCnt, fds, nfds, &dataoff, &fdoff);
-					reply = launch_data_copy(reply);
+					if (fds || nfds == 0) {
+						size_t dataoff = 0;
+						size_t fdoff = 0;
+						reply = launch_data_unpack((void *)sreply, sreplyCnt, fds, nfds, &dataoff, &fdoff);
+						reply = launch_data_copy(reply);
+					}
 
+					free(fds);
 					mig_deallocate(sreply, sreplyCnt);
 					mig_deallocate((vm_address_t)fdps, fdpsCnt);
 				}
@@ -1059,3 +1392,45 @@ launch_socket_service_check_in(void)
 
 	return reply;
 }
+
+int
+launch_socket_service_activate(const char *name, int **fds, size_t *cnt)
+{
+	mach_port_array_t fdps = NULL;
+	mach_msg_type_number_t fdpsCnt = 0;
+	name_t name2;
+	kern_return_t kr;
+	size_t i;
+
+	*fds = NULL;
+	*cnt = 0;
+
+	if (!name || strlcpy(name2, name, sizeof(name2)) >= sizeof(name2)) {
+		return EINVAL;
+	}
+
+	if ((kr = vproc_mig_checkin_sockets(bootstrap_port, name2, &fdps, &fdpsCnt))) {
+		return (kr == ENOENT) ? ENOENT : ESRCH;
+	}
+
+	int *fds2 = fdpsCnt ? calloc(fdpsCnt, sizeof(fds2[0])) : NULL;
+	for (i = 0; i < fdpsCnt; i++) {
+		if (fds2) {
+			fds2[i] = fileport_makefd(fdps[i]);
+		}
+		(void)mach_port_deallocate(mach_task_self(), fdps[i]);
+	}
+
+	if (fdps) {
+		mig_deallocate((vm_address_t)fdps, fdpsCnt * sizeof(fdps[0]));
+	}
+
+	if (fdpsCnt && !fds2) {
+		return ENOMEM;
+	}
+
+	*fds = fds2;
+	*cnt = fdpsCnt;
+
+	return 0;
+}
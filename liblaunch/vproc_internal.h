@@ -63,10 +63,90 @@ vproc_err_t _vproc_post_fork_ping(void);
 #define SPAWN_HAS_UMASK 0x0004
 #define SPAWN_WANTS_WAIT4DEBUGGER 0x0008
 
+// Keys in the packed reply of the original take_subset routine.
+#define TAKE_SUBSET_NAME "TakeSubsetName"
+#define TAKE_SUBSET_PID "TakeSubsetPID"
+#define TAKE_SUBSET_PERPID "TakeSubsetPerPID"
+
+/* One service in a sub-bootstrap being handed to a per-session launchd. The
+ * records line up one-for-one with the port array that comes with them.
+ */
+#define VPROC_SUBSET_PERPID 0x1
+
+struct vproc_subset_record {
+	pid_t pid;
+	uint32_t flags;
+	name_t name;
+};
+
 kern_return_t
-_vproc_grab_subset(mach_port_t bp, mach_port_t *reqport, mach_port_t *rcvright, launch_data_t *outval,
+_vproc_grab_subset(mach_port_t bp, mach_port_t *reqport, mach_port_t *rcvright,
+		struct vproc_subset_record **records, mach_msg_type_number_t *recordCnt,
 		mach_port_array_t *ports, mach_msg_type_number_t *portCnt);
 
+/* The compact descriptor for spawn3(). The fixed header is followed by argc
+ * argument strings and then envc "KEY=VALUE" strings, each NUL-terminated and
+ * packed back to back. Flags are SPAWN_VIA_LAUNCHD_* values. When reusing a
+ * handle, the label is ignored and envc must be zero; argc may be zero to
+ * reuse the arguments from the handle's descriptor as well.
+ */
+#define VPROC_SPAWN_DESC_VERSION 1
+// Bounds on what launchd accepts. Keys must fit in a name_t.
+#define VPROC_SPAWN_DESC_MAX (1024 * 1024)
+#define VPROC_SPAWN_ENV_KEY_MAX (sizeof(name_t) - 1)
+
+struct vproc_spawn_desc {
+	uint32_t version;
+	uint32_t flags;
+	uint32_t argc;
+	uint32_t envc;
+	name_t label;
+	char strings[0];
+};
+
+/* One job in the summary returned by list_jobs(). The status is the raw wait4()
+ * status of the job's last exit. The flags on the request select jobs by state;
+ * asking for neither state returns both.
+ */
+#define VPROC_LIST_RUNNING 0x1
+#define VPROC_LIST_STOPPED 0x2
+
+#define VPROC_LIST_LABEL_TRUNCATED 0x1
+
+struct vproc_list_record {
+	pid_t pid;
+	int32_t last_status;
+	uint32_t flags;
+	name_t label;
+};
+
+kern_return_t
+_vproc_list_jobs(mach_port_t bp, const char *prefix, uint64_t flags,
+		struct vproc_list_record **records, mach_msg_type_number_t *recordCnt);
+
+/* One entry in a set_jetsam_batch() request. The target is named by label, or
+ * by pid if the label is empty. The flags select which of the band and memory
+ * limit are changed. The result of each entry is returned in the same slot as
+ * an errno value.
+ */
+#define VPROC_JETSAM_SET_BAND 0x1
+#define VPROC_JETSAM_SET_MEMLIMIT 0x2
+
+#define VPROC_JETSAM_BATCH_MAX 512
+
+struct vproc_jetsam_update {
+	uint32_t flags;
+	pid_t pid;
+	int32_t band;
+	int32_t memlimit;
+	uint64_t rcdata;
+	name_t label;
+};
+
+kern_return_t
+_vproc_set_jetsam_batch(mach_port_t bp, struct vproc_jetsam_update *updates,
+		mach_msg_type_number_t cnt, int32_t *results);
+
 kern_return_t _vprocmgr_getsocket(name_t);
 
 struct logmsg_s {
@@ -114,6 +194,43 @@ bootstrap_info(mach_port_t bp,
 			   mach_msg_type_number_t *service_activeCnt,
 			   uint64_t flags);
 
+/* Like bootstrap_info(), but returns services in name order, restricted to
+ * those starting with prefix, and at most limit of them (0 for no limit).
+ * Pass the last name and job returned as after and after_job to fetch the next
+ * page; more is set if there are further matches.
+ */
+kern_return_t
+bootstrap_info_page(mach_port_t bp,
+			   const name_t prefix,
+			   const name_t after,
+			   const name_t after_job,
+			   uint32_t limit,
+			   name_array_t *service_names,
+			   mach_msg_type_number_t *service_namesCnt,
+			   name_array_t *service_jobs,
+			   mach_msg_type_number_t *service_jobsCnt,
+			   bootstrap_status_array_t *service_active,
+			   mach_msg_type_number_t *service_activeCnt,
+			   boolean_t *more,
+			   uint64_t flags);
+
+/* Keys of the packed bootstrap tree returned by bootstrap_lookup_tree(). Every
+ * node is a dictionary. Per-user launchds are separate processes, so their
+ * nodes carry an index into the returned port array instead of children.
+ */
+#define BOOTSTRAP_TREE_NAME "Name"
+#define BOOTSTRAP_TREE_PROPERTIES "Properties"
+#define BOOTSTRAP_TREE_SERVICES "Services"
+#define BOOTSTRAP_TREE_CHILDREN "Children"
+#define BOOTSTRAP_TREE_PORTINDEX "PortIndex"
+#define BOOTSTRAP_TREE_SERVICE_NAME "Name"
+#define BOOTSTRAP_TREE_SERVICE_JOB "Job"
+#define BOOTSTRAP_TREE_SERVICE_STATUS "Status"
+
+kern_return_t
+bootstrap_lookup_tree(mach_port_t bp, launch_data_t *tree,
+	mach_port_array_t *peruser_ports, mach_msg_type_number_t *peruser_portsCnt);
+
 #pragma GCC visibility pop
 
 #endif /* __VPROC_INTERNAL_H__ */
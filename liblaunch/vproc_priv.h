@@ -136,6 +136,15 @@ _vproc_kickstart_by_label(const char *label, pid_t *out_pid,
 	mach_port_t *out_port_name, mach_port_t *out_obsrvr_port,
 	vproc_flags_t flags);
 
+/* Like _vproc_kickstart_by_label(), but does not return until the job has
+ * checked in all of its MachServices and Sockets. A timeout of zero waits
+ * until the job is ready or exits. On failure, errno is ETIMEDOUT if the job
+ * was not ready in time and ESRCH if it exited first.
+ */
+vproc_err_t
+_vproc_kickstart_by_label_wait(const char *label, uint32_t timeout,
+	pid_t *out_pid, vproc_flags_t flags);
+
 /* _vprocmgr_log_drain() is specific to syslogd. It is not for general use. */
 typedef void (*_vprocmgr_log_drain_callback_t)(struct timeval *when, pid_t 
 	from_pid, pid_t about_pid, uid_t sender_uid, gid_t sender_gid, int priority,
@@ -146,6 +155,29 @@ vproc_err_t
 _vprocmgr_log_drain(vproc_t vp, pthread_mutex_t *optional_mutex_around_callback,
 	_vprocmgr_log_drain_callback_t func);
 
+/* Log subscriptions let several root consumers tail launchd's log without
+ * draining it from each other. Messages at or above max_pri (numerically at or
+ * below it) that match the optional pid, label prefix and session filters are
+ * retained until every interested subscriber has read them. If the retention
+ * buffer overflows, the oldest messages are discarded and counted in the
+ * dropped value of the subscriber's next read.
+ *
+ * _vprocmgr_log_subscribe() returns a receive right in token. Destroying it
+ * ends the subscription, as does _vprocmgr_log_unsubscribe(), which also
+ * destroys it. _vprocmgr_log_read() blocks until at least one message is
+ * available. Only one read per subscription may be outstanding.
+ */
+vproc_err_t
+_vprocmgr_log_subscribe(int max_pri, pid_t pid, const char *label_prefix,
+	const char *session, mach_port_t *token, uint64_t *handle);
+
+vproc_err_t
+_vprocmgr_log_read(uint64_t handle, pthread_mutex_t *optional_mutex_around_callback,
+	_vprocmgr_log_drain_callback_t func, uint64_t *dropped);
+
+vproc_err_t
+_vprocmgr_log_unsubscribe(mach_port_t token, uint64_t handle);
+
 __attribute__((format(printf, 2, 3)))
 void
 _vproc_log(int pri, const char *msg, ...);
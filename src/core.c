@@ -54,6 +54,7 @@
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/kern_memorystatus.h>
+#include <sys/kauth.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/in_var.h>
@@ -76,6 +77,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <glob.h>
+#include <fnmatch.h>
 #include <System/sys/spawn.h>
 #include <System/sys/spawn_internal.h>
 #include <spawn.h>
@@ -92,6 +94,7 @@
 #include <System/sys/proc_info.h>
 #include <malloc/malloc.h>
 #include <pthread.h>
+#include <libkern/OSAtomic.h>
 #if HAVE_SANDBOX
 #define __APPLE_API_PRIVATE
 #include <sandbox.h>
@@ -146,10 +149,6 @@ extern int gL1CacheEnabled;
 
 #define SHUTDOWN_LOG_DIR "/var/log/shutdown"
 
-#define TAKE_SUBSET_NAME "TakeSubsetName"
-#define TAKE_SUBSET_PID "TakeSubsetPID"
-#define TAKE_SUBSET_PERPID "TakeSubsetPerPID"
-
 #define IS_POWER_OF_TWO(v) (!(v & (v - 1)) && v)
 
 extern char **environ;
@@ -162,13 +161,108 @@ struct waiting_for_removal {
 static bool waiting4removal_new(job_t j, mach_port_t rp);
 static void waiting4removal_delete(job_t j, struct waiting_for_removal *w4r);
 
+/* A kickstart2() caller whose reply is held until the job has checked in all
+ * of its services, it exits or the caller's timeout fires. The timer's ident
+ * is the structure itself.
+ */
+struct waiting_for_ready {
+	SLIST_ENTRY(waiting_for_ready) sle;
+	mach_port_t reply_port;
+	uint32_t timeout;
+};
+
+static bool waiting4ready_new(job_t j, mach_port_t rp, uint32_t timeout);
+static void waiting4ready_delete(job_t j, struct waiting_for_ready *w4r, kern_return_t kr);
+static struct waiting_for_ready *waiting4ready_find(job_t j, void *ident);
+static bool job_is_ready(job_t j);
+static void job_ready_check(job_t j);
+
+/* Jobs stopped together share one deadline timer rather than each arming its
+ * own exit timeout. Every member keeps its own deadline, counted in seconds
+ * from the group's start; the timer is armed for the earliest one. A member
+ * still running at its deadline is sent SIGKILL and leaves the group, after
+ * which the usual per-job SIGKILL timer applies.
+ */
+struct job_stop_group {
+	LIST_ENTRY(job_stop_group) sle;
+	LIST_HEAD(, job_s) members;
+	uint64_t start_time;
+	// Overrides for each member's ExitTimeOut and StopSignal, if nonzero.
+	uint32_t grace;
+	int sig;
+	// Set while the group is open or its timer callback is running.
+	unsigned int nesting;
+	unsigned int cnt;
+	unsigned int killed;
+	bool killed_labels_full;
+	char killed_labels[1024];
+};
+
+static LIST_HEAD(, job_stop_group) s_stop_groups;
+static struct job_stop_group *s_stop_group_open;
+
+static void job_stop_group_begin(uint32_t grace, int sig);
+static void job_stop_group_end(void);
+static bool job_stop_group_join(job_t j, uint32_t deadline);
+static void job_stop_group_leave(job_t j, bool killed);
+static void job_stop_group_settle(struct job_stop_group *g);
+static void job_stop_group_callback(struct job_stop_group *g);
+static struct job_stop_group *job_stop_group_find(uintptr_t ident);
+static void job_stop_grace_elapsed(job_t j, const char *what);
+
+/* A bulk start, stop or remove that may only have so many jobs in flight at
+ * once. A job is in flight from when we act on it until it is ready (start),
+ * has exited (stop) or has been freed (remove). As each one lands, a zero
+ * length timer whose ident is the throttle itself brings us back to act on
+ * the next queued label from the top of the run loop rather than from deep
+ * inside job_reap() or job_free().
+ */
+typedef enum {
+	JOB_THROTTLE_START,
+	JOB_THROTTLE_STOP,
+	JOB_THROTTLE_REMOVE,
+} job_throttle_action_t;
+
+struct job_throttle {
+	LIST_ENTRY(job_throttle) sle;
+	job_throttle_action_t action;
+	// The request's Action string, for the log.
+	const char *verb;
+	uint64_t start_time;
+	uint32_t grace;
+	int sig;
+	size_t limit;
+	size_t inflight;
+	size_t next;
+	size_t cnt;
+	size_t done;
+	// Labels still to act on, in order. Duplicates are NULL.
+	char **labels;
+	bool pumping;
+	bool timer_armed;
+};
+
+static LIST_HEAD(, job_throttle) s_job_throttles;
+
+static int job_throttle_act(struct job_throttle *t, const char *label);
+static bool job_throttle_pending(struct job_throttle *t, job_t j);
+static void job_throttle_pump(struct job_throttle *t, launch_data_t resp);
+static void job_throttle_release(job_t j);
+static void job_throttle_settle(struct job_throttle *t);
+static struct job_throttle *job_throttle_find(uintptr_t ident);
+
 struct machservice {
 	SLIST_ENTRY(machservice) sle;
 	SLIST_ENTRY(machservice) special_port_sle;
 	LIST_ENTRY(machservice) name_hash_sle;
 	LIST_ENTRY(machservice) port_hash_sle;
+	LIST_ENTRY(machservice) pid_hash_sle;
 	struct machservice *alias;
 	job_t job;
+	// The job manager whose service directory lists us, if any.
+	jobmgr_t dir_mgr;
+	// The PID we are indexed under in per_pid_hash, or 0 if we aren't.
+	pid_t pid_hash_p;
 	unsigned int gen_num;
 	mach_port_name_t port;
 	unsigned int
@@ -186,6 +280,8 @@ struct machservice {
 		upfront:1,
 		event_channel:1,
 		recv_race_hack :1,
+		// Some job has cached us as its exception handler.
+		exc_handler_cached:1,
 		/* Don't let the size of this field to get too small. It has to be large
 		 * enough to represent the reasonable range of special port numbers.
 		 */
@@ -201,6 +297,15 @@ static SLIST_HEAD(, machservice) special_ports;
 
 static LIST_HEAD(, machservice) port_hash[PORT_HASH_SIZE];
 
+/* Per-PID services, keyed by the PID of the owning job and the service name.
+ * Lookups with a target PID go straight here instead of hunting for the job
+ * across every job manager and then walking its service list.
+ */
+#define PER_PID_HASH_SIZE 64
+#define HASH_PER_PID(p, n) ((our_strhash(n) ^ (size_t)(p)) & (PER_PID_HASH_SIZE - 1))
+
+static LIST_HEAD(, machservice) per_pid_hash[PER_PID_HASH_SIZE];
+
 static void machservice_setup(launch_data_t obj, const char *key, void *context);
 static void machservice_setup_options(launch_data_t obj, const char *key, void *context);
 static void machservice_resetport(job_t j, struct machservice *ms);
@@ -210,12 +315,20 @@ static struct machservice *machservice_new_alias(job_t aj, struct machservice *o
 static void machservice_ignore(job_t j, struct machservice *ms);
 static void machservice_watch(job_t j, struct machservice *ms);
 static void machservice_delete(job_t j, struct machservice *, bool port_died);
+static void machservice_hash_insert(jobmgr_t jm, struct machservice *ms);
+static void machservice_hash_remove(struct machservice *ms);
+static void machservice_pid_index(struct machservice *ms, pid_t p);
+static void machservice_pid_unindex(struct machservice *ms);
+static struct machservice *machservice_pid_lookup(jobmgr_t jm, pid_t p, const char *name);
+static void job_per_pid_services_index(job_t j);
+static void job_per_pid_services_release(job_t j);
 static void machservice_request_notifications(struct machservice *);
 static mach_port_t machservice_port(struct machservice *);
 static job_t machservice_job(struct machservice *);
 static bool machservice_hidden(struct machservice *);
 static bool machservice_active(struct machservice *);
 static const char *machservice_name(struct machservice *);
+static const char *machservice_owner_name(struct machservice *);
 static bootstrap_status_t machservice_status(struct machservice *);
 void machservice_drain_port(struct machservice *);
 
@@ -264,6 +377,20 @@ struct envitem {
 	};
 };
 
+/* The effective global environment of a job manager: every GlobalEnvironment
+ * item from it and its parents, with later definitions of a key replacing
+ * earlier ones. It is rebuilt only when its version falls behind
+ * s_global_env_gen, which any change to a global item bumps. The entries
+ * point into the envitems themselves, which is safe because deleting one
+ * bumps the version too.
+ */
+struct global_env_entry {
+	const char *key;
+	const char *value;
+};
+
+static uint64_t s_global_env_gen = 1;
+
 static bool envitem_new(job_t j, const char *k, const char *v, bool global);
 static void envitem_delete(job_t j, struct envitem *ei, bool global);
 static void envitem_setup(launch_data_t obj, const char *key, void *context);
@@ -359,6 +486,9 @@ static void eventsystem_ping(void);
 
 struct waiting4attach {
 	LIST_ENTRY(waiting4attach) le;
+	LIST_ENTRY(waiting4attach) port_hash_le;
+	// The manager whose attaches list holds us, or NULL for a domain waiter.
+	jobmgr_t jm;
 	mach_port_t port;
 	pid_t dest;
 	xpc_service_type_t type;
@@ -366,6 +496,17 @@ struct waiting4attach {
 };
 
 static LIST_HEAD(, waiting4attach) _launchd_domain_waiters;
+// Every waiter, by the port it's waiting with.
+static LIST_HEAD(, waiting4attach) waiter_port_hash[PORT_HASH_SIZE];
+// Every job manager with a requestor port, by that port.
+static LIST_HEAD(, jobmgr_s) req_port_hash[PORT_HASH_SIZE];
+
+/* The sessions that jobmgr_find_by_name() can resolve, by case-folded name:
+ * the root job manager's children and, in PID 1, the Background session's
+ * children. XPC domains are never in here.
+ */
+#define SESSION_NAME_HASH_SIZE 16
+static LIST_HEAD(, jobmgr_s) session_name_hash[SESSION_NAME_HASH_SIZE];
 
 static struct waiting4attach *waiting4attach_new(jobmgr_t jm, const char *name, mach_port_t port, pid_t dest, xpc_service_type_t type);
 static void waiting4attach_delete(jobmgr_t jm, struct waiting4attach *w4a);
@@ -377,9 +518,27 @@ static struct waiting4attach *waiting4attach_find(jobmgr_t jm, job_t j);
 #define MACHSERVICE_HASH_SIZE	37
 
 #define LABEL_HASH_SIZE 53
+
+/* A sub-bootstrap handed over by take_subset that hasn't been fully imported.
+ * The records and ports are the out-of-line memory from the reply. We import
+ * them a batch per run loop pass so the new session can serve lookups right
+ * away; a lookup that misses while an import is pending finishes it first.
+ */
+#define SUBSET_IMPORT_BATCH 128
+
+struct jobmgr_subset_import {
+	struct vproc_subset_record *records;
+	mach_port_array_t ports;
+	mach_msg_type_number_t cnt;
+	mach_msg_type_number_t next;
+	bool timer_armed;
+};
+
 struct jobmgr_s {
 	kq_callback kqjobmgr_callback;
 	LIST_ENTRY(jobmgr_s) xpc_le;
+	LIST_ENTRY(jobmgr_s) req_port_hash_sle;
+	LIST_ENTRY(jobmgr_s) session_name_sle;
 	SLIST_ENTRY(jobmgr_s) sle;
 	SLIST_HEAD(, jobmgr_s) submgrs;
 	LIST_HEAD(, job_s) jobs;
@@ -393,7 +552,18 @@ struct jobmgr_s {
 	LIST_HEAD(, job_s) label_hash[LABEL_HASH_SIZE];
 	LIST_HEAD(, job_s) active_jobs[ACTIVE_JOB_HASH_SIZE];
 	LIST_HEAD(, machservice) ms_hash[MACHSERVICE_HASH_SIZE];
+	/* Every non-per-PID service in ms_hash, sorted by name, so that services
+	 * can be enumerated in order, by prefix and a page at a time without
+	 * walking the hash.
+	 */
+	struct machservice **ms_dir;
+	size_t ms_dir_cnt;
+	size_t ms_dir_sz;
+	struct jobmgr_subset_import *subset_import;
 	LIST_HEAD(, job_s) global_env_jobs;
+	struct global_env_entry *global_env;
+	size_t global_env_cnt;
+	uint64_t global_env_gen;
 	mach_port_t jm_port;
 	mach_port_t req_port;
 	jobmgr_t parentmgr;
@@ -408,7 +578,8 @@ struct jobmgr_s {
 		monitor_shutdown:1,
 		shutdown_jobs_dirtied:1,
 		shutdown_jobs_cleaned:1,
-		xpc_singleton:1;
+		xpc_singleton:1,
+		session_name_hashed:1;
 	uint32_t properties;
 	// XPC-specific properties.
 	char owner[MAXCOMLEN];
@@ -442,6 +613,7 @@ static LIST_HEAD(, jobmgr_s) _s_xpc_session_domains;
 #define jobmgr_assumes_zero_p(jm, e) posix_assumes_zero_ctx(jobmgr_log_bug, jm, (e))
 
 static jobmgr_t jobmgr_new(jobmgr_t jm, mach_port_t requestorport, mach_port_t transfer_port, bool sflag, const char *name, bool no_init, mach_port_t asport);
+static void jobmgr_set_req_port(jobmgr_t jm, mach_port_t port);
 static jobmgr_t jobmgr_new_xpc_singleton_domain(jobmgr_t jm, name_t name);
 static jobmgr_t jobmgr_find_xpc_per_user_domain(jobmgr_t jm, uid_t uid);
 static jobmgr_t jobmgr_find_xpc_per_session_domain(jobmgr_t jm, au_asid_t asid);
@@ -449,23 +621,32 @@ static job_t jobmgr_import2(jobmgr_t jm, launch_data_t pload);
 static jobmgr_t jobmgr_parent(jobmgr_t jm);
 static jobmgr_t jobmgr_do_garbage_collection(jobmgr_t jm);
 static bool jobmgr_label_test(jobmgr_t jm, const char *str);
-static void jobmgr_reap_bulk(jobmgr_t jm, struct kevent *kev);
+static bool jobmgr_reap_bulk(jobmgr_t jm, struct kevent *kev);
 static void jobmgr_log_stray_children(jobmgr_t jm, bool kill_strays);
 static void jobmgr_kill_stray_children(jobmgr_t jm, pid_t *p, size_t np);
 static void jobmgr_remove(jobmgr_t jm);
+static void jobmgr_subset_import_step(jobmgr_t jm, size_t max);
+static void jobmgr_subset_import_free(jobmgr_t jm);
 static void jobmgr_dispatch_all(jobmgr_t jm, bool newmounthack);
 static job_t jobmgr_init_session(jobmgr_t jm, const char *session_type, bool sflag);
 static job_t jobmgr_find_by_pid_deep(jobmgr_t jm, pid_t p, bool anon_okay);
 static job_t jobmgr_find_by_pid(jobmgr_t jm, pid_t p, bool create_anon);
 static job_t managed_job(pid_t p);
 static jobmgr_t jobmgr_find_by_name(jobmgr_t jm, const char *where);
+static void jobmgr_session_name_update(jobmgr_t jm);
 static job_t job_mig_intran2(jobmgr_t jm, mach_port_t mport, pid_t upid);
 static job_t jobmgr_lookup_per_user_context_internal(job_t j, uid_t which_user, mach_port_t *mp);
-static void job_export_all2(jobmgr_t jm, launch_data_t where);
 static void jobmgr_callback(void *obj, struct kevent *kev);
 static void jobmgr_setup_env_from_other_jobs(jobmgr_t jm);
 static void jobmgr_export_env_from_other_jobs(jobmgr_t jm, launch_data_t dict);
+static void jobmgr_global_env_materialize(jobmgr_t jm);
+static void jobmgr_global_env_collect(jobmgr_t jm, struct global_env_entry *entries, size_t *cnt);
 static struct machservice *jobmgr_lookup_service(jobmgr_t jm, const char *name, bool check_parent, pid_t target_pid);
+static int jobmgr_service_directory_cmp(struct machservice *ms, const char *name, const char *owner);
+static size_t jobmgr_service_directory_find(jobmgr_t jm, const char *name, const char *owner);
+static void jobmgr_service_directory_insert(jobmgr_t jm, struct machservice *ms);
+static void jobmgr_service_directory_remove(struct machservice *ms);
+static kern_return_t jobmgr_service_directory_copy(jobmgr_t jm, size_t start, size_t cnt, name_array_t *names, name_array_t *jobs, bootstrap_status_array_t *actives);
 static void jobmgr_logv(jobmgr_t jm, int pri, int err, const char *msg, va_list ap) __attribute__((format(printf, 4, 0)));
 static void jobmgr_log(jobmgr_t jm, int pri, const char *msg, ...) __attribute__((format(printf, 3, 4)));
 static void jobmgr_log_perf_statistics(jobmgr_t jm, bool signal_children);
@@ -481,6 +662,168 @@ struct suspended_peruser {
 	job_t j;
 };
 
+/* A small, fixed ring of the most recent lifecycle transitions for a job.
+ * Recording an event never allocates, so it is safe to do from any of the
+ * paths that start, stop or reap a job.
+ */
+#define JOB_HISTORY_SIZE 16
+
+enum {
+	JOB_HISTORY_NONE = 0,
+	JOB_HISTORY_SPAWN,
+	JOB_HISTORY_SPAWN_FAILED,
+	JOB_HISTORY_THROTTLE,
+	JOB_HISTORY_STOP,
+	JOB_HISTORY_KILL,
+	JOB_HISTORY_EXIT,
+	JOB_HISTORY_CRASH,
+};
+
+enum {
+	JOB_HISTORY_REASON_NONE = 0,
+	// The job was started without regard to the throttle interval.
+	JOB_HISTORY_REASON_UNTHROTTLED,
+	// proc_terminate() failed and we fell back to SIGTERM.
+	JOB_HISTORY_REASON_FALLBACK,
+	// The job never exec(3)ed.
+	JOB_HISTORY_REASON_NO_EXEC,
+	// The job was stopped by launchd.
+	JOB_HISTORY_REASON_STOPPED,
+	// The job was jettisoned due to memory pressure.
+	JOB_HISTORY_REASON_JETTISONED,
+	// The job was implicitly reaped by the kernel.
+	JOB_HISTORY_REASON_IMPLICIT_REAP,
+	// The job never exited after SIGKILL and its exit was simulated.
+	JOB_HISTORY_REASON_SIMULATED,
+};
+
+struct job_history_entry {
+	int64_t when;
+	pid_t p;
+	int32_t status;
+	uint8_t event;
+	uint8_t reason;
+};
+
+/* The processes a job has forked, tracked through the same EVFILT_PROC
+ * events that we use for the job itself. The table is allocated once, the
+ * first time the job forks, and has a fixed size; if a job outgrows it, the
+ * diagnostics that use it fall back to asking the kernel.
+ */
+#define JOB_DESCENDANTS_MAX 64
+
+struct job_descendant {
+	LIST_ENTRY(job_descendant) pid_hash_sle;
+	job_t j;
+	pid_t p;
+	pid_t ppid;
+	pid_t pgid;
+	bool did_exec;
+	char comm[MAXCOMLEN + 1];
+};
+
+static LIST_HEAD(, job_descendant) s_descendant_pids[ACTIVE_JOB_HASH_SIZE];
+
+/* A job's own EVFILT_PROC events are delivered straight to it through one of
+ * these, instead of to the root job manager, which would have to search every
+ * manager for the PID. The kernel may still hold events for a route after the
+ * job has moved on, so a route lives until the process's NOTE_EXIT has been
+ * dispatched, and the generation is checked against the job's before the
+ * event is handed over. Anything that fails the check takes the bulk path.
+ */
+struct proc_route {
+	// MUST be first element of this structure.
+	kq_callback kqproc_callback;
+	LIST_ENTRY(proc_route) pid_hash_sle;
+	job_t j;
+	uint64_t gen;
+	pid_t p;
+	bool armed;
+};
+
+#define PROC_ROUTE_STATS_INTERVAL 1000
+
+static LIST_HEAD(, proc_route) s_proc_routes[ACTIVE_JOB_HASH_SIZE];
+static uint64_t s_proc_route_gen;
+static uint64_t s_proc_route_direct;
+static uint64_t s_proc_route_fallback;
+
+/* The packed reply to LAUNCH_KEY_CHECKIN. Nothing in it changes from one run
+ * of a job to the next, so we build it once and hand out the same bytes until
+ * the job's sockets or MachServices change.
+ */
+struct job_checkin_reply {
+	void *data;
+	size_t len;
+	size_t fd_cnt;
+	int fds[0];
+};
+
+/* With OutputCapture, the job's stdout and stderr are the write ends of pipes
+ * and launchd copies whatever comes out of them into StandardOutPath and
+ * StandardErrorPath. This lets us batch up small writes, rotate the files and
+ * cap how quickly a job can fill the disk. If both paths are the same, the two
+ * descriptors share a single pipe.
+ */
+#define JOB_CAPTURE_BUFSIZE (16 * 1024)
+#define JOB_CAPTURE_DRAIN_MAX (4 * JOB_CAPTURE_BUFSIZE)
+#define JOB_CAPTURE_FLUSH_DELAY 1
+#define JOB_CAPTURE_DEFAULT_MAXFILES 4
+#define JOB_CAPTURE_INFLIGHT_MAX (16 * JOB_CAPTURE_BUFSIZE)
+
+struct job_capture_config {
+	uint64_t max_size;
+	uint32_t max_age;
+	uint32_t max_files;
+	uint32_t rate;
+};
+
+/* The file side of an output capture. Once created, it belongs to
+ * s_capture_queue: the file is opened, rotated and written there, under the
+ * job's credentials, so launchd never creates, renames or unlinks a log path
+ * as root and the main thread never waits on the disk. The main thread only
+ * reads inflight, dropped and error, and hands the file back to the queue to
+ * be closed and freed.
+ */
+struct job_capture_file {
+	int wfd;
+	off_t size;
+	uint64_t opened;
+	struct job_capture_config cfg;
+	// Set when the writes must be done as someone other than launchd.
+	bool assume_creds;
+	bool creds_resolved;
+	uid_t uid;
+	gid_t gid;
+	uid_t mach_uid;
+	char *username;
+	char *groupname;
+	volatile int64_t inflight;
+	volatile int64_t dropped;
+	// The first failure since the main thread last looked, as (op << 16) | errno.
+	volatile int32_t error;
+	char path[0];
+};
+
+struct job_capture_chunk {
+	struct job_capture_file *file;
+	size_t len;
+	char buf[0];
+};
+
+struct job_capture {
+	// Our end of the pipe, or -1 once the job's end has closed.
+	int rfd;
+	// The job's end of the pipe, until we've forked.
+	int child_fd;
+	// Where buffered output goes, once there's been some.
+	struct job_capture_file *file;
+	uint64_t dropped;
+	bool flush_pending;
+	size_t len;
+	char buf[JOB_CAPTURE_BUFSIZE];
+};
+
 struct job_s {
 	// MUST be first element of this structure.
 	kq_callback kqjob_callback;
@@ -492,6 +835,7 @@ struct job_s {
 	LIST_ENTRY(job_s) global_pid_hash_sle;
 	LIST_ENTRY(job_s) label_hash_sle;
 	LIST_ENTRY(job_s) global_env_sle;
+	LIST_ENTRY(job_s) stop_group_sle;
 	SLIST_ENTRY(job_s) curious_jobs_sle;
 	LIST_HEAD(, suspended_peruser) suspended_perusers;
 	LIST_HEAD(, waiting_for_exit) exit_watchers;
@@ -505,6 +849,7 @@ struct job_s {
 	SLIST_HEAD(, machservice) machservices;
 	SLIST_HEAD(, semaphoreitem) semaphores;
 	SLIST_HEAD(, waiting_for_removal) removal_watchers;
+	SLIST_HEAD(, waiting_for_ready) ready_watchers;
 	struct waiting4attach *w4a;
 	job_t original;
 	job_t alias;
@@ -514,6 +859,8 @@ struct job_s {
 	mach_port_t exit_status_dest;
 	mach_port_t exit_status_port;
 	mach_port_t spawn_reply_port;
+	// The handle to send back with a spawn3() reply.
+	uint64_t spawn_reply_handle;
 	uid_t mach_uid;
 	jobmgr_t mgr;
 	size_t argc;
@@ -527,6 +874,9 @@ struct job_s {
 	char *stdoutpath;
 	char *stderrpath;
 	char *alt_exc_handler;
+	// What alt_exc_handler resolved to, as long as exc_handler_gen is current.
+	struct machservice *exc_handler_ms;
+	unsigned int exc_handler_gen;
 	char *cfbundleidentifier;
 	unsigned int nruns;
 	uint64_t trt;
@@ -552,6 +902,14 @@ struct job_s {
 	int32_t main_thread_priority;
 	uint32_t timeout;
 	uint32_t exit_timeout;
+	// man launchd.plist --> StopSignal
+	int stop_signal;
+	struct job_stop_group *stop_group;
+	uint32_t stop_group_deadline;
+	// The grace period, in seconds, that job_stop() gave the job before SIGKILL.
+	uint32_t stop_grace;
+	// The bulk request that counts this job against its in-flight limit.
+	struct job_throttle *throttle;
 	uint64_t sent_signal_time;
 	uint64_t start_time;
 	uint32_t min_run_time;
@@ -563,6 +921,21 @@ struct job_s {
 	mach_port_t asport;
 	au_asid_t asid;
 	uuid_t expected_audit_uuid;
+	struct job_history_entry history[JOB_HISTORY_SIZE];
+	uint32_t history_next;
+	struct job_checkin_reply *checkin_reply;
+	struct job_descendant *descendants;
+	struct proc_route *proc_route;
+	uint64_t proc_gen;
+	struct job_capture *capture[2];
+	struct job_capture_config capture_cfg;
+	uint64_t capture_window;
+	uint64_t capture_window_bytes;
+	uint64_t ready_latency;
+	// Crashes held back from the log since crash_burst_start.
+	uint64_t crash_burst_start;
+	uint32_t crash_burst_cnt;
+	int crash_burst_sig;
 	bool 	
 		// man launchd.plist --> Debug
 		debug:1,
@@ -738,13 +1111,24 @@ struct job_s {
 		implicit_reap:1,
 		system_app :1,
 		joins_gui_session :1,
-		low_priority_background_io :1;
+		low_priority_background_io :1,
+		// The job has had more descendants than we could track.
+		descendants_overflowed :1,
+		// man launchd.plist --> OutputCapture
+		capture_output :1,
+		// Output is currently being dropped for exceeding the rate limit.
+		capture_dropping :1,
+		// The current instance has fetched its sockets via check-in.
+		checkedin_sockets :1,
+		// spawn_reply_port is waiting on a spawn3() reply, not spawn2().
+		spawn_reply_v3 :1;
 
 	const char label[0];
 };
 
 static size_t hash_label(const char *label) __attribute__((pure));
 static size_t hash_ms(const char *msstr) __attribute__((pure));
+static size_t hash_session_name(const char *name) __attribute__((pure));
 static SLIST_HEAD(, job_s) s_curious_jobs;
 static LIST_HEAD(, job_s) managed_actives[ACTIVE_JOB_HASH_SIZE];
 
@@ -764,6 +1148,10 @@ static const char *job_active(job_t j);
 static void job_watch(job_t j);
 static void job_ignore(job_t j);
 static void job_reap(job_t j);
+static void job_history_record(job_t j, uint8_t event, int32_t status, uint8_t reason);
+static launch_data_t job_history_export(const struct job_history_entry *history, uint32_t history_next);
+static launch_data_t job_export_checkin(job_t j);
+static void job_checkin_reply_invalidate(job_t j);
 static bool job_useless(job_t j);
 static bool job_keepalive(job_t j);
 static void job_dispatch_curious_jobs(job_t j);
@@ -772,17 +1160,45 @@ static void job_start_child(job_t j) __attribute__((noreturn));
 static void job_setup_attributes(job_t j);
 static bool job_setup_machport(job_t j);
 static kern_return_t job_setup_exit_port(job_t j);
+static kern_return_t job_send_spawn_reply(job_t j);
+static void spawn_templates_forget(jobmgr_t jm);
 static void job_setup_fd(job_t j, int target_fd, const char *path, int flags);
 static void job_postfork_become_user(job_t j);
 static void job_postfork_test_user(job_t j);
 static void job_log_pids_with_weird_uids(job_t j);
 static void job_setup_exception_port(job_t j, task_t target_task);
+static void job_log_crash(job_t j, int sig);
+static void job_crash_burst_flush(job_t j);
 static void job_callback(void *obj, struct kevent *kev);
 static void job_callback_proc(job_t j, struct kevent *kev);
 static void job_callback_timer(job_t j, void *ident);
 static void job_callback_read(job_t j, int ident);
 static void job_log_stray_pg(job_t j);
 static void job_log_children_without_exec(job_t j);
+static void job_descendants_scan(job_t j, pid_t parent);
+static void job_descendants_reparent(job_t j, pid_t parent);
+static void job_descendants_free(job_t j);
+static void job_descendant_callback(struct kevent *kev);
+static void job_descendant_kevent_callback(void *obj, struct kevent *kev);
+static kq_callback kqdescendant_callback = job_descendant_kevent_callback;
+static void *job_proc_route_attach(job_t j, pid_t p);
+static void job_proc_route_armed(job_t j);
+static void job_proc_route_detach(job_t j);
+static struct proc_route *proc_route_find(pid_t p);
+static void proc_route_callback(void *obj, struct kevent *kev);
+static void proc_route_count(bool direct);
+static launch_data_t job_descendants_export(const struct job_descendant *descendants, size_t cnt);
+static void job_capture_prepare(job_t j);
+static void job_capture_attach(job_t j);
+static bool job_capture_setup_fd(job_t j, int target_fd, struct job_capture *jc);
+static struct job_capture *job_capture_find(job_t j, int fd);
+static void job_capture_drain(job_t j, struct job_capture *jc);
+static void job_capture_flush(job_t j, struct job_capture *jc);
+static void job_capture_close(job_t j, struct job_capture *jc);
+static void job_capture_free(job_t j);
+static launch_data_t job_capture_export(const struct job_capture_config *cfg, uint64_t dropped);
+static uint64_t job_capture_dropped(job_t j);
+static void capture_setup(launch_data_t obj, const char *key, void *context);
 static job_t job_new_anonymous(jobmgr_t jm, pid_t anonpid) __attribute__((malloc, nonnull, warn_unused_result));
 static job_t job_new(jobmgr_t jm, const char *label, const char *prog, const char *const *argv) __attribute__((malloc, nonnull(1,2), warn_unused_result));
 static job_t job_new_alias(jobmgr_t jm, job_t src);
@@ -859,8 +1275,34 @@ static size_t our_strhash(const char *s) __attribute__((pure));
 void eliminate_double_reboot(void);
 
 #pragma mark XPC Domain Forward Declarations
+static int _xpc_domain_service_check(jobmgr_t jm, launch_data_t pload);
 static job_t _xpc_domain_import_service(jobmgr_t jm, launch_data_t pload);
 static int _xpc_domain_import_services(job_t j, launch_data_t services);
+static bool _xpc_domain_caller_is_bootstrapper(job_t j);
+static int _xpc_domain_load(job_t j, launch_data_t services);
+static int _xpc_bundle_validate(launch_data_t services);
+static struct xpc_service_bundle *_xpc_bundle_find(uint64_t hash);
+static void _xpc_bundle_delete(struct xpc_service_bundle *b);
+
+/* Service bundles are validated service arrays that the XPC bootstrapper
+ * registers once and then instantiates into new domains by content hash. A
+ * bundle whose contents change gets a new hash, so stale entries are only ever
+ * replaced explicitly or aged out. Loading a bundle saves the copy-in and the
+ * unpack. Each service is still imported as its own job, and that import still
+ * checks the service's keys as it goes.
+ */
+#define XPC_BUNDLE_MAX 32
+
+struct xpc_service_bundle {
+	LIST_ENTRY(xpc_service_bundle) le;
+	uint64_t hash;
+	uint64_t last_used;
+	launch_data_t services;
+	size_t cnt;
+};
+
+static LIST_HEAD(, xpc_service_bundle) s_xpc_bundles;
+static size_t s_xpc_bundle_cnt;
 
 #pragma mark XPC Event Forward Declarations
 static int xpc_event_find_channel(job_t j, const char *stream, struct machservice **ms);
@@ -882,6 +1324,10 @@ static job_t _launchd_embedded_home = NULL;
 static size_t total_children;
 static size_t total_anon_children;
 static mach_port_t the_exception_server;
+// What the host exception ports were last pointed at, or null.
+static mach_port_t the_host_exception_port;
+// Bumped when a service that some job cached as its exception handler goes away.
+static unsigned int s_exc_handler_gen;
 static job_t workaround_5477111;
 static LIST_HEAD(, job_s) s_needing_sessions;
 static LIST_HEAD(, eventsystem) _s_event_systems;
@@ -987,20 +1433,37 @@ job_stop(job_t j)
 	job_log(j, LOG_DEBUG | LOG_CONSOLE, "Stopping job...");
 
 	int error = -1;
-	error = proc_terminate(j->p, &sig);
-	if (error) {
-		job_log(j, LOG_ERR | LOG_CONSOLE, "Could not terminate job: %d: %s", error, strerror(error));
-		job_log(j, LOG_NOTICE | LOG_CONSOLE, "Using fallback option to terminate job...");
-		error = kill2(j->p, SIGTERM);
+	bool fallback = false;
+	struct job_stop_group *g = s_stop_group_open;
+	int stop_signal = (g && g->sig) ? g->sig : j->stop_signal;
+
+	if (stop_signal) {
+		error = kill2(j->p, stop_signal);
 		if (error) {
 			job_log(j, LOG_ERR, "Could not signal job: %d: %s", error, strerror(error));
 		} else {
-			sig = SIGTERM;
+			sig = stop_signal;
+		}
+	} else {
+		error = proc_terminate(j->p, &sig);
+		if (error) {
+			job_log(j, LOG_ERR | LOG_CONSOLE, "Could not terminate job: %d: %s", error, strerror(error));
+			job_log(j, LOG_NOTICE | LOG_CONSOLE, "Using fallback option to terminate job...");
+			fallback = true;
+			error = kill2(j->p, SIGTERM);
+			if (error) {
+				job_log(j, LOG_ERR, "Could not signal job: %d: %s", error, strerror(error));
+			} else {
+				sig = SIGTERM;
+			}
 		}
 	}
 
 	if (!error) {
-		switch (sig) {
+		job_history_record(j, JOB_HISTORY_STOP, sig, sig == SIGTERM && fallback ? JOB_HISTORY_REASON_FALLBACK : JOB_HISTORY_REASON_NONE);
+
+		// A StopSignal gets the same grace period that SIGTERM would.
+		switch ((stop_signal && sig != SIGKILL) ? SIGTERM : sig) {
 		case SIGKILL:
 			j->sent_sigkill = true;
 			j->clean_kill = true;
@@ -1018,13 +1481,16 @@ job_stop(job_t j)
 			job_log(j, LOG_DEBUG | LOG_CONSOLE, "Sent job SIGKILL.");
 			break;
 		case SIGTERM:
-			if (j->exit_timeout) {
+			j->stop_grace = (g && g->grace) ? g->grace : j->exit_timeout;
+			if (job_stop_group_join(j, j->stop_grace)) {
+				job_log(j, LOG_DEBUG, "Joined stop group with a deadline of %u seconds.", j->stop_group_deadline);
+			} else if (j->exit_timeout) {
 				error = kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, j->exit_timeout, j);
 				(void)job_assumes_zero_p(j, error);
 			} else {
 				job_log(j, LOG_NOTICE, "This job has an infinite exit timeout");
 			}
-			job_log(j, LOG_DEBUG, "Sent job SIGTERM.");
+			job_log(j, LOG_DEBUG, "Sent job %s.", sig == SIGTERM ? "SIGTERM" : strsignal(sig));
 			break;
 		default:
 			job_log(j, LOG_ERR | LOG_CONSOLE, "Job was sent unexpected signal: %d: %s", sig, strsignal(sig));
@@ -1035,126 +1501,6 @@ job_stop(job_t j)
 	j->stopped = true;
 }
 
-launch_data_t
-job_export(job_t j)
-{
-	launch_data_t tmp, tmp2, tmp3, r = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
-
-	if (r == NULL) {
-		return NULL;
-	}
-
-	if ((tmp = launch_data_new_string(j->label))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_LABEL);
-	}
-	if ((tmp = launch_data_new_string(j->mgr->name))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_LIMITLOADTOSESSIONTYPE);
-	}
-	if ((tmp = launch_data_new_bool(j->ondemand))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_ONDEMAND);
-	}
-
-	long long status = j->last_exit_status;
-	if (j->fpfail) {
-		status = LAUNCH_EXITSTATUS_FAIRPLAY_FAIL;
-	}
-	if ((tmp = launch_data_new_integer(status))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_LASTEXITSTATUS);
-	}
-
-	if (j->p && (tmp = launch_data_new_integer(j->p))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_PID);
-	}
-	if ((tmp = launch_data_new_integer(j->timeout))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_TIMEOUT);
-	}
-	if (j->prog && (tmp = launch_data_new_string(j->prog))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_PROGRAM);
-	}
-	if (j->stdinpath && (tmp = launch_data_new_string(j->stdinpath))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDINPATH);
-	}
-	if (j->stdoutpath && (tmp = launch_data_new_string(j->stdoutpath))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDOUTPATH);
-	}
-	if (j->stderrpath && (tmp = launch_data_new_string(j->stderrpath))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDERRORPATH);
-	}
-	if (likely(j->argv) && (tmp = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
-		size_t i;
-
-		for (i = 0; i < j->argc; i++) {
-			if ((tmp2 = launch_data_new_string(j->argv[i]))) {
-				launch_data_array_set_index(tmp, tmp2, i);
-			}
-		}
-
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_PROGRAMARGUMENTS);
-	}
-
-	if (j->enable_transactions && (tmp = launch_data_new_bool(true))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_ENABLETRANSACTIONS);
-	}
-
-	if (j->session_create && (tmp = launch_data_new_bool(true))) {
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_SESSIONCREATE);
-	}
-
-	if (j->inetcompat && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
-		if ((tmp2 = launch_data_new_bool(j->inetcompat_wait))) {
-			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBINETDCOMPATIBILITY_WAIT);
-		}
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_INETDCOMPATIBILITY);
-	}
-
-	if (!SLIST_EMPTY(&j->sockets) && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
-		struct socketgroup *sg;
-		unsigned int i;
-
-		SLIST_FOREACH(sg, &j->sockets, sle) {
-			if ((tmp2 = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
-				for (i = 0; i < sg->fd_cnt; i++) {
-					if ((tmp3 = launch_data_new_fd(sg->fds[i]))) {
-						launch_data_array_set_index(tmp2, tmp3, i);
-					}
-				}
-				launch_data_dict_insert(tmp, tmp2, sg->name);
-			}
-		}
-
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_SOCKETS);
-	}
-
-	if (!SLIST_EMPTY(&j->machservices) && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
-		struct machservice *ms;
-
-		tmp3 = NULL;
-
-		SLIST_FOREACH(ms, &j->machservices, sle) {
-			if (ms->per_pid) {
-				if (tmp3 == NULL) {
-					tmp3 = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
-				}
-				if (tmp3) {
-					tmp2 = launch_data_new_machport(MACH_PORT_NULL);
-					launch_data_dict_insert(tmp3, tmp2, ms->name);
-				}
-			} else {
-				tmp2 = launch_data_new_machport(MACH_PORT_NULL);
-				launch_data_dict_insert(tmp, tmp2, ms->name);
-			}
-		}
-
-		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_MACHSERVICES);
-
-		if (tmp3) {
-			launch_data_dict_insert(r, tmp3, LAUNCH_JOBKEY_PERJOBMACHSERVICES);
-		}
-	}
-
-	return r;
-}
-
 static void
 jobmgr_log_active_jobs(jobmgr_t jm)
 {
@@ -1261,6 +1607,7 @@ jobmgr_remove(jobmgr_t jm)
 	job_t ji;
 
 	jobmgr_log(jm, LOG_DEBUG, "Removing job manager.");
+	spawn_templates_forget(jm);
 	if (!SLIST_EMPTY(&jm->submgrs)) {
 		size_t cnt = 0;
 		while ((jmi = SLIST_FIRST(&jm->submgrs))) {
@@ -1285,8 +1632,17 @@ jobmgr_remove(jobmgr_t jm)
 		waiting4attach_delete(jm, w4ai);
 	}
 
+	jobmgr_subset_import_free(jm);
+	free(jm->global_env);
+	if (jm->session_name_hashed) {
+		LIST_REMOVE(jm, session_name_sle);
+		jm->session_name_hashed = false;
+	}
+
 	if (jm->req_port) {
-		(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(jm->req_port));
+		mach_port_t req_port = jm->req_port;
+		jobmgr_set_req_port(jm, MACH_PORT_NULL);
+		(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(req_port));
 	}
 	if (jm->jm_port) {
 		(void)jobmgr_assumes_zero(jm, launchd_mport_close_recv(jm->jm_port));
@@ -1354,6 +1710,8 @@ jobmgr_remove(jobmgr_t jm)
 		exit(EXIT_SUCCESS);
 	}
 
+	(void)jobmgr_assumes_zero(jm, jm->ms_dir_cnt);
+	free(jm->ms_dir);
 	free(jm);
 }
 
@@ -1361,6 +1719,7 @@ void
 job_remove(job_t j)
 {
 	struct waiting_for_removal *w4r;
+	struct waiting_for_ready *w4rdy;
 	struct calendarinterval *ci;
 	struct semaphoreitem *si;
 	struct socketgroup *sg;
@@ -1449,6 +1808,11 @@ job_remove(job_t j)
 		(void)job_assumes_zero(j, launchd_mport_close_recv(j->j_port));
 	}
 
+	job_checkin_reply_invalidate(j);
+	job_descendants_free(j);
+	job_proc_route_detach(j);
+	job_capture_free(j);
+
 	while ((sg = SLIST_FIRST(&j->sockets))) {
 		socketgroup_delete(j, sg);
 	}
@@ -1473,6 +1837,12 @@ job_remove(job_t j)
 	while ((w4r = SLIST_FIRST(&j->removal_watchers))) {
 		waiting4removal_delete(j, w4r);
 	}
+	while ((w4rdy = SLIST_FIRST(&j->ready_watchers))) {
+		waiting4ready_delete(j, w4rdy, BOOTSTRAP_UNKNOWN_SERVICE);
+	}
+	if (j->throttle) {
+		job_throttle_release(j);
+	}
 
 	struct externalevent *eei = NULL;
 	while ((eei = LIST_FIRST(&j->events))) {
@@ -1545,6 +1915,13 @@ job_remove(job_t j)
 		 */
 		(void)kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
 	}
+	if (j->stop_group) {
+		job_stop_group_leave(j, false);
+	}
+	if (j->crash_burst_cnt) {
+		(void)kevent_mod((uintptr_t)&j->crash_burst_cnt, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+		job_crash_burst_flush(j);
+	}
 	if (j->asport != MACH_PORT_NULL) {
 		(void)job_assumes_zero(j, launchd_mport_deallocate(j->asport));
 	}
@@ -1675,6 +2052,20 @@ job_setup_exit_port(job_t j)
 	return kr;
 }
 
+/* Sends the deferred reply to spawn2() or spawn3(), whichever the requestor
+ * used. The caller clears the reply and exit status ports.
+ */
+kern_return_t
+job_send_spawn_reply(job_t j)
+{
+	if (j->spawn_reply_v3) {
+		j->spawn_reply_v3 = false;
+		return job_mig_spawn3_reply(j->spawn_reply_port, BOOTSTRAP_SUCCESS, j->spawn_reply_handle, j->p, j->exit_status_port);
+	}
+
+	return job_mig_spawn2_reply(j->spawn_reply_port, BOOTSTRAP_SUCCESS, j->p, j->exit_status_port);
+}
+
 job_t 
 job_new_via_mach_init(job_t j, const char *cmd, uid_t uid, bool ond)
 {
@@ -1804,7 +2195,7 @@ job_new_anonymous(jobmgr_t jm, pid_t anonpid)
 		// Anonymous process reaping is messy.
 		LIST_INSERT_HEAD(&jm->active_jobs[ACTIVE_JOB_HASH(jr->p)], jr, pid_hash_sle);
 
-		if (unlikely(kevent_mod(jr->p, EVFILT_PROC, EV_ADD, proc_fflags, 0, root_jobmgr) == -1)) {
+		if (unlikely(kevent_mod(jr->p, EVFILT_PROC, EV_ADD, proc_fflags, 0, job_proc_route_attach(jr, jr->p)) == -1)) {
 			if (errno != ESRCH) {
 				(void)job_assumes_zero(jr, errno);
 			}
@@ -1812,6 +2203,8 @@ job_new_anonymous(jobmgr_t jm, pid_t anonpid)
 			// Zombies interact weirdly with kevent(3).
 			job_log(jr, LOG_ERR, "Failed to add kevent for PID %u. Will unload at MIG return", jr->p);
 			jr->unload_at_mig_return = true;
+		} else {
+			job_proc_route_armed(jr);
 		}
 
 		if (unlikely(shutdown_state)) {
@@ -1875,6 +2268,7 @@ job_new_subjob(job_t j, uuid_t identifier)
 		nj->min_run_time = j->min_run_time;
 		nj->timeout = j->timeout;
 		nj->exit_timeout = j->exit_timeout;
+		nj->stop_signal = j->stop_signal;
 
 		snprintf((char *)nj->label, label_sz + 1, "%s.%s", j->label, idstr);
 
@@ -2375,40 +2769,355 @@ job_import_bulk(launch_data_t pload)
 	return resp;
 }
 
-void
-job_import_bool(job_t j, const char *key, bool value)
+static int
+job_control_bulk_label_cmp(const void *a, const void *b)
 {
-	bool found_key = false;
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
 
-	switch (key[0]) {
-	case 'a':
-	case 'A':
-		if (strcasecmp(key, LAUNCH_JOBKEY_ABANDONPROCESSGROUP) == 0) {
-			j->abandon_pg = value;
-			found_key = true;
-		}
-		break;
-	case 'b':
-	case 'B':
-		if (strcasecmp(key, LAUNCH_JOBKEY_BEGINTRANSACTIONATSHUTDOWN) == 0) {
-			j->dirty_at_shutdown = value;
-			found_key = true;
+static int
+job_control_bulk_label_rcmp(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)b, *(const char *const *)a);
+}
+
+/* Starts, stops or removes a set of jobs in one request. The set is an
+ * explicit list of labels, every job whose label matches a glob, or both.
+ * The reply maps each label to an errno. With a limit, at most that many jobs
+ * are in flight at once; labels that don't fit yet are reported as EINPROGRESS
+ * and acted on as earlier jobs land.
+ */
+launch_data_t
+job_control_bulk(launch_data_t request)
+{
+	launch_data_t labels_obj, pattern_obj, action_obj, order_obj, limit_obj, tmp, resp;
+	const char *action, *order = NULL, *pattern = NULL;
+	char **labels;
+	struct job_throttle *t;
+	size_t i, cnt = 0, max;
+	uint64_t limit = 0;
+	uint32_t grace = 0;
+	int sig = 0;
+	job_t ji;
+
+	if (launch_data_get_type(request) != LAUNCH_DATA_DICTIONARY
+			|| !(action_obj = launch_data_dict_lookup(request, LAUNCH_BULKJOBCONTROL_ACTION))
+			|| launch_data_get_type(action_obj) != LAUNCH_DATA_STRING) {
+		return launch_data_new_errno(EINVAL);
+	}
+
+	action = launch_data_get_string(action_obj);
+	if (strcmp(action, LAUNCH_KEY_STARTJOB) != 0 && strcmp(action, LAUNCH_KEY_STOPJOB) != 0 && strcmp(action, LAUNCH_KEY_REMOVEJOB) != 0) {
+		return launch_data_new_errno(EINVAL);
+	}
+
+	if ((labels_obj = launch_data_dict_lookup(request, LAUNCH_BULKJOBCONTROL_LABELS)) && launch_data_get_type(labels_obj) != LAUNCH_DATA_ARRAY) {
+		return launch_data_new_errno(EINVAL);
+	}
+	if ((pattern_obj = launch_data_dict_lookup(request, LAUNCH_BULKJOBCONTROL_PATTERN))) {
+		if (launch_data_get_type(pattern_obj) != LAUNCH_DATA_STRING) {
+			return launch_data_new_errno(EINVAL);
 		}
-		break;
-	case 'j':
-	case 'J':
-		if (strcasecmp(key, LAUNCH_JOBKEY_JOINGUISESSION) == 0) {
-			j->joins_gui_session = value;
-			found_key = true;
+		pattern = launch_data_get_string(pattern_obj);
+	}
+	if ((order_obj = launch_data_dict_lookup(request, LAUNCH_BULKJOBCONTROL_ORDER)) && launch_data_get_type(order_obj) == LAUNCH_DATA_STRING) {
+		order = launch_data_get_string(order_obj);
+	}
+	if ((limit_obj = launch_data_dict_lookup(request, LAUNCH_BULKJOBCONTROL_LIMIT)) && launch_data_get_type(limit_obj) == LAUNCH_DATA_INTEGER) {
+		limit = (uint64_t)launch_data_get_integer(limit_obj);
+	}
+	if ((tmp = launch_data_dict_lookup(request, LAUNCH_BULKJOBCONTROL_GRACEPERIOD)) && launch_data_get_type(tmp) == LAUNCH_DATA_INTEGER) {
+		long long v = launch_data_get_integer(tmp);
+		if (v < 0 || v > UINT32_MAX) {
+			return launch_data_new_errno(EINVAL);
 		}
-		break;
-	case 'k':
-	case 'K':
-		if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE) == 0) {
-			j->ondemand = !value;
-			found_key = true;
+		grace = (uint32_t)v;
+	}
+	if ((tmp = launch_data_dict_lookup(request, LAUNCH_BULKJOBCONTROL_SIGNAL)) && launch_data_get_type(tmp) == LAUNCH_DATA_INTEGER) {
+		long long v = launch_data_get_integer(tmp);
+		if (v <= 0 || v >= NSIG) {
+			return launch_data_new_errno(EINVAL);
 		}
-		break;
+		sig = (int)v;
+	}
+
+	max = labels_obj ? launch_data_array_get_count(labels_obj) : 0;
+	if (pattern) {
+		for (i = 0; i < LABEL_HASH_SIZE; i++) {
+			LIST_FOREACH(ji, &root_jobmgr->label_hash[i], label_hash_sle) {
+				max++;
+			}
+		}
+	}
+
+	if (!(resp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		return launch_data_new_errno(ENOMEM);
+	}
+	if (max == 0) {
+		return resp;
+	}
+	if (!(labels = calloc(max, sizeof(labels[0])))) {
+		launch_data_free(resp);
+		return launch_data_new_errno(ENOMEM);
+	}
+
+	for (i = 0; labels_obj && i < launch_data_array_get_count(labels_obj); i++) {
+		launch_data_t tmp = launch_data_array_get_index(labels_obj, i);
+		if (tmp && launch_data_get_type(tmp) == LAUNCH_DATA_STRING && (labels[cnt] = strdup(launch_data_get_string(tmp)))) {
+			cnt++;
+		}
+	}
+
+	/* Work from copies of the labels, since removing one job can take others
+	 * with it. We look each one up again just before acting on it.
+	 */
+	if (pattern) {
+		for (i = 0; i < LABEL_HASH_SIZE; i++) {
+			LIST_FOREACH(ji, &root_jobmgr->label_hash[i], label_hash_sle) {
+				if (ji->anonymous || ji->removal_pending || ji->mgr->shutting_down) {
+					continue;
+				}
+				if (fnmatch(pattern, ji->label, 0) == 0 && (labels[cnt] = strdup(ji->label))) {
+					cnt++;
+				}
+			}
+		}
+	}
+
+	if (order && strcasecmp(order, LAUNCH_BULKJOBCONTROL_ORDER_LABEL) == 0) {
+		qsort(labels, cnt, sizeof(labels[0]), job_control_bulk_label_cmp);
+	} else if (order && strcasecmp(order, LAUNCH_BULKJOBCONTROL_ORDER_REVERSE) == 0) {
+		qsort(labels, cnt, sizeof(labels[0]), job_control_bulk_label_rcmp);
+	} else if (pattern && !labels_obj) {
+		// Hash order means nothing to anyone, so give matches a stable order.
+		qsort(labels, cnt, sizeof(labels[0]), job_control_bulk_label_cmp);
+	}
+
+	if (!(t = calloc(1, sizeof(*t)))) {
+		for (i = 0; i < cnt; i++) {
+			free(labels[i]);
+		}
+		free(labels);
+		launch_data_free(resp);
+		return launch_data_new_errno(ENOMEM);
+	}
+
+	if (strcmp(action, LAUNCH_KEY_STARTJOB) == 0) {
+		t->action = JOB_THROTTLE_START;
+		t->verb = LAUNCH_KEY_STARTJOB;
+	} else if (strcmp(action, LAUNCH_KEY_STOPJOB) == 0) {
+		t->action = JOB_THROTTLE_STOP;
+		t->verb = LAUNCH_KEY_STOPJOB;
+	} else {
+		t->action = JOB_THROTTLE_REMOVE;
+		t->verb = LAUNCH_KEY_REMOVEJOB;
+	}
+	t->start_time = runtime_get_opaque_time();
+	t->grace = grace;
+	t->sig = sig;
+	t->limit = (limit && limit < SIZE_MAX) ? (size_t)limit : SIZE_MAX;
+	t->cnt = cnt;
+	t->labels = labels;
+	LIST_INSERT_HEAD(&s_job_throttles, t, sle);
+
+	job_throttle_pump(t, resp);
+
+	// Whatever didn't fit under the limit runs as earlier jobs land.
+	for (i = t->next; i < cnt; i++) {
+		if (launch_data_dict_lookup(resp, labels[i])) {
+			free(labels[i]);
+			labels[i] = NULL;
+			continue;
+		}
+		launch_data_dict_insert(resp, launch_data_new_errno(EINPROGRESS), labels[i]);
+	}
+
+	job_throttle_settle(t);
+
+	return resp;
+}
+
+/* Acts on one label on the throttle's behalf and returns the errno to report
+ * for it. The job counts against the throttle's limit until it lands.
+ */
+int
+job_throttle_act(struct job_throttle *t, const char *label)
+{
+	job_t ji;
+	int e = 0;
+
+	if (!(ji = job_find(NULL, label))) {
+		return errno;
+	}
+
+	// A job named by more than one bulk request only counts against the last.
+	if (ji->throttle) {
+		job_throttle_release(ji);
+	}
+	ji->throttle = t;
+	t->inflight++;
+	t->done++;
+
+	if (t->action == JOB_THROTTLE_START) {
+		e = job_dispatch(ji, true) ? 0 : errno;
+	} else if (t->action == JOB_THROTTLE_STOP) {
+		job_stop(ji);
+	} else {
+		job_remove(ji);
+	}
+
+	/* Acting on the job may have freed it, in which case job_free() has
+	 * already let go of the throttle. Otherwise let go now unless there's
+	 * still something to wait for.
+	 */
+	if ((ji = job_find(NULL, label)) && ji->throttle == t && !job_throttle_pending(t, ji)) {
+		job_throttle_release(ji);
+	}
+
+	return e;
+}
+
+bool
+job_throttle_pending(struct job_throttle *t, job_t j)
+{
+	if (t->action == JOB_THROTTLE_START) {
+		return j->p && !job_is_ready(j);
+	} else if (t->action == JOB_THROTTLE_STOP) {
+		return j->p != 0;
+	}
+
+	return j->removal_pending;
+}
+
+/* Acts on queued labels until the throttle's limit is reached. Errors go into
+ * the reply if there still is one, and to the log otherwise. Everything we
+ * stop in one pass shares one deadline timer, so tearing down a whole batch
+ * is bounded by the grace period rather than by however many exit timeouts
+ * happen to line up.
+ */
+void
+job_throttle_pump(struct job_throttle *t, launch_data_t resp)
+{
+	bool grouped = t->action != JOB_THROTTLE_START;
+	const char *label;
+	int e;
+
+	t->pumping = true;
+	if (grouped) {
+		job_stop_group_begin(t->grace, t->sig);
+	}
+
+	while (t->inflight < t->limit && t->next < t->cnt) {
+		if (!(label = t->labels[t->next++])) {
+			continue;
+		}
+		if (resp && launch_data_dict_lookup(resp, label)) {
+			continue;
+		}
+
+		e = job_throttle_act(t, label);
+		if (resp) {
+			launch_data_dict_insert(resp, launch_data_new_errno(e), label);
+		} else if (e) {
+			jobmgr_log(root_jobmgr, LOG_NOTICE, "Bulk %s: %s: %s", t->verb, label, strerror(e));
+		}
+	}
+
+	if (grouped) {
+		job_stop_group_end();
+	}
+	t->pumping = false;
+}
+
+void
+job_throttle_release(job_t j)
+{
+	struct job_throttle *t = j->throttle;
+
+	j->throttle = NULL;
+	t->inflight--;
+
+	if (t->pumping || t->timer_armed) {
+		return;
+	}
+	if (t->next < t->cnt && jobmgr_assumes_zero_p(root_jobmgr, kevent_mod((uintptr_t)t, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0, 0, root_jobmgr)) != -1) {
+		t->timer_armed = true;
+		return;
+	}
+
+	// Without the timer, carry on from here rather than strand the rest.
+	job_throttle_pump(t, NULL);
+	job_throttle_settle(t);
+}
+
+// Frees the throttle once every label has been acted on and has landed.
+void
+job_throttle_settle(struct job_throttle *t)
+{
+	size_t i;
+
+	if (t->inflight || t->next < t->cnt || t->pumping || t->timer_armed) {
+		return;
+	}
+
+	launchd_syslog(LOG_DEBUG, "Bulk %s: %lu of %lu label%s acted on in %llu ms.", t->verb, t->done, t->cnt, t->cnt == 1 ? "" : "s", runtime_get_nanoseconds_since(t->start_time) / NSEC_PER_MSEC);
+
+	for (i = 0; i < t->cnt; i++) {
+		free(t->labels[i]);
+	}
+	free(t->labels);
+	LIST_REMOVE(t, sle);
+	free(t);
+}
+
+struct job_throttle *
+job_throttle_find(uintptr_t ident)
+{
+	struct job_throttle *t;
+
+	LIST_FOREACH(t, &s_job_throttles, sle) {
+		if ((uintptr_t)t == ident) {
+			break;
+		}
+	}
+
+	return t;
+}
+
+void
+job_import_bool(job_t j, const char *key, bool value)
+{
+	bool found_key = false;
+
+	switch (key[0]) {
+	case 'a':
+	case 'A':
+		if (strcasecmp(key, LAUNCH_JOBKEY_ABANDONPROCESSGROUP) == 0) {
+			j->abandon_pg = value;
+			found_key = true;
+		}
+		break;
+	case 'b':
+	case 'B':
+		if (strcasecmp(key, LAUNCH_JOBKEY_BEGINTRANSACTIONATSHUTDOWN) == 0) {
+			j->dirty_at_shutdown = value;
+			found_key = true;
+		}
+		break;
+	case 'j':
+	case 'J':
+		if (strcasecmp(key, LAUNCH_JOBKEY_JOINGUISESSION) == 0) {
+			j->joins_gui_session = value;
+			found_key = true;
+		}
+		break;
+	case 'k':
+	case 'K':
+		if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE) == 0) {
+			j->ondemand = !value;
+			found_key = true;
+		}
+		break;
 	case 'o':
 	case 'O':
 		if (strcasecmp(key, LAUNCH_JOBKEY_ONDEMAND) == 0) {
@@ -2827,6 +3536,12 @@ job_import_integer(job_t j, const char *key, long long value)
 
 				(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_ADD, NOTE_SECONDS, j->start_interval, j));
 			}
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_STOPSIGNAL) == 0) {
+			if (unlikely(value <= 0 || value >= NSIG)) {
+				job_log(j, LOG_WARNING, "%s is not a valid signal. Ignoring.", LAUNCH_JOBKEY_STOPSIGNAL);
+			} else {
+				j->stop_signal = (typeof(j->stop_signal)) value;
+			}
 #if HAVE_SANDBOX
 		} else if (strcasecmp(key, LAUNCH_JOBKEY_SANDBOXFLAGS) == 0) {
 			j->seatbelt_flags = value;
@@ -2968,6 +3683,14 @@ job_import_dictionary(job_t j, const char *key, launch_data_t value)
 			launch_data_dict_iterate(value, machservice_setup, j);
 		}
 		break;
+	case 'o':
+	case 'O':
+		if (strcasecmp(key, LAUNCH_JOBKEY_OUTPUTCAPTURE) == 0) {
+			j->capture_output = true;
+			j->capture_cfg.max_files = JOB_CAPTURE_DEFAULT_MAXFILES;
+			launch_data_dict_iterate(value, capture_setup, j);
+		}
+		break;
 	case 'l':
 	case 'L':
 		if (strcasecmp(key, LAUNCH_JOBKEY_LAUNCHEVENTS) == 0) {
@@ -3449,7457 +4172,11023 @@ job_mig_destructor(job_t j)
 	calendarinterval_sanity_check();
 }
 
-void
-job_export_all2(jobmgr_t jm, launch_data_t where)
-{
-	jobmgr_t jmi;
-	job_t ji;
+/* job_export() and the VPROC_GSK_ALLJOBS export share one builder, which works
+ * from a snapshot of what it needs to read from the job.
+ *
+ * When the dictionary is built before we return to the run loop, the snapshot
+ * just borrows the job's strings and descriptors. Exporting every job is
+ * expensive enough that it shouldn't hold up the main thread, though, so
+ * job_mig_swap_complex() takes snapshots that copy the strings into one arena
+ * (leaving out the socket descriptors, which the reply revokes anyway) and
+ * builds and packs the reply on worker threads.
+ */
+#define JOB_EXPORT_ARENA_BLOCKSZ (64 * 1024)
 
-	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
-		job_export_all2(jmi, where);
-	}
+struct job_export_arena_block {
+	struct job_export_arena_block *next;
+	size_t used;
+	size_t size;
+	char buf[0];
+};
 
-	LIST_FOREACH(ji, &jm->jobs, sle) {
-		launch_data_t tmp;
+struct job_export_arena {
+	struct job_export_arena_block *blocks;
+	bool borrow;
+};
 
-		if (jobmgr_assumes(jm, (tmp = job_export(ji)) != NULL)) {
-			launch_data_dict_insert(where, tmp, ji->label);
-		}
-	}
-}
+struct job_export_socket {
+	const char *name;
+	// NULL if the descriptors weren't captured.
+	const int *fds;
+	unsigned int fd_cnt;
+};
 
-launch_data_t
-job_export_all(void)
-{
-	launch_data_t resp = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+struct job_export_ms {
+	const char *name;
+	bool per_pid;
+};
 
-	if (resp != NULL) {
-		job_export_all2(root_jobmgr, resp);
-	} else {
-		(void)os_assumes_zero(errno);
-	}
+struct job_export_snapshot {
+	const char *label;
+	const char *mgr_name;
+	const char *prog;
+	const char *stdinpath;
+	const char *stdoutpath;
+	const char *stderrpath;
+	const char *const *argv;
+	size_t argc;
+	struct job_export_socket *sockets;
+	size_t socket_cnt;
+	struct job_export_ms *ms;
+	size_t ms_cnt;
+	long long last_exit_status;
+	pid_t p;
+	uint32_t timeout;
+	uint64_t ready_latency;
+	const struct job_history_entry *history;
+	uint32_t history_next;
+	const struct job_descendant *descendants;
+	struct job_capture_config capture_cfg;
+	uint64_t capture_dropped;
+	bool ondemand:1,
+		enable_transactions:1,
+		session_create:1,
+		inetcompat:1,
+		inetcompat_wait:1,
+		capture_output:1;
+};
 
-	return resp;
-}
+struct jobmgr_export_snapshot {
+	struct job_export_snapshot *jobs;
+	launch_data_t *exported;
+	size_t job_cnt;
+};
 
-void
-job_log_stray_pg(job_t j)
+struct job_export_all_ctx {
+	struct jobmgr_export_snapshot *jms;
+	size_t jm_cnt;
+	struct job_export_arena arena;
+	mach_port_t rp;
+};
+
+static void *
+job_export_arena_alloc(struct job_export_arena *a, size_t sz)
 {
-	pid_t *pids = NULL;
-	size_t len = sizeof(pid_t) * get_kern_max_proc();
-	int i = 0, kp_cnt = 0;
+	struct job_export_arena_block *b = a->blocks;
+	void *r;
 
-	if (!launchd_apple_internal) {
-		return;
-	}
+	sz = (sz + 7) & ~(size_t)7;
+	if (!b || b->size - b->used < sz) {
+		size_t bsz = (sz > JOB_EXPORT_ARENA_BLOCKSZ) ? sz : JOB_EXPORT_ARENA_BLOCKSZ;
 
-	runtime_ktrace(RTKT_LAUNCHD_FINDING_STRAY_PG, j->p, 0, 0);
+		if (!(b = malloc(sizeof(*b) + bsz))) {
+			return NULL;
+		}
 
-	if (!job_assumes(j, (pids = malloc(len)) != NULL)) {
-		return;
-	}
-	if (job_assumes_zero_p(j, (kp_cnt = proc_listpgrppids(j->p, pids, len))) == -1) {
-		goto out;
+		b->used = 0;
+		b->size = bsz;
+		b->next = a->blocks;
+		a->blocks = b;
 	}
 
-	for (i = 0; i < kp_cnt; i++) {
-		pid_t p_i = pids[i];
-		if (p_i == j->p) {
-			continue;
-		} else if (p_i == 0 || p_i == 1) {
-			continue;
-		}
+	r = b->buf + b->used;
+	b->used += sz;
 
-		struct proc_bsdshortinfo proc;
-		if (proc_pidinfo(p_i, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
-			if (errno != ESRCH) {
-				(void)job_assumes_zero(j, errno);
-			}
-			continue;
-		}
+	return r;
+}
 
-		pid_t pp_i = proc.pbsi_ppid;
-		const char *z = (proc.pbsi_status == SZOMB) ? "zombie " : "";
-		const char *n = proc.pbsi_comm;
+static const void *
+job_export_arena_copy(struct job_export_arena *a, const void *p, size_t sz)
+{
+	void *r;
 
-		job_log(j, LOG_WARNING, "Stray %sprocess with PGID equal to this dead job: PID %u PPID %u PGID %u %s", z, p_i, pp_i, proc.pbsi_pgid, n);
+	if (!p || a->borrow) {
+		return p;
+	}
+	if ((r = job_export_arena_alloc(a, sz))) {
+		memcpy(r, p, sz);
 	}
 
-out:
-	free(pids);
+	return r;
 }
 
-#if HAVE_SYSTEMSTATS
-static void
-systemstats_timer_callback(void)
+static const char *
+job_export_arena_strdup(struct job_export_arena *a, const char *s)
 {
-	jobmgr_log_perf_statistics(root_jobmgr, true);
+	return s ? job_export_arena_copy(a, s, strlen(s) + 1) : NULL;
 }
 
-static bool
-systemstats_is_enabled(void)
+static void
+job_export_arena_free(struct job_export_arena *a)
 {
-	static bool systemstats_enabled;
+	struct job_export_arena_block *b;
 
-	if (!systemstats_enabled) {
-		char *store = launchd_copy_persistent_store(LAUNCHD_PERSISTENT_STORE_LOGS, NULL);
-		systemstats_enabled = systemstats_init(SYSTEMSTATS_WRITER_launchd, store);
-		free(store);
+	while ((b = a->blocks)) {
+		a->blocks = b->next;
+		free(b);
+	}
+}
 
-		uint64_t interval;
-		interval = systemstats_get_log_interval(SYSTEMSTATS_WRITER_launchd);
+static void
+job_export_snapshot_take(job_t j, struct job_export_snapshot *js, struct job_export_arena *a)
+{
+	struct socketgroup *sg;
+	struct machservice *ms;
+	size_t i = 0;
 
-		if (pid1_magic && systemstats_enabled && interval) {
-			jobmgr_assumes_zero_p(root_jobmgr, kevent_mod((uintptr_t)systemstats_timer_callback, EVFILT_TIMER, EV_ADD, NOTE_SECONDS, interval, root_jobmgr));
+	js->label = job_export_arena_strdup(a, j->label);
+	js->mgr_name = job_export_arena_strdup(a, j->mgr->name);
+	js->prog = job_export_arena_strdup(a, j->prog);
+	js->stdinpath = job_export_arena_strdup(a, j->stdinpath);
+	js->stdoutpath = job_export_arena_strdup(a, j->stdoutpath);
+	js->stderrpath = job_export_arena_strdup(a, j->stderrpath);
+
+	js->last_exit_status = j->fpfail ? LAUNCH_EXITSTATUS_FAIRPLAY_FAIL : j->last_exit_status;
+	js->p = j->p;
+	js->timeout = j->timeout;
+	js->ready_latency = j->ready_latency;
+	js->history = job_export_arena_copy(a, j->history, sizeof(j->history));
+	js->history_next = j->history_next;
+	js->descendants = job_export_arena_copy(a, j->descendants, JOB_DESCENDANTS_MAX * sizeof(j->descendants[0]));
+
+	js->ondemand = j->ondemand;
+	js->enable_transactions = j->enable_transactions;
+	js->session_create = j->session_create;
+	js->inetcompat = j->inetcompat;
+	js->inetcompat_wait = j->inetcompat_wait;
+	js->capture_output = j->capture_output;
+	js->capture_cfg = j->capture_cfg;
+	js->capture_dropped = job_capture_dropped(j);
+
+	if (likely(j->argv)) {
+		const char **argv = a->borrow ? (const char **)j->argv : job_export_arena_alloc(a, j->argc * sizeof(char *));
+		if (argv) {
+			if (!a->borrow) {
+				for (i = 0; i < j->argc; i++) {
+					argv[i] = job_export_arena_strdup(a, j->argv[i]);
+				}
+			}
+			js->argv = argv;
+			js->argc = j->argc;
 		}
 	}
 
-	return systemstats_enabled;
+	SLIST_FOREACH(sg, &j->sockets, sle) {
+		js->socket_cnt++;
+	}
+	if (js->socket_cnt && (js->sockets = job_export_arena_alloc(a, js->socket_cnt * sizeof(js->sockets[0])))) {
+		i = 0;
+		SLIST_FOREACH(sg, &j->sockets, sle) {
+			js->sockets[i].name = job_export_arena_strdup(a, sg->name);
+			js->sockets[i].fds = a->borrow ? sg->fds : NULL;
+			js->sockets[i].fd_cnt = sg->fd_cnt;
+			i++;
+		}
+	} else {
+		js->socket_cnt = 0;
+	}
+
+	SLIST_FOREACH(ms, &j->machservices, sle) {
+		js->ms_cnt++;
+	}
+	if (js->ms_cnt && (js->ms = job_export_arena_alloc(a, js->ms_cnt * sizeof(js->ms[0])))) {
+		i = 0;
+		SLIST_FOREACH(ms, &j->machservices, sle) {
+			js->ms[i].name = job_export_arena_strdup(a, ms->name);
+			js->ms[i].per_pid = ms->per_pid;
+			i++;
+		}
+	} else {
+		js->ms_cnt = 0;
+	}
 }
-#endif // HAVE_SYSTEMSTATS
 
-void
-job_reap(job_t j)
+/* A snapshot that copied its strings may be built off the main thread, so
+ * this may not touch any launchd state or log.
+ */
+static launch_data_t
+job_export_snapshot_build(const struct job_export_snapshot *js)
 {
-	bool is_system_bootstrapper = ((j->is_bootstrapper && pid1_magic) && !j->mgr->parentmgr);
-
-	job_log(j, LOG_DEBUG, "Reaping");
+	launch_data_t tmp, tmp2, tmp3, r = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	size_t i = 0;
 
-	if (unlikely(j->weird_bootstrap)) {
-		int64_t junk = 0;
-		job_mig_swap_integer(j, VPROC_GSK_WEIRD_BOOTSTRAP, 0, 0, &junk);
+	if (r == NULL) {
+		return NULL;
 	}
 
-	if (j->fork_fd) {
-		(void)job_assumes_zero_p(j, runtime_close(j->fork_fd));
-		j->fork_fd = 0;
+	if (js->label && (tmp = launch_data_new_string(js->label))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_LABEL);
+	}
+	if (js->mgr_name && (tmp = launch_data_new_string(js->mgr_name))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_LIMITLOADTOSESSIONTYPE);
+	}
+	if ((tmp = launch_data_new_bool(js->ondemand))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_ONDEMAND);
+	}
+	if ((tmp = launch_data_new_integer(js->last_exit_status))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_LASTEXITSTATUS);
+	}
+	if (js->p && (tmp = launch_data_new_integer(js->p))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_PID);
+	}
+	if (js->history && (tmp = job_history_export(js->history, js->history_next))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_HISTORY);
+	}
+	if ((tmp = job_descendants_export(js->descendants, JOB_DESCENDANTS_MAX))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_DESCENDANTS);
+	}
+	if (js->capture_output && (tmp = job_capture_export(&js->capture_cfg, js->capture_dropped))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_OUTPUTCAPTURE);
+	}
+	if (js->p && js->ready_latency && (tmp = launch_data_new_integer(js->ready_latency / NSEC_PER_USEC))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_READYLATENCY);
+	}
+	if ((tmp = launch_data_new_integer(js->timeout))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_TIMEOUT);
+	}
+	if (js->prog && (tmp = launch_data_new_string(js->prog))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_PROGRAM);
+	}
+	if (js->stdinpath && (tmp = launch_data_new_string(js->stdinpath))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDINPATH);
+	}
+	if (js->stdoutpath && (tmp = launch_data_new_string(js->stdoutpath))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDOUTPATH);
+	}
+	if (js->stderrpath && (tmp = launch_data_new_string(js->stderrpath))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDERRORPATH);
 	}
+	if (js->argv && (tmp = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
+		for (i = 0; i < js->argc; i++) {
+			if (js->argv[i] && (tmp2 = launch_data_new_string(js->argv[i]))) {
+				launch_data_array_set_index(tmp, tmp2, i);
+			}
+		}
 
-	bool was_dirty = false;
-	if (!(j->anonymous || j->implicit_reap)) {
-		uint32_t flags = 0;
-		(void)job_assumes_zero(j, proc_get_dirty(j->p, &flags));
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_PROGRAMARGUMENTS);
+	}
 
-		j->idle_exit = (flags & PROC_DIRTY_ALLOWS_IDLE_EXIT);
-		was_dirty = (flags & PROC_DIRTY_IS_DIRTY);
+	if (js->enable_transactions && (tmp = launch_data_new_bool(true))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_ENABLETRANSACTIONS);
+	}
 
-		job_log(j, LOG_DEBUG, "%sob exited %s.", j->idle_exit ? "Idle-exit j" : "J", was_dirty ? "while dirty" : "cleanly");
+	if (js->session_create && (tmp = launch_data_new_bool(true))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_SESSIONCREATE);
 	}
 
-	if (j->idle_exit && was_dirty) {
-		if (j->jettisoned) {
-			job_log(j, LOG_NOTICE, "Idle-exit job was jettisoned while dirty. Will respawn immediately.");
-			j->unthrottle = true;
-			j->start_pending = true;
-		} else {
-			job_log(j, LOG_INFO, "Idle-exit job exited while dirty.");
+	if (js->inetcompat && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		if ((tmp2 = launch_data_new_bool(js->inetcompat_wait))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBINETDCOMPATIBILITY_WAIT);
 		}
-	} else if (j->idle_exit && j->jettisoned) {
-		/* If an idle-exit job is jettisoned, then we shouldn't throttle its
-		 * next respawn because it could not help when it exited. If it ran for
-		 * the minimum runtime, then this doesn't really matter. If it ran for
-		 * less than the minimum runtime, it will not be throttled.
-		 *
-		 * <rdar://problem/12098667>
-		 */
-		job_log(j, LOG_NOTICE, "Idle-exit job was jettisoned. Will bypass throttle interval for next on-demand launch.");
-		j->unthrottle = true;
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_INETDCOMPATIBILITY);
 	}
 
-	if (j->anonymous) {
-		j->last_exit_status = 0;
-	} else {
-		uint64_t rt = runtime_get_nanoseconds_since(j->start_time);
-		j->trt += rt;
+	if (js->socket_cnt && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		unsigned int k;
 
-		job_log(j, LOG_PERF, "Last instance wall time: %06f", (double)rt / (double)NSEC_PER_SEC);
-		j->nruns++;
+		for (i = 0; i < js->socket_cnt; i++) {
+			const struct job_export_socket *jes = &js->sockets[i];
 
-		/* The job is dead. While the PID/PGID is still known to be valid, try
-		 * to kill abandoned descendant processes.
-		 */
-		job_log_stray_pg(j);
-		if (!j->abandon_pg) {
-			if (unlikely(killpg2(j->p, SIGTERM) == -1 && errno != ESRCH)) {
-				job_log(j, LOG_APPLEONLY, "Bug: 5487498");
+			if (jes->name && (tmp2 = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
+				for (k = 0; k < jes->fd_cnt; k++) {
+					if ((tmp3 = launch_data_new_fd(jes->fds ? jes->fds[k] : -1))) {
+						launch_data_array_set_index(tmp2, tmp3, k);
+					}
+				}
+				launch_data_dict_insert(tmp, tmp2, jes->name);
 			}
 		}
 
-		int r = -1;
-		if (!j->implicit_reap) {
-			/* If the shutdown monitor has suspended a task and not resumed it
-			 * resumed it before exiting, the kernel will not clean up after the
-			 * shutdown monitor. It will, instead, leave the task suspended and
-			 * not process any pending signals on the event loop for the task.
-			 *
-			 * There are a variety of other kernel bugs that could prevent a
-			 * process from exiting, usually having to do with faulty hardware
-			 * or talking to misbehaving drivers that mark a thread as
-			 * uninterruptible and deadlock/hang before unmarking it as such. So
-			 * we have to work around that too.
-			 *
-			 * See <rdar://problem/9284889&9359725>.
-			 */
-			if (j->workaround9359725) {
-				job_log(j, LOG_NOTICE, "Simulated exit: <rdar://problem/9359725>");
-				j->last_exit_status = W_EXITCODE(-1, SIGSEGV);
-			} else {
-#if HAVE_SYSTEMSTATS
-				int r2;
-				struct rusage_info_v1 ri;
-				r2 = job_assumes_zero(j, proc_pid_rusage(j->p, RUSAGE_INFO_V1, (rusage_info_t)&ri));
-#endif
-				if ((r = wait4(j->p, &j->last_exit_status, 0, NULL)) == -1) {
-					job_log(j, LOG_ERR, "Reap failed. Assuming job exited: %d: %s", errno, strerror(errno));
-					j->last_exit_status = W_EXITCODE(-1, SIGSEGV);
-				}
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_SOCKETS);
+	}
 
-				if (j->idle_exit && j->jettisoned) {
-					// Treat idle-exit jettisons as successful exit.
-					//
-					// <rdar://problem/13338973>
-					(void)job_assumes_zero(j, WTERMSIG(j->last_exit_status));
-					j->last_exit_status = W_EXITCODE(0, 0);
+	if (js->ms_cnt && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		tmp3 = NULL;
+
+		for (i = 0; i < js->ms_cnt; i++) {
+			if (!js->ms[i].name) {
+				continue;
+			}
+
+			if (js->ms[i].per_pid) {
+				if (tmp3 == NULL) {
+					tmp3 = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
 				}
-#if HAVE_SYSTEMSTATS
-				if (r2 == 0) {
-					job_log_perf_statistics(j, &ri, j->last_exit_status);
+				if (tmp3) {
+					tmp2 = launch_data_new_machport(MACH_PORT_NULL);
+					launch_data_dict_insert(tmp3, tmp2, js->ms[i].name);
 				}
-#endif
+			} else {
+				tmp2 = launch_data_new_machport(MACH_PORT_NULL);
+				launch_data_dict_insert(tmp, tmp2, js->ms[i].name);
 			}
-		} else {
-			job_log(j, LOG_INFO, "Job was implicitly reaped by the kernel.");
+		}
+
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_MACHSERVICES);
+
+		if (tmp3) {
+			launch_data_dict_insert(r, tmp3, LAUNCH_JOBKEY_PERJOBMACHSERVICES);
 		}
 	}
 
-	if (j->exit_timeout) {
-		(void)kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	return r;
+}
+
+launch_data_t
+job_export(job_t j)
+{
+	struct job_export_arena a = { .borrow = true };
+	struct job_export_snapshot js = { 0 };
+	launch_data_t r;
+
+	job_export_snapshot_take(j, &js, &a);
+	r = job_export_snapshot_build(&js);
+	job_export_arena_free(&a);
+
+	return r;
+}
+
+static size_t
+jobmgr_count_deep(jobmgr_t jm)
+{
+	size_t cnt = 1;
+	jobmgr_t jmi;
+
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		cnt += jobmgr_count_deep(jmi);
 	}
 
-	LIST_REMOVE(j, pid_hash_sle);
-	if (!j->anonymous) {
-		LIST_REMOVE(j, global_pid_hash_sle);
+	return cnt;
+}
+
+static void
+jobmgr_export_snapshot_take(jobmgr_t jm, struct jobmgr_export_snapshot *jms, size_t *idx, struct job_export_arena *a)
+{
+	jobmgr_t jmi;
+	job_t ji;
+
+	/* Submanagers go first so that the outermost manager's job wins a label
+	 * collision, just like the old recursive export.
+	 */
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		jobmgr_export_snapshot_take(jmi, jms, idx, a);
 	}
 
-	if (j->sent_signal_time) {
-		uint64_t td_sec, td_usec, td = runtime_get_nanoseconds_since(j->sent_signal_time);
+	struct jobmgr_export_snapshot *jmsi = &jms[(*idx)++];
+	LIST_FOREACH(ji, &jm->jobs, sle) {
+		jmsi->job_cnt++;
+	}
 
-		td_sec = td / NSEC_PER_SEC;
-		td_usec = (td % NSEC_PER_SEC) / NSEC_PER_USEC;
+	if (jmsi->job_cnt == 0) {
+		return;
+	}
 
-		job_log(j, LOG_DEBUG, "Exited %llu.%06llu seconds after the first signal was sent", td_sec, td_usec);
+	jmsi->jobs = calloc(jmsi->job_cnt, sizeof(jmsi->jobs[0]));
+	jmsi->exported = calloc(jmsi->job_cnt, sizeof(jmsi->exported[0]));
+	if (!jobmgr_assumes(jm, jmsi->jobs != NULL && jmsi->exported != NULL)) {
+		free(jmsi->jobs);
+		free(jmsi->exported);
+		jmsi->jobs = NULL;
+		jmsi->exported = NULL;
+		jmsi->job_cnt = 0;
+		return;
 	}
 
-	int exit_status = WEXITSTATUS(j->last_exit_status);
-	if (WIFEXITED(j->last_exit_status) && exit_status != 0) {
-		if (!j->did_exec && _launchd_support_system) {
-			xpc_object_t event = NULL;
-			switch (exit_status) {
-			case ENOENT:
-			case ENOTDIR:
-			case ESRCH:
-				job_log(j, LOG_NOTICE, "Job failed to exec(3). Setting up event to tell us when to try again: %d: %s", exit_status, strerror(exit_status));
-				event = xpc_dictionary_create(NULL, NULL, 0);
-				xpc_dictionary_set_string(event, "Executable", j->prog ? j->prog : j->argv[0]);
-				if (j->mach_uid) {
-					xpc_dictionary_set_uint64(event, "UID", j->mach_uid);
-				} else if (j->username) {
-					xpc_dictionary_set_string(event, "UserName", j->username);
-				}
+	size_t i = 0;
+	LIST_FOREACH(ji, &jm->jobs, sle) {
+		job_export_snapshot_take(ji, &jmsi->jobs[i++], a);
+	}
+}
 
-				if (j->groupname) {
-					xpc_dictionary_set_string(event, "GroupName", j->groupname);
-				}
+static struct job_export_all_ctx *
+job_export_all_snapshot(bool borrow)
+{
+	struct job_export_all_ctx *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		return NULL;
+	}
 
-				(void)externalevent_new(j, _launchd_support_system, j->label, event, 0);
-				xpc_release(event);
+	ctx->arena.borrow = borrow;
+	ctx->jm_cnt = jobmgr_count_deep(root_jobmgr);
+	ctx->jms = calloc(ctx->jm_cnt, sizeof(ctx->jms[0]));
+	if (!ctx->jms) {
+		free(ctx);
+		return NULL;
+	}
 
-				j->waiting4ok = true;
-			default:
-				job_log(j, LOG_NOTICE, "Job failed to exec(3) for weird reason: %d", exit_status);
-			}
-		} else {
-			int level = LOG_INFO;
-			if (exit_status != 0) {
-				level = LOG_ERR;
-			}
+	size_t idx = 0;
+	jobmgr_export_snapshot_take(root_jobmgr, ctx->jms, &idx, &ctx->arena);
 
-			job_log(j, level, "Exited with code: %d", exit_status);
+	return ctx;
+}
+
+static void
+job_export_all_ctx_free(struct job_export_all_ctx *ctx)
+{
+	size_t i = 0, k = 0;
+
+	for (i = 0; i < ctx->jm_cnt; i++) {
+		struct jobmgr_export_snapshot *jmsi = &ctx->jms[i];
+		for (k = 0; k < jmsi->job_cnt; k++) {
+			if (jmsi->exported[k]) {
+				launch_data_free(jmsi->exported[k]);
+			}
 		}
+		free(jmsi->jobs);
+		free(jmsi->exported);
 	}
 
-	if (WIFSIGNALED(j->last_exit_status)) {
-		int s = WTERMSIG(j->last_exit_status);
-		if ((SIGKILL == s || SIGTERM == s) && !j->stopped) {
-			job_log(j, LOG_NOTICE, "Exited: %s", strsignal(s));
-		} else if (!(j->stopped || j->clean_kill || j->jettisoned)) {
-			switch (s) {
-			// Signals which indicate a crash.
-			case SIGILL:
-			case SIGABRT:
-			case SIGFPE:
-			case SIGBUS:
-			case SIGSEGV:
-			case SIGSYS:
-			/* If the kernel has posted NOTE_EXIT and the signal sent to the process was
-			 * SIGTRAP, assume that it's a crash.
-			 */
-			case SIGTRAP:
-				j->crashed = true;
-				job_log(j, LOG_WARNING, "Job appears to have crashed: %s", strsignal(s));
-				break;
-			default:
-				job_log(j, LOG_WARNING, "Exited abnormally: %s", strsignal(s));
-				break;
-			}
+	job_export_arena_free(&ctx->arena);
+	free(ctx->jms);
+	free(ctx);
+}
 
-			if (is_system_bootstrapper && j->crashed) {
-				job_log(j, LOG_ERR | LOG_CONSOLE, "The %s bootstrapper has crashed: %s", j->mgr->name, strsignal(s));
-			}
-		}
+static launch_data_t
+job_export_all_build(struct job_export_all_ctx *ctx)
+{
+	launch_data_t resp = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	if (!resp) {
+		return NULL;
 	}
 
-	j->reaped = true;
-
-	struct machservice *msi = NULL;
-	if (j->crashed || !(j->did_exec || j->anonymous)) {
-		SLIST_FOREACH(msi, &j->machservices, sle) {
-			if (j->crashed && !msi->isActive && (msi->drain_one_on_crash || msi->drain_all_on_crash)) {
-				machservice_drain_port(msi);
-			}
-
-			if (!j->did_exec && msi->reset && job_assumes(j, !msi->isActive)) {
-				machservice_resetport(j, msi);
-			}
+	// Each manager's snapshot is independent, so build them concurrently.
+	dispatch_apply(ctx->jm_cnt, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+		struct jobmgr_export_snapshot *jmsi = &ctx->jms[i];
+		size_t k = 0;
+		for (k = 0; k < jmsi->job_cnt; k++) {
+			jmsi->exported[k] = job_export_snapshot_build(&jmsi->jobs[k]);
 		}
-	}
+	});
 
-	/* HACK: Essentially duplicating the logic directly above. But this has
-	 * gotten really hairy, and I don't want to try consolidating it right now.
-	 */
-	if (j->xpc_service && !j->xpcproxy_did_exec) {
-		job_log(j, LOG_ERR, "XPC Service could not exec(3). Resetting port.");
-		SLIST_FOREACH(msi, &j->machservices, sle) {
-			/* Drain the messages but do not reset the port. If xpcproxy could
-			 * not exec(3), then we don't want to continue trying, since there
-			 * is very likely a serious configuration error with the service.
-			 *
-			 * The above comment is weird. I originally said we should drain
-			 * messages but not reset the port, but that's exactly what we do
-			 * below, and I'm not sure which is the mistake, the comment or the
-			 * actual behavior.
-			 *
-			 * Since it's always been this way, I'll assume that the comment is
-			 * incorrect, but I'll leave it in place just to remind myself to
-			 * actually look into it at some point.
-			 *
-			 * <rdar://problem/8986802>
-			 */
-			if (msi->upfront && job_assumes(j, !msi->isActive)) {
-				machservice_resetport(j, msi);
+	size_t i = 0, k = 0;
+	for (i = 0; i < ctx->jm_cnt; i++) {
+		struct jobmgr_export_snapshot *jmsi = &ctx->jms[i];
+		for (k = 0; k < jmsi->job_cnt; k++) {
+			if (jmsi->exported[k] && jmsi->jobs[k].label) {
+				// The response now owns this object.
+				launch_data_dict_insert(resp, jmsi->exported[k], jmsi->jobs[k].label);
+				jmsi->exported[k] = NULL;
 			}
 		}
 	}
 
-	struct suspended_peruser *spi = NULL;
-	while ((spi = LIST_FIRST(&j->suspended_perusers))) {
-		job_log(j, LOG_ERR, "Job exited before resuming per-user launchd for UID %u. Will forcibly resume.", spi->j->mach_uid);
-		spi->j->peruser_suspend_count--;
-		if (spi->j->peruser_suspend_count == 0) {
-			job_dispatch(spi->j, false);
-		}
-		LIST_REMOVE(spi, sle);
-		free(spi);
-	}
+	return resp;
+}
 
-	if (j->exit_status_dest) {
-		errno = helper_downcall_wait(j->exit_status_dest, j->last_exit_status);
-		if (errno && errno != MACH_SEND_INVALID_DEST) {
-			(void)job_assumes_zero(j, errno);
-		}
+/* Packs obj into a MIG out-of-line buffer that is exactly as large as it needs
+ * to be.
+ */
+static bool
+launch_data_pack_mig(launch_data_t obj, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt)
+{
+	size_t sz = launch_data_packed_size(obj, NULL);
 
-		j->exit_status_dest = MACH_PORT_NULL;
-	}
+	*outval = 0;
+	*outvalCnt = 0;
 
-	if (j->spawn_reply_port) {
-		/* If the child never called exec(3), we must send a spawn() reply so
-		 * that the requestor can get exit status from it. If we fail to send
-		 * the reply for some reason, we have to deallocate the exit status port
-		 * ourselves.
-		 */
-		kern_return_t kr = job_mig_spawn2_reply(j->spawn_reply_port, BOOTSTRAP_SUCCESS, j->p, j->exit_status_port);
-		if (kr) {
-			if (kr != MACH_SEND_INVALID_DEST) {
-				(void)job_assumes_zero(j, kr);
-			}
+	if (sz > UINT32_MAX) {
+		errno = EFBIG;
+		return false;
+	}
 
-			(void)job_assumes_zero(j, launchd_mport_close_recv(j->exit_status_port));
-		}
+	mig_allocate(outval, (vm_size_t)sz);
+	if (!*outval) {
+		errno = ENOMEM;
+		return false;
+	}
 
-		j->exit_status_port = MACH_PORT_NULL;
-		j->spawn_reply_port = MACH_PORT_NULL;
+	if (launch_data_pack(obj, (void *)*outval, sz, NULL, NULL) != sz) {
+		mig_deallocate(*outval, (vm_size_t)sz);
+		*outval = 0;
+		errno = EINVAL;
+		return false;
 	}
 
-	if (j->anonymous) {
-		total_anon_children--;
-		if (j->holds_ref) {
-			job_log(j, LOG_PERF, "Anonymous job exited holding reference.");
-			runtime_del_ref();
+	*outvalCnt = (mach_msg_type_number_t)sz;
+	return true;
+}
+
+static void
+job_export_all_async(void *context)
+{
+	struct job_export_all_ctx *ctx = context;
+	kern_return_t kr = 1;
+	vm_offset_t outval = 0;
+	mach_msg_type_number_t outvalCnt = 0;
+
+	launch_data_t output_obj = job_export_all_build(ctx);
+	if (output_obj) {
+		if (launch_data_pack_mig(output_obj, &outval, &outvalCnt)) {
+			kr = 0;
 		}
-	} else {
-		job_log(j, LOG_PERF, "Job exited.");
-		runtime_del_ref();
-		total_children--;
+		launch_data_free(output_obj);
 	}
 
-	if (j->has_console) {
-		launchd_wsp = 0;
+	if (unlikely(errno = job_mig_swap_complex_reply(ctx->rp, kr, outval, outvalCnt))) {
+		(void)launchd_mport_deallocate(ctx->rp);
 	}
 
-	if (j->shutdown_monitor) {
-		job_log(j, LOG_NOTICE | LOG_CONSOLE, "Shutdown monitor has exited.");
-		_launchd_shutdown_monitor = NULL;
-		j->shutdown_monitor = false;
+	if (outval) {
+		mig_deallocate(outval, outvalCnt);
 	}
+	job_export_all_ctx_free(ctx);
+}
 
-	if (!j->anonymous) {
-		j->mgr->normal_active_cnt--;
+launch_data_t
+job_export_all(void)
+{
+	launch_data_t resp = NULL;
+	struct job_export_all_ctx *ctx = job_export_all_snapshot(true);
+
+	if (ctx != NULL) {
+		resp = job_export_all_build(ctx);
+		job_export_all_ctx_free(ctx);
+	} else {
+		(void)os_assumes_zero(errno);
 	}
-	j->sent_signal_time = 0;
-	j->sent_sigkill = false;
-	j->clean_kill = false;
-	j->event_monitor_ready2signal = false;
-	j->p = 0;
-	j->uniqueid = 0;
+
+	return resp;
 }
 
 void
-jobmgr_dispatch_all(jobmgr_t jm, bool newmounthack)
+job_log_stray_pg(job_t j)
 {
-	jobmgr_t jmi, jmn;
-	job_t ji, jn;
+	pid_t *pids = NULL;
+	size_t len = sizeof(pid_t) * get_kern_max_proc();
+	int i = 0, kp_cnt = 0;
 
-	if (jm->shutting_down) {
+	if (!launchd_apple_internal) {
 		return;
 	}
 
-	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
-		jobmgr_dispatch_all(jmi, newmounthack);
-	}
+	runtime_ktrace(RTKT_LAUNCHD_FINDING_STRAY_PG, j->p, 0, 0);
 
-	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
-		if (newmounthack && ji->start_on_mount) {
-			ji->start_pending = true;
+	/* Anything left in the dead job's process group that we know about is one
+	 * of its descendants, so unless the job outgrew our table, we already have
+	 * everything we need.
+	 */
+	if (!j->descendants_overflowed) {
+		if (j->descendants) {
+			for (i = 0; i < JOB_DESCENDANTS_MAX; i++) {
+				struct job_descendant *jd = &j->descendants[i];
+				if (jd->p && jd->pgid == j->p) {
+					job_log(j, LOG_WARNING, "Stray process with PGID equal to this dead job: PID %u PPID %u PGID %u %s", jd->p, jd->ppid, jd->pgid, jd->comm);
+				}
+			}
 		}
-
-		job_dispatch(ji, false);
+		return;
 	}
-}
-
-void
-job_dispatch_curious_jobs(job_t j)
-{	
-	job_t ji = NULL, jt = NULL;
-	SLIST_FOREACH_SAFE(ji, &s_curious_jobs, curious_jobs_sle, jt) {
-		struct semaphoreitem *si = NULL;
-		SLIST_FOREACH(si, &ji->semaphores, sle) {			
-			if (!(si->why == OTHER_JOB_ENABLED || si->why == OTHER_JOB_DISABLED)) {
-				continue;
-			}
 
-			if (strcmp(si->what, j->label) == 0) {
-				job_log(ji, LOG_DEBUG, "Dispatching out of interest in \"%s\".", j->label);
+	if (!job_assumes(j, (pids = malloc(len)) != NULL)) {
+		return;
+	}
+	if (job_assumes_zero_p(j, (kp_cnt = proc_listpgrppids(j->p, pids, len))) == -1) {
+		goto out;
+	}
 
-				if (!ji->removing) {
-					job_dispatch(ji, false);
-				} else {
-					job_log(ji, LOG_NOTICE, "The following job is circularly dependent upon this one: %s", j->label);
-				}
+	for (i = 0; i < kp_cnt; i++) {
+		pid_t p_i = pids[i];
+		if (p_i == j->p) {
+			continue;
+		} else if (p_i == 0 || p_i == 1) {
+			continue;
+		}
 
-				/* ji could be removed here, so don't do anything with it or its semaphores
-				 * after this point.
-				 */
-				break;
+		struct proc_bsdshortinfo proc;
+		if (proc_pidinfo(p_i, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
+			if (errno != ESRCH) {
+				(void)job_assumes_zero(j, errno);
 			}
+			continue;
 		}
+
+		pid_t pp_i = proc.pbsi_ppid;
+		const char *z = (proc.pbsi_status == SZOMB) ? "zombie " : "";
+		const char *n = proc.pbsi_comm;
+
+		job_log(j, LOG_WARNING, "Stray %sprocess with PGID equal to this dead job: PID %u PPID %u PGID %u %s", z, p_i, pp_i, proc.pbsi_pgid, n);
 	}
+
+out:
+	free(pids);
 }
 
-job_t
-job_dispatch(job_t j, bool kickstart)
+#if HAVE_SYSTEMSTATS
+static void
+systemstats_timer_callback(void)
 {
-	// Don't dispatch a job if it has no audit session set.
-	if (!uuid_is_null(j->expected_audit_uuid)) {
-		job_log(j, LOG_DEBUG, "Job is still awaiting its audit session UUID. Not dispatching.");
-		return NULL;
-	}
-	if (j->alias) {
-		job_log(j, LOG_DEBUG, "Job is an alias. Not dispatching.");
-		return NULL;
-	}
+	jobmgr_log_perf_statistics(root_jobmgr, true);
+}
 
-	if (j->waiting4ok) {
-		job_log(j, LOG_DEBUG, "Job cannot exec(3). Not dispatching.");
-		return NULL;
-	}
+static bool
+systemstats_is_enabled(void)
+{
+	static bool systemstats_enabled;
 
-#if TARGET_OS_EMBEDDED
-	if (launchd_embedded_handofgod && _launchd_embedded_god) {
-		if (!job_assumes(j, _launchd_embedded_god->username != NULL && j->username != NULL)) {
-			errno = EPERM;
-			return NULL;
+	if (!systemstats_enabled) {
+		char *store = launchd_copy_persistent_store(LAUNCHD_PERSISTENT_STORE_LOGS, NULL);
+		systemstats_enabled = systemstats_init(SYSTEMSTATS_WRITER_launchd, store);
+		free(store);
+
+		uint64_t interval;
+		interval = systemstats_get_log_interval(SYSTEMSTATS_WRITER_launchd);
+
+		if (pid1_magic && systemstats_enabled && interval) {
+			jobmgr_assumes_zero_p(root_jobmgr, kevent_mod((uintptr_t)systemstats_timer_callback, EVFILT_TIMER, EV_ADD, NOTE_SECONDS, interval, root_jobmgr));
 		}
+	}
 
-		if (strcmp(j->username, _launchd_embedded_god->username) != 0) {
-			errno = EPERM;
-			return NULL;
-		}
-	} else if (launchd_embedded_handofgod) {
-		errno = EINVAL;
-		return NULL;
-	}
-#endif
-
-	/*
-	 * The whole job removal logic needs to be consolidated. The fact that
-	 * a job can be removed from just about anywhere makes it easy to have
-	 * stale pointers left behind somewhere on the stack that might get
-	 * used after the deallocation. In particular, during job iteration.
-	 *
-	 * This is a classic example. The act of dispatching a job may delete it.
-	 */	
-	if (!job_active(j)) {
-		if (job_useless(j)) {
-			job_log(j, LOG_DEBUG, "Job is useless. Removing.");
-			job_remove(j);
-			return NULL;
-		}
-		if (unlikely(j->per_user && j->peruser_suspend_count > 0)) {
-			job_log(j, LOG_DEBUG, "Per-user launchd is suspended. Not dispatching.");
-			return NULL;
-		}
-
-		if (kickstart || job_keepalive(j)) {
-			job_log(j, LOG_DEBUG, "%starting job", kickstart ? "Kicks" : "S");
-			job_start(j);
-		} else {
-			job_log(j, LOG_DEBUG, "Watching job.");
-			job_watch(j);
-		}
-	} else {
-		job_log(j, LOG_DEBUG, "Tried to dispatch an already active job: %s.", job_active(j));
-	}
-
-	return j;
+	return systemstats_enabled;
 }
+#endif // HAVE_SYSTEMSTATS
 
 void
-job_kill(job_t j)
+job_reap(job_t j)
 {
-	if (unlikely(!j->p || j->anonymous)) {
-		return;
-	}
-
-	(void)job_assumes_zero_p(j, kill2(j->p, SIGKILL));
-
-	j->sent_sigkill = true;
-	(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, LAUNCHD_SIGKILL_TIMER, j));
+	struct waiting_for_ready *w4rdy;
+	bool is_system_bootstrapper = ((j->is_bootstrapper && pid1_magic) && !j->mgr->parentmgr);
 
-	job_log(j, LOG_DEBUG, "Sent SIGKILL signal");
-}
+	job_log(j, LOG_DEBUG, "Reaping");
 
-void
-job_open_shutdown_transaction(job_t j)
-{
-	int rv = proc_set_dirty(j->p, true);
-	if (rv != 0) {
-		job_log(j, LOG_DEBUG, "Job wants to be dirty at shutdown, but it is not Instant Off-compliant. Treating normally.");
-		j->dirty_at_shutdown = false;
+	if (unlikely(j->weird_bootstrap)) {
+		int64_t junk = 0;
+		job_mig_swap_integer(j, VPROC_GSK_WEIRD_BOOTSTRAP, 0, 0, &junk);
 	}
-}
 
-void
-job_close_shutdown_transaction(job_t j)
-{
-	if (j->dirty_at_shutdown) {
-		job_log(j, LOG_DEBUG, "Closing shutdown transaction for job.");
-		(void)job_assumes_zero(j, proc_set_dirty(j->p, false));
-		j->dirty_at_shutdown = false;
+	if (j->fork_fd) {
+		(void)job_assumes_zero_p(j, runtime_close(j->fork_fd));
+		j->fork_fd = 0;
 	}
-}
 
-void
-job_log_children_without_exec(job_t j)
-{
-	pid_t *pids = NULL;
-	size_t len = sizeof(pid_t) * get_kern_max_proc();
-	int i = 0, kp_cnt = 0;
+	bool was_dirty = false;
+	if (!(j->anonymous || j->implicit_reap)) {
+		uint32_t flags = 0;
+		(void)job_assumes_zero(j, proc_get_dirty(j->p, &flags));
 
-	if (!launchd_apple_internal || j->anonymous || j->per_user) {
-		return;
-	}
+		j->idle_exit = (flags & PROC_DIRTY_ALLOWS_IDLE_EXIT);
+		was_dirty = (flags & PROC_DIRTY_IS_DIRTY);
 
-	if (!job_assumes(j, (pids = malloc(len)) != NULL)) {
-		return;
-	}
-	if (job_assumes_zero_p(j, (kp_cnt = proc_listchildpids(j->p, pids, len))) == -1) {
-		goto out;
+		job_log(j, LOG_DEBUG, "%sob exited %s.", j->idle_exit ? "Idle-exit j" : "J", was_dirty ? "while dirty" : "cleanly");
 	}
 
-	for (i = 0; i < kp_cnt; i++) {
-		struct proc_bsdshortinfo proc;
-		if (proc_pidinfo(pids[i], PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
-			if (errno != ESRCH) {
-				(void)job_assumes_zero(j, errno);
-			}
-			continue;
-		}
-		if (proc.pbsi_flags & P_EXEC) {
-			continue;
+	if (j->idle_exit && was_dirty) {
+		if (j->jettisoned) {
+			job_log(j, LOG_NOTICE, "Idle-exit job was jettisoned while dirty. Will respawn immediately.");
+			j->unthrottle = true;
+			j->start_pending = true;
+		} else {
+			job_log(j, LOG_INFO, "Idle-exit job exited while dirty.");
 		}
-
-		job_log(j, LOG_DEBUG, "Called *fork(). Please switch to posix_spawn*(), pthreads or launchd. Child PID %u", pids[i]);
+	} else if (j->idle_exit && j->jettisoned) {
+		/* If an idle-exit job is jettisoned, then we shouldn't throttle its
+		 * next respawn because it could not help when it exited. If it ran for
+		 * the minimum runtime, then this doesn't really matter. If it ran for
+		 * less than the minimum runtime, it will not be throttled.
+		 *
+		 * <rdar://problem/12098667>
+		 */
+		job_log(j, LOG_NOTICE, "Idle-exit job was jettisoned. Will bypass throttle interval for next on-demand launch.");
+		j->unthrottle = true;
 	}
 
-out:
-	free(pids);
-}
-
-void
-job_callback_proc(job_t j, struct kevent *kev)
-{
-	bool program_changed = false;
-	int fflags = kev->fflags;
-
-	job_log(j, LOG_DEBUG, "EVFILT_PROC event for job.");
-	log_kevent_struct(LOG_DEBUG, kev, 0);
-
-	if (fflags & NOTE_EXEC) {
-		program_changed = true;
-
-		if (j->anonymous) {
-			struct proc_bsdshortinfo proc;
-			if (proc_pidinfo(j->p, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) > 0) {
-				char newlabel[1000];
+	if (j->anonymous) {
+		j->last_exit_status = 0;
+	} else {
+		uint64_t rt = runtime_get_nanoseconds_since(j->start_time);
+		j->trt += rt;
 
-				snprintf(newlabel, sizeof(newlabel), "%p.anonymous.%s", j, proc.pbsi_comm);
+		job_log(j, LOG_PERF, "Last instance wall time: %06f", (double)rt / (double)NSEC_PER_SEC);
+		j->nruns++;
 
-				job_log(j, LOG_INFO, "Program changed. Updating the label to: %s", newlabel);
+		/* The job is dead. While the PID/PGID is still known to be valid, try
+		 * to kill abandoned descendant processes.
+		 */
+		job_log_stray_pg(j);
+		if (!j->abandon_pg) {
+			if (unlikely(killpg2(j->p, SIGTERM) == -1 && errno != ESRCH)) {
+				job_log(j, LOG_APPLEONLY, "Bug: 5487498");
+			}
+		}
+		job_descendants_reparent(j, j->p);
 
-				LIST_REMOVE(j, label_hash_sle);
-				strcpy((char *)j->label, newlabel);
+		int r = -1;
+		if (!j->implicit_reap) {
+			/* If the shutdown monitor has suspended a task and not resumed it
+			 * resumed it before exiting, the kernel will not clean up after the
+			 * shutdown monitor. It will, instead, leave the task suspended and
+			 * not process any pending signals on the event loop for the task.
+			 *
+			 * There are a variety of other kernel bugs that could prevent a
+			 * process from exiting, usually having to do with faulty hardware
+			 * or talking to misbehaving drivers that mark a thread as
+			 * uninterruptible and deadlock/hang before unmarking it as such. So
+			 * we have to work around that too.
+			 *
+			 * See <rdar://problem/9284889&9359725>.
+			 */
+			if (j->workaround9359725) {
+				job_log(j, LOG_NOTICE, "Simulated exit: <rdar://problem/9359725>");
+				j->last_exit_status = W_EXITCODE(-1, SIGSEGV);
+			} else {
+#if HAVE_SYSTEMSTATS
+				int r2;
+				struct rusage_info_v1 ri;
+				r2 = job_assumes_zero(j, proc_pid_rusage(j->p, RUSAGE_INFO_V1, (rusage_info_t)&ri));
+#endif
+				if ((r = wait4(j->p, &j->last_exit_status, 0, NULL)) == -1) {
+					job_log(j, LOG_ERR, "Reap failed. Assuming job exited: %d: %s", errno, strerror(errno));
+					j->last_exit_status = W_EXITCODE(-1, SIGSEGV);
+				}
 
-				jobmgr_t where2put = root_jobmgr;
-				if (j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
-					where2put = j->mgr;
+				if (j->idle_exit && j->jettisoned) {
+					// Treat idle-exit jettisons as successful exit.
+					//
+					// <rdar://problem/13338973>
+					(void)job_assumes_zero(j, WTERMSIG(j->last_exit_status));
+					j->last_exit_status = W_EXITCODE(0, 0);
 				}
-				LIST_INSERT_HEAD(&where2put->label_hash[hash_label(j->label)], j, label_hash_sle);
-			} else if (errno != ESRCH) {
-				(void)job_assumes_zero(j, errno);
-			}
-		} else {
-			if (j->spawn_reply_port) {
-				errno = job_mig_spawn2_reply(j->spawn_reply_port, BOOTSTRAP_SUCCESS, j->p, j->exit_status_port);
-				if (errno) {
-					if (errno != MACH_SEND_INVALID_DEST) {
-						(void)job_assumes_zero(j, errno);
-					}
-					(void)job_assumes_zero(j, launchd_mport_close_recv(j->exit_status_port));
+#if HAVE_SYSTEMSTATS
+				if (r2 == 0) {
+					job_log_perf_statistics(j, &ri, j->last_exit_status);
 				}
-
-				j->spawn_reply_port = MACH_PORT_NULL;
-				j->exit_status_port = MACH_PORT_NULL;
-			}
-
-			if (j->xpc_service && j->did_exec) {
-				j->xpcproxy_did_exec = true;
+#endif
 			}
-
-			j->did_exec = true;
-			job_log(j, LOG_DEBUG, "Program changed");
+		} else {
+			job_log(j, LOG_INFO, "Job was implicitly reaped by the kernel.");
 		}
 	}
 
-	if (fflags & NOTE_FORK) {
-		job_log(j, LOG_DEBUG, "fork()ed%s", program_changed ? ". For this message only: We don't know whether this event happened before or after execve()." : "");
-		job_log_children_without_exec(j);
+	if (j->exit_timeout) {
+		(void)kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	}
+	if (j->stop_group) {
+		job_stop_group_leave(j, false);
 	}
 
-	if (fflags & NOTE_EXIT) {
-		if (kev->data & NOTE_EXIT_DECRYPTFAIL) {
-			j->fpfail = true;
-			job_log(j, LOG_WARNING, "FairPlay decryption failed on binary for job.");
-		} else if (kev->data & NOTE_EXIT_MEMORY) {
-			j->jettisoned = true;
-			job_log(j, LOG_INFO, "Job was killed due to memory pressure.");
-		}
+	LIST_REMOVE(j, pid_hash_sle);
+	if (!j->anonymous) {
+		LIST_REMOVE(j, global_pid_hash_sle);
+	}
+	job_proc_route_detach(j);
 
-		job_reap(j);
+	if (j->sent_signal_time) {
+		uint64_t td_sec, td_usec, td = runtime_get_nanoseconds_since(j->sent_signal_time);
 
-		if (j->anonymous) {
-			job_remove(j);
-			j = NULL;
-		} else {
-			struct waiting4attach *w4ai = NULL;
-			struct waiting4attach *w4ait = NULL;
-			LIST_FOREACH_SAFE(w4ai, &_launchd_domain_waiters, le, w4ait) {
-				if (w4ai->dest == (pid_t)kev->ident) {
-					waiting4attach_delete(j->mgr, w4ai);
+		td_sec = td / NSEC_PER_SEC;
+		td_usec = (td % NSEC_PER_SEC) / NSEC_PER_USEC;
+
+		job_log(j, LOG_DEBUG, "Exited %llu.%06llu seconds after the first signal was sent", td_sec, td_usec);
+	}
+
+	int exit_status = WEXITSTATUS(j->last_exit_status);
+	if (WIFEXITED(j->last_exit_status) && exit_status != 0) {
+		if (!j->did_exec && _launchd_support_system) {
+			xpc_object_t event = NULL;
+			switch (exit_status) {
+			case ENOENT:
+			case ENOTDIR:
+			case ESRCH:
+				job_log(j, LOG_NOTICE, "Job failed to exec(3). Setting up event to tell us when to try again: %d: %s", exit_status, strerror(exit_status));
+				event = xpc_dictionary_create(NULL, NULL, 0);
+				xpc_dictionary_set_string(event, "Executable", j->prog ? j->prog : j->argv[0]);
+				if (j->mach_uid) {
+					xpc_dictionary_set_uint64(event, "UID", j->mach_uid);
+				} else if (j->username) {
+					xpc_dictionary_set_string(event, "UserName", j->username);
+				}
+
+				if (j->groupname) {
+					xpc_dictionary_set_string(event, "GroupName", j->groupname);
 				}
+
+				(void)externalevent_new(j, _launchd_support_system, j->label, event, 0);
+				xpc_release(event);
+
+				j->waiting4ok = true;
+			default:
+				job_log(j, LOG_NOTICE, "Job failed to exec(3) for weird reason: %d", exit_status);
+			}
+		} else {
+			int level = LOG_INFO;
+			if (exit_status != 0) {
+				level = LOG_ERR;
 			}
 
-			(void)job_dispatch(j, false);
+			job_log(j, level, "Exited with code: %d", exit_status);
 		}
 	}
-}
 
-void
-job_callback_timer(job_t j, void *ident)
-{
-	if (j == ident) {
-		job_log(j, LOG_DEBUG, "j == ident (%p)", ident);
-		job_dispatch(j, true);
-	} else if (&j->semaphores == ident) {
-		job_log(j, LOG_DEBUG, "&j->semaphores == ident (%p)", ident);
-		job_dispatch(j, false);
-	} else if (&j->start_interval == ident) {
-		job_log(j, LOG_DEBUG, "&j->start_interval == ident (%p)", ident);
-		j->start_pending = true;
-		job_dispatch(j, false);
-	} else if (&j->exit_timeout == ident) {
-		if (!job_assumes(j, j->p != 0)) {
-			return;
-		}
+	if (WIFSIGNALED(j->last_exit_status)) {
+		int s = WTERMSIG(j->last_exit_status);
+		if ((SIGKILL == s || SIGTERM == s) && !j->stopped) {
+			job_log(j, LOG_NOTICE, "Exited: %s", strsignal(s));
+		} else if (!(j->stopped || j->clean_kill || j->jettisoned)) {
+			switch (s) {
+			// Signals which indicate a crash.
+			case SIGILL:
+			case SIGABRT:
+			case SIGFPE:
+			case SIGBUS:
+			case SIGSEGV:
+			case SIGSYS:
+			/* If the kernel has posted NOTE_EXIT and the signal sent to the process was
+			 * SIGTRAP, assume that it's a crash.
+			 */
+			case SIGTRAP:
+				j->crashed = true;
+				job_log_crash(j, s);
+				break;
+			default:
+				job_log(j, LOG_WARNING, "Exited abnormally: %s", strsignal(s));
+				break;
+			}
 
-		if (j->sent_sigkill) {
-			uint64_t td = runtime_get_nanoseconds_since(j->sent_signal_time);
+			if (is_system_bootstrapper && j->crashed) {
+				job_log(j, LOG_ERR | LOG_CONSOLE, "The %s bootstrapper has crashed: %s", j->mgr->name, strsignal(s));
+			}
+		}
+	}
 
-			td /= NSEC_PER_SEC;
-			td -= j->clean_kill ? 0 : j->exit_timeout;
+	if (!j->anonymous) {
+		uint8_t reason = JOB_HISTORY_REASON_NONE;
+		if (j->workaround9359725) {
+			reason = JOB_HISTORY_REASON_SIMULATED;
+		} else if (j->implicit_reap) {
+			reason = JOB_HISTORY_REASON_IMPLICIT_REAP;
+		} else if (j->jettisoned) {
+			reason = JOB_HISTORY_REASON_JETTISONED;
+		} else if (j->stopped) {
+			reason = JOB_HISTORY_REASON_STOPPED;
+		} else if (!j->did_exec) {
+			reason = JOB_HISTORY_REASON_NO_EXEC;
+		}
 
-			job_log(j, LOG_WARNING | LOG_CONSOLE, "Job has not died after being %skilled %llu seconds ago. Simulating exit.", j->clean_kill ? "cleanly " : "", td);
-			j->workaround9359725 = true;
+		job_history_record(j, j->crashed ? JOB_HISTORY_CRASH : JOB_HISTORY_EXIT, j->last_exit_status, reason);
+	}
 
-			// This basically has to be done off the main thread. We have no
-			// mechanism for draining the main queue in our run loop (like CF
-			// does), and the kevent mechanism wants an object to be associated
-			// as the callback. So we just create a dispatch source and reap the
-			// errant PID whenever we can. Note that it is not safe for us to do
-			// any logging in this block, since logging requires exclusive
-			// access to global data structures that is only protected by the
-			// main thread.
-			dispatch_source_t hack_13570156 = dispatch_source_create(DISPATCH_SOURCE_TYPE_PROC, j->p, DISPATCH_PROC_EXIT, dispatch_get_global_queue(0, 0));
-			dispatch_source_set_event_handler(hack_13570156, ^{
-				pid_t pid = (pid_t)dispatch_source_get_handle(hack_13570156);
+	j->reaped = true;
 
-				int status = 0;
-				(void)waitpid(pid, &status, 0);
-				dispatch_release(hack_13570156);
-			});
+	struct machservice *msi = NULL;
+	if (j->crashed || !(j->did_exec || j->anonymous)) {
+		SLIST_FOREACH(msi, &j->machservices, sle) {
+			if (j->crashed && !msi->isActive && (msi->drain_one_on_crash || msi->drain_all_on_crash)) {
+				machservice_drain_port(msi);
+			}
 
-			dispatch_resume(hack_13570156);
+			if (!j->did_exec && msi->reset && job_assumes(j, !msi->isActive)) {
+				machservice_resetport(j, msi);
+			}
+		}
+	}
 
-			if (launchd_trap_sigkill_bugs) {
-				job_log(j, LOG_NOTICE | LOG_CONSOLE, "Trapping into kernel debugger. You can continue the machine after it has been debugged, and shutdown will proceed normally.");
-				(void)job_assumes_zero(j, host_reboot(mach_host_self(), HOST_REBOOT_DEBUGGER));
+	/* HACK: Essentially duplicating the logic directly above. But this has
+	 * gotten really hairy, and I don't want to try consolidating it right now.
+	 */
+	if (j->xpc_service && !j->xpcproxy_did_exec) {
+		job_log(j, LOG_ERR, "XPC Service could not exec(3). Resetting port.");
+		SLIST_FOREACH(msi, &j->machservices, sle) {
+			/* Drain the messages but do not reset the port. If xpcproxy could
+			 * not exec(3), then we don't want to continue trying, since there
+			 * is very likely a serious configuration error with the service.
+			 *
+			 * The above comment is weird. I originally said we should drain
+			 * messages but not reset the port, but that's exactly what we do
+			 * below, and I'm not sure which is the mistake, the comment or the
+			 * actual behavior.
+			 *
+			 * Since it's always been this way, I'll assume that the comment is
+			 * incorrect, but I'll leave it in place just to remind myself to
+			 * actually look into it at some point.
+			 *
+			 * <rdar://problem/8986802>
+			 */
+			if (msi->upfront && job_assumes(j, !msi->isActive)) {
+				machservice_resetport(j, msi);
 			}
+		}
+	}
 
-			struct kevent bogus_exit;
-			EV_SET(&bogus_exit, j->p, EVFILT_PROC, 0, NOTE_EXIT, 0, 0);
-			jobmgr_callback(j->mgr, &bogus_exit);
-		} else {
-			if (unlikely(j->debug_before_kill)) {
-				job_log(j, LOG_NOTICE, "Exit timeout elapsed. Entering the kernel debugger");
-				(void)job_assumes_zero(j, host_reboot(mach_host_self(), HOST_REBOOT_DEBUGGER));
+	struct suspended_peruser *spi = NULL;
+	while ((spi = LIST_FIRST(&j->suspended_perusers))) {
+		job_log(j, LOG_ERR, "Job exited before resuming per-user launchd for UID %u. Will forcibly resume.", spi->j->mach_uid);
+		spi->j->peruser_suspend_count--;
+		if (spi->j->peruser_suspend_count == 0) {
+			job_dispatch(spi->j, false);
+		}
+		LIST_REMOVE(spi, sle);
+		free(spi);
+	}
+
+	if (j->exit_status_dest) {
+		errno = helper_downcall_wait(j->exit_status_dest, j->last_exit_status);
+		if (errno && errno != MACH_SEND_INVALID_DEST) {
+			(void)job_assumes_zero(j, errno);
+		}
+
+		j->exit_status_dest = MACH_PORT_NULL;
+	}
+
+	if (j->spawn_reply_port) {
+		/* If the child never called exec(3), we must send a spawn() reply so
+		 * that the requestor can get exit status from it. If we fail to send
+		 * the reply for some reason, we have to deallocate the exit status port
+		 * ourselves.
+		 */
+		kern_return_t kr = job_send_spawn_reply(j);
+		if (kr) {
+			if (kr != MACH_SEND_INVALID_DEST) {
+				(void)job_assumes_zero(j, kr);
 			}
 
-			job_log(j, LOG_WARNING | LOG_CONSOLE, "Exit timeout elapsed (%u seconds). Killing", j->exit_timeout);
-			job_kill(j);
+			(void)job_assumes_zero(j, launchd_mport_close_recv(j->exit_status_port));
 		}
-	} else {
-		job_log(j, LOG_ERR, "Unrecognized job timer callback: %p", ident);
+
+		j->exit_status_port = MACH_PORT_NULL;
+		j->spawn_reply_port = MACH_PORT_NULL;
 	}
-}
 
-void
-job_callback_read(job_t j, int ident)
-{
-	if (ident == j->stdin_fd) {
-		job_dispatch(j, true);
+	while ((w4rdy = SLIST_FIRST(&j->ready_watchers))) {
+		job_log(j, LOG_NOTICE, "Job exited before it was ready. Failing kickstart waiter.");
+		waiting4ready_delete(j, w4rdy, ESRCH);
+	}
+
+	if (j->anonymous) {
+		total_anon_children--;
+		if (j->holds_ref) {
+			job_log(j, LOG_PERF, "Anonymous job exited holding reference.");
+			runtime_del_ref();
+		}
 	} else {
-		socketgroup_callback(j);
+		job_log(j, LOG_PERF, "Job exited.");
+		runtime_del_ref();
+		total_children--;
 	}
-}
 
-void
-jobmgr_reap_bulk(jobmgr_t jm, struct kevent *kev)
-{
-	jobmgr_t jmi;
-	job_t j;
+	if (j->has_console) {
+		launchd_wsp = 0;
+	}
 
-	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
-		jobmgr_reap_bulk(jmi, kev);
+	if (j->shutdown_monitor) {
+		job_log(j, LOG_NOTICE | LOG_CONSOLE, "Shutdown monitor has exited.");
+		_launchd_shutdown_monitor = NULL;
+		j->shutdown_monitor = false;
 	}
 
-	if ((j = jobmgr_find_by_pid(jm, (pid_t)kev->ident, false))) {
-		kev->udata = j;
-		job_callback(j, kev);
+	if (!j->anonymous) {
+		j->mgr->normal_active_cnt--;
+	}
+	j->sent_signal_time = 0;
+	j->sent_sigkill = false;
+	j->clean_kill = false;
+	j->stop_grace = 0;
+	j->event_monitor_ready2signal = false;
+	job_per_pid_services_release(j);
+	j->p = 0;
+	j->uniqueid = 0;
+
+	// A job being removed stays in flight until it's freed.
+	if (j->throttle && !j->removal_pending) {
+		job_throttle_release(j);
 	}
 }
 
 void
-jobmgr_callback(void *obj, struct kevent *kev)
+jobmgr_dispatch_all(jobmgr_t jm, bool newmounthack)
 {
-	jobmgr_t jm = obj;
+	jobmgr_t jmi, jmn;
+	job_t ji, jn;
 
-#if TARGET_OS_EMBEDDED
-	int flag2check = VQ_MOUNT;
-#else
-	int flag2check = VQ_UPDATE;
-#endif
+	if (jm->shutting_down) {
+		return;
+	}
 
-	switch (kev->filter) {
-	case EVFILT_PROC:
-		jobmgr_reap_bulk(jm, kev);
-		root_jobmgr = jobmgr_do_garbage_collection(root_jobmgr);
-		break;
-	case EVFILT_SIGNAL:
-		switch (kev->ident) {
-		case SIGTERM:			
-			jobmgr_log(jm, LOG_DEBUG, "Got SIGTERM. Shutting down.");
-			return launchd_shutdown();
-		case SIGUSR1:
-			return calendarinterval_callback();
-		case SIGUSR2:
-			// Turn on all logging.
-			launchd_log_perf = true;
-			launchd_log_debug = true;
-			launchd_log_shutdown = true;
-			/* Hopefully /var is available by this point. If not, uh, oh well.
-			 * It's just a debugging facility.
-			 */
-			return jobmgr_log_perf_statistics(jm, false);
-		case SIGINFO:
-			return jobmgr_log_perf_statistics(jm, true);
-		default:
-			jobmgr_log(jm, LOG_ERR, "Unrecognized signal: %lu: %s", kev->ident, strsignal(kev->ident));
+	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
+		jobmgr_dispatch_all(jmi, newmounthack);
+	}
+
+	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
+		if (newmounthack && ji->start_on_mount) {
+			ji->start_pending = true;
 		}
-		break;
-	case EVFILT_FS:
-		if (kev->fflags & flag2check) {
-			if (!launchd_var_available) {
-				struct stat sb;
-				if (stat("/var/log", &sb) == 0 && (sb.st_mode & S_IWUSR)) {
-					launchd_var_available = true;
+
+		job_dispatch(ji, false);
+	}
+}
+
+void
+job_dispatch_curious_jobs(job_t j)
+{	
+	job_t ji = NULL, jt = NULL;
+	SLIST_FOREACH_SAFE(ji, &s_curious_jobs, curious_jobs_sle, jt) {
+		struct semaphoreitem *si = NULL;
+		SLIST_FOREACH(si, &ji->semaphores, sle) {			
+			if (!(si->why == OTHER_JOB_ENABLED || si->why == OTHER_JOB_DISABLED)) {
+				continue;
+			}
+
+			if (strcmp(si->what, j->label) == 0) {
+				job_log(ji, LOG_DEBUG, "Dispatching out of interest in \"%s\".", j->label);
+
+				if (!ji->removing) {
+					job_dispatch(ji, false);
+				} else {
+					job_log(ji, LOG_NOTICE, "The following job is circularly dependent upon this one: %s", j->label);
 				}
+
+				/* ji could be removed here, so don't do anything with it or its semaphores
+				 * after this point.
+				 */
+				break;
 			}
-		} else if (kev->fflags & VQ_MOUNT) {
-			jobmgr_dispatch_all(jm, true);
 		}
-		jobmgr_dispatch_all_semaphores(jm);
-		break;
-	case EVFILT_TIMER:
-		if (kev->ident == (uintptr_t)&sorted_calendar_events) {
-			calendarinterval_callback();
-		} else if (kev->ident == (uintptr_t)jm) {
-			jobmgr_log(jm, LOG_DEBUG, "Shutdown timer firing.");
-			jobmgr_still_alive_with_check(jm);
-		} else if (kev->ident == (uintptr_t)&jm->reboot_flags) {
-			jobmgr_do_garbage_collection(jm);
-		} else if (kev->ident == (uintptr_t)&launchd_runtime_busy_time) {
-			jobmgr_log(jm, LOG_DEBUG, "Idle exit timer fired. Shutting down.");
-			if (jobmgr_assumes_zero(jm, runtime_busy_cnt) == 0) {
-				return launchd_shutdown();
-			}
-#if HAVE_SYSTEMSTATS
-		} else if (kev->ident == (uintptr_t)systemstats_timer_callback) {
-			systemstats_timer_callback();
+	}
+}
+
+job_t
+job_dispatch(job_t j, bool kickstart)
+{
+	// Don't dispatch a job if it has no audit session set.
+	if (!uuid_is_null(j->expected_audit_uuid)) {
+		job_log(j, LOG_DEBUG, "Job is still awaiting its audit session UUID. Not dispatching.");
+		return NULL;
+	}
+	if (j->alias) {
+		job_log(j, LOG_DEBUG, "Job is an alias. Not dispatching.");
+		return NULL;
+	}
+
+	if (j->waiting4ok) {
+		job_log(j, LOG_DEBUG, "Job cannot exec(3). Not dispatching.");
+		return NULL;
+	}
+
+#if TARGET_OS_EMBEDDED
+	if (launchd_embedded_handofgod && _launchd_embedded_god) {
+		if (!job_assumes(j, _launchd_embedded_god->username != NULL && j->username != NULL)) {
+			errno = EPERM;
+			return NULL;
+		}
+
+		if (strcmp(j->username, _launchd_embedded_god->username) != 0) {
+			errno = EPERM;
+			return NULL;
+		}
+	} else if (launchd_embedded_handofgod) {
+		errno = EINVAL;
+		return NULL;
+	}
 #endif
+
+	/*
+	 * The whole job removal logic needs to be consolidated. The fact that
+	 * a job can be removed from just about anywhere makes it easy to have
+	 * stale pointers left behind somewhere on the stack that might get
+	 * used after the deallocation. In particular, during job iteration.
+	 *
+	 * This is a classic example. The act of dispatching a job may delete it.
+	 */	
+	if (!job_active(j)) {
+		if (job_useless(j)) {
+			job_log(j, LOG_DEBUG, "Job is useless. Removing.");
+			job_remove(j);
+			return NULL;
 		}
-		break;
-	case EVFILT_VNODE:
-		if (kev->ident == (uintptr_t)s_no_hang_fd) {
-			int _no_hang_fd = open("/dev/autofs_nowait", O_EVTONLY | O_NONBLOCK);
-			if (unlikely(_no_hang_fd != -1)) {
-				jobmgr_log(root_jobmgr, LOG_DEBUG, "/dev/autofs_nowait has appeared!");
-				(void)jobmgr_assumes_zero_p(root_jobmgr, kevent_mod((uintptr_t)s_no_hang_fd, EVFILT_VNODE, EV_DELETE, 0, 0, NULL));
-				(void)jobmgr_assumes_zero_p(root_jobmgr, runtime_close(s_no_hang_fd));
-				s_no_hang_fd = _fd(_no_hang_fd);
-			}
-		} else if (pid1_magic && launchd_console && kev->ident == (uintptr_t)fileno(launchd_console)) {
-			int cfd = -1;
-			if (jobmgr_assumes_zero_p(jm, cfd = open(_PATH_CONSOLE, O_WRONLY | O_NOCTTY)) != -1) {
-				_fd(cfd);
-				if (!(launchd_console = fdopen(cfd, "w"))) {
-					(void)jobmgr_assumes_zero(jm, errno);
-					(void)close(cfd);
-				}
-			}
+		if (unlikely(j->per_user && j->peruser_suspend_count > 0)) {
+			job_log(j, LOG_DEBUG, "Per-user launchd is suspended. Not dispatching.");
+			return NULL;
 		}
-		break;
-	default:
-		jobmgr_log(jm, LOG_ERR, "Unrecognized kevent filter: %hd", kev->filter);
+
+		if (kickstart || job_keepalive(j)) {
+			job_log(j, LOG_DEBUG, "%starting job", kickstart ? "Kicks" : "S");
+			job_start(j);
+		} else {
+			job_log(j, LOG_DEBUG, "Watching job.");
+			job_watch(j);
+		}
+	} else {
+		job_log(j, LOG_DEBUG, "Tried to dispatch an already active job: %s.", job_active(j));
 	}
+
+	return j;
 }
 
 void
-job_callback(void *obj, struct kevent *kev)
+job_kill(job_t j)
 {
-	job_t j = obj;
+	if (unlikely(!j->p || j->anonymous)) {
+		return;
+	}
 
-	job_log(j, LOG_DEBUG, "Dispatching kevent callback.");
+	(void)job_assumes_zero_p(j, kill2(j->p, SIGKILL));
+	job_history_record(j, JOB_HISTORY_KILL, SIGKILL, j->stopped ? JOB_HISTORY_REASON_STOPPED : JOB_HISTORY_REASON_NONE);
 
-	switch (kev->filter) {
-	case EVFILT_PROC:
-		return job_callback_proc(j, kev);
-	case EVFILT_TIMER:
-		return job_callback_timer(j, (void *) kev->ident);
-	case EVFILT_READ:
-		return job_callback_read(j, (int) kev->ident);
-	case EVFILT_MACHPORT:
-		return (void)job_dispatch(j, true);
-	default:
-		job_log(j, LOG_ERR, "Unrecognized job callback filter: %hd", kev->filter);
-	}
+	j->sent_sigkill = true;
+	(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, LAUNCHD_SIGKILL_TIMER, j));
+
+	job_log(j, LOG_DEBUG, "Sent SIGKILL signal");
 }
 
+/* Opens a stop group. Until the matching job_stop_group_end(), job_stop()
+ * puts each job it sends a terminating signal into the group instead of
+ * arming that job's exit timeout. Calls nest, and only the outermost call's
+ * overrides take effect.
+ */
 void
-job_start(job_t j)
+job_stop_group_begin(uint32_t grace, int sig)
 {
-	uint64_t td;
-	int spair[2];
-	int execspair[2];
-	char nbuf[64];
-	pid_t c;
-	bool sipc = false;
-	u_int proc_fflags = NOTE_EXIT|NOTE_FORK|NOTE_EXEC|NOTE_EXIT_DETAIL|NOTE_EXITSTATUS;
+	struct job_stop_group *g = s_stop_group_open;
 
-	if (!job_assumes(j, j->mgr != NULL)) {
+	if (g) {
+		g->nesting++;
 		return;
 	}
 
-	if (unlikely(job_active(j))) {
-		job_log(j, LOG_DEBUG, "Already started");
+	// If this fails, job_stop() just falls back to per-job timers.
+	if (!jobmgr_assumes(root_jobmgr, (g = calloc(1, sizeof(*g))) != NULL)) {
 		return;
 	}
 
-	if (!LIST_EMPTY(&j->mgr->attaches)) {
-		job_log(j, LOG_DEBUG, "Looking for attachments for job: %s", j->label);
-		(void)waiting4attach_find(j->mgr, j);
-	}
+	LIST_INIT(&g->members);
+	g->start_time = runtime_get_opaque_time();
+	g->grace = grace;
+	g->sig = sig;
+	g->nesting = 1;
 
-	/*
-	 * Some users adjust the wall-clock and then expect software to not notice.
-	 * Therefore, launchd must use an absolute clock instead of the wall clock
-	 * wherever possible.
-	 */
-	td = runtime_get_nanoseconds_since(j->start_time);
-	td /= NSEC_PER_SEC;
+	LIST_INSERT_HEAD(&s_stop_groups, g, sle);
+	s_stop_group_open = g;
+}
 
-	if (j->start_time && (td < j->min_run_time) && !j->legacy_mach_job && !j->inetcompat && !j->unthrottle) {
-		time_t respawn_delta = j->min_run_time - (uint32_t)td;
-		/* We technically should ref-count throttled jobs to prevent idle exit,
-		 * but we're not directly tracking the 'throttled' state at the moment.
-		 */
-		job_log(j, LOG_NOTICE, "Throttling respawn: Will start in %ld seconds", respawn_delta);
-		(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)j, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, respawn_delta, j));
-		job_ignore(j);
+void
+job_stop_group_end(void)
+{
+	struct job_stop_group *g = s_stop_group_open;
+
+	if (!g || --g->nesting) {
 		return;
 	}
 
-	if (likely(!j->legacy_mach_job)) {
-		sipc = ((!SLIST_EMPTY(&j->sockets) || !SLIST_EMPTY(&j->machservices)) && !j->deny_job_creation) || j->embedded_god;
-	}
+	s_stop_group_open = NULL;
+	job_stop_group_settle(g);
+}
 
-	if (sipc) {
-		(void)job_assumes_zero_p(j, socketpair(AF_UNIX, SOCK_STREAM, 0, spair));
+bool
+job_stop_group_join(job_t j, uint32_t deadline)
+{
+	struct job_stop_group *g = s_stop_group_open;
+
+	if (!g || !deadline || j->stop_group) {
+		return false;
 	}
 
-	(void)job_assumes_zero_p(j, socketpair(AF_UNIX, SOCK_STREAM, 0, execspair));
+	j->stop_group = g;
+	j->stop_group_deadline = (uint32_t)(runtime_get_nanoseconds_since(g->start_time) / NSEC_PER_SEC) + deadline;
+	LIST_INSERT_HEAD(&g->members, j, stop_group_sle);
+	g->cnt++;
 
-	switch (c = runtime_fork(j->weird_bootstrap ? j->j_port : j->mgr->jm_port)) {
-	case -1:
-		job_log_error(j, LOG_ERR, "fork() failed, will try again in one second");
-		(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)j, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, 1, j));
-		job_ignore(j);
+	return true;
+}
 
-		(void)job_assumes_zero(j, runtime_close(execspair[0]));
-		(void)job_assumes_zero(j, runtime_close(execspair[1]));
-		if (sipc) {
-			(void)job_assumes_zero(j, runtime_close(spair[0]));
-			(void)job_assumes_zero(j, runtime_close(spair[1]));
-		}
-		break;
-	case 0:
-		if (unlikely(_vproc_post_fork_ping())) {
-			_exit(EXIT_FAILURE);
-		}
+void
+job_stop_group_leave(job_t j, bool killed)
+{
+	struct job_stop_group *g = j->stop_group;
 
-		(void)job_assumes_zero(j, runtime_close(execspair[0]));
-		// wait for our parent to say they've attached a kevent to us
-		read(_fd(execspair[1]), &c, sizeof(c));
+	LIST_REMOVE(j, stop_group_sle);
+	j->stop_group = NULL;
 
-		if (sipc) {
-			(void)job_assumes_zero(j, runtime_close(spair[0]));
-			snprintf(nbuf, sizeof(nbuf), "%d", spair[1]);
-			setenv(LAUNCHD_TRUSTED_FD_ENV, nbuf, 1);
+	if (killed && !g->killed_labels_full) {
+		size_t len = strlen(g->killed_labels);
+
+		if (len) {
+			(void)strlcat(g->killed_labels, ", ", sizeof(g->killed_labels));
 		}
-		job_start_child(j);
-		break;
-	default:
-		j->start_time = runtime_get_opaque_time();
+		if (strlcat(g->killed_labels, j->label, sizeof(g->killed_labels)) >= sizeof(g->killed_labels) - 5) {
+			// Out of room. Cut back to the last whole label.
+			g->killed_labels[len] = '\0';
+			(void)strlcat(g->killed_labels, len ? ", ..." : "...", sizeof(g->killed_labels));
+			g->killed_labels_full = true;
+		}
+	}
+	if (killed) {
+		g->killed++;
+	}
 
-		job_log(j, LOG_DEBUG, "Started as PID: %u", c);
+	if (!g->nesting && LIST_EMPTY(&g->members)) {
+		job_stop_group_settle(g);
+	}
+}
 
-		j->did_exec = false;
-		j->fpfail = false;
-		j->jettisoned = false;
-		j->xpcproxy_did_exec = false;
-		j->checkedin = false;
-		j->start_pending = false;
-		j->reaped = false;
-		j->crashed = false;
-		j->stopped = false;
-		j->workaround9359725 = false;
-		j->implicit_reap = false;
-		j->unthrottle = false;
-		if (j->needs_kickoff) {
-			j->needs_kickoff = false;
+/* Re-arms the group's timer for its earliest deadline or, once the last member
+ * has left, reports how the stop went and frees the group.
+ */
+void
+job_stop_group_settle(struct job_stop_group *g)
+{
+	uint32_t now = (uint32_t)(runtime_get_nanoseconds_since(g->start_time) / NSEC_PER_SEC);
+	uint32_t next = UINT32_MAX;
+	job_t ji;
 
-			if (SLIST_EMPTY(&j->semaphores)) {
-				j->ondemand = false;
-			}
-		}
+	LIST_FOREACH(ji, &g->members, stop_group_sle) {
+		next = ji->stop_group_deadline < next ? ji->stop_group_deadline : next;
+	}
 
-		if (j->has_console) {
-			launchd_wsp = c;
-		}
+	if (next != UINT32_MAX) {
+		(void)jobmgr_assumes_zero_p(root_jobmgr, kevent_mod((uintptr_t)g, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, next > now ? next - now : 0, root_jobmgr));
+		return;
+	}
 
-		job_log(j, LOG_PERF, "Job started.");
-		runtime_add_ref();
-		total_children++;
-		LIST_INSERT_HEAD(&j->mgr->active_jobs[ACTIVE_JOB_HASH(c)], j, pid_hash_sle);
-		LIST_INSERT_HEAD(&managed_actives[ACTIVE_JOB_HASH(c)], j, global_pid_hash_sle);
-		j->p = c;
+	if (g->cnt) {
+		uint64_t td = runtime_get_nanoseconds_since(g->start_time) / NSEC_PER_MSEC;
 
-		struct proc_uniqidentifierinfo info;
-		if (proc_pidinfo(c, PROC_PIDUNIQIDENTIFIERINFO, 0, &info, PROC_PIDUNIQIDENTIFIERINFO_SIZE) != 0) {
-			// ignore errors here, kevent_mod below will catch them and clean up
-			j->uniqueid = info.p_uniqueid;
+		(void)kevent_mod((uintptr_t)g, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+		if (g->killed) {
+			jobmgr_log(root_jobmgr, LOG_NOTICE, "Stopped %u job%s in %llu ms. %u used the whole grace period and were killed: %s", g->cnt, g->cnt == 1 ? "" : "s", td, g->killed, g->killed_labels);
+		} else {
+			jobmgr_log(root_jobmgr, LOG_PERF, "Stopped %u job%s in %llu ms.", g->cnt, g->cnt == 1 ? "" : "s", td);
 		}
+	}
 
-		j->mgr->normal_active_cnt++;
-		j->fork_fd = _fd(execspair[0]);
-		(void)job_assumes_zero(j, runtime_close(execspair[1]));
-		if (sipc) {
-			(void)job_assumes_zero(j, runtime_close(spair[1]));
-			ipc_open(_fd(spair[0]), j);
-		}
-		if (kevent_mod(c, EVFILT_PROC, EV_ADD, proc_fflags, 0, root_jobmgr ? root_jobmgr : j->mgr) != -1) {
-			job_ignore(j);
-		} else {
-			if (errno == ESRCH) {
-				job_log(j, LOG_ERR, "Child was killed before we could attach a kevent.");
-			} else {
-				(void)job_assumes(j, errno == ESRCH);
-			}
-			job_reap(j);
+	LIST_REMOVE(g, sle);
+	free(g);
+}
 
-			/* If we have reaped this job within this same run loop pass, then
-			 * it will be currently ignored. So if there's a failure to attach a
-			 * kevent, we need to make sure that we watch the job so that we can
-			 * respawn it.
-			 *
-			 * See <rdar://problem/10140809>.
-			 */
-			job_watch(j);
-		}
+void
+job_stop_group_callback(struct job_stop_group *g)
+{
+	uint32_t now = (uint32_t)(runtime_get_nanoseconds_since(g->start_time) / NSEC_PER_SEC);
+	job_t ji, jn;
 
-#if HAVE_SYSTEMSTATS
-		if (systemstats_is_enabled()) {
-			/* We don't really *need* to make the full rusage call -- it
-			 * will be mostly 0s and very small numbers. We only need
-			 * ri_proc_start_abstime, because that's how we disambiguiate
-			 * PIDs when they wrap around; and the UUID.
-			 * In the future we should use the 64-bit process unique ID,
-			 * so there's nothing to disambiguiate, and skip the full
-			 * rusage call here.
-			 *
-			 * Well, the future is now.
-			 */
-			if (_systemstats_get_property(SYSTEMSTATS_API_VERSION, SYSTEMSTATS_WRITER_launchd, SYSTEMSTATS_PROPERTY_LAUNCHD_SHOULD_LOG_JOB_START)) {
-				job_log_perf_statistics(j, NULL, -3);
-			}
-		}
-#endif
-		j->wait4debugger_oneshot = false;
-		if (likely(!j->stall_before_exec)) {
-			job_uncork_fork(j);
+	// Keep the group around until we're done walking it.
+	g->nesting++;
+
+	LIST_FOREACH_SAFE(ji, &g->members, stop_group_sle, jn) {
+		if (ji->stop_group_deadline > now) {
+			continue;
 		}
-		break;
+
+		job_stop_group_leave(ji, true);
+		job_stop_grace_elapsed(ji, "Grace period");
 	}
+
+	g->nesting--;
+	job_stop_group_settle(g);
 }
 
+/* The job outlived the grace period job_stop() gave it, whether that came from
+ * its own exit timeout timer or from its stop group's deadline.
+ */
 void
-job_start_child(job_t j)
+job_stop_grace_elapsed(job_t j, const char *what)
 {
-	typeof(posix_spawn) *psf;
-	const char *file2exec = "/usr/libexec/launchproxy";
-	const char **argv;
-	posix_spawnattr_t spattr;
-	int gflags = GLOB_NOSORT|GLOB_NOCHECK|GLOB_TILDE|GLOB_DOOFFS;
-	glob_t g;
-	short spflags = POSIX_SPAWN_SETEXEC;
-	int psproctype = POSIX_SPAWN_PROC_TYPE_DAEMON_BACKGROUND;
-	size_t binpref_out_cnt = 0;
-	size_t i;
+	if (unlikely(j->debug_before_kill)) {
+		job_log(j, LOG_NOTICE, "%s elapsed. Entering the kernel debugger", what);
+		(void)job_assumes_zero(j, host_reboot(mach_host_self(), HOST_REBOOT_DEBUGGER));
+	}
 
-	(void)job_assumes_zero(j, posix_spawnattr_init(&spattr));
+	job_log(j, LOG_WARNING | LOG_CONSOLE, "%s elapsed (%u seconds). Killing", what, j->stop_grace);
+	job_kill(j);
+}
 
-	job_setup_attributes(j);
+struct job_stop_group *
+job_stop_group_find(uintptr_t ident)
+{
+	struct job_stop_group *g;
 
-	bool use_xpcproxy = false;
-	struct waiting4attach *w4a = waiting4attach_find(j->mgr, j);
-	if (w4a) {
-		(void)setenv(XPC_SERVICE_ENV_ATTACHED, "1", 1);
-		if (!j->xpc_service) {
-			use_xpcproxy = true;
+	LIST_FOREACH(g, &s_stop_groups, sle) {
+		if ((uintptr_t)g == ident) {
+			break;
 		}
 	}
 
-	if (use_xpcproxy) {
-		argv = alloca(3 * sizeof(char *));
-		argv[0] = "/usr/libexec/xpcproxy";
-		argv[1] = "-debug";
-		argv[2] = NULL;
+	return g;
+}
 
-		file2exec = argv[0];
-	} else if (unlikely(j->argv && j->globargv)) {
-		g.gl_offs = 1;
-		for (i = 0; i < j->argc; i++) {
-			if (i > 0) {
-				gflags |= GLOB_APPEND;
-			}
-			if (glob(j->argv[i], gflags, NULL, &g) != 0) {
-				job_log_error(j, LOG_ERR, "glob(\"%s\")", j->argv[i]);
-				exit(EXIT_FAILURE);
-			}
-		}
-		g.gl_pathv[0] = (char *)file2exec;
-		argv = (const char **)g.gl_pathv;
-	} else if (likely(j->argv)) {
-		argv = alloca((j->argc + 2) * sizeof(char *));
-		argv[0] = file2exec;
-		for (i = 0; i < j->argc; i++) {
-			argv[i + 1] = j->argv[i];
-		}
-		argv[i + 1] = NULL;
-	} else {
-		argv = alloca(3 * sizeof(char *));
-		argv[0] = file2exec;
-		argv[1] = j->prog;
-		argv[2] = NULL;
-	}
+void
+job_history_record(job_t j, uint8_t event, int32_t status, uint8_t reason)
+{
+	struct job_history_entry *jhe = &j->history[j->history_next % JOB_HISTORY_SIZE];
+
+	jhe->when = runtime_get_wall_time();
+	jhe->p = j->p;
+	jhe->status = status;
+	jhe->event = event;
+	jhe->reason = reason;
+	j->history_next++;
+}
 
-	if (likely(!(j->inetcompat || use_xpcproxy))) {
-		argv++;
+static const char *
+job_history_event_name(uint8_t event)
+{
+	switch (event) {
+	case JOB_HISTORY_SPAWN:
+		return "Spawn";
+	case JOB_HISTORY_SPAWN_FAILED:
+		return "SpawnFailed";
+	case JOB_HISTORY_THROTTLE:
+		return "Throttle";
+	case JOB_HISTORY_STOP:
+		return "Stop";
+	case JOB_HISTORY_KILL:
+		return "Kill";
+	case JOB_HISTORY_EXIT:
+		return "Exit";
+	case JOB_HISTORY_CRASH:
+		return "Crash";
+	default:
+		return "Unknown";
 	}
+}
 
-	if (unlikely(j->wait4debugger || j->wait4debugger_oneshot)) {
-		if (!j->app) {
-			job_log(j, LOG_WARNING, "Spawned and waiting for the debugger to attach before continuing...");
-		}
-		spflags |= POSIX_SPAWN_START_SUSPENDED;
+static const char *
+job_history_reason_name(uint8_t reason)
+{
+	switch (reason) {
+	case JOB_HISTORY_REASON_UNTHROTTLED:
+		return "Unthrottled";
+	case JOB_HISTORY_REASON_FALLBACK:
+		return "Fallback";
+	case JOB_HISTORY_REASON_NO_EXEC:
+		return "NoExec";
+	case JOB_HISTORY_REASON_STOPPED:
+		return "Stopped";
+	case JOB_HISTORY_REASON_JETTISONED:
+		return "Jettisoned";
+	case JOB_HISTORY_REASON_IMPLICIT_REAP:
+		return "ImplicitReap";
+	case JOB_HISTORY_REASON_SIMULATED:
+		return "Simulated";
+	default:
+		return NULL;
 	}
+}
 
-#if !TARGET_OS_EMBEDDED
-	if (unlikely(j->disable_aslr)) {
-		spflags |= _POSIX_SPAWN_DISABLE_ASLR;
+/* Returns the ring oldest-first, or NULL if nothing has been recorded. Does
+ * not touch any launchd state, so it is safe to call on a snapshot from off
+ * the main thread.
+ */
+launch_data_t
+job_history_export(const struct job_history_entry *history, uint32_t history_next)
+{
+	launch_data_t tmp, tmp2, r;
+	uint32_t i = 0, k = 0, start = 0, cnt = history_next;
+
+	if (cnt == 0 || !(r = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
+		return NULL;
 	}
-#endif
-	spflags |= j->pstype;
 
-	(void)job_assumes_zero(j, posix_spawnattr_setflags(&spattr, spflags));
-	if (unlikely(j->j_binpref_cnt)) {
-		(void)job_assumes_zero(j, posix_spawnattr_setbinpref_np(&spattr, j->j_binpref_cnt, j->j_binpref, &binpref_out_cnt));
-		(void)job_assumes(j, binpref_out_cnt == j->j_binpref_cnt);
+	if (cnt > JOB_HISTORY_SIZE) {
+		start = cnt - JOB_HISTORY_SIZE;
+		cnt = JOB_HISTORY_SIZE;
 	}
 
-	psproctype = j->psproctype;
-	(void)job_assumes_zero(j, posix_spawnattr_setprocesstype_np(&spattr, psproctype));
+	for (i = 0; i < cnt; i++) {
+		const struct job_history_entry *jhe = &history[(start + i) % JOB_HISTORY_SIZE];
+		const char *reason = job_history_reason_name(jhe->reason);
 
-#if TARGET_OS_EMBEDDED
-	/* Set jetsam attributes. POSIX_SPAWN_JETSAM_USE_EFFECTIVE_PRIORITY guards
-	 * against a race which arises if, during spawn, an initial jetsam property
-	 * update occurs before the values below are applied. In this case, the flag
-	 * ensures that the subsequent change is ignored; the explicit update should
-	 * be given priority.
-	 */
-	(void)job_assumes_zero(j, posix_spawnattr_setjetsam(&spattr,
-	        POSIX_SPAWN_JETSAM_USE_EFFECTIVE_PRIORITY | (j->jetsam_memory_limit_background ? POSIX_SPAWN_JETSAM_HIWATER_BACKGROUND : 0), 
-	        j->jetsam_priority, j->jetsam_memlimit));
-#endif
+		if (!(tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+			continue;
+		}
 
-	mach_port_array_t sports = NULL;
-	mach_msg_type_number_t sports_cnt = 0;
-	kern_return_t kr = vproc_mig_get_listener_port_rights(bootstrap_port, &sports, &sports_cnt);
-	if (kr == 0 && sports_cnt) {
-		/* For some reason, this SPI takes a count as a signed quantity. */
-		(void)posix_spawnattr_set_importancewatch_port_np(&spattr, (int)sports_cnt, sports);
+		if ((tmp2 = launch_data_new_integer(jhe->when))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBHISTORY_TIMESTAMP);
+		}
+		if ((tmp2 = launch_data_new_string(job_history_event_name(jhe->event)))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBHISTORY_EVENT);
+		}
+		if (jhe->p && (tmp2 = launch_data_new_integer(jhe->p))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBHISTORY_PID);
+		}
+		if ((tmp2 = launch_data_new_integer(jhe->status))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBHISTORY_STATUS);
+		}
+		if (reason && (tmp2 = launch_data_new_string(reason))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBHISTORY_REASON);
+		}
 
-		/* All "count" parameters in MIG are counts of the array. So an array of
-		 * mach_port_t containing 10 elements will have a count of ten, but it
-		 * will occupy 40 bytes. So we must do the multiplication here to pass
-		 * the correct size.
-		 *
-		 * Note that we do NOT release the send rights. We need them to be valid
-		 * at the time they are passed to posix_spawn(2). When we exec(3) using
-		 * posix_spawn(2), they'll be cleaned up anyway.
-		 */
-		mig_deallocate((vm_address_t)sports, sports_cnt * sizeof(sports[0]));
-	} else if (kr != BOOTSTRAP_UNKNOWN_SERVICE) {
-		(void)job_assumes_zero(j, kr);
+		launch_data_array_set_index(r, tmp, k++);
 	}
 
-#if TARGET_OS_EMBEDDED
-	if (!j->app || j->system_app) {
-		(void)job_assumes_zero(j, posix_spawnattr_setcpumonitor_default(&spattr));
-	}
-#else
-	(void)job_assumes_zero(j, posix_spawnattr_setcpumonitor_default(&spattr));
-#endif
+	return r;
+}
 
-#if !TARGET_OS_EMBEDDED
-	struct task_qos_policy qosinfo = {
-		.task_latency_qos_tier = LATENCY_QOS_LAUNCH_DEFAULT_TIER,
-		.task_throughput_qos_tier = THROUGHPUT_QOS_LAUNCH_DEFAULT_TIER,
-	};
-
-	kr = task_policy_set(mach_task_self(), TASK_BASE_QOS_POLICY, (task_policy_t)&qosinfo, TASK_QOS_POLICY_COUNT);
-	(void)job_assumes_zero_p(j, kr);
-#endif
+void
+job_open_shutdown_transaction(job_t j)
+{
+	int rv = proc_set_dirty(j->p, true);
+	if (rv != 0) {
+		job_log(j, LOG_DEBUG, "Job wants to be dirty at shutdown, but it is not Instant Off-compliant. Treating normally.");
+		j->dirty_at_shutdown = false;
+	}
+}
 
-#if HAVE_RESPONSIBILITY
-	/* Specify which process is responsible for the new job.  Per-app XPC
-	 * services are the responsibility of the app.  Other processes are
-	 * responsible for themselves.  This decision is final and also applies
-	 * to the process's children, so don't initialize responsibility when
-	 * starting a per-user launchd.
-	 */
-	if (j->mgr->req_pid) {
-		responsibility_init2(j->mgr->req_pid, NULL);
-	} else if (!j->per_user) {
-		responsibility_init2(getpid(), j->prog ? j->prog : j->argv[0]);
+void
+job_close_shutdown_transaction(job_t j)
+{
+	if (j->dirty_at_shutdown) {
+		job_log(j, LOG_DEBUG, "Closing shutdown transaction for job.");
+		(void)job_assumes_zero(j, proc_set_dirty(j->p, false));
+		j->dirty_at_shutdown = false;
 	}
-#endif
+}
 
-#if HAVE_QUARANTINE
-	if (j->quarantine_data) {
-		qtn_proc_t qp;
+void
+job_log_children_without_exec(job_t j)
+{
+	pid_t *pids = NULL;
+	size_t len = sizeof(pid_t) * get_kern_max_proc();
+	int i = 0, kp_cnt = 0;
 
-		if (job_assumes(j, qp = qtn_proc_alloc())) {
-			if (job_assumes_zero(j, qtn_proc_init_with_data(qp, j->quarantine_data, j->quarantine_data_sz) == 0)) {
-				(void)job_assumes_zero(j, qtn_proc_apply_to_self(qp));
+	if (!launchd_apple_internal || j->anonymous || j->per_user) {
+		return;
+	}
+
+	if (!j->descendants_overflowed) {
+		if (j->descendants) {
+			for (i = 0; i < JOB_DESCENDANTS_MAX; i++) {
+				struct job_descendant *jd = &j->descendants[i];
+				if (jd->p && jd->ppid == j->p && !jd->did_exec) {
+					job_log(j, LOG_DEBUG, "Called *fork(). Please switch to posix_spawn*(), pthreads or launchd. Child PID %u", jd->p);
+				}
 			}
 		}
+		return;
 	}
-#endif
 
-#if HAVE_SANDBOX
-#if TARGET_OS_EMBEDDED
-	struct sandbox_spawnattrs sbattrs;
-	if (j->seatbelt_profile || j->container_identifier) {
-		sandbox_spawnattrs_init(&sbattrs);
-		if (j->seatbelt_profile) {
-			sandbox_spawnattrs_setprofilename(&sbattrs, j->seatbelt_profile);
-		}
-		if (j->container_identifier) {
-			sandbox_spawnattrs_setcontainer(&sbattrs, j->container_identifier);
-		}
-		(void)job_assumes_zero(j, posix_spawnattr_setmacpolicyinfo_np(&spattr, "Sandbox", &sbattrs, sizeof(sbattrs)));
+	if (!job_assumes(j, (pids = malloc(len)) != NULL)) {
+		return;
+	}
+	if (job_assumes_zero_p(j, (kp_cnt = proc_listchildpids(j->p, pids, len))) == -1) {
+		goto out;
 	}
-#else
-	if (j->seatbelt_profile) {
-		char *seatbelt_err_buf = NULL;
 
-		if (job_assumes_zero_p(j, sandbox_init(j->seatbelt_profile, j->seatbelt_flags, &seatbelt_err_buf)) == -1) {
-			if (seatbelt_err_buf) {
-				job_log(j, LOG_ERR, "Sandbox failed to init: %s", seatbelt_err_buf);
+	for (i = 0; i < kp_cnt; i++) {
+		struct proc_bsdshortinfo proc;
+		if (proc_pidinfo(pids[i], PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
+			if (errno != ESRCH) {
+				(void)job_assumes_zero(j, errno);
 			}
-			goto out_bad;
+			continue;
+		}
+		if (proc.pbsi_flags & P_EXEC) {
+			continue;
 		}
-	}
-#endif
-#endif
-
-	psf = j->prog ? posix_spawn : posix_spawnp;
 
-	if (likely(!(j->inetcompat || use_xpcproxy))) {
-		file2exec = j->prog ? j->prog : argv[0];
+		job_log(j, LOG_DEBUG, "Called *fork(). Please switch to posix_spawn*(), pthreads or launchd. Child PID %u", pids[i]);
 	}
 
-	errno = psf(NULL, file2exec, NULL, &spattr, (char *const *)argv, environ);
-
-#if HAVE_SANDBOX && !TARGET_OS_EMBEDDED
-out_bad:
-#endif
-	_exit(errno);
+out:
+	free(pids);
 }
 
-void
-jobmgr_export_env_from_other_jobs(jobmgr_t jm, launch_data_t dict)
+static struct job_descendant *
+job_descendant_find(pid_t p)
 {
-	launch_data_t tmp;
-	struct envitem *ei;
-	job_t ji;
+	struct job_descendant *jd = NULL;
 
-	if (jm->parentmgr) {
-		jobmgr_export_env_from_other_jobs(jm->parentmgr, dict);
-	} else {
-		char **tmpenviron = environ;
-		for (; *tmpenviron; tmpenviron++) {
-			char envkey[1024];
-			launch_data_t s = launch_data_alloc(LAUNCH_DATA_STRING);
-			launch_data_set_string(s, strchr(*tmpenviron, '=') + 1);
-			strncpy(envkey, *tmpenviron, sizeof(envkey));
-			*(strchr(envkey, '=')) = '\0';
-			launch_data_dict_insert(dict, s, envkey);
+	LIST_FOREACH(jd, &s_descendant_pids[ACTIVE_JOB_HASH(p)], pid_hash_sle) {
+		if (jd->p == p) {
+			break;
 		}
 	}
 
-	LIST_FOREACH(ji, &jm->jobs, sle) {
-		SLIST_FOREACH(ei, &ji->global_env, sle) {
-			if ((tmp = launch_data_new_string(ei->value))) {
-				launch_data_dict_insert(dict, tmp, ei->key);
-			}
-		}
-	}
+	return jd;
 }
 
-void
-jobmgr_setup_env_from_other_jobs(jobmgr_t jm)
+static void
+job_descendant_update(struct job_descendant *jd)
 {
-	struct envitem *ei;
-	job_t ji;
-
-	if (jm->parentmgr) {
-		jobmgr_setup_env_from_other_jobs(jm->parentmgr);
-	}
+	struct proc_bsdshortinfo proc;
 
-	LIST_FOREACH(ji, &jm->global_env_jobs, global_env_sle) {
-		SLIST_FOREACH(ei, &ji->global_env, sle) {
-			setenv(ei->key, ei->value, 1);
+	if (proc_pidinfo(jd->p, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
+		if (errno != ESRCH) {
+			(void)job_assumes_zero(jd->j, errno);
 		}
+		return;
 	}
+
+	jd->ppid = proc.pbsi_ppid;
+	jd->pgid = proc.pbsi_pgid;
+	jd->did_exec = (proc.pbsi_flags & P_EXEC);
+	strlcpy(jd->comm, proc.pbsi_comm, sizeof(jd->comm));
+}
+
+static void
+job_descendant_remove(struct job_descendant *jd)
+{
+	LIST_REMOVE(jd, pid_hash_sle);
+	jd->p = 0;
 }
 
+/* Picks up any children of parent that we haven't seen yet, and their
+ * children. NOTE_FORK doesn't tell us the new PID, so we have to ask.
+ */
 void
-job_log_pids_with_weird_uids(job_t j)
+job_descendants_scan(job_t j, pid_t parent)
 {
-	size_t len = sizeof(pid_t) * get_kern_max_proc();
-	pid_t *pids = NULL;
-	uid_t u = j->mach_uid;
+	const u_int proc_fflags = NOTE_EXIT|NOTE_FORK|NOTE_EXEC;
+	pid_t pids[JOB_DESCENDANTS_MAX];
 	int i = 0, kp_cnt = 0;
 
-	if (!launchd_apple_internal) {
+	if (j->anonymous || j->per_user || j->descendants_overflowed) {
 		return;
 	}
 
-	pids = malloc(len);
-	if (!job_assumes(j, pids != NULL)) {
+	if (!j->descendants && !(j->descendants = calloc(JOB_DESCENDANTS_MAX, sizeof(j->descendants[0])))) {
+		j->descendants_overflowed = true;
 		return;
 	}
 
-	runtime_ktrace(RTKT_LAUNCHD_FINDING_WEIRD_UIDS, j->p, u, 0);
+	if ((kp_cnt = proc_listchildpids(parent, pids, sizeof(pids))) == -1) {
+		if (errno != ESRCH) {
+			(void)job_assumes_zero(j, errno);
+		}
+		return;
+	}
 
-	/* libproc actually has some serious performance drawbacks when used over sysctl(3) in
-	 * scenarios like this. Whereas sysctl(3) can give us back all the kinfo_proc's in
-	 * one kernel call, libproc requires that we get a list of PIDs we're interested in
-	 * (in this case, all PIDs on the system) and then get a single proc_bsdshortinfo
-	 * struct back in a single call for each one.
-	 *
-	 * This kind of thing is also more inherently racy than sysctl(3). While sysctl(3)
-	 * returns a snapshot, it returns the whole shebang at once. Any PIDs given to us by
-	 * libproc could go stale before we call proc_pidinfo().
-	 *
-	 * Note that proc_list*() APIs return the number of PIDs given back, not the number
-	 * of bytes written to the buffer.
-	 */
-	if (job_assumes_zero_p(j, (kp_cnt = proc_listallpids(pids, len))) == -1) {
-		goto out;
+	if (kp_cnt >= JOB_DESCENDANTS_MAX) {
+		// We may not have seen all of them.
+		j->descendants_overflowed = true;
+		return;
 	}
 
 	for (i = 0; i < kp_cnt; i++) {
-		struct proc_bsdshortinfo proc;
-		/* We perhaps should not log a bug here if we get ESRCH back, due to the race
-		 * detailed above.
+		struct job_descendant *jd = job_descendant_find(pids[i]);
+		size_t k = 0;
+
+		if (jd) {
+			continue;
+		}
+
+		for (k = 0; k < JOB_DESCENDANTS_MAX; k++) {
+			if (j->descendants[k].p == 0) {
+				jd = &j->descendants[k];
+				break;
+			}
+		}
+
+		if (!jd) {
+			job_log(j, LOG_DEBUG, "Too many descendants to track. Falling back to the kernel for diagnostics.");
+			j->descendants_overflowed = true;
+			return;
+		}
+
+		jd->j = j;
+		jd->p = pids[i];
+		jd->ppid = parent;
+		jd->pgid = 0;
+		jd->did_exec = false;
+		jd->comm[0] = '\0';
+
+		/* The events come straight back here and are looked up by PID, without
+		 * walking the job managers. If the descendant is itself a job, its
+		 * route already owns the kevent and passes the events along, so
+		 * re-adding it would only steal them from the job.
 		 */
-		if (proc_pidinfo(pids[i], PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
+		if (proc_route_find(jd->p)) {
+			// Nothing to register.
+		} else if (kevent_mod(jd->p, EVFILT_PROC, EV_ADD, proc_fflags, 0, &kqdescendant_callback) == -1) {
 			if (errno != ESRCH) {
 				(void)job_assumes_zero(j, errno);
 			}
+			jd->p = 0;
 			continue;
 		}
 
-		uid_t i_euid = proc.pbsi_uid;
-		uid_t i_uid = proc.pbsi_ruid;
-		uid_t i_svuid = proc.pbsi_svuid;
-		pid_t i_pid = pids[i];
+		LIST_INSERT_HEAD(&s_descendant_pids[ACTIVE_JOB_HASH(jd->p)], jd, pid_hash_sle);
+		job_descendant_update(jd);
 
-		if (i_euid != u && i_uid != u && i_svuid != u) {
-			continue;
-		}
+		// It may have forked before we started watching it.
+		job_descendants_scan(j, jd->p);
+	}
+}
 
-		job_log(j, LOG_ERR, "PID %u \"%s\" has no account to back it! Real/effective/saved UIDs: %u/%u/%u", i_pid, proc.pbsi_comm, i_uid, i_euid, i_svuid);
+// The children of a process that has exited are inherited by PID 1.
+void
+job_descendants_reparent(job_t j, pid_t parent)
+{
+	size_t i = 0;
 
-// Temporarily disabled due to 5423935 and 4946119.
-#if 0
-		// Ask the accountless process to exit.
-		(void)job_assumes_zero_p(j, kill2(i_pid, SIGTERM));
-#endif
+	if (!j->descendants) {
+		return;
 	}
 
-out:
-	free(pids);
+	for (i = 0; i < JOB_DESCENDANTS_MAX; i++) {
+		if (j->descendants[i].p && j->descendants[i].ppid == parent) {
+			j->descendants[i].ppid = 1;
+		}
+	}
 }
 
-static struct passwd *
-job_getpwnam(job_t j, const char *name)
+void
+job_descendants_free(job_t j)
 {
-	/*
-	 * methodology for system daemons
-	 *
-	 * first lookup user record without any opendirectoryd interaction,
-	 * we don't know what interprocess dependencies might be in flight.
-	 * if that fails, we re-enable opendirectoryd interaction and 
-	 * re-issue the lookup.  We have to disable the libinfo L1 cache
-	 * otherwise libinfo will return the negative cache entry on the retry
-	 */
-#if !TARGET_OS_EMBEDDED
-	struct passwd *pw = NULL;
-
-	if (pid1_magic && j->mgr == root_jobmgr) {
-		// 1 == SEARCH_MODULE_FLAG_DISABLED
-		si_search_module_set_flags("ds", 1);
-		gL1CacheEnabled = false;
+	size_t i = 0;
 
-		pw = getpwnam(name);
-		si_search_module_set_flags("ds", 0);
+	if (!j->descendants) {
+		return;
 	}
 
-	if (pw == NULL) {
-		pw = getpwnam(name);
+	/* Leave the kevents alone. Another job (e.g. an anonymous one) may be
+	 * watching the same process, and events for PIDs we no longer know about
+	 * are simply dropped.
+	 */
+	for (i = 0; i < JOB_DESCENDANTS_MAX; i++) {
+		if (j->descendants[i].p) {
+			job_descendant_remove(&j->descendants[i]);
+		}
 	}
 
-	return pw;
-#else
-#pragma unused (j)
-	return getpwnam(name);
-#endif
+	free(j->descendants);
+	j->descendants = NULL;
 }
 
-static struct group *
-job_getgrnam(job_t j, const char *name)
+void
+job_descendant_callback(struct kevent *kev)
 {
-#if !TARGET_OS_EMBEDDED
-    struct group *gr = NULL;
+	struct job_descendant *jd = job_descendant_find((pid_t)kev->ident);
 
-    if (pid1_magic && j->mgr == root_jobmgr) {
-        si_search_module_set_flags("ds", 1);
-        gL1CacheEnabled = false;
+	if (!jd) {
+		return;
+	}
 
-        gr = getgrnam(name);
+	job_t j = jd->j;
+	if (kev->fflags & NOTE_EXEC) {
+		job_descendant_update(jd);
+	}
+	if (kev->fflags & NOTE_FORK) {
+		job_descendants_scan(j, jd->p);
+	}
+	if (kev->fflags & NOTE_EXIT) {
+		job_descendants_reparent(j, jd->p);
+		job_descendant_remove(jd);
+	}
+}
 
-        si_search_module_set_flags("ds", 0);
-    }
+void
+job_descendant_kevent_callback(void *obj __attribute__((unused)), struct kevent *kev)
+{
+	job_descendant_callback(kev);
+}
 
-    if (gr == NULL) {
-        gr = getgrnam(name);
-    }
-
-    return gr;
-#else
-#pragma unused (j)
-    return getgrnam(name);
-#endif
-}
-
-void
-job_postfork_test_user(job_t j)
+launch_data_t
+job_descendants_export(const struct job_descendant *descendants, size_t cnt)
 {
-	// This function is all about 5201578
-
-	const char *home_env_var = getenv("HOME");
-	const char *user_env_var = getenv("USER");
-	const char *logname_env_var = getenv("LOGNAME");
-	uid_t tmp_uid, local_uid = getuid();
-	gid_t tmp_gid, local_gid = getgid();
-	char shellpath[PATH_MAX];
-	char homedir[PATH_MAX];
-	char loginname[2000];
-	struct passwd *pwe;
+	launch_data_t tmp, tmp2, r;
+	size_t i = 0, k = 0;
 
-
-	if (!job_assumes(j, home_env_var && user_env_var && logname_env_var
-				&& strcmp(user_env_var, logname_env_var) == 0)) {
-		goto out_bad;
-	}
-
-	if ((pwe = job_getpwnam(j, user_env_var)) == NULL) {
-		job_log(j, LOG_ERR, "The account \"%s\" has been deleted out from under us!", user_env_var);
-		goto out_bad;
+	if (!descendants || !(r = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
+		return NULL;
 	}
 
-	/*
-	 * We must copy the results of getpw*().
-	 *
-	 * Why? Because subsequent API calls may call getpw*() as a part of
-	 * their implementation. Since getpw*() returns a [now thread scoped]
-	 * global, we must therefore cache the results before continuing.
-	 */
+	for (i = 0; i < cnt; i++) {
+		const struct job_descendant *jd = &descendants[i];
 
-	tmp_uid = pwe->pw_uid;
-	tmp_gid = pwe->pw_gid;
+		if (!jd->p || !(tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+			continue;
+		}
 
-	strlcpy(shellpath, pwe->pw_shell, sizeof(shellpath));
-	strlcpy(loginname, pwe->pw_name, sizeof(loginname));
-	strlcpy(homedir, pwe->pw_dir, sizeof(homedir));
+		if ((tmp2 = launch_data_new_integer(jd->p))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBDESCENDANT_PID);
+		}
+		if ((tmp2 = launch_data_new_integer(jd->ppid))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBDESCENDANT_PPID);
+		}
+		if (jd->comm[0] && (tmp2 = launch_data_new_string(jd->comm))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBDESCENDANT_NAME);
+		}
+		if ((tmp2 = launch_data_new_bool(jd->did_exec))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBDESCENDANT_DIDEXEC);
+		}
 
-	if (strcmp(loginname, logname_env_var) != 0) {
-		job_log(j, LOG_ERR, "The %s environmental variable changed out from under us!", "USER");
-		goto out_bad;
-	}
-	if (strcmp(homedir, home_env_var) != 0) {
-		job_log(j, LOG_ERR, "The %s environmental variable changed out from under us!", "HOME");
-		goto out_bad;
-	}
-	if (local_uid != tmp_uid) {
-		job_log(j, LOG_ERR, "The %cID of the account (%u) changed out from under us (%u)!",
-				'U', tmp_uid, local_uid);
-		goto out_bad;
+		launch_data_array_set_index(r, tmp, k++);
 	}
-	if (local_gid != tmp_gid) {
-		job_log(j, LOG_ERR, "The %cID of the account (%u) changed out from under us (%u)!",
-				'G', tmp_gid, local_gid);
-		goto out_bad;
+
+	if (k == 0) {
+		launch_data_free(r);
+		r = NULL;
 	}
 
-	return;
-out_bad:
-#if 0
-	(void)job_assumes_zero_p(j, kill2(getppid(), SIGTERM));
-	_exit(EXIT_FAILURE);
-#else
-	job_log(j, LOG_WARNING, "In a future build of the OS, this error will be fatal.");
-#endif
+	return r;
 }
 
 void
-job_postfork_become_user(job_t j)
+job_callback_proc(job_t j, struct kevent *kev)
 {
-	char loginname[2000];
-	char tmpdirpath[PATH_MAX];
-	char shellpath[PATH_MAX];
-	char homedir[PATH_MAX];
-	struct passwd *pwe;
-	size_t r;
-	gid_t desired_gid = -1;
-	uid_t desired_uid = -1;
-
-	if (getuid() != 0) {
-		return job_postfork_test_user(j);
-	}
+	bool program_changed = false;
+	int fflags = kev->fflags;
 
-	/*
-	 * I contend that having UID == 0 and GID != 0 is of dubious value.
-	 * Nevertheless, this used to work in Tiger. See: 5425348
-	 */
-	if (j->groupname && !j->username) {
-		j->username = "root";
-	}
+	job_log(j, LOG_DEBUG, "EVFILT_PROC event for job.");
+	log_kevent_struct(LOG_DEBUG, kev, 0);
 
-	if (j->username) {
-		if ((pwe = job_getpwnam(j, j->username)) == NULL) {
-			job_log(j, LOG_ERR, "getpwnam(\"%s\") failed", j->username);
-			_exit(ESRCH);
-		}
-	} else if (j->mach_uid) {
-		if ((pwe = getpwuid(j->mach_uid)) == NULL) {
-			job_log(j, LOG_ERR, "getpwuid(\"%u\") failed", j->mach_uid);
-			job_log_pids_with_weird_uids(j);
-			_exit(ESRCH);
-		}
-	} else {
-		return;
-	}
+	if (fflags & NOTE_EXEC) {
+		program_changed = true;
 
-	/*
-	 * We must copy the results of getpw*().
-	 *
-	 * Why? Because subsequent API calls may call getpw*() as a part of
-	 * their implementation. Since getpw*() returns a [now thread scoped]
-	 * global, we must therefore cache the results before continuing.
-	 */
+		if (j->anonymous) {
+			struct proc_bsdshortinfo proc;
+			if (proc_pidinfo(j->p, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) > 0) {
+				char newlabel[1000];
 
-	desired_uid = pwe->pw_uid;
-	desired_gid = pwe->pw_gid;
+				snprintf(newlabel, sizeof(newlabel), "%p.anonymous.%s", j, proc.pbsi_comm);
 
-	strlcpy(shellpath, pwe->pw_shell, sizeof(shellpath));
-	strlcpy(loginname, pwe->pw_name, sizeof(loginname));
-	strlcpy(homedir, pwe->pw_dir, sizeof(homedir));
+				job_log(j, LOG_INFO, "Program changed. Updating the label to: %s", newlabel);
 
-	if (unlikely(pwe->pw_expire && time(NULL) >= pwe->pw_expire)) {
-		job_log(j, LOG_ERR, "Expired account");
-		_exit(EXIT_FAILURE);
-	}
+				LIST_REMOVE(j, label_hash_sle);
+				strcpy((char *)j->label, newlabel);
 
+				jobmgr_t where2put = root_jobmgr;
+				if (j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
+					where2put = j->mgr;
+				}
+				LIST_INSERT_HEAD(&where2put->label_hash[hash_label(j->label)], j, label_hash_sle);
+			} else if (errno != ESRCH) {
+				(void)job_assumes_zero(j, errno);
+			}
+		} else {
+			if (j->spawn_reply_port) {
+				errno = job_send_spawn_reply(j);
+				if (errno) {
+					if (errno != MACH_SEND_INVALID_DEST) {
+						(void)job_assumes_zero(j, errno);
+					}
+					(void)job_assumes_zero(j, launchd_mport_close_recv(j->exit_status_port));
+				}
 
-	if (unlikely(j->username && strcmp(j->username, loginname) != 0)) {
-		job_log(j, LOG_WARNING, "Suspicious setup: User \"%s\" maps to user: %s", j->username, loginname);
-	} else if (unlikely(j->mach_uid && (j->mach_uid != desired_uid))) {
-		job_log(j, LOG_WARNING, "Suspicious setup: UID %u maps to UID %u", j->mach_uid, desired_uid);
-	}
+				j->spawn_reply_port = MACH_PORT_NULL;
+				j->exit_status_port = MACH_PORT_NULL;
+			}
 
-	if (j->groupname) {
-		struct group *gre;
+			if (j->xpc_service && j->did_exec) {
+				j->xpcproxy_did_exec = true;
+			}
 
-		if (unlikely((gre = job_getgrnam(j, j->groupname)) == NULL)) {
-			job_log(j, LOG_ERR, "getgrnam(\"%s\") failed", j->groupname);
-			_exit(ESRCH);
+			j->did_exec = true;
+			job_log(j, LOG_DEBUG, "Program changed");
 		}
-
-		desired_gid = gre->gr_gid;
-	}
-
-	if (job_assumes_zero_p(j, setlogin(loginname)) == -1) {
-		_exit(EXIT_FAILURE);
 	}
 
-	if (job_assumes_zero_p(j, setgid(desired_gid)) == -1) {
-		_exit(EXIT_FAILURE);
+	if (fflags & NOTE_FORK) {
+		job_log(j, LOG_DEBUG, "fork()ed%s", program_changed ? ". For this message only: We don't know whether this event happened before or after execve()." : "");
+		job_descendants_scan(j, j->p);
+		job_log_children_without_exec(j);
 	}
 
-	/*
-	 * The kernel team and the DirectoryServices team want initgroups()
-	 * called after setgid(). See 4616864 for more information.
-	 */
-
-	if (likely(!j->no_init_groups)) {
-#if 1
-		if (job_assumes_zero_p(j, initgroups(loginname, desired_gid)) == -1) {
-			_exit(EXIT_FAILURE);
-		}
-#else
-		/* Do our own little initgroups(). We do this to guarantee that we're
-		 * always opted into dynamic group resolution in the kernel. initgroups(3)
-		 * does not make this guarantee.
-		 */
-		int groups[NGROUPS], ngroups;
-
-		// A failure here isn't fatal, and we'll still get data we can use.
-		(void)job_assumes_zero_p(j, getgrouplist(j->username, desired_gid, groups, &ngroups));
-
-		if (job_assumes_zero_p(j, syscall(SYS_initgroups, ngroups, groups, desired_uid)) == -1) {
-			_exit(EXIT_FAILURE);
+	if (fflags & NOTE_EXIT) {
+		if (kev->data & NOTE_EXIT_DECRYPTFAIL) {
+			j->fpfail = true;
+			job_log(j, LOG_WARNING, "FairPlay decryption failed on binary for job.");
+		} else if (kev->data & NOTE_EXIT_MEMORY) {
+			j->jettisoned = true;
+			job_log(j, LOG_INFO, "Job was killed due to memory pressure.");
 		}
-#endif
-	}
 
-	if (job_assumes_zero_p(j, setuid(desired_uid)) == -1) {
-		_exit(EXIT_FAILURE);
-	}
+		job_reap(j);
 
-	r = confstr(_CS_DARWIN_USER_TEMP_DIR, tmpdirpath, sizeof(tmpdirpath));
+		if (j->anonymous) {
+			job_remove(j);
+			j = NULL;
+		} else {
+			struct waiting4attach *w4ai = NULL;
+			struct waiting4attach *w4ait = NULL;
+			LIST_FOREACH_SAFE(w4ai, &_launchd_domain_waiters, le, w4ait) {
+				if (w4ai->dest == (pid_t)kev->ident) {
+					waiting4attach_delete(j->mgr, w4ai);
+				}
+			}
 
-	if (likely(r > 0 && r < sizeof(tmpdirpath))) {
-		setenv("TMPDIR", tmpdirpath, 0);
+			(void)job_dispatch(j, false);
+		}
 	}
-
-	setenv("SHELL", shellpath, 0);
-	setenv("HOME", homedir, 0);
-	setenv("USER", loginname, 0);
-	setenv("LOGNAME", loginname, 0);
 }
 
 void
-job_setup_attributes(job_t j)
+job_callback_timer(job_t j, void *ident)
 {
-	struct limititem *li;
-	struct envitem *ei;
-
-	if (unlikely(j->setnice)) {
-		(void)job_assumes_zero_p(j, setpriority(PRIO_PROCESS, 0, j->nice));
-	}
-
-	SLIST_FOREACH(li, &j->limits, sle) {
-		struct rlimit rl;
+	struct waiting_for_ready *w4rdy;
 
-		if (job_assumes_zero_p(j, getrlimit(li->which, &rl) == -1)) {
-			continue;
+	if (j == ident) {
+		job_log(j, LOG_DEBUG, "j == ident (%p)", ident);
+		job_dispatch(j, true);
+	} else if (&j->semaphores == ident) {
+		job_log(j, LOG_DEBUG, "&j->semaphores == ident (%p)", ident);
+		job_dispatch(j, false);
+	} else if (&j->start_interval == ident) {
+		job_log(j, LOG_DEBUG, "&j->start_interval == ident (%p)", ident);
+		j->start_pending = true;
+		job_dispatch(j, false);
+	} else if (j->capture[0] == ident || j->capture[1] == ident) {
+		struct job_capture *jc = ident;
+
+		jc->flush_pending = false;
+		job_capture_flush(j, jc);
+	} else if (&j->crash_burst_cnt == ident) {
+		job_crash_burst_flush(j);
+	} else if ((w4rdy = waiting4ready_find(j, ident))) {
+		job_log(j, LOG_NOTICE, "Job was not ready within the kickstart timeout.");
+		waiting4ready_delete(j, w4rdy, ETIMEDOUT);
+	} else if (&j->exit_timeout == ident) {
+		if (!job_assumes(j, j->p != 0)) {
+			return;
 		}
 
-		if (li->sethard) {
-			rl.rlim_max = li->lim.rlim_max;
-		}
-		if (li->setsoft) {
-			rl.rlim_cur = li->lim.rlim_cur;
-		}
+		if (j->sent_sigkill) {
+			uint64_t td = runtime_get_nanoseconds_since(j->sent_signal_time);
 
-		if (setrlimit(li->which, &rl) == -1) {
-			job_log_error(j, LOG_WARNING, "setrlimit()");
-		}
-	}
+			td /= NSEC_PER_SEC;
+			td -= j->clean_kill ? 0 : j->stop_grace;
 
-	if (unlikely(!j->inetcompat && j->session_create)) {
-		launchd_SessionCreate();
-	}
+			job_log(j, LOG_WARNING | LOG_CONSOLE, "Job has not died after being %skilled %llu seconds ago. Simulating exit.", j->clean_kill ? "cleanly " : "", td);
+			j->workaround9359725 = true;
 
-	if (unlikely(j->low_pri_io)) {
-		(void)job_assumes_zero_p(j, setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE));
-	}
-	if (j->low_priority_background_io) {
-		(void)job_assumes_zero_p(j, setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_DARWIN_BG, IOPOL_THROTTLE));
-	}
-	if (unlikely(j->rootdir)) {
-		(void)job_assumes_zero_p(j, chroot(j->rootdir));
-		(void)job_assumes_zero_p(j, chdir("."));
-	}
+			// This basically has to be done off the main thread. We have no
+			// mechanism for draining the main queue in our run loop (like CF
+			// does), and the kevent mechanism wants an object to be associated
+			// as the callback. So we just create a dispatch source and reap the
+			// errant PID whenever we can. Note that it is not safe for us to do
+			// any logging in this block, since logging requires exclusive
+			// access to global data structures that is only protected by the
+			// main thread.
+			dispatch_source_t hack_13570156 = dispatch_source_create(DISPATCH_SOURCE_TYPE_PROC, j->p, DISPATCH_PROC_EXIT, dispatch_get_global_queue(0, 0));
+			dispatch_source_set_event_handler(hack_13570156, ^{
+				pid_t pid = (pid_t)dispatch_source_get_handle(hack_13570156);
 
-	job_postfork_become_user(j);
+				int status = 0;
+				(void)waitpid(pid, &status, 0);
+				dispatch_release(hack_13570156);
+			});
 
-	if (unlikely(j->workingdir)) {
-		if (chdir(j->workingdir) == -1) {
-			if (errno == ENOENT || errno == ENOTDIR) {
-				job_log(j, LOG_ERR, "Job specified non-existent working directory: %s", j->workingdir);
-			} else {
-				(void)job_assumes_zero(j, errno);
-			}
-		}
-	}
+			dispatch_resume(hack_13570156);
 
-	if (unlikely(j->setmask)) {
-		umask(j->mask);
-	}
+			if (launchd_trap_sigkill_bugs) {
+				job_log(j, LOG_NOTICE | LOG_CONSOLE, "Trapping into kernel debugger. You can continue the machine after it has been debugged, and shutdown will proceed normally.");
+				(void)job_assumes_zero(j, host_reboot(mach_host_self(), HOST_REBOOT_DEBUGGER));
+			}
 
-	if (j->stdin_fd) {
-		(void)job_assumes_zero_p(j, dup2(j->stdin_fd, STDIN_FILENO));
+			struct kevent bogus_exit;
+			EV_SET(&bogus_exit, j->p, EVFILT_PROC, 0, NOTE_EXIT, 0, 0);
+			jobmgr_callback(j->mgr, &bogus_exit);
+		} else {
+			job_stop_grace_elapsed(j, "Exit timeout");
+		}
 	} else {
-		job_setup_fd(j, STDIN_FILENO, j->stdinpath, O_RDONLY|O_CREAT);
-	}
-	job_setup_fd(j, STDOUT_FILENO, j->stdoutpath, O_WRONLY|O_CREAT|O_APPEND);
-	job_setup_fd(j, STDERR_FILENO, j->stderrpath, O_WRONLY|O_CREAT|O_APPEND);
-
-	jobmgr_setup_env_from_other_jobs(j->mgr);
-
-	SLIST_FOREACH(ei, &j->env, sle) {
-		setenv(ei->key, ei->value, 1);
-	}
-
-#if !TARGET_OS_EMBEDDED	
-	if (j->jetsam_properties) {
-		(void)job_assumes_zero(j, proc_setpcontrol(PROC_SETPC_TERMINATE));
+		job_log(j, LOG_ERR, "Unrecognized job timer callback: %p", ident);
 	}
-#endif
+}
 
-#if TARGET_OS_EMBEDDED
-	if (j->main_thread_priority != 0) {
-		struct sched_param params;
-		bzero(&params, sizeof(params));
-		params.sched_priority = j->main_thread_priority;
-		(void)job_assumes_zero_p(j, pthread_setschedparam(pthread_self(), SCHED_OTHER, &params));
-	}
-#endif
+void
+job_callback_read(job_t j, int ident)
+{
+	struct job_capture *jc;
 
-	/*
-	 * We'd like to call setsid() unconditionally, but we have reason to
-	 * believe that prevents launchd from being able to send signals to
-	 * setuid children. We'll settle for process-groups.
-	 */
-	if (getppid() != 1) {
-		(void)job_assumes_zero_p(j, setpgid(0, 0));
+	if (ident == j->stdin_fd) {
+		job_dispatch(j, true);
+	} else if ((jc = job_capture_find(j, ident))) {
+		job_capture_drain(j, jc);
 	} else {
-		(void)job_assumes_zero_p(j, setsid());
+		socketgroup_callback(j);
 	}
 }
 
-void
-job_setup_fd(job_t j, int target_fd, const char *path, int flags)
+bool
+jobmgr_reap_bulk(jobmgr_t jm, struct kevent *kev)
 {
-	int fd;
+	jobmgr_t jmi;
+	job_t j;
+	bool found = false;
 
-	if (!path) {
-		return;
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		found |= jobmgr_reap_bulk(jmi, kev);
 	}
 
-	if ((fd = open(path, flags|O_NOCTTY, DEFFILEMODE)) == -1) {
-		job_log_error(j, LOG_WARNING, "open(\"%s\", ...)", path);
-		return;
+	if ((j = jobmgr_find_by_pid(jm, (pid_t)kev->ident, false))) {
+		kev->udata = j;
+		job_callback(j, kev);
+		found = true;
 	}
 
-	(void)job_assumes_zero_p(j, dup2(fd, target_fd));
-	(void)job_assumes_zero(j, runtime_close(fd));
+	return found;
 }
 
-void
-calendarinterval_setalarm(job_t j, struct calendarinterval *ci)
+void *
+job_proc_route_attach(job_t j, pid_t p)
 {
-	struct calendarinterval *ci_iter, *ci_prev = NULL;
-	time_t later, head_later;
+	struct proc_route *r;
 
-	later = cronemu(ci->when.tm_mon, ci->when.tm_mday, ci->when.tm_hour, ci->when.tm_min);
+	job_proc_route_detach(j);
 
-	if (ci->when.tm_wday != -1) {
-		time_t otherlater = cronemu_wday(ci->when.tm_wday, ci->when.tm_hour, ci->when.tm_min);
+	/* Re-adding the kevent replaces its udata, so an orphaned route for the
+	 * same process would never see its NOTE_EXIT. Adopt it instead.
+	 */
+	if ((r = proc_route_find(p)) && r->j == NULL) {
+		r->j = j;
+		r->gen = ++s_proc_route_gen;
+		j->proc_gen = r->gen;
+		j->proc_route = r;
+		return r;
+	}
 
-		if (ci->when.tm_mday == -1) {
-			later = otherlater;
-		} else {
-			later = later < otherlater ? later : otherlater;
-		}
+	/* If we can't allocate a route, the events go to the root job manager
+	 * and are found the slow way.
+	 */
+	if (!job_assumes(j, (r = calloc(1, sizeof(*r))) != NULL)) {
+		return root_jobmgr ? root_jobmgr : j->mgr;
 	}
 
-	ci->when_next = later;
+	r->kqproc_callback = proc_route_callback;
+	r->j = j;
+	r->p = p;
+	r->gen = ++s_proc_route_gen;
+	j->proc_gen = r->gen;
+	j->proc_route = r;
 
-	LIST_FOREACH(ci_iter, &sorted_calendar_events, global_sle) {
-		if (ci->when_next < ci_iter->when_next) {
-			LIST_INSERT_BEFORE(ci_iter, ci, global_sle);
-			break;
-		}
+	return r;
+}
 
-		ci_prev = ci_iter;
+void
+job_proc_route_armed(job_t j)
+{
+	if (j->proc_route && !j->proc_route->armed) {
+		j->proc_route->armed = true;
+		LIST_INSERT_HEAD(&s_proc_routes[ACTIVE_JOB_HASH(j->proc_route->p)], j->proc_route, pid_hash_sle);
 	}
+}
 
-	if (ci_iter == NULL) {
-		// ci must want to fire after every other timer, or there are no timers
+void
+job_proc_route_detach(job_t j)
+{
+	struct proc_route *r = j->proc_route;
 
-		if (LIST_EMPTY(&sorted_calendar_events)) {
-			LIST_INSERT_HEAD(&sorted_calendar_events, ci, global_sle);
-		} else {
-			LIST_INSERT_AFTER(ci_prev, ci, global_sle);
-		}
+	if (!r) {
+		return;
 	}
 
-	head_later = LIST_FIRST(&sorted_calendar_events)->when_next;
-
-	if (job_assumes_zero_p(j, kevent_mod((uintptr_t)&sorted_calendar_events, EVFILT_TIMER, EV_ADD, NOTE_ABSOLUTE|NOTE_SECONDS, head_later, root_jobmgr)) != -1) {
-		char time_string[100];
-		size_t time_string_len;
-
-		ctime_r(&later, time_string);
-		time_string_len = strlen(time_string);
-
-		if (likely(time_string_len && time_string[time_string_len - 1] == '\n')) {
-			time_string[time_string_len - 1] = '\0';
-		}
+	j->proc_route = NULL;
+	j->proc_gen = 0;
 
-		job_log(j, LOG_INFO, "Scheduled to run again at %s", time_string);
+	if (r->armed) {
+		// The kernel still knows about it. Wait for its NOTE_EXIT.
+		r->j = NULL;
+	} else {
+		free(r);
 	}
 }
 
-bool
-jobmgr_log_bug(_SIMPLE_STRING asl_message __attribute__((unused)), void *ctx, const char *message)
+struct proc_route *
+proc_route_find(pid_t p)
 {
-	jobmgr_t jm = ctx;
-	jobmgr_log(jm, LOG_ERR, "%s", message);
+	struct proc_route *r = NULL;
 
-	return true;
+	LIST_FOREACH(r, &s_proc_routes[ACTIVE_JOB_HASH(p)], pid_hash_sle) {
+		if (r->p == p) {
+			break;
+		}
+	}
+
+	return r;
 }
 
-bool
-job_log_bug(_SIMPLE_STRING asl_message __attribute__((unused)), void *ctx, const char *message)
+void
+proc_route_count(bool direct)
 {
-	job_t j = ctx;
-	job_log(j, LOG_ERR, "%s", message);
+	if (direct) {
+		s_proc_route_direct++;
+	} else {
+		s_proc_route_fallback++;
+	}
 
-	return true;
+	if ((s_proc_route_direct + s_proc_route_fallback) % PROC_ROUTE_STATS_INTERVAL == 0) {
+		launchd_syslog(LOG_PERF, "Process events: %llu routed directly, %llu through the bulk reap fallback.", s_proc_route_direct, s_proc_route_fallback);
+	}
 }
 
-// ri: NULL = please sample j->p; non-NULL = use this sample
 void
-job_log_perf_statistics(job_t j, struct rusage_info_v1 *ri, int64_t exit_status)
+proc_route_callback(void *obj, struct kevent *kev)
 {
-#if HAVE_SYSTEMSTATS
-	if (j->anonymous || !j->p) {
-		return;
-	}
-	if (!systemstats_is_enabled()) {
-		return;
-	}
-	const char *name;
-	if (j->cfbundleidentifier) {
-		name = j->cfbundleidentifier;
+	struct proc_route *r = obj;
+	job_t j = r->j;
+
+	// A job's own process may also be one of another job's descendants.
+	job_descendant_callback(kev);
+
+	if (j && j->proc_route == r && j->proc_gen == r->gen && j->p == r->p) {
+		proc_route_count(true);
+		kev->udata = j;
+		job_callback(j, kev);
 	} else {
-		name = j->label;
-	}
-	int r = 0;
-	struct rusage_info_v1 ris;
-	if (ri == NULL) {
-		ri = &ris;
-		r = proc_pid_rusage(j->p, RUSAGE_INFO_V1, (rusage_info_t)ri);
+		proc_route_count(false);
+		(void)jobmgr_reap_bulk(root_jobmgr, kev);
 	}
-	if (r == -1) {
-		return;
+
+	if (kev->fflags & NOTE_EXIT) {
+		if (r->j) {
+			r->j->proc_route = NULL;
+			r->j->proc_gen = 0;
+		}
+		LIST_REMOVE(r, pid_hash_sle);
+		free(r);
 	}
-	job_log_systemstats(j->p, j->uniqueid, runtime_get_uniqueid(), j->mgr->req_pid, j->mgr->req_uniqueid, name, ri, exit_status);
-#else
-#pragma unused (j, ri, exit_status)
-#endif
+
+	root_jobmgr = jobmgr_do_garbage_collection(root_jobmgr);
 }
 
-#if HAVE_SYSTEMSTATS
-// ri: NULL = don't write fields from ri; non-NULL = use this sample
-static
 void
-job_log_systemstats(pid_t pid, uint64_t uniqueid, uint64_t parent_uniqueid, pid_t req_pid, uint64_t req_uniqueid, const char *name, struct rusage_info_v1 *ri, int64_t exit_status)
+jobmgr_callback(void *obj, struct kevent *kev)
 {
-	if (!systemstats_is_enabled()) {
-		return;
-	}
+	jobmgr_t jm = obj;
+	struct job_stop_group *g;
+	struct job_throttle *t;
 
-	struct systemstats_process_usage_s info;
-	bzero(&info, sizeof(info));
-	info.name = name;
-	info.pid = pid;
-	info.exit_status = exit_status;
-	info.uid = getuid();
-	info.ppid = getpid();
-	info.responsible_pid = req_pid;
-
-	if (likely(ri)) {
-		info.macho_uuid = (const uint8_t *)&ri->ri_uuid;
-		info.user_time = ri->ri_user_time;
-		info.system_time = ri->ri_system_time;
-		info.pkg_idle_wkups = ri->ri_pkg_idle_wkups;
-		info.interrupt_wkups = ri->ri_interrupt_wkups;
-		info.proc_start_abstime = ri->ri_proc_start_abstime;
-		info.proc_exit_abstime = ri->ri_proc_exit_abstime;
-#if SYSTEMSTATS_API_VERSION >= 20130319
-		info.pageins = ri->ri_pageins;
-		info.wired_size = ri->ri_wired_size;
-		info.resident_size = ri->ri_resident_size;
-		info.phys_footprint = ri->ri_phys_footprint;
-		// info.purgeablesize = ???
+#if TARGET_OS_EMBEDDED
+	int flag2check = VQ_MOUNT;
+#else
+	int flag2check = VQ_UPDATE;
 #endif
-#if SYSTEMSTATS_API_VERSION >= 20130328
-		info.child_user_time = ri->ri_child_user_time;
-		info.child_system_time = ri->ri_child_system_time;
-		info.child_pkg_idle_wkups = ri->ri_child_pkg_idle_wkups;
-		info.child_interrupt_wkups = ri->ri_child_interrupt_wkups;
-		info.child_pageins = ri->ri_child_pageins;
-		info.child_elapsed_abstime = ri->ri_child_elapsed_abstime;
+
+	switch (kev->filter) {
+	case EVFILT_PROC:
+		// Only jobs whose route couldn't be allocated, and simulated exits, land here.
+		job_descendant_callback(kev);
+		proc_route_count(false);
+		(void)jobmgr_reap_bulk(jm, kev);
+		root_jobmgr = jobmgr_do_garbage_collection(root_jobmgr);
+		break;
+	case EVFILT_SIGNAL:
+		switch (kev->ident) {
+		case SIGTERM:			
+			jobmgr_log(jm, LOG_DEBUG, "Got SIGTERM. Shutting down.");
+			return launchd_shutdown();
+		case SIGUSR1:
+			return calendarinterval_callback();
+		case SIGUSR2:
+			// Turn on all logging.
+			launchd_log_perf = true;
+			launchd_log_debug = true;
+			launchd_log_shutdown = true;
+			/* Hopefully /var is available by this point. If not, uh, oh well.
+			 * It's just a debugging facility.
+			 */
+			return jobmgr_log_perf_statistics(jm, false);
+		case SIGINFO:
+			return jobmgr_log_perf_statistics(jm, true);
+		default:
+			jobmgr_log(jm, LOG_ERR, "Unrecognized signal: %lu: %s", kev->ident, strsignal(kev->ident));
+		}
+		break;
+	case EVFILT_FS:
+		if (kev->fflags & flag2check) {
+			if (!launchd_var_available) {
+				struct stat sb;
+				if (stat("/var/log", &sb) == 0 && (sb.st_mode & S_IWUSR)) {
+					launchd_var_available = true;
+				}
+			}
+		} else if (kev->fflags & VQ_MOUNT) {
+			jobmgr_dispatch_all(jm, true);
+		}
+		jobmgr_dispatch_all_semaphores(jm);
+		break;
+	case EVFILT_TIMER:
+		if (kev->ident == (uintptr_t)&sorted_calendar_events) {
+			calendarinterval_callback();
+		} else if (kev->ident == (uintptr_t)jm) {
+			jobmgr_log(jm, LOG_DEBUG, "Shutdown timer firing.");
+			jobmgr_still_alive_with_check(jm);
+		} else if (kev->ident == (uintptr_t)&jm->reboot_flags) {
+			jobmgr_do_garbage_collection(jm);
+		} else if (jm->subset_import && kev->ident == (uintptr_t)jm->subset_import) {
+			jm->subset_import->timer_armed = false;
+			jobmgr_subset_import_step(jm, SUBSET_IMPORT_BATCH);
+		} else if ((g = job_stop_group_find(kev->ident))) {
+			job_stop_group_callback(g);
+		} else if ((t = job_throttle_find(kev->ident))) {
+			t->timer_armed = false;
+			job_throttle_pump(t, NULL);
+			job_throttle_settle(t);
+		} else if (kev->ident == (uintptr_t)&launchd_runtime_busy_time) {
+			jobmgr_log(jm, LOG_DEBUG, "Idle exit timer fired. Shutting down.");
+			if (jobmgr_assumes_zero(jm, runtime_busy_cnt) == 0) {
+				return launchd_shutdown();
+			}
+#if HAVE_SYSTEMSTATS
+		} else if (kev->ident == (uintptr_t)systemstats_timer_callback) {
+			systemstats_timer_callback();
 #endif
+		}
+		break;
+	case EVFILT_VNODE:
+		if (kev->ident == (uintptr_t)s_no_hang_fd) {
+			int _no_hang_fd = open("/dev/autofs_nowait", O_EVTONLY | O_NONBLOCK);
+			if (unlikely(_no_hang_fd != -1)) {
+				jobmgr_log(root_jobmgr, LOG_DEBUG, "/dev/autofs_nowait has appeared!");
+				(void)jobmgr_assumes_zero_p(root_jobmgr, kevent_mod((uintptr_t)s_no_hang_fd, EVFILT_VNODE, EV_DELETE, 0, 0, NULL));
+				(void)jobmgr_assumes_zero_p(root_jobmgr, runtime_close(s_no_hang_fd));
+				s_no_hang_fd = _fd(_no_hang_fd);
+			}
+		} else if (pid1_magic && launchd_console && kev->ident == (uintptr_t)fileno(launchd_console)) {
+			int cfd = -1;
+			if (jobmgr_assumes_zero_p(jm, cfd = open(_PATH_CONSOLE, O_WRONLY | O_NOCTTY)) != -1) {
+				_fd(cfd);
+				if (!(launchd_console = fdopen(cfd, "w"))) {
+					(void)jobmgr_assumes_zero(jm, errno);
+					(void)close(cfd);
+				}
+			}
+		}
+		break;
+	default:
+		jobmgr_log(jm, LOG_ERR, "Unrecognized kevent filter: %hd", kev->filter);
 	}
-#if SYSTEMSTATS_API_VERSION >= 20130410
-	info.uniqueid = uniqueid;
-	info.parent_uniqueid = parent_uniqueid;
-	info.responsible_uniqueid = req_uniqueid;
-#endif
-	systemstats_write_process_usage(&info);
 }
-#endif /* HAVE_SYSTEMSTATS */
 
-struct waiting4attach *
-waiting4attach_new(jobmgr_t jm, const char *name, mach_port_t port, pid_t dest, xpc_service_type_t type)
+void
+job_callback(void *obj, struct kevent *kev)
 {
-	size_t xtra = strlen(name) + 1;
-
-	struct waiting4attach *w4a = malloc(sizeof(*w4a) + xtra);
-	if (!w4a) {
-		return NULL;
-	}
+	job_t j = obj;
 
-	w4a->port = port;
-	w4a->dest = dest;
-	w4a->type = type;
-	(void)strcpy(w4a->name, name);
+	job_log(j, LOG_DEBUG, "Dispatching kevent callback.");
 
-	if (dest) {
-		LIST_INSERT_HEAD(&_launchd_domain_waiters, w4a, le);
-	} else {
-		LIST_INSERT_HEAD(&jm->attaches, w4a, le);
+	switch (kev->filter) {
+	case EVFILT_PROC:
+		return job_callback_proc(j, kev);
+	case EVFILT_TIMER:
+		return job_callback_timer(j, (void *) kev->ident);
+	case EVFILT_READ:
+		return job_callback_read(j, (int) kev->ident);
+	case EVFILT_MACHPORT:
+		return (void)job_dispatch(j, true);
+	default:
+		job_log(j, LOG_ERR, "Unrecognized job callback filter: %hd", kev->filter);
 	}
-
-
-	(void)jobmgr_assumes_zero(jm, launchd_mport_notify_req(port, MACH_NOTIFY_DEAD_NAME));
-	return w4a;
 }
 
 void
-waiting4attach_delete(jobmgr_t jm, struct waiting4attach *w4a)
+job_start(job_t j)
 {
-	jobmgr_log(jm, LOG_DEBUG, "Canceling dead-name notification for waiter port: 0x%x", w4a->port);
-
-	LIST_REMOVE(w4a, le);
+	uint64_t td;
+	int spair[2];
+	int execspair[2];
+	char nbuf[64];
+	pid_t c;
+	bool sipc = false;
+	u_int proc_fflags = NOTE_EXIT|NOTE_FORK|NOTE_EXEC|NOTE_EXIT_DETAIL|NOTE_EXITSTATUS;
 
-	mach_port_t previous = MACH_PORT_NULL;
-	(void)jobmgr_assumes_zero(jm, mach_port_request_notification(mach_task_self(), w4a->port, MACH_NOTIFY_DEAD_NAME, 0, MACH_PORT_NULL, MACH_MSG_TYPE_MOVE_SEND_ONCE, &previous));
-	if (previous) {
-		(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(previous));
+	if (!job_assumes(j, j->mgr != NULL)) {
+		return;
 	}
 
-	jobmgr_assumes_zero(jm, launchd_mport_deallocate(w4a->port));
-	free(w4a);
-}
-
-struct waiting4attach *
-waiting4attach_find(jobmgr_t jm, job_t j)
-{
-	char *name2use = (char *)j->label;
-	if (j->app) {
-		struct envitem *ei = NULL;
-		SLIST_FOREACH(ei, &j->env, sle) {
-			if (strcmp(ei->key, XPC_SERVICE_RENDEZVOUS_TOKEN) == 0) {
-				name2use = ei->value;
-				break;
-			}
-		}
+	if (unlikely(job_active(j))) {
+		job_log(j, LOG_DEBUG, "Already started");
+		return;
 	}
 
-	struct waiting4attach *w4ai = NULL;
-	LIST_FOREACH(w4ai, &jm->attaches, le) {
-		if (strcmp(name2use, w4ai->name) == 0) {
-			job_log(j, LOG_DEBUG, "Found attachment: %s", name2use);
-			break;
-		}
+	if (!LIST_EMPTY(&j->mgr->attaches)) {
+		job_log(j, LOG_DEBUG, "Looking for attachments for job: %s", j->label);
+		(void)waiting4attach_find(j->mgr, j);
 	}
 
-	return w4ai;
-}
+	/*
+	 * Some users adjust the wall-clock and then expect software to not notice.
+	 * Therefore, launchd must use an absolute clock instead of the wall clock
+	 * wherever possible.
+	 */
+	td = runtime_get_nanoseconds_since(j->start_time);
+	td /= NSEC_PER_SEC;
 
-void
-job_logv(job_t j, int pri, int err, const char *msg, va_list ap)
-{
-	const char *label2use = j ? j->label : "com.apple.launchd.job-unknown";
-	const char *mgr2use = j ? j->mgr->name : "com.apple.launchd.jobmanager-unknown";
-	char *newmsg;
-	int oldmask = 0;
-	size_t newmsgsz;
+	if (j->start_time && (td < j->min_run_time) && !j->legacy_mach_job && !j->inetcompat && !j->unthrottle) {
+		time_t respawn_delta = j->min_run_time - (uint32_t)td;
+		/* We technically should ref-count throttled jobs to prevent idle exit,
+		 * but we're not directly tracking the 'throttled' state at the moment.
+		 */
+		job_log(j, LOG_NOTICE, "Throttling respawn: Will start in %ld seconds", respawn_delta);
+		job_history_record(j, JOB_HISTORY_THROTTLE, (int32_t)respawn_delta, JOB_HISTORY_REASON_NONE);
+		(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)j, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, respawn_delta, j));
+		job_ignore(j);
+		return;
+	}
 
-	struct launchd_syslog_attr attr = {
-		.from_name = launchd_label,
-		.about_name = label2use,
-		.session_name = mgr2use,
-		.priority = pri,
-		.from_uid = getuid(),
-		.from_pid = getpid(),
-		.about_pid = j ? j->p : 0,
-	};
+	if (likely(!j->legacy_mach_job)) {
+		sipc = ((!SLIST_EMPTY(&j->sockets) || !SLIST_EMPTY(&j->machservices)) && !j->deny_job_creation) || j->embedded_god;
+	}
 
-	/* Hack: If bootstrap_port is set, we must be on the child side of a
-	 * fork(2), but before the exec*(3). Let's route the log message back to
-	 * launchd proper.
-	 */
-	if (bootstrap_port) {
-		return _vproc_logv(pri, err, msg, ap);
+	if (sipc) {
+		(void)job_assumes_zero_p(j, socketpair(AF_UNIX, SOCK_STREAM, 0, spair));
 	}
 
-	newmsgsz = strlen(msg) + 200;
-	newmsg = alloca(newmsgsz);
+	(void)job_assumes_zero_p(j, socketpair(AF_UNIX, SOCK_STREAM, 0, execspair));
+	job_capture_prepare(j);
+	jobmgr_global_env_materialize(j->mgr);
 
-	if (err) {
-#if !TARGET_OS_EMBEDDED
-		snprintf(newmsg, newmsgsz, "%s: %d: %s", msg, err, strerror(err));
-#else
-		snprintf(newmsg, newmsgsz, "(%s) %s: %d: %s", label2use, msg, err, strerror(err));
-#endif
-	} else {
-#if !TARGET_OS_EMBEDDED
-		snprintf(newmsg, newmsgsz, "%s", msg);
-#else
-		snprintf(newmsg, newmsgsz, "(%s) %s", label2use, msg);
-#endif
-	}
-
-	if (j && unlikely(j->debug)) {
-		oldmask = setlogmask(LOG_UPTO(LOG_DEBUG));
-	}
+	switch (c = runtime_fork(j->weird_bootstrap ? j->j_port : j->mgr->jm_port)) {
+	case -1:
+		job_history_record(j, JOB_HISTORY_SPAWN_FAILED, errno, JOB_HISTORY_REASON_NONE);
+		job_log_error(j, LOG_ERR, "fork() failed, will try again in one second");
+		(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)j, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, 1, j));
+		job_ignore(j);
 
-	launchd_vsyslog(&attr, newmsg, ap);
+		(void)job_assumes_zero(j, runtime_close(execspair[0]));
+		(void)job_assumes_zero(j, runtime_close(execspair[1]));
+		if (sipc) {
+			(void)job_assumes_zero(j, runtime_close(spair[0]));
+			(void)job_assumes_zero(j, runtime_close(spair[1]));
+		}
+		job_capture_close(j, j->capture[0]);
+		job_capture_close(j, j->capture[1]);
+		break;
+	case 0:
+		if (unlikely(_vproc_post_fork_ping())) {
+			_exit(EXIT_FAILURE);
+		}
 
-	if (j && unlikely(j->debug)) {
-		setlogmask(oldmask);
-	}
-}
+		(void)job_assumes_zero(j, runtime_close(execspair[0]));
+		// wait for our parent to say they've attached a kevent to us
+		read(_fd(execspair[1]), &c, sizeof(c));
 
-void
-job_log_error(job_t j, int pri, const char *msg, ...)
-{
-	va_list ap;
+		if (sipc) {
+			(void)job_assumes_zero(j, runtime_close(spair[0]));
+			snprintf(nbuf, sizeof(nbuf), "%d", spair[1]);
+			setenv(LAUNCHD_TRUSTED_FD_ENV, nbuf, 1);
+		}
+		job_start_child(j);
+		break;
+	default:
+		j->start_time = runtime_get_opaque_time();
 
-	va_start(ap, msg);
-	job_logv(j, pri, errno, msg, ap);
-	va_end(ap);
-}
+		job_log(j, LOG_DEBUG, "Started as PID: %u", c);
+		uint8_t spawn_reason = j->unthrottle ? JOB_HISTORY_REASON_UNTHROTTLED : JOB_HISTORY_REASON_NONE;
 
-void
-job_log(job_t j, int pri, const char *msg, ...)
-{
-	va_list ap;
+		j->did_exec = false;
+		j->fpfail = false;
+		j->jettisoned = false;
+		j->xpcproxy_did_exec = false;
+		j->checkedin = false;
+		j->checkedin_sockets = false;
+		j->ready_latency = 0;
+		j->start_pending = false;
+		j->reaped = false;
+		j->crashed = false;
+		j->stopped = false;
+		j->workaround9359725 = false;
+		j->implicit_reap = false;
+		j->unthrottle = false;
+		if (j->needs_kickoff) {
+			j->needs_kickoff = false;
 
-	va_start(ap, msg);
-	job_logv(j, pri, 0, msg, ap);
-	va_end(ap);
-}
+			if (SLIST_EMPTY(&j->semaphores)) {
+				j->ondemand = false;
+			}
+		}
 
-#if 0
-void
-jobmgr_log_error(jobmgr_t jm, int pri, const char *msg, ...)
-{
-	va_list ap;
+		if (j->has_console) {
+			launchd_wsp = c;
+		}
 
-	va_start(ap, msg);
-	jobmgr_logv(jm, pri, errno, msg, ap);
-	va_end(ap);
-}
-#endif
+		job_log(j, LOG_PERF, "Job started.");
+		runtime_add_ref();
+		total_children++;
+		LIST_INSERT_HEAD(&j->mgr->active_jobs[ACTIVE_JOB_HASH(c)], j, pid_hash_sle);
+		LIST_INSERT_HEAD(&managed_actives[ACTIVE_JOB_HASH(c)], j, global_pid_hash_sle);
+		j->p = c;
+		job_per_pid_services_index(j);
+		job_history_record(j, JOB_HISTORY_SPAWN, 0, spawn_reason);
 
-void
-jobmgr_log_perf_statistics(jobmgr_t jm, bool signal_children)
-{
-#if HAVE_SYSTEMSTATS
-	// Log information for kernel_task and pid 1 launchd.
-	if (systemstats_is_enabled() && pid1_magic && jm == root_jobmgr) {
-#if SYSTEMSTATS_API_VERSION >= 20130328
-		if (_systemstats_get_property(SYSTEMSTATS_API_VERSION, SYSTEMSTATS_WRITER_launchd, SYSTEMSTATS_PROPERTY_SHOULD_LOG_ENERGY_STATISTICS)) {
-			systemstats_write_intel_energy_statistics(NULL);
+		struct proc_uniqidentifierinfo info;
+		if (proc_pidinfo(c, PROC_PIDUNIQIDENTIFIERINFO, 0, &info, PROC_PIDUNIQIDENTIFIERINFO_SIZE) != 0) {
+			// ignore errors here, kevent_mod below will catch them and clean up
+			j->uniqueid = info.p_uniqueid;
 		}
-#else
-		systemstats_write_intel_energy_statistics(NULL);
-#endif
-		job_log_systemstats(0, 0, 0, 0, 0, "com.apple.kernel", NULL, -1);
-		job_log_systemstats(1, 1, 0, 1, 1, "com.apple.launchd", NULL, -1);
-	}
-#endif
-	jobmgr_t jmi = NULL;
-	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
-		jobmgr_log_perf_statistics(jmi, signal_children);
-	}
 
-	if (jm->xpc_singleton) {
-		jobmgr_log(jm, LOG_PERF, "XPC Singleton Domain: %s", jm->shortdesc);
-	} else if (jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
-		jobmgr_log(jm, LOG_PERF, "XPC Private Domain: %s", jm->owner);
-	} else if (jm->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET) {
-		jobmgr_log(jm, LOG_PERF, "Created via bootstrap_subset()");
-	}
+		j->mgr->normal_active_cnt++;
+		j->fork_fd = _fd(execspair[0]);
+		(void)job_assumes_zero(j, runtime_close(execspair[1]));
+		job_capture_attach(j);
+		if (sipc) {
+			(void)job_assumes_zero(j, runtime_close(spair[1]));
+			ipc_open(_fd(spair[0]), j);
+		}
+		if (kevent_mod(c, EVFILT_PROC, EV_ADD, proc_fflags, 0, job_proc_route_attach(j, c)) != -1) {
+			job_proc_route_armed(j);
+			job_ignore(j);
+		} else {
+			if (errno == ESRCH) {
+				job_log(j, LOG_ERR, "Child was killed before we could attach a kevent.");
+			} else {
+				(void)job_assumes(j, errno == ESRCH);
+			}
+			job_reap(j);
 
-	jobmgr_log(jm, LOG_PERF, "Jobs in job manager:");
+			/* If we have reaped this job within this same run loop pass, then
+			 * it will be currently ignored. So if there's a failure to attach a
+			 * kevent, we need to make sure that we watch the job so that we can
+			 * respawn it.
+			 *
+			 * See <rdar://problem/10140809>.
+			 */
+			job_watch(j);
+		}
 
-	job_t ji = NULL;
-	LIST_FOREACH(ji, &jm->jobs, sle) {
-		job_log_perf_statistics(ji, NULL, -1);
-		if (unlikely(signal_children) && unlikely(strstr(ji->label, "com.apple.launchd.peruser.") == ji->label)) {
-			jobmgr_log(jm, LOG_PERF, "Sending SIGINFO to peruser launchd %d", ji->p);
-			kill(ji->p, SIGINFO);
+#if HAVE_SYSTEMSTATS
+		if (systemstats_is_enabled()) {
+			/* We don't really *need* to make the full rusage call -- it
+			 * will be mostly 0s and very small numbers. We only need
+			 * ri_proc_start_abstime, because that's how we disambiguiate
+			 * PIDs when they wrap around; and the UUID.
+			 * In the future we should use the 64-bit process unique ID,
+			 * so there's nothing to disambiguiate, and skip the full
+			 * rusage call here.
+			 *
+			 * Well, the future is now.
+			 */
+			if (_systemstats_get_property(SYSTEMSTATS_API_VERSION, SYSTEMSTATS_WRITER_launchd, SYSTEMSTATS_PROPERTY_LAUNCHD_SHOULD_LOG_JOB_START)) {
+				job_log_perf_statistics(j, NULL, -3);
+			}
+		}
+#endif
+		j->wait4debugger_oneshot = false;
+		if (likely(!j->stall_before_exec)) {
+			job_uncork_fork(j);
 		}
+		break;
 	}
-
-	jobmgr_log(jm, LOG_PERF, "End of job list.");
 }
 
 void
-jobmgr_log(jobmgr_t jm, int pri, const char *msg, ...)
+job_start_child(job_t j)
 {
-	va_list ap;
+	typeof(posix_spawn) *psf;
+	const char *file2exec = "/usr/libexec/launchproxy";
+	const char **argv;
+	posix_spawnattr_t spattr;
+	int gflags = GLOB_NOSORT|GLOB_NOCHECK|GLOB_TILDE|GLOB_DOOFFS;
+	glob_t g;
+	short spflags = POSIX_SPAWN_SETEXEC;
+	int psproctype = POSIX_SPAWN_PROC_TYPE_DAEMON_BACKGROUND;
+	size_t binpref_out_cnt = 0;
+	size_t i;
 
-	va_start(ap, msg);
-	jobmgr_logv(jm, pri, 0, msg, ap);
-	va_end(ap);
-}
+	(void)job_assumes_zero(j, posix_spawnattr_init(&spattr));
 
-void
-jobmgr_logv(jobmgr_t jm, int pri, int err, const char *msg, va_list ap)
-{
-	if (!jm) {
-		jm = root_jobmgr;
-	}
+	job_setup_attributes(j);
 
-	char *newmsg;
-	char *newname;
-	size_t i, o, jmname_len = strlen(jm->name), newmsgsz;
+	bool use_xpcproxy = false;
+	struct waiting4attach *w4a = waiting4attach_find(j->mgr, j);
+	if (w4a) {
+		(void)setenv(XPC_SERVICE_ENV_ATTACHED, "1", 1);
+		if (!j->xpc_service) {
+			use_xpcproxy = true;
+		}
+	}
 
-	newname = alloca((jmname_len + 1) * 2);
-	newmsgsz = (jmname_len + 1) * 2 + strlen(msg) + 100;
-	newmsg = alloca(newmsgsz);
+	if (use_xpcproxy) {
+		argv = alloca(3 * sizeof(char *));
+		argv[0] = "/usr/libexec/xpcproxy";
+		argv[1] = "-debug";
+		argv[2] = NULL;
 
-	for (i = 0, o = 0; i < jmname_len; i++, o++) {
-		if (jm->name[i] == '%') {
-			newname[o] = '%';
-			o++;
+		file2exec = argv[0];
+	} else if (unlikely(j->argv && j->globargv)) {
+		g.gl_offs = 1;
+		for (i = 0; i < j->argc; i++) {
+			if (i > 0) {
+				gflags |= GLOB_APPEND;
+			}
+			if (glob(j->argv[i], gflags, NULL, &g) != 0) {
+				job_log_error(j, LOG_ERR, "glob(\"%s\")", j->argv[i]);
+				exit(EXIT_FAILURE);
+			}
 		}
-		newname[o] = jm->name[i];
+		g.gl_pathv[0] = (char *)file2exec;
+		argv = (const char **)g.gl_pathv;
+	} else if (likely(j->argv)) {
+		argv = alloca((j->argc + 2) * sizeof(char *));
+		argv[0] = file2exec;
+		for (i = 0; i < j->argc; i++) {
+			argv[i + 1] = j->argv[i];
+		}
+		argv[i + 1] = NULL;
+	} else {
+		argv = alloca(3 * sizeof(char *));
+		argv[0] = file2exec;
+		argv[1] = j->prog;
+		argv[2] = NULL;
 	}
-	newname[o] = '\0';
 
-	if (err) {
-		snprintf(newmsg, newmsgsz, "%s: %s: %s", newname, msg, strerror(err));
-	} else {
-		snprintf(newmsg, newmsgsz, "%s: %s", newname, msg);
+	if (likely(!(j->inetcompat || use_xpcproxy))) {
+		argv++;
 	}
 
-	if (jm->parentmgr) {
-		jobmgr_logv(jm->parentmgr, pri, 0, newmsg, ap);
-	} else {
-		struct launchd_syslog_attr attr = {
-			.from_name = launchd_label,
-			.about_name = launchd_label,
-			.session_name = jm->name,
-			.priority = pri,
-			.from_uid = getuid(),
-			.from_pid = getpid(),
-			.about_pid = getpid(),
-		};
-
-		launchd_vsyslog(&attr, newmsg, ap);
+	if (unlikely(j->wait4debugger || j->wait4debugger_oneshot)) {
+		if (!j->app) {
+			job_log(j, LOG_WARNING, "Spawned and waiting for the debugger to attach before continuing...");
+		}
+		spflags |= POSIX_SPAWN_START_SUSPENDED;
 	}
-}
-
-struct cal_dict_walk {
-	job_t j;
-	struct tm tmptm;
-};
-
-void
-calendarinterval_new_from_obj_dict_walk(launch_data_t obj, const char *key, void *context)
-{
-	struct cal_dict_walk *cdw = context;
-	struct tm *tmptm = &cdw->tmptm;
-	job_t j = cdw->j;
-	int64_t val;
 
-	if (unlikely(LAUNCH_DATA_INTEGER != launch_data_get_type(obj))) {
-		// hack to let caller know something went wrong
-		tmptm->tm_sec = -1;
-		return;
+#if !TARGET_OS_EMBEDDED
+	if (unlikely(j->disable_aslr)) {
+		spflags |= _POSIX_SPAWN_DISABLE_ASLR;
 	}
+#endif
+	spflags |= j->pstype;
 
-	val = launch_data_get_integer(obj);
-
-	if (val < 0) {
-		job_log(j, LOG_WARNING, "The interval for key \"%s\" is less than zero.", key);
-	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_MINUTE) == 0) {
-		if (val > 59) {
-			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 0 and 59 (inclusive).", key);
-			tmptm->tm_sec = -1;
-		} else {
-			tmptm->tm_min = (typeof(tmptm->tm_min)) val;
-		}
-	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_HOUR) == 0) {
-		if (val > 23) {
-			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 0 and 23 (inclusive).", key);
-			tmptm->tm_sec = -1;
-		} else {
-			tmptm->tm_hour = (typeof(tmptm->tm_hour)) val;
-		}
-	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_DAY) == 0) {
-		if (val < 1 || val > 31) {
-			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 1 and 31 (inclusive).", key);
-			tmptm->tm_sec = -1;
-		} else {
-			tmptm->tm_mday = (typeof(tmptm->tm_mday)) val;
-		}
-	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_WEEKDAY) == 0) {
-		if (val > 7) {
-			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 0 and 7 (inclusive).", key);
-			tmptm->tm_sec = -1;
-		} else {
-			tmptm->tm_wday = (typeof(tmptm->tm_wday)) val;
-		}
-	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_MONTH) == 0) {
-		if (val > 12) {
-			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 0 and 12 (inclusive).", key);
-			tmptm->tm_sec = -1;
-		} else {
-			tmptm->tm_mon = (typeof(tmptm->tm_mon)) val;
-			tmptm->tm_mon -= 1; // 4798263 cron compatibility
-		}
+	(void)job_assumes_zero(j, posix_spawnattr_setflags(&spattr, spflags));
+	if (unlikely(j->j_binpref_cnt)) {
+		(void)job_assumes_zero(j, posix_spawnattr_setbinpref_np(&spattr, j->j_binpref_cnt, j->j_binpref, &binpref_out_cnt));
+		(void)job_assumes(j, binpref_out_cnt == j->j_binpref_cnt);
 	}
-}
 
-bool
-calendarinterval_new_from_obj(job_t j, launch_data_t obj)
-{
-	struct cal_dict_walk cdw;
+	psproctype = j->psproctype;
+	(void)job_assumes_zero(j, posix_spawnattr_setprocesstype_np(&spattr, psproctype));
 
-	cdw.j = j;
-	memset(&cdw.tmptm, 0, sizeof(0));
+#if TARGET_OS_EMBEDDED
+	/* Set jetsam attributes. POSIX_SPAWN_JETSAM_USE_EFFECTIVE_PRIORITY guards
+	 * against a race which arises if, during spawn, an initial jetsam property
+	 * update occurs before the values below are applied. In this case, the flag
+	 * ensures that the subsequent change is ignored; the explicit update should
+	 * be given priority.
+	 */
+	(void)job_assumes_zero(j, posix_spawnattr_setjetsam(&spattr,
+	        POSIX_SPAWN_JETSAM_USE_EFFECTIVE_PRIORITY | (j->jetsam_memory_limit_background ? POSIX_SPAWN_JETSAM_HIWATER_BACKGROUND : 0), 
+	        j->jetsam_priority, j->jetsam_memlimit));
+#endif
 
-	cdw.tmptm.tm_min = -1;
-	cdw.tmptm.tm_hour = -1;
-	cdw.tmptm.tm_mday = -1;
-	cdw.tmptm.tm_wday = -1;
-	cdw.tmptm.tm_mon = -1;
+	mach_port_array_t sports = NULL;
+	mach_msg_type_number_t sports_cnt = 0;
+	kern_return_t kr = vproc_mig_get_listener_port_rights(bootstrap_port, &sports, &sports_cnt);
+	if (kr == 0 && sports_cnt) {
+		/* For some reason, this SPI takes a count as a signed quantity. */
+		(void)posix_spawnattr_set_importancewatch_port_np(&spattr, (int)sports_cnt, sports);
 
-	if (!job_assumes(j, obj != NULL)) {
-		return false;
+		/* All "count" parameters in MIG are counts of the array. So an array of
+		 * mach_port_t containing 10 elements will have a count of ten, but it
+		 * will occupy 40 bytes. So we must do the multiplication here to pass
+		 * the correct size.
+		 *
+		 * Note that we do NOT release the send rights. We need them to be valid
+		 * at the time they are passed to posix_spawn(2). When we exec(3) using
+		 * posix_spawn(2), they'll be cleaned up anyway.
+		 */
+		mig_deallocate((vm_address_t)sports, sports_cnt * sizeof(sports[0]));
+	} else if (kr != BOOTSTRAP_UNKNOWN_SERVICE) {
+		(void)job_assumes_zero(j, kr);
 	}
 
-	if (unlikely(LAUNCH_DATA_DICTIONARY != launch_data_get_type(obj))) {
-		return false;
+#if TARGET_OS_EMBEDDED
+	if (!j->app || j->system_app) {
+		(void)job_assumes_zero(j, posix_spawnattr_setcpumonitor_default(&spattr));
 	}
+#else
+	(void)job_assumes_zero(j, posix_spawnattr_setcpumonitor_default(&spattr));
+#endif
 
-	launch_data_dict_iterate(obj, calendarinterval_new_from_obj_dict_walk, &cdw);
+#if !TARGET_OS_EMBEDDED
+	struct task_qos_policy qosinfo = {
+		.task_latency_qos_tier = LATENCY_QOS_LAUNCH_DEFAULT_TIER,
+		.task_throughput_qos_tier = THROUGHPUT_QOS_LAUNCH_DEFAULT_TIER,
+	};
 
-	if (unlikely(cdw.tmptm.tm_sec == -1)) {
-		return false;
+	kr = task_policy_set(mach_task_self(), TASK_BASE_QOS_POLICY, (task_policy_t)&qosinfo, TASK_QOS_POLICY_COUNT);
+	(void)job_assumes_zero_p(j, kr);
+#endif
+
+#if HAVE_RESPONSIBILITY
+	/* Specify which process is responsible for the new job.  Per-app XPC
+	 * services are the responsibility of the app.  Other processes are
+	 * responsible for themselves.  This decision is final and also applies
+	 * to the process's children, so don't initialize responsibility when
+	 * starting a per-user launchd.
+	 */
+	if (j->mgr->req_pid) {
+		responsibility_init2(j->mgr->req_pid, NULL);
+	} else if (!j->per_user) {
+		responsibility_init2(getpid(), j->prog ? j->prog : j->argv[0]);
 	}
+#endif
 
-	return calendarinterval_new(j, &cdw.tmptm);
-}
+#if HAVE_QUARANTINE
+	if (j->quarantine_data) {
+		qtn_proc_t qp;
 
-bool
-calendarinterval_new(job_t j, struct tm *w)
-{
-	struct calendarinterval *ci = calloc(1, sizeof(struct calendarinterval));
+		if (job_assumes(j, qp = qtn_proc_alloc())) {
+			if (job_assumes_zero(j, qtn_proc_init_with_data(qp, j->quarantine_data, j->quarantine_data_sz) == 0)) {
+				(void)job_assumes_zero(j, qtn_proc_apply_to_self(qp));
+			}
+		}
+	}
+#endif
 
-	if (!job_assumes(j, ci != NULL)) {
-		return false;
+#if HAVE_SANDBOX
+#if TARGET_OS_EMBEDDED
+	struct sandbox_spawnattrs sbattrs;
+	if (j->seatbelt_profile || j->container_identifier) {
+		sandbox_spawnattrs_init(&sbattrs);
+		if (j->seatbelt_profile) {
+			sandbox_spawnattrs_setprofilename(&sbattrs, j->seatbelt_profile);
+		}
+		if (j->container_identifier) {
+			sandbox_spawnattrs_setcontainer(&sbattrs, j->container_identifier);
+		}
+		(void)job_assumes_zero(j, posix_spawnattr_setmacpolicyinfo_np(&spattr, "Sandbox", &sbattrs, sizeof(sbattrs)));
 	}
+#else
+	if (j->seatbelt_profile) {
+		char *seatbelt_err_buf = NULL;
 
-	ci->when = *w;
-	ci->job = j;
+		if (job_assumes_zero_p(j, sandbox_init(j->seatbelt_profile, j->seatbelt_flags, &seatbelt_err_buf)) == -1) {
+			if (seatbelt_err_buf) {
+				job_log(j, LOG_ERR, "Sandbox failed to init: %s", seatbelt_err_buf);
+			}
+			goto out_bad;
+		}
+	}
+#endif
+#endif
 
-	SLIST_INSERT_HEAD(&j->cal_intervals, ci, sle);
+	psf = j->prog ? posix_spawn : posix_spawnp;
 
-	calendarinterval_setalarm(j, ci);
+	if (likely(!(j->inetcompat || use_xpcproxy))) {
+		file2exec = j->prog ? j->prog : argv[0];
+	}
 
-	runtime_add_weak_ref();
+	errno = psf(NULL, file2exec, NULL, &spattr, (char *const *)argv, environ);
 
-	return true;
+#if HAVE_SANDBOX && !TARGET_OS_EMBEDDED
+out_bad:
+#endif
+	_exit(errno);
 }
 
 void
-calendarinterval_delete(job_t j, struct calendarinterval *ci)
+jobmgr_global_env_collect(jobmgr_t jm, struct global_env_entry *entries, size_t *cnt)
 {
-	SLIST_REMOVE(&j->cal_intervals, ci, calendarinterval, sle);
-	LIST_REMOVE(ci, global_sle);
+	struct envitem *ei;
+	size_t i;
+	job_t ji;
 
-	free(ci);
+	if (jm->parentmgr) {
+		jobmgr_global_env_collect(jm->parentmgr, entries, cnt);
+	}
 
-	runtime_del_weak_ref();
+	LIST_FOREACH(ji, &jm->global_env_jobs, global_env_sle) {
+		SLIST_FOREACH(ei, &ji->global_env, sle) {
+			for (i = 0; i < *cnt; i++) {
+				if (strcmp(entries[i].key, ei->key) == 0) {
+					break;
+				}
+			}
+
+			entries[i].key = ei->key;
+			entries[i].value = ei->value;
+			if (i == *cnt) {
+				(*cnt)++;
+			}
+		}
+	}
 }
 
 void
-calendarinterval_sanity_check(void)
+jobmgr_global_env_materialize(jobmgr_t jm)
 {
-	struct calendarinterval *ci = LIST_FIRST(&sorted_calendar_events);
-	time_t now = time(NULL);
+	struct global_env_entry *entries = NULL;
+	struct envitem *ei;
+	size_t cnt = 0;
+	jobmgr_t jmi;
+	job_t ji;
 
-	if (unlikely(ci && (ci->when_next < now))) {
-		(void)jobmgr_assumes_zero_p(root_jobmgr, raise(SIGUSR1));
+	if (jm->global_env_gen == s_global_env_gen) {
+		return;
 	}
-}
 
-void
-calendarinterval_callback(void)
-{
-	struct calendarinterval *ci, *ci_next;
-	time_t now = time(NULL);
-
-	LIST_FOREACH_SAFE(ci, &sorted_calendar_events, global_sle, ci_next) {
-		job_t j = ci->job;
-
-		if (ci->when_next > now) {
-			break;
+	for (jmi = jm; jmi; jmi = jmi->parentmgr) {
+		LIST_FOREACH(ji, &jmi->global_env_jobs, global_env_sle) {
+			SLIST_FOREACH(ei, &ji->global_env, sle) {
+				cnt++;
+			}
 		}
-
-		LIST_REMOVE(ci, global_sle);
-		calendarinterval_setalarm(j, ci);
-
-		j->start_pending = true;
-		job_dispatch(j, false);
 	}
-}
-
-bool
-socketgroup_new(job_t j, const char *name, int *fds, size_t fd_cnt)
-{
-	struct socketgroup *sg = calloc(1, sizeof(struct socketgroup) + strlen(name) + 1);
 
-	if (!job_assumes(j, sg != NULL)) {
-		return false;
+	if (cnt && !jobmgr_assumes(jm, (entries = calloc(cnt, sizeof(entries[0]))) != NULL)) {
+		return;
 	}
 
-	sg->fds = calloc(1, fd_cnt * sizeof(int));
-	sg->fd_cnt = fd_cnt;
-
-	if (!job_assumes(j, sg->fds != NULL)) {
-		free(sg);
-		return false;
+	cnt = 0;
+	if (entries) {
+		jobmgr_global_env_collect(jm, entries, &cnt);
 	}
 
-	memcpy(sg->fds, fds, fd_cnt * sizeof(int));
-	strcpy(sg->name_init, name);
-
-	SLIST_INSERT_HEAD(&j->sockets, sg, sle);
-
-	runtime_add_weak_ref();
-
-	return true;
+	free(jm->global_env);
+	jm->global_env = entries;
+	jm->global_env_cnt = cnt;
+	jm->global_env_gen = s_global_env_gen;
 }
 
 void
-socketgroup_delete(job_t j, struct socketgroup *sg)
+jobmgr_export_env_from_other_jobs(jobmgr_t jm, launch_data_t dict)
 {
-	unsigned int i;
+	launch_data_t tmp;
+	size_t i;
 
-	for (i = 0; i < sg->fd_cnt; i++) {
-#if 0
-		struct sockaddr_storage ss;
-		struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
-		socklen_t ss_len = sizeof(ss);
+	char **tmpenviron = environ;
+	for (; *tmpenviron; tmpenviron++) {
+		char envkey[1024];
+		launch_data_t s = launch_data_alloc(LAUNCH_DATA_STRING);
+		launch_data_set_string(s, strchr(*tmpenviron, '=') + 1);
+		strncpy(envkey, *tmpenviron, sizeof(envkey));
+		*(strchr(envkey, '=')) = '\0';
+		launch_data_dict_insert(dict, s, envkey);
+	}
 
-		// 5480306
-		if (job_assumes_zero(j, getsockname(sg->fds[i], (struct sockaddr *)&ss, &ss_len) != -1)
-				&& job_assumes(j, ss_len > 0) && (ss.ss_family == AF_UNIX)) {
-			(void)job_assumes(j, unlink(sun->sun_path) != -1);
-			// We might conditionally need to delete a directory here
+	jobmgr_global_env_materialize(jm);
+	for (i = 0; i < jm->global_env_cnt; i++) {
+		if ((tmp = launch_data_new_string(jm->global_env[i].value))) {
+			launch_data_dict_insert(dict, tmp, jm->global_env[i].key);
 		}
-#endif
-		(void)job_assumes_zero_p(j, runtime_close(sg->fds[i]));
 	}
-
-	SLIST_REMOVE(&j->sockets, sg, socketgroup, sle);
-
-	free(sg->fds);
-	free(sg);
-
-	runtime_del_weak_ref();
 }
 
 void
-socketgroup_kevent_mod(job_t j, struct socketgroup *sg, bool do_add)
+jobmgr_setup_env_from_other_jobs(jobmgr_t jm)
 {
-	struct kevent kev[sg->fd_cnt];
-	char buf[10000];
-	unsigned int i, buf_off = 0;
-
-	for (i = 0; i < sg->fd_cnt; i++) {
-		EV_SET(&kev[i], sg->fds[i], EVFILT_READ, do_add ? EV_ADD : EV_DELETE, 0, 0, j);
-		buf_off += snprintf(buf + buf_off, sizeof(buf) - buf_off, " %d", sg->fds[i]);
-	}
-
-	job_log(j, LOG_DEBUG, "%s Sockets:%s", do_add ? "Watching" : "Ignoring", buf);
-
-	(void)job_assumes_zero_p(j, kevent_bulk_mod(kev, sg->fd_cnt));
+	size_t i;
 
-	for (i = 0; i < sg->fd_cnt; i++) {
-		(void)job_assumes(j, kev[i].flags & EV_ERROR);
-		errno = (typeof(errno)) kev[i].data;
-		(void)job_assumes_zero(j, kev[i].data);
+	/* This runs in the child. job_start() materializes the environment before
+	 * forking, so this is normally just a walk over the array.
+	 */
+	jobmgr_global_env_materialize(jm);
+	for (i = 0; i < jm->global_env_cnt; i++) {
+		setenv(jm->global_env[i].key, jm->global_env[i].value, 1);
 	}
 }
 
 void
-socketgroup_ignore(job_t j, struct socketgroup *sg)
-{
-	socketgroup_kevent_mod(j, sg, false);
-}
-
-void
-socketgroup_watch(job_t j, struct socketgroup *sg)
-{
-	socketgroup_kevent_mod(j, sg, true);
-}
-
-void
-socketgroup_callback(job_t j)
+job_log_pids_with_weird_uids(job_t j)
 {
-	job_dispatch(j, true);
-}
+	size_t len = sizeof(pid_t) * get_kern_max_proc();
+	pid_t *pids = NULL;
+	uid_t u = j->mach_uid;
+	int i = 0, kp_cnt = 0;
 
-bool
-envitem_new(job_t j, const char *k, const char *v, bool global)
-{
-	if (global && !launchd_allow_global_dyld_envvars) {
-		if (strncmp("DYLD_", k, sizeof("DYLD_") - 1) == 0) {
-			job_log(j, LOG_ERR, "Ignoring global environment variable submitted by job (variable=value): %s=%s", k, v);
-			return false;
-		}
+	if (!launchd_apple_internal) {
+		return;
 	}
 
-	struct envitem *ei = calloc(1, sizeof(struct envitem) + strlen(k) + 1 + strlen(v) + 1);
-
-	if (!job_assumes(j, ei != NULL)) {
-		return false;
+	pids = malloc(len);
+	if (!job_assumes(j, pids != NULL)) {
+		return;
 	}
 
-	strcpy(ei->key_init, k);
-	ei->value = ei->key_init + strlen(k) + 1;
-	strcpy(ei->value, v);
+	runtime_ktrace(RTKT_LAUNCHD_FINDING_WEIRD_UIDS, j->p, u, 0);
 
-	if (global) {
-		if (SLIST_EMPTY(&j->global_env)) {
-			LIST_INSERT_HEAD(&j->mgr->global_env_jobs, j, global_env_sle);
-		}
-		SLIST_INSERT_HEAD(&j->global_env, ei, sle);
-	} else {
-		SLIST_INSERT_HEAD(&j->env, ei, sle);
+	/* libproc actually has some serious performance drawbacks when used over sysctl(3) in
+	 * scenarios like this. Whereas sysctl(3) can give us back all the kinfo_proc's in
+	 * one kernel call, libproc requires that we get a list of PIDs we're interested in
+	 * (in this case, all PIDs on the system) and then get a single proc_bsdshortinfo
+	 * struct back in a single call for each one.
+	 *
+	 * This kind of thing is also more inherently racy than sysctl(3). While sysctl(3)
+	 * returns a snapshot, it returns the whole shebang at once. Any PIDs given to us by
+	 * libproc could go stale before we call proc_pidinfo().
+	 *
+	 * Note that proc_list*() APIs return the number of PIDs given back, not the number
+	 * of bytes written to the buffer.
+	 */
+	if (job_assumes_zero_p(j, (kp_cnt = proc_listallpids(pids, len))) == -1) {
+		goto out;
 	}
 
-	job_log(j, LOG_DEBUG, "Added environmental variable: %s=%s", k, v);
+	for (i = 0; i < kp_cnt; i++) {
+		struct proc_bsdshortinfo proc;
+		/* We perhaps should not log a bug here if we get ESRCH back, due to the race
+		 * detailed above.
+		 */
+		if (proc_pidinfo(pids[i], PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
+			if (errno != ESRCH) {
+				(void)job_assumes_zero(j, errno);
+			}
+			continue;
+		}
 
-	return true;
-}
+		uid_t i_euid = proc.pbsi_uid;
+		uid_t i_uid = proc.pbsi_ruid;
+		uid_t i_svuid = proc.pbsi_svuid;
+		pid_t i_pid = pids[i];
 
-void
-envitem_delete(job_t j, struct envitem *ei, bool global)
-{
-	if (global) {
-		SLIST_REMOVE(&j->global_env, ei, envitem, sle);
-		if (SLIST_EMPTY(&j->global_env)) {
-			LIST_REMOVE(j, global_env_sle);
+		if (i_euid != u && i_uid != u && i_svuid != u) {
+			continue;
 		}
-	} else {
-		SLIST_REMOVE(&j->env, ei, envitem, sle);
+
+		job_log(j, LOG_ERR, "PID %u \"%s\" has no account to back it! Real/effective/saved UIDs: %u/%u/%u", i_pid, proc.pbsi_comm, i_uid, i_euid, i_svuid);
+
+// Temporarily disabled due to 5423935 and 4946119.
+#if 0
+		// Ask the accountless process to exit.
+		(void)job_assumes_zero_p(j, kill2(i_pid, SIGTERM));
+#endif
 	}
 
-	free(ei);
+out:
+	free(pids);
 }
 
-void
-envitem_setup(launch_data_t obj, const char *key, void *context)
+static struct passwd *
+job_getpwnam(job_t j, const char *name)
 {
-	job_t j = context;
+	/*
+	 * methodology for system daemons
+	 *
+	 * first lookup user record without any opendirectoryd interaction,
+	 * we don't know what interprocess dependencies might be in flight.
+	 * if that fails, we re-enable opendirectoryd interaction and 
+	 * re-issue the lookup.  We have to disable the libinfo L1 cache
+	 * otherwise libinfo will return the negative cache entry on the retry
+	 */
+#if !TARGET_OS_EMBEDDED
+	struct passwd *pw = NULL;
 
-	if (launch_data_get_type(obj) != LAUNCH_DATA_STRING) {
-		return;
+	if (pid1_magic && j->mgr == root_jobmgr) {
+		// 1 == SEARCH_MODULE_FLAG_DISABLED
+		si_search_module_set_flags("ds", 1);
+		gL1CacheEnabled = false;
+
+		pw = getpwnam(name);
+		si_search_module_set_flags("ds", 0);
 	}
 
-	if (strncmp(LAUNCHD_TRUSTED_FD_ENV, key, sizeof(LAUNCHD_TRUSTED_FD_ENV) - 1) != 0) {
-		envitem_new(j, key, launch_data_get_string(obj), j->importing_global_env);
-	} else {
-		job_log(j, LOG_DEBUG, "Ignoring reserved environmental variable: %s", key);
+	if (pw == NULL) {
+		pw = getpwnam(name);
 	}
+
+	return pw;
+#else
+#pragma unused (j)
+	return getpwnam(name);
+#endif
 }
 
-bool
-limititem_update(job_t j, int w, rlim_t r)
+static struct group *
+job_getgrnam(job_t j, const char *name)
 {
-	struct limititem *li;
-
-	SLIST_FOREACH(li, &j->limits, sle) {
-		if (li->which == w) {
-			break;
-		}
-	}
+#if !TARGET_OS_EMBEDDED
+    struct group *gr = NULL;
 
-	if (li == NULL) {
-		li = calloc(1, sizeof(struct limititem));
+    if (pid1_magic && j->mgr == root_jobmgr) {
+        si_search_module_set_flags("ds", 1);
+        gL1CacheEnabled = false;
 
-		if (!job_assumes(j, li != NULL)) {
-			return false;
-		}
+        gr = getgrnam(name);
 
-		SLIST_INSERT_HEAD(&j->limits, li, sle);
+        si_search_module_set_flags("ds", 0);
+    }
 
-		li->which = w;
-	}
+    if (gr == NULL) {
+        gr = getgrnam(name);
+    }
 
-	if (j->importing_hard_limits) {
-		li->lim.rlim_max = r;
-		li->sethard = true;
-	} else {
-		li->lim.rlim_cur = r;
-		li->setsoft = true;
-	}
-
-	return true;
+    return gr;
+#else
+#pragma unused (j)
+    return getgrnam(name);
+#endif
 }
 
 void
-limititem_delete(job_t j, struct limititem *li)
+job_postfork_test_user(job_t j)
 {
-	SLIST_REMOVE(&j->limits, li, limititem, sle);
+	// This function is all about 5201578
 
-	free(li);
-}
+	const char *home_env_var = getenv("HOME");
+	const char *user_env_var = getenv("USER");
+	const char *logname_env_var = getenv("LOGNAME");
+	uid_t tmp_uid, local_uid = getuid();
+	gid_t tmp_gid, local_gid = getgid();
+	char shellpath[PATH_MAX];
+	char homedir[PATH_MAX];
+	char loginname[2000];
+	struct passwd *pwe;
 
-#if HAVE_SANDBOX
-void
-seatbelt_setup_flags(launch_data_t obj, const char *key, void *context)
-{
-	job_t j = context;
 
-	if (launch_data_get_type(obj) != LAUNCH_DATA_BOOL) {
-		job_log(j, LOG_WARNING, "Sandbox flag value must be boolean: %s", key);
-		return;
+	if (!job_assumes(j, home_env_var && user_env_var && logname_env_var
+				&& strcmp(user_env_var, logname_env_var) == 0)) {
+		goto out_bad;
 	}
 
-	if (launch_data_get_bool(obj) == false) {
-		return;
+	if ((pwe = job_getpwnam(j, user_env_var)) == NULL) {
+		job_log(j, LOG_ERR, "The account \"%s\" has been deleted out from under us!", user_env_var);
+		goto out_bad;
 	}
 
-	if (strcasecmp(key, LAUNCH_JOBKEY_SANDBOX_NAMED) == 0) {
-		j->seatbelt_flags |= SANDBOX_NAMED;
+	/*
+	 * We must copy the results of getpw*().
+	 *
+	 * Why? Because subsequent API calls may call getpw*() as a part of
+	 * their implementation. Since getpw*() returns a [now thread scoped]
+	 * global, we must therefore cache the results before continuing.
+	 */
+
+	tmp_uid = pwe->pw_uid;
+	tmp_gid = pwe->pw_gid;
+
+	strlcpy(shellpath, pwe->pw_shell, sizeof(shellpath));
+	strlcpy(loginname, pwe->pw_name, sizeof(loginname));
+	strlcpy(homedir, pwe->pw_dir, sizeof(homedir));
+
+	if (strcmp(loginname, logname_env_var) != 0) {
+		job_log(j, LOG_ERR, "The %s environmental variable changed out from under us!", "USER");
+		goto out_bad;
 	}
-}
+	if (strcmp(homedir, home_env_var) != 0) {
+		job_log(j, LOG_ERR, "The %s environmental variable changed out from under us!", "HOME");
+		goto out_bad;
+	}
+	if (local_uid != tmp_uid) {
+		job_log(j, LOG_ERR, "The %cID of the account (%u) changed out from under us (%u)!",
+				'U', tmp_uid, local_uid);
+		goto out_bad;
+	}
+	if (local_gid != tmp_gid) {
+		job_log(j, LOG_ERR, "The %cID of the account (%u) changed out from under us (%u)!",
+				'G', tmp_gid, local_gid);
+		goto out_bad;
+	}
+
+	return;
+out_bad:
+#if 0
+	(void)job_assumes_zero_p(j, kill2(getppid(), SIGTERM));
+	_exit(EXIT_FAILURE);
+#else
+	job_log(j, LOG_WARNING, "In a future build of the OS, this error will be fatal.");
 #endif
+}
 
 void
-limititem_setup(launch_data_t obj, const char *key, void *context)
+job_postfork_become_user(job_t j)
 {
-	job_t j = context;
-	size_t i, limits_cnt = (sizeof(launchd_keys2limits) / sizeof(launchd_keys2limits[0]));
-	rlim_t rl;
-
-	if (launch_data_get_type(obj) != LAUNCH_DATA_INTEGER) {
-		return;
-	}
-
-	rl = launch_data_get_integer(obj);
+	char loginname[2000];
+	char tmpdirpath[PATH_MAX];
+	char shellpath[PATH_MAX];
+	char homedir[PATH_MAX];
+	struct passwd *pwe;
+	size_t r;
+	gid_t desired_gid = -1;
+	uid_t desired_uid = -1;
 
-	for (i = 0; i < limits_cnt; i++) {
-		if (strcasecmp(launchd_keys2limits[i].key, key) == 0) {
-			break;
-		}
+	if (getuid() != 0) {
+		return job_postfork_test_user(j);
 	}
 
-	if (i == limits_cnt) {
-		return;
+	/*
+	 * I contend that having UID == 0 and GID != 0 is of dubious value.
+	 * Nevertheless, this used to work in Tiger. See: 5425348
+	 */
+	if (j->groupname && !j->username) {
+		j->username = "root";
 	}
 
-	limititem_update(j, launchd_keys2limits[i].val, rl);
-}
-
-bool
-job_useless(job_t j)
-{
-	if ((j->legacy_LS_job || j->only_once) && j->start_time != 0) {
-		if (j->legacy_LS_job && j->j_port) {
-			return false;
-		}
-		job_log(j, LOG_INFO, "Exited. Was only configured to run once.");
-		return true;
-	} else if (j->removal_pending) {
-		job_log(j, LOG_DEBUG, "Exited while removal was pending.");
-		return true;
-	} else if (j->shutdown_monitor) {
-		return false;
-	} else if (j->mgr->shutting_down && !j->mgr->parentmgr) {
-		job_log(j, LOG_DEBUG, "Exited while shutdown in progress. Processes remaining: %lu/%lu", total_children, total_anon_children);
-		if (total_children == 0 && !j->anonymous) {
-			job_log(j, LOG_DEBUG | LOG_CONSOLE, "Job was last to exit during shutdown of: %s.", j->mgr->name);
+	if (j->username) {
+		if ((pwe = job_getpwnam(j, j->username)) == NULL) {
+			job_log(j, LOG_ERR, "getpwnam(\"%s\") failed", j->username);
+			_exit(ESRCH);
 		}
-		return true;
-	} else if (j->legacy_mach_job) {
-		if (SLIST_EMPTY(&j->machservices)) {
-			job_log(j, LOG_INFO, "Garbage collecting");
-			return true;
-		} else if (!j->checkedin) {
-			job_log(j, LOG_WARNING, "Failed to check-in!");
-			return true;
+	} else if (j->mach_uid) {
+		if ((pwe = getpwuid(j->mach_uid)) == NULL) {
+			job_log(j, LOG_ERR, "getpwuid(\"%u\") failed", j->mach_uid);
+			job_log_pids_with_weird_uids(j);
+			_exit(ESRCH);
 		}
 	} else {
-		/* If the job's executable does not have any valid architectures (for
-		 * example, if it's a PowerPC-only job), then we don't even bother
-		 * trying to relaunch it, as we have no reasonable expectation that
-		 * the situation will change.
-		 *
-		 * <rdar://problem/9106979>
-		 */
-		if (!j->did_exec && WEXITSTATUS(j->last_exit_status) == EBADARCH) {
-			job_log(j, LOG_ERR, "Job executable does not contain supported architectures. Unloading it. Its plist should be removed.");
-			return true;
-		}
-	}
-
-	return false;
-}
-
-bool
-job_keepalive(job_t j)
-{
-	mach_msg_type_number_t statusCnt;
-	mach_port_status_t status;
-	struct semaphoreitem *si;
-	struct machservice *ms;
-	bool good_exit = (WIFEXITED(j->last_exit_status) && WEXITSTATUS(j->last_exit_status) == 0);
-	bool is_not_kextd = (launchd_apple_internal || (strcmp(j->label, "com.apple.kextd") != 0));
-
-	if (unlikely(j->mgr->shutting_down)) {
-		return false;
+		return;
 	}
 
 	/*
-	 * 5066316
+	 * We must copy the results of getpw*().
 	 *
-	 * We definitely need to revisit this after Leopard ships. Please see
-	 * launchctl.c for the other half of this hack.
+	 * Why? Because subsequent API calls may call getpw*() as a part of
+	 * their implementation. Since getpw*() returns a [now thread scoped]
+	 * global, we must therefore cache the results before continuing.
 	 */
-	if (unlikely((j->mgr->global_on_demand_cnt > 0) && is_not_kextd)) {
-		return false;
-	}
 
-	if (unlikely(j->needs_kickoff)) {
-		job_log(j, LOG_DEBUG, "KeepAlive check: Job needs to be kicked off on-demand before KeepAlive sets in.");
-		return false;
-	}
+	desired_uid = pwe->pw_uid;
+	desired_gid = pwe->pw_gid;
 
-	if (j->start_pending) {
-		job_log(j, LOG_DEBUG, "KeepAlive check: Pent-up non-IPC launch criteria.");
-		return true;
+	strlcpy(shellpath, pwe->pw_shell, sizeof(shellpath));
+	strlcpy(loginname, pwe->pw_name, sizeof(loginname));
+	strlcpy(homedir, pwe->pw_dir, sizeof(homedir));
+
+	if (unlikely(pwe->pw_expire && time(NULL) >= pwe->pw_expire)) {
+		job_log(j, LOG_ERR, "Expired account");
+		_exit(EXIT_FAILURE);
 	}
 
-	if (!j->ondemand) {
-		job_log(j, LOG_DEBUG, "KeepAlive check: job configured to run continuously.");
-		return true;
+
+	if (unlikely(j->username && strcmp(j->username, loginname) != 0)) {
+		job_log(j, LOG_WARNING, "Suspicious setup: User \"%s\" maps to user: %s", j->username, loginname);
+	} else if (unlikely(j->mach_uid && (j->mach_uid != desired_uid))) {
+		job_log(j, LOG_WARNING, "Suspicious setup: UID %u maps to UID %u", j->mach_uid, desired_uid);
 	}
 
-	SLIST_FOREACH(ms, &j->machservices, sle) {
-		statusCnt = MACH_PORT_RECEIVE_STATUS_COUNT;
-		if (mach_port_get_attributes(mach_task_self(), ms->port, MACH_PORT_RECEIVE_STATUS,
-					(mach_port_info_t)&status, &statusCnt) != KERN_SUCCESS) {
-			continue;
-		}
-		if (status.mps_msgcount) {
-			job_log(j, LOG_DEBUG, "KeepAlive check: %d queued Mach messages on service: %s",
-					status.mps_msgcount, ms->name);
-			return true;
+	if (j->groupname) {
+		struct group *gre;
+
+		if (unlikely((gre = job_getgrnam(j, j->groupname)) == NULL)) {
+			job_log(j, LOG_ERR, "getgrnam(\"%s\") failed", j->groupname);
+			_exit(ESRCH);
 		}
+
+		desired_gid = gre->gr_gid;
 	}
 
-	/* TODO: Coalesce external events and semaphore items, since they're basically
-	 * the same thing.
-	 */
-	struct externalevent *ei = NULL;
-	LIST_FOREACH(ei, &j->events, job_le) {
-		if (ei->state == ei->wanted_state) {
-			return true;
-		}
+	if (job_assumes_zero_p(j, setlogin(loginname)) == -1) {
+		_exit(EXIT_FAILURE);
 	}
 
-	SLIST_FOREACH(si, &j->semaphores, sle) {
-		bool wanted_state = false;
-		job_t other_j;
+	if (job_assumes_zero_p(j, setgid(desired_gid)) == -1) {
+		_exit(EXIT_FAILURE);
+	}
 
-		switch (si->why) {
-		case NETWORK_UP:
-			wanted_state = true;
-		case NETWORK_DOWN:
-			if (network_up == wanted_state) {
-				job_log(j, LOG_DEBUG, "KeepAlive: The network is %s.", wanted_state ? "up" : "down");
-				return true;
-			}
-			break;
-		case SUCCESSFUL_EXIT:
-			wanted_state = true;
-		case FAILED_EXIT:
-			if (good_exit == wanted_state) {
-				job_log(j, LOG_DEBUG, "KeepAlive: The exit state was %s.", wanted_state ? "successful" : "failure");
-				return true;
-			}
-			break;
-		case CRASHED:
-			wanted_state = true;
-		case DID_NOT_CRASH:
-			if (j->crashed == wanted_state) {
-				return true;
-			}
-			break;
-		case OTHER_JOB_ENABLED:
-			wanted_state = true;
-		case OTHER_JOB_DISABLED:
-			if ((bool)job_find(NULL, si->what) == wanted_state) {
-				job_log(j, LOG_DEBUG, "KeepAlive: The following job is %s: %s", wanted_state ? "enabled" : "disabled", si->what);
-				return true;
-			}
-			break;
-		case OTHER_JOB_ACTIVE:
-			wanted_state = true;
-		case OTHER_JOB_INACTIVE:
-			if ((other_j = job_find(NULL, si->what))) {
-				if ((bool)other_j->p == wanted_state) {
-					job_log(j, LOG_DEBUG, "KeepAlive: The following job is %s: %s", wanted_state ? "active" : "inactive", si->what);
-					return true;
-				}
-			}
-			break;
+	/*
+	 * The kernel team and the DirectoryServices team want initgroups()
+	 * called after setgid(). See 4616864 for more information.
+	 */
+
+	if (likely(!j->no_init_groups)) {
+#if 1
+		if (job_assumes_zero_p(j, initgroups(loginname, desired_gid)) == -1) {
+			_exit(EXIT_FAILURE);
 		}
-	}
+#else
+		/* Do our own little initgroups(). We do this to guarantee that we're
+		 * always opted into dynamic group resolution in the kernel. initgroups(3)
+		 * does not make this guarantee.
+		 */
+		int groups[NGROUPS], ngroups;
 
-	return false;
-}
+		// A failure here isn't fatal, and we'll still get data we can use.
+		(void)job_assumes_zero_p(j, getgrouplist(j->username, desired_gid, groups, &ngroups));
 
-const char *
-job_active(job_t j)
-{
-	if (j->p && j->shutdown_monitor) {
-		return "Monitoring shutdown";
-	}
-	if (j->p) {
-		return "PID is still valid";
+		if (job_assumes_zero_p(j, syscall(SYS_initgroups, ngroups, groups, desired_uid)) == -1) {
+			_exit(EXIT_FAILURE);
+		}
+#endif
 	}
 
-	if (j->priv_port_has_senders) {
-		return "Privileged Port still has outstanding senders";
+	if (job_assumes_zero_p(j, setuid(desired_uid)) == -1) {
+		_exit(EXIT_FAILURE);
 	}
 
-	struct machservice *ms;
-	SLIST_FOREACH(ms, &j->machservices, sle) {
-		/* If we've simulated an exit, we mark the job as non-active, even
-		 * though doing so will leave it in an unsafe state. We do this so that
-		 * shutdown can proceed. See <rdar://problem/11126530>.
-		 */
-		if (!j->workaround9359725 && ms->recv && machservice_active(ms)) {
-			job_log(j, LOG_INFO, "Mach service is still active: %s", ms->name);
-			return "Mach service is still active";
-		}
+	r = confstr(_CS_DARWIN_USER_TEMP_DIR, tmpdirpath, sizeof(tmpdirpath));
+
+	if (likely(r > 0 && r < sizeof(tmpdirpath))) {
+		setenv("TMPDIR", tmpdirpath, 0);
 	}
 
-	return NULL;
+	setenv("SHELL", shellpath, 0);
+	setenv("HOME", homedir, 0);
+	setenv("USER", loginname, 0);
+	setenv("LOGNAME", loginname, 0);
 }
 
 void
-machservice_watch(job_t j, struct machservice *ms)
+job_setup_attributes(job_t j)
 {
-	if (ms->recv) {
-		if (job_assumes_zero(j, runtime_add_mport(ms->port, NULL)) == KERN_INVALID_RIGHT) {
-			ms->recv_race_hack = true;
-		}
-	}
-}
+	struct limititem *li;
+	struct envitem *ei;
 
-void
-machservice_ignore(job_t j, struct machservice *ms)
-{
-	/* We only add ports whose receive rights we control into the port set, so
-	 * don't attempt to remove te service from the port set if we didn't put it
-	 * there in the first place. Otherwise, we could wind up trying to access a
-	 * bogus index (like MACH_PORT_DEAD) or zeroing a valid one out.
-	 *
-	 * <rdar://problem/10898014>
-	 */
-	if (ms->recv) {
-		(void)job_assumes_zero(j, runtime_remove_mport(ms->port));
+	if (unlikely(j->setnice)) {
+		(void)job_assumes_zero_p(j, setpriority(PRIO_PROCESS, 0, j->nice));
 	}
-}
 
-void
-machservice_resetport(job_t j, struct machservice *ms)
-{
-	LIST_REMOVE(ms, port_hash_sle);
-	(void)job_assumes_zero(j, launchd_mport_close_recv(ms->port));
-	(void)job_assumes_zero(j, launchd_mport_deallocate(ms->port));
+	SLIST_FOREACH(li, &j->limits, sle) {
+		struct rlimit rl;
 
-	ms->gen_num++;
-	(void)job_assumes_zero(j, launchd_mport_create_recv(&ms->port));
-	(void)job_assumes_zero(j, launchd_mport_make_send(ms->port));
-	LIST_INSERT_HEAD(&port_hash[HASH_PORT(ms->port)], ms, port_hash_sle);
-}
+		if (job_assumes_zero_p(j, getrlimit(li->which, &rl) == -1)) {
+			continue;
+		}
 
-void
-machservice_stamp_port(job_t j, struct machservice *ms)
-{
-	mach_port_context_t ctx = 0;
-	char *where2get = j->prog ? j->prog : j->argv[0];
+		if (li->sethard) {
+			rl.rlim_max = li->lim.rlim_max;
+		}
+		if (li->setsoft) {
+			rl.rlim_cur = li->lim.rlim_cur;
+		}
 
-	char *prog = NULL;
-	if ((prog = strrchr(where2get, '/'))) {
-		prog++;
-	} else {
-		prog = where2get;
+		if (setrlimit(li->which, &rl) == -1) {
+			job_log_error(j, LOG_WARNING, "setrlimit()");
+		}
 	}
 
-	(void)strncpy((char *)&ctx, prog, sizeof(ctx));
-#if __LITTLE_ENDIAN__
-#if __LP64__
-	ctx = OSSwapBigToHostInt64(ctx);
-#else
-	ctx = OSSwapBigToHostInt32(ctx);
-#endif
-#endif
-
-	(void)job_assumes_zero(j, mach_port_set_context(mach_task_self(), ms->port, ctx));
-}
-
-struct machservice *
-machservice_new(job_t j, const char *name, mach_port_t *serviceport, bool pid_local)
-{
-	/* Don't create new MachServices for dead ports. This is primarily for
-	 * clients who use bootstrap_register2(). They can pass in a send right, but
-	 * then that port can immediately go dead. Hilarity ensues.
-	 *
-	 * <rdar://problem/10898014>
-	 */
-	if (*serviceport == MACH_PORT_DEAD) {
-		return NULL;
+	if (unlikely(!j->inetcompat && j->session_create)) {
+		launchd_SessionCreate();
 	}
 
-	struct machservice *ms = calloc(1, sizeof(struct machservice) + strlen(name) + 1);
-	if (!job_assumes(j, ms != NULL)) {
-		return NULL;
+	if (unlikely(j->low_pri_io)) {
+		(void)job_assumes_zero_p(j, setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE));
+	}
+	if (j->low_priority_background_io) {
+		(void)job_assumes_zero_p(j, setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_DARWIN_BG, IOPOL_THROTTLE));
+	}
+	if (unlikely(j->rootdir)) {
+		(void)job_assumes_zero_p(j, chroot(j->rootdir));
+		(void)job_assumes_zero_p(j, chdir("."));
 	}
 
-	strcpy((char *)ms->name, name);
-	ms->job = j;
-	ms->gen_num = 1;
-	ms->per_pid = pid_local;
+	job_postfork_become_user(j);
 
-	if (likely(*serviceport == MACH_PORT_NULL)) {
-		if (job_assumes_zero(j, launchd_mport_create_recv(&ms->port)) != KERN_SUCCESS) {
-			goto out_bad;
+	if (unlikely(j->workingdir)) {
+		if (chdir(j->workingdir) == -1) {
+			if (errno == ENOENT || errno == ENOTDIR) {
+				job_log(j, LOG_ERR, "Job specified non-existent working directory: %s", j->workingdir);
+			} else {
+				(void)job_assumes_zero(j, errno);
+			}
 		}
+	}
 
-		if (job_assumes_zero(j, launchd_mport_make_send(ms->port)) != KERN_SUCCESS) {
-			goto out_bad2;
-		}
-		*serviceport = ms->port;
-		ms->recv = true;
+	if (unlikely(j->setmask)) {
+		umask(j->mask);
+	}
+
+	if (j->stdin_fd) {
+		(void)job_assumes_zero_p(j, dup2(j->stdin_fd, STDIN_FILENO));
 	} else {
-		ms->port = *serviceport;
-		ms->isActive = true;
+		job_setup_fd(j, STDIN_FILENO, j->stdinpath, O_RDONLY|O_CREAT);
+	}
+	if (!job_capture_setup_fd(j, STDOUT_FILENO, j->capture[0])) {
+		job_setup_fd(j, STDOUT_FILENO, j->stdoutpath, O_WRONLY|O_CREAT|O_APPEND);
+	}
+	if (!job_capture_setup_fd(j, STDERR_FILENO, j->capture[1])) {
+		job_setup_fd(j, STDERR_FILENO, j->stderrpath, O_WRONLY|O_CREAT|O_APPEND);
 	}
 
-	SLIST_INSERT_HEAD(&j->machservices, ms, sle);
+	jobmgr_setup_env_from_other_jobs(j->mgr);
 
-	jobmgr_t where2put = j->mgr;
-	// XPC domains are separate from Mach bootstraps.
-	if (!(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
-		if (launchd_flat_mach_namespace && !(j->mgr->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET)) {
-			where2put = root_jobmgr;
-		}
+	SLIST_FOREACH(ei, &j->env, sle) {
+		setenv(ei->key, ei->value, 1);
 	}
 
-	/* Don't allow MachServices added by multiple-instance jobs to be looked up
-	 * by others. We could just do this with a simple bit, but then we'd have to
-	 * uniquify the names ourselves to avoid collisions. This is just easier.
-	 */
-	if (!j->dedicated_instance) {
-		LIST_INSERT_HEAD(&where2put->ms_hash[hash_ms(ms->name)], ms, name_hash_sle);	
+#if !TARGET_OS_EMBEDDED	
+	if (j->jetsam_properties) {
+		(void)job_assumes_zero(j, proc_setpcontrol(PROC_SETPC_TERMINATE));
 	}
-	LIST_INSERT_HEAD(&port_hash[HASH_PORT(ms->port)], ms, port_hash_sle);
+#endif
 
-	if (ms->recv) {
-		machservice_stamp_port(j, ms);
+#if TARGET_OS_EMBEDDED
+	if (j->main_thread_priority != 0) {
+		struct sched_param params;
+		bzero(&params, sizeof(params));
+		params.sched_priority = j->main_thread_priority;
+		(void)job_assumes_zero_p(j, pthread_setschedparam(pthread_self(), SCHED_OTHER, &params));
 	}
+#endif
 
-	job_log(j, LOG_DEBUG, "Mach service added%s: %s", (j->mgr->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET) ? " to private namespace" : "", name);
-
-	return ms;
-out_bad2:
-	(void)job_assumes_zero(j, launchd_mport_close_recv(ms->port));
-out_bad:
-	free(ms);
-	return NULL;
-}
-
-struct machservice *
-machservice_new_alias(job_t j, struct machservice *orig)
-{
-	struct machservice *ms = calloc(1, sizeof(struct machservice) + strlen(orig->name) + 1);
-	if (job_assumes(j, ms != NULL)) {
-		strcpy((char *)ms->name, orig->name);
-		ms->alias = orig;
-		ms->job = j;
-
-		LIST_INSERT_HEAD(&j->mgr->ms_hash[hash_ms(ms->name)], ms, name_hash_sle);
-		SLIST_INSERT_HEAD(&j->machservices, ms, sle);
-		jobmgr_log(j->mgr, LOG_DEBUG, "Service aliased into job manager: %s", orig->name);
-	}
-
-	return ms;
-}
-
-bootstrap_status_t
-machservice_status(struct machservice *ms)
-{
-	ms = ms->alias ? ms->alias : ms;
-	if (ms->isActive) {
-		return BOOTSTRAP_STATUS_ACTIVE;
-	} else if (ms->job->ondemand) {
-		return BOOTSTRAP_STATUS_ON_DEMAND;
+	/*
+	 * We'd like to call setsid() unconditionally, but we have reason to
+	 * believe that prevents launchd from being able to send signals to
+	 * setuid children. We'll settle for process-groups.
+	 */
+	if (getppid() != 1) {
+		(void)job_assumes_zero_p(j, setpgid(0, 0));
 	} else {
-		return BOOTSTRAP_STATUS_INACTIVE;
+		(void)job_assumes_zero_p(j, setsid());
 	}
 }
 
 void
-job_setup_exception_port(job_t j, task_t target_task)
+job_setup_fd(job_t j, int target_fd, const char *path, int flags)
 {
-	struct machservice *ms;
-	thread_state_flavor_t f = 0;
-	mach_port_t exc_port = the_exception_server;
+	int fd;
 
-	if (unlikely(j->alt_exc_handler)) {
-		ms = jobmgr_lookup_service(j->mgr, j->alt_exc_handler, true, 0);
-		if (likely(ms)) {
-			exc_port = machservice_port(ms);
-		} else {
-			job_log(j, LOG_WARNING, "Falling back to default Mach exception handler. Could not find: %s", j->alt_exc_handler);
-		}
-	} else if (unlikely(j->internal_exc_handler)) {
-		exc_port = runtime_get_kernel_port();
-	} else if (unlikely(!exc_port)) {
+	if (!path) {
 		return;
 	}
 
-#if defined (__ppc__) || defined(__ppc64__)
-	f = PPC_THREAD_STATE64;
-#elif defined(__i386__) || defined(__x86_64__)
-	f = x86_THREAD_STATE;
-#elif defined(__arm__)
-	f = ARM_THREAD_STATE;
-#else
-#error "unknown architecture"
-#endif
-
-	if (likely(target_task)) {
-		kern_return_t kr = task_set_exception_ports(target_task, EXC_MASK_CRASH | EXC_MASK_GUARD | EXC_MASK_RESOURCE, exc_port, EXCEPTION_STATE_IDENTITY | MACH_EXCEPTION_CODES, f);
-		if (kr) {
-			if (kr != MACH_SEND_INVALID_DEST) {
-				(void)job_assumes_zero(j, kr);
-			} else {
-				job_log(j, LOG_WARNING, "Task died before exception port could be set.");
-			}
-		}
-	} else if (pid1_magic && the_exception_server) {
-		mach_port_t mhp = mach_host_self();
-		(void)job_assumes_zero(j, host_set_exception_ports(mhp, EXC_MASK_CRASH | EXC_MASK_GUARD | EXC_MASK_RESOURCE, the_exception_server, EXCEPTION_STATE_IDENTITY | MACH_EXCEPTION_CODES, f));
-		(void)job_assumes_zero(j, launchd_mport_deallocate(mhp));
+	if ((fd = open(path, flags|O_NOCTTY, DEFFILEMODE)) == -1) {
+		job_log_error(j, LOG_WARNING, "open(\"%s\", ...)", path);
+		return;
 	}
+
+	(void)job_assumes_zero_p(j, dup2(fd, target_fd));
+	(void)job_assumes_zero(j, runtime_close(fd));
 }
 
-void
-job_set_exception_port(job_t j, mach_port_t port)
+static const char *
+job_capture_path(job_t j, struct job_capture *jc)
 {
-	if (unlikely(!the_exception_server)) {
-		the_exception_server = port;
-		job_setup_exception_port(j, 0);
-	} else {
-		job_log(j, LOG_WARNING, "The exception server is already claimed!");
-	}
+	return (jc == j->capture[0]) ? j->stdoutpath : j->stderrpath;
 }
 
 void
-machservice_setup_options(launch_data_t obj, const char *key, void *context)
+job_capture_prepare(job_t j)
 {
-	struct machservice *ms = context;
-	mach_port_t mhp = mach_host_self();
-	int which_port;
-	bool b;
+	size_t i;
 
-	if (!job_assumes(ms->job, mhp != MACH_PORT_NULL)) {
+	if (!j->capture_output) {
 		return;
 	}
 
-	switch (launch_data_get_type(obj)) {
-	case LAUNCH_DATA_INTEGER:
-		which_port = (int)launch_data_get_integer(obj); // XXX we should bound check this...
-		if (strcasecmp(key, LAUNCH_JOBKEY_MACH_TASKSPECIALPORT) == 0) {
-			switch (which_port) {
-			case TASK_KERNEL_PORT:
-			case TASK_HOST_PORT:
-			case TASK_NAME_PORT:
-			case TASK_BOOTSTRAP_PORT:
-			/* I find it a little odd that zero isn't reserved in the header.
-			 * Normally Mach is fairly good about this convention...
-			 */
-			case 0:
-				job_log(ms->job, LOG_WARNING, "Tried to set a reserved task special port: %d", which_port);
-				break;
-			default:
-				ms->special_port_num = which_port;
-				SLIST_INSERT_HEAD(&special_ports, ms, special_port_sle);
-				break;
-			}
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_HOSTSPECIALPORT) == 0 && pid1_magic) {
-			if (which_port > HOST_MAX_SPECIAL_KERNEL_PORT) {
-				(void)job_assumes_zero(ms->job, (errno = host_set_special_port(mhp, which_port, ms->port)));
-			} else {
-				job_log(ms->job, LOG_WARNING, "Tried to set a reserved host special port: %d", which_port);
-			}
+	for (i = 0; i < 2; i++) {
+		const char *path = i ? j->stderrpath : j->stdoutpath;
+		struct job_capture *jc = j->capture[i];
+		int fds[2];
+
+		if (i == 1 && jc && jc == j->capture[0]) {
+			// Re-decide below whether stderr still shares stdout's pipe.
+			jc = j->capture[1] = NULL;
 		}
-	case LAUNCH_DATA_BOOL:
-		b = launch_data_get_bool(obj);
-		if (strcasecmp(key, LAUNCH_JOBKEY_MACH_ENTERKERNELDEBUGGERONCLOSE) == 0) {
-			ms->debug_on_close = b;
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_RESETATCLOSE) == 0) {
-			ms->reset = b;
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_HIDEUNTILCHECKIN) == 0) {
-			ms->hide = b;
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_EXCEPTIONSERVER) == 0) {
-			job_set_exception_port(ms->job, ms->port);
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_KUNCSERVER) == 0) {
-			ms->kUNCServer = b;
-			(void)job_assumes_zero(ms->job, host_set_UNDServer(mhp, ms->port));
+		if (!path) {
+			continue;
 		}
-		break;
-	case LAUNCH_DATA_STRING:
-		if (strcasecmp(key, LAUNCH_JOBKEY_MACH_DRAINMESSAGESONCRASH) == 0) {
-			const char *option = launch_data_get_string(obj);
-			if (strcasecmp(option, "One") == 0) {
-				ms->drain_one_on_crash = true;
-			} else if (strcasecmp(option, "All") == 0) {
-				ms->drain_all_on_crash = true;
+		if (i == 1 && j->stdoutpath && strcmp(j->stdoutpath, j->stderrpath) == 0) {
+			if (jc) {
+				job_capture_close(j, jc);
+				free(jc);
 			}
+			j->capture[1] = j->capture[0];
+			continue;
 		}
-		break;
-	case LAUNCH_DATA_DICTIONARY:
-		if (launch_data_dict_get_count(obj) == 0) {
-			job_set_exception_port(ms->job, ms->port);
+
+		if (!jc) {
+			if (!job_assumes(j, (jc = calloc(1, sizeof(struct job_capture))) != NULL)) {
+				continue;
+			}
+
+			jc->rfd = -1;
+			jc->child_fd = -1;
+			j->capture[i] = jc;
 		}
-		break;
-	default:
-		break;
-	}
 
-	(void)job_assumes_zero(ms->job, launchd_mport_deallocate(mhp));
+		/* Something the last instance left behind may still be holding the
+		 * old pipe open. Whatever it writes from here on is lost.
+		 */
+		if (jc->rfd != -1) {
+			job_capture_close(j, jc);
+		}
+
+		if (pipe(fds) == -1) {
+			job_log_error(j, LOG_WARNING, "pipe() for output capture");
+			continue;
+		}
+
+		jc->rfd = _fd(fds[0]);
+		jc->child_fd = _fd(fds[1]);
+		(void)job_assumes_zero_p(j, fcntl(jc->rfd, F_SETFL, O_NONBLOCK));
+	}
 }
 
 void
-machservice_setup(launch_data_t obj, const char *key, void *context)
+job_capture_attach(job_t j)
 {
-	job_t j = context;
-	struct machservice *ms;
-	mach_port_t p = MACH_PORT_NULL;
+	size_t i;
 
-	if (unlikely(ms = jobmgr_lookup_service(j->mgr, key, false, 0))) {
-		job_log(j, LOG_WARNING, "Conflict with job: %s over Mach service: %s", ms->job->label, key);
-		return;
+	for (i = 0; i < 2; i++) {
+		struct job_capture *jc = j->capture[i];
+
+		if (!jc || jc->child_fd == -1) {
+			continue;
+		}
+
+		(void)job_assumes_zero(j, runtime_close(jc->child_fd));
+		jc->child_fd = -1;
+
+		(void)job_assumes_zero_p(j, kevent_mod(jc->rfd, EVFILT_READ, EV_ADD, 0, 0, j));
 	}
+}
 
-	if (!job_assumes(j, (ms = machservice_new(j, key, &p, false)) != NULL)) {
-		return;
+bool
+job_capture_setup_fd(job_t j, int target_fd, struct job_capture *jc)
+{
+	if (!jc || jc->child_fd == -1) {
+		return false;
 	}
 
-	ms->isActive = false;
-	ms->upfront = true;
+	(void)job_assumes_zero_p(j, dup2(jc->child_fd, target_fd));
+	return true;
+}
 
-	if (launch_data_get_type(obj) == LAUNCH_DATA_DICTIONARY) {
-		launch_data_dict_iterate(obj, machservice_setup_options, ms);
+struct job_capture *
+job_capture_find(job_t j, int fd)
+{
+	size_t i;
+
+	for (i = 0; i < 2; i++) {
+		if (j->capture[i] && j->capture[i]->rfd == fd) {
+			return j->capture[i];
+		}
 	}
 
-	kern_return_t kr = mach_port_set_attributes(mach_task_self(), ms->port, MACH_PORT_TEMPOWNER, NULL, 0);
-	(void)job_assumes_zero(j, kr);
+	return NULL;
 }
 
-jobmgr_t
-jobmgr_do_garbage_collection(jobmgr_t jm)
+/* Returns how many of the n bytes just read fit under the job's rate limit.
+ * The limit covers stdout and stderr together.
+ */
+static size_t
+job_capture_admit(job_t j, struct job_capture *jc, size_t n)
 {
-	jobmgr_t jmi = NULL, jmn = NULL;
-	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
-		jobmgr_do_garbage_collection(jmi);
+	uint64_t room;
+	size_t keep;
+
+	if (!j->capture_cfg.rate) {
+		return n;
 	}
 
-	if (!jm->shutting_down) {
-		return jm;
+	if (!j->capture_window || runtime_get_nanoseconds_since(j->capture_window) >= NSEC_PER_SEC) {
+		j->capture_window = runtime_get_opaque_time();
+		j->capture_window_bytes = 0;
 	}
 
-	if (SLIST_EMPTY(&jm->submgrs)) {
-		jobmgr_log(jm, LOG_DEBUG, "No submanagers left.");
-	} else {
-		jobmgr_log(jm, LOG_DEBUG, "Still have submanagers.");
-		SLIST_FOREACH(jmi, &jm->submgrs, sle) {
-			jobmgr_log(jm, LOG_DEBUG, "Submanager: %s", jmi->name);
+	room = j->capture_cfg.rate - j->capture_window_bytes;
+	keep = (n < room) ? n : (size_t)room;
+	j->capture_window_bytes += keep;
+
+	if (keep < n) {
+		jc->dropped += n - keep;
+		if (!j->capture_dropping) {
+			job_log(j, LOG_NOTICE, "Output exceeded %u bytes per second. Dropping output.", j->capture_cfg.rate);
+			j->capture_dropping = true;
 		}
+	} else if (j->capture_dropping && j->capture_window_bytes < j->capture_cfg.rate) {
+		j->capture_dropping = false;
 	}
 
-	size_t actives = 0;
-	job_t ji = NULL, jn = NULL;
-	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
-		if (ji->anonymous) {
-			continue;
+	return keep;
+}
+
+void
+job_capture_drain(job_t j, struct job_capture *jc)
+{
+	size_t total = 0;
+	ssize_t n;
+
+	while (total < JOB_CAPTURE_DRAIN_MAX) {
+		if (jc->len == sizeof(jc->buf)) {
+			job_capture_flush(j, jc);
 		}
 
-		// Let the shutdown monitor be up until the very end.
-		if (ji->shutdown_monitor) {
+		n = read(jc->rfd, jc->buf + jc->len, sizeof(jc->buf) - jc->len);
+		if (n > 0) {
+			total += n;
+			jc->len += job_capture_admit(j, jc, (size_t)n);
 			continue;
 		}
 
-		/* On our first pass through, open a transaction for all the jobs that
-		 * need to be dirty at shutdown. We'll close these transactions once the
-		 * jobs that do not need to be dirty at shutdown have all exited.
-		 */
-		if (ji->dirty_at_shutdown && !jm->shutdown_jobs_dirtied) {
-			job_open_shutdown_transaction(ji);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+			break;
+		}
+		if (n == -1) {
+			(void)job_assumes_zero(j, errno);
 		}
 
-		const char *active = job_active(ji);
-		if (!active) {
-			job_remove(ji);
+		// Every writer has gone away.
+		job_capture_close(j, jc);
+		return;
+	}
+
+	if (jc->len && !jc->flush_pending) {
+		if (job_assumes_zero_p(j, kevent_mod((uintptr_t)jc, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, JOB_CAPTURE_FLUSH_DELAY, j)) != -1) {
+			jc->flush_pending = true;
 		} else {
-			job_log(ji, LOG_DEBUG, "Job is active: %s", active);
-			job_stop(ji);
+			job_capture_flush(j, jc);
+		}
+	}
+}
 
-			if (!ji->dirty_at_shutdown) {
-				actives++;
-			}
+enum {
+	JOB_CAPTURE_ERR_CREDS = 1,
+	JOB_CAPTURE_ERR_OPEN,
+	JOB_CAPTURE_ERR_RENAME,
+	JOB_CAPTURE_ERR_UNLINK,
+	JOB_CAPTURE_ERR_WRITE,
+};
 
-			if (ji->clean_kill) {
-				job_log(ji, LOG_DEBUG, "Job was killed cleanly.");
-			} else {
-				job_log(ji, LOG_DEBUG, "Job was sent SIGTERM%s.", ji->sent_sigkill ? " and SIGKILL" : "");
-			}
-		}
-	}
+static const char *const job_capture_err_ops[] = {
+	[JOB_CAPTURE_ERR_CREDS] = "look up the credentials for",
+	[JOB_CAPTURE_ERR_OPEN] = "open",
+	[JOB_CAPTURE_ERR_RENAME] = "rotate",
+	[JOB_CAPTURE_ERR_UNLINK] = "unlink",
+	[JOB_CAPTURE_ERR_WRITE] = "write to",
+};
 
-	jm->shutdown_jobs_dirtied = true;
-	if (actives == 0) {
-		if (!jm->shutdown_jobs_cleaned) {
-			/* Once all normal jobs have exited, we clean the dirty-at-shutdown
-			 * jobs and make them into normal jobs so that the above loop will
-			 * handle them appropriately.
-			 */
-			LIST_FOREACH(ji, &jm->jobs, sle) {
-				if (ji->anonymous) {
-					continue;
-				}
+static dispatch_queue_t s_capture_queue;
 
-				if (!job_active(ji)) {
-					continue;
-				}
-				
-				if (ji->shutdown_monitor) {
-					continue;
-				}
+static void
+job_capture_file_error(struct job_capture_file *f, int op, int err)
+{
+	(void)OSAtomicCompareAndSwap32Barrier(0, (op << 16) | (err & 0xffff), &f->error);
+}
 
-				job_close_shutdown_transaction(ji);
-				actives++;
-			}
+// Runs on s_capture_queue.
+static bool
+job_capture_file_resolve(struct job_capture_file *f)
+{
+	char buf[4096];
+	struct passwd pw, *pwe = NULL;
+	struct group gr, *gre = NULL;
+	int r;
 
-			jm->shutdown_jobs_cleaned = true;
-		}
+	if (f->creds_resolved) {
+		return true;
+	}
 
-		if (SLIST_EMPTY(&jm->submgrs) && actives == 0) {
-			/* We may be in a situation where the shutdown monitor is all that's
-			 * left, in which case we want to stop it. Like dirty-at-shutdown
-			 * jobs, we turn it back into a normal job so that the main loop
-			 * treats it appropriately.
-			 *
-			 * See:
-			 * <rdar://problem/10756306>
-			 * <rdar://problem/11034971>
-			 * <rdar://problem/11549541>
-			 */
-			if (jm->monitor_shutdown && _launchd_shutdown_monitor) {
-				/* The rest of shutdown has completed, so we can kill the shutdown
-				 * monitor now like it was any other job.
-				 */
-				_launchd_shutdown_monitor->shutdown_monitor = false;
-				
-				job_log(_launchd_shutdown_monitor, LOG_NOTICE | LOG_CONSOLE, "Stopping shutdown monitor.");
-				job_stop(_launchd_shutdown_monitor);
-				_launchd_shutdown_monitor = NULL;
-			} else {
-				jobmgr_log(jm, LOG_DEBUG, "Removing.");
-				jobmgr_remove(jm);
-				return NULL;
-			}
-		}
+	// Same rules as job_postfork_become_user().
+	if (f->username || f->groupname) {
+		r = getpwnam_r(f->username ? f->username : "root", &pw, buf, sizeof(buf), &pwe);
+	} else {
+		r = getpwuid_r(f->mach_uid, &pw, buf, sizeof(buf), &pwe);
+	}
+	if (!pwe) {
+		job_capture_file_error(f, JOB_CAPTURE_ERR_CREDS, r ? r : ESRCH);
+		return false;
 	}
 
-	return jm;
-}
+	f->uid = pwe->pw_uid;
+	f->gid = pwe->pw_gid;
 
-void
-jobmgr_kill_stray_children(jobmgr_t jm, pid_t *p, size_t np)
-{
-	/* I maintain that stray processes should be at the mercy of launchd during
-	 * shutdown, but nevertheless, things like diskimages-helper can stick
-	 * around, and SIGKILLing them can result in data loss. So we send SIGTERM
-	 * to all the strays and don't wait for them to exit before moving on.
-	 * 
-	 * See rdar://problem/6562592
-	 */
-	size_t i = 0;
-	for (i = 0; i < np; i++) {
-		if (p[i] != 0) {
-			jobmgr_log(jm, LOG_DEBUG | LOG_CONSOLE, "Sending SIGTERM to PID %u and continuing...", p[i]);
-			(void)jobmgr_assumes_zero_p(jm, kill2(p[i], SIGTERM));
+	if (f->groupname) {
+		r = getgrnam_r(f->groupname, &gr, buf, sizeof(buf), &gre);
+		if (!gre) {
+			job_capture_file_error(f, JOB_CAPTURE_ERR_CREDS, r ? r : ESRCH);
+			return false;
 		}
+		f->gid = gre->gr_gid;
 	}
+
+	f->creds_resolved = true;
+	return true;
 }
 
-void
-jobmgr_log_stray_children(jobmgr_t jm, bool kill_strays)
+// Runs on s_capture_queue, as the job.
+static void
+job_capture_file_rotate(struct job_capture_file *f)
 {
-	size_t kp_skipped = 0, len = sizeof(pid_t) * get_kern_max_proc();
-	pid_t *pids = NULL;
-	int i = 0, kp_cnt = 0;
+	char from[PATH_MAX], to[PATH_MAX];
+	uint32_t i;
 
-	if (likely(jm->parentmgr || !pid1_magic)) {
+	(void)close(f->wfd);
+	f->wfd = -1;
+
+	if (f->cfg.max_files == 0) {
+		if (unlink(f->path) == -1 && errno != ENOENT) {
+			job_capture_file_error(f, JOB_CAPTURE_ERR_UNLINK, errno);
+		}
 		return;
 	}
 
-	if (!jobmgr_assumes(jm, (pids = malloc(len)) != NULL)) {
-		return;
+	for (i = f->cfg.max_files; i > 1; i--) {
+		(void)snprintf(from, sizeof(from), "%s.%u", f->path, i - 1);
+		(void)snprintf(to, sizeof(to), "%s.%u", f->path, i);
+		if (rename(from, to) == -1 && errno != ENOENT) {
+			job_capture_file_error(f, JOB_CAPTURE_ERR_RENAME, errno);
+		}
 	}
 
-	runtime_ktrace0(RTKT_LAUNCHD_FINDING_ALL_STRAYS);
+	(void)snprintf(to, sizeof(to), "%s.1", f->path);
+	if (rename(f->path, to) == -1 && errno != ENOENT) {
+		job_capture_file_error(f, JOB_CAPTURE_ERR_RENAME, errno);
+	}
+}
 
-	if (jobmgr_assumes_zero_p(jm, (kp_cnt = proc_listallpids(pids, len))) == -1) {
-		goto out;
+// Runs on s_capture_queue, as the job.
+static bool
+job_capture_file_open(struct job_capture_file *f)
+{
+	struct stat sb;
+
+	f->wfd = open(f->path, O_WRONLY|O_APPEND|O_CREAT|O_NOCTTY|O_NOFOLLOW|O_CLOEXEC, DEFFILEMODE);
+	if (f->wfd == -1) {
+		job_capture_file_error(f, JOB_CAPTURE_ERR_OPEN, errno);
+		return false;
 	}
 
-	pid_t *ps = (pid_t *)calloc(sizeof(pid_t), kp_cnt);
-	for (i = 0; i < kp_cnt; i++) {
-		struct proc_bsdshortinfo proc;
-		if (proc_pidinfo(pids[i], PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
-			if (errno != ESRCH) {
-				(void)jobmgr_assumes_zero(jm, errno);
-			}
+	f->size = (fstat(f->wfd, &sb) == 0) ? sb.st_size : 0;
+	f->opened = runtime_get_opaque_time();
 
-			kp_skipped++;
-			continue;
-		}
+	return true;
+}
 
-		pid_t p_i = pids[i];
-		pid_t pp_i = proc.pbsi_ppid;
-		pid_t pg_i = proc.pbsi_pgid;
-		const char *z = (proc.pbsi_status == SZOMB) ? "zombie " : "";
-		const char *n = proc.pbsi_comm;
+// Runs on s_capture_queue.
+static void
+job_capture_file_write(void *ctx)
+{
+	struct job_capture_chunk *c = ctx;
+	struct job_capture_file *f = c->file;
+	size_t off = 0;
+	ssize_t n;
 
-		if (unlikely(p_i == 0 || p_i == 1)) {
-			kp_skipped++;
-			continue;
+	/* The file is opened, rotated and written with the job's credentials, so
+	 * the parent directories are only as open to us as they are to the job.
+	 */
+	if (f->assume_creds) {
+		if (!job_capture_file_resolve(f)) {
+			goto out;
 		}
-
-		if (_launchd_shutdown_monitor && pp_i == _launchd_shutdown_monitor->p) {
-			kp_skipped++;
-			continue;
+		if (pthread_setugid_np(f->uid, f->gid) == -1) {
+			job_capture_file_error(f, JOB_CAPTURE_ERR_CREDS, errno);
+			goto out;
 		}
+	}
 
-		// We might have some jobs hanging around that we've decided to shut down in spite of.
-		job_t j = jobmgr_find_by_pid(jm, p_i, false);
-		if (!j || (j && j->anonymous)) {
-			jobmgr_log(jm, LOG_INFO | LOG_CONSOLE, "Stray %s%s at shutdown: PID %u PPID %u PGID %u %s", z, j ? "anonymous job" : "process", p_i, pp_i, pg_i, n);
+	if (f->wfd != -1) {
+		bool too_big = f->cfg.max_size && (uint64_t)f->size + c->len > f->cfg.max_size;
+		bool too_old = f->cfg.max_age && runtime_get_nanoseconds_since(f->opened) / NSEC_PER_SEC >= f->cfg.max_age;
 
-			int status = 0;
-			if (pp_i == getpid() && !jobmgr_assumes(jm, proc.pbsi_status != SZOMB)) {
-				if (jobmgr_assumes_zero(jm, waitpid(p_i, &status, WNOHANG)) == 0) {
-					jobmgr_log(jm, LOG_INFO | LOG_CONSOLE, "Unreaped zombie stray exited with status %i.", WEXITSTATUS(status));
-				}
-				kp_skipped++;
-			} else {
-				job_t leader = jobmgr_find_by_pid(jm, pg_i, false);
-				/* See rdar://problem/6745714. Some jobs have child processes that back kernel state,
-				 * so we don't want to terminate them. Long-term, I'd really like to provide shutdown
-				 * hints to the kernel along the way, so that it could shutdown certain subsystems when
-				 * their userspace emissaries go away, before the call to reboot(2).
-				 */
-				if (leader && leader->ignore_pg_at_shutdown) {
-					kp_skipped++;
-				} else {
-					ps[i] = p_i;
+		if (too_big || too_old) {
+			job_capture_file_rotate(f);
+		}
+	}
+
+	if (f->wfd != -1 || job_capture_file_open(f)) {
+		while (off < c->len) {
+			if ((n = write(f->wfd, c->buf + off, c->len - off)) == -1) {
+				if (errno == EINTR) {
+					continue;
 				}
+
+				job_capture_file_error(f, JOB_CAPTURE_ERR_WRITE, errno);
+				break;
 			}
-		} else {
-			kp_skipped++;
+
+			off += n;
 		}
+		f->size += off;
 	}
 
-	if ((kp_cnt - kp_skipped > 0) && kill_strays) {
-		jobmgr_kill_stray_children(jm, ps, kp_cnt - kp_skipped);
+	if (f->assume_creds) {
+		(void)os_assumes_zero_p(pthread_setugid_np(KAUTH_UID_NONE, KAUTH_GID_NONE));
 	}
 
-	free(ps);
 out:
-	free(pids);
+	if (off < c->len) {
+		(void)OSAtomicAdd64Barrier((int64_t)(c->len - off), &f->dropped);
+	}
+	(void)OSAtomicAdd64Barrier(-(int64_t)c->len, &f->inflight);
+	free(c);
 }
 
-jobmgr_t 
-jobmgr_parent(jobmgr_t jm)
+// Runs on s_capture_queue, after every write the main thread handed over.
+static void
+job_capture_file_free(void *ctx)
 {
-	return jm->parentmgr;
+	struct job_capture_file *f = ctx;
+
+	if (f->wfd != -1) {
+		(void)close(f->wfd);
+	}
+	free(f->username);
+	free(f->groupname);
+	free(f);
 }
 
-void
-job_uncork_fork(job_t j)
+static struct job_capture_file *
+job_capture_file_new(job_t j, struct job_capture *jc)
 {
-	pid_t c = j->p;
+	const char *path = job_capture_path(j, jc);
+	struct job_capture_file *f;
 
-	job_log(j, LOG_DEBUG, "Uncorking the fork().");
-	/* this unblocks the child and avoids a race
-	 * between the above fork() and the kevent_mod() */
-	(void)job_assumes(j, write(j->fork_fd, &c, sizeof(c)) == sizeof(c));
-	(void)job_assumes_zero_p(j, runtime_close(j->fork_fd));
-	j->fork_fd = 0;
+	if (!path) {
+		return NULL;
+	}
+	if (!s_capture_queue && !job_assumes(j, (s_capture_queue = dispatch_queue_create("com.apple.launchd.output-capture", NULL)) != NULL)) {
+		return NULL;
+	}
+	if (!job_assumes(j, (f = calloc(1, sizeof(*f) + strlen(path) + 1)) != NULL)) {
+		return NULL;
+	}
+
+	strcpy(f->path, path);
+	f->wfd = -1;
+	f->cfg = j->capture_cfg;
+
+	// The same credentials job_postfork_become_user() would have switched to.
+	if (getuid() == 0 && (j->username || j->groupname || j->mach_uid)) {
+		f->assume_creds = true;
+		f->mach_uid = j->mach_uid;
+		f->username = j->username ? strdup(j->username) : NULL;
+		f->groupname = j->groupname ? strdup(j->groupname) : NULL;
+		if (!job_assumes(j, (!j->username || f->username) && (!j->groupname || f->groupname))) {
+			job_capture_file_free(f);
+			return NULL;
+		}
+	}
+
+	return f;
 }
 
-jobmgr_t 
-jobmgr_new(jobmgr_t jm, mach_port_t requestorport, mach_port_t transfer_port, bool sflag, const char *name, bool skip_init, mach_port_t asport)
+// Logs whatever the writer has run into since we last looked.
+static void
+job_capture_file_report(job_t j, struct job_capture_file *f)
 {
-	job_t bootstrapper = NULL;
-	jobmgr_t jmr;
+	int32_t error;
 
-	__OS_COMPILETIME_ASSERT__(offsetof(struct jobmgr_s, kqjobmgr_callback) == 0);
+	do {
+		error = f->error;
+	} while (error && !OSAtomicCompareAndSwap32Barrier(error, 0, &f->error));
 
-	if (unlikely(jm && requestorport == MACH_PORT_NULL)) {
-		jobmgr_log(jm, LOG_ERR, "Mach sub-bootstrap create request requires a requester port");
-		return NULL;
+	if (error) {
+		job_log(j, LOG_WARNING, "Could not %s \"%s\": %d: %s", job_capture_err_ops[error >> 16], f->path, error & 0xffff, strerror(error & 0xffff));
 	}
+}
 
-	jmr = calloc(1, sizeof(struct jobmgr_s) + (name ? (strlen(name) + 1) : NAME_MAX + 1));
+void
+job_capture_flush(job_t j, struct job_capture *jc)
+{
+	struct job_capture_file *f;
+	struct job_capture_chunk *c;
 
-	if (!jobmgr_assumes(jm, jmr != NULL)) {
-		return NULL;
+	if (!jc->len) {
+		return;
 	}
 
-	if (jm == NULL) {
-		root_jobmgr = jmr;
+	if (!jc->file) {
+		jc->file = job_capture_file_new(j, jc);
+	}
+	if (!(f = jc->file)) {
+		goto drop;
 	}
 
-	jmr->kqjobmgr_callback = jobmgr_callback;
-	strcpy(jmr->name_init, name ? name : "Under construction");
-
-	jmr->req_port = requestorport;
+	job_capture_file_report(j, f);
 
-	if ((jmr->parentmgr = jm)) {
-		SLIST_INSERT_HEAD(&jm->submgrs, jmr, sle);
+	// If the disk can't keep up, drop output rather than queue it without bound.
+	if (f->inflight + (int64_t)jc->len > JOB_CAPTURE_INFLIGHT_MAX) {
+		goto drop;
 	}
-
-	if (jm && jobmgr_assumes_zero(jmr, launchd_mport_notify_req(jmr->req_port, MACH_NOTIFY_DEAD_NAME)) != KERN_SUCCESS) {
-		goto out_bad;
+	if (!job_assumes(j, (c = malloc(sizeof(*c) + jc->len)) != NULL)) {
+		goto drop;
 	}
 
-	if (transfer_port != MACH_PORT_NULL) {
-		(void)jobmgr_assumes(jmr, jm != NULL);
-		jmr->jm_port = transfer_port;
-	} else if (!jm && !pid1_magic) {
-		char *trusted_fd = getenv(LAUNCHD_TRUSTED_FD_ENV);
-		name_t service_buf;
-
-		snprintf(service_buf, sizeof(service_buf), "com.apple.launchd.peruser.%u", getuid());
+	c->file = f;
+	c->len = jc->len;
+	memcpy(c->buf, jc->buf, jc->len);
+	(void)OSAtomicAdd64Barrier((int64_t)jc->len, &f->inflight);
+	dispatch_async_f(s_capture_queue, c, job_capture_file_write);
 
-		if (jobmgr_assumes_zero(jmr, bootstrap_check_in(bootstrap_port, service_buf, &jmr->jm_port)) != 0) {
-			goto out_bad;
-		}
+	jc->len = 0;
+	return;
 
-		if (trusted_fd) {
-			int dfd, lfd = (int) strtol(trusted_fd, NULL, 10);
+drop:
+	jc->dropped += jc->len;
+	jc->len = 0;
+}
 
-			if ((dfd = dup(lfd)) >= 0) {
-				(void)jobmgr_assumes_zero_p(jmr, runtime_close(dfd));
-				(void)jobmgr_assumes_zero_p(jmr, runtime_close(lfd));
-			}
+void
+job_capture_close(job_t j, struct job_capture *jc)
+{
+	if (!jc) {
+		return;
+	}
 
-			unsetenv(LAUNCHD_TRUSTED_FD_ENV);
-		}
+	job_capture_flush(j, jc);
 
-		// cut off the Libc cache, we don't want to deadlock against ourself
-		inherited_bootstrap_port = bootstrap_port;
-		bootstrap_port = MACH_PORT_NULL;
-		os_assert_zero(launchd_mport_notify_req(inherited_bootstrap_port, MACH_NOTIFY_DEAD_NAME));
-
-		// We set this explicitly as we start each child
-		os_assert_zero(launchd_set_bport(MACH_PORT_NULL));
-	} else if (jobmgr_assumes_zero(jmr, launchd_mport_create_recv(&jmr->jm_port)) != KERN_SUCCESS) {
-		goto out_bad;
+	if (jc->flush_pending) {
+		(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)jc, EVFILT_TIMER, EV_DELETE, 0, 0, NULL));
+		jc->flush_pending = false;
 	}
-
-	if (!name) {
-		sprintf(jmr->name_init, "%u", MACH_PORT_INDEX(jmr->jm_port));
+	if (jc->rfd != -1) {
+		(void)job_assumes_zero(j, runtime_close(jc->rfd));
+		jc->rfd = -1;
 	}
-
-	if (!jm) {
-		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
-		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
-		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGUSR2, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
-		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGINFO, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
-		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(0, EVFILT_FS, EV_ADD, VQ_MOUNT|VQ_UNMOUNT|VQ_UPDATE, 0, jmr));
+	if (jc->child_fd != -1) {
+		(void)job_assumes_zero(j, runtime_close(jc->child_fd));
+		jc->child_fd = -1;
 	}
-
-	if (name && !skip_init) {
-		bootstrapper = jobmgr_init_session(jmr, name, sflag);
+	if (jc->file) {
+		/* Writes still queued are accounted for by the file, which the queue
+		 * frees once they're done. Anything they drop after this is lost to
+		 * the count.
+		 */
+		job_capture_file_report(j, jc->file);
+		jc->dropped += jc->file->dropped;
+		dispatch_async_f(s_capture_queue, jc->file, job_capture_file_free);
+		jc->file = NULL;
 	}
+}
 
-	if (!bootstrapper || !bootstrapper->weird_bootstrap) {
-		if (jobmgr_assumes_zero(jmr, runtime_add_mport(jmr->jm_port, job_server)) != KERN_SUCCESS) {
-			goto out_bad;
-		}
+void
+job_capture_free(job_t j)
+{
+	if (j->capture[1] == j->capture[0]) {
+		j->capture[1] = NULL;
 	}
 
-	jobmgr_log(jmr, LOG_DEBUG, "Created job manager%s%s", jm ? " with parent: " : ".", jm ? jm->name : "");
-
-	if (bootstrapper) {
-		bootstrapper->asport = asport;
-
-		jobmgr_log(jmr, LOG_DEBUG, "Bootstrapping new job manager with audit session %u", asport);
-		(void)jobmgr_assumes(jmr, job_dispatch(bootstrapper, true) != NULL);
-	} else {
-		jmr->req_asport = asport;
-	}
+	job_capture_close(j, j->capture[0]);
+	job_capture_close(j, j->capture[1]);
+	free(j->capture[0]);
+	free(j->capture[1]);
+	j->capture[0] = NULL;
+	j->capture[1] = NULL;
+}
 
-	if (asport != MACH_PORT_NULL) {
-		(void)jobmgr_assumes_zero(jmr, launchd_mport_copy_send(asport));
-	}
+uint64_t
+job_capture_dropped(job_t j)
+{
+	uint64_t dropped = 0;
 
-	if (jmr->parentmgr) {
-		runtime_add_weak_ref();
-	}
+	size_t i;
 
-	return jmr;
+	for (i = 0; i < 2; i++) {
+		struct job_capture *jc = j->capture[i];
 
-out_bad:
-	if (jmr) {
-		jobmgr_remove(jmr);
-		if (jm == NULL) {
-			root_jobmgr = NULL;
+		if (!jc || (i == 1 && jc == j->capture[0])) {
+			continue;
 		}
-	}
-	return NULL;
-}
-
-jobmgr_t
-jobmgr_new_xpc_singleton_domain(jobmgr_t jm, name_t name)
-{
-	jobmgr_t new = NULL;
 
-	/* These job managers are basically singletons, so we use the root Mach
-	 * bootstrap port as their requestor ports so they'll never go away.
-	 */
-	mach_port_t req_port = root_jobmgr->jm_port;
-	if (jobmgr_assumes_zero(jm, launchd_mport_make_send(req_port)) == KERN_SUCCESS) {
-		new = jobmgr_new(root_jobmgr, req_port, MACH_PORT_NULL, false, name, true, MACH_PORT_NULL);
-		if (new) {
-			new->properties |= BOOTSTRAP_PROPERTY_XPC_SINGLETON;
-			new->properties |= BOOTSTRAP_PROPERTY_XPC_DOMAIN;
-			new->xpc_singleton = true;
+		dropped += jc->dropped;
+		if (jc->file) {
+			dropped += jc->file->dropped;
 		}
 	}
 
-	return new;
+	return dropped;
 }
 
-jobmgr_t
-jobmgr_find_xpc_per_user_domain(jobmgr_t jm, uid_t uid)
+launch_data_t
+job_capture_export(const struct job_capture_config *cfg, uint64_t dropped)
 {
-	jobmgr_t jmi = NULL;
-	LIST_FOREACH(jmi, &_s_xpc_user_domains, xpc_le) {
-		if (jmi->req_euid == uid) {
-			return jmi;
-		}
-	}
+	launch_data_t tmp, r;
 
-	name_t name;
-	(void)snprintf(name, sizeof(name), "com.apple.xpc.domain.peruser.%u", uid);
-	jmi = jobmgr_new_xpc_singleton_domain(jm, name);
-	if (jobmgr_assumes(jm, jmi != NULL)) {
-		/* We need to create a per-user launchd for this UID if there isn't one
-		 * already so we can grab the bootstrap port.
-		 */
-		job_t puj = jobmgr_lookup_per_user_context_internal(NULL, uid, &jmi->req_bsport);
-		if (jobmgr_assumes(jmi, puj != NULL)) {
-			(void)jobmgr_assumes_zero(jmi, launchd_mport_copy_send(puj->asport));
-			(void)jobmgr_assumes_zero(jmi, launchd_mport_copy_send(jmi->req_bsport));
-			jmi->shortdesc = "per-user";
-			jmi->req_asport = puj->asport;
-			jmi->req_asid = puj->asid;
-			jmi->req_euid = uid;
-			jmi->req_egid = -1;
+	if (!(r = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		return NULL;
+	}
 
-			LIST_INSERT_HEAD(&_s_xpc_user_domains, jmi, xpc_le);
-		} else {
-			jobmgr_remove(jmi);
-		}
+	if (cfg->max_size && (tmp = launch_data_new_integer(cfg->max_size))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBOUTPUTCAPTURE_MAXFILESIZE);
+	}
+	if (cfg->max_age && (tmp = launch_data_new_integer(cfg->max_age))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBOUTPUTCAPTURE_MAXFILEAGE);
+	}
+	if ((tmp = launch_data_new_integer(cfg->max_files))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBOUTPUTCAPTURE_MAXFILES);
+	}
+	if (cfg->rate && (tmp = launch_data_new_integer(cfg->rate))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBOUTPUTCAPTURE_MAXBYTESPERSECOND);
+	}
+	if ((tmp = launch_data_new_integer(dropped))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBOUTPUTCAPTURE_DROPPEDBYTES);
 	}
 
-	return jmi;
+	return r;
 }
 
-jobmgr_t
-jobmgr_find_xpc_per_session_domain(jobmgr_t jm, au_asid_t asid)
+void
+capture_setup(launch_data_t obj, const char *key, void *context)
 {
-	jobmgr_t jmi = NULL;
-	LIST_FOREACH(jmi, &_s_xpc_session_domains, xpc_le) {
-		if (jmi->req_asid == asid) {
-			return jmi;
-		}
+	job_t j = context;
+	long long val;
+
+	if (launch_data_get_type(obj) != LAUNCH_DATA_INTEGER) {
+		job_log(j, LOG_WARNING, "OutputCapture key is not an integer: %s", key);
+		return;
 	}
 
-	name_t name;
-	(void)snprintf(name, sizeof(name), "com.apple.xpc.domain.persession.%i", asid);
-	jmi = jobmgr_new_xpc_singleton_domain(jm, name);
-	if (jobmgr_assumes(jm, jmi != NULL)) {
-		(void)jobmgr_assumes_zero(jmi, launchd_mport_make_send(root_jobmgr->jm_port));
-		jmi->shortdesc = "per-session";
-		jmi->req_bsport = root_jobmgr->jm_port;
-		(void)jobmgr_assumes_zero(jmi, audit_session_port(asid, &jmi->req_asport));
-		jmi->req_asid = asid;
-		jmi->req_euid = -1;
-		jmi->req_egid = -1;
+	if ((val = launch_data_get_integer(obj)) < 0) {
+		job_log(j, LOG_WARNING, "OutputCapture key is negative: %s", key);
+		return;
+	}
 
-		LIST_INSERT_HEAD(&_s_xpc_session_domains, jmi, xpc_le);
+	if (strcasecmp(key, LAUNCH_JOBOUTPUTCAPTURE_MAXFILESIZE) == 0) {
+		j->capture_cfg.max_size = (uint64_t)val;
+	} else if (strcasecmp(key, LAUNCH_JOBOUTPUTCAPTURE_MAXFILEAGE) == 0) {
+		j->capture_cfg.max_age = (uint32_t)val;
+	} else if (strcasecmp(key, LAUNCH_JOBOUTPUTCAPTURE_MAXFILES) == 0) {
+		j->capture_cfg.max_files = (uint32_t)val;
+	} else if (strcasecmp(key, LAUNCH_JOBOUTPUTCAPTURE_MAXBYTESPERSECOND) == 0) {
+		j->capture_cfg.rate = (uint32_t)val;
 	} else {
-		jobmgr_remove(jmi);
+		job_log(j, LOG_WARNING, "Unknown OutputCapture key: %s", key);
 	}
-
-	return jmi;
 }
 
-job_t
-jobmgr_init_session(jobmgr_t jm, const char *session_type, bool sflag)
+void
+calendarinterval_setalarm(job_t j, struct calendarinterval *ci)
 {
-	const char *bootstrap_tool[] = { "/bin/launchctl", "bootstrap", "-S", session_type, sflag ? "-s" : NULL, NULL };
-	char thelabel[1000];
-	job_t bootstrapper;
-
-	snprintf(thelabel, sizeof(thelabel), "com.apple.launchctl.%s", session_type);
-	bootstrapper = job_new(jm, thelabel, NULL, bootstrap_tool);
+	struct calendarinterval *ci_iter, *ci_prev = NULL;
+	time_t later, head_later;
 
-	if (jobmgr_assumes(jm, bootstrapper != NULL) && (jm->parentmgr || !pid1_magic)) {
-		bootstrapper->is_bootstrapper = true;
-		char buf[100];
+	later = cronemu(ci->when.tm_mon, ci->when.tm_mday, ci->when.tm_hour, ci->when.tm_min);
 
-		// <rdar://problem/5042202> launchd-201: can't ssh in with AFP OD account (hangs)
-		snprintf(buf, sizeof(buf), "0x%X:0:0", getuid());
-		envitem_new(bootstrapper, "__CF_USER_TEXT_ENCODING", buf, false);
-		bootstrapper->weird_bootstrap = true;
-		(void)jobmgr_assumes(jm, job_setup_machport(bootstrapper));
-	} else if (bootstrapper && strncmp(session_type, VPROCMGR_SESSION_SYSTEM, sizeof(VPROCMGR_SESSION_SYSTEM)) == 0) {
-#if TARGET_OS_EMBEDDED
-		bootstrapper->psproctype = POSIX_SPAWN_PROC_TYPE_DAEMON_INTERACTIVE;
-#endif
-		bootstrapper->is_bootstrapper = true;
-		if (jobmgr_assumes(jm, pid1_magic)) {
-			// Have our system bootstrapper print out to the console.
-			bootstrapper->stdoutpath = strdup(_PATH_CONSOLE);
-			bootstrapper->stderrpath = strdup(_PATH_CONSOLE);
+	if (ci->when.tm_wday != -1) {
+		time_t otherlater = cronemu_wday(ci->when.tm_wday, ci->when.tm_hour, ci->when.tm_min);
 
-			if (launchd_console) {
-				(void)jobmgr_assumes_zero_p(jm, kevent_mod((uintptr_t)fileno(launchd_console), EVFILT_VNODE, EV_ADD | EV_ONESHOT, NOTE_REVOKE, 0, jm));
-			}
+		if (ci->when.tm_mday == -1) {
+			later = otherlater;
+		} else {
+			later = later < otherlater ? later : otherlater;
 		}
 	}
 
-	jm->session_initialized = true;
-	return bootstrapper;
-}
-
-jobmgr_t
-jobmgr_delete_anything_with_port(jobmgr_t jm, mach_port_t port)
-{
-	struct machservice *ms, *next_ms;
-	jobmgr_t jmi, jmn;
+	ci->when_next = later;
 
-	/* Mach ports, unlike Unix descriptors, are reference counted. In other
-	 * words, when some program hands us a second or subsequent send right to a
-	 * port we already have open, the Mach kernel gives us the same port number
-	 * back and increments an reference count associated with the port. This
-	 * This forces us, when discovering that a receive right at the other end
-	 * has been deleted, to wander all of our objects to see what weird places
-	 * clients might have handed us the same send right to use.
-	 */
+	LIST_FOREACH(ci_iter, &sorted_calendar_events, global_sle) {
+		if (ci->when_next < ci_iter->when_next) {
+			LIST_INSERT_BEFORE(ci_iter, ci, global_sle);
+			break;
+		}
 
-	if (jm == root_jobmgr) {
-		if (port == inherited_bootstrap_port) {
-			(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(port));
-			inherited_bootstrap_port = MACH_PORT_NULL;
+		ci_prev = ci_iter;
+	}
 
-			return jobmgr_shutdown(jm);
-		}
+	if (ci_iter == NULL) {
+		// ci must want to fire after every other timer, or there are no timers
 
-		LIST_FOREACH_SAFE(ms, &port_hash[HASH_PORT(port)], port_hash_sle, next_ms) {
-			if (ms->port == port && !ms->recv) {
-				machservice_delete(ms->job, ms, true);
-			}
+		if (LIST_EMPTY(&sorted_calendar_events)) {
+			LIST_INSERT_HEAD(&sorted_calendar_events, ci, global_sle);
+		} else {
+			LIST_INSERT_AFTER(ci_prev, ci, global_sle);
 		}
 	}
 
-	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
-		jobmgr_delete_anything_with_port(jmi, port);
-	}
+	head_later = LIST_FIRST(&sorted_calendar_events)->when_next;
 
-	if (jm->req_port == port) {
-		jobmgr_log(jm, LOG_DEBUG, "Request port died: %i", MACH_PORT_INDEX(port));
-		return jobmgr_shutdown(jm);
-	}
+	if (job_assumes_zero_p(j, kevent_mod((uintptr_t)&sorted_calendar_events, EVFILT_TIMER, EV_ADD, NOTE_ABSOLUTE|NOTE_SECONDS, head_later, root_jobmgr)) != -1) {
+		char time_string[100];
+		size_t time_string_len;
 
-	struct waiting4attach *w4ai = NULL;
-	struct waiting4attach *w4ait = NULL;
-	LIST_FOREACH_SAFE(w4ai, &jm->attaches, le, w4ait) {
-		if (port == w4ai->port) {
-			waiting4attach_delete(jm, w4ai);
-			break;
+		ctime_r(&later, time_string);
+		time_string_len = strlen(time_string);
+
+		if (likely(time_string_len && time_string[time_string_len - 1] == '\n')) {
+			time_string[time_string_len - 1] = '\0';
 		}
-	}
 
-	return jm;
+		job_log(j, LOG_INFO, "Scheduled to run again at %s", time_string);
+	}
 }
 
-struct machservice *
-jobmgr_lookup_service(jobmgr_t jm, const char *name, bool check_parent, pid_t target_pid)
+bool
+jobmgr_log_bug(_SIMPLE_STRING asl_message __attribute__((unused)), void *ctx, const char *message)
 {
-	struct machservice *ms;
-	job_t target_j;
+	jobmgr_t jm = ctx;
+	jobmgr_log(jm, LOG_ERR, "%s", message);
 
-	jobmgr_log(jm, LOG_DEBUG, "Looking up %sservice %s", target_pid ? "per-PID " : "", name);
+	return true;
+}
 
-	if (target_pid) {
-		/* This is a hack to let FileSyncAgent look up per-PID Mach services from the Background
-		 * bootstrap in other bootstraps.
-		 */
+bool
+job_log_bug(_SIMPLE_STRING asl_message __attribute__((unused)), void *ctx, const char *message)
+{
+	job_t j = ctx;
+	job_log(j, LOG_ERR, "%s", message);
 
-		// Start in the given bootstrap.
-		if (unlikely((target_j = jobmgr_find_by_pid(jm, target_pid, false)) == NULL)) {
-			// If we fail, do a deep traversal.
-			if (unlikely((target_j = jobmgr_find_by_pid_deep(root_jobmgr, target_pid, true)) == NULL)) {
-				jobmgr_log(jm, LOG_DEBUG, "Didn't find PID %i", target_pid);
-				return NULL;
-			}
-		}
+	return true;
+}
 
-		SLIST_FOREACH(ms, &target_j->machservices, sle) {
-			if (ms->per_pid && strcmp(name, ms->name) == 0) {
-				return ms;
-			}
-		}
-
-		job_log(target_j, LOG_DEBUG, "Didn't find per-PID Mach service: %s", name);
-		return NULL;
+// ri: NULL = please sample j->p; non-NULL = use this sample
+void
+job_log_perf_statistics(job_t j, struct rusage_info_v1 *ri, int64_t exit_status)
+{
+#if HAVE_SYSTEMSTATS
+	if (j->anonymous || !j->p) {
+		return;
+	}
+	if (!systemstats_is_enabled()) {
+		return;
+	}
+	const char *name;
+	if (j->cfbundleidentifier) {
+		name = j->cfbundleidentifier;
+	} else {
+		name = j->label;
+	}
+	int r = 0;
+	struct rusage_info_v1 ris;
+	if (ri == NULL) {
+		ri = &ris;
+		r = proc_pid_rusage(j->p, RUSAGE_INFO_V1, (rusage_info_t)ri);
+	}
+	if (r == -1) {
+		return;
 	}
+	job_log_systemstats(j->p, j->uniqueid, runtime_get_uniqueid(), j->mgr->req_pid, j->mgr->req_uniqueid, name, ri, exit_status);
+#else
+#pragma unused (j, ri, exit_status)
+#endif
+}
 
-	jobmgr_t where2look = jm;
-	// XPC domains are separate from Mach bootstraps.
-	if (!(jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
-		if (launchd_flat_mach_namespace && !(jm->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET)) {
-			where2look = root_jobmgr;
-		}
+#if HAVE_SYSTEMSTATS
+// ri: NULL = don't write fields from ri; non-NULL = use this sample
+static
+void
+job_log_systemstats(pid_t pid, uint64_t uniqueid, uint64_t parent_uniqueid, pid_t req_pid, uint64_t req_uniqueid, const char *name, struct rusage_info_v1 *ri, int64_t exit_status)
+{
+	if (!systemstats_is_enabled()) {
+		return;
 	}
 
-	LIST_FOREACH(ms, &where2look->ms_hash[hash_ms(name)], name_hash_sle) {
-		if (!ms->per_pid && strcmp(name, ms->name) == 0) {
-			return ms;
-		}
+	struct systemstats_process_usage_s info;
+	bzero(&info, sizeof(info));
+	info.name = name;
+	info.pid = pid;
+	info.exit_status = exit_status;
+	info.uid = getuid();
+	info.ppid = getpid();
+	info.responsible_pid = req_pid;
+
+	if (likely(ri)) {
+		info.macho_uuid = (const uint8_t *)&ri->ri_uuid;
+		info.user_time = ri->ri_user_time;
+		info.system_time = ri->ri_system_time;
+		info.pkg_idle_wkups = ri->ri_pkg_idle_wkups;
+		info.interrupt_wkups = ri->ri_interrupt_wkups;
+		info.proc_start_abstime = ri->ri_proc_start_abstime;
+		info.proc_exit_abstime = ri->ri_proc_exit_abstime;
+#if SYSTEMSTATS_API_VERSION >= 20130319
+		info.pageins = ri->ri_pageins;
+		info.wired_size = ri->ri_wired_size;
+		info.resident_size = ri->ri_resident_size;
+		info.phys_footprint = ri->ri_phys_footprint;
+		// info.purgeablesize = ???
+#endif
+#if SYSTEMSTATS_API_VERSION >= 20130328
+		info.child_user_time = ri->ri_child_user_time;
+		info.child_system_time = ri->ri_child_system_time;
+		info.child_pkg_idle_wkups = ri->ri_child_pkg_idle_wkups;
+		info.child_interrupt_wkups = ri->ri_child_interrupt_wkups;
+		info.child_pageins = ri->ri_child_pageins;
+		info.child_elapsed_abstime = ri->ri_child_elapsed_abstime;
+#endif
 	}
+#if SYSTEMSTATS_API_VERSION >= 20130410
+	info.uniqueid = uniqueid;
+	info.parent_uniqueid = parent_uniqueid;
+	info.responsible_uniqueid = req_uniqueid;
+#endif
+	systemstats_write_process_usage(&info);
+}
+#endif /* HAVE_SYSTEMSTATS */
 
-	if (jm->parentmgr == NULL || !check_parent) {
+struct waiting4attach *
+waiting4attach_new(jobmgr_t jm, const char *name, mach_port_t port, pid_t dest, xpc_service_type_t type)
+{
+	size_t xtra = strlen(name) + 1;
+
+	struct waiting4attach *w4a = malloc(sizeof(*w4a) + xtra);
+	if (!w4a) {
 		return NULL;
 	}
 
-	return jobmgr_lookup_service(jm->parentmgr, name, true, 0);
-}
+	w4a->port = port;
+	w4a->dest = dest;
+	w4a->type = type;
+	(void)strcpy(w4a->name, name);
 
-mach_port_t
-machservice_port(struct machservice *ms)
-{
-	return ms->port;
+	if (dest) {
+		w4a->jm = NULL;
+		LIST_INSERT_HEAD(&_launchd_domain_waiters, w4a, le);
+	} else {
+		w4a->jm = jm;
+		LIST_INSERT_HEAD(&jm->attaches, w4a, le);
+	}
+	LIST_INSERT_HEAD(&waiter_port_hash[HASH_PORT(port)], w4a, port_hash_le);
+
+
+	(void)jobmgr_assumes_zero(jm, launchd_mport_notify_req(port, MACH_NOTIFY_DEAD_NAME));
+	return w4a;
 }
 
-job_t 
-machservice_job(struct machservice *ms)
+void
+waiting4attach_delete(jobmgr_t jm, struct waiting4attach *w4a)
 {
-	return ms->job;
+	jobmgr_log(jm, LOG_DEBUG, "Canceling dead-name notification for waiter port: 0x%x", w4a->port);
+
+	LIST_REMOVE(w4a, le);
+	LIST_REMOVE(w4a, port_hash_le);
+
+	mach_port_t previous = MACH_PORT_NULL;
+	(void)jobmgr_assumes_zero(jm, mach_port_request_notification(mach_task_self(), w4a->port, MACH_NOTIFY_DEAD_NAME, 0, MACH_PORT_NULL, MACH_MSG_TYPE_MOVE_SEND_ONCE, &previous));
+	if (previous) {
+		(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(previous));
+	}
+
+	jobmgr_assumes_zero(jm, launchd_mport_deallocate(w4a->port));
+	free(w4a);
 }
 
-bool
-machservice_hidden(struct machservice *ms)
+struct waiting4attach *
+waiting4attach_find(jobmgr_t jm, job_t j)
 {
-	return ms->hide;
+	char *name2use = (char *)j->label;
+	if (j->app) {
+		struct envitem *ei = NULL;
+		SLIST_FOREACH(ei, &j->env, sle) {
+			if (strcmp(ei->key, XPC_SERVICE_RENDEZVOUS_TOKEN) == 0) {
+				name2use = ei->value;
+				break;
+			}
+		}
+	}
+
+	struct waiting4attach *w4ai = NULL;
+	LIST_FOREACH(w4ai, &jm->attaches, le) {
+		if (strcmp(name2use, w4ai->name) == 0) {
+			job_log(j, LOG_DEBUG, "Found attachment: %s", name2use);
+			break;
+		}
+	}
+
+	return w4ai;
 }
 
-bool
-machservice_active(struct machservice *ms)
+void
+job_logv(job_t j, int pri, int err, const char *msg, va_list ap)
 {
-	return ms->isActive;
+	const char *label2use = j ? j->label : "com.apple.launchd.job-unknown";
+	const char *mgr2use = j ? j->mgr->name : "com.apple.launchd.jobmanager-unknown";
+	char *newmsg;
+	int oldmask = 0;
+	size_t newmsgsz;
+
+	struct launchd_syslog_attr attr = {
+		.from_name = launchd_label,
+		.about_name = label2use,
+		.session_name = mgr2use,
+		.priority = pri,
+		.from_uid = getuid(),
+		.from_pid = getpid(),
+		.about_pid = j ? j->p : 0,
+	};
+
+	/* Hack: If bootstrap_port is set, we must be on the child side of a
+	 * fork(2), but before the exec*(3). Let's route the log message back to
+	 * launchd proper.
+	 */
+	if (bootstrap_port) {
+		return _vproc_logv(pri, err, msg, ap);
+	}
+
+	newmsgsz = strlen(msg) + 200;
+	newmsg = alloca(newmsgsz);
+
+	if (err) {
+#if !TARGET_OS_EMBEDDED
+		snprintf(newmsg, newmsgsz, "%s: %d: %s", msg, err, strerror(err));
+#else
+		snprintf(newmsg, newmsgsz, "(%s) %s: %d: %s", label2use, msg, err, strerror(err));
+#endif
+	} else {
+#if !TARGET_OS_EMBEDDED
+		snprintf(newmsg, newmsgsz, "%s", msg);
+#else
+		snprintf(newmsg, newmsgsz, "(%s) %s", label2use, msg);
+#endif
+	}
+
+	if (j && unlikely(j->debug)) {
+		oldmask = setlogmask(LOG_UPTO(LOG_DEBUG));
+	}
+
+	launchd_vsyslog(&attr, newmsg, ap);
+
+	if (j && unlikely(j->debug)) {
+		setlogmask(oldmask);
+	}
 }
 
-const char *
-machservice_name(struct machservice *ms)
+void
+job_log_error(job_t j, int pri, const char *msg, ...)
 {
-	return ms->name;
+	va_list ap;
+
+	va_start(ap, msg);
+	job_logv(j, pri, errno, msg, ap);
+	va_end(ap);
 }
 
 void
-machservice_drain_port(struct machservice *ms)
+job_log(job_t j, int pri, const char *msg, ...)
 {
-	bool drain_one = ms->drain_one_on_crash;
-	bool drain_all = ms->drain_all_on_crash;
-
-	if (!job_assumes(ms->job, (drain_one || drain_all) == true)) {
-		return;
-	}
+	va_list ap;
 
-	job_log(ms->job, LOG_INFO, "Draining %s...", ms->name);
+	va_start(ap, msg);
+	job_logv(j, pri, 0, msg, ap);
+	va_end(ap);
+}
 
-	char req_buff[sizeof(union __RequestUnion__catch_mach_exc_subsystem) * 2];
-	char rep_buff[sizeof(union __ReplyUnion__catch_mach_exc_subsystem)];
-	mig_reply_error_t *req_hdr = (mig_reply_error_t *)&req_buff;
-	mig_reply_error_t *rep_hdr = (mig_reply_error_t *)&rep_buff;
+#if 0
+void
+jobmgr_log_error(jobmgr_t jm, int pri, const char *msg, ...)
+{
+	va_list ap;
 
-	mach_msg_return_t mr = ~MACH_MSG_SUCCESS;
+	va_start(ap, msg);
+	jobmgr_logv(jm, pri, errno, msg, ap);
+	va_end(ap);
+}
+#endif
 
-	do {
+void
+jobmgr_log_perf_statistics(jobmgr_t jm, bool signal_children)
+{
+#if HAVE_SYSTEMSTATS
+	// Log information for kernel_task and pid 1 launchd.
+	if (systemstats_is_enabled() && pid1_magic && jm == root_jobmgr) {
+#if SYSTEMSTATS_API_VERSION >= 20130328
+		if (_systemstats_get_property(SYSTEMSTATS_API_VERSION, SYSTEMSTATS_WRITER_launchd, SYSTEMSTATS_PROPERTY_SHOULD_LOG_ENERGY_STATISTICS)) {
+			systemstats_write_intel_energy_statistics(NULL);
+		}
+#else
+		systemstats_write_intel_energy_statistics(NULL);
+#endif
+		job_log_systemstats(0, 0, 0, 0, 0, "com.apple.kernel", NULL, -1);
+		job_log_systemstats(1, 1, 0, 1, 1, "com.apple.launchd", NULL, -1);
+	}
+#endif
+	jobmgr_t jmi = NULL;
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		jobmgr_log_perf_statistics(jmi, signal_children);
+	}
+
+	if (jm->xpc_singleton) {
+		jobmgr_log(jm, LOG_PERF, "XPC Singleton Domain: %s", jm->shortdesc);
+	} else if (jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
+		jobmgr_log(jm, LOG_PERF, "XPC Private Domain: %s", jm->owner);
+	} else if (jm->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET) {
+		jobmgr_log(jm, LOG_PERF, "Created via bootstrap_subset()");
+	}
+
+	jobmgr_log(jm, LOG_PERF, "Jobs in job manager:");
+
+	job_t ji = NULL;
+	LIST_FOREACH(ji, &jm->jobs, sle) {
+		job_log_perf_statistics(ji, NULL, -1);
+		if (unlikely(signal_children) && unlikely(strstr(ji->label, "com.apple.launchd.peruser.") == ji->label)) {
+			jobmgr_log(jm, LOG_PERF, "Sending SIGINFO to peruser launchd %d", ji->p);
+			kill(ji->p, SIGINFO);
+		}
+	}
+
+	jobmgr_log(jm, LOG_PERF, "End of job list.");
+}
+
+void
+jobmgr_log(jobmgr_t jm, int pri, const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	jobmgr_logv(jm, pri, 0, msg, ap);
+	va_end(ap);
+}
+
+void
+jobmgr_logv(jobmgr_t jm, int pri, int err, const char *msg, va_list ap)
+{
+	if (!jm) {
+		jm = root_jobmgr;
+	}
+
+	char *newmsg;
+	char *newname;
+	size_t i, o, jmname_len = strlen(jm->name), newmsgsz;
+
+	newname = alloca((jmname_len + 1) * 2);
+	newmsgsz = (jmname_len + 1) * 2 + strlen(msg) + 100;
+	newmsg = alloca(newmsgsz);
+
+	for (i = 0, o = 0; i < jmname_len; i++, o++) {
+		if (jm->name[i] == '%') {
+			newname[o] = '%';
+			o++;
+		}
+		newname[o] = jm->name[i];
+	}
+	newname[o] = '\0';
+
+	if (err) {
+		snprintf(newmsg, newmsgsz, "%s: %s: %s", newname, msg, strerror(err));
+	} else {
+		snprintf(newmsg, newmsgsz, "%s: %s", newname, msg);
+	}
+
+	if (jm->parentmgr) {
+		jobmgr_logv(jm->parentmgr, pri, 0, newmsg, ap);
+	} else {
+		struct launchd_syslog_attr attr = {
+			.from_name = launchd_label,
+			.about_name = launchd_label,
+			.session_name = jm->name,
+			.priority = pri,
+			.from_uid = getuid(),
+			.from_pid = getpid(),
+			.about_pid = getpid(),
+		};
+
+		launchd_vsyslog(&attr, newmsg, ap);
+	}
+}
+
+struct cal_dict_walk {
+	job_t j;
+	struct tm tmptm;
+};
+
+void
+calendarinterval_new_from_obj_dict_walk(launch_data_t obj, const char *key, void *context)
+{
+	struct cal_dict_walk *cdw = context;
+	struct tm *tmptm = &cdw->tmptm;
+	job_t j = cdw->j;
+	int64_t val;
+
+	if (unlikely(LAUNCH_DATA_INTEGER != launch_data_get_type(obj))) {
+		// hack to let caller know something went wrong
+		tmptm->tm_sec = -1;
+		return;
+	}
+
+	val = launch_data_get_integer(obj);
+
+	if (val < 0) {
+		job_log(j, LOG_WARNING, "The interval for key \"%s\" is less than zero.", key);
+	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_MINUTE) == 0) {
+		if (val > 59) {
+			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 0 and 59 (inclusive).", key);
+			tmptm->tm_sec = -1;
+		} else {
+			tmptm->tm_min = (typeof(tmptm->tm_min)) val;
+		}
+	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_HOUR) == 0) {
+		if (val > 23) {
+			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 0 and 23 (inclusive).", key);
+			tmptm->tm_sec = -1;
+		} else {
+			tmptm->tm_hour = (typeof(tmptm->tm_hour)) val;
+		}
+	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_DAY) == 0) {
+		if (val < 1 || val > 31) {
+			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 1 and 31 (inclusive).", key);
+			tmptm->tm_sec = -1;
+		} else {
+			tmptm->tm_mday = (typeof(tmptm->tm_mday)) val;
+		}
+	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_WEEKDAY) == 0) {
+		if (val > 7) {
+			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 0 and 7 (inclusive).", key);
+			tmptm->tm_sec = -1;
+		} else {
+			tmptm->tm_wday = (typeof(tmptm->tm_wday)) val;
+		}
+	} else if (strcasecmp(key, LAUNCH_JOBKEY_CAL_MONTH) == 0) {
+		if (val > 12) {
+			job_log(j, LOG_WARNING, "The interval for key \"%s\" is not between 0 and 12 (inclusive).", key);
+			tmptm->tm_sec = -1;
+		} else {
+			tmptm->tm_mon = (typeof(tmptm->tm_mon)) val;
+			tmptm->tm_mon -= 1; // 4798263 cron compatibility
+		}
+	}
+}
+
+bool
+calendarinterval_new_from_obj(job_t j, launch_data_t obj)
+{
+	struct cal_dict_walk cdw;
+
+	cdw.j = j;
+	memset(&cdw.tmptm, 0, sizeof(0));
+
+	cdw.tmptm.tm_min = -1;
+	cdw.tmptm.tm_hour = -1;
+	cdw.tmptm.tm_mday = -1;
+	cdw.tmptm.tm_wday = -1;
+	cdw.tmptm.tm_mon = -1;
+
+	if (!job_assumes(j, obj != NULL)) {
+		return false;
+	}
+
+	if (unlikely(LAUNCH_DATA_DICTIONARY != launch_data_get_type(obj))) {
+		return false;
+	}
+
+	launch_data_dict_iterate(obj, calendarinterval_new_from_obj_dict_walk, &cdw);
+
+	if (unlikely(cdw.tmptm.tm_sec == -1)) {
+		return false;
+	}
+
+	return calendarinterval_new(j, &cdw.tmptm);
+}
+
+bool
+calendarinterval_new(job_t j, struct tm *w)
+{
+	struct calendarinterval *ci = calloc(1, sizeof(struct calendarinterval));
+
+	if (!job_assumes(j, ci != NULL)) {
+		return false;
+	}
+
+	ci->when = *w;
+	ci->job = j;
+
+	SLIST_INSERT_HEAD(&j->cal_intervals, ci, sle);
+
+	calendarinterval_setalarm(j, ci);
+
+	runtime_add_weak_ref();
+
+	return true;
+}
+
+void
+calendarinterval_delete(job_t j, struct calendarinterval *ci)
+{
+	SLIST_REMOVE(&j->cal_intervals, ci, calendarinterval, sle);
+	LIST_REMOVE(ci, global_sle);
+
+	free(ci);
+
+	runtime_del_weak_ref();
+}
+
+void
+calendarinterval_sanity_check(void)
+{
+	struct calendarinterval *ci = LIST_FIRST(&sorted_calendar_events);
+	time_t now = time(NULL);
+
+	if (unlikely(ci && (ci->when_next < now))) {
+		(void)jobmgr_assumes_zero_p(root_jobmgr, raise(SIGUSR1));
+	}
+}
+
+void
+calendarinterval_callback(void)
+{
+	struct calendarinterval *ci, *ci_next;
+	time_t now = time(NULL);
+
+	LIST_FOREACH_SAFE(ci, &sorted_calendar_events, global_sle, ci_next) {
+		job_t j = ci->job;
+
+		if (ci->when_next > now) {
+			break;
+		}
+
+		LIST_REMOVE(ci, global_sle);
+		calendarinterval_setalarm(j, ci);
+
+		j->start_pending = true;
+		job_dispatch(j, false);
+	}
+}
+
+bool
+socketgroup_new(job_t j, const char *name, int *fds, size_t fd_cnt)
+{
+	struct socketgroup *sg = calloc(1, sizeof(struct socketgroup) + strlen(name) + 1);
+
+	if (!job_assumes(j, sg != NULL)) {
+		return false;
+	}
+
+	sg->fds = calloc(1, fd_cnt * sizeof(int));
+	sg->fd_cnt = fd_cnt;
+
+	if (!job_assumes(j, sg->fds != NULL)) {
+		free(sg);
+		return false;
+	}
+
+	memcpy(sg->fds, fds, fd_cnt * sizeof(int));
+	strcpy(sg->name_init, name);
+
+	SLIST_INSERT_HEAD(&j->sockets, sg, sle);
+	job_checkin_reply_invalidate(j);
+
+	runtime_add_weak_ref();
+
+	return true;
+}
+
+void
+socketgroup_delete(job_t j, struct socketgroup *sg)
+{
+	unsigned int i;
+
+	for (i = 0; i < sg->fd_cnt; i++) {
+#if 0
+		struct sockaddr_storage ss;
+		struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+		socklen_t ss_len = sizeof(ss);
+
+		// 5480306
+		if (job_assumes_zero(j, getsockname(sg->fds[i], (struct sockaddr *)&ss, &ss_len) != -1)
+				&& job_assumes(j, ss_len > 0) && (ss.ss_family == AF_UNIX)) {
+			(void)job_assumes(j, unlink(sun->sun_path) != -1);
+			// We might conditionally need to delete a directory here
+		}
+#endif
+		(void)job_assumes_zero_p(j, runtime_close(sg->fds[i]));
+	}
+
+	SLIST_REMOVE(&j->sockets, sg, socketgroup, sle);
+	job_checkin_reply_invalidate(j);
+
+	free(sg->fds);
+	free(sg);
+
+	runtime_del_weak_ref();
+}
+
+void
+socketgroup_kevent_mod(job_t j, struct socketgroup *sg, bool do_add)
+{
+	struct kevent kev[sg->fd_cnt];
+	char buf[10000];
+	unsigned int i, buf_off = 0;
+
+	for (i = 0; i < sg->fd_cnt; i++) {
+		EV_SET(&kev[i], sg->fds[i], EVFILT_READ, do_add ? EV_ADD : EV_DELETE, 0, 0, j);
+		buf_off += snprintf(buf + buf_off, sizeof(buf) - buf_off, " %d", sg->fds[i]);
+	}
+
+	job_log(j, LOG_DEBUG, "%s Sockets:%s", do_add ? "Watching" : "Ignoring", buf);
+
+	(void)job_assumes_zero_p(j, kevent_bulk_mod(kev, sg->fd_cnt));
+
+	for (i = 0; i < sg->fd_cnt; i++) {
+		(void)job_assumes(j, kev[i].flags & EV_ERROR);
+		errno = (typeof(errno)) kev[i].data;
+		(void)job_assumes_zero(j, kev[i].data);
+	}
+}
+
+void
+socketgroup_ignore(job_t j, struct socketgroup *sg)
+{
+	socketgroup_kevent_mod(j, sg, false);
+}
+
+void
+socketgroup_watch(job_t j, struct socketgroup *sg)
+{
+	socketgroup_kevent_mod(j, sg, true);
+}
+
+void
+socketgroup_callback(job_t j)
+{
+	job_dispatch(j, true);
+}
+
+bool
+envitem_new(job_t j, const char *k, const char *v, bool global)
+{
+	if (global && !launchd_allow_global_dyld_envvars) {
+		if (strncmp("DYLD_", k, sizeof("DYLD_") - 1) == 0) {
+			job_log(j, LOG_ERR, "Ignoring global environment variable submitted by job (variable=value): %s=%s", k, v);
+			return false;
+		}
+	}
+
+	struct envitem *ei = calloc(1, sizeof(struct envitem) + strlen(k) + 1 + strlen(v) + 1);
+
+	if (!job_assumes(j, ei != NULL)) {
+		return false;
+	}
+
+	strcpy(ei->key_init, k);
+	ei->value = ei->key_init + strlen(k) + 1;
+	strcpy(ei->value, v);
+
+	if (global) {
+		if (SLIST_EMPTY(&j->global_env)) {
+			LIST_INSERT_HEAD(&j->mgr->global_env_jobs, j, global_env_sle);
+		}
+		SLIST_INSERT_HEAD(&j->global_env, ei, sle);
+		s_global_env_gen++;
+	} else {
+		SLIST_INSERT_HEAD(&j->env, ei, sle);
+	}
+
+	job_log(j, LOG_DEBUG, "Added environmental variable: %s=%s", k, v);
+
+	return true;
+}
+
+void
+envitem_delete(job_t j, struct envitem *ei, bool global)
+{
+	if (global) {
+		SLIST_REMOVE(&j->global_env, ei, envitem, sle);
+		if (SLIST_EMPTY(&j->global_env)) {
+			LIST_REMOVE(j, global_env_sle);
+		}
+		s_global_env_gen++;
+	} else {
+		SLIST_REMOVE(&j->env, ei, envitem, sle);
+	}
+
+	free(ei);
+}
+
+void
+envitem_setup(launch_data_t obj, const char *key, void *context)
+{
+	job_t j = context;
+
+	if (launch_data_get_type(obj) != LAUNCH_DATA_STRING) {
+		return;
+	}
+
+	if (strncmp(LAUNCHD_TRUSTED_FD_ENV, key, sizeof(LAUNCHD_TRUSTED_FD_ENV) - 1) != 0) {
+		envitem_new(j, key, launch_data_get_string(obj), j->importing_global_env);
+	} else {
+		job_log(j, LOG_DEBUG, "Ignoring reserved environmental variable: %s", key);
+	}
+}
+
+bool
+limititem_update(job_t j, int w, rlim_t r)
+{
+	struct limititem *li;
+
+	SLIST_FOREACH(li, &j->limits, sle) {
+		if (li->which == w) {
+			break;
+		}
+	}
+
+	if (li == NULL) {
+		li = calloc(1, sizeof(struct limititem));
+
+		if (!job_assumes(j, li != NULL)) {
+			return false;
+		}
+
+		SLIST_INSERT_HEAD(&j->limits, li, sle);
+
+		li->which = w;
+	}
+
+	if (j->importing_hard_limits) {
+		li->lim.rlim_max = r;
+		li->sethard = true;
+	} else {
+		li->lim.rlim_cur = r;
+		li->setsoft = true;
+	}
+
+	return true;
+}
+
+void
+limititem_delete(job_t j, struct limititem *li)
+{
+	SLIST_REMOVE(&j->limits, li, limititem, sle);
+
+	free(li);
+}
+
+#if HAVE_SANDBOX
+void
+seatbelt_setup_flags(launch_data_t obj, const char *key, void *context)
+{
+	job_t j = context;
+
+	if (launch_data_get_type(obj) != LAUNCH_DATA_BOOL) {
+		job_log(j, LOG_WARNING, "Sandbox flag value must be boolean: %s", key);
+		return;
+	}
+
+	if (launch_data_get_bool(obj) == false) {
+		return;
+	}
+
+	if (strcasecmp(key, LAUNCH_JOBKEY_SANDBOX_NAMED) == 0) {
+		j->seatbelt_flags |= SANDBOX_NAMED;
+	}
+}
+#endif
+
+void
+limititem_setup(launch_data_t obj, const char *key, void *context)
+{
+	job_t j = context;
+	size_t i, limits_cnt = (sizeof(launchd_keys2limits) / sizeof(launchd_keys2limits[0]));
+	rlim_t rl;
+
+	if (launch_data_get_type(obj) != LAUNCH_DATA_INTEGER) {
+		return;
+	}
+
+	rl = launch_data_get_integer(obj);
+
+	for (i = 0; i < limits_cnt; i++) {
+		if (strcasecmp(launchd_keys2limits[i].key, key) == 0) {
+			break;
+		}
+	}
+
+	if (i == limits_cnt) {
+		return;
+	}
+
+	limititem_update(j, launchd_keys2limits[i].val, rl);
+}
+
+bool
+job_useless(job_t j)
+{
+	if ((j->legacy_LS_job || j->only_once) && j->start_time != 0) {
+		if (j->legacy_LS_job && j->j_port) {
+			return false;
+		}
+		job_log(j, LOG_INFO, "Exited. Was only configured to run once.");
+		return true;
+	} else if (j->removal_pending) {
+		job_log(j, LOG_DEBUG, "Exited while removal was pending.");
+		return true;
+	} else if (j->shutdown_monitor) {
+		return false;
+	} else if (j->mgr->shutting_down && !j->mgr->parentmgr) {
+		job_log(j, LOG_DEBUG, "Exited while shutdown in progress. Processes remaining: %lu/%lu", total_children, total_anon_children);
+		if (total_children == 0 && !j->anonymous) {
+			job_log(j, LOG_DEBUG | LOG_CONSOLE, "Job was last to exit during shutdown of: %s.", j->mgr->name);
+		}
+		return true;
+	} else if (j->legacy_mach_job) {
+		if (SLIST_EMPTY(&j->machservices)) {
+			job_log(j, LOG_INFO, "Garbage collecting");
+			return true;
+		} else if (!j->checkedin) {
+			job_log(j, LOG_WARNING, "Failed to check-in!");
+			return true;
+		}
+	} else {
+		/* If the job's executable does not have any valid architectures (for
+		 * example, if it's a PowerPC-only job), then we don't even bother
+		 * trying to relaunch it, as we have no reasonable expectation that
+		 * the situation will change.
+		 *
+		 * <rdar://problem/9106979>
+		 */
+		if (!j->did_exec && WEXITSTATUS(j->last_exit_status) == EBADARCH) {
+			job_log(j, LOG_ERR, "Job executable does not contain supported architectures. Unloading it. Its plist should be removed.");
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool
+job_keepalive(job_t j)
+{
+	mach_msg_type_number_t statusCnt;
+	mach_port_status_t status;
+	struct semaphoreitem *si;
+	struct machservice *ms;
+	bool good_exit = (WIFEXITED(j->last_exit_status) && WEXITSTATUS(j->last_exit_status) == 0);
+	bool is_not_kextd = (launchd_apple_internal || (strcmp(j->label, "com.apple.kextd") != 0));
+
+	if (unlikely(j->mgr->shutting_down)) {
+		return false;
+	}
+
+	/*
+	 * 5066316
+	 *
+	 * We definitely need to revisit this after Leopard ships. Please see
+	 * launchctl.c for the other half of this hack.
+	 */
+	if (unlikely((j->mgr->global_on_demand_cnt > 0) && is_not_kextd)) {
+		return false;
+	}
+
+	if (unlikely(j->needs_kickoff)) {
+		job_log(j, LOG_DEBUG, "KeepAlive check: Job needs to be kicked off on-demand before KeepAlive sets in.");
+		return false;
+	}
+
+	if (j->start_pending) {
+		job_log(j, LOG_DEBUG, "KeepAlive check: Pent-up non-IPC launch criteria.");
+		return true;
+	}
+
+	if (!j->ondemand) {
+		job_log(j, LOG_DEBUG, "KeepAlive check: job configured to run continuously.");
+		return true;
+	}
+
+	SLIST_FOREACH(ms, &j->machservices, sle) {
+		statusCnt = MACH_PORT_RECEIVE_STATUS_COUNT;
+		if (mach_port_get_attributes(mach_task_self(), ms->port, MACH_PORT_RECEIVE_STATUS,
+					(mach_port_info_t)&status, &statusCnt) != KERN_SUCCESS) {
+			continue;
+		}
+		if (status.mps_msgcount) {
+			job_log(j, LOG_DEBUG, "KeepAlive check: %d queued Mach messages on service: %s",
+					status.mps_msgcount, ms->name);
+			return true;
+		}
+	}
+
+	/* TODO: Coalesce external events and semaphore items, since they're basically
+	 * the same thing.
+	 */
+	struct externalevent *ei = NULL;
+	LIST_FOREACH(ei, &j->events, job_le) {
+		if (ei->state == ei->wanted_state) {
+			return true;
+		}
+	}
+
+	SLIST_FOREACH(si, &j->semaphores, sle) {
+		bool wanted_state = false;
+		job_t other_j;
+
+		switch (si->why) {
+		case NETWORK_UP:
+			wanted_state = true;
+		case NETWORK_DOWN:
+			if (network_up == wanted_state) {
+				job_log(j, LOG_DEBUG, "KeepAlive: The network is %s.", wanted_state ? "up" : "down");
+				return true;
+			}
+			break;
+		case SUCCESSFUL_EXIT:
+			wanted_state = true;
+		case FAILED_EXIT:
+			if (good_exit == wanted_state) {
+				job_log(j, LOG_DEBUG, "KeepAlive: The exit state was %s.", wanted_state ? "successful" : "failure");
+				return true;
+			}
+			break;
+		case CRASHED:
+			wanted_state = true;
+		case DID_NOT_CRASH:
+			if (j->crashed == wanted_state) {
+				return true;
+			}
+			break;
+		case OTHER_JOB_ENABLED:
+			wanted_state = true;
+		case OTHER_JOB_DISABLED:
+			if ((bool)job_find(NULL, si->what) == wanted_state) {
+				job_log(j, LOG_DEBUG, "KeepAlive: The following job is %s: %s", wanted_state ? "enabled" : "disabled", si->what);
+				return true;
+			}
+			break;
+		case OTHER_JOB_ACTIVE:
+			wanted_state = true;
+		case OTHER_JOB_INACTIVE:
+			if ((other_j = job_find(NULL, si->what))) {
+				if ((bool)other_j->p == wanted_state) {
+					job_log(j, LOG_DEBUG, "KeepAlive: The following job is %s: %s", wanted_state ? "active" : "inactive", si->what);
+					return true;
+				}
+			}
+			break;
+		}
+	}
+
+	return false;
+}
+
+const char *
+job_active(job_t j)
+{
+	if (j->p && j->shutdown_monitor) {
+		return "Monitoring shutdown";
+	}
+	if (j->p) {
+		return "PID is still valid";
+	}
+
+	if (j->priv_port_has_senders) {
+		return "Privileged Port still has outstanding senders";
+	}
+
+	struct machservice *ms;
+	SLIST_FOREACH(ms, &j->machservices, sle) {
+		/* If we've simulated an exit, we mark the job as non-active, even
+		 * though doing so will leave it in an unsafe state. We do this so that
+		 * shutdown can proceed. See <rdar://problem/11126530>.
+		 */
+		if (!j->workaround9359725 && ms->recv && machservice_active(ms)) {
+			job_log(j, LOG_INFO, "Mach service is still active: %s", ms->name);
+			return "Mach service is still active";
+		}
+	}
+
+	return NULL;
+}
+
+void
+machservice_watch(job_t j, struct machservice *ms)
+{
+	if (ms->recv) {
+		if (job_assumes_zero(j, runtime_add_mport(ms->port, NULL)) == KERN_INVALID_RIGHT) {
+			ms->recv_race_hack = true;
+		}
+	}
+}
+
+void
+machservice_ignore(job_t j, struct machservice *ms)
+{
+	/* We only add ports whose receive rights we control into the port set, so
+	 * don't attempt to remove te service from the port set if we didn't put it
+	 * there in the first place. Otherwise, we could wind up trying to access a
+	 * bogus index (like MACH_PORT_DEAD) or zeroing a valid one out.
+	 *
+	 * <rdar://problem/10898014>
+	 */
+	if (ms->recv) {
+		(void)job_assumes_zero(j, runtime_remove_mport(ms->port));
+	}
+}
+
+void
+machservice_resetport(job_t j, struct machservice *ms)
+{
+	LIST_REMOVE(ms, port_hash_sle);
+	(void)job_assumes_zero(j, launchd_mport_close_recv(ms->port));
+	(void)job_assumes_zero(j, launchd_mport_deallocate(ms->port));
+
+	ms->gen_num++;
+	(void)job_assumes_zero(j, launchd_mport_create_recv(&ms->port));
+	(void)job_assumes_zero(j, launchd_mport_make_send(ms->port));
+	LIST_INSERT_HEAD(&port_hash[HASH_PORT(ms->port)], ms, port_hash_sle);
+}
+
+void
+machservice_stamp_port(job_t j, struct machservice *ms)
+{
+	mach_port_context_t ctx = 0;
+	char *where2get = j->prog ? j->prog : j->argv[0];
+
+	char *prog = NULL;
+	if ((prog = strrchr(where2get, '/'))) {
+		prog++;
+	} else {
+		prog = where2get;
+	}
+
+	(void)strncpy((char *)&ctx, prog, sizeof(ctx));
+#if __LITTLE_ENDIAN__
+#if __LP64__
+	ctx = OSSwapBigToHostInt64(ctx);
+#else
+	ctx = OSSwapBigToHostInt32(ctx);
+#endif
+#endif
+
+	(void)job_assumes_zero(j, mach_port_set_context(mach_task_self(), ms->port, ctx));
+}
+
+struct machservice *
+machservice_new(job_t j, const char *name, mach_port_t *serviceport, bool pid_local)
+{
+	/* Don't create new MachServices for dead ports. This is primarily for
+	 * clients who use bootstrap_register2(). They can pass in a send right, but
+	 * then that port can immediately go dead. Hilarity ensues.
+	 *
+	 * <rdar://problem/10898014>
+	 */
+	if (*serviceport == MACH_PORT_DEAD) {
+		return NULL;
+	}
+
+	struct machservice *ms = calloc(1, sizeof(struct machservice) + strlen(name) + 1);
+	if (!job_assumes(j, ms != NULL)) {
+		return NULL;
+	}
+
+	strcpy((char *)ms->name, name);
+	ms->job = j;
+	ms->gen_num = 1;
+	ms->per_pid = pid_local;
+
+	if (likely(*serviceport == MACH_PORT_NULL)) {
+		if (job_assumes_zero(j, launchd_mport_create_recv(&ms->port)) != KERN_SUCCESS) {
+			goto out_bad;
+		}
+
+		if (job_assumes_zero(j, launchd_mport_make_send(ms->port)) != KERN_SUCCESS) {
+			goto out_bad2;
+		}
+		*serviceport = ms->port;
+		ms->recv = true;
+	} else {
+		ms->port = *serviceport;
+		ms->isActive = true;
+	}
+
+	SLIST_INSERT_HEAD(&j->machservices, ms, sle);
+	job_checkin_reply_invalidate(j);
+
+	jobmgr_t where2put = j->mgr;
+	// XPC domains are separate from Mach bootstraps.
+	if (!(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
+		if (launchd_flat_mach_namespace && !(j->mgr->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET)) {
+			where2put = root_jobmgr;
+		}
+	}
+
+	/* Don't allow MachServices added by multiple-instance jobs to be looked up
+	 * by others. We could just do this with a simple bit, but then we'd have to
+	 * uniquify the names ourselves to avoid collisions. This is just easier.
+	 */
+	if (!j->dedicated_instance) {
+		machservice_hash_insert(where2put, ms);
+	}
+	LIST_INSERT_HEAD(&port_hash[HASH_PORT(ms->port)], ms, port_hash_sle);
+	if (ms->per_pid && j->p) {
+		machservice_pid_index(ms, j->p);
+	}
+
+	if (ms->recv) {
+		machservice_stamp_port(j, ms);
+	}
+
+	job_log(j, LOG_DEBUG, "Mach service added%s: %s", (j->mgr->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET) ? " to private namespace" : "", name);
+
+	return ms;
+out_bad2:
+	(void)job_assumes_zero(j, launchd_mport_close_recv(ms->port));
+out_bad:
+	free(ms);
+	return NULL;
+}
+
+struct machservice *
+machservice_new_alias(job_t j, struct machservice *orig)
+{
+	struct machservice *ms = calloc(1, sizeof(struct machservice) + strlen(orig->name) + 1);
+	if (job_assumes(j, ms != NULL)) {
+		strcpy((char *)ms->name, orig->name);
+		ms->alias = orig;
+		ms->job = j;
+
+		machservice_hash_insert(j->mgr, ms);
+		SLIST_INSERT_HEAD(&j->machservices, ms, sle);
+		jobmgr_log(j->mgr, LOG_DEBUG, "Service aliased into job manager: %s", orig->name);
+	}
+
+	return ms;
+}
+
+void
+machservice_hash_insert(jobmgr_t jm, struct machservice *ms)
+{
+	LIST_INSERT_HEAD(&jm->ms_hash[hash_ms(ms->name)], ms, name_hash_sle);
+
+	// Per-PID services are never enumerated, so keep them out of the directory.
+	if (!ms->per_pid) {
+		jobmgr_service_directory_insert(jm, ms);
+	}
+}
+
+void
+machservice_hash_remove(struct machservice *ms)
+{
+	LIST_REMOVE(ms, name_hash_sle);
+	jobmgr_service_directory_remove(ms);
+}
+
+void
+jobmgr_service_directory_insert(jobmgr_t jm, struct machservice *ms)
+{
+	if (jm->ms_dir_cnt == jm->ms_dir_sz) {
+		size_t sz = jm->ms_dir_sz ? jm->ms_dir_sz * 2 : 64;
+		struct machservice **dir = realloc(jm->ms_dir, sz * sizeof(jm->ms_dir[0]));
+		if (!jobmgr_assumes(jm, dir != NULL)) {
+			return;
+		}
+
+		jm->ms_dir = dir;
+		jm->ms_dir_sz = sz;
+	}
+
+	size_t i = jobmgr_service_directory_find(jm, ms->name, machservice_owner_name(ms));
+	memmove(&jm->ms_dir[i + 1], &jm->ms_dir[i], (jm->ms_dir_cnt - i) * sizeof(jm->ms_dir[0]));
+	jm->ms_dir[i] = ms;
+	jm->ms_dir_cnt++;
+	ms->dir_mgr = jm;
+}
+
+void
+jobmgr_service_directory_remove(struct machservice *ms)
+{
+	jobmgr_t jm = ms->dir_mgr;
+
+	if (!jm) {
+		return;
+	}
+
+	size_t i = jobmgr_service_directory_find(jm, ms->name, NULL);
+	while (i < jm->ms_dir_cnt && jm->ms_dir[i] != ms) {
+		i++;
+	}
+
+	if (jobmgr_assumes(jm, i < jm->ms_dir_cnt)) {
+		jm->ms_dir_cnt--;
+		memmove(&jm->ms_dir[i], &jm->ms_dir[i + 1], (jm->ms_dir_cnt - i) * sizeof(jm->ms_dir[0]));
+	}
+	ms->dir_mgr = NULL;
+}
+
+void
+machservice_pid_index(struct machservice *ms, pid_t p)
+{
+	machservice_pid_unindex(ms);
+
+	LIST_INSERT_HEAD(&per_pid_hash[HASH_PER_PID(p, ms->name)], ms, pid_hash_sle);
+	ms->pid_hash_p = p;
+}
+
+void
+job_per_pid_services_index(job_t j)
+{
+	struct machservice *ms;
+
+	SLIST_FOREACH(ms, &j->machservices, sle) {
+		if (ms->per_pid) {
+			machservice_pid_index(ms, j->p);
+		}
+	}
+}
+
+/* Called when the job's process has gone away. Per-PID services registered
+ * with a send right die with the process, so we drop them all here in one pass
+ * rather than waiting for a dead-name notification per port, each of which
+ * walks every job manager. Services whose receive right we own stick around
+ * for the next instance and are simply pulled out of the index until then.
+ */
+void
+job_per_pid_services_release(job_t j)
+{
+	struct machservice *ms, *next_ms;
+	size_t cnt = 0;
+
+	SLIST_FOREACH_SAFE(ms, &j->machservices, sle, next_ms) {
+		if (!ms->per_pid) {
+			continue;
+		}
+
+		if (ms->recv) {
+			machservice_pid_unindex(ms);
+		} else {
+			machservice_delete(j, ms, false);
+			cnt++;
+		}
+	}
+
+	if (cnt) {
+		job_log(j, LOG_DEBUG, "Released %lu per-PID Mach service%s.", cnt, cnt == 1 ? "" : "s");
+	}
+}
+
+void
+machservice_pid_unindex(struct machservice *ms)
+{
+	if (ms->pid_hash_p) {
+		LIST_REMOVE(ms, pid_hash_sle);
+		ms->pid_hash_p = 0;
+	}
+}
+
+struct machservice *
+machservice_pid_lookup(jobmgr_t jm, pid_t p, const char *name)
+{
+	struct machservice *ms, *found = NULL;
+
+	LIST_FOREACH(ms, &per_pid_hash[HASH_PER_PID(p, name)], pid_hash_sle) {
+		if (ms->pid_hash_p != p || strcmp(name, ms->name) != 0) {
+			continue;
+		}
+
+		// Prefer the given bootstrap, just like the PID lookup used to.
+		if (ms->job->mgr == jm) {
+			return ms;
+		}
+
+		found = ms;
+	}
+
+	/* If the PID has a job in the given bootstrap, that job is the one being
+	 * asked about, even if some other bootstrap's job for the same PID has a
+	 * service by this name.
+	 */
+	if (found && jobmgr_find_by_pid(jm, p, false)) {
+		found = NULL;
+	}
+
+	return found;
+}
+
+bootstrap_status_t
+machservice_status(struct machservice *ms)
+{
+	ms = ms->alias ? ms->alias : ms;
+	if (ms->isActive) {
+		return BOOTSTRAP_STATUS_ACTIVE;
+	} else if (ms->job->ondemand) {
+		return BOOTSTRAP_STATUS_ON_DEMAND;
+	} else {
+		return BOOTSTRAP_STATUS_INACTIVE;
+	}
+}
+
+void
+job_setup_exception_port(job_t j, task_t target_task)
+{
+	struct machservice *ms;
+	thread_state_flavor_t f = 0;
+	mach_port_t exc_port = the_exception_server;
+
+	if (unlikely(j->alt_exc_handler)) {
+		/* Walking the parent chain for every spawn adds up for crash reporters
+		 * and per-app handlers, so hang on to the answer until the service
+		 * goes away.
+		 */
+		if (j->exc_handler_ms && j->exc_handler_gen == s_exc_handler_gen) {
+			ms = j->exc_handler_ms;
+		} else if ((ms = jobmgr_lookup_service(j->mgr, j->alt_exc_handler, true, 0))) {
+			ms->exc_handler_cached = true;
+			j->exc_handler_ms = ms;
+			j->exc_handler_gen = s_exc_handler_gen;
+		}
+
+		if (likely(ms)) {
+			exc_port = machservice_port(ms);
+		} else {
+			job_log(j, LOG_WARNING, "Falling back to default Mach exception handler. Could not find: %s", j->alt_exc_handler);
+		}
+	} else if (unlikely(j->internal_exc_handler)) {
+		exc_port = runtime_get_kernel_port();
+	} else if (unlikely(!exc_port)) {
+		return;
+	}
+
+#if defined (__ppc__) || defined(__ppc64__)
+	f = PPC_THREAD_STATE64;
+#elif defined(__i386__) || defined(__x86_64__)
+	f = x86_THREAD_STATE;
+#elif defined(__arm__)
+	f = ARM_THREAD_STATE;
+#else
+#error "unknown architecture"
+#endif
+
+	if (likely(target_task)) {
+		/* The task inherited our own exception ports, which are empty, so its
+		 * crashes already fall through to the host ports. If those point at the
+		 * same handler, there's nothing to set.
+		 */
+		if (the_host_exception_port != MACH_PORT_NULL && exc_port == the_host_exception_port) {
+			return;
+		}
+
+		kern_return_t kr = task_set_exception_ports(target_task, EXC_MASK_CRASH | EXC_MASK_GUARD | EXC_MASK_RESOURCE, exc_port, EXCEPTION_STATE_IDENTITY | MACH_EXCEPTION_CODES, f);
+		if (kr) {
+			if (kr != MACH_SEND_INVALID_DEST) {
+				(void)job_assumes_zero(j, kr);
+			} else {
+				job_log(j, LOG_WARNING, "Task died before exception port could be set.");
+			}
+		}
+	} else if (pid1_magic && the_exception_server) {
+		mach_port_t mhp = mach_host_self();
+		if (job_assumes_zero(j, host_set_exception_ports(mhp, EXC_MASK_CRASH | EXC_MASK_GUARD | EXC_MASK_RESOURCE, the_exception_server, EXCEPTION_STATE_IDENTITY | MACH_EXCEPTION_CODES, f)) == KERN_SUCCESS) {
+			the_host_exception_port = the_exception_server;
+		}
+		(void)job_assumes_zero(j, launchd_mport_deallocate(mhp));
+	}
+}
+
+void
+job_set_exception_port(job_t j, mach_port_t port)
+{
+	if (unlikely(!the_exception_server)) {
+		the_exception_server = port;
+		job_setup_exception_port(j, 0);
+	} else {
+		job_log(j, LOG_WARNING, "The exception server is already claimed!");
+	}
+}
+
+/* A job caught in a crash loop would otherwise log every crash on its own. The
+ * first crash in a window is logged right away; the rest are counted and
+ * reported together when the window closes.
+ */
+#define JOB_CRASH_COALESCE_WINDOW 60
+
+void
+job_log_crash(job_t j, int sig)
+{
+	if (j->crash_burst_start) {
+		uint64_t elapsed = runtime_get_nanoseconds_since(j->crash_burst_start) / NSEC_PER_SEC;
+
+		if (elapsed < JOB_CRASH_COALESCE_WINDOW) {
+			if (j->crash_burst_cnt++ == 0) {
+				(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->crash_burst_cnt, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, JOB_CRASH_COALESCE_WINDOW - elapsed, j));
+			}
+			j->crash_burst_sig = sig;
+			return;
+		}
+
+		if (j->crash_burst_cnt) {
+			(void)kevent_mod((uintptr_t)&j->crash_burst_cnt, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+		}
+		job_crash_burst_flush(j);
+	}
+
+	j->crash_burst_start = runtime_get_opaque_time();
+	job_log(j, LOG_WARNING, "Job appears to have crashed: %s", strsignal(sig));
+}
+
+void
+job_crash_burst_flush(job_t j)
+{
+	if (j->crash_burst_cnt) {
+		job_log(j, LOG_WARNING, "Job crashed %u more time%s within %u seconds. Last crash: %s", j->crash_burst_cnt, j->crash_burst_cnt == 1 ? "" : "s", JOB_CRASH_COALESCE_WINDOW, strsignal(j->crash_burst_sig));
+	}
+
+	j->crash_burst_cnt = 0;
+	j->crash_burst_start = 0;
+}
+
+void
+machservice_setup_options(launch_data_t obj, const char *key, void *context)
+{
+	struct machservice *ms = context;
+	mach_port_t mhp = mach_host_self();
+	int which_port;
+	bool b;
+
+	if (!job_assumes(ms->job, mhp != MACH_PORT_NULL)) {
+		return;
+	}
+
+	switch (launch_data_get_type(obj)) {
+	case LAUNCH_DATA_INTEGER:
+		which_port = (int)launch_data_get_integer(obj); // XXX we should bound check this...
+		if (strcasecmp(key, LAUNCH_JOBKEY_MACH_TASKSPECIALPORT) == 0) {
+			switch (which_port) {
+			case TASK_KERNEL_PORT:
+			case TASK_HOST_PORT:
+			case TASK_NAME_PORT:
+			case TASK_BOOTSTRAP_PORT:
+			/* I find it a little odd that zero isn't reserved in the header.
+			 * Normally Mach is fairly good about this convention...
+			 */
+			case 0:
+				job_log(ms->job, LOG_WARNING, "Tried to set a reserved task special port: %d", which_port);
+				break;
+			default:
+				ms->special_port_num = which_port;
+				SLIST_INSERT_HEAD(&special_ports, ms, special_port_sle);
+				break;
+			}
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_HOSTSPECIALPORT) == 0 && pid1_magic) {
+			if (which_port > HOST_MAX_SPECIAL_KERNEL_PORT) {
+				(void)job_assumes_zero(ms->job, (errno = host_set_special_port(mhp, which_port, ms->port)));
+			} else {
+				job_log(ms->job, LOG_WARNING, "Tried to set a reserved host special port: %d", which_port);
+			}
+		}
+	case LAUNCH_DATA_BOOL:
+		b = launch_data_get_bool(obj);
+		if (strcasecmp(key, LAUNCH_JOBKEY_MACH_ENTERKERNELDEBUGGERONCLOSE) == 0) {
+			ms->debug_on_close = b;
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_RESETATCLOSE) == 0) {
+			ms->reset = b;
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_HIDEUNTILCHECKIN) == 0) {
+			ms->hide = b;
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_EXCEPTIONSERVER) == 0) {
+			job_set_exception_port(ms->job, ms->port);
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_MACH_KUNCSERVER) == 0) {
+			ms->kUNCServer = b;
+			(void)job_assumes_zero(ms->job, host_set_UNDServer(mhp, ms->port));
+		}
+		break;
+	case LAUNCH_DATA_STRING:
+		if (strcasecmp(key, LAUNCH_JOBKEY_MACH_DRAINMESSAGESONCRASH) == 0) {
+			const char *option = launch_data_get_string(obj);
+			if (strcasecmp(option, "One") == 0) {
+				ms->drain_one_on_crash = true;
+			} else if (strcasecmp(option, "All") == 0) {
+				ms->drain_all_on_crash = true;
+			}
+		}
+		break;
+	case LAUNCH_DATA_DICTIONARY:
+		if (launch_data_dict_get_count(obj) == 0) {
+			job_set_exception_port(ms->job, ms->port);
+		}
+		break;
+	default:
+		break;
+	}
+
+	(void)job_assumes_zero(ms->job, launchd_mport_deallocate(mhp));
+}
+
+void
+machservice_setup(launch_data_t obj, const char *key, void *context)
+{
+	job_t j = context;
+	struct machservice *ms;
+	mach_port_t p = MACH_PORT_NULL;
+
+	if (unlikely(ms = jobmgr_lookup_service(j->mgr, key, false, 0))) {
+		job_log(j, LOG_WARNING, "Conflict with job: %s over Mach service: %s", ms->job->label, key);
+		return;
+	}
+
+	if (!job_assumes(j, (ms = machservice_new(j, key, &p, false)) != NULL)) {
+		return;
+	}
+
+	ms->isActive = false;
+	ms->upfront = true;
+
+	if (launch_data_get_type(obj) == LAUNCH_DATA_DICTIONARY) {
+		launch_data_dict_iterate(obj, machservice_setup_options, ms);
+	}
+
+	kern_return_t kr = mach_port_set_attributes(mach_task_self(), ms->port, MACH_PORT_TEMPOWNER, NULL, 0);
+	(void)job_assumes_zero(j, kr);
+}
+
+jobmgr_t
+jobmgr_do_garbage_collection(jobmgr_t jm)
+{
+	jobmgr_t jmi = NULL, jmn = NULL;
+	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
+		jobmgr_do_garbage_collection(jmi);
+	}
+
+	if (!jm->shutting_down) {
+		return jm;
+	}
+
+	if (SLIST_EMPTY(&jm->submgrs)) {
+		jobmgr_log(jm, LOG_DEBUG, "No submanagers left.");
+	} else {
+		jobmgr_log(jm, LOG_DEBUG, "Still have submanagers.");
+		SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+			jobmgr_log(jm, LOG_DEBUG, "Submanager: %s", jmi->name);
+		}
+	}
+
+	size_t actives = 0;
+	job_t ji = NULL, jn = NULL;
+	job_stop_group_begin(0, 0);
+	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
+		if (ji->anonymous) {
+			continue;
+		}
+
+		// Let the shutdown monitor be up until the very end.
+		if (ji->shutdown_monitor) {
+			continue;
+		}
+
+		/* On our first pass through, open a transaction for all the jobs that
+		 * need to be dirty at shutdown. We'll close these transactions once the
+		 * jobs that do not need to be dirty at shutdown have all exited.
+		 */
+		if (ji->dirty_at_shutdown && !jm->shutdown_jobs_dirtied) {
+			job_open_shutdown_transaction(ji);
+		}
+
+		const char *active = job_active(ji);
+		if (!active) {
+			job_remove(ji);
+		} else {
+			job_log(ji, LOG_DEBUG, "Job is active: %s", active);
+			job_stop(ji);
+
+			if (!ji->dirty_at_shutdown) {
+				actives++;
+			}
+
+			if (ji->clean_kill) {
+				job_log(ji, LOG_DEBUG, "Job was killed cleanly.");
+			} else {
+				job_log(ji, LOG_DEBUG, "Job was sent SIGTERM%s.", ji->sent_sigkill ? " and SIGKILL" : "");
+			}
+		}
+	}
+	job_stop_group_end();
+
+	jm->shutdown_jobs_dirtied = true;
+	if (actives == 0) {
+		if (!jm->shutdown_jobs_cleaned) {
+			/* Once all normal jobs have exited, we clean the dirty-at-shutdown
+			 * jobs and make them into normal jobs so that the above loop will
+			 * handle them appropriately.
+			 */
+			LIST_FOREACH(ji, &jm->jobs, sle) {
+				if (ji->anonymous) {
+					continue;
+				}
+
+				if (!job_active(ji)) {
+					continue;
+				}
+				
+				if (ji->shutdown_monitor) {
+					continue;
+				}
+
+				job_close_shutdown_transaction(ji);
+				actives++;
+			}
+
+			jm->shutdown_jobs_cleaned = true;
+		}
+
+		if (SLIST_EMPTY(&jm->submgrs) && actives == 0) {
+			/* We may be in a situation where the shutdown monitor is all that's
+			 * left, in which case we want to stop it. Like dirty-at-shutdown
+			 * jobs, we turn it back into a normal job so that the main loop
+			 * treats it appropriately.
+			 *
+			 * See:
+			 * <rdar://problem/10756306>
+			 * <rdar://problem/11034971>
+			 * <rdar://problem/11549541>
+			 */
+			if (jm->monitor_shutdown && _launchd_shutdown_monitor) {
+				/* The rest of shutdown has completed, so we can kill the shutdown
+				 * monitor now like it was any other job.
+				 */
+				_launchd_shutdown_monitor->shutdown_monitor = false;
+				
+				job_log(_launchd_shutdown_monitor, LOG_NOTICE | LOG_CONSOLE, "Stopping shutdown monitor.");
+				job_stop(_launchd_shutdown_monitor);
+				_launchd_shutdown_monitor = NULL;
+			} else {
+				jobmgr_log(jm, LOG_DEBUG, "Removing.");
+				jobmgr_remove(jm);
+				return NULL;
+			}
+		}
+	}
+
+	return jm;
+}
+
+void
+jobmgr_kill_stray_children(jobmgr_t jm, pid_t *p, size_t np)
+{
+	/* I maintain that stray processes should be at the mercy of launchd during
+	 * shutdown, but nevertheless, things like diskimages-helper can stick
+	 * around, and SIGKILLing them can result in data loss. So we send SIGTERM
+	 * to all the strays and don't wait for them to exit before moving on.
+	 * 
+	 * See rdar://problem/6562592
+	 */
+	size_t i = 0;
+	for (i = 0; i < np; i++) {
+		if (p[i] != 0) {
+			jobmgr_log(jm, LOG_DEBUG | LOG_CONSOLE, "Sending SIGTERM to PID %u and continuing...", p[i]);
+			(void)jobmgr_assumes_zero_p(jm, kill2(p[i], SIGTERM));
+		}
+	}
+}
+
+void
+jobmgr_log_stray_children(jobmgr_t jm, bool kill_strays)
+{
+	size_t kp_skipped = 0, len = sizeof(pid_t) * get_kern_max_proc();
+	pid_t *pids = NULL;
+	int i = 0, kp_cnt = 0;
+
+	if (likely(jm->parentmgr || !pid1_magic)) {
+		return;
+	}
+
+	if (!jobmgr_assumes(jm, (pids = malloc(len)) != NULL)) {
+		return;
+	}
+
+	runtime_ktrace0(RTKT_LAUNCHD_FINDING_ALL_STRAYS);
+
+	if (jobmgr_assumes_zero_p(jm, (kp_cnt = proc_listallpids(pids, len))) == -1) {
+		goto out;
+	}
+
+	pid_t *ps = (pid_t *)calloc(sizeof(pid_t), kp_cnt);
+	for (i = 0; i < kp_cnt; i++) {
+		struct proc_bsdshortinfo proc;
+		if (proc_pidinfo(pids[i], PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
+			if (errno != ESRCH) {
+				(void)jobmgr_assumes_zero(jm, errno);
+			}
+
+			kp_skipped++;
+			continue;
+		}
+
+		pid_t p_i = pids[i];
+		pid_t pp_i = proc.pbsi_ppid;
+		pid_t pg_i = proc.pbsi_pgid;
+		const char *z = (proc.pbsi_status == SZOMB) ? "zombie " : "";
+		const char *n = proc.pbsi_comm;
+
+		if (unlikely(p_i == 0 || p_i == 1)) {
+			kp_skipped++;
+			continue;
+		}
+
+		if (_launchd_shutdown_monitor && pp_i == _launchd_shutdown_monitor->p) {
+			kp_skipped++;
+			continue;
+		}
+
+		// We might have some jobs hanging around that we've decided to shut down in spite of.
+		job_t j = jobmgr_find_by_pid(jm, p_i, false);
+		if (!j || (j && j->anonymous)) {
+			jobmgr_log(jm, LOG_INFO | LOG_CONSOLE, "Stray %s%s at shutdown: PID %u PPID %u PGID %u %s", z, j ? "anonymous job" : "process", p_i, pp_i, pg_i, n);
+
+			int status = 0;
+			if (pp_i == getpid() && !jobmgr_assumes(jm, proc.pbsi_status != SZOMB)) {
+				if (jobmgr_assumes_zero(jm, waitpid(p_i, &status, WNOHANG)) == 0) {
+					jobmgr_log(jm, LOG_INFO | LOG_CONSOLE, "Unreaped zombie stray exited with status %i.", WEXITSTATUS(status));
+				}
+				kp_skipped++;
+			} else {
+				job_t leader = jobmgr_find_by_pid(jm, pg_i, false);
+				/* See rdar://problem/6745714. Some jobs have child processes that back kernel state,
+				 * so we don't want to terminate them. Long-term, I'd really like to provide shutdown
+				 * hints to the kernel along the way, so that it could shutdown certain subsystems when
+				 * their userspace emissaries go away, before the call to reboot(2).
+				 */
+				if (leader && leader->ignore_pg_at_shutdown) {
+					kp_skipped++;
+				} else {
+					ps[i] = p_i;
+				}
+			}
+		} else {
+			kp_skipped++;
+		}
+	}
+
+	if ((kp_cnt - kp_skipped > 0) && kill_strays) {
+		jobmgr_kill_stray_children(jm, ps, kp_cnt - kp_skipped);
+	}
+
+	free(ps);
+out:
+	free(pids);
+}
+
+jobmgr_t 
+jobmgr_parent(jobmgr_t jm)
+{
+	return jm->parentmgr;
+}
+
+void
+job_uncork_fork(job_t j)
+{
+	pid_t c = j->p;
+
+	job_log(j, LOG_DEBUG, "Uncorking the fork().");
+	/* this unblocks the child and avoids a race
+	 * between the above fork() and the kevent_mod() */
+	(void)job_assumes(j, write(j->fork_fd, &c, sizeof(c)) == sizeof(c));
+	(void)job_assumes_zero_p(j, runtime_close(j->fork_fd));
+	j->fork_fd = 0;
+}
+
+jobmgr_t 
+jobmgr_new(jobmgr_t jm, mach_port_t requestorport, mach_port_t transfer_port, bool sflag, const char *name, bool skip_init, mach_port_t asport)
+{
+	job_t bootstrapper = NULL;
+	jobmgr_t jmr;
+
+	__OS_COMPILETIME_ASSERT__(offsetof(struct jobmgr_s, kqjobmgr_callback) == 0);
+
+	if (unlikely(jm && requestorport == MACH_PORT_NULL)) {
+		jobmgr_log(jm, LOG_ERR, "Mach sub-bootstrap create request requires a requester port");
+		return NULL;
+	}
+
+	jmr = calloc(1, sizeof(struct jobmgr_s) + (name ? (strlen(name) + 1) : NAME_MAX + 1));
+
+	if (!jobmgr_assumes(jm, jmr != NULL)) {
+		return NULL;
+	}
+
+	if (jm == NULL) {
+		root_jobmgr = jmr;
+	}
+
+	jmr->kqjobmgr_callback = jobmgr_callback;
+	strcpy(jmr->name_init, name ? name : "Under construction");
+
+	jobmgr_set_req_port(jmr, requestorport);
+
+	if ((jmr->parentmgr = jm)) {
+		SLIST_INSERT_HEAD(&jm->submgrs, jmr, sle);
+	}
+
+	if (jm && jobmgr_assumes_zero(jmr, launchd_mport_notify_req(jmr->req_port, MACH_NOTIFY_DEAD_NAME)) != KERN_SUCCESS) {
+		goto out_bad;
+	}
+
+	if (transfer_port != MACH_PORT_NULL) {
+		(void)jobmgr_assumes(jmr, jm != NULL);
+		jmr->jm_port = transfer_port;
+	} else if (!jm && !pid1_magic) {
+		char *trusted_fd = getenv(LAUNCHD_TRUSTED_FD_ENV);
+		name_t service_buf;
+
+		snprintf(service_buf, sizeof(service_buf), "com.apple.launchd.peruser.%u", getuid());
+
+		if (jobmgr_assumes_zero(jmr, bootstrap_check_in(bootstrap_port, service_buf, &jmr->jm_port)) != 0) {
+			goto out_bad;
+		}
+
+		if (trusted_fd) {
+			int dfd, lfd = (int) strtol(trusted_fd, NULL, 10);
+
+			if ((dfd = dup(lfd)) >= 0) {
+				(void)jobmgr_assumes_zero_p(jmr, runtime_close(dfd));
+				(void)jobmgr_assumes_zero_p(jmr, runtime_close(lfd));
+			}
+
+			unsetenv(LAUNCHD_TRUSTED_FD_ENV);
+		}
+
+		// cut off the Libc cache, we don't want to deadlock against ourself
+		inherited_bootstrap_port = bootstrap_port;
+		bootstrap_port = MACH_PORT_NULL;
+		os_assert_zero(launchd_mport_notify_req(inherited_bootstrap_port, MACH_NOTIFY_DEAD_NAME));
+
+		// We set this explicitly as we start each child
+		os_assert_zero(launchd_set_bport(MACH_PORT_NULL));
+	} else if (jobmgr_assumes_zero(jmr, launchd_mport_create_recv(&jmr->jm_port)) != KERN_SUCCESS) {
+		goto out_bad;
+	}
+
+	if (!name) {
+		sprintf(jmr->name_init, "%u", MACH_PORT_INDEX(jmr->jm_port));
+	}
+	jobmgr_session_name_update(jmr);
+
+	if (!jm) {
+		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
+		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
+		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGUSR2, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
+		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGINFO, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
+		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(0, EVFILT_FS, EV_ADD, VQ_MOUNT|VQ_UNMOUNT|VQ_UPDATE, 0, jmr));
+	}
+
+	if (name && !skip_init) {
+		bootstrapper = jobmgr_init_session(jmr, name, sflag);
+	}
+
+	if (!bootstrapper || !bootstrapper->weird_bootstrap) {
+		if (jobmgr_assumes_zero(jmr, runtime_add_mport(jmr->jm_port, job_server)) != KERN_SUCCESS) {
+			goto out_bad;
+		}
+	}
+
+	jobmgr_log(jmr, LOG_DEBUG, "Created job manager%s%s", jm ? " with parent: " : ".", jm ? jm->name : "");
+
+	if (bootstrapper) {
+		bootstrapper->asport = asport;
+
+		jobmgr_log(jmr, LOG_DEBUG, "Bootstrapping new job manager with audit session %u", asport);
+		(void)jobmgr_assumes(jmr, job_dispatch(bootstrapper, true) != NULL);
+	} else {
+		jmr->req_asport = asport;
+	}
+
+	if (asport != MACH_PORT_NULL) {
+		(void)jobmgr_assumes_zero(jmr, launchd_mport_copy_send(asport));
+	}
+
+	if (jmr->parentmgr) {
+		runtime_add_weak_ref();
+	}
+
+	return jmr;
+
+out_bad:
+	if (jmr) {
+		jobmgr_remove(jmr);
+		if (jm == NULL) {
+			root_jobmgr = NULL;
+		}
+	}
+	return NULL;
+}
+
+jobmgr_t
+jobmgr_new_xpc_singleton_domain(jobmgr_t jm, name_t name)
+{
+	jobmgr_t new = NULL;
+
+	/* These job managers are basically singletons, so we use the root Mach
+	 * bootstrap port as their requestor ports so they'll never go away.
+	 */
+	mach_port_t req_port = root_jobmgr->jm_port;
+	if (jobmgr_assumes_zero(jm, launchd_mport_make_send(req_port)) == KERN_SUCCESS) {
+		new = jobmgr_new(root_jobmgr, req_port, MACH_PORT_NULL, false, name, true, MACH_PORT_NULL);
+		if (new) {
+			new->properties |= BOOTSTRAP_PROPERTY_XPC_SINGLETON;
+			new->properties |= BOOTSTRAP_PROPERTY_XPC_DOMAIN;
+			new->xpc_singleton = true;
+			jobmgr_session_name_update(new);
+		}
+	}
+
+	return new;
+}
+
+jobmgr_t
+jobmgr_find_xpc_per_user_domain(jobmgr_t jm, uid_t uid)
+{
+	jobmgr_t jmi = NULL;
+	LIST_FOREACH(jmi, &_s_xpc_user_domains, xpc_le) {
+		if (jmi->req_euid == uid) {
+			return jmi;
+		}
+	}
+
+	name_t name;
+	(void)snprintf(name, sizeof(name), "com.apple.xpc.domain.peruser.%u", uid);
+	jmi = jobmgr_new_xpc_singleton_domain(jm, name);
+	if (jobmgr_assumes(jm, jmi != NULL)) {
+		/* We need to create a per-user launchd for this UID if there isn't one
+		 * already so we can grab the bootstrap port.
+		 */
+		job_t puj = jobmgr_lookup_per_user_context_internal(NULL, uid, &jmi->req_bsport);
+		if (jobmgr_assumes(jmi, puj != NULL)) {
+			(void)jobmgr_assumes_zero(jmi, launchd_mport_copy_send(puj->asport));
+			(void)jobmgr_assumes_zero(jmi, launchd_mport_copy_send(jmi->req_bsport));
+			jmi->shortdesc = "per-user";
+			jmi->req_asport = puj->asport;
+			jmi->req_asid = puj->asid;
+			jmi->req_euid = uid;
+			jmi->req_egid = -1;
+
+			LIST_INSERT_HEAD(&_s_xpc_user_domains, jmi, xpc_le);
+		} else {
+			jobmgr_remove(jmi);
+		}
+	}
+
+	return jmi;
+}
+
+jobmgr_t
+jobmgr_find_xpc_per_session_domain(jobmgr_t jm, au_asid_t asid)
+{
+	jobmgr_t jmi = NULL;
+	LIST_FOREACH(jmi, &_s_xpc_session_domains, xpc_le) {
+		if (jmi->req_asid == asid) {
+			return jmi;
+		}
+	}
+
+	name_t name;
+	(void)snprintf(name, sizeof(name), "com.apple.xpc.domain.persession.%i", asid);
+	jmi = jobmgr_new_xpc_singleton_domain(jm, name);
+	if (jobmgr_assumes(jm, jmi != NULL)) {
+		(void)jobmgr_assumes_zero(jmi, launchd_mport_make_send(root_jobmgr->jm_port));
+		jmi->shortdesc = "per-session";
+		jmi->req_bsport = root_jobmgr->jm_port;
+		(void)jobmgr_assumes_zero(jmi, audit_session_port(asid, &jmi->req_asport));
+		jmi->req_asid = asid;
+		jmi->req_euid = -1;
+		jmi->req_egid = -1;
+
+		LIST_INSERT_HEAD(&_s_xpc_session_domains, jmi, xpc_le);
+	} else {
+		jobmgr_remove(jmi);
+	}
+
+	return jmi;
+}
+
+job_t
+jobmgr_init_session(jobmgr_t jm, const char *session_type, bool sflag)
+{
+	const char *bootstrap_tool[] = { "/bin/launchctl", "bootstrap", "-S", session_type, sflag ? "-s" : NULL, NULL };
+	char thelabel[1000];
+	job_t bootstrapper;
+
+	snprintf(thelabel, sizeof(thelabel), "com.apple.launchctl.%s", session_type);
+	bootstrapper = job_new(jm, thelabel, NULL, bootstrap_tool);
+
+	if (jobmgr_assumes(jm, bootstrapper != NULL) && (jm->parentmgr || !pid1_magic)) {
+		bootstrapper->is_bootstrapper = true;
+		char buf[100];
+
+		// <rdar://problem/5042202> launchd-201: can't ssh in with AFP OD account (hangs)
+		snprintf(buf, sizeof(buf), "0x%X:0:0", getuid());
+		envitem_new(bootstrapper, "__CF_USER_TEXT_ENCODING", buf, false);
+		bootstrapper->weird_bootstrap = true;
+		(void)jobmgr_assumes(jm, job_setup_machport(bootstrapper));
+	} else if (bootstrapper && strncmp(session_type, VPROCMGR_SESSION_SYSTEM, sizeof(VPROCMGR_SESSION_SYSTEM)) == 0) {
+#if TARGET_OS_EMBEDDED
+		bootstrapper->psproctype = POSIX_SPAWN_PROC_TYPE_DAEMON_INTERACTIVE;
+#endif
+		bootstrapper->is_bootstrapper = true;
+		if (jobmgr_assumes(jm, pid1_magic)) {
+			// Have our system bootstrapper print out to the console.
+			bootstrapper->stdoutpath = strdup(_PATH_CONSOLE);
+			bootstrapper->stderrpath = strdup(_PATH_CONSOLE);
+
+			if (launchd_console) {
+				(void)jobmgr_assumes_zero_p(jm, kevent_mod((uintptr_t)fileno(launchd_console), EVFILT_VNODE, EV_ADD | EV_ONESHOT, NOTE_REVOKE, 0, jm));
+			}
+		}
+	}
+
+	jm->session_initialized = true;
+	return bootstrapper;
+}
+
+void
+jobmgr_set_req_port(jobmgr_t jm, mach_port_t port)
+{
+	if (jm->req_port) {
+		LIST_REMOVE(jm, req_port_hash_sle);
+	}
+
+	jm->req_port = port;
+
+	if (port) {
+		LIST_INSERT_HEAD(&req_port_hash[HASH_PORT(port)], jm, req_port_hash_sle);
+	}
+}
+
+void
+jobmgr_session_name_update(jobmgr_t jm)
+{
+	jobmgr_t jmi;
+	bool eligible = false;
+
+	if (jm->session_name_hashed) {
+		LIST_REMOVE(jm, session_name_sle);
+		jm->session_name_hashed = false;
+	}
+
+	if (jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
+		eligible = false;
+	} else if (jm->parentmgr && jm->parentmgr == root_jobmgr) {
+		eligible = true;
+	} else if (pid1_magic && jm->parentmgr && jm->parentmgr->parentmgr == root_jobmgr
+		&& strcasecmp(jm->parentmgr->name, VPROCMGR_SESSION_BACKGROUND) == 0) {
+		eligible = !(jm->parentmgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN);
+	}
+
+	if (eligible) {
+		LIST_INSERT_HEAD(&session_name_hash[hash_session_name(jm->name)], jm, session_name_sle);
+		jm->session_name_hashed = true;
+	}
+
+	// Renaming a session to or from Background changes whether its children are reachable.
+	if (pid1_magic && jm->parentmgr == root_jobmgr) {
+		SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+			jobmgr_session_name_update(jmi);
+		}
+	}
+}
+
+jobmgr_t
+jobmgr_delete_anything_with_port(jobmgr_t jm, mach_port_t port)
+{
+	struct waiting4attach *w4ai, *w4an;
+	struct machservice *ms, *next_ms;
+	bool shutdown_self = false;
+	jobmgr_t jmi;
+
+	/* Mach ports, unlike Unix descriptors, are reference counted. In other
+	 * words, when some program hands us a second or subsequent send right to a
+	 * port we already have open, the Mach kernel gives us the same port number
+	 * back and increments an reference count associated with the port. This
+	 * This forces us, when discovering that a receive right at the other end
+	 * has been deleted, to find all of our objects that clients might have
+	 * handed the same send right to. Services, requestor ports and waiters are
+	 * all hashed by port so that we don't have to walk every job manager to
+	 * find them.
+	 */
+
+	if (port == inherited_bootstrap_port) {
+		(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(port));
+		inherited_bootstrap_port = MACH_PORT_NULL;
+
+		return jobmgr_shutdown(jm);
+	}
+
+	LIST_FOREACH_SAFE(ms, &port_hash[HASH_PORT(port)], port_hash_sle, next_ms) {
+		if (ms->port == port && !ms->recv) {
+			machservice_delete(ms->job, ms, true);
+		}
+	}
+
+	// Domain waiters are cleaned up when the process they wait on exits.
+	LIST_FOREACH_SAFE(w4ai, &waiter_port_hash[HASH_PORT(port)], port_hash_le, w4an) {
+		if (w4ai->port == port && w4ai->jm) {
+			waiting4attach_delete(w4ai->jm, w4ai);
+		}
+	}
+
+	/* Shutting a manager down can free others in the same bucket, so start
+	 * over after each one. Managers already on their way out are left alone.
+	 */
+	do {
+		LIST_FOREACH(jmi, &req_port_hash[HASH_PORT(port)], req_port_hash_sle) {
+			if (jmi->req_port == port && !jmi->shutting_down) {
+				if (jmi == jm) {
+					shutdown_self = true;
+					continue;
+				}
+				break;
+			}
+		}
+
+		if (jmi) {
+			jobmgr_log(jmi, LOG_DEBUG, "Request port died: %i", MACH_PORT_INDEX(port));
+			(void)jobmgr_shutdown(jmi);
+		}
+	} while (jmi);
+
+	if (shutdown_self) {
+		jobmgr_log(jm, LOG_DEBUG, "Request port died: %i", MACH_PORT_INDEX(port));
+		return jobmgr_shutdown(jm);
+	}
+
+	return jm;
+}
+
+struct machservice *
+jobmgr_lookup_service(jobmgr_t jm, const char *name, bool check_parent, pid_t target_pid)
+{
+	struct machservice *ms;
+
+	jobmgr_log(jm, LOG_DEBUG, "Looking up %sservice %s", target_pid ? "per-PID " : "", name);
+
+	if (target_pid) {
+		/* This is a hack to let FileSyncAgent look up per-PID Mach services from the Background
+		 * bootstrap in other bootstraps.
+		 */
+
+		// Start in the given bootstrap.
+		if ((ms = machservice_pid_lookup(jm, target_pid, name))) {
+			return ms;
+		}
+		if (unlikely(jm->subset_import)) {
+			jobmgr_subset_import_step(jm, SIZE_MAX);
+			return jobmgr_lookup_service(jm, name, check_parent, target_pid);
+		}
+
+		jobmgr_log(jm, LOG_DEBUG, "Didn't find per-PID Mach service for PID %i: %s", target_pid, name);
+		return NULL;
+	}
+
+	jobmgr_t where2look = jm;
+	// XPC domains are separate from Mach bootstraps.
+	if (!(jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
+		if (launchd_flat_mach_namespace && !(jm->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET)) {
+			where2look = root_jobmgr;
+		}
+	}
+
+	LIST_FOREACH(ms, &where2look->ms_hash[hash_ms(name)], name_hash_sle) {
+		if (!ms->per_pid && strcmp(name, ms->name) == 0) {
+			return ms;
+		}
+	}
+
+	if (unlikely(where2look->subset_import)) {
+		jobmgr_subset_import_step(where2look, SIZE_MAX);
+		return jobmgr_lookup_service(jm, name, check_parent, 0);
+	}
+
+	if (jm->parentmgr == NULL || !check_parent) {
+		return NULL;
+	}
+
+	return jobmgr_lookup_service(jm->parentmgr, name, true, 0);
+}
+
+mach_port_t
+machservice_port(struct machservice *ms)
+{
+	return ms->port;
+}
+
+job_t 
+machservice_job(struct machservice *ms)
+{
+	return ms->job;
+}
+
+bool
+machservice_hidden(struct machservice *ms)
+{
+	return ms->hide;
+}
+
+bool
+machservice_active(struct machservice *ms)
+{
+	return ms->isActive;
+}
+
+const char *
+machservice_name(struct machservice *ms)
+{
+	return ms->name;
+}
+
+// The job name that service listings show for the service.
+const char *
+machservice_owner_name(struct machservice *ms)
+{
+	ms = ms->alias ? ms->alias : ms;
+	return ms->job->mgr->shortdesc ? ms->job->mgr->shortdesc : ms->job->label;
+}
+
+void
+machservice_drain_port(struct machservice *ms)
+{
+	bool drain_one = ms->drain_one_on_crash;
+	bool drain_all = ms->drain_all_on_crash;
+
+	if (!job_assumes(ms->job, (drain_one || drain_all) == true)) {
+		return;
+	}
+
+	job_log(ms->job, LOG_INFO, "Draining %s...", ms->name);
+
+	char req_buff[sizeof(union __RequestUnion__catch_mach_exc_subsystem) * 2];
+	char rep_buff[sizeof(union __ReplyUnion__catch_mach_exc_subsystem)];
+	mig_reply_error_t *req_hdr = (mig_reply_error_t *)&req_buff;
+	mig_reply_error_t *rep_hdr = (mig_reply_error_t *)&rep_buff;
+
+	mach_msg_return_t mr = ~MACH_MSG_SUCCESS;
+
+	do {
 		/* This should be a direct check on the Mach service to see if it's an exception-handling
 		 * port, and it will break things if ReportCrash or SafetyNet start advertising other
 		 * Mach services. But for now, it should be okay.
 		 */
-		if (ms->job->alt_exc_handler || ms->job->internal_exc_handler) {
-			mr = launchd_exc_runtime_once(ms->port, sizeof(req_buff), sizeof(rep_buff), req_hdr, rep_hdr, 0);
+		if (ms->job->alt_exc_handler || ms->job->internal_exc_handler) {
+			mr = launchd_exc_runtime_once(ms->port, sizeof(req_buff), sizeof(rep_buff), req_hdr, rep_hdr, 0);
+		} else {
+			mach_msg_options_t options =	MACH_RCV_MSG		|
+											MACH_RCV_TIMEOUT	;
+
+			mr = mach_msg((mach_msg_header_t *)req_hdr, options, 0, sizeof(req_buff), ms->port, 0, MACH_PORT_NULL);
+			switch (mr) {
+			case MACH_MSG_SUCCESS:
+				mach_msg_destroy((mach_msg_header_t *)req_hdr);
+				break;
+			case MACH_RCV_TIMED_OUT:
+				break;
+			case MACH_RCV_TOO_LARGE:
+				launchd_syslog(LOG_WARNING, "Tried to receive message that was larger than %lu bytes", sizeof(req_buff));
+				break;
+			default:
+				break;
+			}
+		}
+	} while (drain_all && mr != MACH_RCV_TIMED_OUT);
+}
+
+void
+machservice_delete(job_t j, struct machservice *ms, bool port_died)
+{
+	if (ms->exc_handler_cached) {
+		s_exc_handler_gen++;
+	}
+
+	if (ms->alias) {
+		/* HACK: Egregious code duplication. But dealing with aliases is a
+		 * pretty simple affair since they can't and shouldn't have any complex
+		 * behaviors associated with them.
+		 */
+		machservice_hash_remove(ms);
+		machservice_pid_unindex(ms);
+		SLIST_REMOVE(&j->machservices, ms, machservice, sle);
+		free(ms);
+		return;
+	}
+
+	if (unlikely(ms->debug_on_close)) {
+		job_log(j, LOG_NOTICE, "About to enter kernel debugger because of Mach port: 0x%x", ms->port);
+		(void)job_assumes_zero(j, host_reboot(mach_host_self(), HOST_REBOOT_DEBUGGER));
+	}
+
+	if (ms->recv && job_assumes(j, !machservice_active(ms))) {
+		job_log(j, LOG_DEBUG, "Closing receive right for %s", ms->name);
+		(void)job_assumes_zero(j, launchd_mport_close_recv(ms->port));
+	}
+
+	(void)job_assumes_zero(j, launchd_mport_deallocate(ms->port));
+
+	if (unlikely(ms->port == the_exception_server)) {
+		the_exception_server = 0;
+	}
+	if (unlikely(ms->port == the_host_exception_port)) {
+		// The name may be reused, so stop trusting the host ports.
+		the_host_exception_port = MACH_PORT_NULL;
+	}
+
+	job_log(j, LOG_DEBUG, "Mach service deleted%s: %s", port_died ? " (port died)" : "", ms->name);
+
+	if (ms->special_port_num) {
+		SLIST_REMOVE(&special_ports, ms, machservice, special_port_sle);
+	}
+	SLIST_REMOVE(&j->machservices, ms, machservice, sle);
+	job_checkin_reply_invalidate(j);
+
+	if (!(j->dedicated_instance || ms->event_channel)) {
+		machservice_hash_remove(ms);
+	}
+	LIST_REMOVE(ms, port_hash_sle);
+	machservice_pid_unindex(ms);
+
+	free(ms);
+}
+
+void
+machservice_request_notifications(struct machservice *ms)
+{
+	mach_msg_id_t which = MACH_NOTIFY_DEAD_NAME;
+
+	ms->isActive = true;
+
+	if (ms->recv) {
+		which = MACH_NOTIFY_PORT_DESTROYED;
+		job_checkin(ms->job);
+	}
+
+	(void)job_assumes_zero(ms->job, launchd_mport_notify_req(ms->port, which));
+	job_ready_check(ms->job);
+}
+
+#define NELEM(x) (sizeof(x)/sizeof(x[0]))
+#define END_OF(x) (&(x)[NELEM(x)])
+
+char **
+mach_cmd2argv(const char *string)
+{
+	char *argv[100], args[1000];
+	const char *cp;
+	char *argp = args, term, **argv_ret, *co;
+	unsigned int nargs = 0, i;
+
+	for (cp = string; *cp;) {
+		while (isspace(*cp))
+			cp++;
+		term = (*cp == '"') ? *cp++ : '\0';
+		if (nargs < NELEM(argv)) {
+			argv[nargs++] = argp;
+		}
+		while (*cp && (term ? *cp != term : !isspace(*cp)) && argp < END_OF(args)) {
+			if (*cp == '\\') {
+				cp++;
+			}
+			*argp++ = *cp;
+			if (*cp) {
+				cp++;
+			}
+		}
+		*argp++ = '\0';
+	}
+	argv[nargs] = NULL;
+
+	if (nargs == 0) {
+		return NULL;
+	}
+
+	argv_ret = malloc((nargs + 1) * sizeof(char *) + strlen(string) + 1);
+
+	if (!argv_ret) {
+		(void)os_assumes_zero(errno);
+		return NULL;
+	}
+
+	co = (char *)argv_ret + (nargs + 1) * sizeof(char *);
+
+	for (i = 0; i < nargs; i++) {
+		strcpy(co, argv[i]);
+		argv_ret[i] = co;
+		co += strlen(argv[i]) + 1;
+	}
+	argv_ret[i] = NULL;
+
+	return argv_ret;
+}
+
+void
+job_checkin(job_t j)
+{
+	j->checkedin = true;
+}
+
+void
+job_checkin_sockets(job_t j)
+{
+	job_checkin(j);
+	j->checkedin_sockets = true;
+	job_ready_check(j);
+}
+
+/* The subset of job_export() that a job needs at check-in time. This must not
+ * include anything that changes from one run to the next (PID, last exit
+ * status, etc.), since the packed result is cached across runs.
+ */
+launch_data_t
+job_export_checkin(job_t j)
+{
+	launch_data_t tmp, tmp2, tmp3, r = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+
+	if (r == NULL) {
+		return NULL;
+	}
+
+	if ((tmp = launch_data_new_string(j->label))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_LABEL);
+	}
+	if ((tmp = launch_data_new_integer(j->timeout))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_TIMEOUT);
+	}
+	if (j->prog && (tmp = launch_data_new_string(j->prog))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_PROGRAM);
+	}
+	if (j->stdoutpath && (tmp = launch_data_new_string(j->stdoutpath))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDOUTPATH);
+	}
+	if (j->stderrpath && (tmp = launch_data_new_string(j->stderrpath))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDERRORPATH);
+	}
+	if (j->session_create && (tmp = launch_data_new_bool(true))) {
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_SESSIONCREATE);
+	}
+
+	if (j->inetcompat && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		if ((tmp2 = launch_data_new_bool(j->inetcompat_wait))) {
+			launch_data_dict_insert(tmp, tmp2, LAUNCH_JOBINETDCOMPATIBILITY_WAIT);
+		}
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_INETDCOMPATIBILITY);
+	}
+
+	if (!SLIST_EMPTY(&j->sockets) && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		struct socketgroup *sg;
+		unsigned int i;
+
+		SLIST_FOREACH(sg, &j->sockets, sle) {
+			if ((tmp2 = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
+				for (i = 0; i < sg->fd_cnt; i++) {
+					if ((tmp3 = launch_data_new_fd(sg->fds[i]))) {
+						launch_data_array_set_index(tmp2, tmp3, i);
+					}
+				}
+				launch_data_dict_insert(tmp, tmp2, sg->name);
+			}
+		}
+
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_SOCKETS);
+	}
+
+	if (!SLIST_EMPTY(&j->machservices) && (tmp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		struct machservice *ms;
+
+		tmp3 = NULL;
+
+		SLIST_FOREACH(ms, &j->machservices, sle) {
+			if (ms->per_pid) {
+				if (tmp3 == NULL) {
+					tmp3 = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+				}
+				if (tmp3) {
+					tmp2 = launch_data_new_machport(MACH_PORT_NULL);
+					launch_data_dict_insert(tmp3, tmp2, ms->name);
+				}
+			} else {
+				tmp2 = launch_data_new_machport(MACH_PORT_NULL);
+				launch_data_dict_insert(tmp, tmp2, ms->name);
+			}
+		}
+
+		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_MACHSERVICES);
+
+		if (tmp3) {
+			launch_data_dict_insert(r, tmp3, LAUNCH_JOBKEY_PERJOBMACHSERVICES);
+		}
+	}
+
+	return r;
+}
+
+void
+job_checkin_reply_invalidate(job_t j)
+{
+	if (j->checkin_reply) {
+		free(j->checkin_reply->data);
+		free(j->checkin_reply);
+		j->checkin_reply = NULL;
+	}
+}
+
+bool
+job_get_checkin_reply(job_t j, const void **data, size_t *len, const int **fds, size_t *fd_cnt)
+{
+	struct job_checkin_reply *jcr = j->checkin_reply;
+
+	if (!jcr) {
+		size_t total_fds = 0, bufsz, n = 0;
+		launch_data_t ld;
+
+		if (!(ld = job_export_checkin(j))) {
+			return false;
+		}
+
+		bufsz = launch_data_packed_size(ld, &total_fds);
+		if (!job_assumes(j, (jcr = calloc(1, sizeof(*jcr) + total_fds * sizeof(int))) != NULL)) {
+			launch_data_free(ld);
+			return false;
+		}
+		if (!job_assumes(j, (jcr->data = malloc(bufsz)) != NULL)) {
+			launch_data_free(ld);
+			free(jcr);
+			return false;
+		}
+
+		jcr->len = launch_data_pack(ld, jcr->data, bufsz, jcr->fds, &n);
+		launch_data_free(ld);
+
+		if (!job_assumes(j, jcr->len == bufsz)) {
+			job_log(j, LOG_ERR, "Could not pack check-in reply.");
+			free(jcr->data);
+			free(jcr);
+			return false;
+		}
+
+		jcr->fd_cnt = n;
+		j->checkin_reply = jcr;
+	}
+
+	*data = jcr->data;
+	*len = jcr->len;
+	*fds = jcr->fds;
+	*fd_cnt = jcr->fd_cnt;
+
+	return true;
+}
+
+bool job_is_god(job_t j)
+{
+	return j->embedded_god;
+}
+
+bool
+job_ack_port_destruction(mach_port_t p)
+{
+	struct machservice *ms;
+	job_t j;
+
+	LIST_FOREACH(ms, &port_hash[HASH_PORT(p)], port_hash_sle) {
+		if (ms->recv && (ms->port == p)) {
+			break;
+		}
+	}
+
+	if (!ms) {
+		launchd_syslog(LOG_WARNING, "Could not find MachService to match receive right: 0x%x", p);
+		return false;
+	}
+
+	j = ms->job;
+
+	jobmgr_log(root_jobmgr, LOG_DEBUG, "Receive right returned to us: %s", ms->name);
+
+	/* Without being the exception handler, NOTE_EXIT is our only way to tell if
+	 * the job  crashed, and we can't rely on NOTE_EXIT always being processed
+	 * after all the job's receive rights have been returned.
+	 *
+	 * So when we get receive rights back, check to see if the job has been
+	 * reaped yet. If not, then we add this service to a list of services to be
+	 * drained on crash if it's requested that behavior. So, for a job with N
+	 * receive rights all requesting that they be drained on crash, we can
+	 * safely handle the following sequence of events.
+	 * 
+	 * ReceiveRight0Returned
+	 * ReceiveRight1Returned
+	 * ReceiveRight2Returned
+	 * NOTE_EXIT (reap, get exit status)
+	 * ReceiveRight3Returned
+	 * .
+	 * .
+	 * .
+	 * ReceiveRight(N - 1)Returned
+	 */
+	if (ms->drain_one_on_crash || ms->drain_all_on_crash) {
+		if (j->crashed && j->reaped) {
+			job_log(j, LOG_DEBUG, "Job has crashed. Draining port...");
+			machservice_drain_port(ms);
+		} else if (!(j->crashed || j->reaped)) {
+			job_log(j, LOG_DEBUG, "Job's exit status is still unknown. Deferring drain.");
+		}
+	}
+
+	ms->isActive = false;
+	if (ms->delete_on_destruction) {
+		machservice_delete(j, ms, false);
+	} else if (ms->reset) {
+		machservice_resetport(j, ms);
+	}
+
+	kern_return_t kr = mach_port_set_attributes(mach_task_self(), ms->port, MACH_PORT_TEMPOWNER, NULL, 0);
+	(void)job_assumes_zero(j, kr);
+	machservice_stamp_port(j, ms);
+	job_dispatch(j, false);
+
+	if (ms->recv_race_hack) {
+		ms->recv_race_hack = false;
+		machservice_watch(ms->job, ms);
+	}
+
+	root_jobmgr = jobmgr_do_garbage_collection(root_jobmgr);
+
+	return true;
+}
+
+void
+job_ack_no_senders(job_t j)
+{
+	j->priv_port_has_senders = false;
+
+	(void)job_assumes_zero(j, launchd_mport_close_recv(j->j_port));
+	j->j_port = 0;
+
+	job_log(j, LOG_DEBUG, "No more senders on privileged Mach bootstrap port");
+
+	job_dispatch(j, false);
+}
+
+bool
+semaphoreitem_new(job_t j, semaphore_reason_t why, const char *what)
+{
+	struct semaphoreitem *si;
+	size_t alloc_sz = sizeof(struct semaphoreitem);
+
+	if (what) {
+		alloc_sz += strlen(what) + 1;
+	}
+
+	if (job_assumes(j, si = calloc(1, alloc_sz)) == NULL) {
+		return false;
+	}
+
+	si->why = why;
+
+	if (what) {
+		strcpy(si->what_init, what);
+	}
+
+	SLIST_INSERT_HEAD(&j->semaphores, si, sle);
+
+	if ((why == OTHER_JOB_ENABLED || why == OTHER_JOB_DISABLED) && !j->nosy) {
+		job_log(j, LOG_DEBUG, "Job is interested in \"%s\".", what);
+		SLIST_INSERT_HEAD(&s_curious_jobs, j, curious_jobs_sle);
+		j->nosy = true;
+	}
+
+	semaphoreitem_runtime_mod_ref(si, true);
+
+	return true;
+}
+
+void
+semaphoreitem_runtime_mod_ref(struct semaphoreitem *si, bool add)
+{
+	/*
+	 * External events need to be tracked.
+	 * Internal events do NOT need to be tracked.
+	 */
+
+	switch (si->why) {
+	case SUCCESSFUL_EXIT:
+	case FAILED_EXIT:
+	case OTHER_JOB_ENABLED:
+	case OTHER_JOB_DISABLED:
+	case OTHER_JOB_ACTIVE:
+	case OTHER_JOB_INACTIVE:
+		return;
+	default:
+		break;
+	}
+
+	if (add) {
+		runtime_add_weak_ref();
+	} else {
+		runtime_del_weak_ref();
+	}
+}
+
+void
+semaphoreitem_delete(job_t j, struct semaphoreitem *si)
+{
+	semaphoreitem_runtime_mod_ref(si, false);
+
+	SLIST_REMOVE(&j->semaphores, si, semaphoreitem, sle);
+
+	// We'll need to rethink this if it ever becomes possible to dynamically add or remove semaphores.
+	if ((si->why == OTHER_JOB_ENABLED || si->why == OTHER_JOB_DISABLED) && j->nosy) {
+		j->nosy = false;
+		SLIST_REMOVE(&s_curious_jobs, j, job_s, curious_jobs_sle);
+	}
+
+	free(si);
+}
+
+void
+semaphoreitem_setup_dict_iter(launch_data_t obj, const char *key, void *context)
+{
+	struct semaphoreitem_dict_iter_context *sdic = context;
+	semaphore_reason_t why;
+
+	why = launch_data_get_bool(obj) ? sdic->why_true : sdic->why_false;
+
+	semaphoreitem_new(sdic->j, why, key);
+}
+
+void
+semaphoreitem_setup(launch_data_t obj, const char *key, void *context)
+{
+	struct semaphoreitem_dict_iter_context sdic = { context, 0, 0 };
+	job_t j = context;
+	semaphore_reason_t why;
+
+	switch (launch_data_get_type(obj)) {
+	case LAUNCH_DATA_BOOL:
+		if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_NETWORKSTATE) == 0) {
+			why = launch_data_get_bool(obj) ? NETWORK_UP : NETWORK_DOWN;
+			semaphoreitem_new(j, why, NULL);
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_SUCCESSFULEXIT) == 0) {
+			why = launch_data_get_bool(obj) ? SUCCESSFUL_EXIT : FAILED_EXIT;
+			semaphoreitem_new(j, why, NULL);
+			j->start_pending = true;
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_AFTERINITIALDEMAND) == 0) {
+			j->needs_kickoff = launch_data_get_bool(obj);
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_CRASHED) == 0) {
+			why = launch_data_get_bool(obj) ? CRASHED : DID_NOT_CRASH;
+			semaphoreitem_new(j, why, NULL);
+			j->start_pending = true;
+		} else {
+			job_log(j, LOG_ERR, "Unrecognized KeepAlive attribute: %s", key);
+		}
+		break;
+	case LAUNCH_DATA_DICTIONARY:
+		if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_OTHERJOBACTIVE) == 0) {
+			sdic.why_true = OTHER_JOB_ACTIVE;
+			sdic.why_false = OTHER_JOB_INACTIVE;
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_OTHERJOBENABLED) == 0) {
+			sdic.why_true = OTHER_JOB_ENABLED;
+			sdic.why_false = OTHER_JOB_DISABLED;
+		} else {
+			job_log(j, LOG_ERR, "Unrecognized KeepAlive attribute: %s", key);
+			break;
+		}
+
+		launch_data_dict_iterate(obj, semaphoreitem_setup_dict_iter, &sdic);
+		break;
+	default:
+		job_log(j, LOG_ERR, "Unrecognized KeepAlive type: %u", launch_data_get_type(obj));
+		break;
+	}
+}
+
+bool
+externalevent_new(job_t j, struct eventsystem *sys, const char *evname, xpc_object_t event, uint64_t flags)
+{
+	if (j->event_monitor) {
+		job_log(j, LOG_ERR, "The event monitor job cannot use LaunchEvents or XPC Events.");
+		return false;
+	}
+
+	struct externalevent *ee = (struct externalevent *)calloc(1, sizeof(struct externalevent) + strlen(evname) + 1);
+	if (!ee) {
+		return false;
+	}
+
+	ee->event = xpc_retain(event);
+	(void)strcpy(ee->name, evname);
+	ee->job = j;
+	ee->id = sys->curid;
+	ee->sys = sys;
+	ee->state = false;
+	ee->wanted_state = true;
+	sys->curid++;
+
+	if (flags & XPC_EVENT_FLAG_ENTITLEMENTS) {
+		struct ldcred *ldc = runtime_get_caller_creds();
+		if (ldc) {
+			ee->entitlements = xpc_copy_entitlements_for_pid(ldc->pid);
+		}
+	}
+
+	if (sys == _launchd_support_system) {
+		ee->internal = true;
+	}
+
+	LIST_INSERT_HEAD(&j->events, ee, job_le);
+	LIST_INSERT_HEAD(&sys->events, ee, sys_le);
+
+	job_log(j, LOG_DEBUG, "New event: %s/%s", sys->name, evname);
+
+	eventsystem_ping();
+	return true;
+}
+
+void
+externalevent_delete(struct externalevent *ee)
+{
+	xpc_release(ee->event);
+	if (ee->entitlements) {
+		xpc_release(ee->entitlements);
+	}
+	LIST_REMOVE(ee, job_le);
+	LIST_REMOVE(ee, sys_le);
+
+	free(ee);
+
+	eventsystem_ping();
+}
+
+void
+externalevent_setup(launch_data_t obj, const char *key, void *context)
+{
+	/* This method can ONLY be called on the job_import() path, as it assumes
+	 * the input is a launch_data_t.
+	 */
+	struct externalevent_iter_ctx *ctx = (struct externalevent_iter_ctx *)context;
+
+	xpc_object_t xobj = ld2xpc(obj);
+	if (xobj) {
+		job_log(ctx->j, LOG_DEBUG, "Importing stream/event: %s/%s", ctx->sys->name, key);
+		externalevent_new(ctx->j, ctx->sys, key, xobj, 0);
+		xpc_release(xobj);
+	} else {
+		job_log(ctx->j, LOG_ERR, "Could not import event for job: %s", key);
+	}
+}
+
+struct externalevent *
+externalevent_find(const char *sysname, uint64_t id)
+{
+	struct externalevent *ei = NULL;
+
+	struct eventsystem *es = eventsystem_find(sysname);
+	if (es != NULL) {
+		LIST_FOREACH(ei, &es->events, sys_le) {
+			if (ei->id == id) {
+				break;
+			}
+		}
+	} else {
+		launchd_syslog(LOG_ERR, "Could not find event system: %s", sysname);
+	}
+
+	return ei;
+}
+
+struct eventsystem *
+eventsystem_new(const char *name)
+{
+	struct eventsystem *es = (struct eventsystem *)calloc(1, sizeof(struct eventsystem) + strlen(name) + 1);
+	if (es != NULL) {
+		es->curid = 1;
+		(void)strcpy(es->name, name);
+		LIST_INSERT_HEAD(&_s_event_systems, es, global_le);
+	} else {
+		(void)os_assumes_zero(errno);
+	}
+
+	return es;
+}
+
+void
+eventsystem_delete(struct eventsystem *es)
+{
+	struct externalevent *ei = NULL;
+	while ((ei = LIST_FIRST(&es->events))) {
+		externalevent_delete(ei);
+	}
+
+	LIST_REMOVE(es, global_le);
+
+	free(es);
+}
+
+void
+eventsystem_setup(launch_data_t obj, const char *key, void *context)
+{
+	job_t j = (job_t)context;
+	if (!job_assumes(j, launch_data_get_type(obj) == LAUNCH_DATA_DICTIONARY)) {
+		return;
+	}
+
+	struct eventsystem *sys = eventsystem_find(key);
+	if (unlikely(sys == NULL)) {
+		sys = eventsystem_new(key);
+		job_log(j, LOG_DEBUG, "New event system: %s", key);
+	}
+
+	if (job_assumes(j, sys != NULL)) {
+		struct externalevent_iter_ctx ctx = {
+			.j = j,
+			.sys = sys,
+		};
+
+		job_log(j, LOG_DEBUG, "Importing events for stream: %s", key);
+		launch_data_dict_iterate(obj, externalevent_setup, &ctx);
+	}
+}
+
+struct eventsystem *
+eventsystem_find(const char *name)
+{
+	struct eventsystem *esi = NULL;
+	LIST_FOREACH(esi, &_s_event_systems, global_le) {
+		if (strcmp(name, esi->name) == 0) {
+			break;
+		}
+	}
+
+	return esi;
+}
+
+void
+eventsystem_ping(void)
+{
+	if (!_launchd_event_monitor) {
+		return;
+	}
+
+	if (!_launchd_event_monitor->p) {
+		(void)job_dispatch(_launchd_event_monitor, true);
+	} else {
+		if (_launchd_event_monitor->event_monitor_ready2signal) {
+			(void)job_assumes_zero_p(_launchd_event_monitor, kill(_launchd_event_monitor->p, SIGUSR1));
+		}
+	}
+}
+
+void
+jobmgr_dispatch_all_semaphores(jobmgr_t jm)
+{
+	jobmgr_t jmi, jmn;
+	job_t ji, jn;
+
+
+	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
+		jobmgr_dispatch_all_semaphores(jmi);
+	}
+
+	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
+		if (!SLIST_EMPTY(&ji->semaphores)) {
+			job_dispatch(ji, false);
+		}
+	}
+}
+
+time_t
+cronemu(int mon, int mday, int hour, int min)
+{
+	struct tm workingtm;
+	time_t now;
+
+	now = time(NULL);
+	workingtm = *localtime(&now);
+
+	workingtm.tm_isdst = -1;
+	workingtm.tm_sec = 0;
+	workingtm.tm_min++;
+
+	while (!cronemu_mon(&workingtm, mon, mday, hour, min)) {
+		workingtm.tm_year++;
+		workingtm.tm_mon = 0;
+		workingtm.tm_mday = 1;
+		workingtm.tm_hour = 0;
+		workingtm.tm_min = 0;
+		mktime(&workingtm);
+	}
+
+	return mktime(&workingtm);
+}
+
+time_t
+cronemu_wday(int wday, int hour, int min)
+{
+	struct tm workingtm;
+	time_t now;
+
+	now = time(NULL);
+	workingtm = *localtime(&now);
+
+	workingtm.tm_isdst = -1;
+	workingtm.tm_sec = 0;
+	workingtm.tm_min++;
+
+	if (wday == 7) {
+		wday = 0;
+	}
+
+	while (!(workingtm.tm_wday == wday && cronemu_hour(&workingtm, hour, min))) {
+		workingtm.tm_mday++;
+		workingtm.tm_hour = 0;
+		workingtm.tm_min = 0;
+		mktime(&workingtm);
+	}
+
+	return mktime(&workingtm);
+}
+
+bool
+cronemu_mon(struct tm *wtm, int mon, int mday, int hour, int min)
+{
+	if (mon == -1) {
+		struct tm workingtm = *wtm;
+		int carrytest;
+
+		while (!cronemu_mday(&workingtm, mday, hour, min)) {
+			workingtm.tm_mon++;
+			workingtm.tm_mday = 1;
+			workingtm.tm_hour = 0;
+			workingtm.tm_min = 0;
+			carrytest = workingtm.tm_mon;
+			mktime(&workingtm);
+			if (carrytest != workingtm.tm_mon) {
+				return false;
+			}
+		}
+		*wtm = workingtm;
+		return true;
+	}
+
+	if (mon < wtm->tm_mon) {
+		return false;
+	}
+
+	if (mon > wtm->tm_mon) {
+		wtm->tm_mon = mon;
+		wtm->tm_mday = 1;
+		wtm->tm_hour = 0;
+		wtm->tm_min = 0;
+	}
+
+	return cronemu_mday(wtm, mday, hour, min);
+}
+
+bool
+cronemu_mday(struct tm *wtm, int mday, int hour, int min)
+{
+	if (mday == -1) {
+		struct tm workingtm = *wtm;
+		int carrytest;
+
+		while (!cronemu_hour(&workingtm, hour, min)) {
+			workingtm.tm_mday++;
+			workingtm.tm_hour = 0;
+			workingtm.tm_min = 0;
+			carrytest = workingtm.tm_mday;
+			mktime(&workingtm);
+			if (carrytest != workingtm.tm_mday) {
+				return false;
+			}
+		}
+		*wtm = workingtm;
+		return true;
+	}
+
+	if (mday < wtm->tm_mday) {
+		return false;
+	}
+
+	if (mday > wtm->tm_mday) {
+		wtm->tm_mday = mday;
+		wtm->tm_hour = 0;
+		wtm->tm_min = 0;
+	}
+
+	return cronemu_hour(wtm, hour, min);
+}
+
+bool
+cronemu_hour(struct tm *wtm, int hour, int min)
+{
+	if (hour == -1) {
+		struct tm workingtm = *wtm;
+		int carrytest;
+
+		while (!cronemu_min(&workingtm, min)) {
+			workingtm.tm_hour++;
+			workingtm.tm_min = 0;
+			carrytest = workingtm.tm_hour;
+			mktime(&workingtm);
+			if (carrytest != workingtm.tm_hour) {
+				return false;
+			}
+		}
+		*wtm = workingtm;
+		return true;
+	}
+
+	if (hour < wtm->tm_hour) {
+		return false;
+	}
+
+	if (hour > wtm->tm_hour) {
+		wtm->tm_hour = hour;
+		wtm->tm_min = 0;
+	}
+
+	return cronemu_min(wtm, min);
+}
+
+bool
+cronemu_min(struct tm *wtm, int min)
+{
+	if (min == -1) {
+		return true;
+	}
+
+	if (min < wtm->tm_min) {
+		return false;
+	}
+
+	if (min > wtm->tm_min) {
+		wtm->tm_min = min;
+	}
+
+	return true;
+}
+
+kern_return_t
+job_mig_create_server(job_t j, cmd_t server_cmd, uid_t server_uid, boolean_t on_demand, mach_port_t *server_portp)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+	job_t js;
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (unlikely(j->deny_job_creation)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+#if HAVE_SANDBOX
+	const char **argv = (const char **)mach_cmd2argv(server_cmd);
+	if (unlikely(argv == NULL)) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_PATH, argv[0]) > 0)) {
+		free(argv);
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+	free(argv);
+#endif
+
+	job_log(j, LOG_DEBUG, "Server create attempt: %s", server_cmd);
+
+	if (pid1_magic) {
+		if (ldc->euid || ldc->uid) {
+			job_log(j, LOG_WARNING, "Server create attempt moved to per-user launchd: %s", server_cmd);
+			return VPROC_ERR_TRY_PER_USER;
+		}
+	} else {
+		if (unlikely(server_uid != getuid())) {
+			job_log(j, LOG_WARNING, "Server create: \"%s\": As UID %d, we will not be able to switch to UID %d",
+					server_cmd, getuid(), server_uid);
+		}
+		server_uid = 0; // zero means "do nothing"
+	}
+
+	js = job_new_via_mach_init(j, server_cmd, server_uid, on_demand);
+
+	if (unlikely(js == NULL)) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	*server_portp = js->j_port;
+	return BOOTSTRAP_SUCCESS;
+}
+
+kern_return_t
+job_mig_send_signal(job_t j, mach_port_t srp, name_t targetlabel, int sig)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+	job_t otherj;
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (unlikely(ldc->euid != 0 && ldc->euid != getuid()) || j->deny_job_creation) {
+#if TARGET_OS_EMBEDDED	
+		if (!j->embedded_god) {
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+#else
+		return BOOTSTRAP_NOT_PRIVILEGED;
+#endif
+	}
+
+#if HAVE_SANDBOX
+	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+#endif
+
+	if (unlikely(!(otherj = job_find(NULL, targetlabel)))) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
+	}
+
+#if TARGET_OS_EMBEDDED
+	if (j->embedded_god) {
+		if (j->username && otherj->username) {
+			if (strcmp(j->username, otherj->username) != 0) {
+				return BOOTSTRAP_NOT_PRIVILEGED;
+			}
+		} else {
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+	}
+#endif	
+
+	if (sig == VPROC_MAGIC_UNLOAD_SIGNAL) {
+		bool do_block = otherj->p;
+
+		if (otherj->anonymous) {
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+
+		job_remove(otherj);
+
+		if (do_block) {
+			job_log(j, LOG_DEBUG, "Blocking MIG return of job_remove(): %s", otherj->label);
+			// this is messy. We shouldn't access 'otherj' after job_remove(), but we check otherj->p first...
+			(void)job_assumes(otherj, waiting4removal_new(otherj, srp));
+			return MIG_NO_REPLY;
+		} else {
+			return 0;
+		}
+	} else if (otherj->p) {
+		(void)job_assumes_zero_p(j, kill2(otherj->p, sig));
+	}
+
+	return 0;
+}
+
+kern_return_t
+job_mig_log_forward(job_t j, vm_offset_t inval, mach_msg_type_number_t invalCnt)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (!job_assumes(j, j->per_user)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+	return launchd_log_forward(ldc->euid, ldc->egid, inval, invalCnt);
+}
+
+kern_return_t
+job_mig_log_drain(job_t j, mach_port_t srp, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (unlikely(ldc->euid)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+	return launchd_log_drain(srp, outval, outvalCnt);
+}
+
+kern_return_t
+job_mig_log_subscribe(job_t j, mach_port_t token, integer_t maxpri, pid_t pid, name_t prefix, name_t session, uint64_t *handle)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (unlikely(ldc->euid)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+	if (!MACH_PORT_VALID(token)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+	return launchd_log_subscribe(token, maxpri, pid, prefix, session, handle);
+}
+
+kern_return_t
+job_mig_log_read(job_t j, mach_port_t srp, uint64_t handle, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt, uint64_t *dropped)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (unlikely(ldc->euid)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+	return launchd_log_subscription_read(srp, handle, outval, outvalCnt, dropped);
+}
+
+kern_return_t
+job_mig_log_unsubscribe(job_t j, uint64_t handle)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (unlikely(ldc->euid)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+	return launchd_log_unsubscribe(handle);
+}
+
+kern_return_t
+job_mig_swap_complex(job_t j, mach_port_t srp, vproc_gsk_t inkey, vproc_gsk_t outkey,
+	vm_offset_t inval, mach_msg_type_number_t invalCnt, vm_offset_t *outval,
+	mach_msg_type_number_t *outvalCnt)
+{
+	const char *action;
+	launch_data_t input_obj = NULL, output_obj = NULL;
+	size_t data_offset = 0;
+	struct ldcred *ldc = runtime_get_caller_creds();
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (inkey && ldc->pid != j->p) {
+		if (ldc->euid && ldc->euid != getuid()) {
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+ 	}
+
+	if (unlikely(inkey && outkey && !job_assumes(j, inkey == outkey))) {
+		return 1;
+	}
+
+	if (inkey && outkey) {
+		action = "Swapping";
+	} else if (inkey) {
+		action = "Setting";
+	} else {
+		action = "Getting";
+	}
+
+	job_log(j, LOG_DEBUG, "%s key: %u", action, inkey ? inkey : outkey);
+
+	if (outkey == VPROC_GSK_ALLJOBS && !inkey) {
+		/* Snapshot the job list now, and build the reply on a worker thread
+		 * so that lookups aren't stuck behind us.
+		 */
+		struct job_export_all_ctx *ctx = job_export_all_snapshot(false);
+		if (!job_assumes(j, ctx != NULL)) {
+			mig_deallocate(inval, invalCnt);
+			return 1;
+		}
+
+		ctx->rp = srp;
+		dispatch_async_f(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ctx, job_export_all_async);
+		mig_deallocate(inval, invalCnt);
+		return MIG_NO_REPLY;
+	}
+
+	*outval = 0;
+	*outvalCnt = 0;
+
+	/* Note to future maintainers: launch_data_unpack() does NOT return a heap
+	 * object. The data is decoded in-place. So do not call launch_data_free()
+	 * on input_obj.
+	 */
+	runtime_ktrace0(RTKT_LAUNCHD_DATA_UNPACK);
+	if (unlikely(invalCnt && !job_assumes(j, (input_obj = launch_data_unpack((void *)inval, invalCnt, NULL, 0, &data_offset, NULL)) != NULL))) {
+		goto out_bad;
+	}
+
+	char *store = NULL;
+	switch (outkey) {
+	case VPROC_GSK_ENVIRONMENT:
+		if (!job_assumes(j, (output_obj = launch_data_alloc(LAUNCH_DATA_DICTIONARY)))) {
+			goto out_bad;
+		}
+		jobmgr_export_env_from_other_jobs(j->mgr, output_obj);
+		break;
+	case VPROC_GSK_ALLJOBS:
+		if (!job_assumes(j, (output_obj = job_export_all()) != NULL)) {
+			goto out_bad;
+		}
+		ipc_revoke_fds(output_obj);
+		break;
+	case VPROC_GSK_MGR_NAME:
+		if (!job_assumes(j, (output_obj = launch_data_new_string(j->mgr->name)) != NULL)) {
+			goto out_bad;
+		}
+		break;
+	case VPROC_GSK_JOB_OVERRIDES_DB:
+		store = launchd_copy_persistent_store(LAUNCHD_PERSISTENT_STORE_DB, "overrides.plist");
+		if (!store || !job_assumes(j, (output_obj = launch_data_new_string(store)) != NULL)) {
+			free(store);
+			goto out_bad;
+		}
+
+		free(store);
+		break;
+	case VPROC_GSK_ZERO:
+		break;
+	default:
+		goto out_bad;
+	}
+
+	if (output_obj) {
+		runtime_ktrace0(RTKT_LAUNCHD_DATA_PACK);
+		if (!job_assumes(j, launch_data_pack_mig(output_obj, outval, outvalCnt))) {
+			goto out_bad;
+		}
+		launch_data_free(output_obj);
+	}
+
+	mig_deallocate(inval, invalCnt);
+	return 0;
+
+out_bad:
+	mig_deallocate(inval, invalCnt);
+	if (*outval) {
+		mig_deallocate(*outval, *outvalCnt);
+	}
+	if (output_obj) {
+		launch_data_free(output_obj);
+	}
+
+	return 1;
+}
+
+kern_return_t
+job_mig_swap_integer(job_t j, vproc_gsk_t inkey, vproc_gsk_t outkey, int64_t inval, int64_t *outval)
+{
+	const char *action;
+	kern_return_t kr = 0;
+	struct ldcred *ldc = runtime_get_caller_creds();
+	int oldmask;
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (inkey && ldc->pid != j->p) {
+		if (ldc->euid && ldc->euid != getuid()) {
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+ 	}
+
+	if (unlikely(inkey && outkey && !job_assumes(j, inkey == outkey))) {
+		return 1;
+	}
+
+	if (inkey && outkey) {
+		action = "Swapping";
+	} else if (inkey) {
+		action = "Setting";
+	} else {
+		action = "Getting";
+	}
+
+	job_log(j, LOG_DEBUG, "%s key: %u", action, inkey ? inkey : outkey);
+
+	switch (outkey) {
+	case VPROC_GSK_ABANDON_PROCESS_GROUP:
+		*outval = j->abandon_pg;
+		break;
+	case VPROC_GSK_LAST_EXIT_STATUS:
+		*outval = j->last_exit_status;
+		break;
+	case VPROC_GSK_MGR_UID:
+		*outval = getuid();
+		break;
+	case VPROC_GSK_MGR_PID:
+		*outval = getpid();
+		break;
+	case VPROC_GSK_IS_MANAGED:
+		*outval = j->anonymous ? 0 : 1;
+		break;
+	case VPROC_GSK_BASIC_KEEPALIVE:
+		*outval = !j->ondemand;
+		break;
+	case VPROC_GSK_START_INTERVAL:
+		*outval = j->start_interval;
+		break;
+	case VPROC_GSK_IDLE_TIMEOUT:
+		*outval = j->timeout;
+		break;
+	case VPROC_GSK_EXIT_TIMEOUT:
+		*outval = j->exit_timeout;
+		break;
+	case VPROC_GSK_GLOBAL_LOG_MASK:
+		oldmask = runtime_setlogmask(LOG_UPTO(LOG_DEBUG));
+		*outval = oldmask;
+		runtime_setlogmask(oldmask);
+		break;
+	case VPROC_GSK_GLOBAL_UMASK:
+		oldmask = umask(0);
+		*outval = oldmask;
+		umask(oldmask);
+		break;
+	case VPROC_GSK_TRANSACTIONS_ENABLED:
+		job_log(j, LOG_DEBUG, "Reading EnableTransactions value.");
+		*outval = j->enable_transactions;
+		break;
+	case VPROC_GSK_WAITFORDEBUGGER:
+		*outval = j->wait4debugger;
+		break;
+	case VPROC_GSK_EMBEDDEDROOTEQUIVALENT:
+		*outval = j->embedded_god;
+		break;
+	case VPROC_GSK_ZERO:
+		*outval = 0;
+		break;
+	default:
+		kr = 1;
+		break;
+	}
+
+	switch (inkey) {
+	case VPROC_GSK_ABANDON_PROCESS_GROUP:
+		j->abandon_pg = (bool)inval;
+		break;
+	case VPROC_GSK_GLOBAL_ON_DEMAND:
+		job_log(j, LOG_DEBUG, "Job has set global on-demand mode to: %s", inval ? "true" : "false");
+		kr = job_set_global_on_demand(j, inval);
+		break;
+	case VPROC_GSK_BASIC_KEEPALIVE:
+		j->ondemand = !inval;
+		break;
+	case VPROC_GSK_START_INTERVAL:
+		if (inval > UINT32_MAX || inval < 0) {
+			kr = 1;
+		} else if (inval) {
+			if (j->start_interval == 0) {
+				runtime_add_weak_ref();
+			}
+			j->start_interval = (typeof(j->start_interval)) inval;
+			(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_ADD, NOTE_SECONDS, j->start_interval, j));
+		} else if (j->start_interval) {
+			(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_DELETE, 0, 0, NULL));
+			if (j->start_interval != 0) {
+				runtime_del_weak_ref();
+			}
+			j->start_interval = 0;
+		}
+		break;
+	case VPROC_GSK_IDLE_TIMEOUT:
+		if (inval < 0 || inval > UINT32_MAX) {
+			kr = 1;
 		} else {
-			mach_msg_options_t options =	MACH_RCV_MSG		|
-											MACH_RCV_TIMEOUT	;
+			j->timeout = (typeof(j->timeout)) inval;
+		}
+		break;
+	case VPROC_GSK_EXIT_TIMEOUT:
+		if (inval < 0 || inval > UINT32_MAX) {
+			kr = 1;
+		} else {
+			j->exit_timeout = (typeof(j->exit_timeout)) inval;
+		}
+		break;
+	case VPROC_GSK_GLOBAL_LOG_MASK:
+		if (inval < 0 || inval > UINT32_MAX) {
+			kr = 1;
+		} else {
+			runtime_setlogmask((int) inval);
+		}
+		break;
+	case VPROC_GSK_GLOBAL_UMASK:
+		__OS_COMPILETIME_ASSERT__(sizeof (mode_t) == 2);
+		if (inval < 0 || inval > UINT16_MAX) {
+			kr = 1;
+		} else {
+#if HAVE_SANDBOX
+			if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
+				kr = 1;
+			} else {
+				umask((mode_t) inval);
+			}
+#endif
+		}
+		break;
+	case VPROC_GSK_TRANSACTIONS_ENABLED:
+		/* No-op. */
+		break;
+	case VPROC_GSK_WEIRD_BOOTSTRAP:
+		if (job_assumes(j, j->weird_bootstrap)) {
+			job_log(j, LOG_DEBUG, "Unsetting weird bootstrap.");
 
-			mr = mach_msg((mach_msg_header_t *)req_hdr, options, 0, sizeof(req_buff), ms->port, 0, MACH_PORT_NULL);
-			switch (mr) {
-			case MACH_MSG_SUCCESS:
-				mach_msg_destroy((mach_msg_header_t *)req_hdr);
-				break;
-			case MACH_RCV_TIMED_OUT:
-				break;
-			case MACH_RCV_TOO_LARGE:
-				launchd_syslog(LOG_WARNING, "Tried to receive message that was larger than %lu bytes", sizeof(req_buff));
-				break;
-			default:
-				break;
+			mach_msg_size_t mxmsgsz = (typeof(mxmsgsz)) sizeof(union __RequestUnion__job_mig_job_subsystem);
+
+			if (job_mig_job_subsystem.maxsize > mxmsgsz) {
+				mxmsgsz = job_mig_job_subsystem.maxsize;
 			}
+
+			(void)job_assumes_zero(j, runtime_add_mport(j->mgr->jm_port, job_server));
+			j->weird_bootstrap = false;
 		}
-	} while (drain_all && mr != MACH_RCV_TIMED_OUT);
+		break;
+	case VPROC_GSK_WAITFORDEBUGGER:
+		j->wait4debugger_oneshot = inval;
+		break;
+	case VPROC_GSK_PERUSER_SUSPEND:
+		if (job_assumes(j, pid1_magic && ldc->euid == 0)) {
+			mach_port_t junk = MACH_PORT_NULL;
+			job_t jpu = jobmgr_lookup_per_user_context_internal(j, (uid_t)inval, &junk);
+			if (job_assumes(j, jpu != NULL)) {
+				struct suspended_peruser *spi = NULL;
+				LIST_FOREACH(spi, &j->suspended_perusers, sle) {
+					if ((int64_t)(spi->j->mach_uid) == inval) {
+						job_log(j, LOG_WARNING, "Job tried to suspend per-user launchd for UID %lli twice.", inval);
+						break;
+					}
+				}
+
+				if (spi == NULL) {
+					job_log(j, LOG_INFO, "Job is suspending the per-user launchd for UID %lli.", inval);
+					spi = (struct suspended_peruser *)calloc(sizeof(struct suspended_peruser), 1);
+					if (job_assumes(j, spi != NULL)) {
+						/* Stop listening for events.
+						 *
+						 * See <rdar://problem/9014146>.
+						 */
+						if (jpu->peruser_suspend_count == 0) {
+							job_ignore(jpu);
+						}
+
+						spi->j = jpu;
+						spi->j->peruser_suspend_count++;
+						LIST_INSERT_HEAD(&j->suspended_perusers, spi, sle);
+						job_stop(spi->j);
+						*outval = jpu->p;
+					} else {
+						kr = BOOTSTRAP_NO_MEMORY;
+					}
+				}
+			}
+		} else {
+			kr = 1;
+		}
+		break;
+	case VPROC_GSK_PERUSER_RESUME:
+		if (job_assumes(j, pid1_magic == true)) {
+			struct suspended_peruser *spi = NULL, *spt = NULL;
+			LIST_FOREACH_SAFE(spi, &j->suspended_perusers, sle, spt) {
+				if ((int64_t)(spi->j->mach_uid) == inval) {
+					spi->j->peruser_suspend_count--;
+					LIST_REMOVE(spi, sle);
+					job_log(j, LOG_INFO, "Job is resuming the per-user launchd for UID %lli.", inval);
+					break;
+				}
+			}
+
+			if (!job_assumes(j, spi != NULL)) {
+				job_log(j, LOG_WARNING, "Job tried to resume per-user launchd for UID %lli that it did not suspend.", inval);
+				kr = BOOTSTRAP_NOT_PRIVILEGED;
+			} else if (spi->j->peruser_suspend_count == 0) {
+				job_watch(spi->j);
+				job_dispatch(spi->j, false);
+				free(spi);
+			}
+		} else {
+			kr = 1;
+		}
+		break;
+	case VPROC_GSK_ZERO:
+		break;
+	default:
+		kr = 1;
+		break;
+	}
+
+	return kr;
 }
 
-void
-machservice_delete(job_t j, struct machservice *ms, bool port_died)
+kern_return_t
+job_mig_post_fork_ping(job_t j, task_t child_task, mach_port_t *asport)
 {
-	if (ms->alias) {
-		/* HACK: Egregious code duplication. But dealing with aliases is a
-		 * pretty simple affair since they can't and shouldn't have any complex
-		 * behaviors associated with them.
-		 */
-		LIST_REMOVE(ms, name_hash_sle);
-		SLIST_REMOVE(&j->machservices, ms, machservice, sle);
-		free(ms);
-		return;
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (unlikely(ms->debug_on_close)) {
-		job_log(j, LOG_NOTICE, "About to enter kernel debugger because of Mach port: 0x%x", ms->port);
-		(void)job_assumes_zero(j, host_reboot(mach_host_self(), HOST_REBOOT_DEBUGGER));
-	}
+	job_log(j, LOG_DEBUG, "Post fork ping.");
 
-	if (ms->recv && job_assumes(j, !machservice_active(ms))) {
-		job_log(j, LOG_DEBUG, "Closing receive right for %s", ms->name);
-		(void)job_assumes_zero(j, launchd_mport_close_recv(ms->port));
-	}
+	struct machservice *ms;
+	job_setup_exception_port(j, child_task);
+	SLIST_FOREACH(ms, &special_ports, special_port_sle) {
+		if (j->per_user && (ms->special_port_num != TASK_ACCESS_PORT)) {
+			// The TASK_ACCESS_PORT funny business is to workaround 5325399.
+			continue;
+		}
 
-	(void)job_assumes_zero(j, launchd_mport_deallocate(ms->port));
+		errno = task_set_special_port(child_task, ms->special_port_num, ms->port);
+		if (errno) {
+			if (errno == MACH_SEND_INVALID_DEST) {
+				job_log(j, LOG_WARNING, "Task died before special ports could be set.");
+				break;
+			}
 
-	if (unlikely(ms->port == the_exception_server)) {
-		the_exception_server = 0;
-	}
+			int desired_log_level = LOG_ERR;
+			if (j->anonymous) {
+				// 5338127
 
-	job_log(j, LOG_DEBUG, "Mach service deleted%s: %s", port_died ? " (port died)" : "", ms->name);
+				desired_log_level = LOG_WARNING;
 
-	if (ms->special_port_num) {
-		SLIST_REMOVE(&special_ports, ms, machservice, special_port_sle);
+				if (ms->special_port_num == TASK_SEATBELT_PORT) {
+					desired_log_level = LOG_DEBUG;
+				}
+			}
+
+			job_log(j, desired_log_level, "Could not setup Mach task special port %u: %s", ms->special_port_num, mach_error_string(errno));
+		}
 	}
-	SLIST_REMOVE(&j->machservices, ms, machservice, sle);
 
-	if (!(j->dedicated_instance || ms->event_channel)) {
-		LIST_REMOVE(ms, name_hash_sle);
+	/* MIG will not zero-initialize this pointer, so we must always do so.
+	 *
+	 * <rdar://problem/8562593>.
+	 */
+	*asport = MACH_PORT_NULL;
+#if !TARGET_OS_EMBEDDED
+	if (!j->anonymous) {
+		/* XPC services will spawn into the root security session by default.
+		 * xpcproxy will switch them away if needed.
+		 */
+		if (!(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
+			job_log(j, LOG_DEBUG, "Returning session port: 0x%x", j->asport);
+			*asport = j->asport;
+		}
 	}
-	LIST_REMOVE(ms, port_hash_sle);
+#endif
+	(void)job_assumes_zero(j, launchd_mport_deallocate(child_task));
 
-	free(ms);
+	return 0;
 }
 
-void
-machservice_request_notifications(struct machservice *ms)
+kern_return_t
+job_mig_get_listener_port_rights(job_t j, mach_port_array_t *sports, mach_msg_type_number_t *sports_cnt)
 {
-	mach_msg_id_t which = MACH_NOTIFY_DEAD_NAME;
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
 
-	ms->isActive = true;
+	size_t cnt = 0;
+	struct machservice *msi = NULL;
+	SLIST_FOREACH(msi, &j->machservices, sle) {
+		if (msi->upfront && job_assumes(j, msi->recv)) {
+			cnt++;
+		}
+	}
 
-	if (ms->recv) {
-		which = MACH_NOTIFY_PORT_DESTROYED;
-		job_checkin(ms->job);
+	if (cnt == 0) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	(void)job_assumes_zero(ms->job, launchd_mport_notify_req(ms->port, which));
-}
+	mach_port_array_t sports2 = NULL;
+	mig_allocate((vm_address_t *)&sports2, cnt * sizeof(sports2[0]));
+	if (!sports2) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
 
-#define NELEM(x) (sizeof(x)/sizeof(x[0]))
-#define END_OF(x) (&(x)[NELEM(x)])
+	size_t i = 0;
+	SLIST_FOREACH(msi, &j->machservices, sle) {
+		if (msi->upfront && msi->recv) {
+			sports2[i] = msi->port;
+			i++;
+		}
+	}
 
-char **
-mach_cmd2argv(const char *string)
+	*sports = sports2;
+	*sports_cnt = cnt;
+
+	return KERN_SUCCESS;
+}
+
+kern_return_t
+job_mig_checkin_sockets(job_t j, name_t name, mach_port_array_t *fdps, mach_msg_type_number_t *fdps_cnt)
 {
-	char *argv[100], args[1000];
-	const char *cp;
-	char *argp = args, term, **argv_ret, *co;
-	unsigned int nargs = 0, i;
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
 
-	for (cp = string; *cp;) {
-		while (isspace(*cp))
-			cp++;
-		term = (*cp == '"') ? *cp++ : '\0';
-		if (nargs < NELEM(argv)) {
-			argv[nargs++] = argp;
-		}
-		while (*cp && (term ? *cp != term : !isspace(*cp)) && argp < END_OF(args)) {
-			if (*cp == '\\') {
-				cp++;
-			}
-			*argp++ = *cp;
-			if (*cp) {
-				cp++;
-			}
+	struct socketgroup *sg = NULL;
+	SLIST_FOREACH(sg, &j->sockets, sle) {
+		if (strncmp(sg->name, name, sizeof(name_t)) == 0) {
+			break;
 		}
-		*argp++ = '\0';
 	}
-	argv[nargs] = NULL;
 
-	if (nargs == 0) {
-		return NULL;
+	if (!sg) {
+		return ENOENT;
 	}
 
-	argv_ret = malloc((nargs + 1) * sizeof(char *) + strlen(string) + 1);
-
-	if (!argv_ret) {
-		(void)os_assumes_zero(errno);
-		return NULL;
+	mach_port_array_t fdps2 = NULL;
+	if (sg->fd_cnt) {
+		mig_allocate((vm_address_t *)&fdps2, sg->fd_cnt * sizeof(fdps2[0]));
+		if (!fdps2) {
+			return BOOTSTRAP_NO_MEMORY;
+		}
 	}
 
-	co = (char *)argv_ret + (nargs + 1) * sizeof(char *);
+	unsigned int i = 0;
+	for (i = 0; i < sg->fd_cnt; i++) {
+		fdps2[i] = MACH_PORT_NULL;
+		if (fileport_makeport(sg->fds[i], &fdps2[i]) != 0) {
+			job_log(j, LOG_ERR, "Could not make fileport for socket %s at index: %u: %d: %s", sg->name, i, errno, strerror(errno));
+			break;
+		}
+	}
 
-	for (i = 0; i < nargs; i++) {
-		strcpy(co, argv[i]);
-		argv_ret[i] = co;
-		co += strlen(argv[i]) + 1;
+	if (i != sg->fd_cnt) {
+		while (i--) {
+			(void)launchd_mport_deallocate(fdps2[i]);
+		}
+		mig_deallocate((vm_address_t)fdps2, sg->fd_cnt * sizeof(fdps2[0]));
+		return BOOTSTRAP_NO_MEMORY;
 	}
-	argv_ret[i] = NULL;
 
-	return argv_ret;
-}
+	job_checkin_sockets(j);
 
-void
-job_checkin(job_t j)
-{
-	j->checkedin = true;
-}
+	*fdps = fdps2;
+	*fdps_cnt = sg->fd_cnt;
 
-bool job_is_god(job_t j)
-{
-	return j->embedded_god;
+	return KERN_SUCCESS;
 }
 
-bool
-job_ack_port_destruction(mach_port_t p)
+kern_return_t
+job_mig_register_gui_session(job_t j, mach_port_t asport)
 {
-	struct machservice *ms;
-	job_t j;
-
-	LIST_FOREACH(ms, &port_hash[HASH_PORT(p)], port_hash_sle) {
-		if (ms->recv && (ms->port == p)) {
-			break;
-		}
+	if (!j->per_user) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	if (!ms) {
-		launchd_syslog(LOG_WARNING, "Could not find MachService to match receive right: 0x%x", p);
-		return false;
+	jobmgr_t jm = jobmgr_find_xpc_per_user_domain(root_jobmgr, j->mach_uid);
+	if (!jm) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	j = ms->job;
-
-	jobmgr_log(root_jobmgr, LOG_DEBUG, "Receive right returned to us: %s", ms->name);
-
-	/* Without being the exception handler, NOTE_EXIT is our only way to tell if
-	 * the job  crashed, and we can't rely on NOTE_EXIT always being processed
-	 * after all the job's receive rights have been returned.
-	 *
-	 * So when we get receive rights back, check to see if the job has been
-	 * reaped yet. If not, then we add this service to a list of services to be
-	 * drained on crash if it's requested that behavior. So, for a job with N
-	 * receive rights all requesting that they be drained on crash, we can
-	 * safely handle the following sequence of events.
-	 * 
-	 * ReceiveRight0Returned
-	 * ReceiveRight1Returned
-	 * ReceiveRight2Returned
-	 * NOTE_EXIT (reap, get exit status)
-	 * ReceiveRight3Returned
-	 * .
-	 * .
-	 * .
-	 * ReceiveRight(N - 1)Returned
-	 */
-	if (ms->drain_one_on_crash || ms->drain_all_on_crash) {
-		if (j->crashed && j->reaped) {
-			job_log(j, LOG_DEBUG, "Job has crashed. Draining port...");
-			machservice_drain_port(ms);
-		} else if (!(j->crashed || j->reaped)) {
-			job_log(j, LOG_DEBUG, "Job's exit status is still unknown. Deferring drain.");
-		}
+	if (jm->req_gui_asport) {
+		// This job manager persists, so we need to allow the per-user launchd
+		// to update the GUI session as it comes and goes.
+		jobmgr_assumes_zero(jm, launchd_mport_deallocate(jm->req_gui_asport));
 	}
 
-	ms->isActive = false;
-	if (ms->delete_on_destruction) {
-		machservice_delete(j, ms, false);
-	} else if (ms->reset) {
-		machservice_resetport(j, ms);
-	}
+	jm->req_gui_asport = asport;
+	return KERN_SUCCESS;
+}
 
-	kern_return_t kr = mach_port_set_attributes(mach_task_self(), ms->port, MACH_PORT_TEMPOWNER, NULL, 0);
-	(void)job_assumes_zero(j, kr);
-	machservice_stamp_port(j, ms);
-	job_dispatch(j, false);
+kern_return_t
+job_mig_reboot2(job_t j, uint64_t flags)
+{
+	char who_started_the_reboot[2048] = "";
+	struct proc_bsdshortinfo proc;
+	struct ldcred *ldc = runtime_get_caller_creds();
+	pid_t pid_to_log;
 
-	if (ms->recv_race_hack) {
-		ms->recv_race_hack = false;
-		machservice_watch(ms->job, ms);
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	root_jobmgr = jobmgr_do_garbage_collection(root_jobmgr);
+	if (unlikely(!pid1_magic)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
 
-	return true;
-}
+#if !TARGET_OS_EMBEDDED
+	if (unlikely(ldc->euid)) {
+#else
+	if (unlikely(ldc->euid) && !j->embedded_god) {
+#endif
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
 
-void
-job_ack_no_senders(job_t j)
-{
-	j->priv_port_has_senders = false;
+	for (pid_to_log = ldc->pid; pid_to_log; pid_to_log = proc.pbsi_ppid) {
+		size_t who_offset;
+		if (proc_pidinfo(pid_to_log, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
+			if (errno != ESRCH) {
+				(void)job_assumes_zero(j, errno);
+			}
+			return 1;
+		}
 
-	(void)job_assumes_zero(j, launchd_mport_close_recv(j->j_port));
-	j->j_port = 0;
+		if (!job_assumes(j, pid_to_log != (pid_t)proc.pbsi_ppid)) {
+			job_log(j, LOG_WARNING, "Job which is its own parent started reboot.");
+			snprintf(who_started_the_reboot, sizeof(who_started_the_reboot), "%s[%u]->%s[%u]->%s[%u]->...", proc.pbsi_comm, pid_to_log, proc.pbsi_comm, pid_to_log, proc.pbsi_comm, pid_to_log);
+			break;
+		}
 
-	job_log(j, LOG_DEBUG, "No more senders on privileged Mach bootstrap port");
+		who_offset = strlen(who_started_the_reboot);
+		snprintf(who_started_the_reboot + who_offset, sizeof(who_started_the_reboot) - who_offset,
+				" %s[%u]%s", proc.pbsi_comm, pid_to_log, proc.pbsi_ppid ? " ->" : "");
+	}
 
-	job_dispatch(j, false);
+	root_jobmgr->reboot_flags = (int)flags;
+	job_log(j, LOG_DEBUG, "reboot2() initiated by:%s", who_started_the_reboot);
+	launchd_shutdown();
+
+	return 0;
 }
 
-bool
-semaphoreitem_new(job_t j, semaphore_reason_t why, const char *what)
+kern_return_t
+job_mig_getsocket(job_t j, name_t spr)
 {
-	struct semaphoreitem *si;
-	size_t alloc_sz = sizeof(struct semaphoreitem);
-
-	if (what) {
-		alloc_sz += strlen(what) + 1;
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (job_assumes(j, si = calloc(1, alloc_sz)) == NULL) {
-		return false;
+	if (j->deny_job_creation) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	si->why = why;
-
-	if (what) {
-		strcpy(si->what_init, what);
+#if HAVE_SANDBOX
+	struct ldcred *ldc = runtime_get_caller_creds(); 
+	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
+#endif
 
-	SLIST_INSERT_HEAD(&j->semaphores, si, sle);
+	ipc_server_init();
 
-	if ((why == OTHER_JOB_ENABLED || why == OTHER_JOB_DISABLED) && !j->nosy) {
-		job_log(j, LOG_DEBUG, "Job is interested in \"%s\".", what);
-		SLIST_INSERT_HEAD(&s_curious_jobs, j, curious_jobs_sle);
-		j->nosy = true;
+	if (unlikely(!sockpath)) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	semaphoreitem_runtime_mod_ref(si, true);
+	strncpy(spr, sockpath, sizeof(name_t));
 
-	return true;
+	return BOOTSTRAP_SUCCESS;
 }
 
-void
-semaphoreitem_runtime_mod_ref(struct semaphoreitem *si, bool add)
+kern_return_t
+job_mig_log(job_t j, int pri, int err, logmsg_t msg)
 {
-	/*
-	 * External events need to be tracked.
-	 * Internal events do NOT need to be tracked.
-	 */
-
-	switch (si->why) {
-	case SUCCESSFUL_EXIT:
-	case FAILED_EXIT:
-	case OTHER_JOB_ENABLED:
-	case OTHER_JOB_DISABLED:
-	case OTHER_JOB_ACTIVE:
-	case OTHER_JOB_INACTIVE:
-		return;
-	default:
-		break;
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (add) {
-		runtime_add_weak_ref();
+	if ((errno = err)) {
+		job_log_error(j, pri, "%s", msg);
 	} else {
-		runtime_del_weak_ref();
+		job_log(j, pri, "%s", msg);
 	}
+
+	return 0;
 }
 
 void
-semaphoreitem_delete(job_t j, struct semaphoreitem *si)
+job_setup_per_user_directory(job_t j, uid_t uid, const char *path)
 {
-	semaphoreitem_runtime_mod_ref(si, false);
+	struct stat sb;
 
-	SLIST_REMOVE(&j->semaphores, si, semaphoreitem, sle);
+	bool created = false;
+	int r = stat(path, &sb);
+	if ((r == -1 && errno == ENOENT) || (r == 0 && !S_ISDIR(sb.st_mode))) {
+		if (r == 0) {
+			job_log(j, LOG_NOTICE, "File at location of per-user launchd directory is not a directory. Moving aside: %s", path);
 
-	// We'll need to rethink this if it ever becomes possible to dynamically add or remove semaphores.
-	if ((si->why == OTHER_JOB_ENABLED || si->why == OTHER_JOB_DISABLED) && j->nosy) {
-		j->nosy = false;
-		SLIST_REMOVE(&s_curious_jobs, j, job_s, curious_jobs_sle);
+			char old[PATH_MAX];
+			snprintf(old, sizeof(old), "%s.movedaside", path);
+			(void)job_assumes_zero_p(j, rename(path, old));
+		}
+
+		(void)job_assumes_zero_p(j, mkdir(path, S_IRWXU));
+		(void)job_assumes_zero_p(j, chown(path, uid, 0));
+		created = true;
 	}
 
-	free(si);
+	if (!created) {
+		if (sb.st_uid != uid) {
+			job_log(j, LOG_NOTICE, "Per-user launchd directory has improper user ownership. Repairing: %s", path);
+			(void)job_assumes_zero_p(j, chown(path, uid, 0));
+		}
+		if (sb.st_gid != 0) {
+			job_log(j, LOG_NOTICE, "Per-user launchd directory has improper group ownership. Repairing: %s", path);
+			(void)job_assumes_zero_p(j, chown(path, uid, 0));
+		}
+		if (sb.st_mode != (S_IRWXU | S_IFDIR)) {
+			job_log(j, LOG_NOTICE, "Per-user launchd directory has improper mode. Repairing: %s", path);
+			(void)job_assumes_zero_p(j, chmod(path, S_IRWXU));
+		}
+	}
 }
 
 void
-semaphoreitem_setup_dict_iter(launch_data_t obj, const char *key, void *context)
+job_setup_per_user_directories(job_t j, uid_t uid, const char *label)
 {
-	struct semaphoreitem_dict_iter_context *sdic = context;
-	semaphore_reason_t why;
+	char path[PATH_MAX];
 
-	why = launch_data_get_bool(obj) ? sdic->why_true : sdic->why_false;
+	(void)snprintf(path, sizeof(path), LAUNCHD_DB_PREFIX "/%s", label);
+	job_setup_per_user_directory(j, uid, path);
 
-	semaphoreitem_new(sdic->j, why, key);
+	(void)snprintf(path, sizeof(path), LAUNCHD_LOG_PREFIX "/%s", label);
+	job_setup_per_user_directory(j, uid, path);
 }
 
-void
-semaphoreitem_setup(launch_data_t obj, const char *key, void *context)
+job_t
+jobmgr_lookup_per_user_context_internal(job_t j, uid_t which_user, mach_port_t *mp)
 {
-	struct semaphoreitem_dict_iter_context sdic = { context, 0, 0 };
-	job_t j = context;
-	semaphore_reason_t why;
-
-	switch (launch_data_get_type(obj)) {
-	case LAUNCH_DATA_BOOL:
-		if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_NETWORKSTATE) == 0) {
-			why = launch_data_get_bool(obj) ? NETWORK_UP : NETWORK_DOWN;
-			semaphoreitem_new(j, why, NULL);
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_SUCCESSFULEXIT) == 0) {
-			why = launch_data_get_bool(obj) ? SUCCESSFUL_EXIT : FAILED_EXIT;
-			semaphoreitem_new(j, why, NULL);
-			j->start_pending = true;
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_AFTERINITIALDEMAND) == 0) {
-			j->needs_kickoff = launch_data_get_bool(obj);
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_CRASHED) == 0) {
-			why = launch_data_get_bool(obj) ? CRASHED : DID_NOT_CRASH;
-			semaphoreitem_new(j, why, NULL);
-			j->start_pending = true;
-		} else {
-			job_log(j, LOG_ERR, "Unrecognized KeepAlive attribute: %s", key);
+	job_t ji = NULL;
+	LIST_FOREACH(ji, &root_jobmgr->jobs, sle) {
+		if (!ji->per_user) {
+			continue;
 		}
-		break;
-	case LAUNCH_DATA_DICTIONARY:
-		if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_OTHERJOBACTIVE) == 0) {
-			sdic.why_true = OTHER_JOB_ACTIVE;
-			sdic.why_false = OTHER_JOB_INACTIVE;
-		} else if (strcasecmp(key, LAUNCH_JOBKEY_KEEPALIVE_OTHERJOBENABLED) == 0) {
-			sdic.why_true = OTHER_JOB_ENABLED;
-			sdic.why_false = OTHER_JOB_DISABLED;
-		} else {
-			job_log(j, LOG_ERR, "Unrecognized KeepAlive attribute: %s", key);
-			break;
+		if (ji->mach_uid != which_user) {
+			continue;
+		}
+		if (SLIST_EMPTY(&ji->machservices)) {
+			continue;
+		}
+		if (!SLIST_FIRST(&ji->machservices)->per_user_hack) {
+			continue;
 		}
+		break;
+	}
+
+	if (unlikely(ji == NULL)) {
+		struct machservice *ms;
+		char lbuf[1024];
+
+		job_log(j, LOG_DEBUG, "Creating per user launchd job for UID: %u", which_user);
+
+		sprintf(lbuf, "com.apple.launchd.peruser.%u", which_user);
+
+		ji = job_new(root_jobmgr, lbuf, "/sbin/launchd", NULL);
+
+		if (ji != NULL) {
+			auditinfo_addr_t auinfo = {
+				.ai_termid = { 
+					.at_type = AU_IPv4
+				},
+				.ai_auid = which_user,
+				.ai_asid = AU_ASSIGN_ASID,
+			};
+
+			if (setaudit_addr(&auinfo, sizeof(auinfo)) == 0) {
+				job_log(ji, LOG_DEBUG, "Created new security session for per-user launchd: %u", auinfo.ai_asid);
+				(void)job_assumes(ji, (ji->asport = audit_session_self()) != MACH_PORT_NULL);
+
+				/* Kinda lame that we have to do this, but we can't create an
+				 * audit session without joining it.
+				 */
+				(void)job_assumes(ji, audit_session_join(launchd_audit_port));
+				ji->asid = auinfo.ai_asid;
+			} else {
+				job_log(ji, LOG_WARNING, "Could not set audit session!");
+				job_remove(ji);
+				return NULL;
+			}
+
+			ji->mach_uid = which_user;
+			ji->per_user = true;
+			ji->enable_transactions = true;
+			job_setup_per_user_directories(ji, which_user, lbuf);
+
+			if ((ms = machservice_new(ji, lbuf, mp, false)) == NULL) {
+				job_remove(ji);
+				ji = NULL;
+			} else {
+				ms->upfront = true;
+				ms->per_user_hack = true;
+				ms->hide = true;
 
-		launch_data_dict_iterate(obj, semaphoreitem_setup_dict_iter, &sdic);
-		break;
-	default:
-		job_log(j, LOG_ERR, "Unrecognized KeepAlive type: %u", launch_data_get_type(obj));
-		break;
+				ji = job_dispatch(ji, false);
+			}
+		}
+	} else {
+		*mp = machservice_port(SLIST_FIRST(&ji->machservices));
+		job_log(j, LOG_DEBUG, "Per user launchd job found for UID: %u", which_user);
 	}
+
+	return ji;
 }
 
-bool
-externalevent_new(job_t j, struct eventsystem *sys, const char *evname, xpc_object_t event, uint64_t flags)
+kern_return_t
+job_mig_lookup_per_user_context(job_t j, uid_t which_user, mach_port_t *up_cont)
 {
-	if (j->event_monitor) {
-		job_log(j, LOG_ERR, "The event monitor job cannot use LaunchEvents or XPC Events.");
-		return false;
-	}
+	struct ldcred *ldc = runtime_get_caller_creds();
+	job_t jpu;
 
-	struct externalevent *ee = (struct externalevent *)calloc(1, sizeof(struct externalevent) + strlen(evname) + 1);
-	if (!ee) {
-		return false;
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	ee->event = xpc_retain(event);
-	(void)strcpy(ee->name, evname);
-	ee->job = j;
-	ee->id = sys->curid;
-	ee->sys = sys;
-	ee->state = false;
-	ee->wanted_state = true;
-	sys->curid++;
-
-	if (flags & XPC_EVENT_FLAG_ENTITLEMENTS) {
-		struct ldcred *ldc = runtime_get_caller_creds();
-		if (ldc) {
-			ee->entitlements = xpc_copy_entitlements_for_pid(ldc->pid);
-		}
+	if (launchd_osinstaller) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	if (sys == _launchd_support_system) {
-		ee->internal = true;
-	}
+#if TARGET_OS_EMBEDDED
+	// There is no need for per-user launchd's on embedded.
+	job_log(j, LOG_ERR, "Per-user launchds are not supported on this platform.");
+	return BOOTSTRAP_UNKNOWN_SERVICE;
+#endif
 
-	LIST_INSERT_HEAD(&j->events, ee, job_le);
-	LIST_INSERT_HEAD(&sys->events, ee, sys_le);
+#if HAVE_SANDBOX
+	if (unlikely(sandbox_check(ldc->pid, "mach-per-user-lookup", SANDBOX_FILTER_NONE) > 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+#endif
 
-	job_log(j, LOG_DEBUG, "New event: %s/%s", sys->name, evname);
+	job_log(j, LOG_INFO, "Looking up per user launchd for UID: %u", which_user);
 
-	eventsystem_ping();
-	return true;
-}
+	if (unlikely(!pid1_magic)) {
+		job_log(j, LOG_ERR, "Only PID 1 supports per user launchd lookups.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
 
-void
-externalevent_delete(struct externalevent *ee)
-{
-	xpc_release(ee->event);
-	if (ee->entitlements) {
-		xpc_release(ee->entitlements);
+	if (ldc->euid || ldc->uid) {
+		which_user = ldc->euid ?: ldc->uid;
 	}
-	LIST_REMOVE(ee, job_le);
-	LIST_REMOVE(ee, sys_le);
 
-	free(ee);
+	*up_cont = MACH_PORT_NULL;
 
-	eventsystem_ping();
+	jpu = jobmgr_lookup_per_user_context_internal(j, which_user, up_cont);
+
+	return 0;
 }
 
-void
-externalevent_setup(launch_data_t obj, const char *key, void *context)
+kern_return_t
+job_mig_check_in2(job_t j, name_t servicename, mach_port_t *serviceportp, uuid_t instance_id, uint64_t flags)
 {
-	/* This method can ONLY be called on the job_import() path, as it assumes
-	 * the input is a launch_data_t.
-	 */
-	struct externalevent_iter_ctx *ctx = (struct externalevent_iter_ctx *)context;
+	bool per_pid_service = flags & BOOTSTRAP_PER_PID_SERVICE;
+	bool strict = flags & BOOTSTRAP_STRICT_CHECKIN;
+	struct ldcred *ldc = runtime_get_caller_creds();
+	struct machservice *ms = NULL;
+	job_t jo;
 
-	xpc_object_t xobj = ld2xpc(obj);
-	if (xobj) {
-		job_log(ctx->j, LOG_DEBUG, "Importing stream/event: %s/%s", ctx->sys->name, key);
-		externalevent_new(ctx->j, ctx->sys, key, xobj, 0);
-		xpc_release(xobj);
-	} else {
-		job_log(ctx->j, LOG_ERR, "Could not import event for job: %s", key);
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
-}
-
-struct externalevent *
-externalevent_find(const char *sysname, uint64_t id)
-{
-	struct externalevent *ei = NULL;
 
-	struct eventsystem *es = eventsystem_find(sysname);
-	if (es != NULL) {
-		LIST_FOREACH(ei, &es->events, sys_le) {
-			if (ei->id == id) {
+	if (j->dedicated_instance) {
+		struct machservice *msi = NULL;
+		SLIST_FOREACH(msi, &j->machservices, sle) {
+			if (strncmp(servicename, msi->name, sizeof(name_t) - 1) == 0) {
+				uuid_copy(instance_id, j->instance_id);
+				ms = msi;
 				break;
 			}
 		}
 	} else {
-		launchd_syslog(LOG_ERR, "Could not find event system: %s", sysname);
+		ms = jobmgr_lookup_service(j->mgr, servicename, false, per_pid_service ? ldc->pid : 0);
 	}
 
-	return ei;
-}
+	if (strict) {
+		if (likely(ms != NULL)) {
+			if (ms->job != j) {
+				return BOOTSTRAP_NOT_PRIVILEGED;
+			} else if (ms->isActive) {
+				return BOOTSTRAP_SERVICE_ACTIVE;
+			}
+		} else {
+			return BOOTSTRAP_UNKNOWN_SERVICE;
+		}
+	} else if (ms == NULL) {
+		if (job_assumes(j, !j->dedicated_instance)) {
+			*serviceportp = MACH_PORT_NULL;
 
-struct eventsystem *
-eventsystem_new(const char *name)
-{
-	struct eventsystem *es = (struct eventsystem *)calloc(1, sizeof(struct eventsystem) + strlen(name) + 1);
-	if (es != NULL) {
-		es->curid = 1;
-		(void)strcpy(es->name, name);
-		LIST_INSERT_HEAD(&_s_event_systems, es, global_le);
+#if HAVE_SANDBOX
+			if (unlikely(sandbox_check(ldc->pid, "mach-register", per_pid_service ? SANDBOX_FILTER_LOCAL_NAME : SANDBOX_FILTER_GLOBAL_NAME, servicename) > 0)) {
+				return BOOTSTRAP_NOT_PRIVILEGED;
+			}
+#endif
+			if (unlikely((ms = machservice_new(j, servicename, serviceportp, per_pid_service)) == NULL)) {
+				return BOOTSTRAP_NO_MEMORY;
+			}
+
+			// Treat this like a legacy job.
+			if (!j->legacy_mach_job) {
+				ms->isActive = true;
+				ms->recv = false;
+			}
+
+			if (!(j->anonymous || j->legacy_LS_job || j->legacy_mach_job)) {
+				job_log(j, LOG_APPLEONLY, "Please add the following service to the configuration file for this job: %s", servicename);
+			}
+		} else {
+			return BOOTSTRAP_UNKNOWN_SERVICE;
+		}
 	} else {
-		(void)os_assumes_zero(errno);
+		if (unlikely((jo = machservice_job(ms)) != j)) {
+			static pid_t last_warned_pid;
+
+			if (last_warned_pid != ldc->pid) {
+				job_log(jo, LOG_WARNING, "The following job tried to hijack the service \"%s\" from this job: %s", servicename, j->label);
+				last_warned_pid = ldc->pid;
+			}
+
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+		if (unlikely(machservice_active(ms))) {
+			job_log(j, LOG_WARNING, "Check-in of Mach service failed. Already active: %s", servicename);
+			return BOOTSTRAP_SERVICE_ACTIVE;
+		}
 	}
 
-	return es;
+	job_checkin(j);
+	machservice_request_notifications(ms);
+
+	job_log(j, LOG_INFO, "Check-in of service: %s", servicename);
+
+	*serviceportp = machservice_port(ms);
+	return BOOTSTRAP_SUCCESS;
 }
 
-void
-eventsystem_delete(struct eventsystem *es)
+kern_return_t
+job_mig_register2(job_t j, name_t servicename, mach_port_t serviceport, uint64_t flags)
 {
-	struct externalevent *ei = NULL;
-	while ((ei = LIST_FIRST(&es->events))) {
-		externalevent_delete(ei);
+	struct machservice *ms;
+	struct ldcred *ldc = runtime_get_caller_creds();
+	bool per_pid_service = flags & BOOTSTRAP_PER_PID_SERVICE;
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	LIST_REMOVE(es, global_le);
+	if (!per_pid_service && !j->legacy_LS_job) {
+		job_log(j, LOG_APPLEONLY, "Performance: bootstrap_register() is deprecated. Service: %s", servicename);
+	}
 
-	free(es);
-}
+	job_log(j, LOG_DEBUG, "%sMach service registration attempt: %s", flags & BOOTSTRAP_PER_PID_SERVICE ? "Per PID " : "", servicename);
 
-void
-eventsystem_setup(launch_data_t obj, const char *key, void *context)
-{
-	job_t j = (job_t)context;
-	if (!job_assumes(j, launch_data_get_type(obj) == LAUNCH_DATA_DICTIONARY)) {
-		return;
+#if HAVE_SANDBOX
+	if (unlikely(sandbox_check(ldc->pid, "mach-register", per_pid_service ? SANDBOX_FILTER_LOCAL_NAME : SANDBOX_FILTER_GLOBAL_NAME, servicename) > 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+#endif
+
+	// 5641783 for the embedded hack
+#if !TARGET_OS_EMBEDDED
+	/*
+	 * From a per-user/session launchd's perspective, SecurityAgent (UID
+	 * 92) is a rogue application (not our UID, not root and not a child of
+	 * us). We'll have to reconcile this design friction at a later date.
+	 */
+	if (unlikely(j->anonymous && j->mgr->parentmgr == NULL && ldc->uid != 0 && ldc->uid != getuid() && ldc->uid != 92)) {
+		if (pid1_magic) {
+			return VPROC_ERR_TRY_PER_USER;
+		} else {
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+	}
+#endif
+
+	ms = jobmgr_lookup_service(j->mgr, servicename, false, flags & BOOTSTRAP_PER_PID_SERVICE ? ldc->pid : 0);
+
+	if (unlikely(ms)) {
+		if (machservice_job(ms) != j) {
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+		if (machservice_active(ms)) {
+			job_log(j, LOG_DEBUG, "Mach service registration failed. Already active: %s", servicename);
+			return BOOTSTRAP_SERVICE_ACTIVE;
+		}
+		if (ms->recv && (serviceport != MACH_PORT_NULL)) {
+			job_log(j, LOG_ERR, "bootstrap_register() erroneously called instead of bootstrap_check_in(). Mach service: %s", servicename);
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+		job_checkin(j);
+		machservice_delete(j, ms, false);
 	}
 
-	struct eventsystem *sys = eventsystem_find(key);
-	if (unlikely(sys == NULL)) {
-		sys = eventsystem_new(key);
-		job_log(j, LOG_DEBUG, "New event system: %s", key);
+	if (likely(serviceport != MACH_PORT_NULL)) {
+		if (likely(ms = machservice_new(j, servicename, &serviceport, flags & BOOTSTRAP_PER_PID_SERVICE ? true : false))) {
+			machservice_request_notifications(ms);
+		} else {
+			return BOOTSTRAP_NO_MEMORY;
+		}
 	}
 
-	if (job_assumes(j, sys != NULL)) {
-		struct externalevent_iter_ctx ctx = {
-			.j = j,
-			.sys = sys,
-		};
 
-		job_log(j, LOG_DEBUG, "Importing events for stream: %s", key);
-		launch_data_dict_iterate(obj, externalevent_setup, &ctx);
-	}
+	return BOOTSTRAP_SUCCESS;
 }
 
-struct eventsystem *
-eventsystem_find(const char *name)
+kern_return_t
+job_mig_look_up2(job_t j, mach_port_t srp, name_t servicename, mach_port_t *serviceportp, pid_t target_pid, uuid_t instance_id, uint64_t flags)
 {
-	struct eventsystem *esi = NULL;
-	LIST_FOREACH(esi, &_s_event_systems, global_le) {
-		if (strcmp(name, esi->name) == 0) {
-			break;
-		}
+	struct machservice *ms = NULL;
+	struct ldcred *ldc = runtime_get_caller_creds();
+	kern_return_t kr;
+	bool per_pid_lookup = flags & BOOTSTRAP_PER_PID_SERVICE;
+	bool specific_instance = flags & BOOTSTRAP_SPECIFIC_INSTANCE;
+	bool strict_lookup = flags & BOOTSTRAP_STRICT_LOOKUP;
+	bool privileged = flags & BOOTSTRAP_PRIVILEGED_SERVER;
+
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	return esi;
-}
+	bool xpc_req = (j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN);
 
-void
-eventsystem_ping(void)
-{
-	if (!_launchd_event_monitor) {
-		return;
+	// 5641783 for the embedded hack
+#if !TARGET_OS_EMBEDDED
+	if (unlikely(pid1_magic && j->anonymous && j->mgr->parentmgr == NULL && ldc->uid != 0 && ldc->euid != 0)) {
+		return VPROC_ERR_TRY_PER_USER;
 	}
+#endif
 
-	if (!_launchd_event_monitor->p) {
-		(void)job_dispatch(_launchd_event_monitor, true);
+#if HAVE_SANDBOX
+	/* We don't do sandbox checking for XPC domains because, by definition, all
+	 * the services within your domain should be accessible to you.
+	 */
+	if (!xpc_req && unlikely(sandbox_check(ldc->pid, "mach-lookup", per_pid_lookup ? SANDBOX_FILTER_LOCAL_NAME : SANDBOX_FILTER_GLOBAL_NAME, servicename) > 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+#endif
+
+	if (per_pid_lookup) {
+		ms = jobmgr_lookup_service(j->mgr, servicename, false, target_pid);
 	} else {
-		if (_launchd_event_monitor->event_monitor_ready2signal) {
-			(void)job_assumes_zero_p(_launchd_event_monitor, kill(_launchd_event_monitor->p, SIGUSR1));
+		if (xpc_req) {
+			// Requests from XPC domains stay local.
+			ms = jobmgr_lookup_service(j->mgr, servicename, false, 0);
+		} else {
+			/* A strict lookup which is privileged won't even bother trying to
+			 * find a service if we're not hosting the root Mach bootstrap.
+			 */
+			if (strict_lookup && privileged) {
+				if (inherited_bootstrap_port == MACH_PORT_NULL) {
+					ms = jobmgr_lookup_service(j->mgr, servicename, true, 0);
+				}
+			} else {
+				ms = jobmgr_lookup_service(j->mgr, servicename, true, 0);
+			}
 		}
 	}
-}
-
-void
-jobmgr_dispatch_all_semaphores(jobmgr_t jm)
-{
-	jobmgr_t jmi, jmn;
-	job_t ji, jn;
 
+	if (likely(ms)) {
+		ms = ms->alias ? ms->alias : ms;
+		if (unlikely(specific_instance && ms->job->multiple_instances)) {
+			job_t ji = NULL;
+			job_t instance = NULL;
+			LIST_FOREACH(ji, &ms->job->subjobs, subjob_sle) {
+				if (uuid_compare(instance_id, ji->instance_id) == 0) {
+					instance = ji;
+					break;
+				}
+			}
 
-	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
-		jobmgr_dispatch_all_semaphores(jmi);
-	}
+			if (unlikely(instance == NULL)) {
+				job_log(ms->job, LOG_DEBUG, "Creating new instance of job based on lookup of service %s", ms->name);
+				instance = job_new_subjob(ms->job, instance_id);
+				if (job_assumes(j, instance != NULL)) {
+					/* Disable this support for now. We only support having 
+					 * multi-instance jobs within private XPC domains.
+					 */
+#if 0
+					/* If the job is multi-instance, in a singleton XPC domain
+					 * and the request is not coming from within that singleton
+					 * domain, we need to alias the new job into the requesting
+					 * domain.
+					 */
+					if (!j->mgr->xpc_singleton && xpc_req) {
+						(void)job_assumes(instance, job_new_alias(j->mgr, instance));
+					}
+#endif
+					job_dispatch(instance, false);
+				}
+			}
 
-	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
-		if (!SLIST_EMPTY(&ji->semaphores)) {
-			job_dispatch(ji, false);
+			ms = NULL;
+			if (job_assumes(j, instance != NULL)) {
+				struct machservice *msi = NULL;
+				SLIST_FOREACH(msi, &instance->machservices, sle) {
+					/* sizeof(servicename) will return the size of a pointer,
+					 * even though it's an array type, because when passing
+					 * arrays as parameters in C, they implicitly degrade to
+					 * pointers.
+					 */
+					if (strncmp(servicename, msi->name, sizeof(name_t) - 1) == 0) {
+						ms = msi;
+						break;
+					}
+				}
+			}
+		} else {
+			if (machservice_hidden(ms) && !machservice_active(ms)) {
+				ms = NULL;
+			} else if (unlikely(ms->per_user_hack)) {
+				ms = NULL;
+			}
 		}
 	}
-}
-
-time_t
-cronemu(int mon, int mday, int hour, int min)
-{
-	struct tm workingtm;
-	time_t now;
-
-	now = time(NULL);
-	workingtm = *localtime(&now);
 
-	workingtm.tm_isdst = -1;
-	workingtm.tm_sec = 0;
-	workingtm.tm_min++;
+	if (likely(ms)) {
+		(void)job_assumes(j, machservice_port(ms) != MACH_PORT_NULL);
+		job_log(j, LOG_DEBUG, "%sMach service lookup: %s", per_pid_lookup ? "Per PID " : "", servicename);
+		*serviceportp = machservice_port(ms);
 
-	while (!cronemu_mon(&workingtm, mon, mday, hour, min)) {
-		workingtm.tm_year++;
-		workingtm.tm_mon = 0;
-		workingtm.tm_mday = 1;
-		workingtm.tm_hour = 0;
-		workingtm.tm_min = 0;
-		mktime(&workingtm);
+		kr = BOOTSTRAP_SUCCESS;
+	} else if (strict_lookup && !privileged) {
+		/* Hack: We need to simulate XPC's desire not to establish a hierarchy.
+		 * So if XPC is doing the lookup, and it's not a privileged lookup, we
+		 * won't forward. But if it is a privileged lookup, then we must
+		 * forward.
+		 */
+		return BOOTSTRAP_UNKNOWN_SERVICE;
+	} else if (inherited_bootstrap_port != MACH_PORT_NULL) {
+		// Requests from within an XPC domain don't get forwarded.
+		job_log(j, LOG_DEBUG, "Mach service lookup forwarded: %s", servicename);
+		/* Clients potentially check the audit token of the reply to verify that
+		 * the returned send right is trustworthy.
+		 */
+		(void)job_assumes_zero(j, vproc_mig_look_up2_forward(inherited_bootstrap_port, srp, servicename, target_pid, instance_id, flags));
+		return MIG_NO_REPLY;
+	} else if (pid1_magic && j->anonymous && ldc->euid >= 500 && strcasecmp(j->mgr->name, VPROCMGR_SESSION_LOGINWINDOW) == 0) {
+		/* 5240036 Should start background session when a lookup of CCacheServer
+		 * occurs
+		 *
+		 * This is a total hack. We sniff out loginwindow session, and attempt
+		 * to guess what it is up to. If we find a EUID that isn't root, we
+		 * force it over to the per-user context.
+		 */
+		return VPROC_ERR_TRY_PER_USER;
+	} else {
+		job_log(j, LOG_DEBUG, "%sMach service lookup failed: %s", per_pid_lookup ? "Per PID " : "", servicename);
+		kr = BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	return mktime(&workingtm);
+	return kr;
 }
 
-time_t
-cronemu_wday(int wday, int hour, int min)
+kern_return_t
+job_mig_parent(job_t j, mach_port_t srp, mach_port_t *parentport)
 {
-	struct tm workingtm;
-	time_t now;
-
-	now = time(NULL);
-	workingtm = *localtime(&now);
-
-	workingtm.tm_isdst = -1;
-	workingtm.tm_sec = 0;
-	workingtm.tm_min++;
-
-	if (wday == 7) {
-		wday = 0;
-	}
-
-	while (!(workingtm.tm_wday == wday && cronemu_hour(&workingtm, hour, min))) {
-		workingtm.tm_mday++;
-		workingtm.tm_hour = 0;
-		workingtm.tm_min = 0;
-		mktime(&workingtm);
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	return mktime(&workingtm);
-}
-
-bool
-cronemu_mon(struct tm *wtm, int mon, int mday, int hour, int min)
-{
-	if (mon == -1) {
-		struct tm workingtm = *wtm;
-		int carrytest;
+	job_log(j, LOG_DEBUG, "Requested parent bootstrap port");
+	jobmgr_t jm = j->mgr;
 
-		while (!cronemu_mday(&workingtm, mday, hour, min)) {
-			workingtm.tm_mon++;
-			workingtm.tm_mday = 1;
-			workingtm.tm_hour = 0;
-			workingtm.tm_min = 0;
-			carrytest = workingtm.tm_mon;
-			mktime(&workingtm);
-			if (carrytest != workingtm.tm_mon) {
-				return false;
-			}
-		}
-		*wtm = workingtm;
-		return true;
+	if (jobmgr_parent(jm)) {
+		*parentport = jobmgr_parent(jm)->jm_port;
+	} else if (MACH_PORT_NULL == inherited_bootstrap_port) {
+		*parentport = jm->jm_port;
+	} else {
+		(void)job_assumes_zero(j, vproc_mig_parent_forward(inherited_bootstrap_port, srp));
+		// The previous routine moved the reply port, we're forced to return MIG_NO_REPLY now
+		return MIG_NO_REPLY;
 	}
+	return BOOTSTRAP_SUCCESS;
+}
 
-	if (mon < wtm->tm_mon) {
-		return false;
+kern_return_t
+job_mig_get_root_bootstrap(job_t j, mach_port_t *rootbsp)
+{
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (mon > wtm->tm_mon) {
-		wtm->tm_mon = mon;
-		wtm->tm_mday = 1;
-		wtm->tm_hour = 0;
-		wtm->tm_min = 0;
+	if (inherited_bootstrap_port == MACH_PORT_NULL) {
+		*rootbsp = root_jobmgr->jm_port;
+		(void)job_assumes_zero(j, launchd_mport_make_send(root_jobmgr->jm_port));
+	} else {
+		*rootbsp = inherited_bootstrap_port;
+		(void)job_assumes_zero(j, launchd_mport_copy_send(inherited_bootstrap_port));
 	}
 
-	return cronemu_mday(wtm, mday, hour, min);
+	return BOOTSTRAP_SUCCESS;
 }
 
-bool
-cronemu_mday(struct tm *wtm, int mday, int hour, int min)
+/* The directory is ordered by service name and then by owning job, each cut
+ * to what fits in a name_t, since that's all a caller paging through it sees.
+ * A NULL owner sorts before every job.
+ */
+int
+jobmgr_service_directory_cmp(struct machservice *ms, const char *name, const char *owner)
 {
-	if (mday == -1) {
-		struct tm workingtm = *wtm;
-		int carrytest;
+	int r = strncmp(ms->name, name, sizeof(name_t) - 1);
 
-		while (!cronemu_hour(&workingtm, hour, min)) {
-			workingtm.tm_mday++;
-			workingtm.tm_hour = 0;
-			workingtm.tm_min = 0;
-			carrytest = workingtm.tm_mday;
-			mktime(&workingtm);
-			if (carrytest != workingtm.tm_mday) {
-				return false;
-			}
-		}
-		*wtm = workingtm;
-		return true;
+	if (r || !owner) {
+		return r;
 	}
 
-	if (mday < wtm->tm_mday) {
-		return false;
-	}
+	return strncmp(machservice_owner_name(ms), owner, sizeof(name_t) - 1);
+}
 
-	if (mday > wtm->tm_mday) {
-		wtm->tm_mday = mday;
-		wtm->tm_hour = 0;
-		wtm->tm_min = 0;
+// Returns the index of the first entry not less than (name, owner).
+size_t
+jobmgr_service_directory_find(jobmgr_t jm, const char *name, const char *owner)
+{
+	size_t lo = 0, hi = jm->ms_dir_cnt;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (jobmgr_service_directory_cmp(jm->ms_dir[mid], name, owner) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
 
-	return cronemu_hour(wtm, hour, min);
+	return lo;
 }
 
-bool
-cronemu_hour(struct tm *wtm, int hour, int min)
+kern_return_t
+jobmgr_service_directory_copy(jobmgr_t jm, size_t start, size_t cnt, name_array_t *namesp, name_array_t *jobsp, bootstrap_status_array_t *activesp)
 {
-	if (hour == -1) {
-		struct tm workingtm = *wtm;
-		int carrytest;
+	name_array_t service_names = NULL;
+	name_array_t service_jobs = NULL;
+	bootstrap_status_array_t service_actives = NULL;
+	size_t i = 0;
 
-		while (!cronemu_min(&workingtm, min)) {
-			workingtm.tm_hour++;
-			workingtm.tm_min = 0;
-			carrytest = workingtm.tm_hour;
-			mktime(&workingtm);
-			if (carrytest != workingtm.tm_hour) {
-				return false;
-			}
-		}
-		*wtm = workingtm;
-		return true;
+	*namesp = NULL;
+	*jobsp = NULL;
+	*activesp = NULL;
+
+	if (cnt == 0) {
+		return BOOTSTRAP_SUCCESS;
 	}
 
-	if (hour < wtm->tm_hour) {
-		return false;
+	mig_allocate((vm_address_t *)&service_names, cnt * sizeof(service_names[0]));
+	if (!jobmgr_assumes(jm, service_names != NULL)) {
+		goto out_bad;
 	}
 
-	if (hour > wtm->tm_hour) {
-		wtm->tm_hour = hour;
-		wtm->tm_min = 0;
+	mig_allocate((vm_address_t *)&service_jobs, cnt * sizeof(service_jobs[0]));
+	if (!jobmgr_assumes(jm, service_jobs != NULL)) {
+		goto out_bad;
 	}
 
-	return cronemu_min(wtm, min);
-}
+	mig_allocate((vm_address_t *)&service_actives, cnt * sizeof(service_actives[0]));
+	if (!jobmgr_assumes(jm, service_actives != NULL)) {
+		goto out_bad;
+	}
 
-bool
-cronemu_min(struct tm *wtm, int min)
-{
-	if (min == -1) {
-		return true;
+	for (i = 0; i < cnt; i++) {
+		struct machservice *msi = jm->ms_dir[start + i];
+
+		strlcpy(service_names[i], machservice_name(msi), sizeof(service_names[0]));
+		strlcpy(service_jobs[i], machservice_owner_name(msi), sizeof(service_jobs[0]));
+		msi = msi->alias ? msi->alias : msi;
+		service_actives[i] = machservice_status(msi);
 	}
 
-	if (min < wtm->tm_min) {
-		return false;
+	*namesp = service_names;
+	*jobsp = service_jobs;
+	*activesp = service_actives;
+
+	return BOOTSTRAP_SUCCESS;
+
+out_bad:
+	if (service_names) {
+		mig_deallocate((vm_address_t)service_names, cnt * sizeof(service_names[0]));
+	}
+	if (service_jobs) {
+		mig_deallocate((vm_address_t)service_jobs, cnt * sizeof(service_jobs[0]));
+	}
+	if (service_actives) {
+		mig_deallocate((vm_address_t)service_actives, cnt * sizeof(service_actives[0]));
 	}
 
-	if (min > wtm->tm_min) {
-		wtm->tm_min = min;
+	return BOOTSTRAP_NO_MEMORY;
+}
+
+static jobmgr_t
+job_mig_info_target(job_t j, uint64_t flags)
+{
+	if (launchd_flat_mach_namespace) {
+		if ((j->mgr->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET) || (flags & BOOTSTRAP_FORCE_LOCAL)) {
+			return j->mgr;
+		}
+
+		return root_jobmgr;
 	}
 
-	return true;
+	return j->mgr;
 }
 
 kern_return_t
-job_mig_create_server(job_t j, cmd_t server_cmd, uid_t server_uid, boolean_t on_demand, mach_port_t *server_portp)
+job_mig_info(job_t j, name_array_t *servicenamesp,
+	unsigned int *servicenames_cnt, name_array_t *servicejobsp,
+	unsigned int *servicejobs_cnt, bootstrap_status_array_t *serviceactivesp,
+	unsigned int *serviceactives_cnt, uint64_t flags)
 {
-	struct ldcred *ldc = runtime_get_caller_creds();
-	job_t js;
+	kern_return_t kr;
+	jobmgr_t jm;
 
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (unlikely(j->deny_job_creation)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-
-#if HAVE_SANDBOX
-	const char **argv = (const char **)mach_cmd2argv(server_cmd);
-	if (unlikely(argv == NULL)) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
-	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_PATH, argv[0]) > 0)) {
-		free(argv);
-		return BOOTSTRAP_NOT_PRIVILEGED;
+#if TARGET_OS_EMBEDDED
+	struct ldcred *ldc = runtime_get_caller_creds();
+	if (ldc->euid) {
+		return EPERM;
 	}
-	free(argv);
-#endif
-
-	job_log(j, LOG_DEBUG, "Server create attempt: %s", server_cmd);
+#endif // TARGET_OS_EMBEDDED
 
-	if (pid1_magic) {
-		if (ldc->euid || ldc->uid) {
-			job_log(j, LOG_WARNING, "Server create attempt moved to per-user launchd: %s", server_cmd);
-			return VPROC_ERR_TRY_PER_USER;
-		}
-	} else {
-		if (unlikely(server_uid != getuid())) {
-			job_log(j, LOG_WARNING, "Server create: \"%s\": As UID %d, we will not be able to switch to UID %d",
-					server_cmd, getuid(), server_uid);
-		}
-		server_uid = 0; // zero means "do nothing"
+	jm = job_mig_info_target(j, flags);
+	// A listing that stops partway through the parent's subset would be a lie.
+	if (unlikely(jm->subset_import)) {
+		jobmgr_subset_import_step(jm, SIZE_MAX);
 	}
 
-	js = job_new_via_mach_init(j, server_cmd, server_uid, on_demand);
-
-	if (unlikely(js == NULL)) {
-		return BOOTSTRAP_NO_MEMORY;
+	kr = jobmgr_service_directory_copy(jm, 0, jm->ms_dir_cnt, servicenamesp, servicejobsp, serviceactivesp);
+	if (kr == BOOTSTRAP_SUCCESS) {
+		*servicenames_cnt = *servicejobs_cnt = *serviceactives_cnt = (unsigned int)jm->ms_dir_cnt;
 	}
 
-	*server_portp = js->j_port;
-	return BOOTSTRAP_SUCCESS;
+	return kr;
 }
 
 kern_return_t
-job_mig_send_signal(job_t j, mach_port_t srp, name_t targetlabel, int sig)
+job_mig_info_page(job_t j, name_t prefix, name_t after, name_t after_job, uint32_t limit,
+	name_array_t *servicenamesp, unsigned int *servicenames_cnt,
+	name_array_t *servicejobsp, unsigned int *servicejobs_cnt,
+	bootstrap_status_array_t *serviceactivesp, unsigned int *serviceactives_cnt,
+	boolean_t *more, uint64_t flags)
 {
-	struct ldcred *ldc = runtime_get_caller_creds();
-	job_t otherj;
+	size_t start, end, prefix_len;
+	kern_return_t kr;
+	jobmgr_t jm;
 
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (unlikely(ldc->euid != 0 && ldc->euid != getuid()) || j->deny_job_creation) {
-#if TARGET_OS_EMBEDDED	
-		if (!j->embedded_god) {
-			return BOOTSTRAP_NOT_PRIVILEGED;
-		}
-#else
-		return BOOTSTRAP_NOT_PRIVILEGED;
-#endif
-	}
-
-#if HAVE_SANDBOX
-	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+#if TARGET_OS_EMBEDDED
+	struct ldcred *ldc = runtime_get_caller_creds();
+	if (ldc->euid) {
+		return EPERM;
 	}
-#endif
+#endif // TARGET_OS_EMBEDDED
 
-	if (unlikely(!(otherj = job_find(NULL, targetlabel)))) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+	jm = job_mig_info_target(j, flags);
+	if (unlikely(jm->subset_import)) {
+		jobmgr_subset_import_step(jm, SIZE_MAX);
 	}
+	prefix_len = strnlen(prefix, sizeof(name_t));
 
-#if TARGET_OS_EMBEDDED
-	if (j->embedded_god) {
-		if (j->username && otherj->username) {
-			if (strcmp(j->username, otherj->username) != 0) {
-				return BOOTSTRAP_NOT_PRIVILEGED;
-			}
-		} else {
-			return BOOTSTRAP_NOT_PRIVILEGED;
+	/* Resume strictly after the last entry the caller saw rather than at an
+	 * index, so that services coming and going between pages don't cause
+	 * entries to be skipped or repeated. Several jobs can offer the same name,
+	 * so the entry is the name and job together.
+	 */
+	if (after[0] && strncmp(after, prefix, prefix_len) >= 0) {
+		start = jobmgr_service_directory_find(jm, after, after_job);
+		while (start < jm->ms_dir_cnt && jobmgr_service_directory_cmp(jm->ms_dir[start], after, after_job) == 0) {
+			start++;
 		}
+	} else {
+		start = jobmgr_service_directory_find(jm, prefix, NULL);
 	}
-#endif	
 
-	if (sig == VPROC_MAGIC_UNLOAD_SIGNAL) {
-		bool do_block = otherj->p;
-
-		if (otherj->anonymous) {
-			return BOOTSTRAP_NOT_PRIVILEGED;
-		}
+	end = start;
+	while (end < jm->ms_dir_cnt && (limit == 0 || end - start < limit) && strncmp(jm->ms_dir[end]->name, prefix, prefix_len) == 0) {
+		end++;
+	}
 
-		job_remove(otherj);
+	*more = (end < jm->ms_dir_cnt && strncmp(jm->ms_dir[end]->name, prefix, prefix_len) == 0);
 
-		if (do_block) {
-			job_log(j, LOG_DEBUG, "Blocking MIG return of job_remove(): %s", otherj->label);
-			// this is messy. We shouldn't access 'otherj' after job_remove(), but we check otherj->p first...
-			(void)job_assumes(otherj, waiting4removal_new(otherj, srp));
-			return MIG_NO_REPLY;
-		} else {
-			return 0;
-		}
-	} else if (otherj->p) {
-		(void)job_assumes_zero_p(j, kill2(otherj->p, sig));
+	kr = jobmgr_service_directory_copy(jm, start, end - start, servicenamesp, servicejobsp, serviceactivesp);
+	if (kr == BOOTSTRAP_SUCCESS) {
+		*servicenames_cnt = *servicejobs_cnt = *serviceactives_cnt = (unsigned int)(end - start);
 	}
 
-	return 0;
+	return kr;
 }
 
 kern_return_t
-job_mig_log_forward(job_t j, vm_offset_t inval, mach_msg_type_number_t invalCnt)
+job_mig_lookup_children(job_t j, mach_port_array_t *child_ports,
+	mach_msg_type_number_t *child_ports_cnt, name_array_t *child_names,
+	mach_msg_type_number_t *child_names_cnt,
+	bootstrap_property_array_t *child_properties,
+	mach_msg_type_number_t *child_properties_cnt)
 {
-	struct ldcred *ldc = runtime_get_caller_creds();
-
+	kern_return_t kr = BOOTSTRAP_NO_MEMORY;
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (!job_assumes(j, j->per_user)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-
-	return launchd_log_forward(ldc->euid, ldc->egid, inval, invalCnt);
-}
-
-kern_return_t
-job_mig_log_drain(job_t j, mach_port_t srp, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt)
-{
 	struct ldcred *ldc = runtime_get_caller_creds();
 
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
-
-	if (unlikely(ldc->euid)) {
+	/* Only allow root processes to look up children, even if we're in the per-user launchd.
+	 * Otherwise, this could be used to cross sessions, which counts as a security vulnerability
+	 * in a non-flat namespace.
+	 */
+	if (ldc->euid != 0) {
+		job_log(j, LOG_WARNING, "Attempt to look up children of bootstrap by unprivileged job.");
 		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	return launchd_log_drain(srp, outval, outvalCnt);
-}
-
-kern_return_t
-job_mig_swap_complex(job_t j, vproc_gsk_t inkey, vproc_gsk_t outkey,
-	vm_offset_t inval, mach_msg_type_number_t invalCnt, vm_offset_t *outval,
-	mach_msg_type_number_t *outvalCnt)
-{
-	const char *action;
-	launch_data_t input_obj = NULL, output_obj = NULL;
-	size_t data_offset = 0;
-	size_t packed_size;
-	struct ldcred *ldc = runtime_get_caller_creds();
+	unsigned int cnt = 0;
 
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	jobmgr_t jmr = j->mgr;
+	jobmgr_t jmi = NULL;
+	SLIST_FOREACH(jmi, &jmr->submgrs, sle) {
+		cnt++;
 	}
 
-	if (inkey && ldc->pid != j->p) {
-		if (ldc->euid && ldc->euid != getuid()) {
-			return BOOTSTRAP_NOT_PRIVILEGED;
+	// Find our per-user launchds if we're PID 1.
+	job_t ji = NULL;
+	if (pid1_magic) {
+		LIST_FOREACH(ji, &jmr->jobs, sle) {
+			cnt += ji->per_user ? 1 : 0;
 		}
- 	}
-
-	if (unlikely(inkey && outkey && !job_assumes(j, inkey == outkey))) {
-		return 1;
 	}
 
-	if (inkey && outkey) {
-		action = "Swapping";
-	} else if (inkey) {
-		action = "Setting";
-	} else {
-		action = "Getting";
+	if (cnt == 0) {
+		return BOOTSTRAP_NO_CHILDREN;
 	}
 
-	job_log(j, LOG_DEBUG, "%s key: %u", action, inkey ? inkey : outkey);
+	mach_port_array_t _child_ports = NULL;
+	name_array_t _child_names = NULL;
+	bootstrap_property_array_t _child_properties = NULL;
 
-	*outvalCnt = 20 * 1024 * 1024;
-	mig_allocate(outval, *outvalCnt);
-	if (!job_assumes(j, *outval != 0)) {
-		return 1;
+	mig_allocate((vm_address_t *)&_child_ports, cnt * sizeof(_child_ports[0]));
+	if (!job_assumes(j, _child_ports != NULL)) {
+		kr = BOOTSTRAP_NO_MEMORY;
+		goto out_bad;
 	}
 
-	/* Note to future maintainers: launch_data_unpack() does NOT return a heap
-	 * object. The data is decoded in-place. So do not call launch_data_free()
-	 * on input_obj.
-	 */
-	runtime_ktrace0(RTKT_LAUNCHD_DATA_UNPACK);
-	if (unlikely(invalCnt && !job_assumes(j, (input_obj = launch_data_unpack((void *)inval, invalCnt, NULL, 0, &data_offset, NULL)) != NULL))) {
+	mig_allocate((vm_address_t *)&_child_names, cnt * sizeof(_child_names[0]));
+	if (!job_assumes(j, _child_names != NULL)) {
+		kr = BOOTSTRAP_NO_MEMORY;
 		goto out_bad;
 	}
 
-	char *store = NULL;
-	switch (outkey) {
-	case VPROC_GSK_ENVIRONMENT:
-		if (!job_assumes(j, (output_obj = launch_data_alloc(LAUNCH_DATA_DICTIONARY)))) {
-			goto out_bad;
-		}
-		jobmgr_export_env_from_other_jobs(j->mgr, output_obj);
-		runtime_ktrace0(RTKT_LAUNCHD_DATA_PACK);
-		if (!job_assumes(j, launch_data_pack(output_obj, (void *)*outval, *outvalCnt, NULL, NULL) != 0)) {
-			goto out_bad;
-		}
-		launch_data_free(output_obj);
-		break;
-	case VPROC_GSK_ALLJOBS:
-		if (!job_assumes(j, (output_obj = job_export_all()) != NULL)) {
-			goto out_bad;
-		}
-		ipc_revoke_fds(output_obj);
-		runtime_ktrace0(RTKT_LAUNCHD_DATA_PACK);
-		packed_size = launch_data_pack(output_obj, (void *)*outval, *outvalCnt, NULL, NULL);
-		if (!job_assumes(j, packed_size != 0)) {
-			goto out_bad;
-		}
-		launch_data_free(output_obj);
-		break;
-	case VPROC_GSK_MGR_NAME:
-		if (!job_assumes(j, (output_obj = launch_data_new_string(j->mgr->name)) != NULL)) {
-			goto out_bad;
-		}
-		packed_size = launch_data_pack(output_obj, (void *)*outval, *outvalCnt, NULL, NULL);
-		if (!job_assumes(j, packed_size != 0)) {
-			goto out_bad;
-		}
+	mig_allocate((vm_address_t *)&_child_properties, cnt * sizeof(_child_properties[0]));
+	if (!job_assumes(j, _child_properties != NULL)) {
+		kr = BOOTSTRAP_NO_MEMORY;
+		goto out_bad;
+	}
 
-		launch_data_free(output_obj);
-		break;
-	case VPROC_GSK_JOB_OVERRIDES_DB:
-		store = launchd_copy_persistent_store(LAUNCHD_PERSISTENT_STORE_DB, "overrides.plist");
-		if (!store || !job_assumes(j, (output_obj = launch_data_new_string(store)) != NULL)) {
-			free(store);
-			goto out_bad;
+	unsigned int cnt2 = 0;
+	SLIST_FOREACH(jmi, &jmr->submgrs, sle) {
+		if (jobmgr_assumes_zero(jmi, launchd_mport_make_send(jmi->jm_port)) == KERN_SUCCESS) {
+			_child_ports[cnt2] = jmi->jm_port;
+		} else {
+			_child_ports[cnt2] = MACH_PORT_NULL;
 		}
 
-		free(store);
-		packed_size = launch_data_pack(output_obj, (void *)*outval, *outvalCnt, NULL, NULL);
-		if (!job_assumes(j, packed_size != 0)) {
-			goto out_bad;
-		}
+		strlcpy(_child_names[cnt2], jmi->name, sizeof(_child_names[0]));
+		_child_properties[cnt2] = jmi->properties;
 
-		launch_data_free(output_obj);
-		break;
-	case VPROC_GSK_ZERO:
-		mig_deallocate(*outval, *outvalCnt);
-		*outval = 0;
-		*outvalCnt = 0;
-		break;
-	default:
-		goto out_bad;
+		cnt2++;
 	}
 
-	mig_deallocate(inval, invalCnt);
-	return 0;
+	if (pid1_magic) LIST_FOREACH(ji, &jmr->jobs, sle) {
+		if (ji->per_user) {
+			if (job_assumes(ji, SLIST_FIRST(&ji->machservices)->per_user_hack == true)) {
+				mach_port_t port = machservice_port(SLIST_FIRST(&ji->machservices));
 
-out_bad:
-	mig_deallocate(inval, invalCnt);
-	if (*outval) {
-		mig_deallocate(*outval, *outvalCnt);
-	}
-	if (output_obj) {
-		launch_data_free(output_obj);
+				if (job_assumes_zero(ji, launchd_mport_copy_send(port)) == KERN_SUCCESS) {
+					_child_ports[cnt2] = port;
+				} else {
+					_child_ports[cnt2] = MACH_PORT_NULL;
+				}
+			} else {
+				_child_ports[cnt2] = MACH_PORT_NULL;
+			}
+
+			strlcpy(_child_names[cnt2], ji->label, sizeof(_child_names[0]));
+			_child_properties[cnt2] |= BOOTSTRAP_PROPERTY_PERUSER;
+
+			cnt2++;
+		}
 	}
 
-	return 1;
-}
+	*child_names_cnt = cnt;
+	*child_ports_cnt = cnt;
+	*child_properties_cnt = cnt;
 
-kern_return_t
-job_mig_swap_integer(job_t j, vproc_gsk_t inkey, vproc_gsk_t outkey, int64_t inval, int64_t *outval)
-{
-	const char *action;
-	kern_return_t kr = 0;
-	struct ldcred *ldc = runtime_get_caller_creds();
-	int oldmask;
+	*child_names = _child_names;
+	*child_ports = _child_ports;
+	*child_properties = _child_properties;
 
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	unsigned int i = 0;
+	for (i = 0; i < cnt; i++) {
+		job_log(j, LOG_DEBUG, "child_names[%u] = %s", i, (char *)_child_names[i]);
 	}
 
-	if (inkey && ldc->pid != j->p) {
-		if (ldc->euid && ldc->euid != getuid()) {
-			return BOOTSTRAP_NOT_PRIVILEGED;
-		}
- 	}
+	return BOOTSTRAP_SUCCESS;
+out_bad:
+	if (_child_ports) {
+		mig_deallocate((vm_address_t)_child_ports, cnt * sizeof(_child_ports[0]));
+	}
 
-	if (unlikely(inkey && outkey && !job_assumes(j, inkey == outkey))) {
-		return 1;
+	if (_child_names) {
+		mig_deallocate((vm_address_t)_child_names, cnt * sizeof(_child_names[0]));
 	}
 
-	if (inkey && outkey) {
-		action = "Swapping";
-	} else if (inkey) {
-		action = "Setting";
-	} else {
-		action = "Getting";
+	if (_child_properties) {
+		mig_deallocate((vm_address_t)_child_properties, cnt * sizeof(_child_properties[0]));
 	}
 
-	job_log(j, LOG_DEBUG, "%s key: %u", action, inkey ? inkey : outkey);
+	return kr;
+}
 
-	switch (outkey) {
-	case VPROC_GSK_ABANDON_PROCESS_GROUP:
-		*outval = j->abandon_pg;
-		break;
-	case VPROC_GSK_LAST_EXIT_STATUS:
-		*outval = j->last_exit_status;
-		break;
-	case VPROC_GSK_MGR_UID:
-		*outval = getuid();
-		break;
-	case VPROC_GSK_MGR_PID:
-		*outval = getpid();
-		break;
-	case VPROC_GSK_IS_MANAGED:
-		*outval = j->anonymous ? 0 : 1;
-		break;
-	case VPROC_GSK_BASIC_KEEPALIVE:
-		*outval = !j->ondemand;
-		break;
-	case VPROC_GSK_START_INTERVAL:
-		*outval = j->start_interval;
-		break;
-	case VPROC_GSK_IDLE_TIMEOUT:
-		*outval = j->timeout;
-		break;
-	case VPROC_GSK_EXIT_TIMEOUT:
-		*outval = j->exit_timeout;
-		break;
-	case VPROC_GSK_GLOBAL_LOG_MASK:
-		oldmask = runtime_setlogmask(LOG_UPTO(LOG_DEBUG));
-		*outval = oldmask;
-		runtime_setlogmask(oldmask);
-		break;
-	case VPROC_GSK_GLOBAL_UMASK:
-		oldmask = umask(0);
-		*outval = oldmask;
-		umask(oldmask);
-		break;
-	case VPROC_GSK_TRANSACTIONS_ENABLED:
-		job_log(j, LOG_DEBUG, "Reading EnableTransactions value.");
-		*outval = j->enable_transactions;
-		break;
-	case VPROC_GSK_WAITFORDEBUGGER:
-		*outval = j->wait4debugger;
-		break;
-	case VPROC_GSK_EMBEDDEDROOTEQUIVALENT:
-		*outval = j->embedded_god;
-		break;
-	case VPROC_GSK_ZERO:
-		*outval = 0;
-		break;
-	default:
-		kr = 1;
-		break;
+static size_t
+jobmgr_count_perusers_deep(jobmgr_t jm)
+{
+	size_t cnt = 0;
+	jobmgr_t jmi = NULL;
+	job_t ji = NULL;
+
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		cnt += jobmgr_count_perusers_deep(jmi);
+	}
+
+	LIST_FOREACH(ji, &jm->jobs, sle) {
+		cnt += ji->per_user ? 1 : 0;
 	}
 
-	switch (inkey) {
-	case VPROC_GSK_ABANDON_PROCESS_GROUP:
-		j->abandon_pg = (bool)inval;
-		break;
-	case VPROC_GSK_GLOBAL_ON_DEMAND:
-		job_log(j, LOG_DEBUG, "Job has set global on-demand mode to: %s", inval ? "true" : "false");
-		kr = job_set_global_on_demand(j, inval);
-		break;
-	case VPROC_GSK_BASIC_KEEPALIVE:
-		j->ondemand = !inval;
-		break;
-	case VPROC_GSK_START_INTERVAL:
-		if (inval > UINT32_MAX || inval < 0) {
-			kr = 1;
-		} else if (inval) {
-			if (j->start_interval == 0) {
-				runtime_add_weak_ref();
-			}
-			j->start_interval = (typeof(j->start_interval)) inval;
-			(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_ADD, NOTE_SECONDS, j->start_interval, j));
-		} else if (j->start_interval) {
-			(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_DELETE, 0, 0, NULL));
-			if (j->start_interval != 0) {
-				runtime_del_weak_ref();
-			}
-			j->start_interval = 0;
-		}
-		break;
-	case VPROC_GSK_IDLE_TIMEOUT:
-		if (inval < 0 || inval > UINT32_MAX) {
-			kr = 1;
-		} else {
-			j->timeout = (typeof(j->timeout)) inval;
+	return cnt;
+}
+
+static launch_data_t
+jobmgr_export_tree(jobmgr_t jm, mach_port_array_t ports, mach_msg_type_number_t *port_cnt)
+{
+	launch_data_t r = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	launch_data_t services = launch_data_alloc(LAUNCH_DATA_ARRAY);
+	launch_data_t children = launch_data_alloc(LAUNCH_DATA_ARRAY);
+	launch_data_t tmp = NULL;
+
+	if (!r || !services || !children) {
+		goto out_bad;
+	}
+
+	if (unlikely(jm->subset_import)) {
+		jobmgr_subset_import_step(jm, SIZE_MAX);
+	}
+
+	if ((tmp = launch_data_new_string(jm->name))) {
+		launch_data_dict_insert(r, tmp, BOOTSTRAP_TREE_NAME);
+	}
+	if ((tmp = launch_data_new_integer(jm->properties))) {
+		launch_data_dict_insert(r, tmp, BOOTSTRAP_TREE_PROPERTIES);
+	}
+
+	size_t i = 0, cnt = 0;
+	for (i = 0; i < jm->ms_dir_cnt; i++) {
+		struct machservice *msi = jm->ms_dir[i];
+
+		launch_data_t ms_dict = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+		if (!jobmgr_assumes(jm, ms_dict != NULL)) {
+			goto out_bad;
 		}
-		break;
-	case VPROC_GSK_EXIT_TIMEOUT:
-		if (inval < 0 || inval > UINT32_MAX) {
-			kr = 1;
-		} else {
-			j->exit_timeout = (typeof(j->exit_timeout)) inval;
+
+		if ((tmp = launch_data_new_string(machservice_name(msi)))) {
+			launch_data_dict_insert(ms_dict, tmp, BOOTSTRAP_TREE_SERVICE_NAME);
 		}
-		break;
-	case VPROC_GSK_GLOBAL_LOG_MASK:
-		if (inval < 0 || inval > UINT32_MAX) {
-			kr = 1;
-		} else {
-			runtime_setlogmask((int) inval);
+
+		struct machservice *owner = msi->alias ? msi->alias : msi;
+		const char *job_name = machservice_owner_name(msi);
+		if ((tmp = launch_data_new_string(job_name))) {
+			launch_data_dict_insert(ms_dict, tmp, BOOTSTRAP_TREE_SERVICE_JOB);
 		}
-		break;
-	case VPROC_GSK_GLOBAL_UMASK:
-		__OS_COMPILETIME_ASSERT__(sizeof (mode_t) == 2);
-		if (inval < 0 || inval > UINT16_MAX) {
-			kr = 1;
-		} else {
-#if HAVE_SANDBOX
-			if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
-				kr = 1;
-			} else {
-				umask((mode_t) inval);
-			}
-#endif
+		if ((tmp = launch_data_new_integer(machservice_status(owner)))) {
+			launch_data_dict_insert(ms_dict, tmp, BOOTSTRAP_TREE_SERVICE_STATUS);
 		}
-		break;
-	case VPROC_GSK_TRANSACTIONS_ENABLED:
-		/* No-op. */
-		break;
-	case VPROC_GSK_WEIRD_BOOTSTRAP:
-		if (job_assumes(j, j->weird_bootstrap)) {
-			job_log(j, LOG_DEBUG, "Unsetting weird bootstrap.");
 
-			mach_msg_size_t mxmsgsz = (typeof(mxmsgsz)) sizeof(union __RequestUnion__job_mig_job_subsystem);
+		launch_data_array_set_index(services, ms_dict, cnt++);
+	}
 
-			if (job_mig_job_subsystem.maxsize > mxmsgsz) {
-				mxmsgsz = job_mig_job_subsystem.maxsize;
-			}
+	cnt = 0;
+	jobmgr_t jmi = NULL;
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		if (!(tmp = jobmgr_export_tree(jmi, ports, port_cnt))) {
+			goto out_bad;
+		}
+		launch_data_array_set_index(children, tmp, cnt++);
+	}
 
-			(void)job_assumes_zero(j, runtime_add_mport(j->mgr->jm_port, job_server));
-			j->weird_bootstrap = false;
+	/* Per-user launchds are separate processes, so we can't describe their
+	 * trees. Hand back a send right instead, and the caller can ask them for
+	 * their own snapshot.
+	 */
+	job_t ji = NULL;
+	if (pid1_magic) LIST_FOREACH(ji, &jm->jobs, sle) {
+		if (!ji->per_user) {
+			continue;
 		}
-		break;
-	case VPROC_GSK_WAITFORDEBUGGER:
-		j->wait4debugger_oneshot = inval;
-		break;
-	case VPROC_GSK_PERUSER_SUSPEND:
-		if (job_assumes(j, pid1_magic && ldc->euid == 0)) {
-			mach_port_t junk = MACH_PORT_NULL;
-			job_t jpu = jobmgr_lookup_per_user_context_internal(j, (uid_t)inval, &junk);
-			if (job_assumes(j, jpu != NULL)) {
-				struct suspended_peruser *spi = NULL;
-				LIST_FOREACH(spi, &j->suspended_perusers, sle) {
-					if ((int64_t)(spi->j->mach_uid) == inval) {
-						job_log(j, LOG_WARNING, "Job tried to suspend per-user launchd for UID %lli twice.", inval);
-						break;
-					}
-				}
 
-				if (spi == NULL) {
-					job_log(j, LOG_INFO, "Job is suspending the per-user launchd for UID %lli.", inval);
-					spi = (struct suspended_peruser *)calloc(sizeof(struct suspended_peruser), 1);
-					if (job_assumes(j, spi != NULL)) {
-						/* Stop listening for events.
-						 *
-						 * See <rdar://problem/9014146>.
-						 */
-						if (jpu->peruser_suspend_count == 0) {
-							job_ignore(jpu);
-						}
+		launch_data_t child = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+		if (!job_assumes(ji, child != NULL)) {
+			goto out_bad;
+		}
 
-						spi->j = jpu;
-						spi->j->peruser_suspend_count++;
-						LIST_INSERT_HEAD(&j->suspended_perusers, spi, sle);
-						job_stop(spi->j);
-						*outval = jpu->p;
-					} else {
-						kr = BOOTSTRAP_NO_MEMORY;
-					}
-				}
-			}
-		} else {
-			kr = 1;
+		if ((tmp = launch_data_new_string(ji->label))) {
+			launch_data_dict_insert(child, tmp, BOOTSTRAP_TREE_NAME);
+		}
+		if ((tmp = launch_data_new_integer(BOOTSTRAP_PROPERTY_PERUSER))) {
+			launch_data_dict_insert(child, tmp, BOOTSTRAP_TREE_PROPERTIES);
 		}
-		break;
-	case VPROC_GSK_PERUSER_RESUME:
-		if (job_assumes(j, pid1_magic == true)) {
-			struct suspended_peruser *spi = NULL, *spt = NULL;
-			LIST_FOREACH_SAFE(spi, &j->suspended_perusers, sle, spt) {
-				if ((int64_t)(spi->j->mach_uid) == inval) {
-					spi->j->peruser_suspend_count--;
-					LIST_REMOVE(spi, sle);
-					job_log(j, LOG_INFO, "Job is resuming the per-user launchd for UID %lli.", inval);
-					break;
-				}
-			}
 
-			if (!job_assumes(j, spi != NULL)) {
-				job_log(j, LOG_WARNING, "Job tried to resume per-user launchd for UID %lli that it did not suspend.", inval);
-				kr = BOOTSTRAP_NOT_PRIVILEGED;
-			} else if (spi->j->peruser_suspend_count == 0) {
-				job_watch(spi->j);
-				job_dispatch(spi->j, false);
-				free(spi);
+		struct machservice *ms = SLIST_FIRST(&ji->machservices);
+		if (job_assumes(ji, ms != NULL && ms->per_user_hack == true)) {
+			mach_port_t port = machservice_port(ms);
+			if (job_assumes_zero(ji, launchd_mport_copy_send(port)) == KERN_SUCCESS) {
+				ports[*port_cnt] = port;
+				if ((tmp = launch_data_new_integer(*port_cnt))) {
+					launch_data_dict_insert(child, tmp, BOOTSTRAP_TREE_PORTINDEX);
+				}
+				(*port_cnt)++;
 			}
-		} else {
-			kr = 1;
 		}
-		break;
-	case VPROC_GSK_ZERO:
-		break;
-	default:
-		kr = 1;
-		break;
+
+		launch_data_array_set_index(children, child, cnt++);
 	}
 
-	return kr;
+	launch_data_dict_insert(r, services, BOOTSTRAP_TREE_SERVICES);
+	launch_data_dict_insert(r, children, BOOTSTRAP_TREE_CHILDREN);
+
+	return r;
+
+out_bad:
+	if (r) {
+		launch_data_free(r);
+	}
+	if (services) {
+		launch_data_free(services);
+	}
+	if (children) {
+		launch_data_free(children);
+	}
+
+	return NULL;
 }
 
 kern_return_t
-job_mig_post_fork_ping(job_t j, task_t child_task, mach_port_t *asport)
+job_mig_lookup_tree(job_t j, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt,
+	mach_port_array_t *peruser_ports, mach_msg_type_number_t *peruser_ports_cnt,
+	uint64_t flags __attribute__((unused)))
 {
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	job_log(j, LOG_DEBUG, "Post fork ping.");
+	// Same rules as job_mig_lookup_children().
+	struct ldcred *ldc = runtime_get_caller_creds();
+	if (ldc->euid != 0) {
+		job_log(j, LOG_WARNING, "Attempt to look up bootstrap tree by unprivileged job.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
 
-	struct machservice *ms;
-	job_setup_exception_port(j, child_task);
-	SLIST_FOREACH(ms, &special_ports, special_port_sle) {
-		if (j->per_user && (ms->special_port_num != TASK_ACCESS_PORT)) {
-			// The TASK_ACCESS_PORT funny business is to workaround 5325399.
-			continue;
+	kern_return_t kr = BOOTSTRAP_NO_MEMORY;
+	launch_data_t output_obj = NULL;
+	mach_port_array_t _ports = NULL;
+	mach_msg_type_number_t ports_cnt = 0;
+
+	*outval = 0;
+	*outvalCnt = 0;
+
+	size_t max_ports = pid1_magic ? jobmgr_count_perusers_deep(j->mgr) : 0;
+	if (max_ports) {
+		mig_allocate((vm_address_t *)&_ports, max_ports * sizeof(_ports[0]));
+		if (!job_assumes(j, _ports != NULL)) {
+			goto out_bad;
 		}
+	}
 
-		errno = task_set_special_port(child_task, ms->special_port_num, ms->port);
-		if (errno) {
-			if (errno == MACH_SEND_INVALID_DEST) {
-				job_log(j, LOG_WARNING, "Task died before special ports could be set.");
-				break;
-			}
+	if (!job_assumes(j, (output_obj = jobmgr_export_tree(j->mgr, _ports, &ports_cnt)) != NULL)) {
+		goto out_bad;
+	}
 
-			int desired_log_level = LOG_ERR;
-			if (j->anonymous) {
-				// 5338127
+	runtime_ktrace0(RTKT_LAUNCHD_DATA_PACK);
+	if (!job_assumes(j, launch_data_pack_mig(output_obj, outval, outvalCnt))) {
+		goto out_bad;
+	}
 
-				desired_log_level = LOG_WARNING;
+	launch_data_free(output_obj);
+	output_obj = NULL;
 
-				if (ms->special_port_num == TASK_SEATBELT_PORT) {
-					desired_log_level = LOG_DEBUG;
-				}
-			}
+	/* MIG only deallocates as much of the array as it sends, so don't hand it
+	 * more than was filled in.
+	 */
+	if (_ports && ports_cnt < max_ports) {
+		mach_port_array_t trimmed = NULL;
 
-			job_log(j, desired_log_level, "Could not setup Mach task special port %u: %s", ms->special_port_num, mach_error_string(errno));
+		if (ports_cnt) {
+			mig_allocate((vm_address_t *)&trimmed, ports_cnt * sizeof(trimmed[0]));
+			if (!job_assumes(j, trimmed != NULL)) {
+				goto out_bad;
+			}
+			memcpy(trimmed, _ports, ports_cnt * sizeof(trimmed[0]));
 		}
+		mig_deallocate((vm_address_t)_ports, max_ports * sizeof(_ports[0]));
+		_ports = trimmed;
 	}
 
-	/* MIG will not zero-initialize this pointer, so we must always do so.
-	 *
-	 * <rdar://problem/8562593>.
-	 */
-	*asport = MACH_PORT_NULL;
-#if !TARGET_OS_EMBEDDED
-	if (!j->anonymous) {
-		/* XPC services will spawn into the root security session by default.
-		 * xpcproxy will switch them away if needed.
-		 */
-		if (!(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
-			job_log(j, LOG_DEBUG, "Returning session port: 0x%x", j->asport);
-			*asport = j->asport;
+	*peruser_ports = _ports;
+	*peruser_ports_cnt = ports_cnt;
+
+	return BOOTSTRAP_SUCCESS;
+
+out_bad:
+	if (output_obj) {
+		launch_data_free(output_obj);
+	}
+	if (*outval) {
+		mig_deallocate(*outval, *outvalCnt);
+		*outval = 0;
+		*outvalCnt = 0;
+	}
+	if (_ports) {
+		mach_msg_type_number_t i = 0;
+		for (i = 0; i < ports_cnt; i++) {
+			(void)launchd_mport_deallocate(_ports[i]);
 		}
+		mig_deallocate((vm_address_t)_ports, max_ports * sizeof(_ports[0]));
+	}
+
+	return kr;
+}
+
+kern_return_t
+job_mig_pid_is_managed(job_t j __attribute__((unused)), pid_t p, boolean_t *managed)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+	if ((ldc->euid != geteuid()) && (ldc->euid != 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
-#endif
-	(void)job_assumes_zero(j, launchd_mport_deallocate(child_task));
 
-	return 0;
+	/* This is so loginwindow doesn't try to quit GUI apps that have been launched
+	 * directly by launchd as agents.
+	 */
+	job_t j_for_pid = jobmgr_find_by_pid_deep(root_jobmgr, p, false);
+	if (j_for_pid && !j_for_pid->anonymous && !j_for_pid->legacy_LS_job) {
+		*managed = true;
+	}
+
+	return BOOTSTRAP_SUCCESS;
 }
 
 kern_return_t
-job_mig_get_listener_port_rights(job_t j, mach_port_array_t *sports, mach_msg_type_number_t *sports_cnt)
+job_mig_port_for_label(job_t j __attribute__((unused)), name_t label, mach_port_t *mp)
 {
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	size_t cnt = 0;
-	struct machservice *msi = NULL;
-	SLIST_FOREACH(msi, &j->machservices, sle) {
-		if (msi->upfront && job_assumes(j, msi->recv)) {
-			cnt++;
-		}
-	}
+	struct ldcred *ldc = runtime_get_caller_creds();
+	kern_return_t kr = BOOTSTRAP_NOT_PRIVILEGED;
 
-	if (cnt == 0) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+#if HAVE_SANDBOX
+	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
+#endif
 
-	mach_port_array_t sports2 = NULL;
-	mig_allocate((vm_address_t *)&sports2, cnt * sizeof(sports2[0]));
-	if (!sports2) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
+	mach_port_t _mp = MACH_PORT_NULL;
+	if (!j->deny_job_creation && (ldc->euid == 0 || ldc->euid == geteuid())) {
+		job_t target_j = job_find(NULL, label);
+		if (jobmgr_assumes(root_jobmgr, target_j != NULL)) {
+			if (target_j->j_port == MACH_PORT_NULL) {
+				(void)job_assumes(target_j, job_setup_machport(target_j) == true);
+			}
 
-	size_t i = 0;
-	SLIST_FOREACH(msi, &j->machservices, sle) {
-		if (msi->upfront && msi->recv) {
-			sports2[i] = msi->port;
-			i++;
+			_mp = target_j->j_port;
+			kr = _mp != MACH_PORT_NULL ? BOOTSTRAP_SUCCESS : BOOTSTRAP_NO_MEMORY;
+		} else {
+			kr = BOOTSTRAP_NO_MEMORY;
 		}
 	}
 
-	*sports = sports2;
-	*sports_cnt = cnt;
-
-	return KERN_SUCCESS;
+	*mp = _mp;
+	return kr;
 }
 
 kern_return_t
-job_mig_register_gui_session(job_t j, mach_port_t asport)
+job_mig_set_security_session(job_t j, uuid_t uuid, mach_port_t asport)
 {
-	if (!j->per_user) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
+#if TARGET_OS_EMBEDDED
+	return KERN_SUCCESS;
+#endif
 
-	jobmgr_t jm = jobmgr_find_xpc_per_user_domain(root_jobmgr, j->mach_uid);
-	if (!jm) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (jm->req_gui_asport) {
-		// This job manager persists, so we need to allow the per-user launchd
-		// to update the GUI session as it comes and goes.
-		jobmgr_assumes_zero(jm, launchd_mport_deallocate(jm->req_gui_asport));
+	uuid_string_t uuid_str;
+	uuid_unparse(uuid, uuid_str);
+	job_log(j, LOG_DEBUG, "Setting session %u for UUID %s...", asport, uuid_str);
+
+	job_t ji = NULL, jt = NULL;
+	LIST_FOREACH_SAFE(ji, &s_needing_sessions, sle, jt) {
+		uuid_string_t uuid_str2;
+		uuid_unparse(ji->expected_audit_uuid, uuid_str2);
+
+		if (uuid_compare(uuid, ji->expected_audit_uuid) == 0) {
+			uuid_clear(ji->expected_audit_uuid);
+			if (asport != MACH_PORT_NULL) {
+				job_log(ji, LOG_DEBUG, "Job should join session with port 0x%x", asport);
+				(void)job_assumes_zero(j, launchd_mport_copy_send(asport));
+			} else {
+				job_log(ji, LOG_DEBUG, "No session to set for job. Using our session.");
+			}
+
+			ji->asport = asport;
+			LIST_REMOVE(ji, needing_session_sle);
+
+			if (ji->event_monitor) {
+				eventsystem_ping();
+			} else {
+				job_dispatch(ji, false);
+			}
+		}
 	}
 
-	jm->req_gui_asport = asport;
+	/* Each job that the session port was set for holds a reference. At the end of
+	 * the loop, there will be one extra reference belonging to this MiG protocol.
+	 * We need to release it so that the session goes away when all the jobs
+	 * referencing it are unloaded.
+	 */
+	(void)job_assumes_zero(j, launchd_mport_deallocate(asport));
+
 	return KERN_SUCCESS;
 }
 
-kern_return_t
-job_mig_reboot2(job_t j, uint64_t flags)
+jobmgr_t 
+jobmgr_find_by_name(jobmgr_t jm, const char *where)
 {
-	char who_started_the_reboot[2048] = "";
-	struct proc_bsdshortinfo proc;
-	struct ldcred *ldc = runtime_get_caller_creds();
-	pid_t pid_to_log;
+	jobmgr_t jmi;
 
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	// NULL is only passed for our custom API for LaunchServices. If that is the case, we do magic.
+	if (where == NULL) {
+		if (strcasecmp(jm->name, VPROCMGR_SESSION_LOGINWINDOW) == 0) {
+			where = VPROCMGR_SESSION_LOGINWINDOW;
+		} else {
+			where = VPROCMGR_SESSION_AQUA;
+		}
 	}
 
-	if (unlikely(!pid1_magic)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (strcasecmp(jm->name, where) == 0) {
+		return jm;
 	}
 
-#if !TARGET_OS_EMBEDDED
-	if (unlikely(ldc->euid)) {
-#else
-	if (unlikely(ldc->euid) && !j->embedded_god) {
-#endif
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (strcasecmp(where, VPROCMGR_SESSION_BACKGROUND) == 0 && !pid1_magic) {
+		jmi = root_jobmgr;
+		goto jm_found;
 	}
 
-	for (pid_to_log = ldc->pid; pid_to_log; pid_to_log = proc.pbsi_ppid) {
-		size_t who_offset;
-		if (proc_pidinfo(pid_to_log, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
-			if (errno != ESRCH) {
-				(void)job_assumes_zero(j, errno);
-			}
-			return 1;
-		}
-
-		if (!job_assumes(j, pid_to_log != (pid_t)proc.pbsi_ppid)) {
-			job_log(j, LOG_WARNING, "Job which is its own parent started reboot.");
-			snprintf(who_started_the_reboot, sizeof(who_started_the_reboot), "%s[%u]->%s[%u]->%s[%u]->...", proc.pbsi_comm, pid_to_log, proc.pbsi_comm, pid_to_log, proc.pbsi_comm, pid_to_log);
+	LIST_FOREACH(jmi, &session_name_hash[hash_session_name(where)], session_name_sle) {
+		if (unlikely(jmi->shutting_down)) {
+			continue;
+		} else if (strcasecmp(jmi->name, where) == 0) {
 			break;
 		}
-
-		who_offset = strlen(who_started_the_reboot);
-		snprintf(who_started_the_reboot + who_offset, sizeof(who_started_the_reboot) - who_offset,
-				" %s[%u]%s", proc.pbsi_comm, pid_to_log, proc.pbsi_ppid ? " ->" : "");
 	}
 
-	root_jobmgr->reboot_flags = (int)flags;
-	job_log(j, LOG_DEBUG, "reboot2() initiated by:%s", who_started_the_reboot);
-	launchd_shutdown();
-
-	return 0;
+jm_found:
+	return jmi;
 }
 
 kern_return_t
-job_mig_getsocket(job_t j, name_t spr)
+job_mig_move_subset(job_t j, mach_port_t target_subset, name_t session_type, mach_port_t asport, uint64_t flags)
 {
+	mach_msg_type_number_t l2l_record_cnt = 0, l2l_port_cnt = 0;
+	struct vproc_subset_record *l2l_records = NULL;
+	mach_port_array_t l2l_ports = NULL;
+	mach_port_t reqport, rcvright;
+	kern_return_t kr = 1;
+	struct ldcred *ldc = runtime_get_caller_creds();
+	jobmgr_t jmr = NULL;
+
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (j->deny_job_creation) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
+	if (job_mig_intran2(root_jobmgr, target_subset, ldc->pid)) {
+		job_log(j, LOG_ERR, "Moving a session to ourself is bogus.");
 
-#if HAVE_SANDBOX
-	struct ldcred *ldc = runtime_get_caller_creds(); 
-	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+		kr = BOOTSTRAP_NOT_PRIVILEGED;
+		goto out;
 	}
-#endif
 
-	ipc_server_init();
+	job_log(j, LOG_DEBUG, "Move subset attempt: 0x%x", target_subset);
 
-	if (unlikely(!sockpath)) {
-		return BOOTSTRAP_NO_MEMORY;
+	kr = _vproc_grab_subset(target_subset, &reqport, &rcvright, &l2l_records, &l2l_record_cnt, &l2l_ports, &l2l_port_cnt);
+	if (job_assumes_zero(j, kr) != 0) {
+		goto out;
 	}
 
-	strncpy(spr, sockpath, sizeof(name_t));
+	if (l2l_record_cnt != l2l_port_cnt) {
+		os_assert_zero(l2l_port_cnt);
+	}
 
-	return BOOTSTRAP_SUCCESS;
-}
+	if (!job_assumes(j, (jmr = jobmgr_new(j->mgr, reqport, rcvright, false, session_type, false, asport)) != NULL)) {
+		kr = BOOTSTRAP_NO_MEMORY;
+		goto out;
+	}
 
-kern_return_t
-job_mig_log(job_t j, int pri, int err, logmsg_t msg)
-{
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	if (strcmp(session_type, VPROCMGR_SESSION_AQUA) == 0) {
+		jobmgr_log(jmr, LOG_NOTICE, "Registering new GUI session.");
+		kr = vproc_mig_register_gui_session(inherited_bootstrap_port, asport);
+		if (kr) {
+			jobmgr_log(jmr, LOG_ERR, "Failed to register GUI session with PID 1: 0x%x/0x%x", inherited_bootstrap_port, kr);
+		}
 	}
 
-	if ((errno = err)) {
-		job_log_error(j, pri, "%s", msg);
-	} else {
-		job_log(j, pri, "%s", msg);
+	jmr->properties |= BOOTSTRAP_PROPERTY_MOVEDSUBSET;
+
+	/* This is a hack. We should be doing this in jobmgr_new(), but since we're in the middle of
+	 * processing an IPC request, we'll do this action before the new job manager can get any IPC
+	 * requests. This serialization is guaranteed since we are single-threaded in that respect.
+	 */
+	if (flags & LAUNCH_GLOBAL_ON_DEMAND) {
+		// This is so awful.
+		// Remove the job from its current job manager.
+		LIST_REMOVE(j, sle);
+		LIST_REMOVE(j, pid_hash_sle);
+
+		// Put the job into the target job manager.
+		LIST_INSERT_HEAD(&jmr->jobs, j, sle);
+		LIST_INSERT_HEAD(&jmr->active_jobs[ACTIVE_JOB_HASH(j->p)], j, pid_hash_sle);
+
+		j->mgr = jmr;
+		job_set_global_on_demand(j, true);
+
+		if (!j->holds_ref) {
+			job_log(j, LOG_PERF, "Job moved subset into: %s", j->mgr->name);
+			j->holds_ref = true;
+			runtime_add_ref();
+		}
 	}
 
-	return 0;
-}
+	if (l2l_port_cnt) {
+		if (!job_assumes(j, (jmr->subset_import = calloc(1, sizeof(struct jobmgr_subset_import))) != NULL)) {
+			kr = BOOTSTRAP_NO_MEMORY;
+			goto out;
+		}
 
-void
-job_setup_per_user_directory(job_t j, uid_t uid, const char *path)
-{
-	struct stat sb;
+		jmr->subset_import->records = l2l_records;
+		jmr->subset_import->ports = l2l_ports;
+		jmr->subset_import->cnt = l2l_port_cnt;
+		l2l_records = NULL;
+		l2l_ports = NULL;
 
-	bool created = false;
-	int r = stat(path, &sb);
-	if ((r == -1 && errno == ENOENT) || (r == 0 && !S_ISDIR(sb.st_mode))) {
-		if (r == 0) {
-			job_log(j, LOG_NOTICE, "File at location of per-user launchd directory is not a directory. Moving aside: %s", path);
+		jobmgr_subset_import_step(jmr, SUBSET_IMPORT_BATCH);
+	}
+
+	kr = 0;
 
-			char old[PATH_MAX];
-			snprintf(old, sizeof(old), "%s.movedaside", path);
-			(void)job_assumes_zero_p(j, rename(path, old));
-		}
+out:
+	if (l2l_records) {
+		mig_deallocate((vm_address_t)l2l_records, l2l_record_cnt * sizeof(l2l_records[0]));
+	}
 
-		(void)job_assumes_zero_p(j, mkdir(path, S_IRWXU));
-		(void)job_assumes_zero_p(j, chown(path, uid, 0));
-		created = true;
+	if (l2l_ports) {
+		mig_deallocate((vm_address_t)l2l_ports, l2l_port_cnt * sizeof(l2l_ports[0]));
 	}
 
-	if (!created) {
-		if (sb.st_uid != uid) {
-			job_log(j, LOG_NOTICE, "Per-user launchd directory has improper user ownership. Repairing: %s", path);
-			(void)job_assumes_zero_p(j, chown(path, uid, 0));
-		}
-		if (sb.st_gid != 0) {
-			job_log(j, LOG_NOTICE, "Per-user launchd directory has improper group ownership. Repairing: %s", path);
-			(void)job_assumes_zero_p(j, chown(path, uid, 0));
+	if (kr == 0) {
+		if (target_subset) {
+			(void)job_assumes_zero(j, launchd_mport_deallocate(target_subset));
 		}
-		if (sb.st_mode != (S_IRWXU | S_IFDIR)) {
-			job_log(j, LOG_NOTICE, "Per-user launchd directory has improper mode. Repairing: %s", path);
-			(void)job_assumes_zero_p(j, chmod(path, S_IRWXU));
+		if (asport) {
+			(void)job_assumes_zero(j, launchd_mport_deallocate(asport));
 		}
+	} else if (jmr) {
+		jobmgr_shutdown(jmr);
 	}
+
+	return kr;
 }
 
 void
-job_setup_per_user_directories(job_t j, uid_t uid, const char *label)
+jobmgr_subset_import_step(jobmgr_t jm, size_t max)
 {
-	char path[PATH_MAX];
-
-	(void)snprintf(path, sizeof(path), LAUNCHD_DB_PREFIX "/%s", label);
-	job_setup_per_user_directory(j, uid, path);
-
-	(void)snprintf(path, sizeof(path), LAUNCHD_LOG_PREFIX "/%s", label);
-	job_setup_per_user_directory(j, uid, path);
-}
+	struct jobmgr_subset_import *si = jm->subset_import;
+	size_t done = 0;
 
-job_t
-jobmgr_lookup_per_user_context_internal(job_t j, uid_t which_user, mach_port_t *mp)
-{
-	job_t ji = NULL;
-	LIST_FOREACH(ji, &root_jobmgr->jobs, sle) {
-		if (!ji->per_user) {
-			continue;
-		}
-		if (ji->mach_uid != which_user) {
-			continue;
-		}
-		if (SLIST_EMPTY(&ji->machservices)) {
-			continue;
-		}
-		if (!SLIST_FIRST(&ji->machservices)->per_user_hack) {
-			continue;
-		}
-		break;
+	if (unlikely(jm->shutting_down)) {
+		jobmgr_subset_import_free(jm);
+		return;
 	}
 
-	if (unlikely(ji == NULL)) {
+	while (si->next < si->cnt && done < max) {
+		struct vproc_subset_record *r = &si->records[si->next];
+		mach_port_t *port = &si->ports[si->next];
 		struct machservice *ms;
-		char lbuf[1024];
-
-		job_log(j, LOG_DEBUG, "Creating per user launchd job for UID: %u", which_user);
-
-		sprintf(lbuf, "com.apple.launchd.peruser.%u", which_user);
-
-		ji = job_new(root_jobmgr, lbuf, "/sbin/launchd", NULL);
-
-		if (ji != NULL) {
-			auditinfo_addr_t auinfo = {
-				.ai_termid = { 
-					.at_type = AU_IPv4
-				},
-				.ai_auid = which_user,
-				.ai_asid = AU_ASSIGN_ASID,
-			};
-
-			if (setaudit_addr(&auinfo, sizeof(auinfo)) == 0) {
-				job_log(ji, LOG_DEBUG, "Created new security session for per-user launchd: %u", auinfo.ai_asid);
-				(void)job_assumes(ji, (ji->asport = audit_session_self()) != MACH_PORT_NULL);
+		job_t j_for_service;
 
-				/* Kinda lame that we have to do this, but we can't create an
-				 * audit session without joining it.
-				 */
-				(void)job_assumes(ji, audit_session_join(launchd_audit_port));
-				ji->asid = auinfo.ai_asid;
-			} else {
-				job_log(ji, LOG_WARNING, "Could not set audit session!");
-				job_remove(ji);
-				return NULL;
-			}
+		si->next++;
+		done++;
 
-			ji->mach_uid = which_user;
-			ji->per_user = true;
-			ji->enable_transactions = true;
-			job_setup_per_user_directories(ji, which_user, lbuf);
+		r->name[sizeof(r->name) - 1] = '\0';
+		j_for_service = jobmgr_find_by_pid(jm, r->pid, true);
 
-			if ((ms = machservice_new(ji, lbuf, mp, false)) == NULL) {
-				job_remove(ji);
-				ji = NULL;
-			} else {
-				ms->upfront = true;
-				ms->per_user_hack = true;
-				ms->hide = true;
+		if (unlikely(!j_for_service)) {
+			// The PID probably exited
+			(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(*port));
+			continue;
+		}
 
-				ji = job_dispatch(ji, false);
-			}
+		if (likely(ms = machservice_new(j_for_service, r->name, port, r->flags & VPROC_SUBSET_PERPID))) {
+			jobmgr_log(jm, LOG_DEBUG, "Importing %s into new bootstrap.", r->name);
+			machservice_request_notifications(ms);
 		}
-	} else {
-		*mp = machservice_port(SLIST_FIRST(&ji->machservices));
-		job_log(j, LOG_DEBUG, "Per user launchd job found for UID: %u", which_user);
 	}
 
-	return ji;
+	if (si->next == si->cnt) {
+		jobmgr_log(jm, LOG_DEBUG, "Imported %u services into new bootstrap.", si->cnt);
+		jobmgr_subset_import_free(jm);
+	} else if (!si->timer_armed) {
+		// Let whatever else is pending run before the next batch.
+		if (jobmgr_assumes_zero_p(jm, kevent_mod((uintptr_t)si, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0, 0, jm)) != -1) {
+			si->timer_armed = true;
+		} else {
+			jobmgr_subset_import_step(jm, SIZE_MAX);
+		}
+	}
 }
 
-kern_return_t
-job_mig_lookup_per_user_context(job_t j, uid_t which_user, mach_port_t *up_cont)
+void
+jobmgr_subset_import_free(jobmgr_t jm)
 {
-	struct ldcred *ldc = runtime_get_caller_creds();
-	job_t jpu;
-
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
-
-	if (launchd_osinstaller) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
-	}
-
-#if TARGET_OS_EMBEDDED
-	// There is no need for per-user launchd's on embedded.
-	job_log(j, LOG_ERR, "Per-user launchds are not supported on this platform.");
-	return BOOTSTRAP_UNKNOWN_SERVICE;
-#endif
+	struct jobmgr_subset_import *si = jm->subset_import;
 
-#if HAVE_SANDBOX
-	if (unlikely(sandbox_check(ldc->pid, "mach-per-user-lookup", SANDBOX_FILTER_NONE) > 0)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (!si) {
+		return;
 	}
-#endif
-
-	job_log(j, LOG_INFO, "Looking up per user launchd for UID: %u", which_user);
 
-	if (unlikely(!pid1_magic)) {
-		job_log(j, LOG_ERR, "Only PID 1 supports per user launchd lookups.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (si->timer_armed) {
+		(void)jobmgr_assumes_zero_p(jm, kevent_mod((uintptr_t)si, EVFILT_TIMER, EV_DELETE, 0, 0, NULL));
 	}
 
-	if (ldc->euid || ldc->uid) {
-		which_user = ldc->euid ?: ldc->uid;
+	for (; si->next < si->cnt; si->next++) {
+		(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(si->ports[si->next]));
 	}
 
-	*up_cont = MACH_PORT_NULL;
-
-	jpu = jobmgr_lookup_per_user_context_internal(j, which_user, up_cont);
-
-	return 0;
+	mig_deallocate((vm_address_t)si->records, si->cnt * sizeof(si->records[0]));
+	mig_deallocate((vm_address_t)si->ports, si->cnt * sizeof(si->ports[0]));
+	free(si);
+	jm->subset_import = NULL;
 }
 
 kern_return_t
-job_mig_check_in2(job_t j, name_t servicename, mach_port_t *serviceportp, uuid_t instance_id, uint64_t flags)
+job_mig_init_session(job_t j, name_t session_type, mach_port_t asport)
 {
-	bool per_pid_service = flags & BOOTSTRAP_PER_PID_SERVICE;
-	bool strict = flags & BOOTSTRAP_STRICT_CHECKIN;
-	struct ldcred *ldc = runtime_get_caller_creds();
-	struct machservice *ms = NULL;
-	job_t jo;
-
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (j->dedicated_instance) {
-		struct machservice *msi = NULL;
-		SLIST_FOREACH(msi, &j->machservices, sle) {
-			if (strncmp(servicename, msi->name, sizeof(name_t) - 1) == 0) {
-				uuid_copy(instance_id, j->instance_id);
-				ms = msi;
-				break;
-			}
-		}
-	} else {
-		ms = jobmgr_lookup_service(j->mgr, servicename, false, per_pid_service ? ldc->pid : 0);
-	}
-
-	if (strict) {
-		if (likely(ms != NULL)) {
-			if (ms->job != j) {
-				return BOOTSTRAP_NOT_PRIVILEGED;
-			} else if (ms->isActive) {
-				return BOOTSTRAP_SERVICE_ACTIVE;
-			}
-		} else {
-			return BOOTSTRAP_UNKNOWN_SERVICE;
-		}
-	} else if (ms == NULL) {
-		if (job_assumes(j, !j->dedicated_instance)) {
-			*serviceportp = MACH_PORT_NULL;
-
-#if HAVE_SANDBOX
-			if (unlikely(sandbox_check(ldc->pid, "mach-register", per_pid_service ? SANDBOX_FILTER_LOCAL_NAME : SANDBOX_FILTER_GLOBAL_NAME, servicename) > 0)) {
-				return BOOTSTRAP_NOT_PRIVILEGED;
-			}
-#endif
-			if (unlikely((ms = machservice_new(j, servicename, serviceportp, per_pid_service)) == NULL)) {
-				return BOOTSTRAP_NO_MEMORY;
-			}
+	job_t j2;
 
-			// Treat this like a legacy job.
-			if (!j->legacy_mach_job) {
-				ms->isActive = true;
-				ms->recv = false;
-			}
+	kern_return_t kr = BOOTSTRAP_NO_MEMORY;
+	if (j->mgr->session_initialized) {
+		job_log(j, LOG_ERR, "Tried to initialize an already setup session!");
+		kr = BOOTSTRAP_NOT_PRIVILEGED;
+	} else if (strcmp(session_type, VPROCMGR_SESSION_LOGINWINDOW) == 0) {
+		jobmgr_t jmi;
 
-			if (!(j->anonymous || j->legacy_LS_job || j->legacy_mach_job)) {
-				job_log(j, LOG_APPLEONLY, "Please add the following service to the configuration file for this job: %s", servicename);
-			}
-		} else {
-			return BOOTSTRAP_UNKNOWN_SERVICE;
-		}
-	} else {
-		if (unlikely((jo = machservice_job(ms)) != j)) {
-			static pid_t last_warned_pid;
+		/*
+		 * 5330262
+		 *
+		 * We're working around LoginWindow and the WindowServer.
+		 *
+		 * In practice, there is only one LoginWindow session. Unfortunately, for certain
+		 * scenarios, the WindowServer spawns loginwindow, and in those cases, it frequently
+		 * spawns a replacement loginwindow session before cleaning up the previous one.
+		 *
+		 * We're going to use the creation of a new LoginWindow context as a clue that the
+		 * previous LoginWindow context is on the way out and therefore we should just
+		 * kick-start the shutdown of it.
+		 */
 
-			if (last_warned_pid != ldc->pid) {
-				job_log(jo, LOG_WARNING, "The following job tried to hijack the service \"%s\" from this job: %s", servicename, j->label);
-				last_warned_pid = ldc->pid;
+		SLIST_FOREACH(jmi, &root_jobmgr->submgrs, sle) {
+			if (unlikely(jmi->shutting_down)) {
+				continue;
+			} else if (strcasecmp(jmi->name, session_type) == 0) {
+				jobmgr_shutdown(jmi);
+				break;
 			}
-
-			return BOOTSTRAP_NOT_PRIVILEGED;
-		}
-		if (unlikely(machservice_active(ms))) {
-			job_log(j, LOG_WARNING, "Check-in of Mach service failed. Already active: %s", servicename);
-			return BOOTSTRAP_SERVICE_ACTIVE;
 		}
-	}
+	} else if (strcmp(session_type, VPROCMGR_SESSION_AQUA) == 0) {
+		(void)job_assumes_zero(j, runtime_remove_mport(j->mgr->jm_port));
+ 	}
 
-	job_checkin(j);
-	machservice_request_notifications(ms);
+	jobmgr_log(j->mgr, LOG_DEBUG, "Initializing as %s", session_type);
+	strcpy(j->mgr->name_init, session_type);
+	jobmgr_session_name_update(j->mgr);
 
-	job_log(j, LOG_INFO, "Check-in of service: %s", servicename);
+	if (job_assumes(j, (j2 = jobmgr_init_session(j->mgr, session_type, false)))) {
+		j2->asport = asport;
+		(void)job_assumes(j, job_dispatch(j2, true));
+		kr = BOOTSTRAP_SUCCESS;
+	}
 
-	*serviceportp = machservice_port(ms);
-	return BOOTSTRAP_SUCCESS;
+	return kr;
 }
 
 kern_return_t
-job_mig_register2(job_t j, name_t servicename, mach_port_t serviceport, uint64_t flags)
+job_mig_switch_to_session(job_t j, mach_port_t requestor_port, name_t session_name, mach_port_t asport, mach_port_t *new_bsport)
 {
-	struct machservice *ms;
 	struct ldcred *ldc = runtime_get_caller_creds();
-	bool per_pid_service = flags & BOOTSTRAP_PER_PID_SERVICE;
-
-	if (!j) {
+	if (!jobmgr_assumes(root_jobmgr, j != NULL)) {
+		jobmgr_log(root_jobmgr, LOG_ERR, "%s() called with NULL job: PID %d", __func__, ldc->pid);
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (!per_pid_service && !j->legacy_LS_job) {
-		job_log(j, LOG_APPLEONLY, "Performance: bootstrap_register() is deprecated. Service: %s", servicename);
+	if (j->mgr->shutting_down) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	job_log(j, LOG_DEBUG, "%sMach service registration attempt: %s", flags & BOOTSTRAP_PER_PID_SERVICE ? "Per PID " : "", servicename);
+	job_log(j, LOG_DEBUG, "Job wants to move to %s session.", session_name);
 
-#if HAVE_SANDBOX
-	if (unlikely(sandbox_check(ldc->pid, "mach-register", per_pid_service ? SANDBOX_FILTER_LOCAL_NAME : SANDBOX_FILTER_GLOBAL_NAME, servicename) > 0)) {
+	if (!job_assumes(j, pid1_magic == false)) {
+		job_log(j, LOG_WARNING, "Switching sessions is not allowed in the system Mach bootstrap.");
 		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
-#endif
 
-	// 5641783 for the embedded hack
-#if !TARGET_OS_EMBEDDED
-	/*
-	 * From a per-user/session launchd's perspective, SecurityAgent (UID
-	 * 92) is a rogue application (not our UID, not root and not a child of
-	 * us). We'll have to reconcile this design friction at a later date.
-	 */
-	if (unlikely(j->anonymous && j->mgr->parentmgr == NULL && ldc->uid != 0 && ldc->uid != getuid() && ldc->uid != 92)) {
-		if (pid1_magic) {
-			return VPROC_ERR_TRY_PER_USER;
-		} else {
-			return BOOTSTRAP_NOT_PRIVILEGED;
-		}
+	if (!j->anonymous) {
+		job_log(j, LOG_NOTICE, "Non-anonymous job tried to switch sessions. Please use LimitLoadToSessionType instead.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
-#endif
-
-	ms = jobmgr_lookup_service(j->mgr, servicename, false, flags & BOOTSTRAP_PER_PID_SERVICE ? ldc->pid : 0);
 
-	if (unlikely(ms)) {
-		if (machservice_job(ms) != j) {
-			return BOOTSTRAP_NOT_PRIVILEGED;
-		}
-		if (machservice_active(ms)) {
-			job_log(j, LOG_DEBUG, "Mach service registration failed. Already active: %s", servicename);
-			return BOOTSTRAP_SERVICE_ACTIVE;
-		}
-		if (ms->recv && (serviceport != MACH_PORT_NULL)) {
-			job_log(j, LOG_ERR, "bootstrap_register() erroneously called instead of bootstrap_check_in(). Mach service: %s", servicename);
-			return BOOTSTRAP_NOT_PRIVILEGED;
-		}
-		job_checkin(j);
-		machservice_delete(j, ms, false);
+	jobmgr_t target_jm = jobmgr_find_by_name(root_jobmgr, session_name);
+	if (target_jm == j->mgr) {
+		job_log(j, LOG_DEBUG, "Job is already in its desired session (%s).", session_name);
+		(void)job_assumes_zero(j, launchd_mport_deallocate(asport));
+		(void)job_assumes_zero(j, launchd_mport_deallocate(requestor_port));
+		*new_bsport = target_jm->jm_port;
+		return BOOTSTRAP_SUCCESS;
 	}
 
-	if (likely(serviceport != MACH_PORT_NULL)) {
-		if (likely(ms = machservice_new(j, servicename, &serviceport, flags & BOOTSTRAP_PER_PID_SERVICE ? true : false))) {
-			machservice_request_notifications(ms);
-		} else {
-			return BOOTSTRAP_NO_MEMORY;
+	if (!target_jm) {
+		target_jm = jobmgr_new(j->mgr, requestor_port, MACH_PORT_NULL, false, session_name, false, asport);
+		if (target_jm) {
+			target_jm->properties |= BOOTSTRAP_PROPERTY_IMPLICITSUBSET;
+			(void)job_assumes_zero(j, launchd_mport_deallocate(asport));
 		}
 	}
 
-
-	return BOOTSTRAP_SUCCESS;
-}
-
-kern_return_t
-job_mig_look_up2(job_t j, mach_port_t srp, name_t servicename, mach_port_t *serviceportp, pid_t target_pid, uuid_t instance_id, uint64_t flags)
-{
-	struct machservice *ms = NULL;
-	struct ldcred *ldc = runtime_get_caller_creds();
-	kern_return_t kr;
-	bool per_pid_lookup = flags & BOOTSTRAP_PER_PID_SERVICE;
-	bool specific_instance = flags & BOOTSTRAP_SPECIFIC_INSTANCE;
-	bool strict_lookup = flags & BOOTSTRAP_STRICT_LOOKUP;
-	bool privileged = flags & BOOTSTRAP_PRIVILEGED_SERVER;
-
-	if (!j) {
+	if (!job_assumes(j, target_jm != NULL)) {
+		job_log(j, LOG_WARNING, "Could not find %s session!", session_name);
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	bool xpc_req = (j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN);
+	// Remove the job from it's current job manager.
+	LIST_REMOVE(j, sle);
+	LIST_REMOVE(j, pid_hash_sle);
 
-	// 5641783 for the embedded hack
-#if !TARGET_OS_EMBEDDED
-	if (unlikely(pid1_magic && j->anonymous && j->mgr->parentmgr == NULL && ldc->uid != 0 && ldc->euid != 0)) {
-		return VPROC_ERR_TRY_PER_USER;
+	job_t ji = NULL, jit = NULL;
+	LIST_FOREACH_SAFE(ji, &j->mgr->global_env_jobs, global_env_sle, jit) {
+		if (ji == j) {
+			LIST_REMOVE(ji, global_env_sle);
+			break;
+		}
 	}
-#endif
 
-#if HAVE_SANDBOX
-	/* We don't do sandbox checking for XPC domains because, by definition, all
-	 * the services within your domain should be accessible to you.
-	 */
-	if (!xpc_req && unlikely(sandbox_check(ldc->pid, "mach-lookup", per_pid_lookup ? SANDBOX_FILTER_LOCAL_NAME : SANDBOX_FILTER_GLOBAL_NAME, servicename) > 0)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-#endif
+	// Put the job into the target job manager.
+	LIST_INSERT_HEAD(&target_jm->jobs, j, sle);
+	LIST_INSERT_HEAD(&target_jm->active_jobs[ACTIVE_JOB_HASH(j->p)], j, pid_hash_sle);
 
-	if (per_pid_lookup) {
-		ms = jobmgr_lookup_service(j->mgr, servicename, false, target_pid);
-	} else {
-		if (xpc_req) {
-			// Requests from XPC domains stay local.
-			ms = jobmgr_lookup_service(j->mgr, servicename, false, 0);
-		} else {
-			/* A strict lookup which is privileged won't even bother trying to
-			 * find a service if we're not hosting the root Mach bootstrap.
-			 */
-			if (strict_lookup && privileged) {
-				if (inherited_bootstrap_port == MACH_PORT_NULL) {
-					ms = jobmgr_lookup_service(j->mgr, servicename, true, 0);
-				}
-			} else {
-				ms = jobmgr_lookup_service(j->mgr, servicename, true, 0);
-			}
-		}
+	if (ji) {
+		LIST_INSERT_HEAD(&target_jm->global_env_jobs, j, global_env_sle);
+		s_global_env_gen++;
 	}
 
-	if (likely(ms)) {
-		ms = ms->alias ? ms->alias : ms;
-		if (unlikely(specific_instance && ms->job->multiple_instances)) {
-			job_t ji = NULL;
-			job_t instance = NULL;
-			LIST_FOREACH(ji, &ms->job->subjobs, subjob_sle) {
-				if (uuid_compare(instance_id, ji->instance_id) == 0) {
-					instance = ji;
-					break;
-				}
-			}
-
-			if (unlikely(instance == NULL)) {
-				job_log(ms->job, LOG_DEBUG, "Creating new instance of job based on lookup of service %s", ms->name);
-				instance = job_new_subjob(ms->job, instance_id);
-				if (job_assumes(j, instance != NULL)) {
-					/* Disable this support for now. We only support having 
-					 * multi-instance jobs within private XPC domains.
-					 */
-#if 0
-					/* If the job is multi-instance, in a singleton XPC domain
-					 * and the request is not coming from within that singleton
-					 * domain, we need to alias the new job into the requesting
-					 * domain.
-					 */
-					if (!j->mgr->xpc_singleton && xpc_req) {
-						(void)job_assumes(instance, job_new_alias(j->mgr, instance));
-					}
-#endif
-					job_dispatch(instance, false);
-				}
-			}
+	j->mgr = target_jm;
 
-			ms = NULL;
-			if (job_assumes(j, instance != NULL)) {
-				struct machservice *msi = NULL;
-				SLIST_FOREACH(msi, &instance->machservices, sle) {
-					/* sizeof(servicename) will return the size of a pointer,
-					 * even though it's an array type, because when passing
-					 * arrays as parameters in C, they implicitly degrade to
-					 * pointers.
-					 */
-					if (strncmp(servicename, msi->name, sizeof(name_t) - 1) == 0) {
-						ms = msi;
-						break;
-					}
-				}
-			}
-		} else {
-			if (machservice_hidden(ms) && !machservice_active(ms)) {
-				ms = NULL;
-			} else if (unlikely(ms->per_user_hack)) {
-				ms = NULL;
-			}
+	/* Move our Mach services over if we're not in a flat namespace. Either way,
+	 * the job name the directory orders them by can change with the manager,
+	 * so file them again.
+	 */
+	struct machservice *msi = NULL, *msit = NULL;
+	SLIST_FOREACH_SAFE(msi, &j->machservices, sle, msit) {
+		if (!launchd_flat_mach_namespace) {
+			machservice_hash_remove(msi);
+			machservice_hash_insert(target_jm, msi);
+		} else if (msi->dir_mgr) {
+			jobmgr_t dir_jm = msi->dir_mgr;
+			jobmgr_service_directory_remove(msi);
+			jobmgr_service_directory_insert(dir_jm, msi);
 		}
 	}
 
-	if (likely(ms)) {
-		(void)job_assumes(j, machservice_port(ms) != MACH_PORT_NULL);
-		job_log(j, LOG_DEBUG, "%sMach service lookup: %s", per_pid_lookup ? "Per PID " : "", servicename);
-		*serviceportp = machservice_port(ms);
-
-		kr = BOOTSTRAP_SUCCESS;
-	} else if (strict_lookup && !privileged) {
-		/* Hack: We need to simulate XPC's desire not to establish a hierarchy.
-		 * So if XPC is doing the lookup, and it's not a privileged lookup, we
-		 * won't forward. But if it is a privileged lookup, then we must
-		 * forward.
-		 */
-		return BOOTSTRAP_UNKNOWN_SERVICE;
-	} else if (inherited_bootstrap_port != MACH_PORT_NULL) {
-		// Requests from within an XPC domain don't get forwarded.
-		job_log(j, LOG_DEBUG, "Mach service lookup forwarded: %s", servicename);
-		/* Clients potentially check the audit token of the reply to verify that
-		 * the returned send right is trustworthy.
-		 */
-		(void)job_assumes_zero(j, vproc_mig_look_up2_forward(inherited_bootstrap_port, srp, servicename, target_pid, instance_id, flags));
-		return MIG_NO_REPLY;
-	} else if (pid1_magic && j->anonymous && ldc->euid >= 500 && strcasecmp(j->mgr->name, VPROCMGR_SESSION_LOGINWINDOW) == 0) {
-		/* 5240036 Should start background session when a lookup of CCacheServer
-		 * occurs
-		 *
-		 * This is a total hack. We sniff out loginwindow session, and attempt
-		 * to guess what it is up to. If we find a EUID that isn't root, we
-		 * force it over to the per-user context.
+	if (!j->holds_ref) {
+		/* Anonymous jobs which move around are particularly interesting to us, so we want to
+		 * stick around while they're still around.
+		 * For example, login calls into the PAM launchd module, which moves the process into
+		 * the StandardIO session by default. So we'll hold a reference on that job to prevent
+		 * ourselves from going away.
 		 */
-		return VPROC_ERR_TRY_PER_USER;
-	} else {
-		job_log(j, LOG_DEBUG, "%sMach service lookup failed: %s", per_pid_lookup ? "Per PID " : "", servicename);
-		kr = BOOTSTRAP_UNKNOWN_SERVICE;
+		j->holds_ref = true;
+		job_log(j, LOG_PERF, "Job switched into manager: %s", j->mgr->name);
+		runtime_add_ref();
 	}
 
-	return kr;
+	*new_bsport = target_jm->jm_port;
+
+	return KERN_SUCCESS;
 }
 
-kern_return_t
-job_mig_parent(job_t j, mach_port_t srp, mach_port_t *parentport)
+static kern_return_t
+job_take_subset_check(job_t j)
 {
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	job_log(j, LOG_DEBUG, "Requested parent bootstrap port");
-	jobmgr_t jm = j->mgr;
+	jobmgr_t jm = j->mgr;
+
+	if (unlikely(!pid1_magic)) {
+		job_log(j, LOG_ERR, "Only the system launchd will transfer Mach sub-bootstraps.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+	if (unlikely(jobmgr_parent(jm) == NULL)) {
+		job_log(j, LOG_ERR, "Root Mach bootstrap cannot be transferred.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+	if (unlikely(strcasecmp(jm->name, VPROCMGR_SESSION_AQUA) == 0)) {
+		job_log(j, LOG_ERR, "Cannot transfer a setup GUI session.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+	if (unlikely(!j->anonymous)) {
+		job_log(j, LOG_ERR, "Only the anonymous job can transfer Mach sub-bootstraps.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+	job_log(j, LOG_DEBUG, "Transferring sub-bootstrap to the per session launchd.");
 
-	if (jobmgr_parent(jm)) {
-		*parentport = jobmgr_parent(jm)->jm_port;
-	} else if (MACH_PORT_NULL == inherited_bootstrap_port) {
-		*parentport = jm->jm_port;
-	} else {
-		(void)job_assumes_zero(j, vproc_mig_parent_forward(inherited_bootstrap_port, srp));
-		// The previous routine moved the reply port, we're forced to return MIG_NO_REPLY now
-		return MIG_NO_REPLY;
-	}
 	return BOOTSTRAP_SUCCESS;
 }
 
-kern_return_t
-job_mig_get_root_bootstrap(job_t j, mach_port_t *rootbsp)
+static void
+job_take_subset_handoff(job_t j, mach_port_t *reqport, mach_port_t *rcvright)
 {
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
+	jobmgr_t jm = j->mgr;
 
-	if (inherited_bootstrap_port == MACH_PORT_NULL) {
-		*rootbsp = root_jobmgr->jm_port;
-		(void)job_assumes_zero(j, launchd_mport_make_send(root_jobmgr->jm_port));
-	} else {
-		*rootbsp = inherited_bootstrap_port;
-		(void)job_assumes_zero(j, launchd_mport_copy_send(inherited_bootstrap_port));
-	}
+	*reqport = jm->req_port;
+	*rcvright = jm->jm_port;
 
-	return BOOTSTRAP_SUCCESS;
+	jobmgr_set_req_port(jm, MACH_PORT_NULL);
+	jm->jm_port = 0;
+
+	workaround_5477111 = j;
+
+	jobmgr_shutdown(jm);
 }
 
 kern_return_t
-job_mig_info(job_t j, name_array_t *servicenamesp,
-	unsigned int *servicenames_cnt, name_array_t *servicejobsp,
-	unsigned int *servicejobs_cnt, bootstrap_status_array_t *serviceactivesp,
-	unsigned int *serviceactives_cnt, uint64_t flags)
+job_mig_take_subset(job_t j, mach_port_t *reqport, mach_port_t *rcvright,
+		vm_offset_t *outdata, mach_msg_type_number_t *outdataCnt,
+		mach_port_array_t *portsp, unsigned int *ports_cnt)
 {
-	name_array_t service_names = NULL;
-	name_array_t service_jobs = NULL;
-	bootstrap_status_array_t service_actives = NULL;
+	launch_data_t tmp_obj, tmp_dict, outdata_obj_array = NULL;
+	mach_port_array_t ports = NULL;
 	unsigned int cnt = 0, cnt2 = 0;
+	struct machservice *ms;
+	kern_return_t kr;
 	jobmgr_t jm;
+	job_t ji;
 
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	if ((kr = job_take_subset_check(j))) {
+		return kr;
 	}
 
-#if TARGET_OS_EMBEDDED
-	struct ldcred *ldc = runtime_get_caller_creds();
-	if (ldc->euid) {
-		return EPERM;
-	}
-#endif // TARGET_OS_EMBEDDED
+	jm = j->mgr;
+	*outdata = 0;
+	*outdataCnt = 0;
 
-	if (launchd_flat_mach_namespace) {
-		if ((j->mgr->properties & BOOTSTRAP_PROPERTY_EXPLICITSUBSET) || (flags & BOOTSTRAP_FORCE_LOCAL)) {
-			jm = j->mgr;
-		} else {
-			jm = root_jobmgr;
-		}
-	} else {
-		jm = j->mgr;
+	outdata_obj_array = launch_data_alloc(LAUNCH_DATA_ARRAY);
+	if (!job_assumes(j, outdata_obj_array)) {
+		goto out_bad;
 	}
 
-	unsigned int i = 0;
-	struct machservice *msi = NULL;
-	for (i = 0; i < MACHSERVICE_HASH_SIZE; i++) {
-		LIST_FOREACH(msi, &jm->ms_hash[i], name_hash_sle) {
-			cnt += !msi->per_pid ? 1 : 0;
+	LIST_FOREACH(ji, &j->mgr->jobs, sle) {
+		if (!ji->anonymous) {
+			continue;
+		}
+		SLIST_FOREACH(ms, &ji->machservices, sle) {
+			cnt++;
 		}
 	}
 
-	if (cnt == 0) {
-		goto out;
-	}
-
-	mig_allocate((vm_address_t *)&service_names, cnt * sizeof(service_names[0]));
-	if (!job_assumes(j, service_names != NULL)) {
+	mig_allocate((vm_address_t *)&ports, cnt * sizeof(ports[0]));
+	if (!job_assumes(j, ports != NULL)) {
 		goto out_bad;
 	}
 
-	mig_allocate((vm_address_t *)&service_jobs, cnt * sizeof(service_jobs[0]));
-	if (!job_assumes(j, service_jobs != NULL)) {
-		goto out_bad;
-	}
+	LIST_FOREACH(ji, &j->mgr->jobs, sle) {
+		if (!ji->anonymous) {
+			continue;
+		}
 
-	mig_allocate((vm_address_t *)&service_actives, cnt * sizeof(service_actives[0]));
-	if (!job_assumes(j, service_actives != NULL)) {
-		goto out_bad;
-	}
+		SLIST_FOREACH(ms, &ji->machservices, sle) {
+			if (job_assumes(j, (tmp_dict = launch_data_alloc(LAUNCH_DATA_DICTIONARY)))) {
+				(void)job_assumes(j, launch_data_array_set_index(outdata_obj_array, tmp_dict, cnt2));
+			} else {
+				goto out_bad;
+			}
 
-	for (i = 0; i < MACHSERVICE_HASH_SIZE; i++) {
-		LIST_FOREACH(msi, &jm->ms_hash[i], name_hash_sle) {
-			if (!msi->per_pid) {
-				strlcpy(service_names[cnt2], machservice_name(msi), sizeof(service_names[0]));
-				msi = msi->alias ? msi->alias : msi;
-				if (msi->job->mgr->shortdesc) {
-					strlcpy(service_jobs[cnt2], msi->job->mgr->shortdesc, sizeof(service_jobs[0]));
-				} else {
-					strlcpy(service_jobs[cnt2], msi->job->label, sizeof(service_jobs[0]));
-				}
-				service_actives[cnt2] = machservice_status(msi);
-				cnt2++;
+			if (job_assumes(j, (tmp_obj = launch_data_new_string(machservice_name(ms))))) {
+				(void)job_assumes(j, launch_data_dict_insert(tmp_dict, tmp_obj, TAKE_SUBSET_NAME));
+			} else {
+				goto out_bad;
+			}
+
+			if (job_assumes(j, (tmp_obj = launch_data_new_integer((ms->job->p))))) {
+				(void)job_assumes(j, launch_data_dict_insert(tmp_dict, tmp_obj, TAKE_SUBSET_PID));
+			} else {
+				goto out_bad;
+			}
+
+			if (job_assumes(j, (tmp_obj = launch_data_new_bool((ms->per_pid))))) {
+				(void)job_assumes(j, launch_data_dict_insert(tmp_dict, tmp_obj, TAKE_SUBSET_PERPID));
+			} else {
+				goto out_bad;
 			}
+
+			ports[cnt2] = machservice_port(ms);
+
+			// Increment the send right by one so we can shutdown the jobmgr cleanly
+			(void)jobmgr_assumes_zero(jm, launchd_mport_copy_send(ports[cnt2]));
+			cnt2++;
 		}
 	}
 
 	(void)job_assumes(j, cnt == cnt2);
 
-out:
-	*servicenamesp = service_names;
-	*servicejobsp = service_jobs;
-	*serviceactivesp = service_actives;
-	*servicenames_cnt = *servicejobs_cnt = *serviceactives_cnt = cnt;
+	runtime_ktrace0(RTKT_LAUNCHD_DATA_PACK);
+	if (!job_assumes(j, launch_data_pack_mig(outdata_obj_array, outdata, outdataCnt))) {
+		goto out_bad;
+	}
+
+	launch_data_free(outdata_obj_array);
+
+	*portsp = ports;
+	*ports_cnt = cnt;
+
+	job_take_subset_handoff(j, reqport, rcvright);
 
 	return BOOTSTRAP_SUCCESS;
 
 out_bad:
-	if (service_names) {
-		mig_deallocate((vm_address_t)service_names, cnt * sizeof(service_names[0]));
+	if (outdata_obj_array) {
+		launch_data_free(outdata_obj_array);
 	}
-	if (service_jobs) {
-		mig_deallocate((vm_address_t)service_jobs, cnt * sizeof(service_jobs[0]));
+	if (*outdata) {
+		mig_deallocate(*outdata, *outdataCnt);
 	}
-	if (service_actives) {
-		mig_deallocate((vm_address_t)service_actives, cnt * sizeof(service_actives[0]));
+	if (ports) {
+		mig_deallocate((vm_address_t)ports, cnt * sizeof(ports[0]));
 	}
 
 	return BOOTSTRAP_NO_MEMORY;
 }
 
 kern_return_t
-job_mig_lookup_children(job_t j, mach_port_array_t *child_ports,
-	mach_msg_type_number_t *child_ports_cnt, name_array_t *child_names,
-	mach_msg_type_number_t *child_names_cnt,
-	bootstrap_property_array_t *child_properties,
-	mach_msg_type_number_t *child_properties_cnt)
+job_mig_take_subset2(job_t j, mach_port_t *reqport, mach_port_t *rcvright,
+		vm_offset_t *outdata, mach_msg_type_number_t *outdataCnt,
+		mach_port_array_t *portsp, unsigned int *ports_cnt)
 {
-	kern_return_t kr = BOOTSTRAP_NO_MEMORY;
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
-
-	struct ldcred *ldc = runtime_get_caller_creds();
-
-	/* Only allow root processes to look up children, even if we're in the per-user launchd.
-	 * Otherwise, this could be used to cross sessions, which counts as a security vulnerability
-	 * in a non-flat namespace.
-	 */
-	if (ldc->euid != 0) {
-		job_log(j, LOG_WARNING, "Attempt to look up children of bootstrap by unprivileged job.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-
-	unsigned int cnt = 0;
+	struct vproc_subset_record *records = NULL;
+	mach_port_array_t ports = NULL;
+	unsigned int cnt = 0, i = 0;
+	struct machservice *ms;
+	kern_return_t kr;
+	job_t ji;
 
-	jobmgr_t jmr = j->mgr;
-	jobmgr_t jmi = NULL;
-	SLIST_FOREACH(jmi, &jmr->submgrs, sle) {
-		cnt++;
+	if ((kr = job_take_subset_check(j))) {
+		return kr;
 	}
 
-	// Find our per-user launchds if we're PID 1.
-	job_t ji = NULL;
-	if (pid1_magic) {
-		LIST_FOREACH(ji, &jmr->jobs, sle) {
-			cnt += ji->per_user ? 1 : 0;
+	LIST_FOREACH(ji, &j->mgr->jobs, sle) {
+		if (!ji->anonymous) {
+			continue;
+		}
+		SLIST_FOREACH(ms, &ji->machservices, sle) {
+			cnt++;
 		}
 	}
 
-	if (cnt == 0) {
-		return BOOTSTRAP_NO_CHILDREN;
-	}
-
-	mach_port_array_t _child_ports = NULL;
-	name_array_t _child_names = NULL;
-	bootstrap_property_array_t _child_properties = NULL;
-
-	mig_allocate((vm_address_t *)&_child_ports, cnt * sizeof(_child_ports[0]));
-	if (!job_assumes(j, _child_ports != NULL)) {
-		kr = BOOTSTRAP_NO_MEMORY;
-		goto out_bad;
-	}
-
-	mig_allocate((vm_address_t *)&_child_names, cnt * sizeof(_child_names[0]));
-	if (!job_assumes(j, _child_names != NULL)) {
-		kr = BOOTSTRAP_NO_MEMORY;
-		goto out_bad;
-	}
-
-	mig_allocate((vm_address_t *)&_child_properties, cnt * sizeof(_child_properties[0]));
-	if (!job_assumes(j, _child_properties != NULL)) {
-		kr = BOOTSTRAP_NO_MEMORY;
-		goto out_bad;
+	if (cnt) {
+		mig_allocate((vm_address_t *)&records, cnt * sizeof(records[0]));
+		mig_allocate((vm_address_t *)&ports, cnt * sizeof(ports[0]));
+		if (!job_assumes(j, records != NULL && ports != NULL)) {
+			goto out_bad;
+		}
 	}
 
-	unsigned int cnt2 = 0;
-	SLIST_FOREACH(jmi, &jmr->submgrs, sle) {
-		if (jobmgr_assumes_zero(jmi, launchd_mport_make_send(jmi->jm_port)) == KERN_SUCCESS) {
-			_child_ports[cnt2] = jmi->jm_port;
-		} else {
-			_child_ports[cnt2] = MACH_PORT_NULL;
+	LIST_FOREACH(ji, &j->mgr->jobs, sle) {
+		if (!ji->anonymous) {
+			continue;
 		}
 
-		strlcpy(_child_names[cnt2], jmi->name, sizeof(_child_names[0]));
-		_child_properties[cnt2] = jmi->properties;
+		SLIST_FOREACH(ms, &ji->machservices, sle) {
+			records[i].pid = ms->job->p;
+			records[i].flags = ms->per_pid ? VPROC_SUBSET_PERPID : 0;
+			(void)strlcpy(records[i].name, ms->name, sizeof(records[i].name));
 
-		cnt2++;
+			ports[i] = machservice_port(ms);
+			// Increment the send right by one so we can shutdown the jobmgr cleanly
+			(void)job_assumes_zero(j, launchd_mport_copy_send(ports[i]));
+			i++;
+		}
 	}
 
-	if (pid1_magic) LIST_FOREACH(ji, &jmr->jobs, sle) {
-		if (ji->per_user) {
-			if (job_assumes(ji, SLIST_FIRST(&ji->machservices)->per_user_hack == true)) {
-				mach_port_t port = machservice_port(SLIST_FIRST(&ji->machservices));
+	*outdata = (vm_offset_t)records;
+	*outdataCnt = cnt * sizeof(records[0]);
+	*portsp = ports;
+	*ports_cnt = cnt;
 
-				if (job_assumes_zero(ji, launchd_mport_copy_send(port)) == KERN_SUCCESS) {
-					_child_ports[cnt2] = port;
-				} else {
-					_child_ports[cnt2] = MACH_PORT_NULL;
-				}
-			} else {
-				_child_ports[cnt2] = MACH_PORT_NULL;
-			}
+	job_take_subset_handoff(j, reqport, rcvright);
 
-			strlcpy(_child_names[cnt2], ji->label, sizeof(_child_names[0]));
-			_child_properties[cnt2] |= BOOTSTRAP_PROPERTY_PERUSER;
+	return BOOTSTRAP_SUCCESS;
 
-			cnt2++;
-		}
+out_bad:
+	if (records) {
+		mig_deallocate((vm_address_t)records, cnt * sizeof(records[0]));
+	}
+	if (ports) {
+		mig_deallocate((vm_address_t)ports, cnt * sizeof(ports[0]));
 	}
 
-	*child_names_cnt = cnt;
-	*child_ports_cnt = cnt;
-	*child_properties_cnt = cnt;
+	return BOOTSTRAP_NO_MEMORY;
+}
 
-	*child_names = _child_names;
-	*child_ports = _child_ports;
-	*child_properties = _child_properties;
+kern_return_t
+job_mig_subset(job_t j, mach_port_t requestorport, mach_port_t *subsetportp)
+{
+	int bsdepth = 0;
+	jobmgr_t jmr;
 
-	unsigned int i = 0;
-	for (i = 0; i < cnt; i++) {
-		job_log(j, LOG_DEBUG, "child_names[%u] = %s", i, (char *)_child_names[i]);
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
-
-	return BOOTSTRAP_SUCCESS;
-out_bad:
-	if (_child_ports) {
-		mig_deallocate((vm_address_t)_child_ports, cnt * sizeof(_child_ports[0]));
+	if (j->mgr->shutting_down) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	if (_child_names) {
-		mig_deallocate((vm_address_t)_child_names, cnt * sizeof(_child_names[0]));
+	jmr = j->mgr;
+
+	while ((jmr = jobmgr_parent(jmr)) != NULL) {
+		bsdepth++;
 	}
 
-	if (_child_properties) {
-		mig_deallocate((vm_address_t)_child_properties, cnt * sizeof(_child_properties[0]));
+	// Since we use recursion, we need an artificial depth for subsets
+	if (unlikely(bsdepth > 100)) {
+		job_log(j, LOG_ERR, "Mach sub-bootstrap create request failed. Depth greater than: %d", bsdepth);
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	return kr;
-}
+	char name[NAME_MAX];
+	snprintf(name, sizeof(name), "%s[%i].subset.%i", j->anonymous ? j->prog : j->label, j->p, MACH_PORT_INDEX(requestorport));
 
-kern_return_t
-job_mig_pid_is_managed(job_t j __attribute__((unused)), pid_t p, boolean_t *managed)
-{
-	struct ldcred *ldc = runtime_get_caller_creds();
-	if ((ldc->euid != geteuid()) && (ldc->euid != 0)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (!job_assumes(j, (jmr = jobmgr_new(j->mgr, requestorport, MACH_PORT_NULL, false, name, true, j->asport)) != NULL)) {
+		if (unlikely(requestorport == MACH_PORT_NULL)) {
+			return BOOTSTRAP_NOT_PRIVILEGED;
+		}
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	/* This is so loginwindow doesn't try to quit GUI apps that have been launched
-	 * directly by launchd as agents.
+	*subsetportp = jmr->jm_port;
+	jmr->properties |= BOOTSTRAP_PROPERTY_EXPLICITSUBSET;
+
+	/* A job could create multiple subsets, so only add a reference the first time
+	 * it does so we don't have to keep a count.
 	 */
-	job_t j_for_pid = jobmgr_find_by_pid_deep(root_jobmgr, p, false);
-	if (j_for_pid && !j_for_pid->anonymous && !j_for_pid->legacy_LS_job) {
-		*managed = true;
+	if (j->anonymous && !j->holds_ref) {
+		job_log(j, LOG_PERF, "Job created subset: %s", jmr->name);
+		j->holds_ref = true;
+		runtime_add_ref();
 	}
 
+	job_log(j, LOG_DEBUG, "Job created a subset named \"%s\"", jmr->name);
 	return BOOTSTRAP_SUCCESS;
 }
 
-kern_return_t
-job_mig_port_for_label(job_t j __attribute__((unused)), name_t label, mach_port_t *mp)
+/* Checks the keys that decide where a service goes, before anything is
+ * created for it. Service bundles are checked the same way when they are
+ * registered, in which case there's no manager to log against yet.
+ */
+int
+_xpc_domain_service_check(jobmgr_t jm, launch_data_t pload)
 {
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	if (launch_data_get_type(pload) != LAUNCH_DATA_DICTIONARY) {
+		return EINVAL;
 	}
 
-	struct ldcred *ldc = runtime_get_caller_creds();
-	kern_return_t kr = BOOTSTRAP_NOT_PRIVILEGED;
-
-#if HAVE_SANDBOX
-	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	launch_data_t ldlabel = launch_data_dict_lookup(pload, LAUNCH_JOBKEY_LABEL);
+	if (!ldlabel || launch_data_get_type(ldlabel) != LAUNCH_DATA_STRING) {
+		return EINVAL;
 	}
-#endif
 
-	mach_port_t _mp = MACH_PORT_NULL;
-	if (!j->deny_job_creation && (ldc->euid == 0 || ldc->euid == geteuid())) {
-		job_t target_j = job_find(NULL, label);
-		if (jobmgr_assumes(root_jobmgr, target_j != NULL)) {
-			if (target_j->j_port == MACH_PORT_NULL) {
-				(void)job_assumes(target_j, job_setup_machport(target_j) == true);
-			}
+	launch_data_t destname = launch_data_dict_lookup(pload, LAUNCH_JOBKEY_XPCDOMAIN);
+	if (!destname) {
+		return 0;
+	}
+	if (launch_data_get_type(destname) != LAUNCH_DATA_STRING) {
+		if (jm) {
+			jobmgr_log(jm, LOG_ERR, "XPC domain type is not a string.");
+		}
+		return EINVAL;
+	}
 
-			_mp = target_j->j_port;
-			kr = _mp != MACH_PORT_NULL ? BOOTSTRAP_SUCCESS : BOOTSTRAP_NO_MEMORY;
-		} else {
-			kr = BOOTSTRAP_NO_MEMORY;
+	const char *str = launch_data_get_string(destname);
+	if (strcmp(str, XPC_DOMAIN_TYPE_SYSTEM) != 0
+		&& strcmp(str, XPC_DOMAIN_TYPE_PERUSER) != 0
+		&& strcmp(str, XPC_DOMAIN_TYPE_PERSESSION) != 0) {
+		if (jm) {
+			jobmgr_log(jm, LOG_ERR, "Invalid XPC domain type: %s", str);
 		}
+		return EINVAL;
 	}
 
-	*mp = _mp;
-	return kr;
+	return 0;
 }
 
-kern_return_t
-job_mig_set_security_session(job_t j, uuid_t uuid, mach_port_t asport)
+job_t
+_xpc_domain_import_service(jobmgr_t jm, launch_data_t pload)
 {
-#if TARGET_OS_EMBEDDED
-	return KERN_SUCCESS;
-#endif
+	jobmgr_t where2put = NULL;
+	int error;
 
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	if ((error = _xpc_domain_service_check(jm, pload))) {
+		errno = error;
+		return NULL;
 	}
 
-	uuid_string_t uuid_str;
-	uuid_unparse(uuid, uuid_str);
-	job_log(j, LOG_DEBUG, "Setting session %u for UUID %s...", asport, uuid_str);
+	const char *label = launch_data_get_string(launch_data_dict_lookup(pload, LAUNCH_JOBKEY_LABEL));
+	jobmgr_log(jm, LOG_DEBUG, "Importing service: %s", label);
 
-	job_t ji = NULL, jt = NULL;
-	LIST_FOREACH_SAFE(ji, &s_needing_sessions, sle, jt) {
-		uuid_string_t uuid_str2;
-		uuid_unparse(ji->expected_audit_uuid, uuid_str2);
+	launch_data_t destname = launch_data_dict_lookup(pload, LAUNCH_JOBKEY_XPCDOMAIN);
+	if (destname) {
+		bool supported_domain = false;
+		const char *str = launch_data_get_string(destname);
 
-		if (uuid_compare(uuid, ji->expected_audit_uuid) == 0) {
-			uuid_clear(ji->expected_audit_uuid);
-			if (asport != MACH_PORT_NULL) {
-				job_log(ji, LOG_DEBUG, "Job should join session with port 0x%x", asport);
-				(void)job_assumes_zero(j, launchd_mport_copy_send(asport));
-			} else {
-				job_log(ji, LOG_DEBUG, "No session to set for job. Using our session.");
+		if (strcmp(str, XPC_DOMAIN_TYPE_SYSTEM) == 0) {
+			where2put = _s_xpc_system_domain;
+		} else if (strcmp(str, XPC_DOMAIN_TYPE_PERUSER) == 0) {
+			where2put = jobmgr_find_xpc_per_user_domain(jm, jm->req_euid);
+			supported_domain = true;
+		} else {
+			where2put = jobmgr_find_xpc_per_session_domain(jm, jm->req_asid);
+		}
+
+		if (where2put && !supported_domain) {
+			launch_data_t mi = NULL;
+			if ((mi = launch_data_dict_lookup(pload, LAUNCH_JOBKEY_MULTIPLEINSTANCES))) {
+				if (launch_data_get_type(mi) == LAUNCH_DATA_BOOL && launch_data_get_bool(mi)) {
+					jobmgr_log(where2put, LOG_ERR, "Multiple-instance services are not supported in this domain.");
+					where2put = NULL;
+					errno = EINVAL;
+				}
 			}
+		}
+	} else {
+		where2put = jm;
+	}
 
-			ji->asport = asport;
-			LIST_REMOVE(ji, needing_session_sle);
+	job_t j = NULL;
+	if (where2put) {
+		/* Gross. If the service already exists in a singleton domain, then
+		 * jobmgr_import2() will return the existing job. But if we fail to alias
+		 * this job, we will normally want to remove it. But if we did not create
+		 * it in the first place, then we need to avoid removing it. So check
+		 * errno against EEXIST in the success case and if it's EEXIST, then do
+		 * not remove the original job in the event of a failed alias.
+		 *
+		 * This really needs to be re-thought, but I think it'll require a larger
+		 * evaluation of launchd's data structures. Right now, once a job is
+		 * imported into a singleton domain, it won't be removed until the system
+		 * shuts down, but that may not always be true. If it ever changes, we'll
+		 * have a problem because we'll have to account for all existing aliases
+		 * and clean them up somehow. Or just start ref-counting. I knew this
+		 * aliasing stuff would be trouble...
+		 *
+		 * <rdar://problem/10646503>
+		 */
+		jobmgr_log(where2put, LOG_DEBUG, "Importing service...");
 
-			if (ji->event_monitor) {
-				eventsystem_ping();
+		errno = 0;
+		if ((j = jobmgr_import2(where2put, pload))) {
+			bool created = (errno != EEXIST);
+			j->xpc_service = true;
+
+			if (where2put->xpc_singleton) {
+				/* If the service was destined for one of the global domains,
+				 * then we have to alias it into our local domain to reserve the
+				 * name.
+				 */
+				job_t ja = NULL;
+				if (!(ja = job_new_alias(jm, j))) {
+					/* If we failed to alias the job because of a conflict over
+					 * the label, then we remove it from the global domain. We
+					 * don't want to risk having imported a malicious job into
+					 * one of the global domains.
+					 */
+					if (errno != EEXIST) {
+						job_log(j, LOG_ERR, "Failed to alias job into: %s: %d: %s", where2put->name, errno, strerror(errno));
+					} else {
+						errno = 0;
+					}
+
+					if (created) {
+						jobmgr_log(jm, LOG_WARNING, "Singleton service already existed in job-local namespace. Removing: %s", j->label);
+						job_remove(j);
+					}
+
+					j = NULL;
+				} else {
+					jobmgr_log(jm, LOG_DEBUG, "Aliased service into local domain: %s", j->label);
+					(void)job_dispatch(j, false);
+					ja->xpc_service = true;
+					j = ja;
+				}
 			} else {
-				job_dispatch(ji, false);
+				(void)job_dispatch(j, false);
+			}
+		}
+	} else {
+		jobmgr_log(jm, LOG_DEBUG, "Could not find destination for service: %s", label);
+	}
+
+	return j;
+}
+
+int
+_xpc_domain_import_services(job_t j, launch_data_t services)
+{
+	int error = EINVAL;
+	if (launch_data_get_type(services) != LAUNCH_DATA_ARRAY) {
+		return error;
+	}
+
+	size_t i = 0;
+	size_t c = launch_data_array_get_count(services);
+	jobmgr_log(j->mgr, LOG_DEBUG, "Importing new services: %lu", c);
+
+	for (i = 0; i < c; i++) {
+		jobmgr_log(j->mgr, LOG_DEBUG, "Importing service at index: %lu", i);
+
+		job_t nj = NULL;
+		launch_data_t ploadi = launch_data_array_get_index(services, i);
+		if (!(nj = _xpc_domain_import_service(j->mgr, ploadi))) {
+			if (!j->mgr->session_initialized && errno) {
+				/* Service import failures are only fatal if the domain is being
+				 * initialized. If we're extending the domain, we can run into
+				 * errors with services already existing, so we just ignore them.
+				 * In the case of a domain extension, we don't want to halt the
+				 * operation if we run into an error with one service.
+				 *
+				 * <rdar://problem/10842779>
+				 */
+				jobmgr_log(j->mgr, LOG_ERR, "Failed to import service at index: %lu: %d: %s", i, errno, strerror(errno));
+				error = errno;
+				break;
 			}
+		} else {
+			jobmgr_log(j->mgr, LOG_DEBUG, "Imported service: %s", nj->label);
 		}
 	}
 
-	/* Each job that the session port was set for holds a reference. At the end of
-	 * the loop, there will be one extra reference belonging to this MiG protocol.
-	 * We need to release it so that the session goes away when all the jobs
-	 * referencing it are unloaded.
-	 */
-	(void)job_assumes_zero(j, launchd_mport_deallocate(asport));
-
-	return KERN_SUCCESS;
+	if (i == c) {
+		error = 0;
+	}
+
+	return error;
 }
 
-jobmgr_t 
-jobmgr_find_by_name(jobmgr_t jm, const char *where)
+kern_return_t
+xpc_domain_import2(job_t j, mach_port_t reqport, mach_port_t dport)
 {
-	jobmgr_t jmi, jmi2;
-
-	// NULL is only passed for our custom API for LaunchServices. If that is the case, we do magic.
-	if (where == NULL) {
-		if (strcasecmp(jm->name, VPROCMGR_SESSION_LOGINWINDOW) == 0) {
-			where = VPROCMGR_SESSION_LOGINWINDOW;
-		} else {
-			where = VPROCMGR_SESSION_AQUA;
-		}
+	if (unlikely(!pid1_magic)) {
+		job_log(j, LOG_ERR, "XPC domains may only reside in PID 1.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
-
-	if (strcasecmp(jm->name, where) == 0) {
-		return jm;
+	if (!j || !MACH_PORT_VALID(reqport)) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
-
-	if (strcasecmp(where, VPROCMGR_SESSION_BACKGROUND) == 0 && !pid1_magic) {
-		jmi = root_jobmgr;
-		goto jm_found;
+	if (root_jobmgr->shutting_down) {
+		jobmgr_log(root_jobmgr, LOG_ERR, "Attempt to create new domain while shutting down.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+	if (!j->xpc_bootstrapper) {
+		job_log(j, LOG_ERR, "Attempt to create new XPC domain by unprivileged job.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	SLIST_FOREACH(jmi, &root_jobmgr->submgrs, sle) {	
-		if (unlikely(jmi->shutting_down)) {
-			continue;
-		} else if (jmi->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
-			continue;
-		} else if (strcasecmp(jmi->name, where) == 0) {
-			goto jm_found;
-		} else if (strcasecmp(jmi->name, VPROCMGR_SESSION_BACKGROUND) == 0 && pid1_magic) {
-			SLIST_FOREACH(jmi2, &jmi->submgrs, sle) {
-				if (strcasecmp(jmi2->name, where) == 0) {
-					jmi = jmi2;
-					goto jm_found;
-				}
-			}
-		}
+	kern_return_t kr = BOOTSTRAP_NO_MEMORY;
+	/* All XPC domains are children of the root job manager. What we're creating
+	 * here is really just a skeleton. By creating it, we're adding reqp to our
+	 * port set. It will have two messages on it. The first specifies the
+	 * environment of the originator. This is so we can cache it and hand it to
+	 * xpcproxy to bootstrap our services. The second is the set of jobs that is
+	 * to be bootstrapped in.
+	 */
+	jobmgr_t jm = jobmgr_new(root_jobmgr, reqport, dport, false, NULL, true, MACH_PORT_NULL);
+	if (job_assumes(j, jm != NULL)) {
+		jm->properties |= BOOTSTRAP_PROPERTY_XPC_DOMAIN;
+		jm->shortdesc = "private";
+		jobmgr_session_name_update(jm);
+		kr = BOOTSTRAP_SUCCESS;
 	}
 
-jm_found:
-	return jmi;
+	return kr;
 }
 
 kern_return_t
-job_mig_move_subset(job_t j, mach_port_t target_subset, name_t session_type, mach_port_t asport, uint64_t flags)
+xpc_domain_set_environment(job_t j, mach_port_t rp, mach_port_t bsport, mach_port_t excport, vm_offset_t ctx, mach_msg_type_number_t ctx_sz)
 {
-	mach_msg_type_number_t l2l_i, l2l_port_cnt = 0;
-	mach_port_array_t l2l_ports = NULL;
-	mach_port_t reqport, rcvright;
-	kern_return_t kr = 1;
-	launch_data_t out_obj_array = NULL;
-	struct ldcred *ldc = runtime_get_caller_creds();
-	jobmgr_t jmr = NULL;
-
 	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
-
-	if (job_mig_intran2(root_jobmgr, target_subset, ldc->pid)) {
-		job_log(j, LOG_ERR, "Moving a session to ourself is bogus.");
-
-		kr = BOOTSTRAP_NOT_PRIVILEGED;
-		goto out;
-	}
-
-	job_log(j, LOG_DEBUG, "Move subset attempt: 0x%x", target_subset);
-
-	kr = _vproc_grab_subset(target_subset, &reqport, &rcvright, &out_obj_array, &l2l_ports, &l2l_port_cnt);
-	if (job_assumes_zero(j, kr) != 0) {
-		goto out;
+		/* Due to the whacky nature of XPC service bootstrapping, we can end up
+		 * getting this message long after the requesting process has gone away.
+		 * See <rdar://problem/8593143>.
+		 */
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	if (launch_data_array_get_count(out_obj_array) != l2l_port_cnt) {
-		os_assert_zero(l2l_port_cnt);
+	jobmgr_t jm = j->mgr;
+	if (!(jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	if (!job_assumes(j, (jmr = jobmgr_new(j->mgr, reqport, rcvright, false, session_type, false, asport)) != NULL)) {
-		kr = BOOTSTRAP_NO_MEMORY;
-		goto out;
+	if (jm->req_asport != MACH_PORT_NULL) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	if (strcmp(session_type, VPROCMGR_SESSION_AQUA) == 0) {
-		jobmgr_log(jmr, LOG_NOTICE, "Registering new GUI session.");
-		kr = vproc_mig_register_gui_session(inherited_bootstrap_port, asport);
-		if (kr) {
-			jobmgr_log(jmr, LOG_ERR, "Failed to register GUI session with PID 1: 0x%x/0x%x", inherited_bootstrap_port, kr);
+	struct ldcred *ldc = runtime_get_caller_creds();
+	struct proc_bsdinfowithuniqid proc;
+	if (proc_pidinfo(ldc->pid, PROC_PIDT_BSDINFOWITHUNIQID, 1, &proc, PROC_PIDT_BSDINFOWITHUNIQID_SIZE) == 0) {
+		if (errno != ESRCH) {
+			(void)jobmgr_assumes_zero(jm, errno);
 		}
-	}
-
-	jmr->properties |= BOOTSTRAP_PROPERTY_MOVEDSUBSET;
-
-	/* This is a hack. We should be doing this in jobmgr_new(), but since we're in the middle of
-	 * processing an IPC request, we'll do this action before the new job manager can get any IPC
-	 * requests. This serialization is guaranteed since we are single-threaded in that respect.
-	 */
-	if (flags & LAUNCH_GLOBAL_ON_DEMAND) {
-		// This is so awful.
-		// Remove the job from its current job manager.
-		LIST_REMOVE(j, sle);
-		LIST_REMOVE(j, pid_hash_sle);
-
-		// Put the job into the target job manager.
-		LIST_INSERT_HEAD(&jmr->jobs, j, sle);
-		LIST_INSERT_HEAD(&jmr->active_jobs[ACTIVE_JOB_HASH(j->p)], j, pid_hash_sle);
-
-		j->mgr = jmr;
-		job_set_global_on_demand(j, true);
 
-		if (!j->holds_ref) {
-			job_log(j, LOG_PERF, "Job moved subset into: %s", j->mgr->name);
-			j->holds_ref = true;
-			runtime_add_ref();
-		}
+		jm->error = errno;
+		jobmgr_remove(jm);
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	for (l2l_i = 0; l2l_i < l2l_port_cnt; l2l_i++) {
-		launch_data_t tmp, obj_at_idx;
-		struct machservice *ms;
-		job_t j_for_service;
-		const char *serv_name;
-		pid_t target_pid;
-		bool serv_perpid;
-
-		(void)job_assumes(j, obj_at_idx = launch_data_array_get_index(out_obj_array, l2l_i));
-		(void)job_assumes(j, tmp = launch_data_dict_lookup(obj_at_idx, TAKE_SUBSET_PID));
-		target_pid = (pid_t)launch_data_get_integer(tmp);
-		(void)job_assumes(j, tmp = launch_data_dict_lookup(obj_at_idx, TAKE_SUBSET_PERPID));
-		serv_perpid = launch_data_get_bool(tmp);
-		(void)job_assumes(j, tmp = launch_data_dict_lookup(obj_at_idx, TAKE_SUBSET_NAME));
-		serv_name = launch_data_get_string(tmp);
-
-		j_for_service = jobmgr_find_by_pid(jmr, target_pid, true);
-
-		if (unlikely(!j_for_service)) {
-			// The PID probably exited
-			(void)job_assumes_zero(j, launchd_mport_deallocate(l2l_ports[l2l_i]));
-			continue;
-		}
-
-		if (likely(ms = machservice_new(j_for_service, serv_name, &l2l_ports[l2l_i], serv_perpid))) {
-			job_log(j, LOG_DEBUG, "Importing %s into new bootstrap.", serv_name);
-			machservice_request_notifications(ms);
-		}
+#if !TARGET_OS_EMBEDDED
+	if (jobmgr_assumes_zero(jm, audit_session_port(ldc->asid, &jm->req_asport)) != 0) {
+		jm->error = EPERM;
+		jobmgr_remove(jm);
+		job_log(j, LOG_ERR, "Failed to get port for ASID: %u", ldc->asid);
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
+#else
+	jm->req_asport = MACH_PORT_DEAD;
+#endif
 
-	kr = 0;
-
-out:
-	if (out_obj_array) {
-		launch_data_free(out_obj_array);
+	struct waiting4attach *w4ai = NULL;
+	struct waiting4attach *w4ait = NULL;
+	LIST_FOREACH_SAFE(w4ai, &_launchd_domain_waiters, le, w4ait) {
+		if (w4ai->dest == ldc->pid) {
+			jobmgr_log(jm, LOG_DEBUG, "Migrating attach for: %s", w4ai->name);
+			LIST_REMOVE(w4ai, le);
+			LIST_INSERT_HEAD(&jm->attaches, w4ai, le);
+			w4ai->jm = jm;
+			w4ai->dest = 0;
+		}
 	}
 
-	if (l2l_ports) {
-		mig_deallocate((vm_address_t)l2l_ports, l2l_port_cnt * sizeof(l2l_ports[0]));
-	}
+	(void)snprintf(jm->name_init, NAME_MAX, "com.apple.xpc.domain.%s.%d", proc.pbsd.pbi_comm, ldc->pid);
+	strlcpy(jm->owner, proc.pbsd.pbi_comm, sizeof(jm->owner));
+	jm->req_bsport = bsport;
+	jm->req_excport = excport;
+	jm->req_rport = rp;
+	jm->req_ctx = ctx;
+	jm->req_ctx_sz = ctx_sz;
+	jm->req_pid = ldc->pid;
+	jm->req_euid = ldc->euid;
+	jm->req_egid = ldc->egid;
+	jm->req_asid = ldc->asid;
+	jm->req_uniqueid = proc.p_uniqidentifier.p_uniqueid;
 
-	if (kr == 0) {
-		if (target_subset) {
-			(void)job_assumes_zero(j, launchd_mport_deallocate(target_subset));
-		}
-		if (asport) {
-			(void)job_assumes_zero(j, launchd_mport_deallocate(asport));
-		}
-	} else if (jmr) {
-		jobmgr_shutdown(jmr);
-	}
+	return KERN_SUCCESS;
+}
 
-	return kr;
+bool
+_xpc_domain_caller_is_bootstrapper(job_t j)
+{
+	/* There is only ever one bootstrapper, so there is no need to search the
+	 * root job manager for the caller's PID.
+	 */
+	job_t bj = _launchd_xpc_bootstrapper;
+	return bj && bj->mgr == root_jobmgr && bj->p && bj->p == j->p;
 }
 
-kern_return_t
-job_mig_init_session(job_t j, name_t session_type, mach_port_t asport)
+int
+_xpc_domain_load(job_t j, launch_data_t services)
 {
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	// This is just for XPC domains (for now).
+	if (!(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
-
-	job_t j2;
-
-	kern_return_t kr = BOOTSTRAP_NO_MEMORY;
 	if (j->mgr->session_initialized) {
-		job_log(j, LOG_ERR, "Tried to initialize an already setup session!");
-		kr = BOOTSTRAP_NOT_PRIVILEGED;
-	} else if (strcmp(session_type, VPROCMGR_SESSION_LOGINWINDOW) == 0) {
-		jobmgr_t jmi;
-
-		/*
-		 * 5330262
-		 *
-		 * We're working around LoginWindow and the WindowServer.
-		 *
-		 * In practice, there is only one LoginWindow session. Unfortunately, for certain
-		 * scenarios, the WindowServer spawns loginwindow, and in those cases, it frequently
-		 * spawns a replacement loginwindow session before cleaning up the previous one.
-		 *
-		 * We're going to use the creation of a new LoginWindow context as a clue that the
-		 * previous LoginWindow context is on the way out and therefore we should just
-		 * kick-start the shutdown of it.
-		 */
-
-		SLIST_FOREACH(jmi, &root_jobmgr->submgrs, sle) {
-			if (unlikely(jmi->shutting_down)) {
-				continue;
-			} else if (strcasecmp(jmi->name, session_type) == 0) {
-				jobmgr_shutdown(jmi);
-				break;
-			}
-		}
-	} else if (strcmp(session_type, VPROCMGR_SESSION_AQUA) == 0) {
-		(void)job_assumes_zero(j, runtime_remove_mport(j->mgr->jm_port));
- 	}
-
-	jobmgr_log(j->mgr, LOG_DEBUG, "Initializing as %s", session_type);
-	strcpy(j->mgr->name_init, session_type);
+		jobmgr_log(j->mgr, LOG_ERR, "Attempt to initialize an already-initialized XPC domain.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
 
-	if (job_assumes(j, (j2 = jobmgr_init_session(j->mgr, session_type, false)))) {
-		j2->asport = asport;
-		(void)job_assumes(j, job_dispatch(j2, true));
-		kr = BOOTSTRAP_SUCCESS;
+	int error = _xpc_domain_import_services(j, services);
+	if (error) {
+		j->mgr->error = error;
+		jobmgr_log(j->mgr, LOG_ERR, "Obliterating domain.");
+		jobmgr_remove(j->mgr);
+	} else {
+		j->mgr->session_initialized = true;
+		(void)jobmgr_assumes_zero(j->mgr, xpc_call_wakeup(j->mgr->req_rport, BOOTSTRAP_SUCCESS));
+		j->mgr->req_rport = MACH_PORT_NULL;
 	}
 
-	return kr;
+	return error;
 }
 
 kern_return_t
-job_mig_switch_to_session(job_t j, mach_port_t requestor_port, name_t session_name, mach_port_t asport, mach_port_t *new_bsport)
+xpc_domain_load_services(job_t j, vm_offset_t services_buff, mach_msg_type_number_t services_sz)
 {
-	struct ldcred *ldc = runtime_get_caller_creds();
-	if (!jobmgr_assumes(root_jobmgr, j != NULL)) {
-		jobmgr_log(root_jobmgr, LOG_ERR, "%s() called with NULL job: PID %d", __func__, ldc->pid);
-		return BOOTSTRAP_NO_MEMORY;
-	}
-
-	if (j->mgr->shutting_down) {
+	if (!j) {
 		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	job_log(j, LOG_DEBUG, "Job wants to move to %s session.", session_name);
-
-	if (!job_assumes(j, pid1_magic == false)) {
-		job_log(j, LOG_WARNING, "Switching sessions is not allowed in the system Mach bootstrap.");
+	if (!_xpc_domain_caller_is_bootstrapper(j)) {
+		job_log(j, LOG_ERR, "Attempt to load services into XPC domain by unprivileged job.");
 		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	if (!j->anonymous) {
-		job_log(j, LOG_NOTICE, "Non-anonymous job tried to switch sessions. Please use LimitLoadToSessionType instead.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	size_t offset = 0;
+	launch_data_t services = launch_data_unpack((void *)services_buff, services_sz, NULL, 0, &offset, NULL);
+	if (!services) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	jobmgr_t target_jm = jobmgr_find_by_name(root_jobmgr, session_name);
-	if (target_jm == j->mgr) {
-		job_log(j, LOG_DEBUG, "Job is already in its desired session (%s).", session_name);
-		(void)job_assumes_zero(j, launchd_mport_deallocate(asport));
-		(void)job_assumes_zero(j, launchd_mport_deallocate(requestor_port));
-		*new_bsport = target_jm->jm_port;
-		return BOOTSTRAP_SUCCESS;
+	int error = _xpc_domain_load(j, services);
+	if (!error) {
+		/* Returning a failure code will destroy the message, whereas returning
+		 * success will not, so we need to clean up here.
+		 */
+		mig_deallocate(services_buff, services_sz);
 	}
 
-	if (!target_jm) {
-		target_jm = jobmgr_new(j->mgr, requestor_port, MACH_PORT_NULL, false, session_name, false, asport);
-		if (target_jm) {
-			target_jm->properties |= BOOTSTRAP_PROPERTY_IMPLICITSUBSET;
-			(void)job_assumes_zero(j, launchd_mport_deallocate(asport));
-		}
-	}
+	return error;
+}
 
-	if (!job_assumes(j, target_jm != NULL)) {
-		job_log(j, LOG_WARNING, "Could not find %s session!", session_name);
-		return BOOTSTRAP_NO_MEMORY;
+kern_return_t
+xpc_domain_check_in(job_t j, mach_port_t *bsport, mach_port_t *sbsport, 
+	mach_port_t *excport, mach_port_t *asport, uint32_t *uid, uint32_t *gid,
+	int32_t *asid, vm_offset_t *ctx, mach_msg_type_number_t *ctx_sz)
+{
+	if (!jobmgr_assumes(root_jobmgr, j != NULL)) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
-
-	// Remove the job from it's current job manager.
-	LIST_REMOVE(j, sle);
-	LIST_REMOVE(j, pid_hash_sle);
-
-	job_t ji = NULL, jit = NULL;
-	LIST_FOREACH_SAFE(ji, &j->mgr->global_env_jobs, global_env_sle, jit) {
-		if (ji == j) {
-			LIST_REMOVE(ji, global_env_sle);
-			break;
-		}
+	jobmgr_t jm = j->mgr;
+	if (!(jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	// Put the job into the target job manager.
-	LIST_INSERT_HEAD(&target_jm->jobs, j, sle);
-	LIST_INSERT_HEAD(&target_jm->active_jobs[ACTIVE_JOB_HASH(j->p)], j, pid_hash_sle);
-
-	if (ji) {
-		LIST_INSERT_HEAD(&target_jm->global_env_jobs, j, global_env_sle);
+	if (jm->req_asport == MACH_PORT_NULL) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	// Move our Mach services over if we're not in a flat namespace.
-	if (!launchd_flat_mach_namespace && !SLIST_EMPTY(&j->machservices)) {
-		struct machservice *msi = NULL, *msit = NULL;
-		SLIST_FOREACH_SAFE(msi, &j->machservices, sle, msit) {
-			LIST_REMOVE(msi, name_hash_sle);
-			LIST_INSERT_HEAD(&target_jm->ms_hash[hash_ms(msi->name)], msi, name_hash_sle);
+	*bsport = jm->req_bsport;
+	*sbsport = root_jobmgr->jm_port;
+	*excport = jm->req_excport;
+	if (j->joins_gui_session) {
+		if (jm->req_gui_asport) {
+			*asport = jm->req_gui_asport;
+		} else {
+			job_log(j, LOG_NOTICE, "No GUI session set for UID of user service. This service may not act properly.");
+			*asport = jm->req_asport;
 		}
+	} else {
+		*asport = jm->req_asport;
 	}
 
-	j->mgr = target_jm;
-
-	if (!j->holds_ref) {
-		/* Anonymous jobs which move around are particularly interesting to us, so we want to
-		 * stick around while they're still around.
-		 * For example, login calls into the PAM launchd module, which moves the process into
-		 * the StandardIO session by default. So we'll hold a reference on that job to prevent
-		 * ourselves from going away.
-		 */
-		j->holds_ref = true;
-		job_log(j, LOG_PERF, "Job switched into manager: %s", j->mgr->name);
-		runtime_add_ref();
-	}
+	*uid = jm->req_euid;
+	*gid = jm->req_egid;
+	*asid = jm->req_asid;
 
-	*new_bsport = target_jm->jm_port;
+	*ctx = jm->req_ctx;
+	*ctx_sz = jm->req_ctx_sz;
 
 	return KERN_SUCCESS;
 }
 
 kern_return_t
-job_mig_take_subset(job_t j, mach_port_t *reqport, mach_port_t *rcvright,
-		vm_offset_t *outdata, mach_msg_type_number_t *outdataCnt,
-		mach_port_array_t *portsp, unsigned int *ports_cnt)
+xpc_domain_get_service_name(job_t j, event_name_t name)
 {
-	launch_data_t tmp_obj, tmp_dict, outdata_obj_array = NULL;
-	mach_port_array_t ports = NULL;
-	unsigned int cnt = 0, cnt2 = 0;
-	size_t packed_size;
-	struct machservice *ms;
-	jobmgr_t jm;
-	job_t ji;
-
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	jm = j->mgr;
-
-	if (unlikely(!pid1_magic)) {
-		job_log(j, LOG_ERR, "Only the system launchd will transfer Mach sub-bootstraps.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-	if (unlikely(jobmgr_parent(jm) == NULL)) {
-		job_log(j, LOG_ERR, "Root Mach bootstrap cannot be transferred.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-	if (unlikely(strcasecmp(jm->name, VPROCMGR_SESSION_AQUA) == 0)) {
-		job_log(j, LOG_ERR, "Cannot transfer a setup GUI session.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-	if (unlikely(!j->anonymous)) {
-		job_log(j, LOG_ERR, "Only the anonymous job can transfer Mach sub-bootstraps.");
+	if (!j->xpc_service) {
+		jobmgr_log(j->mgr, LOG_ERR, "Attempt to get service name by non-XPC service: %s", j->label);
 		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	job_log(j, LOG_DEBUG, "Transferring sub-bootstrap to the per session launchd.");
-
-	outdata_obj_array = launch_data_alloc(LAUNCH_DATA_ARRAY);
-	if (!job_assumes(j, outdata_obj_array)) {
-		goto out_bad;
-	}
-
-	*outdataCnt = 20 * 1024 * 1024;
-	mig_allocate(outdata, *outdataCnt);
-	if (!job_assumes(j, *outdata != 0)) {
-		return 1;
+	const char *what2find = j->label;
+	if (j->dedicated_instance) {
+		what2find = j->original->label;
 	}
 
-	LIST_FOREACH(ji, &j->mgr->jobs, sle) {
-		if (!ji->anonymous) {
-			continue;
-		}
-		SLIST_FOREACH(ms, &ji->machservices, sle) {
-			cnt++;
+	struct machservice *msi = NULL;
+	SLIST_FOREACH(msi, &j->machservices, sle) {
+		if (strcmp(msi->name, what2find) == 0) {
+			break;
 		}
 	}
 
-	mig_allocate((vm_address_t *)&ports, cnt * sizeof(ports[0]));
-	if (!job_assumes(j, ports != NULL)) {
-		goto out_bad;
+	if (!msi) {
+		jobmgr_log(j->mgr, LOG_ERR, "Attempt to get service name that does not exist: %s", j->label);
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	LIST_FOREACH(ji, &j->mgr->jobs, sle) {
-		if (!ji->anonymous) {
-			continue;
-		}
-
-		SLIST_FOREACH(ms, &ji->machservices, sle) {
-			if (job_assumes(j, (tmp_dict = launch_data_alloc(LAUNCH_DATA_DICTIONARY)))) {
-				(void)job_assumes(j, launch_data_array_set_index(outdata_obj_array, tmp_dict, cnt2));
-			} else {
-				goto out_bad;
-			}
-
-			if (job_assumes(j, (tmp_obj = launch_data_new_string(machservice_name(ms))))) {
-				(void)job_assumes(j, launch_data_dict_insert(tmp_dict, tmp_obj, TAKE_SUBSET_NAME));
-			} else {
-				goto out_bad;
-			}
-
-			if (job_assumes(j, (tmp_obj = launch_data_new_integer((ms->job->p))))) {
-				(void)job_assumes(j, launch_data_dict_insert(tmp_dict, tmp_obj, TAKE_SUBSET_PID));
-			} else {
-				goto out_bad;
-			}
-
-			if (job_assumes(j, (tmp_obj = launch_data_new_bool((ms->per_pid))))) {
-				(void)job_assumes(j, launch_data_dict_insert(tmp_dict, tmp_obj, TAKE_SUBSET_PERPID));
-			} else {
-				goto out_bad;
-			}
-
-			ports[cnt2] = machservice_port(ms);
+	(void)strlcpy(name, msi->name, sizeof(event_name_t));
+	return BOOTSTRAP_SUCCESS;
+}
 
-			// Increment the send right by one so we can shutdown the jobmgr cleanly
-			(void)jobmgr_assumes_zero(jm, launchd_mport_copy_send(ports[cnt2]));
-			cnt2++;
-		}
+#if XPC_LPI_VERSION >= 20111216
+kern_return_t
+xpc_domain_add_services(job_t j, vm_offset_t services_buff, mach_msg_type_number_t services_sz)
+{
+	if (!j) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	(void)job_assumes(j, cnt == cnt2);
-
-	runtime_ktrace0(RTKT_LAUNCHD_DATA_PACK);
-	packed_size = launch_data_pack(outdata_obj_array, (void *)*outdata, *outdataCnt, NULL, NULL);
-	if (!job_assumes(j, packed_size != 0)) {
-		goto out_bad;
+	if (!_xpc_domain_caller_is_bootstrapper(j)) {
+		job_log(j, LOG_ERR, "Attempt to add service to XPC domain by unprivileged job.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	launch_data_free(outdata_obj_array);
-
-	*portsp = ports;
-	*ports_cnt = cnt;
-
-	*reqport = jm->req_port;
-	*rcvright = jm->jm_port;
-
-	jm->req_port = 0;
-	jm->jm_port = 0;
+	if (!(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
 
-	workaround_5477111 = j;
+	size_t offset = 0;
+	launch_data_t services = launch_data_unpack((void *)services_buff, services_sz, NULL, 0, &offset, NULL);
+	if (!services) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
 
-	jobmgr_shutdown(jm);
+	int error = _xpc_domain_import_services(j, services);
+	if (!error) {
+		mig_deallocate(services_buff, services_sz);
+	}
 
-	return BOOTSTRAP_SUCCESS;
+	return error;
+}
+#endif
 
-out_bad:
-	if (outdata_obj_array) {
-		launch_data_free(outdata_obj_array);
-	}
-	if (*outdata) {
-		mig_deallocate(*outdata, *outdataCnt);
+// A bundle is rejected up front if any service would fail to import.
+int
+_xpc_bundle_validate(launch_data_t services)
+{
+	if (launch_data_get_type(services) != LAUNCH_DATA_ARRAY) {
+		return EINVAL;
 	}
-	if (ports) {
-		mig_deallocate((vm_address_t)ports, cnt * sizeof(ports[0]));
+
+	size_t i = 0;
+	size_t c = launch_data_array_get_count(services);
+	int error = 0;
+	for (i = 0; i < c && !error; i++) {
+		error = _xpc_domain_service_check(NULL, launch_data_array_get_index(services, i));
 	}
 
-	return BOOTSTRAP_NO_MEMORY;
+	return error;
 }
 
-kern_return_t
-job_mig_subset(job_t j, mach_port_t requestorport, mach_port_t *subsetportp)
+struct xpc_service_bundle *
+_xpc_bundle_find(uint64_t hash)
 {
-	int bsdepth = 0;
-	jobmgr_t jmr;
+	struct xpc_service_bundle *b = NULL;
+	LIST_FOREACH(b, &s_xpc_bundles, le) {
+		if (b->hash == hash) {
+			break;
+		}
+	}
+
+	return b;
+}
+
+void
+_xpc_bundle_delete(struct xpc_service_bundle *b)
+{
+	LIST_REMOVE(b, le);
+	s_xpc_bundle_cnt--;
+	launch_data_free(b->services);
+	free(b);
+}
 
+kern_return_t
+job_mig_xpc_bundle_register(job_t j, vm_offset_t services_buff, mach_msg_type_number_t services_sz, uint64_t replaces, uint64_t *hash)
+{
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
-	if (j->mgr->shutting_down) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
-	}
 
-	jmr = j->mgr;
+	if (!_xpc_domain_caller_is_bootstrapper(j)) {
+		job_log(j, LOG_ERR, "Attempt to register XPC service bundle by unprivileged job.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
 
-	while ((jmr = jobmgr_parent(jmr)) != NULL) {
-		bsdepth++;
+	// FNV-1a over the packed bundle. Identical contents always land on the same entry.
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i = 0;
+	for (i = 0; i < services_sz; i++) {
+		h ^= ((unsigned char *)services_buff)[i];
+		h *= 0x100000001b3ULL;
 	}
 
-	// Since we use recursion, we need an artificial depth for subsets
-	if (unlikely(bsdepth > 100)) {
-		job_log(j, LOG_ERR, "Mach sub-bootstrap create request failed. Depth greater than: %d", bsdepth);
-		return BOOTSTRAP_NO_MEMORY;
+	struct xpc_service_bundle *b = NULL;
+	if (replaces && replaces != h && (b = _xpc_bundle_find(replaces))) {
+		job_log(j, LOG_DEBUG, "Invalidating XPC service bundle: 0x%llx", replaces);
+		_xpc_bundle_delete(b);
 	}
 
-	char name[NAME_MAX];
-	snprintf(name, sizeof(name), "%s[%i].subset.%i", j->anonymous ? j->prog : j->label, j->p, MACH_PORT_INDEX(requestorport));
+	if (!(b = _xpc_bundle_find(h))) {
+		size_t offset = 0;
+		launch_data_t services = launch_data_unpack((void *)services_buff, services_sz, NULL, 0, &offset, NULL);
+		if (!services) {
+			return BOOTSTRAP_NO_MEMORY;
+		}
 
-	if (!job_assumes(j, (jmr = jobmgr_new(j->mgr, requestorport, MACH_PORT_NULL, false, name, true, j->asport)) != NULL)) {
-		if (unlikely(requestorport == MACH_PORT_NULL)) {
-			return BOOTSTRAP_NOT_PRIVILEGED;
+		int error = _xpc_bundle_validate(services);
+		if (error) {
+			job_log(j, LOG_ERR, "Rejecting invalid XPC service bundle.");
+			return error;
 		}
-		return BOOTSTRAP_NO_MEMORY;
-	}
 
-	*subsetportp = jmr->jm_port;
-	jmr->properties |= BOOTSTRAP_PROPERTY_EXPLICITSUBSET;
+		if (s_xpc_bundle_cnt >= XPC_BUNDLE_MAX) {
+			struct xpc_service_bundle *bi = NULL, *oldest = NULL;
+			LIST_FOREACH(bi, &s_xpc_bundles, le) {
+				if (!oldest || bi->last_used < oldest->last_used) {
+					oldest = bi;
+				}
+			}
+			_xpc_bundle_delete(oldest);
+		}
 
-	/* A job could create multiple subsets, so only add a reference the first time
-	 * it does so we don't have to keep a count.
-	 */
-	if (j->anonymous && !j->holds_ref) {
-		job_log(j, LOG_PERF, "Job created subset: %s", jmr->name);
-		j->holds_ref = true;
-		runtime_add_ref();
+		if (!job_assumes(j, (b = calloc(1, sizeof(*b))) != NULL)) {
+			return BOOTSTRAP_NO_MEMORY;
+		}
+		// The unpacked data points into the message buffer, so keep our own copy.
+		if (!job_assumes(j, (b->services = launch_data_copy(services)) != NULL)) {
+			free(b);
+			return BOOTSTRAP_NO_MEMORY;
+		}
+
+		b->hash = h;
+		b->cnt = launch_data_array_get_count(services);
+		LIST_INSERT_HEAD(&s_xpc_bundles, b, le);
+		s_xpc_bundle_cnt++;
+
+		job_log(j, LOG_DEBUG, "Registered XPC service bundle 0x%llx with %lu services.", h, b->cnt);
 	}
 
-	job_log(j, LOG_DEBUG, "Job created a subset named \"%s\"", jmr->name);
+	b->last_used = runtime_get_opaque_time();
+	*hash = h;
+
+	mig_deallocate(services_buff, services_sz);
+
 	return BOOTSTRAP_SUCCESS;
 }
 
-job_t
-_xpc_domain_import_service(jobmgr_t jm, launch_data_t pload)
+kern_return_t
+job_mig_xpc_bundle_load(job_t j, uint64_t hash)
 {
-	jobmgr_t where2put = NULL;
+	if (!j) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
+	}
 
-	if (launch_data_get_type(pload) != LAUNCH_DATA_DICTIONARY) {
-		errno = EINVAL;
-		return NULL;
+	if (!_xpc_domain_caller_is_bootstrapper(j)) {
+		job_log(j, LOG_ERR, "Attempt to load services into XPC domain by unprivileged job.");
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	launch_data_t ldlabel = launch_data_dict_lookup(pload, LAUNCH_JOBKEY_LABEL);
-	if (!ldlabel || launch_data_get_type(ldlabel) != LAUNCH_DATA_STRING) {
-		errno = EINVAL;
-		return NULL;
+	/* An unknown hash means that the bundle was never registered or has been
+	 * evicted. The caller is expected to fall back to xpc_domain_load_services.
+	 */
+	struct xpc_service_bundle *b = _xpc_bundle_find(hash);
+	if (!b) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
 
-	const char *label = launch_data_get_string(ldlabel);
-	jobmgr_log(jm, LOG_DEBUG, "Importing service: %s", label);
+	b->last_used = runtime_get_opaque_time();
+	jobmgr_log(j->mgr, LOG_DEBUG, "Loading XPC service bundle 0x%llx with %lu services.", hash, b->cnt);
 
-	launch_data_t destname = launch_data_dict_lookup(pload, LAUNCH_JOBKEY_XPCDOMAIN);
-	if (destname) {
-		bool supported_domain = false;
+	return _xpc_domain_load(j, b->services);
+}
 
-		if (launch_data_get_type(destname) == LAUNCH_DATA_STRING) {
-			const char *str = launch_data_get_string(destname);
-			if (strcmp(str, XPC_DOMAIN_TYPE_SYSTEM) == 0) {
-				where2put = _s_xpc_system_domain;
-			} else if (strcmp(str, XPC_DOMAIN_TYPE_PERUSER) == 0) {
-				where2put = jobmgr_find_xpc_per_user_domain(jm, jm->req_euid);
-				supported_domain = true;
-			} else if (strcmp(str, XPC_DOMAIN_TYPE_PERSESSION) == 0) {
-				where2put = jobmgr_find_xpc_per_session_domain(jm, jm->req_asid);
-			} else {
-				jobmgr_log(jm, LOG_ERR, "Invalid XPC domain type: %s", str);
-				errno = EINVAL;
-			}
-		} else {
-			jobmgr_log(jm, LOG_ERR, "XPC domain type is not a string.");
-			errno = EINVAL;
+#pragma mark XPC Events
+int
+xpc_event_find_channel(job_t j, const char *stream, struct machservice **ms)
+{
+	int error = EXNOMEM;
+	struct machservice *msi = NULL;
+	SLIST_FOREACH(msi, &j->machservices, sle) {
+		if (strcmp(stream, msi->name) == 0) {
+			break;
 		}
+	}
 
-		if (where2put && !supported_domain) {
-			launch_data_t mi = NULL;
-			if ((mi = launch_data_dict_lookup(pload, LAUNCH_JOBKEY_MULTIPLEINSTANCES))) {
-				if (launch_data_get_type(mi) == LAUNCH_DATA_BOOL && launch_data_get_bool(mi)) {
-					jobmgr_log(where2put, LOG_ERR, "Multiple-instance services are not supported in this domain.");
-					where2put = NULL;
-					errno = EINVAL;
-				}
-			}
+	if (!msi) {
+		mach_port_t sp = MACH_PORT_NULL;
+		msi = machservice_new(j, stream, &sp, false);
+		if (!msi) {
+			return EXNOMEM;
 		}
-	} else {
-		where2put = jm;
-	}
 
-	job_t j = NULL;
-	if (where2put) {
-		/* Gross. If the service already exists in a singleton domain, then
-		 * jobmgr_import2() will return the existing job. But if we fail to alias
-		 * this job, we will normally want to remove it. But if we did not create
-		 * it in the first place, then we need to avoid removing it. So check
-		 * errno against EEXIST in the success case and if it's EEXIST, then do
-		 * not remove the original job in the event of a failed alias.
-		 *
-		 * This really needs to be re-thought, but I think it'll require a larger
-		 * evaluation of launchd's data structures. Right now, once a job is
-		 * imported into a singleton domain, it won't be removed until the system
-		 * shuts down, but that may not always be true. If it ever changes, we'll
-		 * have a problem because we'll have to account for all existing aliases
-		 * and clean them up somehow. Or just start ref-counting. I knew this
-		 * aliasing stuff would be trouble...
-		 *
-		 * <rdar://problem/10646503>
+		job_log(j, LOG_DEBUG, "Creating new MachService for stream: %s", stream);
+		/* Hack to keep this from being publicly accessible through
+		 * bootstrap_look_up().
 		 */
-		jobmgr_log(where2put, LOG_DEBUG, "Importing service...");
-
-		errno = 0;
-		if ((j = jobmgr_import2(where2put, pload))) {
-			bool created = (errno != EEXIST);
-			j->xpc_service = true;
-
-			if (where2put->xpc_singleton) {
-				/* If the service was destined for one of the global domains,
-				 * then we have to alias it into our local domain to reserve the
-				 * name.
-				 */
-				job_t ja = NULL;
-				if (!(ja = job_new_alias(jm, j))) {
-					/* If we failed to alias the job because of a conflict over
-					 * the label, then we remove it from the global domain. We
-					 * don't want to risk having imported a malicious job into
-					 * one of the global domains.
-					 */
-					if (errno != EEXIST) {
-						job_log(j, LOG_ERR, "Failed to alias job into: %s: %d: %s", where2put->name, errno, strerror(errno));
-					} else {
-						errno = 0;
-					}
-
-					if (created) {
-						jobmgr_log(jm, LOG_WARNING, "Singleton service already existed in job-local namespace. Removing: %s", j->label);
-						job_remove(j);
-					}
+		if (!j->dedicated_instance) {
+			machservice_hash_remove(msi);
+		}
+		msi->event_channel = true;
 
-					j = NULL;
-				} else {
-					jobmgr_log(jm, LOG_DEBUG, "Aliased service into local domain: %s", j->label);
-					(void)job_dispatch(j, false);
-					ja->xpc_service = true;
-					j = ja;
-				}
-			} else {
-				(void)job_dispatch(j, false);
-			}
+		/* If we call job_dispatch() here before the audit session for the job
+		 * has been set, we'll end up not watching this service. But we also have
+		 * to take care not to watch the port if the job is active.
+		 *
+		 * See <rdar://problem/10357855>.
+		 */
+		if (!j->currently_ignored) {
+			machservice_watch(j, msi);
 		}
+
+		error = 0;
+		*ms = msi;
+	} else if (!msi->event_channel) {
+		job_log(j, LOG_ERR, "This job registered a MachService name identical to the requested event channel name: %s", stream);
+		error = EEXIST;
 	} else {
-		jobmgr_log(jm, LOG_DEBUG, "Could not find destination for service: %s", label);
+		error = 0;
+		*ms = msi;
 	}
 
-	return j;
+	return error;
 }
 
 int
-_xpc_domain_import_services(job_t j, launch_data_t services)
+xpc_event_get_event_name(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	int error = EINVAL;
-	if (launch_data_get_type(services) != LAUNCH_DATA_ARRAY) {
-		return error;
+	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
+	if (!stream) {
+		return EXINVAL;
 	}
 
-	size_t i = 0;
-	size_t c = launch_data_array_get_count(services);
-	jobmgr_log(j->mgr, LOG_DEBUG, "Importing new services: %lu", c);
+	uint64_t token = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_TOKEN);
+	if (!token) {
+		return EXINVAL;
+	}
 
-	for (i = 0; i < c; i++) {
-		jobmgr_log(j->mgr, LOG_DEBUG, "Importing service at index: %lu", i);
+	job_log(j, LOG_DEBUG, "Getting event name for stream/token: %s/0x%llu", stream, token);
 
-		job_t nj = NULL;
-		launch_data_t ploadi = launch_data_array_get_index(services, i);
-		if (!(nj = _xpc_domain_import_service(j->mgr, ploadi))) {
-			if (!j->mgr->session_initialized && errno) {
-				/* Service import failures are only fatal if the domain is being
-				 * initialized. If we're extending the domain, we can run into
-				 * errors with services already existing, so we just ignore them.
-				 * In the case of a domain extension, we don't want to halt the
-				 * operation if we run into an error with one service.
-				 *
-				 * <rdar://problem/10842779>
-				 */
-				jobmgr_log(j->mgr, LOG_ERR, "Failed to import service at index: %lu: %d: %s", i, errno, strerror(errno));
-				error = errno;
-				break;
-			}
-		} else {
-			jobmgr_log(j->mgr, LOG_DEBUG, "Imported service: %s", nj->label);
-		}
+	int result = ESRCH;
+	struct externalevent *event = externalevent_find(stream, token);
+	if (event && j->event_monitor) {
+		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+		xpc_dictionary_set_string(reply2, XPC_EVENT_ROUTINE_KEY_NAME, event->name);
+		*reply = reply2;
+
+		job_log(j, LOG_DEBUG, "Found: %s", event->name);
+		result = 0;
+	}
+
+	return result;
+}
+
+int
+xpc_event_copy_entitlements(job_t j, xpc_object_t request, xpc_object_t *reply)
+{
+	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
+	if (!stream) {
+		return EXINVAL;
 	}
 
-	if (i == c) {
-		error = 0;
+	uint64_t token = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_TOKEN);
+	if (!token) {
+		return EXINVAL;
 	}
 
-	return error;
+	job_log(j, LOG_DEBUG, "Getting entitlements for stream/token: %s/0x%llu", stream, token);
+
+	int result = ESRCH;
+	struct externalevent *event = externalevent_find(stream, token);
+	if (event && j->event_monitor) {
+		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+		xpc_dictionary_set_value(reply2, XPC_EVENT_ROUTINE_KEY_ENTITLEMENTS, event->entitlements);
+		*reply = reply2;
+
+		job_log(j, LOG_DEBUG, "Found: %s", event->name);
+		result = 0;
+	}
+
+	return result;
 }
 
-kern_return_t
-xpc_domain_import2(job_t j, mach_port_t reqport, mach_port_t dport)
+// TODO - can be removed with rdar://problem/12666150
+#ifndef XPC_EVENT_FLAG_ALLOW_UNMANAGED
+#define XPC_EVENT_FLAG_ALLOW_UNMANAGED (1 << 1)
+#endif
+	
+int
+xpc_event_set_event(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	if (unlikely(!pid1_magic)) {
-		job_log(j, LOG_ERR, "XPC domains may only reside in PID 1.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-	if (!j || !MACH_PORT_VALID(reqport)) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
+	if (!stream) {
+		return EXINVAL;
 	}
-	if (root_jobmgr->shutting_down) {
-		jobmgr_log(root_jobmgr, LOG_ERR, "Attempt to create new domain while shutting down.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
+
+	const char *key = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_NAME);
+	if (!key) {
+		return EXINVAL;
 	}
-	if (!j->xpc_bootstrapper) {
-		job_log(j, LOG_ERR, "Attempt to create new XPC domain by unprivileged job.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
+
+	xpc_object_t event = xpc_dictionary_get_value(request, XPC_EVENT_ROUTINE_KEY_EVENT);
+	if (event && xpc_get_type(event) != XPC_TYPE_DICTIONARY) {
+		return EXINVAL;
 	}
 
-	kern_return_t kr = BOOTSTRAP_NO_MEMORY;
-	/* All XPC domains are children of the root job manager. What we're creating
-	 * here is really just a skeleton. By creating it, we're adding reqp to our
-	 * port set. It will have two messages on it. The first specifies the
-	 * environment of the originator. This is so we can cache it and hand it to
-	 * xpcproxy to bootstrap our services. The second is the set of jobs that is
-	 * to be bootstrapped in.
+	uint64_t flags = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_FLAGS);
+
+	/* Don't allow events to be set for anonymous jobs unless specifically
+	 * requested in the flags. Only permit this for internal development.
 	 */
-	jobmgr_t jm = jobmgr_new(root_jobmgr, reqport, dport, false, NULL, true, MACH_PORT_NULL);
-	if (job_assumes(j, jm != NULL)) {
-		jm->properties |= BOOTSTRAP_PROPERTY_XPC_DOMAIN;
-		jm->shortdesc = "private";
-		kr = BOOTSTRAP_SUCCESS;
+	if (j->anonymous && ((flags & XPC_EVENT_FLAG_ALLOW_UNMANAGED) == 0 || !launchd_apple_internal)) {
+		job_log(j, LOG_ERR, "Unmanaged jobs may not make XPC Events requests.");
+		return EPERM;
 	}
 
-	return kr;
-}
+	job_log(j, LOG_DEBUG, "%s event for stream/key: %s/%s", event ? "Setting" : "Removing", stream, key);
 
-kern_return_t
-xpc_domain_set_environment(job_t j, mach_port_t rp, mach_port_t bsport, mach_port_t excport, vm_offset_t ctx, mach_msg_type_number_t ctx_sz)
-{
-	if (!j) {
-		/* Due to the whacky nature of XPC service bootstrapping, we can end up
-		 * getting this message long after the requesting process has gone away.
-		 * See <rdar://problem/8593143>.
+	struct externalevent *eei = NULL;
+	LIST_FOREACH(eei, &j->events, job_le) {
+		/* If the event for the given key already exists for the job, we need to
+		 * remove the old one first.
 		 */
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+		if (strcmp(eei->name, key) == 0 && strcmp(eei->sys->name, stream) == 0) {
+			job_log(j, LOG_DEBUG, "Event exists. Removing.");
+			externalevent_delete(eei);
+			break;
+		}
 	}
 
-	jobmgr_t jm = j->mgr;
-	if (!(jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	int result = EXNOMEM;
+	if (event) {
+		struct eventsystem *es = eventsystem_find(stream);
+		if (!es) {
+			job_log(j, LOG_DEBUG, "Creating stream.");
+			es = eventsystem_new(stream);
+		}
+
+		if (es) {
+			job_log(j, LOG_DEBUG, "Adding event.");
+			if (externalevent_new(j, es, key, event, flags)) {
+				job_log(j, LOG_DEBUG, "Added new event for key: %s", key);
+				result = 0;
+			} else {
+				job_log(j, LOG_ERR, "Could not create event for key: %s", key);
+			}
+		} else {
+			job_log(j, LOG_ERR, "Event stream could not be created: %s", stream);
+		}
+	} else {
+		/* If the event was NULL, then we just remove it and return. */
+		result = 0;
 	}
 
-	if (jm->req_asport != MACH_PORT_NULL) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (result == 0) {
+		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+		*reply = reply2;
 	}
 
-	struct ldcred *ldc = runtime_get_caller_creds();
-	struct proc_bsdinfowithuniqid proc;
-	if (proc_pidinfo(ldc->pid, PROC_PIDT_BSDINFOWITHUNIQID, 1, &proc, PROC_PIDT_BSDINFOWITHUNIQID_SIZE) == 0) {
-		if (errno != ESRCH) {
-			(void)jobmgr_assumes_zero(jm, errno);
-		}
+	return result;
+}
 
-		jm->error = errno;
-		jobmgr_remove(jm);
-		return BOOTSTRAP_NO_MEMORY;
+int
+xpc_event_copy_event(job_t j, xpc_object_t request, xpc_object_t *reply)
+{
+	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
+	const char *key = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_NAME);
+
+	bool all_streams = (stream == NULL);
+	bool all_events = (key == NULL || strcmp(key, "") == 0); // strcmp for libxpc compatibility
+	xpc_object_t events = NULL;
+
+	if (all_streams && !all_events) {
+		return EXINVAL;
 	}
 
-#if !TARGET_OS_EMBEDDED
-	if (jobmgr_assumes_zero(jm, audit_session_port(ldc->asid, &jm->req_asport)) != 0) {
-		jm->error = EPERM;
-		jobmgr_remove(jm);
-		job_log(j, LOG_ERR, "Failed to get port for ASID: %u", ldc->asid);
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (all_streams || all_events) {
+		job_log(j, LOG_DEBUG, "Fetching all events%s%s", stream ? " for stream: " : "", stream ? stream : "");
+		events = xpc_dictionary_create(NULL, NULL, 0);
+	} else {
+		job_log(j, LOG_DEBUG, "Fetching stream/key: %s/%s", stream, key);
 	}
-#else
-	jm->req_asport = MACH_PORT_DEAD;
-#endif
 
-	struct waiting4attach *w4ai = NULL;
-	struct waiting4attach *w4ait = NULL;
-	LIST_FOREACH_SAFE(w4ai, &_launchd_domain_waiters, le, w4ait) {
-		if (w4ai->dest == ldc->pid) {
-			jobmgr_log(jm, LOG_DEBUG, "Migrating attach for: %s", w4ai->name);
-			LIST_REMOVE(w4ai, le);
-			LIST_INSERT_HEAD(&jm->attaches, w4ai, le);
-			w4ai->dest = 0;
+	int result = ESRCH;
+	struct externalevent *eei = NULL;
+	LIST_FOREACH(eei, &j->events, job_le) {
+		if (all_streams) {
+			xpc_object_t sub = xpc_dictionary_get_value(events, eei->sys->name);
+			if (sub == NULL) {
+				sub = xpc_dictionary_create(NULL, NULL, 0);
+				xpc_dictionary_set_value(events, eei->sys->name, sub);
+				xpc_release(sub);
+			}
+			xpc_dictionary_set_value(sub, eei->name, eei->event);
+		} else if (strcmp(eei->sys->name, stream) == 0) {
+			if (all_events) {
+				xpc_dictionary_set_value(events, eei->name, eei->event);
+			} else if (strcmp(eei->name, key) == 0) {
+				job_log(j, LOG_DEBUG, "Found event.");
+				events = xpc_retain(eei->event);
+				break;
+			}
 		}
 	}
 
-	(void)snprintf(jm->name_init, NAME_MAX, "com.apple.xpc.domain.%s.%d", proc.pbsd.pbi_comm, ldc->pid);
-	strlcpy(jm->owner, proc.pbsd.pbi_comm, sizeof(jm->owner));
-	jm->req_bsport = bsport;
-	jm->req_excport = excport;
-	jm->req_rport = rp;
-	jm->req_ctx = ctx;
-	jm->req_ctx_sz = ctx_sz;
-	jm->req_pid = ldc->pid;
-	jm->req_euid = ldc->euid;
-	jm->req_egid = ldc->egid;
-	jm->req_asid = ldc->asid;
-	jm->req_uniqueid = proc.p_uniqidentifier.p_uniqueid;
+	if (events) {
+		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+		xpc_dictionary_set_value(reply2, XPC_EVENT_ROUTINE_KEY_EVENT, events);
+		xpc_release(events);
 
-	return KERN_SUCCESS;
+		*reply = reply2;
+		result = 0;
+	}
+
+	return result;
 }
 
-kern_return_t
-xpc_domain_load_services(job_t j, vm_offset_t services_buff, mach_msg_type_number_t services_sz)
+int
+xpc_event_channel_check_in(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	if (!j) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
+	if (!stream) {
+		return EXINVAL;
 	}
 
- 	job_t rootj = jobmgr_find_by_pid(root_jobmgr, j->p, false);
- 	if (!(rootj && rootj->xpc_bootstrapper)) {
-		job_log(j, LOG_ERR, "Attempt to load services into XPC domain by unprivileged job.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	job_log(j, LOG_DEBUG, "Checking in stream: %s", stream);
+
+	struct machservice *ms = NULL;
+	int error = xpc_event_find_channel(j, stream, &ms);
+	if (error) {
+		job_log(j, LOG_ERR, "Failed to check in: 0x%x: %s", error, xpc_strerror(error));
+	} else if (ms->isActive) {
+		job_log(j, LOG_ERR, "Attempt to check in on event channel multiple times: %s", stream);
+		error = EBUSY;
+	} else {
+		machservice_request_notifications(ms);
+
+		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+		xpc_dictionary_set_mach_recv(reply2, XPC_EVENT_ROUTINE_KEY_PORT, ms->port);
+		*reply = reply2;
+		error = 0;
 	}
 
-	// This is just for XPC domains (for now).
-	if (!(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	return error;
+}
+
+int
+xpc_event_channel_look_up(job_t j, xpc_object_t request, xpc_object_t *reply)
+{
+	if (!j->event_monitor) {
+		return EPERM;
+	}
+
+	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
+	if (!stream) {
+		return EXINVAL;
 	}
-	if (j->mgr->session_initialized) {
-		jobmgr_log(j->mgr, LOG_ERR, "Attempt to initialize an already-initialized XPC domain.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
+
+	uint64_t token = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_TOKEN);
+	if (!token) {
+		return EXINVAL;
 	}
 
-	size_t offset = 0;
-	launch_data_t services = launch_data_unpack((void *)services_buff, services_sz, NULL, 0, &offset, NULL);
-	if (!services) {
-		return BOOTSTRAP_NO_MEMORY;
+	job_log(j, LOG_DEBUG, "Looking up channel for stream/token: %s/%llu", stream, token);
+
+	struct externalevent *ee = externalevent_find(stream, token);
+	if (!ee) {
+		return ESRCH;
 	}
 
-	int error = _xpc_domain_import_services(j, services);
-	if (error) {
-		j->mgr->error = error;
-		jobmgr_log(j->mgr, LOG_ERR, "Obliterating domain.");
-		jobmgr_remove(j->mgr);
+	struct machservice *ms = NULL;
+	int error = xpc_event_find_channel(ee->job, stream, &ms);
+	if (!error) {
+		job_log(j, LOG_DEBUG, "Found event channel port: 0x%x", ms->port);
+		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+		xpc_dictionary_set_mach_send(reply2, XPC_EVENT_ROUTINE_KEY_PORT, ms->port);
+		*reply = reply2;
+		error = 0;
 	} else {
-		j->mgr->session_initialized = true;
-		(void)jobmgr_assumes_zero(j->mgr, xpc_call_wakeup(j->mgr->req_rport, BOOTSTRAP_SUCCESS));
-		j->mgr->req_rport = MACH_PORT_NULL;
-
-		/* Returning a failure code will destroy the message, whereas returning
-		 * success will not, so we need to clean up here.
-		 */
-		mig_deallocate(services_buff, services_sz);
-		error = BOOTSTRAP_SUCCESS;
+		job_log(j, LOG_ERR, "Could not find event channel for stream/token: %s/%llu: 0x%x: %s", stream, token, error, xpc_strerror(error));
 	}
 
 	return error;
 }
 
-kern_return_t
-xpc_domain_check_in(job_t j, mach_port_t *bsport, mach_port_t *sbsport, 
-	mach_port_t *excport, mach_port_t *asport, uint32_t *uid, uint32_t *gid,
-	int32_t *asid, vm_offset_t *ctx, mach_msg_type_number_t *ctx_sz)
+int
+xpc_event_provider_check_in(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	if (!jobmgr_assumes(root_jobmgr, j != NULL)) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
-	}
-	jobmgr_t jm = j->mgr;
-	if (!(jm->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (!j->event_monitor) {
+		return EPERM;
 	}
 
-	if (jm->req_asport == MACH_PORT_NULL) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	/* This indicates that the event monitor is now safe to signal. This state
+	 * is independent of whether this operation actually succeeds; we just need
+	 * it to ignore SIGUSR1.
+	 */
+	j->event_monitor_ready2signal = true;
+
+	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
+	if (!stream) {
+		return EXINVAL;
 	}
 
-	*bsport = jm->req_bsport;
-	*sbsport = root_jobmgr->jm_port;
-	*excport = jm->req_excport;
-	if (j->joins_gui_session) {
-		if (jm->req_gui_asport) {
-			*asport = jm->req_gui_asport;
-		} else {
-			job_log(j, LOG_NOTICE, "No GUI session set for UID of user service. This service may not act properly.");
-			*asport = jm->req_asport;
+	job_log(j, LOG_DEBUG, "Provider checking in for stream: %s", stream);
+
+	xpc_object_t events = xpc_array_create(NULL, 0);
+	struct eventsystem *es = eventsystem_find(stream);
+	if (!es) {
+		/* If we had to create the event stream, there were no events, so just
+		 * give back the empty array.
+		 */
+		job_log(j, LOG_DEBUG, "Creating event stream.");
+		es = eventsystem_new(stream);
+		if (!job_assumes(j, es)) {
+			xpc_release(events);
+			return EXNOMEM;
+		}
+
+		if (strcmp(stream, "com.apple.launchd.helper") == 0) {
+			_launchd_support_system = es;
 		}
 	} else {
-		*asport = jm->req_asport;
-	}
+		job_log(j, LOG_DEBUG, "Filling event array.");
 
-	*uid = jm->req_euid;
-	*gid = jm->req_egid;
-	*asid = jm->req_asid;
+		struct externalevent *ei = NULL;
+		LIST_FOREACH(ei, &es->events, sys_le) {
+			xpc_array_set_uint64(events, XPC_ARRAY_APPEND, ei->id);
+			xpc_array_append_value(events, ei->event);
+		}
+	}
 
-	*ctx = jm->req_ctx;
-	*ctx_sz = jm->req_ctx_sz;
+	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+	xpc_dictionary_set_value(reply2, XPC_EVENT_ROUTINE_KEY_EVENTS, events);
+	xpc_release(events);
+	*reply = reply2;
 
-	return KERN_SUCCESS;
+	return 0;
 }
 
-kern_return_t
-xpc_domain_get_service_name(job_t j, event_name_t name)
+int
+xpc_event_provider_set_state(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
+	job_t other_j = NULL;
 
-	if (!j->xpc_service) {
-		jobmgr_log(j->mgr, LOG_ERR, "Attempt to get service name by non-XPC service: %s", j->label);
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (!j->event_monitor) {
+		return EPERM;
 	}
 
-	const char *what2find = j->label;
-	if (j->dedicated_instance) {
-		what2find = j->original->label;
+	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
+	if (!stream) {
+		return EXINVAL;
 	}
 
-	struct machservice *msi = NULL;
-	SLIST_FOREACH(msi, &j->machservices, sle) {
-		if (strcmp(msi->name, what2find) == 0) {
-			break;
-		}
+	uint64_t token = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_TOKEN);
+	if (!token) {
+		return EXINVAL;
 	}
 
-	if (!msi) {
-		jobmgr_log(j->mgr, LOG_ERR, "Attempt to get service name that does not exist: %s", j->label);
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+	bool state = false;
+	xpc_object_t xstate = xpc_dictionary_get_value(request, XPC_EVENT_ROUTINE_KEY_STATE);
+	if (!xstate || xpc_get_type(xstate) != XPC_TYPE_BOOL) {
+		return EXINVAL;
+	} else {
+		state = xpc_bool_get_value(xstate);
 	}
 
-	(void)strlcpy(name, msi->name, sizeof(event_name_t));
-	return BOOTSTRAP_SUCCESS;
-}
+	job_log(j, LOG_DEBUG, "Setting event state to %s for stream/token: %s/%llu", state ? "true" : "false", stream, token);
 
-#if XPC_LPI_VERSION >= 20111216
-kern_return_t
-xpc_domain_add_services(job_t j, vm_offset_t services_buff, mach_msg_type_number_t services_sz)
-{
-	if (!j) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+	struct externalevent *ei = externalevent_find(stream, token);
+	if (!ei) {
+		job_log(j, LOG_ERR, "Could not find stream/token: %s/%llu", stream, token);
+		return ESRCH;
 	}
 
- 	job_t rootj = jobmgr_find_by_pid(root_jobmgr, j->p, false);
- 	if (!(rootj && rootj->xpc_bootstrapper)) {
-		job_log(j, LOG_ERR, "Attempt to add service to XPC domain by unprivileged job.");
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
+	other_j = ei->job;
+	ei->state = state;
 
-	if (!(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	if (ei->internal) {
+		job_log(ei->job, LOG_NOTICE, "Job should be able to exec(3) now.");
+		ei->job->waiting4ok = false;
+		externalevent_delete(ei);
 	}
 
-	size_t offset = 0;
-	launch_data_t services = launch_data_unpack((void *)services_buff, services_sz, NULL, 0, &offset, NULL);
-	if (!services) {
-		return BOOTSTRAP_NO_MEMORY;
-	}
+	(void)job_dispatch(other_j, false);
 
-	int error = _xpc_domain_import_services(j, services);
-	if (!error) {
-		mig_deallocate(services_buff, services_sz);
-	}
+	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+	*reply = reply2;
 
-	return error;
+	return 0;
 }
-#endif
 
-#pragma mark XPC Events
-int
-xpc_event_find_channel(job_t j, const char *stream, struct machservice **ms)
+bool
+xpc_event_demux(mach_port_t p, xpc_object_t request, xpc_object_t *reply)
 {
-	int error = EXNOMEM;
-	struct machservice *msi = NULL;
-	SLIST_FOREACH(msi, &j->machservices, sle) {
-		if (strcmp(stream, msi->name) == 0) {
-			break;
-		}
+	uint64_t op = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_OP);
+	if (!op) {
+		return false;
 	}
 
-	if (!msi) {
-		mach_port_t sp = MACH_PORT_NULL;
-		msi = machservice_new(j, stream, &sp, false);
-		if (!msi) {
-			return EXNOMEM;
+	audit_token_t token;
+	xpc_dictionary_get_audit_token(request, &token);
+	runtime_record_caller_creds(&token);
+
+	struct ldcred *ldc = runtime_get_caller_creds();
+	job_t j = managed_job(ldc->pid);
+	if (!j) {
+		j = job_mig_intran(p);
+		if (!j) {
+			op = -1;
 		}
+	}
+
+	job_log(j, LOG_DEBUG, "Incoming XPC event request: %llu", op);
+
+	int error = -1;
+	switch (op) {
+	case XPC_EVENT_GET_NAME:
+		error = xpc_event_get_event_name(j, request, reply);
+		break;
+	case XPC_EVENT_SET:
+		error = xpc_event_set_event(j, request, reply);
+		break;
+	case XPC_EVENT_COPY:
+		error = xpc_event_copy_event(j, request, reply);
+		break;
+	case XPC_EVENT_CHECK_IN:
+		error = xpc_event_channel_check_in(j, request, reply);
+		break;
+	case XPC_EVENT_LOOK_UP:
+		error = xpc_event_channel_look_up(j, request, reply);
+		break;
+	case XPC_EVENT_PROVIDER_CHECK_IN:
+		error = xpc_event_provider_check_in(j, request, reply);
+		break;
+	case XPC_EVENT_PROVIDER_SET_STATE:
+		error = xpc_event_provider_set_state(j, request, reply);
+		break;
+	case XPC_EVENT_COPY_ENTITLEMENTS:
+		error = xpc_event_copy_entitlements(j, request, reply);
+		break;
+	case -1:
+		error = EINVAL;
+		break;
+	default:
+		job_log(j, LOG_ERR, "Bogus opcode.");
+		error = EDOM;
+	}
+
+	if (error) {
+		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+		xpc_dictionary_set_uint64(reply2, XPC_EVENT_ROUTINE_KEY_ERROR, error);
+		*reply = reply2;
+	}
 
-		job_log(j, LOG_DEBUG, "Creating new MachService for stream: %s", stream);
-		/* Hack to keep this from being publicly accessible through
-		 * bootstrap_look_up().
-		 */
-		if (!j->dedicated_instance) {
-			LIST_REMOVE(msi, name_hash_sle);
-		}
-		msi->event_channel = true;
+	return true;
+}
 
-		/* If we call job_dispatch() here before the audit session for the job
-		 * has been set, we'll end up not watching this service. But we also have
-		 * to take care not to watch the port if the job is active.
-		 *
-		 * See <rdar://problem/10357855>.
-		 */
-		if (!j->currently_ignored) {
-			machservice_watch(j, msi);
+uint64_t
+xpc_get_jetsam_entitlement(const char *key)
+{
+	uint64_t entitlement = 0;
+
+	audit_token_t *token = runtime_get_caller_token();
+	xpc_object_t value = xpc_copy_entitlement_for_token(key, token);
+	if (value) {
+		if (xpc_get_type(value) == XPC_TYPE_UINT64) {
+			entitlement = xpc_uint64_get_value(value);
 		}
 
-		error = 0;
-		*ms = msi;
-	} else if (!msi->event_channel) {
-		job_log(j, LOG_ERR, "This job registered a MachService name identical to the requested event channel name: %s", stream);
-		error = EEXIST;
-	} else {
-		error = 0;
-		*ms = msi;
+		xpc_release(value);
 	}
-
-	return error;
+	
+	return entitlement;	
 }
 
 int
-xpc_event_get_event_name(job_t j, xpc_object_t request, xpc_object_t *reply)
-{
-	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
-	if (!stream) {
-		return EXINVAL;
+xpc_process_set_jetsam_band(job_t j, xpc_object_t request, xpc_object_t *reply)
+{	
+	if (!j) {
+		return EINVAL;
 	}
 
-	uint64_t token = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_TOKEN);
-	if (!token) {
+	const char *label = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_LABEL);
+	if (!label) {
 		return EXINVAL;
 	}
 
-	job_log(j, LOG_DEBUG, "Getting event name for stream/token: %s/0x%llu", stream, token);
-
-	int result = ESRCH;
-	struct externalevent *event = externalevent_find(stream, token);
-	if (event && j->event_monitor) {
-		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-		xpc_dictionary_set_string(reply2, XPC_EVENT_ROUTINE_KEY_NAME, event->name);
-		*reply = reply2;
-
-		job_log(j, LOG_DEBUG, "Found: %s", event->name);
-		result = 0;
-	}
-
-	return result;
-}
-
-int
-xpc_event_copy_entitlements(job_t j, xpc_object_t request, xpc_object_t *reply)
-{
-	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
-	if (!stream) {
+	xpc_jetsam_band_t entitled_band = -1;
+	xpc_jetsam_band_t requested_band = (xpc_jetsam_band_t)xpc_dictionary_get_uint64(request, XPC_PROCESS_ROUTINE_KEY_PRIORITY_BAND);
+	if (!requested_band) {
 		return EXINVAL;
 	}
 
-	uint64_t token = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_TOKEN);
-	if (!token) {
+	if (!(requested_band >= XPC_JETSAM_BAND_SUSPENDED && requested_band < XPC_JETSAM_BAND_LAST)) {
 		return EXINVAL;
 	}
 
-	job_log(j, LOG_DEBUG, "Getting entitlements for stream/token: %s/0x%llu", stream, token);
+	uint64_t rcdata = xpc_dictionary_get_uint64(request, XPC_PROCESS_ROUTINE_KEY_RCDATA);
+	
+	job_t tj = job_find(root_jobmgr, label);
+	if (!tj) {
+		return EXSRCH;
+	}
 
-	int result = ESRCH;
-	struct externalevent *event = externalevent_find(stream, token);
-	if (event && j->event_monitor) {
-		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-		xpc_dictionary_set_value(reply2, XPC_EVENT_ROUTINE_KEY_ENTITLEMENTS, event->entitlements);
-		*reply = reply2;
+	boolean_t allow = false;
+	if (j->embedded_god) {
+		allow = true;
+	} else {
+		entitled_band = xpc_get_jetsam_entitlement("com.apple.private.jetsam.modify-priority");
+		if (entitled_band >= requested_band) {
+			allow = true;
+		}
+	}
 
-		job_log(j, LOG_DEBUG, "Found: %s", event->name);
-		result = 0;
+	if (!allow) {
+		if (launchd_no_jetsam_perm_check) {
+			job_log(j, LOG_NOTICE, "Jetsam priority checks disabled; allowing job to set priority: %d", requested_band);
+		} else {		
+			job_log(j, LOG_ERR, "Job cannot decrease Jetsam priority band (requested/maximum): %d/%d", requested_band, entitled_band);
+			return EPERM;
+		}
 	}
 
-	return result;
+	job_log(j, LOG_INFO, "Setting Jetsam band: %d.", requested_band);
+	job_update_jetsam_properties(tj, requested_band, rcdata);
+
+	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+	*reply = reply2;
+
+	return 0;
 }
 
-// TODO - can be removed with rdar://problem/12666150
-#ifndef XPC_EVENT_FLAG_ALLOW_UNMANAGED
-#define XPC_EVENT_FLAG_ALLOW_UNMANAGED (1 << 1)
-#endif
-	
 int
-xpc_event_set_event(job_t j, xpc_object_t request, xpc_object_t *reply)
+xpc_process_set_jetsam_memory_limit(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
-	if (!stream) {
-		return EXINVAL;
-	}
-
-	const char *key = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_NAME);
-	if (!key) {
-		return EXINVAL;
+	if (!j) {
+		return EINVAL;
 	}
 
-	xpc_object_t event = xpc_dictionary_get_value(request, XPC_EVENT_ROUTINE_KEY_EVENT);
-	if (event && xpc_get_type(event) != XPC_TYPE_DICTIONARY) {
+	const char *label = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_LABEL);
+	if (!label) {
 		return EXINVAL;
 	}
 
-	uint64_t flags = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_FLAGS);
+	int32_t entitlement_limit = 0;
+	int32_t requested_limit = (int32_t)xpc_dictionary_get_uint64(request, XPC_PROCESS_ROUTINE_KEY_MEMORY_LIMIT);
 
-	/* Don't allow events to be set for anonymous jobs unless specifically
-	 * requested in the flags. Only permit this for internal development.
-	 */
-	if (j->anonymous && ((flags & XPC_EVENT_FLAG_ALLOW_UNMANAGED) == 0 || !launchd_apple_internal)) {
-		job_log(j, LOG_ERR, "Unmanaged jobs may not make XPC Events requests.");
-		return EPERM;
+	job_t tj = job_find(root_jobmgr, label);
+	if (!tj) {
+		return EXSRCH;
 	}
 
-	job_log(j, LOG_DEBUG, "%s event for stream/key: %s/%s", event ? "Setting" : "Removing", stream, key);
-
-	struct externalevent *eei = NULL;
-	LIST_FOREACH(eei, &j->events, job_le) {
-		/* If the event for the given key already exists for the job, we need to
-		 * remove the old one first.
-		 */
-		if (strcmp(eei->name, key) == 0 && strcmp(eei->sys->name, stream) == 0) {
-			job_log(j, LOG_DEBUG, "Event exists. Removing.");
-			externalevent_delete(eei);
-			break;
+	boolean_t allow = false;
+	if (j->embedded_god) {
+		allow = true;
+	} else {
+		entitlement_limit = (int32_t)xpc_get_jetsam_entitlement("com.apple.private.jetsam.memory_limit");		
+		if (entitlement_limit >= requested_limit) {
+			allow = true;
 		}
 	}
 
-	int result = EXNOMEM;
-	if (event) {
-		struct eventsystem *es = eventsystem_find(stream);
-		if (!es) {
-			job_log(j, LOG_DEBUG, "Creating stream.");
-			es = eventsystem_new(stream);
+	if (!allow) {
+		if (launchd_no_jetsam_perm_check) {
+			job_log(j, LOG_NOTICE, "Jetsam priority checks disabled; allowing job to set memory limit: %d", requested_limit);
+		} else {		
+			job_log(j, LOG_ERR, "Job cannot set Jetsam memory limit (requested/maximum): %d/%d", requested_limit, entitlement_limit);
+			return EPERM;
 		}
+	}
 
-		if (es) {
-			job_log(j, LOG_DEBUG, "Adding event.");
-			if (externalevent_new(j, es, key, event, flags)) {
-				job_log(j, LOG_DEBUG, "Added new event for key: %s", key);
-				result = 0;
-			} else {
-				job_log(j, LOG_ERR, "Could not create event for key: %s", key);
+	job_log(j, LOG_INFO, "Setting Jetsam memory limit: %d.", requested_limit);
+	job_update_jetsam_memory_limit(tj, requested_limit);
+
+	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+	*reply = reply2;
+
+	return 0;
+}
+
+static jobmgr_t
+_xpc_process_find_target_manager(job_t j, xpc_service_type_t type, pid_t pid)
+{
+	jobmgr_t target = NULL;
+	if (type == XPC_SERVICE_TYPE_BUNDLED) {
+		job_log(j, LOG_DEBUG, "Bundled service. Searching for XPC domains for PID: %d", pid);
+
+		jobmgr_t jmi = NULL;
+		SLIST_FOREACH(jmi, &root_jobmgr->submgrs, sle) {
+			if (jmi->req_pid && jmi->req_pid == pid) {
+				jobmgr_log(jmi, LOG_DEBUG, "Found job manager for PID.");
+				target = jmi;
+				break;
 			}
-		} else {
-			job_log(j, LOG_ERR, "Event stream could not be created: %s", stream);
 		}
-	} else {
-		/* If the event was NULL, then we just remove it and return. */
-		result = 0;
-	}
-
-	if (result == 0) {
-		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-		*reply = reply2;
+	} else if (type == XPC_SERVICE_TYPE_LAUNCHD || type == XPC_SERVICE_TYPE_APP) {
+		target = j->mgr;
 	}
 
-	return result;
+	return target;
 }
 
-int
-xpc_event_copy_event(job_t j, xpc_object_t request, xpc_object_t *reply)
+static int
+xpc_process_attach(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
-	const char *key = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_NAME);
+	if (!j) {
+		return EINVAL;
+	}
 
-	bool all_streams = (stream == NULL);
-	bool all_events = (key == NULL || strcmp(key, "") == 0); // strcmp for libxpc compatibility
-	xpc_object_t events = NULL;
+	audit_token_t *token = runtime_get_caller_token();
+	xpc_object_t entitlement = xpc_copy_entitlement_for_token(XPC_SERVICE_ENTITLEMENT_ATTACH, token);
+	if (!entitlement) {
+		job_log(j, LOG_ERR, "Job does not have entitlement: %s", XPC_SERVICE_ENTITLEMENT_ATTACH);
+		return EPERM;
+	}
 
-	if (all_streams && !all_events) {
+	if (entitlement != XPC_BOOL_TRUE) {
+		char *desc = xpc_copy_description(entitlement);
+		job_log(j, LOG_ERR, "Job has bad value for entitlement: %s:\n%s", XPC_SERVICE_ENTITLEMENT_ATTACH, desc);
+		free(desc);
+
+		xpc_release(entitlement);
+		return EPERM;
+	}
+
+	const char *name = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_NAME);
+	if (!name) {
 		return EXINVAL;
 	}
 
-	if (all_streams || all_events) {
-		job_log(j, LOG_DEBUG, "Fetching all events%s%s", stream ? " for stream: " : "", stream ? stream : "");
-		events = xpc_dictionary_create(NULL, NULL, 0);
-	} else {
-		job_log(j, LOG_DEBUG, "Fetching stream/key: %s/%s", stream, key);
+	xpc_service_type_t type = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_TYPE);
+	if (!type) {
+		return EXINVAL;
 	}
 
-	int result = ESRCH;
-	struct externalevent *eei = NULL;
-	LIST_FOREACH(eei, &j->events, job_le) {
-		if (all_streams) {
-			xpc_object_t sub = xpc_dictionary_get_value(events, eei->sys->name);
-			if (sub == NULL) {
-				sub = xpc_dictionary_create(NULL, NULL, 0);
-				xpc_dictionary_set_value(events, eei->sys->name, sub);
-				xpc_release(sub);
-			}
-			xpc_dictionary_set_value(sub, eei->name, eei->event);
-		} else if (strcmp(eei->sys->name, stream) == 0) {
-			if (all_events) {
-				xpc_dictionary_set_value(events, eei->name, eei->event);
-			} else if (strcmp(eei->name, key) == 0) {
-				job_log(j, LOG_DEBUG, "Found event.");
-				events = xpc_retain(eei->event);
-				break;
-			}
-		}
+	mach_port_t port = xpc_dictionary_copy_mach_send(request, XPC_PROCESS_ROUTINE_KEY_NEW_INSTANCE_PORT);
+	if (!MACH_PORT_VALID(port)) {
+		return EXINVAL;
 	}
 
-	if (events) {
-		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-		xpc_dictionary_set_value(reply2, XPC_EVENT_ROUTINE_KEY_EVENT, events);
-		xpc_release(events);
-
-		*reply = reply2;
-		result = 0;
-	}
+	pid_t pid = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_HANDLE);
 
-	return result;
-}
+	job_log(j, LOG_DEBUG, "Attaching to service: %s", name);
 
-int
-xpc_event_channel_check_in(job_t j, xpc_object_t request, xpc_object_t *reply)
-{
-	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
-	if (!stream) {
-		return EXINVAL;
-	}
+	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+	jobmgr_t target = _xpc_process_find_target_manager(j, type, pid);
+	if (target) {
+		jobmgr_log(target, LOG_DEBUG, "Found target job manager for service: %s", name);
+		(void)jobmgr_assumes(target, waiting4attach_new(target, name, port, 0, type));
 
-	job_log(j, LOG_DEBUG, "Checking in stream: %s", stream);
+		/* HACK: This is awful. For legacy reasons, launchd job labels are all
+		 * stored in a global namespace, which is stored in the root job
+		 * manager. But XPC domains have a per-domain namespace. So if we're
+		 * looking for a legacy launchd job, we have to redirect any attachment
+		 * attempts to the root job manager to find existing instances.
+		 *
+		 * But because we store attachments on a per-job manager basis, we have
+		 * to create the new attachment in the actual target job manager, hence
+		 * why we change the target only after we've created the attachment.
+		 */
+		if (strcmp(target->name, VPROCMGR_SESSION_AQUA) == 0) {
+			target = root_jobmgr;
+		}
 
-	struct machservice *ms = NULL;
-	int error = xpc_event_find_channel(j, stream, &ms);
-	if (error) {
-		job_log(j, LOG_ERR, "Failed to check in: 0x%x: %s", error, xpc_strerror(error));
-	} else if (ms->isActive) {
-		job_log(j, LOG_ERR, "Attempt to check in on event channel multiple times: %s", stream);
-		error = EBUSY;
+		job_t existing = job_find(target, name);
+		if (existing && existing->p) {
+			job_log(existing, LOG_DEBUG, "Found existing instance of service.");
+			xpc_dictionary_set_int64(reply2, XPC_PROCESS_ROUTINE_KEY_PID, existing->p);
+		} else {
+			xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, ESRCH);
+		}
+	} else if (type == XPC_SERVICE_TYPE_BUNDLED) {
+		(void)job_assumes(j, waiting4attach_new(target, name, port, pid, type));
+		xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, ESRCH);
 	} else {
-		machservice_request_notifications(ms);
-
-		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-		xpc_dictionary_set_mach_recv(reply2, XPC_EVENT_ROUTINE_KEY_PORT, ms->port);
-		*reply = reply2;
-		error = 0;
+		xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, EXSRCH);
 	}
 
-	return error;
+	*reply = reply2;
+	return 0;
 }
 
-int
-xpc_event_channel_look_up(job_t j, xpc_object_t request, xpc_object_t *reply)
+static int
+xpc_process_detach(job_t j, xpc_object_t request, xpc_object_t *reply __unused)
 {
-	if (!j->event_monitor) {
-		return EPERM;
+	if (!j) {
+		return EINVAL;
 	}
 
-	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
-	if (!stream) {
+	const char *name = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_NAME);
+	if (!name) {
 		return EXINVAL;
 	}
 
-	uint64_t token = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_TOKEN);
-	if (!token) {
+	xpc_service_type_t type = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_TYPE);
+	if (!type) {
 		return EXINVAL;
 	}
 
-	job_log(j, LOG_DEBUG, "Looking up channel for stream/token: %s/%llu", stream, token);
+	job_log(j, LOG_DEBUG, "Deatching from service: %s", name);
 
-	struct externalevent *ee = externalevent_find(stream, token);
-	if (!ee) {
-		return ESRCH;
-	}
+	pid_t pid = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_PID);
+	jobmgr_t target = _xpc_process_find_target_manager(j, type, pid);
+	if (target) {
+		jobmgr_log(target, LOG_DEBUG, "Found target job manager for service: %s", name);
 
-	struct machservice *ms = NULL;
-	int error = xpc_event_find_channel(ee->job, stream, &ms);
-	if (!error) {
-		job_log(j, LOG_DEBUG, "Found event channel port: 0x%x", ms->port);
-		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-		xpc_dictionary_set_mach_send(reply2, XPC_EVENT_ROUTINE_KEY_PORT, ms->port);
-		*reply = reply2;
-		error = 0;
-	} else {
-		job_log(j, LOG_ERR, "Could not find event channel for stream/token: %s/%llu: 0x%x: %s", stream, token, error, xpc_strerror(error));
+		struct waiting4attach *w4ai = NULL;
+		struct waiting4attach *w4ait = NULL;
+		LIST_FOREACH_SAFE(w4ai, &target->attaches, le, w4ait) {
+			if (strcmp(name, w4ai->name) == 0) {
+				jobmgr_log(target, LOG_DEBUG, "Found attachment. Deleting.");
+				waiting4attach_delete(target, w4ai);
+				break;
+			}
+		}
 	}
 
-	return error;
+	return 0;
 }
 
-int
-xpc_event_provider_check_in(job_t j, xpc_object_t request, xpc_object_t *reply)
+static int
+xpc_process_get_properties(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	if (!j->event_monitor) {
-		return EPERM;
+	if (j->anonymous) {
+		/* Total hack. libxpc will send requests to the pipe created out of the
+		 * process' bootstrap port, so when job_mig_intran() tries to resolve
+		 * the process into a job, it'll wind up creating an anonymous job if
+		 * the requestor was an XPC service, whose job manager is an XPC domain.
+		 */
+		pid_t pid = j->p;
+		jobmgr_t jmi = NULL;
+		SLIST_FOREACH(jmi, &root_jobmgr->submgrs, sle) {
+			if ((j = jobmgr_find_by_pid(jmi, pid, false))) {
+				break;
+			}
+		}
 	}
 
-	/* This indicates that the event monitor is now safe to signal. This state
-	 * is independent of whether this operation actually succeeds; we just need
-	 * it to ignore SIGUSR1.
-	 */
-	j->event_monitor_ready2signal = true;
+	if (!j || j->anonymous) {
+		return EXINVAL;
+	}
 
-	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
-	if (!stream) {
+	struct waiting4attach *w4a = waiting4attach_find(j->mgr, j);
+	if (!w4a) {
 		return EXINVAL;
 	}
 
-	job_log(j, LOG_DEBUG, "Provider checking in for stream: %s", stream);
+	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+	xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_TYPE, w4a->type);
+	xpc_dictionary_set_mach_send(reply2, XPC_PROCESS_ROUTINE_KEY_NEW_INSTANCE_PORT, w4a->port);
+	if (j->prog) {
+		xpc_dictionary_set_string(reply2, XPC_PROCESS_ROUTINE_KEY_PATH, j->prog);
+	} else {
+		xpc_dictionary_set_string(reply2, XPC_PROCESS_ROUTINE_KEY_PATH, j->argv[0]);
+	}
 
-	xpc_object_t events = xpc_array_create(NULL, 0);
-	struct eventsystem *es = eventsystem_find(stream);
-	if (!es) {
-		/* If we had to create the event stream, there were no events, so just
-		 * give back the empty array.
-		 */
-		job_log(j, LOG_DEBUG, "Creating event stream.");
-		es = eventsystem_new(stream);
-		if (!job_assumes(j, es)) {
-			xpc_release(events);
-			return EXNOMEM;
-		}
+	if (j->argv) {
+		xpc_object_t xargv = xpc_array_create(NULL, 0);
 
-		if (strcmp(stream, "com.apple.launchd.helper") == 0) {
-			_launchd_support_system = es;
+		size_t i = 0;
+		for (i = 0; i < j->argc; i++) {
+			if (j->argv[i]) {
+				xpc_array_set_string(xargv, XPC_ARRAY_APPEND, j->argv[i]);
+			}
 		}
-	} else {
-		job_log(j, LOG_DEBUG, "Filling event array.");
 
-		struct externalevent *ei = NULL;
-		LIST_FOREACH(ei, &es->events, sys_le) {
-			xpc_array_set_uint64(events, XPC_ARRAY_APPEND, ei->id);
-			xpc_array_append_value(events, ei->event);
-		}
+		xpc_dictionary_set_value(reply2, XPC_PROCESS_ROUTINE_KEY_ARGV, xargv);
+		xpc_release(xargv);
 	}
 
-	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-	xpc_dictionary_set_value(reply2, XPC_EVENT_ROUTINE_KEY_EVENTS, events);
-	xpc_release(events);
 	*reply = reply2;
-
 	return 0;
 }
 
-int
-xpc_event_provider_set_state(job_t j, xpc_object_t request, xpc_object_t *reply)
+static int
+xpc_process_service_kill(job_t j, xpc_object_t request, xpc_object_t *reply)
 {
-	job_t other_j = NULL;
+#if XPC_LPI_VERSION >= 20130426
+	if (!j) {
+		return ESRCH;
+	}
 
-	if (!j->event_monitor) {
+	jobmgr_t jm = _xpc_process_find_target_manager(j, XPC_SERVICE_TYPE_BUNDLED, j->p);
+	if (!jm) {
+		return ENOENT;
+	}
+
+	const char *name = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_NAME);
+	if (!name) {
+		return EINVAL;
+	}
+
+	int64_t whichsig = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_SIGNAL);
+	if (!whichsig) {
+		return EINVAL;
+	}
+
+	job_t j2kill = job_find(jm, name);
+	if (!j2kill) {
+		return ESRCH;
+	}
+
+	if (j2kill->alias) {
+		// Only allow for private instances to be killed.
 		return EPERM;
 	}
 
-	const char *stream = xpc_dictionary_get_string(request, XPC_EVENT_ROUTINE_KEY_STREAM);
-	if (!stream) {
-		return EXINVAL;
+	struct proc_bsdshortinfo proc;
+	if (proc_pidinfo(j2kill->p, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
+		if (errno != ESRCH) {
+			(void)jobmgr_assumes_zero(root_jobmgr, errno);
+		}
+
+		return errno;
 	}
 
-	uint64_t token = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_TOKEN);
-	if (!token) {
-		return EXINVAL;
+	struct ldcred *ldc = runtime_get_caller_creds();
+	if (proc.pbsi_uid != ldc->euid) {
+		// Do not allow non-root to kill RoleAccount services running as a
+		// different user.
+		return EPERM;
 	}
 
-	bool state = false;
-	xpc_object_t xstate = xpc_dictionary_get_value(request, XPC_EVENT_ROUTINE_KEY_STATE);
-	if (!xstate || xpc_get_type(xstate) != XPC_TYPE_BOOL) {
-		return EXINVAL;
-	} else {
-		state = xpc_bool_get_value(xstate);
+	if (!j2kill->p) {
+		return EALREADY;
 	}
 
-	job_log(j, LOG_DEBUG, "Setting event state to %s for stream/token: %s/%llu", state ? "true" : "false", stream, token);
-
-	struct externalevent *ei = externalevent_find(stream, token);
-	if (!ei) {
-		job_log(j, LOG_ERR, "Could not find stream/token: %s/%llu", stream, token);
-		return ESRCH;
+	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+	if (!reply2) {
+		return EINVAL;
 	}
 
-	other_j = ei->job;
-	ei->state = state;
-
-	if (ei->internal) {
-		job_log(ei->job, LOG_NOTICE, "Job should be able to exec(3) now.");
-		ei->job->waiting4ok = false;
-		externalevent_delete(ei);
+	int error = 0;
+	int ret = kill(j2kill->p, whichsig);
+	if (ret) {
+		error = errno;
 	}
 
-	(void)job_dispatch(other_j, false);
-
-	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
+	xpc_dictionary_set_int64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, error);
 	*reply = reply2;
-
 	return 0;
+#else
+	return ENOTSUP;
+#endif
 }
 
 bool
-xpc_event_demux(mach_port_t p, xpc_object_t request, xpc_object_t *reply)
+xpc_process_demux(mach_port_t p, xpc_object_t request, xpc_object_t *reply)
 {
-	uint64_t op = xpc_dictionary_get_uint64(request, XPC_EVENT_ROUTINE_KEY_OP);
+	uint64_t op = xpc_dictionary_get_uint64(request, XPC_PROCESS_ROUTINE_KEY_OP);
 	if (!op) {
 		return false;
 	}
@@ -10908,696 +15197,882 @@ xpc_event_demux(mach_port_t p, xpc_object_t request, xpc_object_t *reply)
 	xpc_dictionary_get_audit_token(request, &token);
 	runtime_record_caller_creds(&token);
 
-	struct ldcred *ldc = runtime_get_caller_creds();
-	job_t j = managed_job(ldc->pid);
-	if (!j) {
-		j = job_mig_intran(p);
-		if (!j) {
-			op = -1;
-		}
-	}
-
-	job_log(j, LOG_DEBUG, "Incoming XPC event request: %llu", op);
+	job_t j = job_mig_intran(p);
+	job_log(j, LOG_DEBUG, "Incoming XPC process request: %llu", op);
 
 	int error = -1;
 	switch (op) {
-	case XPC_EVENT_GET_NAME:
-		error = xpc_event_get_event_name(j, request, reply);
-		break;
-	case XPC_EVENT_SET:
-		error = xpc_event_set_event(j, request, reply);
-		break;
-	case XPC_EVENT_COPY:
-		error = xpc_event_copy_event(j, request, reply);
-		break;
-	case XPC_EVENT_CHECK_IN:
-		error = xpc_event_channel_check_in(j, request, reply);
+	case XPC_PROCESS_JETSAM_SET_BAND:
+		error = xpc_process_set_jetsam_band(j, request, reply);
 		break;
-	case XPC_EVENT_LOOK_UP:
-		error = xpc_event_channel_look_up(j, request, reply);
+	case XPC_PROCESS_JETSAM_SET_MEMORY_LIMIT:
+		error = xpc_process_set_jetsam_memory_limit(j, request, reply);
 		break;
-	case XPC_EVENT_PROVIDER_CHECK_IN:
-		error = xpc_event_provider_check_in(j, request, reply);
+	case XPC_PROCESS_SERVICE_ATTACH:
+		error = xpc_process_attach(j, request, reply);
 		break;
-	case XPC_EVENT_PROVIDER_SET_STATE:
-		error = xpc_event_provider_set_state(j, request, reply);
+	case XPC_PROCESS_SERVICE_DETACH:
+		error = xpc_process_detach(j, request, reply);
 		break;
-	case XPC_EVENT_COPY_ENTITLEMENTS:
-		error = xpc_event_copy_entitlements(j, request, reply);
+	case XPC_PROCESS_SERVICE_GET_PROPERTIES:
+		error = xpc_process_get_properties(j, request, reply);
 		break;
-	case -1:
-		error = EINVAL;
+	case XPC_PROCESS_SERVICE_KILL:
+		error = xpc_process_service_kill(j, request, reply);
 		break;
 	default:
-		job_log(j, LOG_ERR, "Bogus opcode.");
+		job_log(j, LOG_ERR, "Bogus process opcode.");
 		error = EDOM;
 	}
 
 	if (error) {
 		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-		xpc_dictionary_set_uint64(reply2, XPC_EVENT_ROUTINE_KEY_ERROR, error);
+		if (reply2) {
+			xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, error);
+		}
+
 		*reply = reply2;
 	}
 
 	return true;
 }
 
-uint64_t
-xpc_get_jetsam_entitlement(const char *key)
+kern_return_t
+job_mig_kickstart(job_t j, name_t targetlabel, pid_t *out_pid, unsigned int flags)
 {
-	uint64_t entitlement = 0;
+	struct ldcred *ldc = runtime_get_caller_creds();
+	job_t otherj;
 
-	audit_token_t *token = runtime_get_caller_token();
-	xpc_object_t value = xpc_copy_entitlement_for_token(key, token);
-	if (value) {
-		if (xpc_get_type(value) == XPC_TYPE_UINT64) {
-			entitlement = xpc_uint64_get_value(value);
-		}
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
 
-		xpc_release(value);
+	if (unlikely(!(otherj = job_find(NULL, targetlabel)))) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
 	}
-	
-	return entitlement;	
+
+#if TARGET_OS_EMBEDDED
+	bool allow_non_root_kickstart = j->username && otherj->username && (strcmp(j->username, otherj->username) == 0);
+#else
+	bool allow_non_root_kickstart = false;
+#endif
+
+	if (ldc->euid != 0 && ldc->euid != geteuid() && !allow_non_root_kickstart) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+
+#if HAVE_SANDBOX
+	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
+	}
+#endif
+
+	if (otherj->p && (flags & VPROCFLAG_STALL_JOB_EXEC)) {
+		return BOOTSTRAP_SERVICE_ACTIVE;
+	}
+
+	otherj->stall_before_exec = (flags & VPROCFLAG_STALL_JOB_EXEC);
+	otherj = job_dispatch(otherj, true);
+
+	if (!job_assumes(j, otherj && otherj->p)) {
+		// <rdar://problem/6787083> Clear this flag if we failed to start the job.
+		otherj->stall_before_exec = false;
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	*out_pid = otherj->p;
+
+	return 0;
 }
 
-int
-xpc_process_set_jetsam_band(job_t j, xpc_object_t request, xpc_object_t *reply)
-{	
+kern_return_t
+job_mig_kickstart2(job_t j, mach_port_t rp, name_t targetlabel, uint32_t timeout, pid_t *out_pid, uint32_t flags)
+{
+	job_t otherj;
+
+	kern_return_t kr = job_mig_kickstart(j, targetlabel, out_pid, flags);
+	if (kr != 0) {
+		return kr;
+	}
+
+	if (!job_assumes(j, (otherj = job_find(NULL, targetlabel)) != NULL)) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (job_is_ready(otherj)) {
+		job_ready_check(otherj);
+		return 0;
+	}
+
+	if (!waiting4ready_new(otherj, rp, timeout)) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	return MIG_NO_REPLY;
+}
+
+/* The checks every app launch request has to pass before we look at what it
+ * wants to launch.
+ */
+static kern_return_t
+job_spawn_check(job_t j)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+
 	if (!j) {
-		return EINVAL;
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	const char *label = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_LABEL);
-	if (!label) {
-		return EXINVAL;
+	if (unlikely(j->deny_job_creation)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
 
-	xpc_jetsam_band_t entitled_band = -1;
-	xpc_jetsam_band_t requested_band = (xpc_jetsam_band_t)xpc_dictionary_get_uint64(request, XPC_PROCESS_ROUTINE_KEY_PRIORITY_BAND);
-	if (!requested_band) {
-		return EXINVAL;
+#if HAVE_SANDBOX
+	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
+		return BOOTSTRAP_NOT_PRIVILEGED;
 	}
+#endif
 
-	if (!(requested_band >= XPC_JETSAM_BAND_SUSPENDED && requested_band < XPC_JETSAM_BAND_LAST)) {
-		return EXINVAL;
+	if (unlikely(pid1_magic && ldc->euid && ldc->uid)) {
+		job_log(j, LOG_DEBUG, "Punting spawn to per-user-context");
+		return VPROC_ERR_TRY_PER_USER;
 	}
 
-	uint64_t rcdata = xpc_dictionary_get_uint64(request, XPC_PROCESS_ROUTINE_KEY_RCDATA);
-	
-	job_t tj = job_find(root_jobmgr, label);
-	if (!tj) {
-		return EXSRCH;
+	return 0;
+}
+
+// Marks a newly created job as an app launched on j's behalf and starts it.
+static kern_return_t
+job_spawn_app(job_t j, job_t jr, mach_port_t asport, job_t *outj)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+
+	if (pid1_magic) {
+		jr->mach_uid = ldc->uid;
 	}
 
-	boolean_t allow = false;
-	if (j->embedded_god) {
-		allow = true;
-	} else {
-		entitled_band = xpc_get_jetsam_entitlement("com.apple.private.jetsam.modify-priority");
-		if (entitled_band >= requested_band) {
-			allow = true;
+	// TODO: Consolidate the app and legacy_LS_job bits.
+	jr->legacy_LS_job = true;
+	jr->abandon_pg = true;
+	jr->asport = asport;
+	jr->app = true;
+	uuid_clear(jr->expected_audit_uuid);
+	jr = job_dispatch(jr, true);
+
+	if (!job_assumes(j, jr != NULL)) {
+		job_remove(jr);
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	if (!job_assumes(jr, jr->p)) {
+		job_remove(jr);
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	job_log(jr, LOG_DEBUG, "Spawned by PID %u: %s", j->p, j->label);
+	*outj = jr;
+
+	return BOOTSTRAP_SUCCESS;
+}
+
+/* Turns the result of an app launch into a reply. A new process is replied to
+ * once it has called exec(3). The handle is only given for spawn3(), whose
+ * reply carries it.
+ */
+static kern_return_t
+job_spawn_reply_setup(job_t j, job_t nj, kern_return_t kr, mach_port_t rp, uint64_t *handle, pid_t *child_pid, mach_port_t *obsvr_port)
+{
+	if (likely(kr == KERN_SUCCESS)) {
+		if (job_setup_exit_port(nj) != KERN_SUCCESS) {
+			job_remove(nj);
+			kr = BOOTSTRAP_NO_MEMORY;
+		} else {
+			/* Do not return until the job has called exec(3), thereby making it
+			 * safe for the caller to send it SIGCONT.
+			 *
+			 * <rdar://problem/9042798>
+			 */
+			nj->spawn_reply_port = rp;
+			nj->spawn_reply_handle = handle ? *handle : 0;
+			nj->spawn_reply_v3 = (handle != NULL);
+			kr = MIG_NO_REPLY;
 		}
-	}
+	} else if (kr == BOOTSTRAP_NAME_IN_USE) {
+		bool was_running = nj->p;
+		if (job_dispatch(nj, true)) {
+			if (!was_running) {
+				job_log(nj, LOG_DEBUG, "Job exists but is not running. Kick-starting.");
 
-	if (!allow) {
-		if (launchd_no_jetsam_perm_check) {
-			job_log(j, LOG_NOTICE, "Jetsam priority checks disabled; allowing job to set priority: %d", requested_band);
-		} else {		
-			job_log(j, LOG_ERR, "Job cannot decrease Jetsam priority band (requested/maximum): %d/%d", requested_band, entitled_band);
-			return EPERM;
+				if (job_setup_exit_port(nj) == KERN_SUCCESS) {
+					nj->spawn_reply_port = rp;
+					nj->spawn_reply_handle = handle ? *handle : 0;
+					nj->spawn_reply_v3 = (handle != NULL);
+					kr = MIG_NO_REPLY;
+				} else {
+					kr = BOOTSTRAP_NO_MEMORY;
+				}
+			} else {
+				*obsvr_port = MACH_PORT_NULL;
+				*child_pid = nj->p;
+				kr = KERN_SUCCESS;
+			}
+		} else {
+			job_log(nj, LOG_ERR, "Failed to dispatch job, requestor: %s", j->label);
+			kr = BOOTSTRAP_UNKNOWN_SERVICE;
 		}
 	}
 
-	job_log(j, LOG_INFO, "Setting Jetsam band: %d.", requested_band);
-	job_update_jetsam_properties(tj, requested_band, rcdata);
-
-	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-	*reply = reply2;
-
-	return 0;
+	return kr;
 }
 
-int
-xpc_process_set_jetsam_memory_limit(job_t j, xpc_object_t request, xpc_object_t *reply)
+kern_return_t
+job_mig_spawn_internal(job_t j, vm_offset_t indata, mach_msg_type_number_t indataCnt, mach_port_t asport, job_t *outj)
 {
-	if (!j) {
-		return EINVAL;
-	}
+	launch_data_t jobdata = NULL;
+	size_t data_offset = 0;
+	kern_return_t kr;
+	job_t jr;
 
-	const char *label = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_LABEL);
-	if (!label) {
-		return EXINVAL;
+	if ((kr = job_spawn_check(j))) {
+		return kr;
 	}
 
-	int32_t entitlement_limit = 0;
-	int32_t requested_limit = (int32_t)xpc_dictionary_get_uint64(request, XPC_PROCESS_ROUTINE_KEY_MEMORY_LIMIT);
-
-	job_t tj = job_find(root_jobmgr, label);
-	if (!tj) {
-		return EXSRCH;
+	if (!job_assumes(j, indataCnt != 0)) {
+		return 1;
 	}
 
-	boolean_t allow = false;
-	if (j->embedded_god) {
-		allow = true;
-	} else {
-		entitlement_limit = (int32_t)xpc_get_jetsam_entitlement("com.apple.private.jetsam.memory_limit");		
-		if (entitlement_limit >= requested_limit) {
-			allow = true;
-		}
+	runtime_ktrace0(RTKT_LAUNCHD_DATA_UNPACK);
+	if (!job_assumes(j, (jobdata = launch_data_unpack((void *)indata, indataCnt, NULL, 0, &data_offset, NULL)) != NULL)) {
+		return 1;
 	}
 
-	if (!allow) {
-		if (launchd_no_jetsam_perm_check) {
-			job_log(j, LOG_NOTICE, "Jetsam priority checks disabled; allowing job to set memory limit: %d", requested_limit);
-		} else {		
-			job_log(j, LOG_ERR, "Job cannot set Jetsam memory limit (requested/maximum): %d/%d", requested_limit, entitlement_limit);
-			return EPERM;
-		}
+	jobmgr_t target_jm = jobmgr_find_by_name(j->mgr, NULL);
+	if (!jobmgr_assumes(j->mgr, target_jm != NULL)) {
+		jobmgr_log(j->mgr, LOG_ERR, "This API can only be used by a process running within an Aqua session.");
+		return 1;
 	}
 
-	job_log(j, LOG_INFO, "Setting Jetsam memory limit: %d.", requested_limit);
-	job_update_jetsam_memory_limit(tj, requested_limit);
-
-	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-	*reply = reply2;
-
-	return 0;
-}
-
-static jobmgr_t
-_xpc_process_find_target_manager(job_t j, xpc_service_type_t type, pid_t pid)
-{
-	jobmgr_t target = NULL;
-	if (type == XPC_SERVICE_TYPE_BUNDLED) {
-		job_log(j, LOG_DEBUG, "Bundled service. Searching for XPC domains for PID: %d", pid);
+	jr = jobmgr_import2(target_jm ?: j->mgr, jobdata);
 
-		jobmgr_t jmi = NULL;
-		SLIST_FOREACH(jmi, &root_jobmgr->submgrs, sle) {
-			if (jmi->req_pid && jmi->req_pid == pid) {
-				jobmgr_log(jmi, LOG_DEBUG, "Found job manager for PID.");
-				target = jmi;
-				break;
+	launch_data_t label = NULL;
+	launch_data_t wait4debugger = NULL;
+	if (!jr) {
+		switch (errno) {
+		case EEXIST:
+			/* If EEXIST was returned, we know that there is a label string in
+			 * the dictionary. So we don't need to check the types here; that
+			 * has already been done.
+			 */
+			label = launch_data_dict_lookup(jobdata, LAUNCH_JOBKEY_LABEL);
+			jr = job_find(NULL, launch_data_get_string(label));
+			if (job_assumes(j, jr != NULL) && !jr->p) {
+				wait4debugger = launch_data_dict_lookup(jobdata, LAUNCH_JOBKEY_WAITFORDEBUGGER);
+				if (wait4debugger && launch_data_get_type(wait4debugger) == LAUNCH_DATA_BOOL) {
+					if (launch_data_get_bool(wait4debugger)) {
+						/* If the job exists, we're going to kick-start it, but
+						 * we need to give the caller the opportunity to start
+						 * it suspended if it so desires. But this will only
+						 * take effect if the job isn't running.
+						 */
+						jr->wait4debugger_oneshot = true;
+					}
+				}
 			}
+
+			*outj = jr;
+			return BOOTSTRAP_NAME_IN_USE;
+		default:
+			return BOOTSTRAP_NO_MEMORY;
 		}
-	} else if (type == XPC_SERVICE_TYPE_LAUNCHD || type == XPC_SERVICE_TYPE_APP) {
-		target = j->mgr;
 	}
 
-	return target;
+	return job_spawn_app(j, jr, asport, outj);
 }
 
-static int
-xpc_process_attach(job_t j, xpc_object_t request, xpc_object_t *reply)
+kern_return_t
+job_mig_spawn2(job_t j, mach_port_t rp, vm_offset_t indata, mach_msg_type_number_t indataCnt, mach_port_t asport, pid_t *child_pid, mach_port_t *obsvr_port)
 {
-	if (!j) {
-		return EINVAL;
-	}
+	job_t nj = NULL;
+	kern_return_t kr = job_mig_spawn_internal(j, indata, indataCnt, asport, &nj);
+	kr = job_spawn_reply_setup(j, nj, kr, rp, NULL, child_pid, obsvr_port);
 
-	audit_token_t *token = runtime_get_caller_token();
-	xpc_object_t entitlement = xpc_copy_entitlement_for_token(XPC_SERVICE_ENTITLEMENT_ATTACH, token);
-	if (!entitlement) {
-		job_log(j, LOG_ERR, "Job does not have entitlement: %s", XPC_SERVICE_ENTITLEMENT_ATTACH);
-		return EPERM;
-	}
+	mig_deallocate(indata, indataCnt);
+	return kr;
+}
 
-	if (entitlement != XPC_BOOL_TRUE) {
-		char *desc = xpc_copy_description(entitlement);
-		job_log(j, LOG_ERR, "Job has bad value for entitlement: %s:\n%s", XPC_SERVICE_ENTITLEMENT_ATTACH, desc);
-		free(desc);
+/* Splits a compact spawn descriptor into argument and environment vectors,
+ * which point into the descriptor. Either vector may be NULL if the caller
+ * doesn't want it. Returns false if the descriptor is malformed.
+ */
+static bool
+spawn_desc_parse(const struct vproc_spawn_desc *d, size_t len, const char ***argvp, const char ***envpp)
+{
+	const char **argv = NULL, **envp = NULL;
+	const char *ptr, *end;
+	uint32_t i;
 
-		xpc_release(entitlement);
-		return EPERM;
+	if (len < sizeof(*d) || len > VPROC_SPAWN_DESC_MAX || d->version != VPROC_SPAWN_DESC_VERSION) {
+		return false;
 	}
-
-	const char *name = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_NAME);
-	if (!name) {
-		return EXINVAL;
+	if (strnlen(d->label, sizeof(d->label)) == sizeof(d->label)) {
+		return false;
 	}
-
-	xpc_service_type_t type = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_TYPE);
-	if (!type) {
-		return EXINVAL;
+	// Every string takes at least its terminator.
+	if (d->argc > len - sizeof(*d) || d->envc > len - sizeof(*d) - d->argc) {
+		return false;
 	}
 
-	mach_port_t port = xpc_dictionary_copy_mach_send(request, XPC_PROCESS_ROUTINE_KEY_NEW_INSTANCE_PORT);
-	if (!MACH_PORT_VALID(port)) {
-		return EXINVAL;
+	if (argvp && !(argv = calloc(d->argc + 1, sizeof(argv[0])))) {
+		return false;
+	}
+	if (envpp && !(envp = calloc(d->envc + 1, sizeof(envp[0])))) {
+		free(argv);
+		return false;
 	}
 
-	pid_t pid = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_HANDLE);
-
-	job_log(j, LOG_DEBUG, "Attaching to service: %s", name);
-
-	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-	jobmgr_t target = _xpc_process_find_target_manager(j, type, pid);
-	if (target) {
-		jobmgr_log(target, LOG_DEBUG, "Found target job manager for service: %s", name);
-		(void)jobmgr_assumes(target, waiting4attach_new(target, name, port, 0, type));
-
-		/* HACK: This is awful. For legacy reasons, launchd job labels are all
-		 * stored in a global namespace, which is stored in the root job
-		 * manager. But XPC domains have a per-domain namespace. So if we're
-		 * looking for a legacy launchd job, we have to redirect any attachment
-		 * attempts to the root job manager to find existing instances.
-		 *
-		 * But because we store attachments on a per-job manager basis, we have
-		 * to create the new attachment in the actual target job manager, hence
-		 * why we change the target only after we've created the attachment.
-		 */
-		if (strcmp(target->name, VPROCMGR_SESSION_AQUA) == 0) {
-			target = root_jobmgr;
+	ptr = d->strings;
+	end = (const char *)d + len;
+	for (i = 0; i < d->argc + d->envc; i++) {
+		const char *nul = memchr(ptr, '\0', end - ptr);
+		const char *eq = i >= d->argc && nul ? strchr(ptr, '=') : NULL;
+		if (!nul || (i >= d->argc && (!eq || (size_t)(eq - ptr) > VPROC_SPAWN_ENV_KEY_MAX))) {
+			free(argv);
+			free(envp);
+			return false;
 		}
 
-		job_t existing = job_find(target, name);
-		if (existing && existing->p) {
-			job_log(existing, LOG_DEBUG, "Found existing instance of service.");
-			xpc_dictionary_set_int64(reply2, XPC_PROCESS_ROUTINE_KEY_PID, existing->p);
-		} else {
-			xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, ESRCH);
+		if (i < d->argc && argv) {
+			argv[i] = ptr;
+		} else if (i >= d->argc && envp) {
+			envp[i - d->argc] = ptr;
 		}
-	} else if (type == XPC_SERVICE_TYPE_BUNDLED) {
-		(void)job_assumes(j, waiting4attach_new(target, name, port, pid, type));
-		xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, ESRCH);
-	} else {
-		xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, EXSRCH);
+		ptr = nul + 1;
 	}
 
-	*reply = reply2;
-	return 0;
+	if (argvp) {
+		*argvp = argv;
+	}
+	if (envpp) {
+		*envpp = envp;
+	}
+
+	return true;
 }
 
-static int
-xpc_process_detach(job_t j, xpc_object_t request, xpc_object_t *reply __unused)
-{
-	if (!j) {
-		return EINVAL;
-	}
+/* A compact spawn descriptor kept so that repeat launches of the same app can
+ * name it by handle rather than sending it again. It also remembers the
+ * manager the first launch resolved to.
+ */
+struct spawn_template {
+	LIST_ENTRY(spawn_template) sle;
+	uint64_t handle;
+	uid_t euid;
+	jobmgr_t jm;
+	size_t len;
+	struct vproc_spawn_desc *desc;
+};
 
-	const char *name = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_NAME);
-	if (!name) {
-		return EXINVAL;
-	}
+#define SPAWN_TEMPLATE_MAX 64
 
-	xpc_service_type_t type = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_TYPE);
-	if (!type) {
-		return EXINVAL;
-	}
+// Most recently used first, so eviction takes from the tail.
+static LIST_HEAD(, spawn_template) s_spawn_templates;
+static unsigned int s_spawn_template_cnt;
+static uint64_t s_spawn_template_next_handle = 1;
 
-	job_log(j, LOG_DEBUG, "Deatching from service: %s", name);
+static void
+spawn_template_delete(struct spawn_template *st)
+{
+	LIST_REMOVE(st, sle);
+	s_spawn_template_cnt--;
+	free(st->desc);
+	free(st);
+}
 
-	pid_t pid = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_PID);
-	jobmgr_t target = _xpc_process_find_target_manager(j, type, pid);
-	if (target) {
-		jobmgr_log(target, LOG_DEBUG, "Found target job manager for service: %s", name);
+static struct spawn_template *
+spawn_template_new(jobmgr_t jm, const struct vproc_spawn_desc *d, size_t len, uid_t euid)
+{
+	struct spawn_template *st = NULL, *sti;
 
-		struct waiting4attach *w4ai = NULL;
-		struct waiting4attach *w4ait = NULL;
-		LIST_FOREACH_SAFE(w4ai, &target->attaches, le, w4ait) {
-			if (strcmp(name, w4ai->name) == 0) {
-				jobmgr_log(target, LOG_DEBUG, "Found attachment. Deleting.");
-				waiting4attach_delete(target, w4ai);
-				break;
-			}
+	if (s_spawn_template_cnt >= SPAWN_TEMPLATE_MAX) {
+		LIST_FOREACH(sti, &s_spawn_templates, sle) {
+			st = sti;
 		}
+		spawn_template_delete(st);
+	}
+
+	if (!jobmgr_assumes(jm, (st = calloc(1, sizeof(*st))) != NULL)) {
+		return NULL;
+	}
+	if (!jobmgr_assumes(jm, (st->desc = malloc(len)) != NULL)) {
+		free(st);
+		return NULL;
 	}
 
-	return 0;
+	memcpy(st->desc, d, len);
+	st->len = len;
+	st->jm = jm;
+	st->euid = euid;
+	st->handle = s_spawn_template_next_handle++;
+
+	LIST_INSERT_HEAD(&s_spawn_templates, st, sle);
+	s_spawn_template_cnt++;
+
+	return st;
 }
 
-static int
-xpc_process_get_properties(job_t j, xpc_object_t request, xpc_object_t *reply)
+static struct spawn_template *
+spawn_template_find(uint64_t handle, uid_t euid)
 {
-	if (j->anonymous) {
-		/* Total hack. libxpc will send requests to the pipe created out of the
-		 * process' bootstrap port, so when job_mig_intran() tries to resolve
-		 * the process into a job, it'll wind up creating an anonymous job if
-		 * the requestor was an XPC service, whose job manager is an XPC domain.
-		 */
-		pid_t pid = j->p;
-		jobmgr_t jmi = NULL;
-		SLIST_FOREACH(jmi, &root_jobmgr->submgrs, sle) {
-			if ((j = jobmgr_find_by_pid(jmi, pid, false))) {
-				break;
-			}
+	struct spawn_template *st;
+
+	LIST_FOREACH(st, &s_spawn_templates, sle) {
+		if (st->handle == handle) {
+			break;
 		}
 	}
 
-	if (!j || j->anonymous) {
-		return EXINVAL;
+	if (!st || st->euid != euid) {
+		return NULL;
 	}
 
-	struct waiting4attach *w4a = waiting4attach_find(j->mgr, j);
-	if (!w4a) {
-		return EXINVAL;
+	if (st->jm->shutting_down) {
+		spawn_template_delete(st);
+		return NULL;
 	}
 
-	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-	xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_TYPE, w4a->type);
-	xpc_dictionary_set_mach_send(reply2, XPC_PROCESS_ROUTINE_KEY_NEW_INSTANCE_PORT, w4a->port);
-	if (j->prog) {
-		xpc_dictionary_set_string(reply2, XPC_PROCESS_ROUTINE_KEY_PATH, j->prog);
-	} else {
-		xpc_dictionary_set_string(reply2, XPC_PROCESS_ROUTINE_KEY_PATH, j->argv[0]);
+	if (st != LIST_FIRST(&s_spawn_templates)) {
+		LIST_REMOVE(st, sle);
+		LIST_INSERT_HEAD(&s_spawn_templates, st, sle);
 	}
 
-	if (j->argv) {
-		xpc_object_t xargv = xpc_array_create(NULL, 0);
+	return st;
+}
 
-		size_t i = 0;
-		for (i = 0; i < j->argc; i++) {
-			if (j->argv[i]) {
-				xpc_array_set_string(xargv, XPC_ARRAY_APPEND, j->argv[i]);
-			}
-		}
+// Drops the templates that resolved to a manager that is going away.
+static void
+spawn_templates_forget(jobmgr_t jm)
+{
+	struct spawn_template *st, *stn;
 
-		xpc_dictionary_set_value(reply2, XPC_PROCESS_ROUTINE_KEY_ARGV, xargv);
-		xpc_release(xargv);
+	LIST_FOREACH_SAFE(st, &s_spawn_templates, sle, stn) {
+		if (st->jm == jm) {
+			spawn_template_delete(st);
+		}
 	}
-
-	*reply = reply2;
-	return 0;
 }
 
-static int
-xpc_process_service_kill(job_t j, xpc_object_t request, xpc_object_t *reply)
+/* Creates an app job straight from a compact spawn descriptor, without going
+ * through jobmgr_import2() and the generic key dispatch. Only what the
+ * descriptor can express is set; everything else keeps job_new()'s defaults.
+ * If a job with the label already exists, it is returned and *existed is set.
+ */
+static job_t
+job_new_compact(jobmgr_t jm, const struct vproc_spawn_desc *d, const char *const *argv, const char *const *envp, bool *existed)
 {
-#if XPC_LPI_VERSION >= 20130426
-	if (!j) {
-		return ESRCH;
+	job_t j;
+	size_t i;
+
+	*existed = false;
+	if (unlikely((j = job_find(root_jobmgr, d->label)) != NULL)) {
+		// Same as spawn2(): only honor this if we're about to start it.
+		if (!j->p && (d->flags & SPAWN_VIA_LAUNCHD_STOPPED)) {
+			j->wait4debugger_oneshot = true;
+		}
+		*existed = true;
+		return j;
+	}
+	if (unlikely(!jobmgr_label_test(root_jobmgr, d->label))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!argv[0]) {
+		jobmgr_log(jm, LOG_ERR, "Compact spawn specifies no arguments: %s", d->label);
+		errno = EINVAL;
+		return NULL;
 	}
 
-	jobmgr_t jm = _xpc_process_find_target_manager(j, XPC_SERVICE_TYPE_BUNDLED, j->p);
-	if (!jm) {
-		return ENOENT;
+	if (!(j = job_new(jm, d->label, NULL, argv))) {
+		return NULL;
 	}
+#if TARGET_OS_EMBEDDED
+	job_apply_defaults(j);
+#endif
 
-	const char *name = xpc_dictionary_get_string(request, XPC_PROCESS_ROUTINE_KEY_NAME);
-	if (!name) {
-		return EINVAL;
+	for (i = 0; envp[i]; i++) {
+		// spawn_desc_parse() has made sure the key fits.
+		const char *eq = strchr(envp[i], '=');
+		name_t key;
+
+		(void)strlcpy(key, envp[i], (size_t)(eq - envp[i]) + 1);
+		envitem_new(j, key, eq + 1, false);
 	}
 
-	int64_t whichsig = xpc_dictionary_get_int64(request, XPC_PROCESS_ROUTINE_KEY_SIGNAL);
-	if (!whichsig) {
-		return EINVAL;
+	if (d->flags & SPAWN_VIA_LAUNCHD_STOPPED) {
+		j->wait4debugger = true;
+	}
+	if (d->flags & SPAWN_VIA_LAUNCHD_TALAPP) {
+		j->psproctype = POSIX_SPAWN_PROC_TYPE_APP_TAL;
+	}
+	if (d->flags & SPAWN_VIA_LAUNCHD_DISABLE_ASLR) {
+		j->disable_aslr = true;
 	}
 
-	job_t j2kill = job_find(jm, name);
-	if (!j2kill) {
-		return ESRCH;
+	if (pid1_magic && !jm->parentmgr) {
+		// See jobmgr_import2().
+		envitem_new(j, "__CF_USER_TEXT_ENCODING", "0x0:0:0", false);
 	}
 
-	if (j2kill->alias) {
-		// Only allow for private instances to be killed.
-		return EPERM;
+	job_log(j, LOG_DEBUG, "Created from a compact spawn descriptor.");
+
+	return j;
+}
+
+kern_return_t
+job_mig_spawn3(job_t j, mach_port_t rp, vm_offset_t indata, mach_msg_type_number_t indataCnt, mach_port_t asport, uint64_t *handle, pid_t *child_pid, mach_port_t *obsvr_port)
+{
+	struct ldcred *ldc = runtime_get_caller_creds();
+	const struct vproc_spawn_desc *d = (const struct vproc_spawn_desc *)indata;
+	const char **argv = NULL, **envp = NULL, **req_argv = NULL;
+	struct spawn_template *st = NULL;
+	jobmgr_t target_jm;
+	job_t nj = NULL;
+	kern_return_t kr;
+
+	if ((kr = job_spawn_check(j))) {
+		goto out;
 	}
 
-	struct proc_bsdshortinfo proc;
-	if (proc_pidinfo(j2kill->p, PROC_PIDT_SHORTBSDINFO, 1, &proc, PROC_PIDT_SHORTBSDINFO_SIZE) == 0) {
-		if (errno != ESRCH) {
-			(void)jobmgr_assumes_zero(root_jobmgr, errno);
+#if TARGET_OS_EMBEDDED
+	// The UserName checks for the god job need the full import.
+	if (launchd_embedded_handofgod) {
+		kr = ENOTSUP;
+		goto out;
+	}
+#endif
+
+	if (*handle) {
+		if (!(st = spawn_template_find(*handle, ldc->euid))) {
+			kr = BOOTSTRAP_UNKNOWN_SERVICE;
+			goto out;
 		}
 
-		return errno;
-	}
+		// The request may only bring new arguments.
+		if (indataCnt && (!spawn_desc_parse(d, indataCnt, &req_argv, NULL) || d->envc)) {
+			kr = 1;
+			goto out;
+		}
 
-	struct ldcred *ldc = runtime_get_caller_creds();
-	if (proc.pbsi_uid != ldc->euid) {
-		// Do not allow non-root to kill RoleAccount services running as a
-		// different user.
-		return EPERM;
+		d = st->desc;
+		target_jm = st->jm;
+		(void)job_assumes(j, spawn_desc_parse(d, st->len, &argv, &envp));
+		if (req_argv && req_argv[0]) {
+			free(argv);
+			argv = req_argv;
+			req_argv = NULL;
+		}
+	} else {
+		if (!job_assumes(j, spawn_desc_parse(d, indataCnt, &argv, &envp))) {
+			kr = 1;
+			goto out;
+		}
+
+		target_jm = jobmgr_find_by_name(j->mgr, NULL);
+		if (!jobmgr_assumes(j->mgr, target_jm != NULL)) {
+			jobmgr_log(j->mgr, LOG_ERR, "This API can only be used by a process running within an Aqua session.");
+			kr = 1;
+			goto out;
+		}
 	}
 
-	if (!j2kill->p) {
-		return EALREADY;
+	if (!argv || !envp) {
+		kr = BOOTSTRAP_NO_MEMORY;
+		goto out;
 	}
 
-	xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-	if (!reply2) {
-		return EINVAL;
+	bool existed = false;
+	if (!(nj = job_new_compact(target_jm, d, argv, envp, &existed))) {
+		kr = BOOTSTRAP_NO_MEMORY;
+	} else if (existed) {
+		kr = BOOTSTRAP_NAME_IN_USE;
+	} else {
+		kr = job_spawn_app(j, nj, asport, &nj);
 	}
 
-	int error = 0;
-	int ret = kill(j2kill->p, whichsig);
-	if (ret) {
-		error = errno;
+	/* Hand out a handle for the definition we just used, unless the caller
+	 * already has one. Failing to make one isn't fatal; the caller will just
+	 * send the whole descriptor again next time. Only a successful reply
+	 * carries the handle back, so there's no point otherwise.
+	 */
+	if (!st && kr == KERN_SUCCESS) {
+		st = spawn_template_new(target_jm, d, indataCnt, ldc->euid);
+		*handle = st ? st->handle : 0;
 	}
 
-	xpc_dictionary_set_int64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, error);
-	*reply = reply2;
-	return 0;
-#else
-	return ENOTSUP;
-#endif
-}
+	kr = job_spawn_reply_setup(j, nj, kr, rp, handle, child_pid, obsvr_port);
 
-bool
-xpc_process_demux(mach_port_t p, xpc_object_t request, xpc_object_t *reply)
-{
-	uint64_t op = xpc_dictionary_get_uint64(request, XPC_PROCESS_ROUTINE_KEY_OP);
-	if (!op) {
-		return false;
+out:
+	free(argv);
+	free(envp);
+	free(req_argv);
+	if (indataCnt) {
+		mig_deallocate(indata, indataCnt);
 	}
+	return kr;
+}
 
-	audit_token_t token;
-	xpc_dictionary_get_audit_token(request, &token);
-	runtime_record_caller_creds(&token);
+/* The full export keys jobs by label, and a later job overwrites an earlier one
+ * with the same label. Jobs are visited submanagers first, so the outermost
+ * manager wins, and between siblings the one visited last wins. The listing
+ * dedupes with the same walk: a label maps to the last job visited with it.
+ */
+struct jobmgr_list_table {
+	job_t *slots;
+	size_t mask;
+};
 
-	job_t j = job_mig_intran(p);
-	job_log(j, LOG_DEBUG, "Incoming XPC process request: %llu", op);
+static void
+jobmgr_list_count(jobmgr_t jm, const char *prefix, size_t prefix_len, size_t *cnt)
+{
+	jobmgr_t jmi;
+	job_t ji;
 
-	int error = -1;
-	switch (op) {
-	case XPC_PROCESS_JETSAM_SET_BAND:
-		error = xpc_process_set_jetsam_band(j, request, reply);
-		break;
-	case XPC_PROCESS_JETSAM_SET_MEMORY_LIMIT:
-		error = xpc_process_set_jetsam_memory_limit(j, request, reply);
-		break;
-	case XPC_PROCESS_SERVICE_ATTACH:
-		error = xpc_process_attach(j, request, reply);
-		break;
-	case XPC_PROCESS_SERVICE_DETACH:
-		error = xpc_process_detach(j, request, reply);
-		break;
-	case XPC_PROCESS_SERVICE_GET_PROPERTIES:
-		error = xpc_process_get_properties(j, request, reply);
-		break;
-	case XPC_PROCESS_SERVICE_KILL:
-		error = xpc_process_service_kill(j, request, reply);
-		break;
-	default:
-		job_log(j, LOG_ERR, "Bogus process opcode.");
-		error = EDOM;
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		jobmgr_list_count(jmi, prefix, prefix_len, cnt);
 	}
-
-	if (error) {
-		xpc_object_t reply2 = xpc_dictionary_create_reply(request);
-		if (reply2) {
-			xpc_dictionary_set_uint64(reply2, XPC_PROCESS_ROUTINE_KEY_ERROR, error);
+	LIST_FOREACH(ji, &jm->jobs, sle) {
+		if (strncmp(ji->label, prefix, prefix_len) == 0) {
+			(*cnt)++;
 		}
-
-		*reply = reply2;
 	}
-
-	return true;
 }
 
-kern_return_t
-job_mig_kickstart(job_t j, name_t targetlabel, pid_t *out_pid, unsigned int flags)
+static job_t *
+jobmgr_list_slot(struct jobmgr_list_table *t, const char *label)
 {
-	struct ldcred *ldc = runtime_get_caller_creds();
-	job_t otherj;
+	uint32_t h = 2166136261U;
+	const char *p;
+	size_t i;
 
-	if (!j) {
-		return BOOTSTRAP_NO_MEMORY;
+	for (p = label; *p; p++) {
+		h ^= (unsigned char)*p;
+		h *= 16777619U;
 	}
 
-	if (unlikely(!(otherj = job_find(NULL, targetlabel)))) {
-		return BOOTSTRAP_UNKNOWN_SERVICE;
+	for (i = h & t->mask; t->slots[i] && strcmp(t->slots[i]->label, label) != 0; i = (i + 1) & t->mask) {
+		;
 	}
 
-#if TARGET_OS_EMBEDDED
-	bool allow_non_root_kickstart = j->username && otherj->username && (strcmp(j->username, otherj->username) == 0);
-#else
-	bool allow_non_root_kickstart = false;
-#endif
+	return &t->slots[i];
+}
 
-	if (ldc->euid != 0 && ldc->euid != geteuid() && !allow_non_root_kickstart) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
+static void
+jobmgr_list_winners(jobmgr_t jm, const char *prefix, size_t prefix_len, struct jobmgr_list_table *t)
+{
+	jobmgr_t jmi;
+	job_t ji;
 
-#if HAVE_SANDBOX
-	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		jobmgr_list_winners(jmi, prefix, prefix_len, t);
 	}
-#endif
-
-	if (otherj->p && (flags & VPROCFLAG_STALL_JOB_EXEC)) {
-		return BOOTSTRAP_SERVICE_ACTIVE;
+	LIST_FOREACH(ji, &jm->jobs, sle) {
+		if (strncmp(ji->label, prefix, prefix_len) == 0) {
+			*jobmgr_list_slot(t, ji->label) = ji;
+		}
 	}
+}
 
-	otherj->stall_before_exec = (flags & VPROCFLAG_STALL_JOB_EXEC);
-	otherj = job_dispatch(otherj, true);
+/* Called once with a NULL records array to count and again to fill it in, the
+ * same way take_subset2 sizes its reply.
+ */
+static void
+jobmgr_list_jobs(jobmgr_t jm, const char *prefix, size_t prefix_len, uint64_t flags,
+	struct jobmgr_list_table *t, struct vproc_list_record *records, size_t *cnt)
+{
+	uint64_t states = flags & (VPROC_LIST_RUNNING | VPROC_LIST_STOPPED);
+	jobmgr_t jmi;
+	job_t ji;
 
-	if (!job_assumes(j, otherj && otherj->p)) {
-		// <rdar://problem/6787083> Clear this flag if we failed to start the job.
-		otherj->stall_before_exec = false;
-		return BOOTSTRAP_NO_MEMORY;
+	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+		jobmgr_list_jobs(jmi, prefix, prefix_len, flags, t, records, cnt);
 	}
 
-	*out_pid = otherj->p;
+	LIST_FOREACH(ji, &jm->jobs, sle) {
+		if (strncmp(ji->label, prefix, prefix_len) != 0) {
+			continue;
+		}
+		if (*jobmgr_list_slot(t, ji->label) != ji) {
+			// Shadowed by a job with the same label that the export keeps instead.
+			continue;
+		}
+		if (states && !(states & (ji->p ? VPROC_LIST_RUNNING : VPROC_LIST_STOPPED))) {
+			continue;
+		}
+
+		if (records) {
+			struct vproc_list_record *r = &records[*cnt];
 
-	return 0;
+			r->pid = ji->p;
+			r->last_status = ji->fpfail ? LAUNCH_EXITSTATUS_FAIRPLAY_FAIL : ji->last_exit_status;
+			r->flags = 0;
+			if (strlcpy(r->label, ji->label, sizeof(r->label)) >= sizeof(r->label)) {
+				r->flags |= VPROC_LIST_LABEL_TRUNCATED;
+			}
+		}
+		(*cnt)++;
+	}
 }
 
 kern_return_t
-job_mig_spawn_internal(job_t j, vm_offset_t indata, mach_msg_type_number_t indataCnt, mach_port_t asport, job_t *outj)
+job_mig_list_jobs(job_t j, name_t prefix, uint64_t flags, vm_offset_t *outdata, mach_msg_type_number_t *outdataCnt)
 {
-	launch_data_t jobdata = NULL;
-	size_t data_offset = 0;
-	struct ldcred *ldc = runtime_get_caller_creds();
-	job_t jr;
+	struct vproc_list_record *records = NULL;
+	struct jobmgr_list_table t = { NULL, 0 };
+	size_t cnt = 0, filled = 0, sz = 16;
+	size_t prefix_len;
 
 	if (!j) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (unlikely(j->deny_job_creation)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
+	*outdata = 0;
+	*outdataCnt = 0;
 
-#if HAVE_SANDBOX
-	if (unlikely(sandbox_check(ldc->pid, "job-creation", SANDBOX_FILTER_NONE) > 0)) {
-		return BOOTSTRAP_NOT_PRIVILEGED;
-	}
-#endif
+	prefix_len = strnlen(prefix, sizeof(name_t));
 
-	if (unlikely(pid1_magic && ldc->euid && ldc->uid)) {
-		job_log(j, LOG_DEBUG, "Punting spawn to per-user-context");
-		return VPROC_ERR_TRY_PER_USER;
+	// Keep the label table at most half full so probes stay short.
+	jobmgr_list_count(root_jobmgr, prefix, prefix_len, &cnt);
+	if (cnt == 0) {
+		return BOOTSTRAP_SUCCESS;
 	}
-
-	if (!job_assumes(j, indataCnt != 0)) {
-		return 1;
+	while (sz < cnt * 2) {
+		sz *= 2;
 	}
-
-	runtime_ktrace0(RTKT_LAUNCHD_DATA_UNPACK);
-	if (!job_assumes(j, (jobdata = launch_data_unpack((void *)indata, indataCnt, NULL, 0, &data_offset, NULL)) != NULL)) {
-		return 1;
+	if (!job_assumes(j, (t.slots = calloc(sz, sizeof(t.slots[0]))) != NULL)) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
+	t.mask = sz - 1;
+	jobmgr_list_winners(root_jobmgr, prefix, prefix_len, &t);
 
-	jobmgr_t target_jm = jobmgr_find_by_name(j->mgr, NULL);
-	if (!jobmgr_assumes(j->mgr, target_jm != NULL)) {
-		jobmgr_log(j->mgr, LOG_ERR, "This API can only be used by a process running within an Aqua session.");
-		return 1;
+	// This covers the same jobs as VPROC_GSK_ALLJOBS, minus everything but the summary.
+	cnt = 0;
+	jobmgr_list_jobs(root_jobmgr, prefix, prefix_len, flags, &t, NULL, &cnt);
+	if (cnt) {
+		mig_allocate((vm_address_t *)&records, cnt * sizeof(records[0]));
+		if (!job_assumes(j, records != NULL)) {
+			free(t.slots);
+			return BOOTSTRAP_NO_MEMORY;
+		}
+
+		jobmgr_list_jobs(root_jobmgr, prefix, prefix_len, flags, &t, records, &filled);
+		(void)job_assumes(j, filled == cnt);
 	}
+	free(t.slots);
 
-	jr = jobmgr_import2(target_jm ?: j->mgr, jobdata);
+	*outdata = (vm_offset_t)records;
+	*outdataCnt = (mach_msg_type_number_t)(cnt * sizeof(records[0]));
 
-	launch_data_t label = NULL;
-	launch_data_t wait4debugger = NULL;
-	if (!jr) {
-		switch (errno) {
-		case EEXIST:
-			/* If EEXIST was returned, we know that there is a label string in
-			 * the dictionary. So we don't need to check the types here; that
-			 * has already been done.
-			 */
-			label = launch_data_dict_lookup(jobdata, LAUNCH_JOBKEY_LABEL);
-			jr = job_find(NULL, launch_data_get_string(label));
-			if (job_assumes(j, jr != NULL) && !jr->p) {
-				wait4debugger = launch_data_dict_lookup(jobdata, LAUNCH_JOBKEY_WAITFORDEBUGGER);
-				if (wait4debugger && launch_data_get_type(wait4debugger) == LAUNCH_DATA_BOOL) {
-					if (launch_data_get_bool(wait4debugger)) {
-						/* If the job exists, we're going to kick-start it, but
-						 * we need to give the caller the opportunity to start
-						 * it suspended if it so desires. But this will only
-						 * take effect if the job isn't running.
-						 */
-						jr->wait4debugger_oneshot = true;
-					}
-				}
-			}
+	return BOOTSTRAP_SUCCESS;
+}
 
-			*outj = jr;
-			return BOOTSTRAP_NAME_IN_USE;
-		default:
-			return BOOTSTRAP_NO_MEMORY;
-		}
-	}
+kern_return_t
+job_mig_set_jetsam_batch(job_t j, vm_offset_t inval, mach_msg_type_number_t invalCnt, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt)
+{
+	struct vproc_jetsam_update *updates = (struct vproc_jetsam_update *)inval;
+	xpc_jetsam_band_t entitled_band = -1;
+	int32_t entitled_limit = 0;
+	int32_t *results = NULL;
+	job_t *targets = NULL;
+	size_t i, cnt, applied = 0;
 
-	if (pid1_magic) {
-		jr->mach_uid = ldc->uid;
+	/* On failure, the request is destroyed by the MIG server along with the
+	 * out-of-line updates, so they are only deallocated on success.
+	 */
+	if (!j) {
+		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	// TODO: Consolidate the app and legacy_LS_job bits.
-	jr->legacy_LS_job = true;
-	jr->abandon_pg = true;
-	jr->asport = asport;
-	jr->app = true;
-	uuid_clear(jr->expected_audit_uuid);
-	jr = job_dispatch(jr, true);
+	cnt = invalCnt / sizeof(updates[0]);
+	if (invalCnt % sizeof(updates[0]) != 0 || cnt == 0 || cnt > VPROC_JETSAM_BATCH_MAX) {
+		return BOOTSTRAP_BAD_COUNT;
+	}
 
-	if (!job_assumes(j, jr != NULL)) {
-		job_remove(jr);
+	mig_allocate((vm_address_t *)&results, cnt * sizeof(results[0]));
+	if (!job_assumes(j, results != NULL)) {
 		return BOOTSTRAP_NO_MEMORY;
 	}
-
-	if (!job_assumes(jr, jr->p)) {
-		job_remove(jr);
+	if (!job_assumes(j, (targets = calloc(cnt, sizeof(targets[0]))) != NULL)) {
+		mig_deallocate((vm_address_t)results, cnt * sizeof(results[0]));
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	job_log(jr, LOG_DEBUG, "Spawned by PID %u: %s", j->p, j->label);
-	*outj = jr;
+	/* The entitlements belong to the caller, not to any one entry, so they
+	 * are only fetched once per batch.
+	 */
+	if (!j->embedded_god) {
+		entitled_band = xpc_get_jetsam_entitlement("com.apple.private.jetsam.modify-priority");
+		entitled_limit = (int32_t)xpc_get_jetsam_entitlement("com.apple.private.jetsam.memory_limit");
+	}
 
-	return BOOTSTRAP_SUCCESS;
-}
+	// Resolve and check every entry before touching the kernel.
+	for (i = 0; i < cnt; i++) {
+		struct vproc_jetsam_update *u = &updates[i];
+		bool setband = (u->flags & VPROC_JETSAM_SET_BAND);
+		bool setlimit = (u->flags & VPROC_JETSAM_SET_MEMLIMIT);
 
-kern_return_t
-job_mig_spawn2(job_t j, mach_port_t rp, vm_offset_t indata, mach_msg_type_number_t indataCnt, mach_port_t asport, pid_t *child_pid, mach_port_t *obsvr_port)
-{
-	job_t nj = NULL;
-	kern_return_t kr = job_mig_spawn_internal(j, indata, indataCnt, asport, &nj);
-	if (likely(kr == KERN_SUCCESS)) {
-		if (job_setup_exit_port(nj) != KERN_SUCCESS) {
-			job_remove(nj);
-			kr = BOOTSTRAP_NO_MEMORY;
-		} else {
-			/* Do not return until the job has called exec(3), thereby making it
-			 * safe for the caller to send it SIGCONT.
-			 *
-			 * <rdar://problem/9042798>
-			 */
-			nj->spawn_reply_port = rp;
-			kr = MIG_NO_REPLY;
+		results[i] = 0;
+
+		if (!(setband || setlimit) || strnlen(u->label, sizeof(u->label)) == sizeof(u->label)) {
+			results[i] = EINVAL;
+			continue;
+		}
+		if (setband && !(u->band >= XPC_JETSAM_BAND_SUSPENDED && u->band < XPC_JETSAM_BAND_LAST)) {
+			results[i] = EINVAL;
+			continue;
 		}
-	} else if (kr == BOOTSTRAP_NAME_IN_USE) {
-		bool was_running = nj->p;
-		if (job_dispatch(nj, true)) {
-			if (!was_running) {
-				job_log(nj, LOG_DEBUG, "Job exists but is not running. Kick-starting.");
 
-				if (job_setup_exit_port(nj) == KERN_SUCCESS) {
-					nj->spawn_reply_port = rp;
-					kr = MIG_NO_REPLY;
-				} else {
-					kr = BOOTSTRAP_NO_MEMORY;
-				}
-			} else {
-				*obsvr_port = MACH_PORT_NULL;
-				*child_pid = nj->p;
-				kr = KERN_SUCCESS;
-			}
-		} else {
-			job_log(nj, LOG_ERR, "Failed to dispatch job, requestor: %s", j->label);
-			kr = BOOTSTRAP_UNKNOWN_SERVICE;
+		if (u->label[0]) {
+			targets[i] = job_find(root_jobmgr, u->label);
+		} else if (u->pid > 0) {
+			targets[i] = jobmgr_find_by_pid_deep(root_jobmgr, u->pid, true);
+		}
+		if (!targets[i]) {
+			results[i] = ESRCH;
+			continue;
+		}
+
+		if (j->embedded_god || launchd_no_jetsam_perm_check) {
+			continue;
+		}
+		if ((setband && entitled_band < u->band) || (setlimit && entitled_limit < u->memlimit)) {
+			job_log(j, LOG_ERR, "Job cannot set Jetsam properties of %s (band requested/maximum: %d/%d, limit requested/maximum: %d/%d)",
+				targets[i]->label, u->band, entitled_band, u->memlimit, entitled_limit);
+			targets[i] = NULL;
+			results[i] = EPERM;
 		}
 	}
 
-	mig_deallocate(indata, indataCnt);
-	return kr;
+	for (i = 0; i < cnt; i++) {
+		if (!targets[i]) {
+			continue;
+		}
+		if (updates[i].flags & VPROC_JETSAM_SET_BAND) {
+			job_update_jetsam_properties(targets[i], updates[i].band, updates[i].rcdata);
+		}
+		if (updates[i].flags & VPROC_JETSAM_SET_MEMLIMIT) {
+			job_update_jetsam_memory_limit(targets[i], updates[i].memlimit);
+		}
+		applied++;
+	}
+
+	job_log(j, LOG_INFO, "Applied %zu of %zu Jetsam updates.", applied, cnt);
+
+	free(targets);
+
+	*outval = (vm_offset_t)results;
+	*outvalCnt = (mach_msg_type_number_t)(cnt * sizeof(results[0]));
+	mig_deallocate(inval, invalCnt);
+
+	return BOOTSTRAP_SUCCESS;
 }
 
 launch_data_t
@@ -11609,7 +16084,7 @@ job_do_legacy_ipc_request(job_t j, launch_data_t request, mach_port_t asport __a
 	if (launch_data_get_type(request) == LAUNCH_DATA_STRING) {
 		if (strcmp(launch_data_get_string(request), LAUNCH_KEY_CHECKIN) == 0) {
 			reply = job_export(j);
-			job_checkin(j);
+			job_checkin_sockets(j);
 		}
 	}
 
@@ -11662,26 +16137,47 @@ job_mig_legacy_ipc_request(job_t j, vm_offset_t request,
 		goto out_bad;
 	}
 
-	ldreply = job_do_legacy_ipc_request(j, ldrequest, asport);
-	if (!ldreply) {
-		ldreply = launch_data_new_errno(errno);
-		if (!ldreply) {
+	int out_fds[LAUNCHD_MAX_LEGACY_FDS];
+	size_t nout_fds = 0;
+	const void *checkin_data = NULL;
+	const int *checkin_fds = NULL;
+	size_t checkin_len = 0, checkin_fd_cnt = 0;
+
+	if (launch_data_get_type(ldrequest) == LAUNCH_DATA_STRING
+			&& strcmp(launch_data_get_string(ldrequest), LAUNCH_KEY_CHECKIN) == 0
+			&& job_get_checkin_reply(j, &checkin_data, &checkin_len, &checkin_fds, &checkin_fd_cnt)
+			&& checkin_fd_cnt <= LAUNCHD_MAX_LEGACY_FDS) {
+		// Fast path: copy out the cached reply rather than packing a new one.
+		*replyCnt = (mach_msg_type_number_t)checkin_len;
+		mig_allocate(reply, *replyCnt);
+		if (!*reply) {
 			goto out_bad;
 		}
-	}
 
-	*replyCnt = 10 * 1024 * 1024;
-	mig_allocate(reply, *replyCnt);
-	if (!*reply) {
-		goto out_bad;
-	}
+		memcpy((void *)*reply, checkin_data, checkin_len);
+		memcpy(out_fds, checkin_fds, checkin_fd_cnt * sizeof(int));
+		nout_fds = checkin_fd_cnt;
+		job_checkin_sockets(j);
+	} else {
+		ldreply = job_do_legacy_ipc_request(j, ldrequest, asport);
+		if (!ldreply) {
+			ldreply = launch_data_new_errno(errno);
+			if (!ldreply) {
+				goto out_bad;
+			}
+		}
 
-	int out_fds[LAUNCHD_MAX_LEGACY_FDS];
-	size_t nout_fds = 0;
-	size_t sz = launch_data_pack(ldreply, (void *)*reply, *replyCnt, out_fds, &nout_fds);
-	if (!sz) {
-		job_log(j, LOG_ERR, "Could not pack legacy IPC reply.");
-		goto out_bad;
+		*replyCnt = 10 * 1024 * 1024;
+		mig_allocate(reply, *replyCnt);
+		if (!*reply) {
+			goto out_bad;
+		}
+
+		size_t sz = launch_data_pack(ldreply, (void *)*reply, *replyCnt, out_fds, &nout_fds);
+		if (!sz) {
+			job_log(j, LOG_ERR, "Could not pack legacy IPC reply.");
+			goto out_bad;
+		}
 	}
 
 	if (nout_fds) {
@@ -11715,8 +16211,10 @@ job_mig_legacy_ipc_request(job_t j, vm_offset_t request,
 	}
 
 	mig_deallocate(request, requestCnt);
-	launch_data_free(ldreply);
-	ldreply = NULL;
+	if (ldreply) {
+		launch_data_free(ldreply);
+		ldreply = NULL;
+	}
 
 	// Unused for now.
 	(void)launchd_mport_deallocate(asport);
@@ -11804,6 +16302,19 @@ hash_ms(const char *msstr)
 	return our_strhash(msstr) % MACHSERVICE_HASH_SIZE;
 }
 
+size_t
+hash_session_name(const char *name)
+{
+	size_t c, r = 5381;
+
+	// djb2 again, but case-folded to match strcasecmp(3).
+	while ((c = (unsigned char)*name++)) {
+		r = ((r << 5) + r) + tolower((int)c);
+	}
+
+	return r % SESSION_NAME_HASH_SIZE;
+}
+
 bool
 waiting4removal_new(job_t j, mach_port_t rp)
 {
@@ -11830,6 +16341,106 @@ waiting4removal_delete(job_t j, struct waiting_for_removal *w4r)
 	free(w4r);
 }
 
+bool
+waiting4ready_new(job_t j, mach_port_t rp, uint32_t timeout)
+{
+	struct waiting_for_ready *w4r;
+
+	if (!job_assumes(j, (w4r = malloc(sizeof(struct waiting_for_ready))) != NULL)) {
+		return false;
+	}
+
+	w4r->reply_port = rp;
+	w4r->timeout = timeout;
+
+	if (timeout && job_assumes_zero_p(j, kevent_mod((uintptr_t)w4r, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, timeout, j)) == -1) {
+		free(w4r);
+		return false;
+	}
+
+	SLIST_INSERT_HEAD(&j->ready_watchers, w4r, sle);
+
+	return true;
+}
+
+struct waiting_for_ready *
+waiting4ready_find(job_t j, void *ident)
+{
+	struct waiting_for_ready *w4r;
+
+	SLIST_FOREACH(w4r, &j->ready_watchers, sle) {
+		if (w4r == ident) {
+			break;
+		}
+	}
+
+	return w4r;
+}
+
+void
+waiting4ready_delete(job_t j, struct waiting_for_ready *w4r, kern_return_t kr)
+{
+	if (w4r->timeout) {
+		(void)kevent_mod((uintptr_t)w4r, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	}
+
+	kern_return_t kr2 = job_mig_kickstart2_reply(w4r->reply_port, kr, j->p);
+	if (kr2 && kr2 != MACH_SEND_INVALID_DEST) {
+		(void)job_assumes_zero(j, kr2);
+	}
+
+	SLIST_REMOVE(&j->ready_watchers, w4r, waiting_for_ready, sle);
+
+	free(w4r);
+}
+
+/* A job is ready once the current instance has checked in every MachService
+ * it declared and, if it has Sockets, has fetched them. Per-PID services and
+ * XPC event channels are not declared up front, so they don't count.
+ */
+bool
+job_is_ready(job_t j)
+{
+	struct machservice *ms;
+
+	if (!j->p) {
+		return false;
+	}
+
+	SLIST_FOREACH(ms, &j->machservices, sle) {
+		if (!ms->per_pid && !ms->event_channel && !ms->isActive) {
+			return false;
+		}
+	}
+
+	return SLIST_EMPTY(&j->sockets) || j->checkedin_sockets;
+}
+
+void
+job_ready_check(job_t j)
+{
+	struct waiting_for_ready *w4r;
+
+	if (!job_is_ready(j)) {
+		return;
+	}
+	if (j->throttle && j->throttle->action == JOB_THROTTLE_START) {
+		job_throttle_release(j);
+	}
+	if (j->ready_latency && SLIST_EMPTY(&j->ready_watchers)) {
+		return;
+	}
+
+	if (!j->ready_latency) {
+		j->ready_latency = runtime_get_nanoseconds_since(j->start_time);
+		job_log(j, LOG_PERF, "Ready after %llu us.", j->ready_latency / NSEC_PER_USEC);
+	}
+
+	while ((w4r = SLIST_FIRST(&j->ready_watchers))) {
+		waiting4ready_delete(j, w4r, BOOTSTRAP_SUCCESS);
+	}
+}
+
 size_t
 get_kern_max_proc(void)
 {
@@ -51,10 +51,13 @@ bool job_is_anonymous(job_t j);
 launch_data_t job_export(job_t j);
 void job_stop(job_t j);
 void job_checkin(job_t j);
+void job_checkin_sockets(job_t j);
+bool job_get_checkin_reply(job_t j, const void **data, size_t *len, const int **fds, size_t *fd_cnt);
 void job_remove(job_t j);
 bool job_is_god(job_t j);
 job_t job_import(launch_data_t pload);
 launch_data_t job_import_bulk(launch_data_t pload);
+launch_data_t job_control_bulk(launch_data_t request);
 job_t job_mig_intran(mach_port_t mp);
 void job_mig_destructor(job_t j);
 void job_ack_no_senders(job_t j);
@@ -330,22 +330,40 @@ void
 ipc_readmsg(launch_data_t msg, void *context)
 {
 	struct readmsg_context rmc = { context, NULL };
+	const void *checkin_data;
+	const int *checkin_fds;
+	size_t checkin_len, checkin_fd_cnt;
+	int r;
 
-	if (LAUNCH_DATA_DICTIONARY == launch_data_get_type(msg)) {
-		launch_data_dict_iterate(msg, ipc_readmsg2, &rmc);
-	} else if (LAUNCH_DATA_STRING == launch_data_get_type(msg)) {
-		ipc_readmsg2(NULL, launch_data_get_string(msg), &rmc);
+	if (rmc.c->j && LAUNCH_DATA_STRING == launch_data_get_type(msg)
+			&& strcmp(launch_data_get_string(msg), LAUNCH_KEY_CHECKIN) == 0
+			&& job_get_checkin_reply(rmc.c->j, &checkin_data, &checkin_len, &checkin_fds, &checkin_fd_cnt)) {
+		/* Check-in is by far the most common request on the trusted socket,
+		 * and its reply never changes between runs of a job. So skip
+		 * job_export() and the packing and send the job's cached reply.
+		 */
+		job_checkin_sockets(rmc.c->j);
+		ipc_close_fds(msg);
+		r = launchd_msg_send_packed(rmc.c->conn, checkin_data, checkin_len, checkin_fds, checkin_fd_cnt);
 	} else {
-		rmc.resp = launch_data_new_errno(EINVAL);
-	}
+		if (LAUNCH_DATA_DICTIONARY == launch_data_get_type(msg)) {
+			launch_data_dict_iterate(msg, ipc_readmsg2, &rmc);
+		} else if (LAUNCH_DATA_STRING == launch_data_get_type(msg)) {
+			ipc_readmsg2(NULL, launch_data_get_string(msg), &rmc);
+		} else {
+			rmc.resp = launch_data_new_errno(EINVAL);
+		}
 
-	if (NULL == rmc.resp) {
-		rmc.resp = launch_data_new_errno(ENOSYS);
-	}
+		if (NULL == rmc.resp) {
+			rmc.resp = launch_data_new_errno(ENOSYS);
+		}
+
+		ipc_close_fds(msg);
 
-	ipc_close_fds(msg);
+		r = launchd_msg_send(rmc.c->conn, rmc.resp);
+	}
 
-	if (launchd_msg_send(rmc.c->conn, rmc.resp) == -1) {
+	if (r == -1) {
 		if (errno == EAGAIN) {
 			kevent_mod(launchd_getfd(rmc.c->conn), EVFILT_WRITE, EV_ADD, 0, 0, &rmc.c->kqconn_callback);
 		} else {
@@ -353,7 +371,9 @@ ipc_readmsg(launch_data_t msg, void *context)
 			ipc_close(rmc.c);
 		}
 	}
-	launch_data_free(rmc.resp);
+	if (rmc.resp) {
+		launch_data_free(rmc.resp);
+	}
 }
 
 void
@@ -379,7 +399,7 @@ ipc_readmsg2(launch_data_t data, const char *cmd, void *context)
 
 	if (rmc->c->j && strcmp(cmd, LAUNCH_KEY_CHECKIN) == 0) {
 		resp = job_export(rmc->c->j);
-		job_checkin(rmc->c->j);
+		job_checkin_sockets(rmc->c->j);
 	} else if (allow_privileged_ops) {
 #if TARGET_OS_EMBEDDED
 		launchd_embedded_handofgod = rmc->c->j && job_is_god(rmc->c->j);
@@ -420,6 +440,8 @@ ipc_readmsg2(launch_data_t data, const char *cmd, void *context)
 					job_remove(j);
 				}
 				resp = launch_data_new_errno(errno);
+			} else if (!strcmp(cmd, LAUNCH_KEY_BULKJOBCONTROL)) {
+				resp = job_control_bulk(data);
 			} else if (!strcmp(cmd, LAUNCH_KEY_SUBMITJOB)) {
 				if (launch_data_get_type(data) == LAUNCH_DATA_ARRAY) {
 					resp = job_import_bulk(data);
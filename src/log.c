@@ -13,6 +13,14 @@
 #define LAUNCHD_SHUTDOWN_LOG "launchd-shutdown.%s.log"
 #define LAUNCHD_LOWLEVEL_LOG "launchd-lowlevel.%s.log"
 
+/* Messages retained for subscribers are bounded by size. When the bound is
+ * hit, the oldest message is dropped and every subscriber that still wanted
+ * it has its drop counter bumped.
+ */
+#define LOGSUB_RETAIN_MAX (512 * 1024)
+#define LOGSUB_READ_MAX (64 * 1024)
+#define LOGSUB_MAX 16
+
 os_redirect_assumes(_launchd_os_redirect);
 
 char *launchd_username = "unknown";
@@ -29,6 +37,36 @@ static size_t _launchd_logq_sz;
 static size_t _launchd_logq_cnt;
 static int _launchd_log_up2 = LOG_UPTO(LOG_NOTICE);
 
+struct logsub_msg {
+	STAILQ_ENTRY(logsub_msg) sqe;
+	uint64_t seq;
+	uint32_t refs;
+	struct logmsg_s *lm;
+};
+
+struct logsub_s {
+	LIST_ENTRY(logsub_s) le;
+	uint64_t handle;
+	uint64_t cursor;
+	uint64_t dropped;
+	mach_port_t token;
+	mach_port_t reply_port;
+	int max_pri;
+	pid_t pid;
+	size_t prefix_len;
+	name_t prefix;
+	name_t session;
+};
+
+static LIST_HEAD(, logsub_s) _launchd_logsubs = LIST_HEAD_INITIALIZER(_launchd_logsubs);
+static STAILQ_HEAD(, logsub_msg) _launchd_logsub_q = STAILQ_HEAD_INITIALIZER(_launchd_logsub_q);
+static size_t _launchd_logsub_q_sz;
+static size_t _launchd_logsub_cnt;
+static uint64_t _launchd_logsub_next_seq = 1;
+static uint64_t _launchd_logsub_next_handle = 1;
+static int _launchd_logsub_max_pri = -1;
+static bool _launchd_logsub_dirty;
+
 static int64_t _launchd_shutdown_start;
 
 struct _launchd_open_log_ctx_s {
@@ -69,8 +107,8 @@ runtime_setlogmask(int maskpri)
 	return _launchd_log_up2;
 }
 
-static bool
-_logmsg_add(struct launchd_syslog_attr *attr, int err_num, const char *msg)
+static struct logmsg_s *
+_logmsg_new(struct launchd_syslog_attr *attr, int err_num, const char *msg)
 {
 	size_t lm_sz = sizeof(struct logmsg_s) + strlen(msg) + strlen(attr->from_name) + strlen(attr->about_name) + strlen(attr->session_name) + 4;
 	char *data_off;
@@ -80,7 +118,7 @@ _logmsg_add(struct launchd_syslog_attr *attr, int err_num, const char *msg)
 	lm_sz = ROUND_TO_64BIT_WORD_SIZE(lm_sz);
 
 	if (unlikely((lm = calloc(1, lm_sz)) == NULL)) {
-		return false;
+		return NULL;
 	}
 
 	data_off = lm->data;
@@ -100,11 +138,33 @@ _logmsg_add(struct launchd_syslog_attr *attr, int err_num, const char *msg)
 	lm->session_name = data_off;
 	data_off += sprintf(data_off, "%s", attr->session_name) + 1;
 
+	return lm;
+}
+
+static struct logmsg_s *
+_logmsg_copy(struct logmsg_s *lm)
+{
+	struct logmsg_s *lm2;
+
+	if (unlikely((lm2 = malloc(lm->obj_sz)) == NULL)) {
+		return NULL;
+	}
+
+	memcpy(lm2, lm, lm->obj_sz);
+	lm2->from_name = (char *)lm2 + (lm->from_name - (char *)lm);
+	lm2->about_name = (char *)lm2 + (lm->about_name - (char *)lm);
+	lm2->msg = (char *)lm2 + (lm->msg - (char *)lm);
+	lm2->session_name = (char *)lm2 + (lm->session_name - (char *)lm);
+
+	return lm2;
+}
+
+static void
+_logmsg_enqueue(struct logmsg_s *lm)
+{
 	STAILQ_INSERT_TAIL(&_launchd_logq, lm, sqe);
-	_launchd_logq_sz += lm_sz;
+	_launchd_logq_sz += lm->obj_sz;
 	_launchd_logq_cnt++;
-
-	return true;
 }
 
 static void
@@ -117,6 +177,254 @@ _logmsg_remove(struct logmsg_s *lm)
 	free(lm);
 }
 
+static bool
+_logsub_matches(struct logsub_s *ls, struct logmsg_s *lm)
+{
+	if (lm->pri > ls->max_pri) {
+		return false;
+	}
+	if (ls->pid && lm->about_pid != ls->pid) {
+		return false;
+	}
+	if (ls->prefix_len && strncmp(lm->about_name, ls->prefix, ls->prefix_len) != 0) {
+		return false;
+	}
+	if (ls->session[0] && strcmp(lm->session_name, ls->session) != 0) {
+		return false;
+	}
+
+	return true;
+}
+
+static void
+_logsub_recompute_max_pri(void)
+{
+	struct logsub_s *ls;
+
+	_launchd_logsub_max_pri = -1;
+	LIST_FOREACH(ls, &_launchd_logsubs, le) {
+		if (ls->max_pri > _launchd_logsub_max_pri) {
+			_launchd_logsub_max_pri = ls->max_pri;
+		}
+	}
+}
+
+static void
+_logsub_msg_free(struct logsub_msg *m)
+{
+	STAILQ_REMOVE(&_launchd_logsub_q, m, logsub_msg, sqe);
+	_launchd_logsub_q_sz -= m->lm->obj_sz;
+	free(m->lm);
+	free(m);
+}
+
+/* Messages are only reclaimed from the head so that the queue stays ordered by
+ * sequence number. A consumed message behind an unconsumed one waits for it.
+ */
+static void
+_logsub_collect(void)
+{
+	struct logsub_msg *m;
+
+	while ((m = STAILQ_FIRST(&_launchd_logsub_q)) && m->refs == 0) {
+		_logsub_msg_free(m);
+	}
+}
+
+static void
+_logsub_drop_oldest(void)
+{
+	struct logsub_msg *m = STAILQ_FIRST(&_launchd_logsub_q);
+	struct logsub_s *ls;
+
+	if (m->refs) {
+		LIST_FOREACH(ls, &_launchd_logsubs, le) {
+			if (ls->cursor <= m->seq && _logsub_matches(ls, m->lm)) {
+				ls->dropped++;
+			}
+		}
+	}
+
+	_logsub_msg_free(m);
+}
+
+static void
+_logsub_publish(struct logmsg_s *lm)
+{
+	struct logsub_msg *m;
+	struct logsub_s *ls;
+	uint32_t refs = 0;
+
+	LIST_FOREACH(ls, &_launchd_logsubs, le) {
+		if (_logsub_matches(ls, lm)) {
+			refs++;
+		}
+	}
+
+	if (refs == 0) {
+		return;
+	}
+
+	if (unlikely((m = calloc(1, sizeof(*m))) == NULL)) {
+		return;
+	}
+	if (unlikely((m->lm = _logmsg_copy(lm)) == NULL)) {
+		free(m);
+		return;
+	}
+
+	m->seq = _launchd_logsub_next_seq++;
+	m->refs = refs;
+	STAILQ_INSERT_TAIL(&_launchd_logsub_q, m, sqe);
+	_launchd_logsub_q_sz += lm->obj_sz;
+	_launchd_logsub_dirty = true;
+
+	while (_launchd_logsub_q_sz > LOGSUB_RETAIN_MAX) {
+		_logsub_drop_oldest();
+	}
+}
+
+/* Copies as many of the subscriber's pending messages as fit in one read and
+ * advances its cursor past them. Returns ENOENT if nothing is pending.
+ */
+static kern_return_t
+_logsub_pack(struct logsub_s *ls, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt)
+{
+	struct logsub_msg *m, *last = NULL;
+	struct logmsg_s *lm;
+	size_t sz = 0;
+	void *offset;
+
+	STAILQ_FOREACH(m, &_launchd_logsub_q, sqe) {
+		if (m->seq < ls->cursor || !_logsub_matches(ls, m->lm)) {
+			continue;
+		}
+		if (sz && sz + m->lm->obj_sz > LOGSUB_READ_MAX) {
+			break;
+		}
+		sz += m->lm->obj_sz;
+		last = m;
+	}
+
+	if (!last) {
+		return ENOENT;
+	}
+
+	mig_allocate(outval, sz);
+	if (unlikely(*outval == 0)) {
+		return 1;
+	}
+	*outvalCnt = sz;
+
+	offset = (void *)*outval;
+	STAILQ_FOREACH(m, &_launchd_logsub_q, sqe) {
+		if (m->seq < ls->cursor || !_logsub_matches(ls, m->lm)) {
+			continue;
+		}
+
+		/* The retained message is shared with other subscribers, so the
+		 * offsets are written into the copy rather than the original.
+		 */
+		lm = offset;
+		memcpy(lm, m->lm, m->lm->obj_sz);
+		lm->from_name_offset = m->lm->from_name - (char *)m->lm;
+		lm->about_name_offset = m->lm->about_name - (char *)m->lm;
+		lm->msg_offset = m->lm->msg - (char *)m->lm;
+		lm->session_name_offset = m->lm->session_name - (char *)m->lm;
+		offset += m->lm->obj_sz;
+
+		m->refs--;
+		if (m == last) {
+			break;
+		}
+	}
+
+	ls->cursor = last->seq + 1;
+	_logsub_collect();
+
+	return 0;
+}
+
+static void
+_logsub_reply(struct logsub_s *ls, kern_return_t kr, vm_offset_t outval, mach_msg_type_number_t outvalCnt)
+{
+	mach_port_t tmp_port = ls->reply_port;
+
+	ls->reply_port = MACH_PORT_NULL;
+
+	if (unlikely(errno = job_mig_log_read_reply(tmp_port, kr, outval, outvalCnt, ls->dropped))) {
+		if (errno != MACH_SEND_INVALID_DEST) {
+			(void)os_assumes_zero(errno);
+		}
+		(void)os_assumes_zero(launchd_mport_deallocate(tmp_port));
+	} else if (kr == 0) {
+		ls->dropped = 0;
+	}
+}
+
+static void
+_logsub_uncork_pending_reads(void)
+{
+	mach_msg_type_number_t outvalCnt;
+	vm_offset_t outval;
+	struct logsub_s *ls;
+
+	if (!_launchd_logsub_dirty) {
+		return;
+	}
+	_launchd_logsub_dirty = false;
+
+	LIST_FOREACH(ls, &_launchd_logsubs, le) {
+		if (!ls->reply_port) {
+			continue;
+		}
+		if (_logsub_pack(ls, &outval, &outvalCnt) != 0) {
+			continue;
+		}
+
+		_logsub_reply(ls, 0, outval, outvalCnt);
+		mig_deallocate(outval, outvalCnt);
+	}
+}
+
+static void
+_logsub_delete(struct logsub_s *ls)
+{
+	struct logsub_msg *m;
+
+	STAILQ_FOREACH(m, &_launchd_logsub_q, sqe) {
+		if (m->seq >= ls->cursor && _logsub_matches(ls, m->lm)) {
+			m->refs--;
+		}
+	}
+
+	if (ls->reply_port) {
+		_logsub_reply(ls, ECANCELED, 0, 0);
+	}
+	(void)os_assumes_zero(launchd_mport_deallocate(ls->token));
+
+	LIST_REMOVE(ls, le);
+	_launchd_logsub_cnt--;
+	free(ls);
+
+	_logsub_recompute_max_pri();
+	_logsub_collect();
+}
+
+static struct logsub_s *
+_logsub_find(uint64_t handle)
+{
+	struct logsub_s *ls;
+
+	LIST_FOREACH(ls, &_launchd_logsubs, le) {
+		if (ls->handle == handle) {
+			return ls;
+		}
+	}
+
+	return NULL;
+}
+
 bool
 _launchd_os_redirect(const char *message)
 {
@@ -234,8 +542,19 @@ launchd_vsyslog(struct launchd_syslog_attr *attr, const char *fmt, va_list args)
 		fprintf(log2here, "%-8lld %-32s %-8u %-24s %-8u  %s\n", delta, attr->from_name, attr->from_pid, attr->about_name, attr->about_pid, message);
 	}
 
-	if ((LOG_MASK(attr->priority) & _launchd_log_up2)) {
-		_logmsg_add(attr, saved_errno, message);
+	bool to_drain = (LOG_MASK(attr->priority) & _launchd_log_up2);
+	bool to_subs = (attr->priority <= _launchd_logsub_max_pri);
+	struct logmsg_s *lm;
+
+	if ((to_drain || to_subs) && (lm = _logmsg_new(attr, saved_errno, message))) {
+		if (to_subs) {
+			_logsub_publish(lm);
+		}
+		if (to_drain) {
+			_logmsg_enqueue(lm);
+		} else {
+			free(lm);
+		}
 	}
 }
 
@@ -326,6 +645,8 @@ launchd_log_push(void)
 	} else {
 		_launchd_log_uncork_pending_drain();
 	}
+
+	_logsub_uncork_pending_reads();
 }
 
 kern_return_t
@@ -361,9 +682,10 @@ launchd_log_forward(uid_t forward_uid, gid_t forward_gid, vm_offset_t inval, mac
 		lm->msg += (size_t)lm;
 		lm->session_name += (size_t)lm;
 
-		STAILQ_INSERT_TAIL(&_launchd_logq, lm, sqe);
-		_launchd_logq_sz += lm->obj_sz;
-		_launchd_logq_cnt++;
+		if (lm->pri <= _launchd_logsub_max_pri) {
+			_logsub_publish(lm);
+		}
+		_logmsg_enqueue(lm);
 
 		data_left -= lm->obj_sz;
 	}
@@ -388,6 +710,93 @@ launchd_log_drain(mach_port_t srp, vm_offset_t *outval, mach_msg_type_number_t *
 	return _launchd_log_pack(outval, outvalCnt);
 }
 
+kern_return_t
+launchd_log_subscribe(mach_port_t token, int max_pri, pid_t pid, const char *prefix, const char *session, uint64_t *handle)
+{
+	struct logsub_s *ls;
+
+	if (_launchd_logsub_cnt >= LOGSUB_MAX) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+	if (unlikely((ls = calloc(1, sizeof(*ls))) == NULL)) {
+		return BOOTSTRAP_NO_MEMORY;
+	}
+
+	ls->handle = _launchd_logsub_next_handle++;
+	ls->cursor = _launchd_logsub_next_seq;
+	ls->token = token;
+	ls->max_pri = max_pri;
+	ls->pid = pid;
+	(void)strlcpy(ls->prefix, prefix, sizeof(ls->prefix));
+	ls->prefix_len = strlen(ls->prefix);
+	(void)strlcpy(ls->session, session, sizeof(ls->session));
+
+	/* The subscription lives only as long as the subscriber holds the receive
+	 * right for its token.
+	 */
+	(void)os_assumes_zero(launchd_mport_notify_req(token, MACH_NOTIFY_DEAD_NAME));
+
+	LIST_INSERT_HEAD(&_launchd_logsubs, ls, le);
+	_launchd_logsub_cnt++;
+	_logsub_recompute_max_pri();
+
+	*handle = ls->handle;
+
+	return 0;
+}
+
+kern_return_t
+launchd_log_subscription_read(mach_port_t srp, uint64_t handle, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt, uint64_t *dropped)
+{
+	struct logsub_s *ls;
+	kern_return_t kr;
+
+	if (!(ls = _logsub_find(handle))) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
+	}
+	if (ls->reply_port) {
+		return EBUSY;
+	}
+
+	if ((kr = _logsub_pack(ls, outval, outvalCnt)) == ENOENT) {
+		ls->reply_port = srp;
+		return MIG_NO_REPLY;
+	}
+
+	*dropped = ls->dropped;
+	if (kr == 0) {
+		ls->dropped = 0;
+	}
+
+	return kr;
+}
+
+kern_return_t
+launchd_log_unsubscribe(uint64_t handle)
+{
+	struct logsub_s *ls;
+
+	if (!(ls = _logsub_find(handle))) {
+		return BOOTSTRAP_UNKNOWN_SERVICE;
+	}
+
+	_logsub_delete(ls);
+
+	return 0;
+}
+
+void
+launchd_log_port_died(mach_port_t name)
+{
+	struct logsub_s *ls, *ls_next;
+
+	LIST_FOREACH_SAFE(ls, &_launchd_logsubs, le, ls_next) {
+		if (ls->token == name) {
+			_logsub_delete(ls);
+		}
+	}
+}
+
 void
 launchd_closelog(void)
 {
@@ -68,4 +68,16 @@ launchd_log_forward(uid_t forward_uid, gid_t forward_gid, vm_offset_t inval, mac
 kern_return_t
 launchd_log_drain(mach_port_t srp, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt);
 
+kern_return_t
+launchd_log_subscribe(mach_port_t token, int max_pri, pid_t pid, const char *prefix, const char *session, uint64_t *handle);
+
+kern_return_t
+launchd_log_subscription_read(mach_port_t srp, uint64_t handle, vm_offset_t *outval, mach_msg_type_number_t *outvalCnt, uint64_t *dropped);
+
+kern_return_t
+launchd_log_unsubscribe(uint64_t handle);
+
+void
+launchd_log_port_died(mach_port_t name);
+
 #endif /* __LAUNCHD_LOG_H__ */
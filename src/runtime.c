@@ -91,15 +91,110 @@ static int bulk_kev_cnt;
 
 static pthread_t kqueue_demand_thread;
 
+/* While performance logging is on, a probe timer measures how late BSD events
+ * get dispatched. The probe's due time is a timestamp that both runtime modes
+ * share, so the delay covers the kernel wakeup plus, in the helper-thread mode,
+ * the hop through the internal port to the main thread.
+ */
+#define KQUEUE_PROBE_INTERVAL_MSEC 1000
+#define KQUEUE_LATENCY_SAMPLES 60
+static uint64_t kqueue_probe_armed;
+static struct {
+	uint64_t samples;
+	uint64_t total;
+	uint64_t max;
+} kqueue_latency;
+
+/* Requests are sorted into two lanes. Lookups, check-ins and everything else
+ * cheap are handled as they arrive. Administrative requests that can take a
+ * while are queued whenever other requests are waiting behind them, and run
+ * once the port set goes quiet or once they've been passed over for too long.
+ */
+enum {
+	RUNTIME_LANE_LOOKUP,
+	RUNTIME_LANE_ADMIN,
+	RUNTIME_LANE_COUNT,
+};
+
+struct runtime_deferred_request {
+	STAILQ_ENTRY(runtime_deferred_request) sqe;
+	uint64_t received;
+	// The registration the request arrived on, checked again before it runs.
+	mig_callback demux;
+	mach_port_t port;
+	uint32_t gen;
+	// The request followed by its trailer, exactly as received.
+	mach_msg_header_t request[0];
+};
+
+static struct runtime_lane {
+	const char *name;
+	uint64_t handled;
+	uint64_t depth;
+	uint64_t max_depth;
+	uint64_t total_wait;
+	uint64_t max_wait;
+	uint64_t total_service;
+	uint64_t max_service;
+} runtime_lanes[RUNTIME_LANE_COUNT] = {
+	[RUNTIME_LANE_LOOKUP] = { .name = "lookup" },
+	[RUNTIME_LANE_ADMIN] = { .name = "admin" },
+};
+
+#define RUNTIME_LANE_REPORT_INTERVAL 1000
+#define RUNTIME_ADMIN_STARVE_CNT 32
+#define RUNTIME_ADMIN_STARVE_NSEC (50 * NSEC_PER_MSEC)
+
+/* Administrative job routines. Their message IDs are looked up in the map MIG
+ * generates from job.defs, so reordering the routines can't go stale here.
+ */
+static const char *const runtime_admin_routine_names[] = {
+	"info",
+	"log_drain",
+	"lookup_tree",
+	"info_page",
+	"list_jobs",
+	"log_read",
+};
+static bool runtime_admin_routines[job_MSG_COUNT];
+static mach_msg_id_t runtime_swap_complex_id;
+
+static STAILQ_HEAD(, runtime_deferred_request) runtime_admin_queue = STAILQ_HEAD_INITIALIZER(runtime_admin_queue);
+static unsigned int runtime_admin_passed_over;
+// Watches ipc_port_set alone so we can ask whether anything is waiting.
+static int lanes_kq;
+
 static void mportset_callback(void);
 static kq_callback kqmportset_callback = (kq_callback)mportset_callback;
+static void ipcportset_callback(void *obj, struct kevent *kev);
+static kq_callback kqipcportset_callback = ipcportset_callback;
 static void *kqueue_demand_loop(void *arg);
+static void runtime_dispatch_kevents(struct kevent *kev, int cnt);
+static void kqueue_probe_arm(void);
+static void kqueue_probe_callback(void *obj, struct kevent *kev);
+static kq_callback kqkqueue_probe_callback = kqueue_probe_callback;
 
 boolean_t launchd_internal_demux(mach_msg_header_t *Request, mach_msg_header_t *Reply);
 static void launchd_runtime2(mach_msg_size_t msg_size);
+static void launchd_runtime_receive(mach_msg_size_t msg_size);
+static void launchd_runtime_unified(void) __attribute__((noreturn));
+static boolean_t launchd_mig_demux2(mach_msg_header_t *request, mach_msg_header_t *reply, int lane, uint64_t received);
+static int runtime_request_lane(mach_msg_header_t *request, mig_callback the_demux);
+static void runtime_lanes_init(void);
+static bool runtime_ipc_pending(void);
+static bool runtime_admin_defer(mach_msg_header_t *request, mach_msg_header_t *reply, uint64_t received, mig_callback the_demux);
+static bool runtime_admin_due(void);
+static void runtime_admin_run_one(void);
+static void runtime_admin_reply_error(mach_msg_header_t *request, kern_return_t kr);
+static void runtime_lane_account(int lane, uint64_t received, uint64_t started);
 static mach_msg_size_t max_msg_size;
 static mig_callback *mig_cb_table;
 static size_t mig_cb_table_sz;
+/* Bumped whenever a slot in mig_cb_table is registered or removed, so a
+ * deferred request can tell that its port went away (or that the name was
+ * reused) while it sat in the queue.
+ */
+static uint32_t *mig_cb_gen_table;
 static timeout_callback runtime_idle_callback;
 static mach_msg_timeout_t runtime_idle_timeout;
 static struct ldcred ldc;
@@ -129,6 +224,7 @@ bool launchd_log_shutdown = true;
 bool launchd_log_shutdown = false;
 #endif
 bool launchd_log_perf = false;
+bool launchd_unified_runtime = false;
 bool launchd_log_debug = false;
 bool launchd_trap_sigkill_bugs = false;
 bool launchd_no_jetsam_perm_check = false;
@@ -190,6 +286,12 @@ launchd_runtime_init(void)
 	os_assert_zero(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, &ipc_port_set));
 	posix_assert_zero(kevent_mod(demand_port_set, EVFILT_MACHPORT, EV_ADD, 0, 0, &kqmportset_callback));
 
+	struct kevent kev;
+	(void)posix_assert_zero((lanes_kq = kqueue()));
+	EV_SET(&kev, ipc_port_set, EVFILT_MACHPORT, EV_ADD, 0, 0, NULL);
+	posix_assert_zero(kevent(lanes_kq, &kev, 1, NULL, 0, NULL));
+	runtime_lanes_init();
+
 	os_assert_zero(launchd_mport_create_recv(&launchd_internal_port));
 	os_assert_zero(launchd_mport_make_send(launchd_internal_port));
 
@@ -199,8 +301,16 @@ launchd_runtime_init(void)
 	}
 
 	os_assert_zero(runtime_add_mport(launchd_internal_port, launchd_internal_demux));
-	os_assert_zero(pthread_create(&kqueue_demand_thread, NULL, kqueue_demand_loop, NULL));
-	os_assert_zero(pthread_detach(kqueue_demand_thread));
+	if (launchd_unified_runtime) {
+		/* The main thread waits on the kqueue itself and hears about pending
+		 * Mach messages through it, so there's no helper thread to hop
+		 * through.
+		 */
+		posix_assert_zero(kevent_mod(ipc_port_set, EVFILT_MACHPORT, EV_ADD, 0, 0, &kqipcportset_callback));
+	} else {
+		os_assert_zero(pthread_create(&kqueue_demand_thread, NULL, kqueue_demand_loop, NULL));
+		os_assert_zero(pthread_detach(kqueue_demand_thread));
+	}
 
 	(void)posix_assumes_zero(sysctlbyname("vfs.generic.noremotehang", NULL, NULL, &p, sizeof(p)));
 }
@@ -545,53 +655,112 @@ kern_return_t
 x_handle_kqueue(mach_port_t junk __attribute__((unused)), integer_t fd)
 {
 	struct timespec ts = { 0, 0 };
-	struct kevent *kevi, kev[BULK_KEV_MAX];
+	struct kevent kev[BULK_KEV_MAX];
+	int cnt;
+
+	if ((cnt = kevent(fd, NULL, 0, kev, BULK_KEV_MAX, &ts)) != -1) {
+		runtime_dispatch_kevents(kev, cnt);
+	} else {
+		(void)os_assumes_zero(errno);
+	}
+
+	return 0;
+}
+
+void
+kqueue_probe_arm(void)
+{
+	if (kevent_mod((uintptr_t)&kqueue_probe_armed, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_CRITICAL, KQUEUE_PROBE_INTERVAL_MSEC, &kqkqueue_probe_callback) != -1) {
+		kqueue_probe_armed = runtime_get_opaque_time();
+	} else {
+		(void)os_assumes_zero(errno);
+	}
+}
+
+void
+kqueue_probe_callback(void *obj __attribute__((unused)), struct kevent *kev __attribute__((unused)))
+{
+	uint64_t elapsed = runtime_get_nanoseconds_since(kqueue_probe_armed);
+	uint64_t td = elapsed > KQUEUE_PROBE_INTERVAL_MSEC * NSEC_PER_MSEC ? elapsed - KQUEUE_PROBE_INTERVAL_MSEC * NSEC_PER_MSEC : 0;
+
+	kqueue_probe_armed = 0;
+
+	kqueue_latency.total += td;
+	if (td > kqueue_latency.max) {
+		kqueue_latency.max = td;
+	}
+
+	if (++kqueue_latency.samples == KQUEUE_LATENCY_SAMPLES) {
+		launchd_syslog(LOG_PERF, "kqueue event due to dispatch (%s): average %llu us, worst %llu us over %u samples.",
+				launchd_unified_runtime ? "unified" : "helper thread",
+				kqueue_latency.total / KQUEUE_LATENCY_SAMPLES / NSEC_PER_USEC,
+				kqueue_latency.max / NSEC_PER_USEC, KQUEUE_LATENCY_SAMPLES);
+		memset(&kqueue_latency, 0, sizeof(kqueue_latency));
+	}
+}
+
+void
+runtime_dispatch_kevents(struct kevent *kev, int cnt)
+{
+	struct kevent *kevi;
 	int i;
 
 	bulk_kev = kev;
+	bulk_kev_cnt = cnt;
 
-	if ((bulk_kev_cnt = kevent(fd, NULL, 0, kev, BULK_KEV_MAX, &ts)) != -1) {
 #if 0	
-		for (i = 0; i < bulk_kev_cnt; i++) {
-			log_kevent_struct(LOG_DEBUG, &kev[0], i);
-		}
+	for (i = 0; i < bulk_kev_cnt; i++) {
+		log_kevent_struct(LOG_DEBUG, &kev[0], i);
+	}
 #endif
-		for (i = 0; i < bulk_kev_cnt; i++) {
-			bulk_kev_i = i;
-			kevi = &kev[i];
-
-			if (kevi->filter) {
-				launchd_syslog(LOG_DEBUG, "Dispatching kevent (ident/filter): %lu/%hd", kevi->ident, kevi->filter);
-				log_kevent_struct(LOG_DEBUG, kev, i);
-
-				struct job_check_s {
-					kq_callback kqc;
-				};
-
-				struct job_check_s *check = kevi->udata;
-				if (check && check->kqc) {
-					runtime_ktrace(RTKT_LAUNCHD_BSD_KEVENT|DBG_FUNC_START, kevi->ident, kevi->filter, kevi->fflags);
-					(*((kq_callback *)kevi->udata))(kevi->udata, kevi);
-					runtime_ktrace0(RTKT_LAUNCHD_BSD_KEVENT|DBG_FUNC_END);
-				} else {
-					launchd_syslog(LOG_ERR, "The following kevent had invalid context data. Please file a bug with the following information:");
-					log_kevent_struct(LOG_EMERG, &kev[0], i);
-				}
-				launchd_syslog(LOG_DEBUG, "Handled kevent.");
+	for (i = 0; i < bulk_kev_cnt; i++) {
+		bulk_kev_i = i;
+		kevi = &kev[i];
+
+		if (kevi->filter) {
+			launchd_syslog(LOG_DEBUG, "Dispatching kevent (ident/filter): %lu/%hd", kevi->ident, kevi->filter);
+			log_kevent_struct(LOG_DEBUG, kev, i);
+
+			struct job_check_s {
+				kq_callback kqc;
+			};
+
+			struct job_check_s *check = kevi->udata;
+			if (check && check->kqc) {
+				runtime_ktrace(RTKT_LAUNCHD_BSD_KEVENT|DBG_FUNC_START, kevi->ident, kevi->filter, kevi->fflags);
+				(*((kq_callback *)kevi->udata))(kevi->udata, kevi);
+				runtime_ktrace0(RTKT_LAUNCHD_BSD_KEVENT|DBG_FUNC_END);
+			} else {
+				launchd_syslog(LOG_ERR, "The following kevent had invalid context data. Please file a bug with the following information:");
+				log_kevent_struct(LOG_EMERG, &kev[0], i);
 			}
+			launchd_syslog(LOG_DEBUG, "Handled kevent.");
 		}
-	} else {
-		(void)os_assumes_zero(errno);
 	}
 
 	bulk_kev = NULL;
 
-	return 0;
+	if (launchd_log_perf && !kqueue_probe_armed) {
+		kqueue_probe_arm();
+	}
+}
+
+void
+ipcportset_callback(void *obj __attribute__((unused)), struct kevent *kev __attribute__((unused)))
+{
+	/* The port set stays readable until it's empty, so anything left over
+	 * comes back on the next trip through kevent().
+	 */
+	launchd_runtime_receive(max_msg_size);
 }
 
 void
 launchd_runtime(void)
 {
+	if (launchd_unified_runtime) {
+		launchd_runtime_unified();
+	}
+
 	launchd_runtime2(max_msg_size);
 	dispatch_main();
 }
@@ -695,21 +864,29 @@ runtime_add_mport(mach_port_t name, mig_callback demux)
 	if (unlikely(needed_table_sz > mig_cb_table_sz)) {
 		needed_table_sz *= 2; /* Let's try and avoid realloc'ing for a while */
 		mig_callback *new_table = malloc(needed_table_sz);
+		size_t new_cnt = needed_table_sz / sizeof(mig_callback);
+		uint32_t *new_gen_table = calloc(new_cnt, sizeof(uint32_t));
 
-		if (!new_table) {
+		if (!new_table || !new_gen_table) {
+			free(new_table);
+			free(new_gen_table);
 			return KERN_RESOURCE_SHORTAGE;
 		}
 
 		if (likely(mig_cb_table)) {
 			memcpy(new_table, mig_cb_table, mig_cb_table_sz);
+			memcpy(new_gen_table, mig_cb_gen_table, (mig_cb_table_sz / sizeof(mig_callback)) * sizeof(uint32_t));
 			free(mig_cb_table);
+			free(mig_cb_gen_table);
 		}
 
 		mig_cb_table_sz = needed_table_sz;
 		mig_cb_table = new_table;
+		mig_cb_gen_table = new_gen_table;
 	}
 
 	mig_cb_table[MACH_PORT_INDEX(name)] = demux;
+	mig_cb_gen_table[MACH_PORT_INDEX(name)]++;
 
 	return errno = mach_port_move_member(mach_task_self(), name, target_set);
 }
@@ -718,6 +895,7 @@ kern_return_t
 runtime_remove_mport(mach_port_t name)
 {
 	mig_cb_table[MACH_PORT_INDEX(name)] = NULL;
+	mig_cb_gen_table[MACH_PORT_INDEX(name)]++;
 
 	return errno = mach_port_move_member(mach_task_self(), name, MACH_PORT_NULL);
 }
@@ -904,6 +1082,8 @@ do_mach_notify_dead_name(mach_port_t notify __attribute__((unused)), mach_port_n
 		launchd_drain_reply_port = MACH_PORT_NULL;
 	}
 
+	launchd_log_port_died(name);
+
 	if (root_jobmgr) {
 		root_jobmgr = jobmgr_delete_anything_with_port(root_jobmgr, name);
 	}
@@ -988,8 +1168,251 @@ runtime_get_caller_token(void)
 	return &ldc_token;
 }
 
+void
+runtime_lanes_init(void)
+{
+	static const struct {
+		const char *name;
+		mach_msg_id_t id;
+	} job_routine_map[] = { subsystem_to_name_map_job };
+	size_t i, k;
+
+	for (i = 0; i < sizeof(job_routine_map) / sizeof(job_routine_map[0]); i++) {
+		mach_msg_id_t idx = job_routine_map[i].id - job_subsystem.start;
+		if (!os_assumes(idx >= 0 && idx < job_MSG_COUNT)) {
+			continue;
+		}
+
+		if (strcmp(job_routine_map[i].name, "swap_complex") == 0) {
+			runtime_swap_complex_id = job_routine_map[i].id;
+			continue;
+		}
+
+		for (k = 0; k < sizeof(runtime_admin_routine_names) / sizeof(runtime_admin_routine_names[0]); k++) {
+			if (strcmp(job_routine_map[i].name, runtime_admin_routine_names[k]) == 0) {
+				runtime_admin_routines[idx] = true;
+				break;
+			}
+		}
+	}
+}
+
+int
+runtime_request_lane(mach_msg_header_t *request, mig_callback the_demux)
+{
+	if (the_demux != job_server) {
+		return RUNTIME_LANE_LOOKUP;
+	}
+
+	/* legacy_ipc_request only serves launch_msg() check-ins, so it stays in
+	 * the lookup lane along with the other check-in routines.
+	 */
+	mach_msg_id_t idx = request->msgh_id - job_subsystem.start;
+	if (idx >= 0 && idx < job_MSG_COUNT && runtime_admin_routines[idx]) {
+		return RUNTIME_LANE_ADMIN;
+	}
+
+	if (request->msgh_id == runtime_swap_complex_id) {
+		__Request__swap_complex_t *req = (__Request__swap_complex_t *)request;
+		if (request->msgh_size >= sizeof(*req) && req->inkey == 0 && req->outkey == VPROC_GSK_ALLJOBS) {
+			return RUNTIME_LANE_ADMIN;
+		}
+	}
+
+	return RUNTIME_LANE_LOOKUP;
+}
+
+bool
+runtime_ipc_pending(void)
+{
+	struct timespec ts = { 0, 0 };
+	struct kevent kev;
+
+	return kevent(lanes_kq, NULL, 0, &kev, 1, &ts) > 0;
+}
+
+bool
+runtime_admin_defer(mach_msg_header_t *request, mach_msg_header_t *reply, uint64_t received, mig_callback the_demux)
+{
+	mach_msg_audit_trailer_t *tp = (mach_msg_audit_trailer_t *)((vm_offset_t)request + round_msg(request->msgh_size));
+	size_t sz = round_msg(request->msgh_size) + tp->msgh_trailer_size;
+	struct runtime_deferred_request *dr = malloc(sizeof(*dr) + sz);
+	if (!dr) {
+		return false;
+	}
+
+	// We now own every right and out-of-line region the request carries.
+	memcpy(dr->request, request, sz);
+	dr->received = received;
+	dr->demux = the_demux;
+	dr->port = request->msgh_local_port;
+	dr->gen = mig_cb_gen_table[MACH_PORT_INDEX(dr->port)];
+	STAILQ_INSERT_TAIL(&runtime_admin_queue, dr, sqe);
+
+	struct runtime_lane *lane = &runtime_lanes[RUNTIME_LANE_ADMIN];
+	if (++lane->depth > lane->max_depth) {
+		lane->max_depth = lane->depth;
+	}
+
+	mig_reply_error_t *rep = (mig_reply_error_t *)reply;
+	rep->Head.msgh_bits = MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(request->msgh_bits), 0);
+	rep->Head.msgh_remote_port = MACH_PORT_NULL;
+	rep->Head.msgh_local_port = MACH_PORT_NULL;
+	rep->Head.msgh_size = sizeof(*rep);
+	rep->Head.msgh_id = request->msgh_id + 100;
+	rep->NDR = NDR_record;
+	rep->RetCode = MIG_NO_REPLY;
+
+	launchd_syslog(LOG_DEBUG, "Queued administrative MIG request: %u", request->msgh_id);
+
+	return true;
+}
+
+bool
+runtime_admin_due(void)
+{
+	struct runtime_deferred_request *dr = STAILQ_FIRST(&runtime_admin_queue);
+
+	if (!dr) {
+		return false;
+	}
+	if (runtime_admin_passed_over >= RUNTIME_ADMIN_STARVE_CNT) {
+		return true;
+	}
+	if (runtime_opaque_time_to_nano(runtime_get_opaque_time() - dr->received) >= RUNTIME_ADMIN_STARVE_NSEC) {
+		return true;
+	}
+
+	return !runtime_ipc_pending();
+}
+
+void
+runtime_admin_run_one(void)
+{
+	struct runtime_deferred_request *dr = STAILQ_FIRST(&runtime_admin_queue);
+	mach_msg_header_t *request = dr->request;
+	mach_msg_return_t mr;
+
+	STAILQ_REMOVE_HEAD(&runtime_admin_queue, sqe);
+	runtime_lanes[RUNTIME_LANE_ADMIN].depth--;
+	runtime_admin_passed_over = 0;
+
+	size_t idx = MACH_PORT_INDEX(dr->port);
+	if (idx >= mig_cb_table_sz / sizeof(mig_callback) || mig_cb_table[idx] != dr->demux || mig_cb_gen_table[idx] != dr->gen) {
+		launchd_syslog(LOG_NOTICE, "Port went away before queued administrative MIG request ran: 0x%x: %u", dr->port, request->msgh_id);
+		runtime_admin_reply_error(request, MIG_SERVER_DIED);
+		free(dr);
+		return;
+	}
+
+	mig_reply_error_t *rep = calloc(1, max_msg_size);
+	if (!os_assumes(rep != NULL)) {
+		runtime_admin_reply_error(request, KERN_RESOURCE_SHORTAGE);
+		free(dr);
+		return;
+	}
+
+	(void)launchd_mig_demux2(request, &rep->Head, RUNTIME_LANE_ADMIN, dr->received);
+
+	// Same rules as mach_msg_server().
+	if (!(rep->Head.msgh_bits & MACH_MSGH_BITS_COMPLEX)) {
+		if (rep->RetCode == MIG_NO_REPLY) {
+			rep->Head.msgh_remote_port = MACH_PORT_NULL;
+		} else if (rep->RetCode != KERN_SUCCESS) {
+			// The reply port still gets the error; everything else goes.
+			request->msgh_remote_port = MACH_PORT_NULL;
+			mach_msg_destroy(request);
+		}
+	}
+
+	if (rep->Head.msgh_remote_port != MACH_PORT_NULL) {
+		mr = mach_msg(&rep->Head, MACH_SEND_MSG | MACH_SEND_TIMEOUT, rep->Head.msgh_size, 0, MACH_PORT_NULL, 0, MACH_PORT_NULL);
+		if (mr == MACH_SEND_INVALID_DEST || mr == MACH_SEND_TIMED_OUT) {
+			mach_msg_destroy(&rep->Head);
+		} else {
+			(void)os_assumes_zero(mr);
+		}
+	}
+
+	free(rep);
+	free(dr);
+}
+
+void
+runtime_admin_reply_error(mach_msg_header_t *request, kern_return_t kr)
+{
+	mig_reply_error_t rep;
+
+	rep.Head.msgh_bits = MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(request->msgh_bits), 0);
+	rep.Head.msgh_remote_port = request->msgh_remote_port;
+	rep.Head.msgh_local_port = MACH_PORT_NULL;
+	rep.Head.msgh_size = sizeof(rep);
+	rep.Head.msgh_id = request->msgh_id + 100;
+	rep.Head.msgh_reserved = 0;
+	rep.NDR = NDR_record;
+	rep.RetCode = kr;
+
+	// The reply port gets the error; every other right and region goes.
+	request->msgh_remote_port = MACH_PORT_NULL;
+	mach_msg_destroy(request);
+
+	if (rep.Head.msgh_remote_port != MACH_PORT_NULL) {
+		mach_msg_return_t mr = mach_msg(&rep.Head, MACH_SEND_MSG | MACH_SEND_TIMEOUT, rep.Head.msgh_size, 0, MACH_PORT_NULL, 0, MACH_PORT_NULL);
+		if (mr == MACH_SEND_INVALID_DEST || mr == MACH_SEND_TIMED_OUT) {
+			mach_msg_destroy(&rep.Head);
+		} else {
+			(void)os_assumes_zero(mr);
+		}
+	}
+}
+
+void
+runtime_lane_account(int lane_idx, uint64_t received, uint64_t started)
+{
+	struct runtime_lane *lane = &runtime_lanes[lane_idx];
+	uint64_t wait = runtime_opaque_time_to_nano(started - received);
+	uint64_t service = runtime_opaque_time_to_nano(runtime_get_opaque_time() - started);
+
+	lane->total_wait += wait;
+	if (wait > lane->max_wait) {
+		lane->max_wait = wait;
+	}
+	lane->total_service += service;
+	if (service > lane->max_service) {
+		lane->max_service = service;
+	}
+
+	if (++lane->handled == RUNTIME_LANE_REPORT_INTERVAL) {
+		launchd_syslog(LOG_PERF, "%s lane: %u requests, queue depth max %llu, wait average %llu us worst %llu us, service average %llu us worst %llu us.",
+				lane->name, RUNTIME_LANE_REPORT_INTERVAL, lane->max_depth,
+				lane->total_wait / RUNTIME_LANE_REPORT_INTERVAL / NSEC_PER_USEC, lane->max_wait / NSEC_PER_USEC,
+				lane->total_service / RUNTIME_LANE_REPORT_INTERVAL / NSEC_PER_USEC, lane->max_service / NSEC_PER_USEC);
+
+		lane->handled = 0;
+		lane->max_depth = lane->depth;
+		lane->total_wait = lane->max_wait = 0;
+		lane->total_service = lane->max_service = 0;
+	}
+}
+
 static boolean_t
 launchd_mig_demux(mach_msg_header_t *request, mach_msg_header_t *reply)
+{
+	uint64_t received = runtime_get_opaque_time();
+	mig_callback the_demux = mig_cb_table[MACH_PORT_INDEX(request->msgh_local_port)];
+	int lane = runtime_request_lane(request, the_demux);
+
+	if (lane == RUNTIME_LANE_ADMIN && (!STAILQ_EMPTY(&runtime_admin_queue) || runtime_ipc_pending())) {
+		if (runtime_admin_defer(request, reply, received, the_demux)) {
+			return true;
+		}
+	}
+
+	return launchd_mig_demux2(request, reply, lane, received);
+}
+
+boolean_t
+launchd_mig_demux2(mach_msg_header_t *request, mach_msg_header_t *reply, int lane, uint64_t received)
 {
 	boolean_t result = false;
 
@@ -999,7 +1422,9 @@ launchd_mig_demux(mach_msg_header_t *request, mach_msg_header_t *reply)
 	mach_msg_audit_trailer_t *tp = (mach_msg_audit_trailer_t *)((vm_offset_t)request + round_msg(request->msgh_size));
 	runtime_record_caller_creds(&tp->msgh_audit);
 
-	result = the_demux(request, reply);
+	if (likely(the_demux)) {
+		result = the_demux(request, reply);
+	}
 	if (!result) {
 		launchd_syslog(LOG_DEBUG, "Demux failed. Trying other subsystems...");
 		if (request->msgh_id == MACH_NOTIFY_NO_SENDERS) {
@@ -1015,6 +1440,8 @@ launchd_mig_demux(mach_msg_header_t *request, mach_msg_header_t *reply)
 		launchd_syslog(LOG_DEBUG, "MIG demux succeeded.");
 	}
 
+	runtime_lane_account(lane, received, time_of_mach_msg_return);
+
 	return result;
 }
 
@@ -1024,46 +1451,88 @@ launchd_runtime2(mach_msg_size_t msg_size)
 	for (;;) {
 		launchd_log_push();
 
-		mach_port_t recvp = MACH_PORT_NULL;
-		xpc_object_t request = NULL;
-		int result = xpc_pipe_try_receive(ipc_port_set, &request, &recvp, launchd_mig_demux, msg_size, 0);
-		if (result == 0 && request) {
-			boolean_t handled = false;
-			time_of_mach_msg_return = runtime_get_opaque_time();
-			launchd_syslog(LOG_DEBUG, "XPC request.");
-
-			xpc_object_t reply = NULL;
-			if (xpc_event_demux(recvp, request, &reply)) {
-				handled = true;
-			} else if (xpc_process_demux(recvp, request, &reply)) {
-				handled = true;
-			}
+		if (runtime_admin_due()) {
+			runtime_admin_run_one();
+			continue;
+		} else if (!STAILQ_EMPTY(&runtime_admin_queue)) {
+			runtime_admin_passed_over++;
+		}
 
-			if (!handled) {
-				launchd_syslog(LOG_DEBUG, "XPC routine could not be handled.");
-				xpc_release(request);
-				continue;
-			}
+		launchd_runtime_receive(msg_size);
+	}
+}
 
-			launchd_syslog(LOG_DEBUG, "XPC routine was handled.");
-			if (reply) {
-				launchd_syslog(LOG_DEBUG, "Sending reply.");
-				result = xpc_pipe_routine_reply(reply);
-				if (result == 0) {
-					launchd_syslog(LOG_DEBUG, "Reply sent successfully.");
-				} else if (result != EPIPE) {
-					launchd_syslog(LOG_ERR, "Failed to send reply message: 0x%x", result);
-				}
+void
+launchd_runtime_unified(void)
+{
+	struct timespec ts = { 0, 0 };
+	struct kevent kev[BULK_KEV_MAX];
+
+	for (;;) {
+		launchd_log_push();
+
+		if (runtime_admin_due()) {
+			runtime_admin_run_one();
+		} else if (!STAILQ_EMPTY(&runtime_admin_queue)) {
+			runtime_admin_passed_over++;
+		}
 
-				xpc_release(reply);
+		// Don't sleep while administrative requests are still queued.
+		int cnt = kevent(mainkq, NULL, 0, kev, BULK_KEV_MAX, STAILQ_EMPTY(&runtime_admin_queue) ? NULL : &ts);
+		if (cnt == -1) {
+			if (errno != EINTR) {
+				(void)os_assumes_zero(errno);
 			}
+			continue;
+		}
+
+		time_of_mach_msg_return = runtime_get_opaque_time();
+		runtime_dispatch_kevents(kev, cnt);
+	}
+}
 
+void
+launchd_runtime_receive(mach_msg_size_t msg_size)
+{
+	mach_port_t recvp = MACH_PORT_NULL;
+	xpc_object_t request = NULL;
+	int result = xpc_pipe_try_receive(ipc_port_set, &request, &recvp, launchd_mig_demux, msg_size, 0);
+	if (result == 0 && request) {
+		boolean_t handled = false;
+		time_of_mach_msg_return = runtime_get_opaque_time();
+		launchd_syslog(LOG_DEBUG, "XPC request.");
+
+		xpc_object_t reply = NULL;
+		if (xpc_event_demux(recvp, request, &reply)) {
+			handled = true;
+		} else if (xpc_process_demux(recvp, request, &reply)) {
+			handled = true;
+		}
+
+		if (!handled) {
+			launchd_syslog(LOG_DEBUG, "XPC routine could not be handled.");
 			xpc_release(request);
-		} else if (result == 0) {
-			launchd_syslog(LOG_DEBUG, "MIG request.");
-		} else if (result == EINVAL) {
-			launchd_syslog(LOG_ERR, "Rejected invalid request message.");
+			return;
 		}
+
+		launchd_syslog(LOG_DEBUG, "XPC routine was handled.");
+		if (reply) {
+			launchd_syslog(LOG_DEBUG, "Sending reply.");
+			result = xpc_pipe_routine_reply(reply);
+			if (result == 0) {
+				launchd_syslog(LOG_DEBUG, "Reply sent successfully.");
+			} else if (result != EPIPE) {
+				launchd_syslog(LOG_ERR, "Failed to send reply message: 0x%x", result);
+			}
+
+			xpc_release(reply);
+		}
+
+		xpc_release(request);
+	} else if (result == 0) {
+		launchd_syslog(LOG_DEBUG, "MIG request.");
+	} else if (result == EINVAL) {
+		launchd_syslog(LOG_ERR, "Rejected invalid request message.");
 	}
 }
 
@@ -1408,6 +1877,10 @@ do_file_init(void)
 		launchd_log_perf = true;
 	}
 
+	if (config_check(".launchd_unified_runtime", sb)) {
+		launchd_unified_runtime = true;
+	}
+
 	if (config_check("/etc/rc.cdrom", sb)) {
 		launchd_osinstaller = true;
 	}
@@ -59,6 +59,7 @@ extern bool launchd_malloc_log_stacks;
 extern bool launchd_log_shutdown;
 extern bool launchd_log_debug;
 extern bool launchd_log_perf;
+extern bool launchd_unified_runtime;
 extern bool launchd_trap_sigkill_bugs;
 extern bool launchd_no_jetsam_perm_check;
 extern bool launchd_osinstaller;
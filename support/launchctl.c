@@ -152,7 +152,9 @@ static int demux_cmd(int argc, char *const argv[]);
 static void submit_job_pass(launch_data_t jobs);
 static void do_mgroup_join(int fd, int family, int socktype, int protocol, const char *mgroup);
 static mach_port_t str2bsport(const char *s);
+static void print_job_summary(pid_t pid, int wstatus, const char *label);
 static void print_jobs(launch_data_t j, const char *key, void *context);
+static bool print_job_records(void);
 static void print_obj(launch_data_t obj, const char *key, void *context);
 static bool str2lim(const char *buf, rlim_t *res);
 static const char *lim2str(rlim_t val, char *buf);
@@ -201,6 +203,7 @@ static int load_and_unload_cmd(int argc, char *const argv[]);
 static int start_stop_remove_cmd(int argc, char *const argv[]);
 static int submit_cmd(int argc, char *const argv[]);
 static int list_cmd(int argc, char *const argv[]);
+static int history_cmd(int argc, char *const argv[]);
 
 static int setenv_cmd(int argc, char *const argv[]);
 static int unsetenv_cmd(int argc, char *const argv[]);
@@ -217,6 +220,9 @@ static int bsexec_cmd(int argc, char *const argv[]);
 static int _bslist_cmd(mach_port_t bport, unsigned int depth, bool show_job, bool local_only);
 static int bslist_cmd(int argc, char *const argv[]);
 static int _bstree_cmd(mach_port_t bsport, unsigned int depth, bool show_jobs);
+static const char *bsprops2type(bootstrap_property_t props);
+static int _bstree_snapshot_cmd(mach_port_t bsport, unsigned int depth, bool show_jobs);
+static void _bstree_print_node(launch_data_t node, mach_port_array_t ports, mach_msg_type_number_t port_cnt, unsigned int depth, bool show_jobs);
 static int bstree_cmd(int argc __attribute__((unused)), char * const argv[] __attribute__((unused)));
 static int managerpid_cmd(int argc __attribute__((unused)), char * const argv[] __attribute__((unused)));
 static int manageruid_cmd(int argc __attribute__((unused)), char * const argv[] __attribute__((unused)));
@@ -233,12 +239,13 @@ static const struct {
 	{ "load",			load_and_unload_cmd,	"Load configuration files and/or directories" },
 	{ "unload",			load_and_unload_cmd,	"Unload configuration files and/or directories" },
 //	{ "reload",			reload_cmd,				"Reload configuration files and/or directories" },
-	{ "start",			start_stop_remove_cmd,	"Start specified job" },
-	{ "stop",			start_stop_remove_cmd,	"Stop specified job" },
+	{ "start",			start_stop_remove_cmd,	"Start specified jobs" },
+	{ "stop",			start_stop_remove_cmd,	"Stop specified jobs" },
 	{ "submit",			submit_cmd,				"Submit a job from the command line" },
-	{ "remove",			start_stop_remove_cmd,	"Remove specified job" },
+	{ "remove",			start_stop_remove_cmd,	"Remove specified jobs" },
 	{ "bootstrap",		bootstrap_cmd,			"Bootstrap launchd" },
 	{ "list",			list_cmd,				"List jobs and information about jobs" },
+	{ "history",		history_cmd,			"Show recent state transitions of the specified job" },
 	{ "setenv",			setenv_cmd,				"Set an environmental variable in launchd" },
 	{ "unsetenv",		unsetenv_cmd,			"Unset an environmental variable in launchd" },
 	{ "getenv",			getenv_and_export_cmd,	"Get an environmental variable from launchd" },
@@ -2854,12 +2861,114 @@ submit_job_pass(launch_data_t jobs)
 	launch_data_free(msg);
 }
 
+struct bulk_result_ctx {
+	const char *verb;
+	size_t done;
+	int r;
+};
+
+static void
+bulk_result_check(launch_data_t obj, const char *label, void *context)
+{
+	struct bulk_result_ctx *ctx = context;
+	int e;
+
+	if (launch_data_get_type(obj) != LAUNCH_DATA_ERRNO) {
+		return;
+	}
+
+	// Queued behind the limit. launchd acts on it as earlier jobs finish.
+	if ((e = launch_data_get_errno(obj)) == EINPROGRESS) {
+		ctx->done++;
+	} else if (e) {
+		launchctl_log(LOG_ERR, "%s %s %s error: %s", getprogname(), ctx->verb, label, strerror(e));
+		ctx->r = 1;
+	} else {
+		ctx->done++;
+	}
+}
+
+static int
+start_stop_remove_bulk(const char *lmsgcmd, const char *verb, const char *pattern, const char *order, long long limit, long long grace, int argc, char *const argv[])
+{
+	launch_data_t resp, msg, req, labels;
+	int i, e, r = 0;
+
+	msg = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	req = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	launch_data_dict_insert(req, launch_data_new_string(lmsgcmd), LAUNCH_BULKJOBCONTROL_ACTION);
+
+	if (argc) {
+		labels = launch_data_alloc(LAUNCH_DATA_ARRAY);
+		for (i = 0; i < argc; i++) {
+			launch_data_array_set_index(labels, launch_data_new_string(argv[i]), i);
+		}
+		launch_data_dict_insert(req, labels, LAUNCH_BULKJOBCONTROL_LABELS);
+	}
+	if (pattern) {
+		launch_data_dict_insert(req, launch_data_new_string(pattern), LAUNCH_BULKJOBCONTROL_PATTERN);
+	}
+	if (order) {
+		launch_data_dict_insert(req, launch_data_new_string(order), LAUNCH_BULKJOBCONTROL_ORDER);
+	}
+	if (limit) {
+		launch_data_dict_insert(req, launch_data_new_integer(limit), LAUNCH_BULKJOBCONTROL_LIMIT);
+	}
+	if (grace) {
+		launch_data_dict_insert(req, launch_data_new_integer(grace), LAUNCH_BULKJOBCONTROL_GRACEPERIOD);
+	}
+	launch_data_dict_insert(msg, req, LAUNCH_KEY_BULKJOBCONTROL);
+
+	resp = launch_msg(msg);
+	launch_data_free(msg);
+
+	if (resp == NULL) {
+		launchctl_log(LOG_ERR, "launch_msg(): %s", strerror(errno));
+		return 1;
+	}
+
+	if (launch_data_get_type(resp) == LAUNCH_DATA_DICTIONARY) {
+		struct bulk_result_ctx ctx = { verb, 0, 0 };
+		launch_data_t obj;
+
+		// Report the labels we named in the order we named them.
+		for (i = 0; i < argc; i++) {
+			if ((obj = launch_data_dict_lookup(resp, argv[i]))) {
+				bulk_result_check(obj, argv[i], &ctx);
+				launch_data_dict_remove(resp, argv[i]);
+			}
+		}
+		launch_data_dict_iterate(resp, bulk_result_check, &ctx);
+
+		r = ctx.r;
+		if (ctx.done == 0 && r == 0) {
+			launchctl_log(LOG_ERR, "%s %s: No matching jobs", getprogname(), verb);
+			r = 1;
+		}
+	} else if (launch_data_get_type(resp) == LAUNCH_DATA_ERRNO) {
+		if ((e = launch_data_get_errno(resp))) {
+			launchctl_log(LOG_ERR, "%s %s error: %s", getprogname(), verb, strerror(e));
+			r = 1;
+		}
+	} else {
+		launchctl_log(LOG_ERR, "%s %s returned unknown response", getprogname(), verb);
+		r = 1;
+	}
+
+	launch_data_free(resp);
+	return r;
+}
+
 int
 start_stop_remove_cmd(int argc, char *const argv[])
 {
 	launch_data_t resp, msg;
 	const char *lmsgcmd = LAUNCH_KEY_STOPJOB;
-	int e, r = 0;
+	const char *verb = argv[0];
+	const char *pattern = NULL, *order = NULL;
+	long long limit = 0, grace = 0;
+	bool badopts = false;
+	int ch, e, r = 0;
 
 	if (0 == strcmp(argv[0], "start"))
 		lmsgcmd = LAUNCH_KEY_STARTJOB;
@@ -2867,13 +2976,49 @@ start_stop_remove_cmd(int argc, char *const argv[])
 	if (0 == strcmp(argv[0], "remove"))
 		lmsgcmd = LAUNCH_KEY_REMOVEJOB;
 
-	if (argc != 2) {
-		launchctl_log(LOG_ERR, "usage: %s %s <job label>", getprogname(), argv[0]);
+	while ((ch = getopt(argc, argv, "p:o:n:g:")) != -1) {
+		switch (ch) {
+		case 'p':
+			pattern = optarg;
+			break;
+		case 'o':
+			if (strcasecmp(optarg, "label") == 0) {
+				order = LAUNCH_BULKJOBCONTROL_ORDER_LABEL;
+			} else if (strcasecmp(optarg, "reverse") == 0) {
+				order = LAUNCH_BULKJOBCONTROL_ORDER_REVERSE;
+			} else {
+				badopts = true;
+			}
+			break;
+		case 'n':
+			limit = strtoll(optarg, NULL, 0);
+			badopts |= (limit <= 0);
+			break;
+		case 'g':
+			grace = strtoll(optarg, NULL, 0);
+			badopts |= (grace <= 0 || grace > UINT32_MAX || lmsgcmd == LAUNCH_KEY_STARTJOB);
+			break;
+		case '?':
+		default:
+			badopts = true;
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (badopts || (argc == 0 && !pattern)) {
+		launchctl_log(LOG_ERR, "usage: %s %s [-p <glob>] [-o <label|reverse>] [-n <limit>]%s [<job label> ...]", getprogname(), verb, lmsgcmd == LAUNCH_KEY_STARTJOB ? "" : " [-g <seconds>]");
 		return 1;
 	}
 
+	// One label and nothing else is what every launchd understands.
+	if (argc != 1 || pattern || order || limit || grace) {
+		return start_stop_remove_bulk(lmsgcmd, verb, pattern, order, limit, grace, argc, argv);
+	}
+
 	msg = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
-	launch_data_dict_insert(msg, launch_data_new_string(argv[1]), lmsgcmd);
+	launch_data_dict_insert(msg, launch_data_new_string(argv[0]), lmsgcmd);
 
 	resp = launch_msg(msg);
 	launch_data_free(msg);
@@ -2883,11 +3028,11 @@ start_stop_remove_cmd(int argc, char *const argv[])
 		return 1;
 	} else if (launch_data_get_type(resp) == LAUNCH_DATA_ERRNO) {
 		if ((e = launch_data_get_errno(resp))) {
-			launchctl_log(LOG_ERR, "%s %s error: %s", getprogname(), argv[0], strerror(e));
+			launchctl_log(LOG_ERR, "%s %s error: %s", getprogname(), verb, strerror(e));
 			r = 1;
 		}
 	} else {
-		launchctl_log(LOG_ERR, "%s %s returned unknown response", getprogname(), argv[0]);
+		launchctl_log(LOG_ERR, "%s %s returned unknown response", getprogname(), verb);
 		r = 1;
 	}
 
@@ -2895,6 +3040,20 @@ start_stop_remove_cmd(int argc, char *const argv[])
 	return r;
 }
 
+void
+print_job_summary(pid_t pid, int wstatus, const char *label)
+{
+	if (pid) {
+		fprintf(stdout, "%d\t-\t%s\n", pid, label);
+	} else if (WIFEXITED(wstatus)) {
+		fprintf(stdout, "-\t%d\t%s\n", WEXITSTATUS(wstatus), label);
+	} else if (WIFSIGNALED(wstatus)) {
+		fprintf(stdout, "-\t-%d\t%s\n", WTERMSIG(wstatus), label);
+	} else {
+		fprintf(stdout, "-\t???\t%s\n", label);
+	}
+}
+
 void
 print_jobs(launch_data_t j, const char *key __attribute__((unused)), void *context __attribute__((unused)))
 {
@@ -2906,16 +3065,9 @@ print_jobs(launch_data_t j, const char *key __attribute__((unused)), void *conte
 	size_t i;
 
 	if (pido) {
-		fprintf(stdout, "%lld\t-\t%s\n", launch_data_get_integer(pido), label);
+		print_job_summary((pid_t)launch_data_get_integer(pido), 0, label);
 	} else if (stato) {
-		int wstatus = (int)launch_data_get_integer(stato);
-		if (WIFEXITED(wstatus)) {
-			fprintf(stdout, "-\t%d\t%s\n", WEXITSTATUS(wstatus), label);
-		} else if (WIFSIGNALED(wstatus)) {
-			fprintf(stdout, "-\t-%d\t%s\n", WTERMSIG(wstatus), label);
-		} else {
-			fprintf(stdout, "-\t???\t%s\n", label);
-		}
+		print_job_summary(0, (int)launch_data_get_integer(stato), label);
 	} else {
 		fprintf(stdout, "-\t-\t%s\n", label);
 	}
@@ -2924,6 +3076,42 @@ print_jobs(launch_data_t j, const char *key __attribute__((unused)), void *conte
 	}
 }
 
+/* The summary records carry only what print_jobs() needs, so `launchctl list`
+ * no longer makes launchd export every job in full. A label too long for a
+ * record means we have to ask for the full export after all.
+ */
+bool
+print_job_records(void)
+{
+	struct vproc_list_record *records = NULL;
+	mach_msg_type_number_t i, cnt = 0;
+	bool truncated = false;
+
+	if (_vproc_list_jobs(bootstrap_port, NULL, 0, &records, &cnt) != 0) {
+		return false;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (records[i].flags & VPROC_LIST_LABEL_TRUNCATED) {
+			truncated = true;
+			break;
+		}
+	}
+
+	if (!truncated) {
+		fprintf(stdout, "PID\tStatus\tLabel\n");
+		for (i = 0; i < cnt; i++) {
+			print_job_summary(records[i].pid, records[i].last_status, records[i].label);
+		}
+	}
+
+	if (records) {
+		mig_deallocate((vm_address_t)records, cnt * sizeof(records[0]));
+	}
+
+	return !truncated;
+}
+
 void
 print_obj(launch_data_t obj, const char *key, void *context __attribute__((unused)))
 {
@@ -3051,6 +3239,8 @@ list_cmd(int argc, char *const argv[])
 			r = 1;
 			launch_data_free(resp);
 		}
+	} else if (print_job_records()) {
+		r = 0;
 	} else if (vproc_swap_complex(NULL, VPROC_GSK_ALLJOBS, NULL, &resp) == NULL) {
 		fprintf(stdout, "PID\tStatus\tLabel\n");
 		launch_data_dict_iterate(resp, print_jobs, NULL);
@@ -3062,6 +3252,82 @@ list_cmd(int argc, char *const argv[])
 	return r;
 }
 
+int
+history_cmd(int argc, char *const argv[])
+{
+	launch_data_t resp, msg, history, entry, tmp;
+	size_t i, c;
+
+	if (argc != 2) {
+		launchctl_log(LOG_ERR, "usage: %s %s <label>", getprogname(), argv[0]);
+		return 1;
+	}
+
+	msg = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	launch_data_dict_insert(msg, launch_data_new_string(argv[1]), LAUNCH_KEY_GETJOB);
+
+	resp = launch_msg(msg);
+	launch_data_free(msg);
+
+	if (resp == NULL) {
+		launchctl_log(LOG_ERR, "launch_msg(): %s", strerror(errno));
+		return 1;
+	} else if (launch_data_get_type(resp) == LAUNCH_DATA_ERRNO) {
+		launchctl_log(LOG_ERR, "%s %s error: %s", getprogname(), argv[0], strerror(launch_data_get_errno(resp)));
+		launch_data_free(resp);
+		return 1;
+	} else if (launch_data_get_type(resp) != LAUNCH_DATA_DICTIONARY) {
+		launchctl_log(LOG_ERR, "%s %s returned unknown response", getprogname(), argv[0]);
+		launch_data_free(resp);
+		return 1;
+	}
+
+	fprintf(stdout, "Time\t\t\t\tEvent\t\tPID\tStatus\tReason\n");
+
+	if ((history = launch_data_dict_lookup(resp, LAUNCH_JOBKEY_HISTORY))) {
+		c = launch_data_array_get_count(history);
+		for (i = 0; i < c; i++) {
+			char tbuf[32] = "-";
+			long long when = 0;
+			struct tm tm;
+			time_t secs;
+
+			entry = launch_data_array_get_index(history, i);
+
+			if ((tmp = launch_data_dict_lookup(entry, LAUNCH_JOBHISTORY_TIMESTAMP))) {
+				when = launch_data_get_integer(tmp);
+				secs = (time_t)(when / USEC_PER_SEC);
+				if (localtime_r(&secs, &tm)) {
+					strftime(tbuf, sizeof(tbuf), "%F %T", &tm);
+				}
+			}
+			fprintf(stdout, "%s.%06lld\t", tbuf, when % USEC_PER_SEC);
+
+			tmp = launch_data_dict_lookup(entry, LAUNCH_JOBHISTORY_EVENT);
+			fprintf(stdout, "%-12s\t", tmp ? launch_data_get_string(tmp) : "-");
+
+			if ((tmp = launch_data_dict_lookup(entry, LAUNCH_JOBHISTORY_PID))) {
+				fprintf(stdout, "%lld\t", launch_data_get_integer(tmp));
+			} else {
+				fprintf(stdout, "-\t");
+			}
+
+			if ((tmp = launch_data_dict_lookup(entry, LAUNCH_JOBHISTORY_STATUS))) {
+				fprintf(stdout, "%lld\t", launch_data_get_integer(tmp));
+			} else {
+				fprintf(stdout, "-\t");
+			}
+
+			tmp = launch_data_dict_lookup(entry, LAUNCH_JOBHISTORY_REASON);
+			fprintf(stdout, "%s\n", tmp ? launch_data_get_string(tmp) : "-");
+		}
+	}
+
+	launch_data_free(resp);
+
+	return 0;
+}
+
 int
 stdio_cmd(int argc __attribute__((unused)), char *const argv[])
 {
@@ -3646,6 +3912,8 @@ _bslist_cmd(mach_port_t bport, unsigned int depth, bool show_job, bool local_onl
 	name_array_t service_jobs;
 	mach_msg_type_number_t service_cnt, service_jobs_cnt, service_active_cnt;
 	bootstrap_status_array_t service_actives;
+	boolean_t more = false;
+	name_t prefix = "", after = "", after_job = "";
 	unsigned int i;
 
 	if (bport == MACH_PORT_NULL) {
@@ -3655,21 +3923,39 @@ _bslist_cmd(mach_port_t bport, unsigned int depth, bool show_job, bool local_onl
 
 	uint64_t flags = 0;
 	flags |= local_only ? BOOTSTRAP_FORCE_LOCAL : 0;
-	result = bootstrap_info(bport, &service_names, &service_cnt, &service_jobs, &service_jobs_cnt, &service_actives, &service_active_cnt, flags);
-	if (result != BOOTSTRAP_SUCCESS) {
-		launchctl_log(LOG_ERR, "bootstrap_info(): %d", result);
-		return 1;
-	}
 
 #define bport_state(x)	(((x) == BOOTSTRAP_STATUS_ACTIVE) ? "A" : ((x) == BOOTSTRAP_STATUS_ON_DEMAND) ? "D" : "I")
 
-	for (i = 0; i < service_cnt ; i++) {
-		if (!show_job) {
-			fprintf(stdout, "%*s%-3s%s\n", depth, "", bport_state((service_actives[i])), service_names[i]);
+	do {
+		result = bootstrap_info_page(bport, prefix, after, after_job, 512, &service_names, &service_cnt, &service_jobs, &service_jobs_cnt, &service_actives, &service_active_cnt, &more, flags);
+		if (result == MIG_BAD_ID && after[0] == '\0') {
+			// Older launchd. Fetch everything at once.
+			more = false;
+			result = bootstrap_info(bport, &service_names, &service_cnt, &service_jobs, &service_jobs_cnt, &service_actives, &service_active_cnt, flags);
+		}
+		if (result != BOOTSTRAP_SUCCESS) {
+			launchctl_log(LOG_ERR, "bootstrap_info(): %d", result);
+			return 1;
+		}
+
+		for (i = 0; i < service_cnt ; i++) {
+			if (!show_job) {
+				fprintf(stdout, "%*s%-3s%s\n", depth, "", bport_state((service_actives[i])), service_names[i]);
+			} else {
+				fprintf(stdout, "%*s%-3s%s (%s)\n", depth, "", bport_state((service_actives[i])), service_names[i], service_jobs[i]);
+			}
+		}
+
+		if (service_cnt) {
+			strlcpy(after, service_names[service_cnt - 1], sizeof(after));
+			strlcpy(after_job, service_jobs[service_cnt - 1], sizeof(after_job));
+			(void)vm_deallocate(mach_task_self(), (vm_address_t)service_names, service_cnt * sizeof(service_names[0]));
+			(void)vm_deallocate(mach_task_self(), (vm_address_t)service_jobs, service_jobs_cnt * sizeof(service_jobs[0]));
+			(void)vm_deallocate(mach_task_self(), (vm_address_t)service_actives, service_active_cnt * sizeof(service_actives[0]));
 		} else {
-			fprintf(stdout, "%*s%-3s%s (%s)\n", depth, "", bport_state((service_actives[i])), service_names[i], service_jobs[i]);
+			more = false;
 		}
-	}
+	} while (more);
 
 	return 0;
 }
@@ -3706,6 +3992,114 @@ bslist_cmd(int argc, char *const argv[])
 	return _bslist_cmd(bport, 0, show_jobs, false);
 }
 
+const char *
+bsprops2type(bootstrap_property_t props)
+{
+	const char *type = NULL;
+	if (props & BOOTSTRAP_PROPERTY_PERUSER) {
+		type = "Per-user";
+	} else if (props & BOOTSTRAP_PROPERTY_EXPLICITSUBSET) {
+		type = "Explicit Subset";
+	} else if (props & BOOTSTRAP_PROPERTY_IMPLICITSUBSET) {
+		type = "Implicit Subset";
+	} else if (props & BOOTSTRAP_PROPERTY_MOVEDSUBSET) {
+		type = "Moved Subset";
+	} else if (props & BOOTSTRAP_PROPERTY_XPC_SINGLETON) {
+		type = "XPC Singleton Domain";
+	} else if (props & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
+		type = "XPC Private Domain";
+	} else {
+		type = "Unknown";
+	}
+
+	return type;
+}
+
+void
+_bstree_print_node(launch_data_t node, mach_port_array_t ports, mach_msg_type_number_t port_cnt, unsigned int depth, bool show_jobs)
+{
+	launch_data_t services = launch_data_dict_lookup(node, BOOTSTRAP_TREE_SERVICES);
+	launch_data_t children = launch_data_dict_lookup(node, BOOTSTRAP_TREE_CHILDREN);
+	size_t i = 0;
+
+	for (i = 0; services && i < launch_data_array_get_count(services); i++) {
+		launch_data_t ms = launch_data_array_get_index(services, i);
+		launch_data_t name = launch_data_dict_lookup(ms, BOOTSTRAP_TREE_SERVICE_NAME);
+		launch_data_t job = launch_data_dict_lookup(ms, BOOTSTRAP_TREE_SERVICE_JOB);
+		launch_data_t status = launch_data_dict_lookup(ms, BOOTSTRAP_TREE_SERVICE_STATUS);
+		if (!name || !job || !status) {
+			continue;
+		}
+
+		const char *state = bport_state(launch_data_get_integer(status));
+		if (!show_jobs) {
+			fprintf(stdout, "%*s%-3s%s\n", depth, "", state, launch_data_get_string(name));
+		} else {
+			fprintf(stdout, "%*s%-3s%s (%s)\n", depth, "", state, launch_data_get_string(name), launch_data_get_string(job));
+		}
+	}
+
+	for (i = 0; children && i < launch_data_array_get_count(children); i++) {
+		launch_data_t child = launch_data_array_get_index(children, i);
+		launch_data_t name = launch_data_dict_lookup(child, BOOTSTRAP_TREE_NAME);
+		launch_data_t props = launch_data_dict_lookup(child, BOOTSTRAP_TREE_PROPERTIES);
+		launch_data_t pidx = launch_data_dict_lookup(child, BOOTSTRAP_TREE_PORTINDEX);
+		if (!name || !props) {
+			continue;
+		}
+
+		fprintf(stdout, "%*s%s (%s)/\n", depth, "", launch_data_get_string(name), bsprops2type((bootstrap_property_t)launch_data_get_integer(props)));
+		if (pidx) {
+			long long idx = launch_data_get_integer(pidx);
+			if (idx >= 0 && idx < port_cnt && ports[idx] != MACH_PORT_NULL) {
+				_bstree_snapshot_cmd(ports[idx], depth + 4, show_jobs);
+			}
+		} else {
+			_bstree_print_node(child, ports, port_cnt, depth + 4, show_jobs);
+		}
+	}
+}
+
+/* Renders the tree under bsport from a single snapshot. Only per-user launchds
+ * cost an additional round trip, since they live in separate processes.
+ */
+int
+_bstree_snapshot_cmd(mach_port_t bsport, unsigned int depth, bool show_jobs)
+{
+	launch_data_t tree = NULL;
+	mach_port_array_t ports = NULL;
+	mach_msg_type_number_t port_cnt = 0;
+
+	kern_return_t kr = bootstrap_lookup_tree(bsport, &tree, &ports, &port_cnt);
+	if (kr == MIG_BAD_ID) {
+		// An older launchd. Walk the tree the slow way.
+		return _bstree_cmd(bsport, depth, show_jobs);
+	} else if (kr != BOOTSTRAP_SUCCESS) {
+		if (kr == BOOTSTRAP_NOT_PRIVILEGED) {
+			launchctl_log(LOG_ERR, "You must be root to perform this operation.");
+		} else {
+			launchctl_log(LOG_ERR, "bootstrap_lookup_tree(): %d", kr);
+		}
+
+		return 1;
+	}
+
+	_bstree_print_node(tree, ports, port_cnt, depth, show_jobs);
+	launch_data_free(tree);
+
+	if (ports) {
+		mach_msg_type_number_t i = 0;
+		for (i = 0; i < port_cnt; i++) {
+			if (ports[i] != MACH_PORT_NULL) {
+				(void)mach_port_deallocate(mach_task_self(), ports[i]);
+			}
+		}
+		mig_deallocate((vm_address_t)ports, port_cnt * sizeof(ports[0]));
+	}
+
+	return 0;
+}
+
 int
 _bstree_cmd(mach_port_t bsport, unsigned int depth, bool show_jobs)
 {
@@ -3734,24 +4128,7 @@ _bstree_cmd(mach_port_t bsport, unsigned int depth, bool show_jobs)
 	_bslist_cmd(bsport, depth, show_jobs, true);
 
 	for (i = 0; i < cnt; i++) {
-		char *type = NULL;
-		if (child_props[i] & BOOTSTRAP_PROPERTY_PERUSER) {
-			type = "Per-user";
-		} else if (child_props[i] & BOOTSTRAP_PROPERTY_EXPLICITSUBSET) {
-			type = "Explicit Subset";
-		} else if (child_props[i] & BOOTSTRAP_PROPERTY_IMPLICITSUBSET) {
-			type = "Implicit Subset";
-		} else if (child_props[i] & BOOTSTRAP_PROPERTY_MOVEDSUBSET) {
-			type = "Moved Subset";
-		} else if (child_props[i] & BOOTSTRAP_PROPERTY_XPC_SINGLETON) {
-			type = "XPC Singleton Domain";
-		} else if (child_props[i] & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
-			type = "XPC Private Domain";
-		} else {
-			type = "Unknown";
-		}
-
-		fprintf(stdout, "%*s%s (%s)/\n", depth, "", child_names[i], type);
+		fprintf(stdout, "%*s%s (%s)/\n", depth, "", child_names[i], bsprops2type(child_props[i]));
 		if (child_ports[i] != MACH_PORT_NULL) {
 			_bstree_cmd(child_ports[i], depth + 4, show_jobs);
 		}
@@ -3781,7 +4158,7 @@ bstree_cmd(int argc, char * const argv[])
 		fprintf(stdout, "System/\n");
 	}
 
-	return _bstree_cmd(str2bsport("/"), 4, show_jobs);
+	return _bstree_snapshot_cmd(str2bsport("/"), 4, show_jobs);
 }
 
 int